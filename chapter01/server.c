@@ -31,6 +31,7 @@
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>                    /* writev, struct iovec */
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
@@ -215,52 +216,80 @@ accept_loop(int soc)
     }
 }
 
-/* サイズ指定文字列連結（strlcat 相当）
+/* 応答の末尾に付ける文字列（受信時にこの分の tailroom を残しておく） */
+#define RESP_SUFFIX     ":OK\r\n"
+#define RESP_SUFFIX_LEN (sizeof(RESP_SUFFIX) - 1)
+
+/* 長さ付きバッファ（応答組み立て用）
  *
- * 目的：
- * - dst のバッファサイズ size を超えないように src を末尾に連結する
- * - 返り値は「連結しようとした後の総文字数」（切り詰めが起きたかの判断に使える）
+ * base[0 .. size) の中で、データは base[off .. off+len) にある。
+ *
+ *   base                off            off+len                 size
+ *    |<-- headroom -->|<---- data ---->|<---- tailroom ---->|
  *
- * なぜ必要？
- * - strcat はバッファ境界を知らないので危険（バッファオーバーフロー）
- * - snprintf を使うのが一般的だが、教材として strlcat の実装を載せている形
+ * mystrlcat + strlen との違い：
+ * - 長さを持っているので、連結のたびに NUL を探して先頭から数え直さない（O(1) で追記）
+ * - NUL 終端を必要としないので、recv したバイト列をそのまま扱える
+ * - 先頭側にも空き（headroom）を取れるので、ヘッダ等を後から前に付けられる
+ * - データ部をそのまま iovec にして writev に渡せる
  */
-size_t
-mystrlcat(char *dst, const char *src, size_t size)
+struct mbuf {
+    char *base;                         /* 領域の先頭 */
+    size_t size;                        /* 領域の大きさ */
+    size_t off;                         /* データの開始位置 */
+    size_t len;                         /* データ長 */
+};
+
+#define MBUF_DATA(m_)     ((m_)->base + (m_)->off)
+#define MBUF_TAIL(m_)     ((m_)->base + (m_)->off + (m_)->len)
+#define MBUF_HEADROOM(m_) ((m_)->off)
+#define MBUF_TAILROOM(m_) ((m_)->size - (m_)->off - (m_)->len)
+
+/* 領域 base[0..size) を、先頭に headroom バイト空けた空のバッファとして使い始める */
+void
+mbuf_init(struct mbuf *m, char *base, size_t size, size_t headroom)
 {
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
-    
-    /* dst の現在長を数える（最大 size まで）
-     * lest は残りバイト数カウンタ。
-     */
-    for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--);
-    dlen = (size_t)(pd - dst);
+    m->base = base;
+    m->size = size;
+    m->off = headroom < size ? headroom : size;
+    m->len = 0;
+}
 
-    /* dst が size いっぱいで終端していない場合（= 既に満杯） */
-    if (size - dlen == 0) {
-        return (dlen + strlen(src)); /* 連結したかった長さを返す（切り詰め検出用） */
+/* 末尾に n バイト追記する（tailroom が足りなければ何もせず -1） */
+int
+mbuf_append(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_TAILROOM(m)) {
+        return (-1);
     }
+    (void) memcpy(MBUF_TAIL(m), src, n);
+    m->len += n;
+    return (0);
+}
 
-    /* pde は「書き込み可能な最後の位置（終端 '\0' 用に1バイト残す）」 */
-    pde = dst + size - 1;
-
-    /* src を詰められるだけコピー */
-    for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
+/* 先頭に n バイト付け足す（headroom が足りなければ何もせず -1） */
+int
+mbuf_prepend(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_HEADROOM(m)) {
+        return (-1);
     }
+    m->off -= n;
+    m->len += n;
+    (void) memcpy(MBUF_DATA(m), src, n);
+    return (0);
+}
 
-    /* 必ず終端NULで埋める（pd〜pde） */
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
+/* データ部を iovec に変換する（戻り値は writev に渡す要素数） */
+int
+mbuf_iov(const struct mbuf *m, struct iovec *iov)
+{
+    if (m->len == 0) {
+        return (0);
     }
-
-    /* ps を最後まで進めて「本来の src 長」を確定する */
-    while (*ps++);
-
-    /* dst元の長さ + srcの長さ（実際に入った長さではなく、入れようとした長さ） */
-    return (dlen + (size_t)(ps - src - 1));
+    iov[0].iov_base = MBUF_DATA(m);
+    iov[0].iov_len = m->len;
+    return (1);
 }
 
 /* 送受信ループ
@@ -270,17 +299,25 @@ mystrlcat(char *dst, const char *src, size_t size)
  * - クライアントが「1行」を送る（末尾に \r\n か \n が来る想定）
  * - サーバは受け取った文字列に ":OK\r\n" を付けて返す
  *
- * TCPの性質上、recv 1回で1行が来る保証はないが、簡略化している。
+ * TCPの性質上、recv 1回で1行が来る保証はない（1 回に複数の行が入ることも、
+ * 1 行が何回かに分かれて届くこともある）ので、改行の届いていない行の途中は
+ * 次の recv まで持ち越し、行ごとに応答する。
  */
 void
 send_recv_loop(int acc)
 {
-    char buf[512], *ptr;
+    char buf[512];
+    struct mbuf m;
+    struct iovec iov[2];
+    size_t end, start, e;
     ssize_t len;
+    int cr;
 
+    /* 受信バッファを空にする（行の途中は先頭に詰めて次の recv まで持ち越す） */
+    mbuf_init(&m, buf, sizeof(buf), 0);
+    cr = 0;
     for (;;) {
-
-        /* 受信：
+        /* 受信（持ち越した行の途中の後ろに読む）：
          * - 第4引数 flags=0 で通常受信
          * - 戻り値 len:
          *   >0: 受け取ったバイト数
@@ -290,7 +327,8 @@ send_recv_loop(int acc)
          * 注意：ここはブロッキングrecv。
          * 相手が送らない限りここで止まる。
          */
-        if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
+        if ((len = recv(acc, MBUF_TAIL(&m),
+                        MBUF_TAILROOM(&m), 0)) == -1) {
             /* エラー */
             perror("recv");
             break;
@@ -299,50 +337,54 @@ send_recv_loop(int acc)
         if (len == 0) {
             /* 相手が接続を閉じた（EOF） */
             (void) fprintf(stderr, "recv:EOF\n");
-            break;
-        }
-
-        /* 文字列化・表示
-         *
-         * !!! 重要なバグ注意 !!!
-         * recv は最大 sizeof(buf) バイト受け取る可能性がある。
-         * そのとき len == 512 となり、buf[512] = '\0' は境界外アクセス。
-         *
-         * 安全にするなら：
-         * - recv のサイズを sizeof(buf)-1 にする
-         *   例: recv(acc, buf, sizeof(buf)-1, 0)
-         * が定番。
-         */
-        buf[len] = '\0';
+            /* 改行の届かなかった最後の行にも応答する */
+            end = m.len;
+        } else {
+            m.len += (size_t) len;
 
-        /* 改行（\r か \n）があればそこで文字列を切る
-         * strpbrk は「指定文字集合のどれかに最初にマッチする位置」を返す
-         */
-        if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-            *ptr = '\0';
+            /* 最後の区切り（\r か \n）までに応答し、後ろ（改行の届いていない行の途中）は持ち越す
+             * 改行の無いまま buf が一杯なら、全部を 1 行とする
+             */
+            for (end = m.len; end > 0 && buf[end - 1] != '\r' && buf[end - 1] != '\n'; end--) {
+                ;
+            }
+            if (end == 0 && MBUF_TAILROOM(&m) == 0) {
+                end = m.len;
+            }
         }
 
-        (void) fprintf(stderr, "[client]%s\n", buf);
-
-        /* 応答文字列作成：
-         * 受け取った buf の末尾に ":OK\r\n" を付ける
-         * mystrlcat を使うことでバッファサイズを超えないようにする
+        /* 1 行ずつ表示し、行ごとに ":OK\r\n" を付けて返す（続けて届いた要求にもそれぞれ返す）
+         * - 区切りは \r / \n / \r\n（recv の境目で分かれた \r\n も 1 つの区切り）
+         * - 応答は行と ":OK\r\n" を iovec で並べて送る（buf に書き足さない）
          */
-        (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-
-        /* send するサイズは NUL までの長さ（strlen） */
-        len = (ssize_t) strlen(buf);
-
-        /* 応答送信：
-         * send も部分送信があり得る（戻り値が要求サイズより小さい可能性）。
-         * このコードは教材的に1回で送れる前提に寄っている。
-         * 堅牢化するなら「全部送るまでループ」が必要。
-         */
-        if ((len = send(acc, buf, (size_t) len, 0)) == -1) {
-            /* エラー */
-            perror("send");
+        for (start = 0; start < end; start = e + 1) {
+            for (e = start; e < end && buf[e] != '\r' && buf[e] != '\n'; e++) {
+                ;
+            }
+            if (e == start && e < end && buf[e] == '\n' && (e > 0 ? buf[e - 1] == '\r' : cr)) {
+                /* \r\n の \n */
+                continue;
+            }
+            (void) fprintf(stderr, "[client]%.*s\n", (int) (e - start), buf + start);
+            iov[0].iov_base = buf + start;
+            iov[0].iov_len = e - start;
+            iov[1].iov_base = RESP_SUFFIX;
+            iov[1].iov_len = RESP_SUFFIX_LEN;
+            if (writev(acc, iov, 2) == -1) {
+                perror("writev");
+                len = -1;
+                break;
+            }
+        }
+        if (len <= 0) {
+            /* EOF / 応答を送れなかった */
             break;
         }
+        cr = end == m.len && end > 0 && buf[end - 1] == '\r';
+
+        /* 行の途中を先頭に詰める */
+        m.len -= end;
+        (void) memmove(buf, buf + end, m.len);
     }
 }
 
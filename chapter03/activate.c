@@ -0,0 +1,305 @@
+/*
+ * activate: ソケットアクティベーションのスーパーバイザ役 兼 起動時間の計測ツール
+ *
+ * 目的：
+ * - systemd 等がやっている「listen ソケットを先に開いてからサーバを起動する」を最小限で再現し、
+ *   サーバ（server1 / daemon）の LISTEN_FDS 対応と READY 通知を試せるようにする
+ * - 「起動してから最初の接続に応答するまで」（cold start → first accept）の時間を
+ *   従来の起動（サーバ自身が bind）と比べる
+ *
+ * 使い方：
+ *   activate bind|socket port rounds prog [args...]
+ *     - bind   : 従来どおりサーバ自身に bind させる（比較の基準）
+ *                クライアントは ECONNREFUSED の間 connect をやり直す
+ *     - socket : activate が port を listen してから起動し、FD 3 として渡す
+ *                （LISTEN_PID / LISTEN_FDS を設定。connect は起動直後から成功する）
+ *     - rounds : 起動 → 計測 → SIGTERM で停止 を繰り返す回数
+ *     - prog   : 起動するサーバ（例 ./server1 127.0.0.1 20041）
+ *
+ * 計測内容（1 回ごと、最後に平均 / 最小 / 最大）：
+ * - ready : fork から NOTIFY_SOCKET に READY=1 が届くまで
+ * - first : fork から最初の接続の応答（1 行）を受け取るまで
+ * - retry : bind モードで connect が拒否された回数（起動の隙間に来た接続が失う分）
+ *
+ * 注意：
+ * - サーバは 1 行受け取ったら応答を返すもの（server1 の echo）を想定している
+ * - NOTIFY_SOCKET は /tmp/activate.<pid> に作る（終了時に消す）
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+/* 応答・READY を待つ上限（ミリ秒） */
+#define WAIT_MS         5000
+
+/* connect をやり直す間隔（マイクロ秒） */
+#define RETRY_US        100
+
+/* 単調増加時計の現在値（マイクロ秒） */
+static double
+now_us(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec * 1e6 + (double) ts.tv_nsec / 1e3);
+}
+
+/* 127.0.0.1:port で listen するソケットを作る（socket モードで渡す側） */
+static int
+listen_socket(int port)
+{
+    struct sockaddr_in sin;
+    int soc, opt;
+
+    if ((soc = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        perror("socket");
+        return (-1);
+    }
+    opt = 1;
+    (void) setsockopt(soc, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    (void) memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons((unsigned short) port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(soc, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+        perror("bind");
+        (void) close(soc);
+        return (-1);
+    }
+    if (listen(soc, SOMAXCONN) == -1) {
+        perror("listen");
+        (void) close(soc);
+        return (-1);
+    }
+    return (soc);
+}
+
+/* NOTIFY_SOCKET 用のデータグラムソケットを path に作る */
+static int
+notify_socket(const char *path)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket(AF_UNIX)");
+        return (-1);
+    }
+    (void) memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    (void) snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+    (void) unlink(path);
+    if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
+        perror("bind(AF_UNIX)");
+        (void) close(fd);
+        return (-1);
+    }
+    return (fd);
+}
+
+/* READY=1 が届いていれば 1（届くまで待たない / timeout_ms だけ待つ） */
+static int
+poll_ready(int nfd, int timeout_ms)
+{
+    struct pollfd pfd;
+    char buf[256];
+    ssize_t len;
+
+    pfd.fd = nfd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout_ms) <= 0) {
+        return (0);
+    }
+    if ((len = recv(nfd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) <= 0) {
+        return (0);
+    }
+    buf[len] = '\0';
+    return (strncmp(buf, "READY=1", 7) == 0 || strstr(buf, "\nREADY=1") != NULL);
+}
+
+/* サーバを 1 回起動して ready / first を計る
+ *
+ * アルゴリズム：
+ * 1) fork 直前の時刻を t0 とする
+ * 2) 子：socket モードなら listen ソケットを FD 3 に置き、LISTEN_PID=自分 / LISTEN_FDS=1 を設定、
+ *        NOTIFY_SOCKET を設定して exec
+ * 3) 親：connect（拒否されたら RETRY_US 待ってやり直す）→ 1 行送る → 応答を待つ
+ *        その間も NOTIFY_SOCKET を覗き、READY が届いた時刻を記録する
+ * 4) SIGTERM で止めて回収
+ */
+static int
+spawn_once(int lsoc, int nfd, const char *npath, int port, char *argv[],
+           double *ready, double *first, long *retry)
+{
+    struct sockaddr_in sin;
+    struct pollfd pfd;
+    char buf[512], nbuf[32];
+    double t0, deadline;
+    pid_t pid;
+    int soc, status;
+
+    *ready = *first = -1.0;
+    *retry = 0;
+    while (poll_ready(nfd, 0)) {
+        /* 前回の残りを捨てる */
+    }
+
+    t0 = now_us();
+    if ((pid = fork()) == -1) {
+        perror("fork");
+        return (-1);
+    }
+    if (pid == 0) {
+        if (lsoc != -1) {
+            if (lsoc != 3) {
+                (void) dup2(lsoc, 3);
+                (void) close(lsoc);
+            }
+            (void) snprintf(nbuf, sizeof(nbuf), "%ld", (long) getpid());
+            (void) setenv("LISTEN_PID", nbuf, 1);
+            (void) setenv("LISTEN_FDS", "1", 1);
+        }
+        (void) setenv("NOTIFY_SOCKET", npath, 1);
+        (void) execvp(argv[0], argv);
+        perror("execvp");
+        _exit(EX_UNAVAILABLE);
+    }
+
+    (void) memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons((unsigned short) port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    deadline = t0 + WAIT_MS * 1e3;
+
+    /* connect（bind モードではサーバが listen するまで拒否される） */
+    for (;;) {
+        if (*ready < 0 && poll_ready(nfd, 0)) {
+            *ready = now_us() - t0;
+        }
+        if ((soc = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+            perror("socket");
+            goto done;
+        }
+        if (connect(soc, (struct sockaddr *) &sin, sizeof(sin)) == 0) {
+            break;
+        }
+        (void) close(soc);
+        if (errno != ECONNREFUSED || now_us() > deadline) {
+            perror("connect");
+            goto done;
+        }
+        (*retry)++;
+        (void) usleep(RETRY_US);
+    }
+
+    /* 1 行送って、応答と READY の両方を待つ */
+    (void) send(soc, "hello\r\n", 7, MSG_NOSIGNAL);
+    pfd.fd = soc;
+    pfd.events = POLLIN;
+    while (*first < 0 && now_us() < deadline) {
+        if (*ready < 0 && poll_ready(nfd, 0)) {
+            *ready = now_us() - t0;
+        }
+        if (poll(&pfd, 1, 1) > 0) {
+            if (recv(soc, buf, sizeof(buf), 0) > 0) {
+                *first = now_us() - t0;
+            }
+            break;
+        }
+    }
+    (void) close(soc);
+    if (*ready < 0 && poll_ready(nfd, (int) ((deadline - now_us()) / 1e3))) {
+        *ready = now_us() - t0;
+    }
+
+done:
+    (void) kill(pid, SIGTERM);
+    (void) waitpid(pid, &status, 0);
+    return (*first < 0 ? -1 : 0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    double ready, first, rsum, rmin, rmax, fsum, fmin, fmax;
+    long retry, rtsum;
+    char npath[64];
+    int port, rounds, lsoc, nfd, i, nready, nok;
+
+    if (argc <= 4 || (strcmp(argv[1], "bind") != 0 && strcmp(argv[1], "socket") != 0)) {
+        (void) fprintf(stderr, "activate bind|socket port rounds prog [args...]\n");
+        return (EX_USAGE);
+    }
+    port = atoi(argv[2]);
+    if ((rounds = atoi(argv[3])) <= 0) {
+        rounds = 1;
+    }
+
+    /* socket モード：サーバより先に listen しておく（全ラウンドで同じソケットを渡し続ける） */
+    lsoc = -1;
+    if (strcmp(argv[1], "socket") == 0 && (lsoc = listen_socket(port)) == -1) {
+        return (EX_UNAVAILABLE);
+    }
+    (void) snprintf(npath, sizeof(npath), "/tmp/activate.%ld", (long) getpid());
+    if ((nfd = notify_socket(npath)) == -1) {
+        return (EX_UNAVAILABLE);
+    }
+
+    rsum = fsum = 0.0;
+    rmin = fmin = 1e18;
+    rmax = fmax = 0.0;
+    rtsum = 0;
+    nready = nok = 0;
+    for (i = 0; i < rounds; i++) {
+        if (spawn_once(lsoc, nfd, npath, port, &argv[4], &ready, &first, &retry) == -1) {
+            (void) fprintf(stderr, "round %d:no reply\n", i);
+            continue;
+        }
+        nok++;
+        fsum += first;
+        fmin = first < fmin ? first : fmin;
+        fmax = first > fmax ? first : fmax;
+        rtsum += retry;
+        if (ready >= 0) {
+            nready++;
+            rsum += ready;
+            rmin = ready < rmin ? ready : rmin;
+            rmax = ready > rmax ? ready : rmax;
+        }
+    }
+
+    (void) printf("mode=%s rounds=%d ok=%d\n", argv[1], rounds, nok);
+    if (nok > 0) {
+        (void) printf("first : avg %8.1f us  min %8.1f  max %8.1f  retry/round %.1f\n",
+                      fsum / nok, fmin, fmax, (double) rtsum / nok);
+    }
+    if (nready > 0) {
+        (void) printf("ready : avg %8.1f us  min %8.1f  max %8.1f  (%d/%d notified)\n",
+                      rsum / nready, rmin, rmax, nready, nok);
+    } else {
+        (void) printf("ready : no READY=1 received\n");
+    }
+
+    (void) close(nfd);
+    (void) unlink(npath);
+    if (lsoc != -1) {
+        (void) close(lsoc);
+    }
+    return (nok == rounds ? EX_OK : EX_SOFTWARE);
+}
@@ -19,31 +19,179 @@
  * - nochdir : 0なら chdir("/") する、1ならしない
  * - noclose : 0なら FD close と /dev/null 付け替えをする、1ならしない
  *
+ * ソケットアクティベーションと起動の速さ（追加）：
+ * - listen_fds()   : スーパーバイザ（systemd 等）が先に開いて渡した listen ソケットを受け取る
+ *                    （LISTEN_PID / LISTEN_FDS 規約。FD は 3 番から連続して並んでいる）
+ *                    → サーバは bind し直さず、起動した瞬間から accept できる
+ *                    （起動前に来た接続もバックログに溜まっている）
+ * - close_fds_from : FD を 1 本ずつ close するのをやめ、close_range(2) で一度に閉じる
+ *                    （使えない古いカーネルでは /proc/self/fd に実在する FD だけを閉じる）
+ *                    daemonize は listen_fds() で受け取った FD を閉じずに残す
+ * - notify_ready() : 準備完了を NOTIFY_SOCKET（Unix ドメインのデータグラム）で知らせる
+ *                    （"READY=1" を送る sd_notify 規約）
+ *
  * 注意（実務上の改善ポイント）：
- * - MAXFD=64 は固定値で雑。実際は getrlimit(RLIMIT_NOFILE) 等で上限を取得して閉じるのが一般的
  * - signal() より sigaction() を使う方が正確で推奨
  * - umask(0) を入れる実装も多い（ファイル作成権限を制御）
  * - syslog を使うのがデーモンの定番（標準出力は閉じるため）
  */
 
 #include <sys/types.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>                /* SYS_close_range */
+#include <sys/un.h>                     /* NOTIFY_SOCKET（sockaddr_un） */
 
+#include <dirent.h>                     /* /proc/self/fd の列挙 */
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sysexits.h>
 #include <unistd.h>
 
-/* クローズする最大ディスクリプタ値（簡易版）
+/* 受け取った listen ソケットの先頭 FD 番号（LISTEN_FDS 規約で 3 固定） */
+#define LISTEN_FDS_START 3
+
+/* listen_fds() で受け取った listen ソケットの数（daemonize はこの分を閉じずに残す） */
+int g_listen_nfds = 0;
+
+/* スーパーバイザから渡された listen ソケットを受け取る
  *
- * 目的：
- * - デーモン化時に、親プロセスから引き継いだファイルディスクリプタ（FD）を全部閉じたい
- * - ただし本来は OS の FD 上限を取得してそれまで閉じるべき
- * - ここでは教材的に 0..63 を閉じる簡略化をしている
+ * 戻り値：渡された FD の数（FD は LISTEN_FDS_START から連続） / 0（渡されていない）
+ *
+ * 規約（LISTEN_PID / LISTEN_FDS）：
+ * - LISTEN_PID : FD を渡した相手の PID。自分の PID と違えば、親から環境変数だけ
+ *                引き継いだ別プロセスなので使わない
+ * - LISTEN_FDS : 渡した FD の数
+ * unset_environment が真なら環境変数を消す（子プロセスに誤って伝わらないように）。
+ * 受け取った FD には FD_CLOEXEC を付ける（exec する子に持ち越さない）。
+ *
+ * 注意：LISTEN_PID を見るので、daemonize（fork する）より前に呼ぶこと。
  */
-#define MAXFD   64
+int
+listen_fds(int unset_environment)
+{
+    const char *e;
+    char *end;
+    long pid, n;
+    int fd;
+
+    n = 0;
+    if ((e = getenv("LISTEN_PID")) == NULL) {
+        goto out;
+    }
+    pid = strtol(e, &end, 10);
+    if (*e == '\0' || *end != '\0' || pid != (long) getpid()) {
+        goto out;
+    }
+    if ((e = getenv("LISTEN_FDS")) == NULL) {
+        goto out;
+    }
+    n = strtol(e, &end, 10);
+    if (*e == '\0' || *end != '\0' || n <= 0 || n > INT_MAX - LISTEN_FDS_START) {
+        n = 0;
+        goto out;
+    }
+    for (fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + (int) n; fd++) {
+        (void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+out:
+    if (unset_environment) {
+        (void) unsetenv("LISTEN_PID");
+        (void) unsetenv("LISTEN_FDS");
+        (void) unsetenv("LISTEN_FDNAMES");
+    }
+    g_listen_nfds = (int) n;
+    return ((int) n);
+}
+
+/* lowfd 以上の FD をすべて閉じる
+ *
+ * アルゴリズム：
+ * 1) close_range(lowfd, ~0U, 0)（Linux 5.9 以降）：システムコール 1 回で全部閉じる
+ * 2) 使えなければ /proc/self/fd を列挙し、実際に開いている FD だけを閉じる
+ *    （列挙に使っているディレクトリの FD 自身は閉じない）
+ * 3) /proc も無ければ、FD の上限（sysconf(_SC_OPEN_MAX)）まで 1 本ずつ閉じる
+ *
+ * 上限まで 1 本ずつ閉じる方法は、上限が大きい（数十万〜百万）環境では
+ * それだけで起動が目に見えて遅くなる。
+ */
+void
+close_fds_from(int lowfd)
+{
+    struct dirent *de;
+    DIR *dir;
+    long fd, max;
+    char *end;
+
+#ifdef SYS_close_range
+    if (syscall(SYS_close_range, (unsigned int) lowfd, ~0U, 0) == 0) {
+        return;
+    }
+#endif
+    if ((dir = opendir("/proc/self/fd")) != NULL) {
+        while ((de = readdir(dir)) != NULL) {
+            fd = strtol(de->d_name, &end, 10);
+            if (de->d_name[0] == '.' || *end != '\0') {
+                continue;
+            }
+            if (fd >= lowfd && fd != dirfd(dir)) {
+                (void) close((int) fd);
+            }
+        }
+        (void) closedir(dir);
+        return;
+    }
+    if ((max = sysconf(_SC_OPEN_MAX)) <= 0) {
+        max = 1024;
+    }
+    for (fd = lowfd; fd < max; fd++) {
+        (void) close((int) fd);
+    }
+}
+
+/* 準備完了を通知する（NOTIFY_SOCKET / sd_notify 規約）
+ *
+ * state : 送る文字列（例 "READY=1"）
+ * 戻り値: 1（送った） / 0（NOTIFY_SOCKET が無い = 通知先なし） / -1（失敗）
+ *
+ * - NOTIFY_SOCKET は Unix ドメインのデータグラムソケットのパス
+ *   （先頭が '@' なら抽象名前空間：sun_path の先頭を NUL にする）
+ * - 1 回 sendto するだけなので、通知先が居なくてもサーバの動作には影響しない
+ */
+int
+notify_ready(const char *state)
+{
+    struct sockaddr_un sun;
+    const char *path;
+    size_t len;
+    int fd, ret;
+
+    if ((path = getenv("NOTIFY_SOCKET")) == NULL) {
+        return (0);
+    }
+    len = strlen(path);
+    if (len < 2 || len >= sizeof(sun.sun_path) || (path[0] != '/' && path[0] != '@')) {
+        return (-1);
+    }
+    (void) memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    (void) memcpy(sun.sun_path, path, len);
+    if (path[0] == '@') {
+        sun.sun_path[0] = '\0';
+    }
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1) {
+        return (-1);
+    }
+    ret = sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *) &sun,
+                 (socklen_t) (offsetof(struct sockaddr_un, sun_path) + len)) == -1 ? -1 : 1;
+    (void) close(fd);
+    return (ret);
+}
 
 /* デーモン化関数
  *
@@ -58,7 +206,7 @@
 int
 daemonize(int nochdir, int noclose)
 {
-    int i, fd;
+    int fd;
     pid_t pid;
 
     /* 1回目 fork：
@@ -125,12 +273,13 @@ daemonize(int nochdir, int noclose)
      */
     if (noclose == 0) {
 
-        /* すべてのFDを閉じる（簡易：0..MAXFD-1）
-         * 実務では RLIMIT_NOFILE を見て上限まで閉じるのが一般的
+        /* 標準入出力と、listen_fds() で受け取った listen ソケット以外のFDを閉じる
+         * （3 .. 3+g_listen_nfds-1 は残し、その先を close_fds_from でまとめて閉じる）
          */
-        for (i = 0; i < MAXFD; i++) {
-            (void) close(i);
-        }
+        (void) close(0);
+        (void) close(1);
+        (void) close(2);
+        close_fds_from(LISTEN_FDS_START + g_listen_nfds);
 
         /* stdin/stdout/stderr を /dev/null に付け替える
          *
@@ -165,7 +314,8 @@ daemonize(int nochdir, int noclose)
  * - daemonize(0,0) により
  *   - カレントディレクトリが "/" に移動しているか
  *   - 標準入出力が /dev/null に付け替わっているか
- * を確認する
+ *   - LISTEN_FDS で渡された listen ソケットが閉じられずに残っているか
+ * を確認し、最後に NOTIFY_SOCKET へ READY=1 を送る
  */
 #ifdef UNIT_TEST
 #include <syslog.h>
@@ -174,6 +324,10 @@ int
 main(int argc, char *argv[])
 {
     char buf[256];
+    int nfds;
+
+    /* 渡された listen ソケットを受け取る（LISTEN_PID を見るので fork する前に） */
+    nfds = listen_fds(1);
 
     /* デーモン化：
      * - nochdir=0 なので "/" へ chdir する
@@ -193,6 +347,13 @@ main(int argc, char *argv[])
      */
     syslog(LOG_USER | LOG_NOTICE, "daemon:cwd=%s\n", getcwd(buf, sizeof(buf)));
 
+    /* 受け取った listen ソケットが残っているか（fcntl が成功すれば開いている） */
+    syslog(LOG_USER | LOG_NOTICE, "daemon:listen_fds=%d fd3=%s\n", nfds,
+           fcntl(LISTEN_FDS_START, F_GETFD) != -1 ? "open" : "closed");
+
+    /* 準備完了の通知 */
+    (void) notify_ready("READY=1");
+
     return (EX_OK);
 }
 #endif
@@ -17,28 +17,72 @@
  *        recv で受信 → 行末処理 → ":OK\r\n" を付けて send で返す
  *
  * [B] シグナルによる “自己再実行” アルゴリズム
- *   1) main で SIGHUP のハンドラ(sig_hangup_handler)を登録
- *   2) SIGHUP 到来でハンドラが割り込み実行される（非同期イベント）
- *   3) ハンドラが FD を整理（標準入出力以外を close）
+ *   1) main で SIGHUP / SIGTERM / SIGINT を sig_fd_init で「読める FD」に変える
+ *      （signalfd。使えなければ自己パイプ：ハンドラは 1 バイト write するだけ）
+ *   2) accept_loop はその FD と listen ソケットを poll で同時に待ち、
+ *      SIGHUP を「ループのイベント」として受け取る（非同期に割り込まれない）
+ *   3) 接続を持っていない地点で FD を整理（標準入出力以外を close）
  *   4) execve(argv[0], argv, envp) で自分自身を上書き再実行する
+ *   SIGTERM / SIGINT もイベントとして受け取り、listen ソケットを閉じて終了する。
+ *
+ * [C] ホットリスタート（第2引数 hot）
+ *   [B] は listen ソケットも閉じてから exec するので、新しいイメージが server_socket で
+ *   bind し直すまでの間に来た接続は拒否（RST）され、処理中のクライアントも切れる。
+ *   hot モードでは listen ソケットを閉じずに exec の向こうへ持ち越す：
+ *   1) SIGHUP はシグナル FD から読まれ、sig_dispatch がフラグ（g_restart）を立てる
+ *   2) accept_loop が「接続を処理していない地点」でフラグを見て hot_restart() を呼ぶ
+ *      （処理中のクライアントは最後まで相手をしてから再起動する）
+ *   3) hot_restart は listen ソケットの FD 番号を環境変数 RE_EXEC_LISTEN_FD に入れ、
+ *      その FD だけを残して他を閉じ、SIGHUP をブロックしたまま execve する
+ *   4) 新しいイメージは環境変数の FD が listen 中のソケットか確かめて、bind せずにそのまま使う
+ *   listen ソケットは一度も閉じないので、再起動中に届いた SYN はバックログに溜まり、
+ *   新しいイメージが accept する（接続は 1 本も失われない）。
+ *   bench（chapter05）の hammer モードで、SIGHUP を連打しながら接続の失敗数を数えられる。
+ *
+ * [D] 接続ごと引き継ぐアップグレード（第2引数 upgrade）
+ *   [C] は listen ソケットしか持ち越さないので、処理中の接続を抱えたままでは再起動できない。
+ *   upgrade モードは poll で多数の接続を同時に持つサーバとして動き、SIGHUP で：
+ *   1) socketpair（SOCK_SEQPACKET）を作って fork し、子で新しいバイナリを execve する
+ *      （listen ソケットと socketpair の片側だけを FD_CLOEXEC なしで渡す。番号は環境変数）
+ *   2) 古いプロセスは accept をやめ、生きている接続の FD を SCM_RIGHTS で
+ *      最大 HANDOFF_BATCH 本ずつ送る。各接続には「まだ行になっていない受信済みバイト」と
+ *      処理した行数をコンパクトなレコード（struct handoff_rec + データ）にして添える
+ *   3) 新しいプロセスはレコードから接続表を組み立て直し、終わりの印を受けたら 1 バイト返す
+ *   4) 古いプロセスはその返事を受けてから自分の接続を閉じて終了する
+ *      （FD は新しいプロセス側にも開いているので、close しても相手に FIN は出ない）
+ *   カーネルの受信バッファにあるデータは FD と一緒に引き継がれ、アプリのバッファにある
+ *   途中までの行はレコードで渡るので、クライアントからは切断もデータ欠けも見えない。
+ *   bench の upgrade モードで、N 本の接続を持たせたまま SIGHUP して確かめられる。
  *
  * execve の性質：
  * - 成功すると戻らない。現在のプロセスのメモリ空間は新しい実行イメージに差し替わり、
  *   新しい main() が最初から実行される。
  * - fork していないので PID は同一（“再起動”に似るが実体は “自己置換”）
  *
+ * シグナルを FD で受け取る理由：
+ * - 以前はハンドラの中で fprintf/close/execve をしていた（async-signal-safe ではなく、
+ *   accept/recv の最中に FD が消えて EBADF になり得た）
+ * - signalfd ではシグナルはブロックしたまま「キュー」に溜まり、ループが読みに来るまで
+ *   何も割り込まない。recv/accept が EINTR で戻ることも無い
+ * - signalfd はブロック中のシグナルを exec の向こうへ保留したまま持ち越せる
+ *   （再起動中に来た SIGHUP は新しいイメージのシグナル FD から読める）
+ *
  * 重要な注意（教材上の簡略化ポイント）：
- * - signal handler 内の fprintf/perror は async-signal-safe ではない（厳密には危険）
- *   → 実務ではハンドラはフラグを立てるだけにし、メインループ側で安全に exec するのが定石
- * - SA_NODEFER により SIGHUP が再入可能（連打でハンドラが重なる可能性）
- *   → execve と再入は相性が悪いので、実務なら外すのが無難
  * - recv バッファ終端処理に境界外アクセスの可能性（len==512の場合）
  *   → 安全化するなら recv(..., sizeof(buf)-1, ...) が定石
  */
 
+#define _GNU_SOURCE                     /* accept4() / MSG_CMSG_CLOEXEC */
+
 #include <sys/param.h>
+#include <sys/resource.h>               /* RLIMIT_NOFILE（upgrade モード） */
+#ifdef __linux__
+#include <sys/signalfd.h>               /* signalfd（シグナルを FD で受け取る） */
+#endif
 #include <sys/socket.h>
+#include <sys/time.h>                   /* struct timeval（SO_RCVTIMEO） */
 #include <sys/types.h>
+#include <sys/uio.h>                    /* writev, struct iovec */
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
@@ -46,6 +90,10 @@
 #include <netdb.h>
 
 #include <ctype.h>
+#include <poll.h>                       /* upgrade モードの多重化 */
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>                      /* fcntl（FD_CLOEXEC を外す） */
 #include <errno.h>
 #include <signal.h>
 #include <stdio.h>
@@ -66,38 +114,200 @@ void send_recv_loop(int acc);
 
 /* コマンドライン引数、環境変数のアドレス保持用（グローバル）
  *
- * - SIGHUP ハンドラ内で execve(argv[0], argv, envp) を呼びたい
- * - しかしハンドラは main のローカル変数に直接アクセスできない
+ * - legacy_restart / hot_restart で execve(argv[0], argv, envp) を呼びたい
+ * - しかしそれらは main のローカル変数に直接アクセスできない
  * - そこで argv/envp の “アドレス” を保持し、(*argv_)[0] のように間接参照する
  */
 int *argc_;
 char ***argv_;
 char ***envp_;
 
-/* SIGHUP ハンドラ
+/* ホットリスタート（hot モード）用
+ *
+ * - LISTEN_FD_ENV : exec の向こうへ listen ソケットの FD 番号を伝える環境変数
+ * - g_hot         : hot モードなら 1
+ * - g_restart     : SIGHUP で 1 になる（sig_dispatch が立てる）
+ * - g_stop        : SIGTERM / SIGINT で受けたシグナル番号になる（0 = 通常運転）
+ */
+#define LISTEN_FD_ENV "RE_EXEC_LISTEN_FD"
+extern char **environ;
+int g_hot = 0;
+int g_restart = 0;
+int g_stop = 0;
+
+/* シグナルを FD で受け取る（sig_fd_init）
+ *
+ * - g_sig_fd   : signalfd、または自己パイプの読み側（poll で待てる）
+ * - g_sig_pipe : 自己パイプ（signalfd が使えないときだけ使う）
+ */
+int g_sig_fd = -1;
+int g_sig_pipe[2] = { -1, -1 };
+
+/* 接続ごと引き継ぐアップグレード（upgrade モード）用
+ *
+ * - HANDOFF_FD_ENV : 新しいバイナリに引き継ぎ用 socketpair の FD 番号を伝える環境変数
+ * - struct conn    : 1 接続の状態（行になっていない受信済みバイト inbuf と、処理した行数）
+ * - struct handoff_rec : 引き継ぎで送る 1 接続ぶんのレコード（この後ろに inbuf が inlen バイト続く）
+ */
+#define HANDOFF_FD_ENV  "RE_EXEC_HANDOFF_FD"
+#define MAX_CONN        16384           /* 同時に持つ接続数の上限 */
+#define CONN_BUFSZ      512             /* 1 行の最大長 */
+#define HANDOFF_BATCH   64              /* 1 回の sendmsg で渡す接続数 */
+#define HANDOFF_WAIT    5               /* 秒：新しいプロセスの受け取りの返事を待つ上限 */
+
+struct conn {
+    int fd;
+    size_t inlen;                       /* inbuf にある行になっていないバイト数 */
+    long nlines;                        /* この接続で処理した行数 */
+    char inbuf[CONN_BUFSZ];
+};
+
+struct handoff_rec {
+    uint32_t inlen;
+    uint32_t pad;
+    int64_t nlines;
+};
+
+/* g_pfd の並び：[0] listen / [1] シグナル FD / [PFD_BASE + i] 接続 g_conns[i] */
+#define PFD_BASE        2
+
+int g_upgrade = 0;
+struct conn *g_conns;
+struct pollfd *g_pfd;
+int g_nconns;
+
+/* 自己パイプ用のシグナルハンドラ（signalfd が使えないとき）
+ *
+ * シグナル番号を 1 バイト書くだけ（write は async-signal-safe）。
+ * パイプはノンブロッキングなので、溢れても（= 未読が溜まりすぎても）ここで止まらない。
+ */
+void
+sig_pipe_handler(int sig)
+{
+    unsigned char c;
+    int save;
+
+    save = errno;
+    c = (unsigned char) sig;
+    (void) write(g_sig_pipe[1], &c, 1);
+    errno = save;
+}
+
+/* sigs[0..nsigs) を「読める FD」で受け取るようにする
+ *
+ * 戻り値: poll で待つ FD / -1（失敗）
+ *
+ * アルゴリズム：
+ * 1) 対象のシグナルをブロック（以後、非同期に割り込まれない）
+ * 2) signalfd を作る → 届いたシグナルは signalfd_siginfo として read できる
+ * 3) signalfd が無ければ自己パイプ：ハンドラ（SA_RESTART）が番号を 1 バイト書き、
+ *    ブロックを外す（exec 前から保留されていた分はここでハンドラに届く）
+ */
+int
+sig_fd_init(const int *sigs, int nsigs)
+{
+    struct sigaction sa;
+    sigset_t mask;
+    int i;
+
+    (void) sigemptyset(&mask);
+    for (i = 0; i < nsigs; i++) {
+        (void) sigaddset(&mask, sigs[i]);
+    }
+    (void) sigprocmask(SIG_BLOCK, &mask, NULL);
+#ifdef __linux__
+    if ((g_sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) != -1) {
+        return (g_sig_fd);
+    }
+    perror("signalfd");
+#endif
+    if (pipe(g_sig_pipe) == -1) {
+        perror("pipe");
+        (void) sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        return (-1);
+    }
+    for (i = 0; i < 2; i++) {
+        (void) fcntl(g_sig_pipe[i], F_SETFL, fcntl(g_sig_pipe[i], F_GETFL, 0) | O_NONBLOCK);
+        (void) fcntl(g_sig_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_pipe_handler;
+    (void) sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    for (i = 0; i < nsigs; i++) {
+        (void) sigaction(sigs[i], &sa, NULL);
+    }
+    g_sig_fd = g_sig_pipe[0];
+    (void) sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    return (g_sig_fd);
+}
+
+/* シグナル FD から 1 つ取り出す（戻り値：シグナル番号 / 0 = もう無い） */
+int
+sig_fd_read(void)
+{
+#ifdef __linux__
+    struct signalfd_siginfo si;
+#endif
+    unsigned char c;
+
+    if (g_sig_pipe[0] == -1) {
+#ifdef __linux__
+        if (read(g_sig_fd, &si, sizeof(si)) == (ssize_t) sizeof(si)) {
+            return ((int) si.ssi_signo);
+        }
+#endif
+        return (0);
+    }
+    if (read(g_sig_fd, &c, 1) == 1) {
+        return (c);
+    }
+    return (0);
+}
+
+/* 届いているシグナルをすべてフラグに変える（ループの中から呼ぶ）
  *
- * sig: シグナル番号（SIGHUPなら通常 1）
+ * - SIGHUP          : g_restart（再起動は接続を持っていない地点で行う）
+ * - SIGTERM / SIGINT: g_stop
+ */
+void
+sig_dispatch(void)
+{
+    int sig;
+
+    while ((sig = sig_fd_read()) != 0) {
+        (void) fprintf(stderr, "signal:%d\n", sig);
+        if (sig == SIGHUP) {
+            g_restart = 1;
+        } else if (sig == SIGTERM || sig == SIGINT) {
+            g_stop = sig;
+        }
+    }
+}
+
+/* 自分自身を上書き再実行する（hot でも upgrade でもないモード）
  *
- * やっていること（アルゴリズム）：
- * 1) SIGHUP を受けたことを表示（教材用ログ）
- * 2) 標準入出力(0,1,2)を残して、それ以外のFDを close
+ * 1) 標準入出力(0,1,2)を残して、それ以外のFDを close
  *    - 目的：exec 後に “不要なFD” を持ち越さない（FDリーク防止）
- *    - 例：listenソケット、accept済みソケット、ログファイル、パイプなどが残ると事故りやすい
- * 3) execve で自分自身を上書き再実行
+ *    - listen ソケットも閉じるので、新しいイメージが bind し直すまでの接続は拒否される
+ *      （hot モードとの違い）
+ * 2) execve で自分自身を上書き再実行
  *
- * 注意：
- * - この実装は 3以上を全部閉じるため、listenソケットも閉じられる
- *   → accept中にSIGHUPが来ると accept/recv/send が EBADF 等で失敗する可能性がある
- * - 実務なら “安全なタイミングでリスタートする” ために、
- *   ハンドラではフラグを立ててループが落ち着いたところで close/exec する設計にすることが多い
+ * 以前はこれを SIGHUP ハンドラの中で行っていた（accept/recv の途中で FD が消える）。
+ * いまは accept_loop が接続を持っていない地点で呼ぶ。
+ * SIGHUP はブロックしたまま exec するので、新しいイメージが sig_fd_init するまでの間に
+ * 次の SIGHUP が来ても既定動作（終了）にはならない。
  */
 void
-sig_hangup_handler(int sig)
+legacy_restart(void)
 {
+    sigset_t mask;
     int i;
 
-    /* NOTE: fprintf は async-signal-safe ではない（教材として簡略化） */
-    (void) fprintf(stderr, "sig_hangup_handler(%d)\n", sig);
+    g_restart = 0;
+    (void) sigemptyset(&mask);
+    (void) sigaddset(&mask, SIGHUP);
+    (void) sigprocmask(SIG_BLOCK, &mask, NULL);
 
     /* stdin, stdout, stderr 以外をクローズ（3..MAXFD-1） */
     for (i = 3; i < MAXFD; i++) {
@@ -107,15 +317,151 @@ sig_hangup_handler(int sig)
     /* 自プロセスの上書き再実行
      *
      * - 成功したらこの関数から戻らない（プロセスイメージが置換される）
-     * - 失敗した場合のみ -1 が返り、perror が呼ばれる
+     * - 失敗したら listen ソケットも閉じてしまっているので終了する
      *
      * 注意：argv[0] が相対パス（例 "./re-exec"）だと、
      *       カレントディレクトリが変わった状況では execve が失敗し得る。
      */
-    if (execve((*argv_)[0], (*argv_), (*envp_)) == -1) {
-        /* NOTE: perror も async-signal-safe ではない（教材として簡略化） */
+    (void) execve((*argv_)[0], (*argv_), (*envp_));
+    perror("execve");
+    exit(EX_OSERR);
+}
+
+/* 前のイメージから引き継いだ listen ソケットを受け取る
+ *
+ * 戻り値: listen 中のソケットFD（引き継ぎあり） / -1（環境変数なし・不正）
+ *
+ * アルゴリズム：
+ * 1) 環境変数 RE_EXEC_LISTEN_FD を数値にする
+ * 2) getsockopt(SO_ACCEPTCONN) で「本当に listen 中のソケットか」確かめる
+ *    （環境変数は外から与えられ得るので、でたらめな FD をそのまま使わない）
+ * 3) 環境変数は消しておく（このプロセスから起動する別プログラムに見せない）
+ */
+int
+inherit_listen_socket(void)
+{
+    char *p, *end;
+    long fd;
+    int val;
+    socklen_t len;
+
+    if ((p = getenv(LISTEN_FD_ENV)) == NULL) {
+        return (-1);
+    }
+    fd = strtol(p, &end, 10);
+    (void) unsetenv(LISTEN_FD_ENV);
+    if (*p == '\0' || *end != '\0' || fd < 3 || fd >= MAXFD) {
+        (void) fprintf(stderr, "%s=%s:invalid\n", LISTEN_FD_ENV, p);
+        return (-1);
+    }
+    val = 0;
+    len = (socklen_t) sizeof(val);
+    if (getsockopt((int) fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &len) == -1 || val != 1) {
+        (void) fprintf(stderr, "%s=%ld:not a listening socket\n", LISTEN_FD_ENV, fd);
+        return (-1);
+    }
+    return ((int) fd);
+}
+
+/* listen ソケットを持ったまま自分自身を再実行する（hot モード）
+ *
+ * soc: 持ち越す listen ソケットFD
+ *
+ * アルゴリズム：
+ * 1) SIGHUP をブロック（signalfd ならもともとブロック中。自己パイプのときは、
+ *    exec 直後、新しい main がハンドラを登録する前に SIGHUP が来ると既定動作で
+ *    終了してしまう。ブロック中に来た分は保留され、新しい main の sig_fd_init が
+ *    受け取る）
+ * 2) soc の番号を環境変数に入れ、FD_CLOEXEC を外す
+ * 3) soc と標準入出力以外の、FD_CLOEXEC の付いていない FD を close
+ *    （シグナル FD など FD_CLOEXEC 付きの FD は execve が閉じるので残しておく。
+ *     execve に失敗したとき、このイメージが今までどおりそれを poll し続けられる）
+ * 4) execve（environ を渡すので setenv した値が新しいイメージに届く）
+ * 失敗したら環境変数を消してブロックを戻し、このイメージのまま処理を続ける。
+ */
+void
+hot_restart(int soc)
+{
+    char nbuf[16];
+    sigset_t mask;
+    int i, fl;
+
+    g_restart = 0;
+    (void) sigemptyset(&mask);
+    (void) sigaddset(&mask, SIGHUP);
+    (void) sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    (void) fprintf(stderr, "hot restart:listen fd=%d\n", soc);
+    (void) snprintf(nbuf, sizeof(nbuf), "%d", soc);
+    (void) setenv(LISTEN_FD_ENV, nbuf, 1);
+    (void) fcntl(soc, F_SETFD, 0);
+    for (i = 3; i < MAXFD; i++) {
+        if (i != soc && (fl = fcntl(i, F_GETFD)) != -1 && (fl & FD_CLOEXEC) == 0) {
+            (void) close(i);
+        }
+    }
+
+    if (execve((*argv_)[0], (*argv_), environ) == -1) {
         perror("execve");
     }
+    (void) unsetenv(LISTEN_FD_ENV);
+    if (g_sig_pipe[0] != -1) {
+        (void) sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    }
+}
+
+/* 単調増加時計の現在値（秒） */
+double
+now_sec(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec + (double) ts.tv_nsec / 1e9);
+}
+
+/* グレースフル停止（drain、upgrade モード）
+ *
+ * SIGTERM / SIGINT を受けたら listen ソケットを閉じて新しい接続を断り、
+ * 持っている接続は相手が閉じるまで処理を続ける。
+ * 接続が 0 になるか DRAIN_TIMEOUT 秒を過ぎたら（残りを閉じて）終了する。
+ * 逐次処理の accept_loop は接続を持っていない地点でしか g_stop を見ないので、
+ * もともと処理中の接続を切らずに止まる。
+ */
+#define DRAIN_TIMEOUT   (30)
+
+double g_drain_start = 0.0;     /* drain を始めた時刻（0 = 通常運転） */
+double g_drain_report = 0.0;    /* 最後に途中経過を表示した時刻 */
+
+/* drain を始める（sig：受けたシグナル、nconn：その時点の接続数） */
+void
+drain_begin(int sig, int nconn)
+{
+    g_drain_start = g_drain_report = now_sec();
+    (void) fprintf(stderr, "drain:signal %d, stop accepting, conns=%d, timeout=%ds\n",
+                   sig, nconn, DRAIN_TIMEOUT);
+}
+
+/* drain を終えてよいか調べる（1 = 接続 0、または期限切れ / 0 = まだ待つ） */
+int
+drain_check(int nconn)
+{
+    double now;
+
+    now = now_sec();
+    if (nconn == 0) {
+        (void) fprintf(stderr, "drain:done in %.1fs\n", now - g_drain_start);
+        return (1);
+    }
+    if (now - g_drain_start >= DRAIN_TIMEOUT) {
+        (void) fprintf(stderr, "drain:deadline, closing %d conns\n", nconn);
+        return (1);
+    }
+    if (now - g_drain_report >= 1.0) {
+        g_drain_report = now;
+        (void) fprintf(stderr, "drain:conns=%d elapsed=%.1fs\n", nconn, now - g_drain_start);
+    }
+    return (0);
 }
 
 /* サーバソケットの準備（portのみ指定）
@@ -212,20 +558,51 @@ server_socket(const char *portnm)
  *
  * 注意：
  * - 逐次サーバなので、1接続中は他接続を捌かない（同時接続を捌くなら fork/thread/epoll 等が必要）
- * - SIGHUP によって FD が閉じられると、accept が EBADF 等で失敗し得る（非同期割り込みの教材ポイント）
+ * - accept の前に listen ソケットとシグナル FD を poll で待つ
+ *   シグナルが来たら sig_dispatch でフラグにして、ここ（= 接続を持っていない地点）で
+ *   hot_restart / legacy_restart / 終了 を行う
+ * - 接続の処理中に来たシグナルはシグナル FD に溜まるだけで、recv を EINTR で止めない
  */
 void
 accept_loop(int soc)
 {
     char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
     struct sockaddr_storage from;
+    struct pollfd pfd[2];
     int acc;
     socklen_t len;
 
+    pfd[0].fd = soc;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = g_sig_fd;
+    pfd[1].events = POLLIN;
     for (;;) {
+        if (g_stop) {
+            return;
+        }
+        if (g_restart) {
+            if (g_hot) {
+                hot_restart(soc);
+            } else {
+                legacy_restart();
+            }
+        }
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+            }
+            continue;
+        }
+        if (pfd[1].revents & POLLIN) {
+            sig_dispatch();
+            continue;
+        }
+        if ((pfd[0].revents & POLLIN) == 0) {
+            continue;
+        }
         len = (socklen_t) sizeof(from);
 
-        /* 接続受付（シグナル割り込みで EINTR の可能性） */
+        /* 接続受付 */
         if ((acc = accept(soc, (struct sockaddr *) &from, &len)) == -1) {
             if (errno != EINTR) {
                 perror("accept");
@@ -247,43 +624,80 @@ accept_loop(int soc)
     }
 }
 
-/* サイズ指定文字列連結（strlcat相当）
+/* 応答の末尾に付ける文字列（受信時にこの分の tailroom を残しておく） */
+#define RESP_SUFFIX     ":OK\r\n"
+#define RESP_SUFFIX_LEN (sizeof(RESP_SUFFIX) - 1)
+
+/* 長さ付きバッファ（応答組み立て用）
+ *
+ * base[0 .. size) の中で、データは base[off .. off+len) にある。
  *
- * dst のバッファサイズ size を超えないように src を末尾に連結する。
- * 応答文字列 ":OK\r\n" を追加するときに利用。
+ *   base                off            off+len                 size
+ *    |<-- headroom -->|<---- data ---->|<---- tailroom ---->|
+ *
+ * mystrlcat + strlen との違い：
+ * - 長さを持っているので、連結のたびに NUL を探して先頭から数え直さない（O(1) で追記）
+ * - NUL 終端を必要としないので、recv したバイト列をそのまま扱える
+ * - 先頭側にも空き（headroom）を取れるので、ヘッダ等を後から前に付けられる
+ * - データ部をそのまま iovec にして writev に渡せる
  */
-size_t
-mystrlcat(char *dst, const char *src, size_t size)
-{
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
+struct mbuf {
+    char *base;                         /* 領域の先頭 */
+    size_t size;                        /* 領域の大きさ */
+    size_t off;                         /* データの開始位置 */
+    size_t len;                         /* データ長 */
+};
 
-    /* dst の終端まで進む（最大 size まで） */
-    for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--);
-    dlen = (size_t)(pd - dst);
-
-    /* すでに満杯なら “本来必要だった長さ” を返す */
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
-    }
+#define MBUF_DATA(m_)     ((m_)->base + (m_)->off)
+#define MBUF_TAIL(m_)     ((m_)->base + (m_)->off + (m_)->len)
+#define MBUF_HEADROOM(m_) ((m_)->off)
+#define MBUF_TAILROOM(m_) ((m_)->size - (m_)->off - (m_)->len)
 
-    /* 終端NULを確保するため、書き込み可能最終位置は size-1 */
-    pde = dst + size - 1;
+/* 領域 base[0..size) を、先頭に headroom バイト空けた空のバッファとして使い始める */
+void
+mbuf_init(struct mbuf *m, char *base, size_t size, size_t headroom)
+{
+    m->base = base;
+    m->size = size;
+    m->off = headroom < size ? headroom : size;
+    m->len = 0;
+}
 
-    /* src を入るだけコピー */
-    for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
+/* 末尾に n バイト追記する（tailroom が足りなければ何もせず -1） */
+int
+mbuf_append(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_TAILROOM(m)) {
+        return (-1);
     }
+    (void) memcpy(MBUF_TAIL(m), src, n);
+    m->len += n;
+    return (0);
+}
 
-    /* 残りを NUL で埋める（終端保証） */
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
+/* 先頭に n バイト付け足す（headroom が足りなければ何もせず -1） */
+int
+mbuf_prepend(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_HEADROOM(m)) {
+        return (-1);
     }
+    m->off -= n;
+    m->len += n;
+    (void) memcpy(MBUF_DATA(m), src, n);
+    return (0);
+}
 
-    /* src 長の計算（psは '\0' まで進める） */
-    while (*ps++);
-    return (dlen + (size_t)(ps - src - 1));
+/* データ部を iovec に変換する（戻り値は writev に渡す要素数） */
+int
+mbuf_iov(const struct mbuf *m, struct iovec *iov)
+{
+    if (m->len == 0) {
+        return (0);
+    }
+    iov[0].iov_base = MBUF_DATA(m);
+    iov[0].iov_len = m->len;
+    return (1);
 }
 
 /* 送受信ループ（簡易 echo + OK）
@@ -293,135 +707,586 @@ mystrlcat(char *dst, const char *src, size_t size)
  * アルゴリズム：
  * 1) recv で受信
  * 2) len==0 なら相手が切断（EOF）→終了
- * 3) 受信データを文字列化して表示（CR/LFで行末処理）
- * 4) ":OK\r\n" を付けて send で返す
- *
- * 重要注意（境界）：
- * - recv の第三引数が sizeof(buf) なので、len が 512 になり得る
- * - buf[len] = '\0' は buf[512] となり境界外アクセスの可能性
- * - 安全化するなら recv(..., sizeof(buf)-1, ...) にする
+ * 3) 受信データを CR/LF で行に切り分けて表示
+ * 4) 行ごとに ":OK\r\n" を付けて返す
  *
  * 重要注意（TCPの性質）：
  * - TCP はストリームなので、1回のrecvが「ちょうど1行」とは限らない
- * - 教材として単純化しているが、厳密には行バッファリングが必要
+ * - 改行の届いていない行の途中は次の recv まで持ち越す（行バッファリング。
+ *   upgrade モードの conn_input と同じ考え方）
  */
 void
 send_recv_loop(int acc)
 {
-    char buf[512], *ptr;
+    char buf[512];
+    struct mbuf m;
+    struct iovec iov[2];
+    size_t end, start, e;
     ssize_t len;
+    int cr;
 
+    /* 受信バッファを空にする（行の途中は先頭に詰めて次の recv まで持ち越す） */
+    mbuf_init(&m, buf, sizeof(buf), 0);
+    cr = 0;
     for (;;) {
-        /* 受信 */
-        if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
+        /* 受信（持ち越した行の途中の後ろに読む） */
+        if ((len = recv(acc, MBUF_TAIL(&m),
+                        MBUF_TAILROOM(&m), 0)) == -1) {
+            if (errno == EINTR) {
+                /* 自己パイプ（SA_RESTART）でも通常は来ない。念のため読み直す */
+                continue;
+            }
             perror("recv");
             break;
         }
 
         if (len == 0) {
             (void) fprintf(stderr, "recv:EOF\n");
+            /* 改行の届かなかった最後の行にも応答する */
+            end = m.len;
+        } else {
+            m.len += (size_t) len;
+
+            /* 最後の区切り（\r か \n）までに応答し、後ろ（改行の届いていない行の途中）は持ち越す
+             * 改行の無いまま buf が一杯なら、全部を 1 行とする
+             */
+            for (end = m.len; end > 0 && buf[end - 1] != '\r' && buf[end - 1] != '\n'; end--) {
+                ;
+            }
+            if (end == 0 && MBUF_TAILROOM(&m) == 0) {
+                end = m.len;
+            }
+        }
+
+        /* 1 行ずつ表示し、行ごとに ":OK\r\n" を付けて返す（続けて届いた要求にもそれぞれ返す）
+         * - 区切りは \r / \n / \r\n（recv の境目で分かれた \r\n も 1 つの区切り）
+         * - 応答は行と ":OK\r\n" を iovec で並べて送る（buf に書き足さない）
+         */
+        for (start = 0; start < end; start = e + 1) {
+            for (e = start; e < end && buf[e] != '\r' && buf[e] != '\n'; e++) {
+                ;
+            }
+            if (e == start && e < end && buf[e] == '\n' && (e > 0 ? buf[e - 1] == '\r' : cr)) {
+                /* \r\n の \n */
+                continue;
+            }
+            (void) fprintf(stderr, "[client]%.*s\n", (int) (e - start), buf + start);
+            iov[0].iov_base = buf + start;
+            iov[0].iov_len = e - start;
+            iov[1].iov_base = RESP_SUFFIX;
+            iov[1].iov_len = RESP_SUFFIX_LEN;
+            if (writev(acc, iov, 2) == -1) {
+                perror("writev");
+                len = -1;
+                break;
+            }
+        }
+        if (len <= 0) {
+            /* EOF / 応答を送れなかった */
+            break;
+        }
+        cr = end == m.len && end > 0 && buf[end - 1] == '\r';
+
+        /* 行の途中を先頭に詰める */
+        m.len -= end;
+        (void) memmove(buf, buf + end, m.len);
+    }
+}
+
+/* ---------------- upgrade モード（接続ごと引き継ぐ） ---------------- */
+
+/* 接続を表に足す（満杯なら閉じて -1） */
+int
+conn_add(int fd, const char *in, size_t inlen, long nlines)
+{
+    struct conn *c;
+
+    if (g_nconns >= MAX_CONN || inlen > CONN_BUFSZ) {
+        (void) close(fd);
+        return (-1);
+    }
+    c = &g_conns[g_nconns];
+    c->fd = fd;
+    c->inlen = inlen;
+    c->nlines = nlines;
+    if (inlen > 0) {
+        (void) memcpy(c->inbuf, in, inlen);
+    }
+    g_pfd[PFD_BASE + g_nconns].fd = fd;
+    g_pfd[PFD_BASE + g_nconns].events = POLLIN;
+    g_pfd[PFD_BASE + g_nconns].revents = 0;
+    g_nconns++;
+    return (0);
+}
+
+/* i 番目の接続を閉じ、最後の接続で穴を埋める */
+void
+conn_close(int i)
+{
+    (void) close(g_conns[i].fd);
+    g_nconns--;
+    g_conns[i] = g_conns[g_nconns];
+    g_pfd[PFD_BASE + i] = g_pfd[PFD_BASE + g_nconns];
+}
+
+/* 接続 c の受信（戻り値：0 = 続ける / -1 = 閉じる）
+ *
+ * send_recv_loop と違い、TCP ストリームをきちんと行に区切る：
+ * - recv したバイトを inbuf の後ろに足し、LF が見つかるたびに 1 行として応答する
+ * - LF の無い残り（途中までの行）は inbuf に残して次の recv を待つ
+ *   → この残りが、引き継ぎのときにレコードで新しいプロセスへ渡される
+ * - inbuf が満杯になっても LF が無ければ、そこまでを 1 行とみなす
+ */
+int
+conn_input(struct conn *c)
+{
+    struct iovec iov[2];
+    char *lf;
+    size_t n, linelen;
+    ssize_t len;
+
+    if ((len = recv(c->fd, c->inbuf + c->inlen, CONN_BUFSZ - c->inlen, 0)) == -1) {
+        if (errno == EINTR || errno == EAGAIN) {
+            return (0);
+        }
+        perror("recv");
+        return (-1);
+    }
+    if (len == 0) {
+        return (-1);
+    }
+    c->inlen += (size_t) len;
+
+    for (;;) {
+        if ((lf = memchr(c->inbuf, '\n', c->inlen)) != NULL) {
+            n = (size_t) (lf - c->inbuf) + 1;
+        } else if (c->inlen == CONN_BUFSZ) {
+            n = CONN_BUFSZ;
+        } else {
             break;
         }
+        linelen = n;
+        while (linelen > 0 && (c->inbuf[linelen - 1] == '\n' || c->inbuf[linelen - 1] == '\r')) {
+            linelen--;
+        }
+        (void) fprintf(stderr, "[client]%.*s\n", (int) linelen, c->inbuf);
+
+        iov[0].iov_base = c->inbuf;
+        iov[0].iov_len = linelen;
+        iov[1].iov_base = RESP_SUFFIX;
+        iov[1].iov_len = RESP_SUFFIX_LEN;
+        if (writev(c->fd, iov, 2) == -1) {
+            perror("writev");
+            return (-1);
+        }
+        c->nlines++;
+        c->inlen -= n;
+        (void) memmove(c->inbuf, c->inbuf + n, c->inlen);
+    }
+    return (0);
+}
 
-        /* 文字列化（len==512の可能性がある点に注意） */
-        buf[len] = '\0';
+/* 接続の FD を batch 本まとめて送る（SCM_RIGHTS + レコード列）。成功 0 / 失敗 -1
+ *
+ * 1 メッセージの形：
+ *   本文   : uint32_t 個数 + （struct handoff_rec + inbuf の中身）× 個数
+ *   補助データ : SCM_RIGHTS で FD × 個数（本文のレコードと同じ順）
+ * 個数 0 のメッセージは「これで全部」の印
+ */
+int
+handoff_send(int chan, struct conn *cs, int n)
+{
+    static char body[sizeof(uint32_t) + HANDOFF_BATCH * (sizeof(struct handoff_rec) + CONN_BUFSZ)];
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+        struct cmsghdr align;
+    } u;
+    struct handoff_rec rec;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    uint32_t cnt;
+    size_t off;
+    int i;
 
-        /* CR/LF で切って表示（ログが1行になる） */
-        if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-            *ptr = '\0';
+    cnt = (uint32_t) n;
+    (void) memcpy(body, &cnt, sizeof(cnt));
+    off = sizeof(cnt);
+    for (i = 0; i < n; i++) {
+        rec.inlen = (uint32_t) cs[i].inlen;
+        rec.pad = 0;
+        rec.nlines = cs[i].nlines;
+        (void) memcpy(body + off, &rec, sizeof(rec));
+        off += sizeof(rec);
+        (void) memcpy(body + off, cs[i].inbuf, cs[i].inlen);
+        off += cs[i].inlen;
+    }
+
+    iov.iov_base = body;
+    iov.iov_len = off;
+    (void) memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (n > 0) {
+        msg.msg_control = u.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+        for (i = 0; i < n; i++) {
+            (void) memcpy(CMSG_DATA(cmsg) + sizeof(int) * i, &cs[i].fd, sizeof(int));
         }
-        (void) fprintf(stderr, "[client]%s\n", buf);
+    }
+    if (sendmsg(chan, &msg, MSG_NOSIGNAL) == -1) {
+        perror("sendmsg");
+        return (-1);
+    }
+    return (0);
+}
 
-        /* 応答文字列作成 */
-        (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-        len = (ssize_t) strlen(buf);
+/* 古いプロセス側：新しいバイナリを起動して全接続を渡す
+ *
+ * soc: listen ソケットFD
+ *
+ * アルゴリズム：
+ * 1) SIGHUP をブロック（自己パイプのとき、引き継ぎ中の連打と exec 直後の既定動作での終了を防ぐ。
+ *    signalfd ならもともとブロック中）
+ * 2) socketpair を作って fork → 子は listen と socketpair の片側を残して新しいバイナリを execve
+ *    （接続の FD は accept4 の SOCK_CLOEXEC で exec のときに自動で閉じる）
+ * 3) 全接続を HANDOFF_BATCH 本ずつ handoff_send → 個数 0 の終わりの印
+ * 4) 新しいプロセスからの 1 バイトの返事を待つ（= 全接続を受け取った。HANDOFF_WAIT 秒まで）
+ * 5) 経過時間を表示して終了（FD は新しいプロセスにも開いているので接続は切れない）
+ * 途中で失敗したら（新しいバイナリが起動できない、送れない、返事が来ない等）新しいプロセスを
+ * SIGKILL で止めて回収し、接続を持ったまま処理を続ける（同じ接続を 2 つのプロセスが
+ * 読まないように。新しいプロセスも終わりの印が来なければ自分から終了する）。
+ */
+void
+upgrade_handoff(int soc)
+{
+    char nbuf[2][16], ack;
+    struct timeval tv;
+    sigset_t mask;
+    double t0;
+    size_t buffered;
+    int sv[2], i, n;
+    pid_t pid;
+
+    g_restart = 0;
+    t0 = now_sec();
+    (void) sigemptyset(&mask);
+    (void) sigaddset(&mask, SIGHUP);
+    (void) sigprocmask(SIG_BLOCK, &mask, NULL);
 
-        /* 応答送信（部分送信は未考慮：教材として単純化） */
-        if ((len = send(acc, buf, (size_t) len, 0)) == -1) {
-            perror("send");
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        if (g_sig_pipe[0] != -1) {
+            (void) sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        }
+        return;
+    }
+    if ((pid = fork()) == 0) {
+        (void) snprintf(nbuf[0], sizeof(nbuf[0]), "%d", soc);
+        (void) snprintf(nbuf[1], sizeof(nbuf[1]), "%d", sv[1]);
+        (void) setenv(LISTEN_FD_ENV, nbuf[0], 1);
+        (void) setenv(HANDOFF_FD_ENV, nbuf[1], 1);
+        (void) fcntl(soc, F_SETFD, 0);
+        (void) fcntl(sv[1], F_SETFD, 0);
+        (void) execve((*argv_)[0], (*argv_), environ);
+        perror("execve");
+        _exit(EX_OSERR);
+    } else if (pid == -1) {
+        perror("fork");
+        (void) close(sv[0]);
+        (void) close(sv[1]);
+        if (g_sig_pipe[0] != -1) {
+            (void) sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        }
+        return;
+    }
+    (void) close(sv[1]);
+    tv.tv_sec = HANDOFF_WAIT;
+    tv.tv_usec = 0;
+    (void) setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    buffered = 0;
+    for (i = 0; i < g_nconns; i += n) {
+        n = g_nconns - i < HANDOFF_BATCH ? g_nconns - i : HANDOFF_BATCH;
+        if (handoff_send(sv[0], &g_conns[i], n) == -1) {
             break;
         }
     }
+    for (i = 0; i < g_nconns; i++) {
+        buffered += g_conns[i].inlen;
+    }
+    if (i < g_nconns || handoff_send(sv[0], NULL, 0) == -1
+        || recv(sv[0], &ack, 1, 0) != 1) {
+        (void) fprintf(stderr, "upgrade:handoff failed, keep serving\n");
+        (void) close(sv[0]);
+        (void) kill(pid, SIGKILL);
+        while (waitpid(pid, NULL, 0) == -1 && errno == EINTR) {
+            ;
+        }
+        if (g_sig_pipe[0] != -1) {
+            (void) sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        }
+        return;
+    }
+    (void) fprintf(stderr, "upgrade:handed %d conns (%zu buffered bytes) to pid %d in %.1f ms\n",
+                   g_nconns, buffered, (int) pid, (now_sec() - t0) * 1e3);
+    exit(EX_OK);
+}
+
+/* 新しいプロセス側：古いプロセスから接続を受け取る
+ *
+ * 戻り値: 受け取った接続数 / -1（引き継ぎなし）
+ *
+ * 環境変数 RE_EXEC_HANDOFF_FD の socketpair から、個数 0 の印が来るまで
+ * レコードと FD を受け取って接続表に並べ、最後に 1 バイト返して閉じる。
+ * 印が来ないままチャネルが閉じたら、古いプロセスは引き継ぎをやめて接続を持ち続けているので、
+ * 受け取った接続を閉じて終了する（同じ接続を 2 つのプロセスで読まない）。
+ */
+int
+upgrade_takeover(void)
+{
+    static char body[sizeof(uint32_t) + HANDOFF_BATCH * (sizeof(struct handoff_rec) + CONN_BUFSZ)];
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+        struct cmsghdr align;
+    } u;
+    struct handoff_rec rec;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    int fds[HANDOFF_BATCH];
+    char *p;
+    double t0;
+    uint32_t cnt, i;
+    size_t off;
+    ssize_t len;
+    int chan, nfds, total;
+
+    if ((p = getenv(HANDOFF_FD_ENV)) == NULL) {
+        return (-1);
+    }
+    chan = atoi(p);
+    (void) unsetenv(HANDOFF_FD_ENV);
+    (void) fcntl(chan, F_SETFD, FD_CLOEXEC);
+    t0 = now_sec();
+
+    total = 0;
+    for (;;) {
+        iov.iov_base = body;
+        iov.iov_len = sizeof(body);
+        (void) memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = u.buf;
+        msg.msg_controllen = sizeof(u.buf);
+        if ((len = recvmsg(chan, &msg, MSG_CMSG_CLOEXEC)) < (ssize_t) sizeof(cnt)) {
+            if (len == -1 && errno == EINTR) {
+                continue;
+            }
+            (void) fprintf(stderr, "upgrade:handoff channel closed before the end, exit\n");
+            (void) close(chan);
+            while (g_nconns > 0) {
+                conn_close(g_nconns - 1);
+            }
+            exit(EX_PROTOCOL);
+        }
+        nfds = 0;
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                nfds = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+                (void) memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * nfds);
+            }
+        }
+        (void) memcpy(&cnt, body, sizeof(cnt));
+        if (cnt == 0) {
+            break;
+        }
+        off = sizeof(cnt);
+        for (i = 0; i < cnt && (int) i < nfds; i++) {
+            (void) memcpy(&rec, body + off, sizeof(rec));
+            off += sizeof(rec);
+            if (conn_add(fds[i], body + off, rec.inlen, (long) rec.nlines) == 0) {
+                total++;
+            }
+            off += rec.inlen;
+        }
+    }
+
+    (void) send(chan, "k", 1, MSG_NOSIGNAL);
+    (void) close(chan);
+    (void) fprintf(stderr, "upgrade:took over %d conns in %.1f ms\n", total, (now_sec() - t0) * 1e3);
+    return (total);
+}
+
+/* upgrade モードのメインループ
+ *
+ * soc: listen ソケットFD（ノンブロッキングにして poll の 0 番に置く）
+ *
+ * アルゴリズム：
+ * 1) poll で listen・シグナル FD・全接続を待つ
+ * 2) シグナル FD が読めれば sig_dispatch。g_restart が立っていれば upgrade_handoff
+ *    （成功すればここには戻らない）
+ *    g_stop なら drain：listen ソケットを閉じて poll から外し（fd = -1 は無視される）、
+ *    接続が 0 になるか期限が切れたら残りを閉じて戻る
+ * 3) listen が読めれば accept4 で取れるだけ取る（SOCK_CLOEXEC：exec に持ち越さない）
+ * 4) 読める接続ごとに conn_input。-1 なら閉じる
+ */
+void
+upgrade_loop(int soc)
+{
+    struct rlimit rl;
+    int acc, i;
+
+    /* 多数の接続を持てるように FD の上限を引き上げる */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        (void) setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    (void) fcntl(soc, F_SETFL, fcntl(soc, F_GETFL, 0) | O_NONBLOCK);
+    g_pfd[0].fd = soc;
+    g_pfd[0].events = POLLIN;
+    g_pfd[1].fd = g_sig_fd;
+    g_pfd[1].events = POLLIN;
+
+    for (;;) {
+        if (g_restart && soc != -1) {
+            upgrade_handoff(soc);
+        }
+        if (g_stop && soc != -1) {
+            drain_begin(g_stop, g_nconns);
+            g_pfd[0].fd = -1;
+            (void) close(soc);
+            soc = -1;
+        }
+        if (soc == -1 && drain_check(g_nconns)) {
+            while (g_nconns > 0) {
+                conn_close(g_nconns - 1);
+            }
+            return;
+        }
+        /* drain 中は途中経過と期限を見るため 1 秒で戻る */
+        if (poll(g_pfd, (nfds_t) (PFD_BASE + g_nconns), soc == -1 ? 1000 : -1) == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+            }
+            continue;
+        }
+        if (g_pfd[1].revents & POLLIN) {
+            sig_dispatch();
+            continue;
+        }
+        if (g_pfd[0].revents & POLLIN) {
+            while ((acc = accept4(soc, NULL, NULL, SOCK_CLOEXEC)) != -1) {
+                (void) conn_add(acc, NULL, 0, 0);
+            }
+        }
+        for (i = g_nconns - 1; i >= 0; i--) {
+            if (g_pfd[PFD_BASE + i].revents != 0 && conn_input(&g_conns[i]) == -1) {
+                conn_close(i);
+            }
+        }
+    }
 }
 
 /* main：SIGHUP で self re-exec する TCP サーバ
  *
  * argv[1] : port
+ * argv[2] : hot（省略可。listen ソケットを持ち越すホットリスタート）
+ *           upgrade（省略可。接続ごと新しいバイナリに引き継ぐ）
  *
  * アルゴリズム：
- * 1) argv/envp のアドレスをグローバル保持（ハンドラで execve）
- * 2) sigaction で SIGHUP ハンドラ登録（SA_NODEFER）
+ * 1) argv/envp のアドレスをグローバル保持（legacy_restart で execve）
+ * 2) sig_fd_init で SIGHUP / SIGTERM / SIGINT をシグナル FD に向ける
  * 3) server_socket(port) で listen ソケット生成
- * 4) accept_loop で接続処理
+ * 4) accept_loop で接続処理（SIGTERM / SIGINT で戻ってきたら listen を閉じて終了）
+ *    upgrade モードでは upgrade_loop が drain の始めに listen を閉じる
  */
 int
 main(int argc, char *argv[], char *envp[])
 {
-    struct sigaction sa;
+    static const int sigs[] = { SIGHUP, SIGTERM, SIGINT };
     int soc;
 
     /* 引数チェック */
     if (argc <= 1) {
-        (void) fprintf(stderr, "re-exec port\n");
+        (void) fprintf(stderr, "re-exec port [hot|upgrade]\n");
         return (EX_USAGE);
     }
+    if (argc > 2) {
+        if (strcmp(argv[2], "hot") == 0) {
+            g_hot = 1;
+        } else if (strcmp(argv[2], "upgrade") == 0) {
+            g_upgrade = 1;
+        } else {
+            (void) fprintf(stderr, "re-exec port [hot|upgrade]\n");
+            return (EX_USAGE);
+        }
+    }
 
-    /* argv/envp をハンドラから参照できるように保持 */
+    /* argv/envp を再実行の関数から参照できるように保持 */
     argc_ = &argc;
     argv_ = &argv;
     envp_ = &envp;
 
-    /* SIGHUP ハンドラ設定（sigaction）
-     *
-     * 手順：
-     * - 現在の設定を取得
-     * - handler と flags を更新
-     * - 設定適用
-     *
-     * 注意：
-     * - sa.sa_mask を初期化していない（定番は sigemptyset(&sa.sa_mask)）
-     * - sa.sa_flags を SA_NODEFER に上書きしている（元のフラグを捨てる）
-     * - SA_NODEFER は再入を許し得るため、実務なら外すことが多い
+    /* シグナルを FD で受け取る
+     * - signalfd なら exec 前にブロックしたまま保留された SIGHUP もここから読める
+     * - 自己パイプなら、ハンドラを登録してからブロックを外す（保留分はそこで届く）
      */
-    (void) sigaction(SIGHUP, (struct sigaction *) NULL, &sa);
-    sa.sa_handler = sig_hangup_handler;
-    sa.sa_flags = SA_NODEFER;
-    (void) sigaction(SIGHUP, &sa, (struct sigaction *) NULL);
-    (void) fprintf(stderr, "sigaction():end\n");
-
-    /* listen ソケット生成 */
-    if ((soc = server_socket(argv[1])) == -1) {
+    if (sig_fd_init(sigs, (int) (sizeof(sigs) / sizeof(sigs[0]))) == -1) {
+        return (EX_OSERR);
+    }
+    (void) fprintf(stderr, "signal fd=%d (%s)\n", g_sig_fd,
+                   g_sig_pipe[0] == -1 ? "signalfd" : "self-pipe");
+
+    /* listen ソケット：前のイメージから引き継いだものがあれば bind し直さずに使う */
+    if ((soc = inherit_listen_socket()) != -1) {
+        (void) fprintf(stderr, "inherited listen fd=%d\n", soc);
+    } else if ((soc = server_socket(argv[1])) == -1) {
         (void) fprintf(stderr, "server_socket(%s):error\n", argv[1]);
         return (EX_UNAVAILABLE);
     }
 
     (void) fprintf(stderr, "ready for accept\n");
 
-    /* accept ループ（通常ここから戻らない） */
-    accept_loop(soc);
+    if (g_upgrade) {
+        /* 接続表（古いプロセスから引き継いだ接続があれば先に並べる） */
+        if ((g_conns = calloc(MAX_CONN, sizeof(struct conn))) == NULL
+            || (g_pfd = calloc(MAX_CONN + PFD_BASE, sizeof(struct pollfd))) == NULL) {
+            perror("calloc");
+            return (EX_OSERR);
+        }
+        (void) upgrade_takeover();
+        upgrade_loop(soc);
+    }
+
+    /* accept ループ（SIGTERM / SIGINT で戻る） */
+    if (!g_upgrade) {
+        accept_loop(soc);
+        (void) close(soc);
+    }
 
-    /* 念のため（通常到達しない） */
-    (void) close(soc);
+    (void) fprintf(stderr, "stopped\n");
     return (EX_OK);
 }
 
 /*
  * 学習メモ（より安全な設計へ）
  *
- * 1) ハンドラ内で I/O をしない
+ * 1) ハンドラ内で I/O をしない（対応済み）
  * - fprintf/perror は async-signal-safe ではない
- * - write(2) だけにするか、フラグを立てるだけにする
+ * - いまはシグナル FD（signalfd / 自己パイプ）でループのイベントにしている
  *
- * 2) ハンドラ内で close/exec しない（タイミング問題）
+ * 2) ハンドラ内で close/exec しない（対応済み）
  * - accept/recv/send の最中にFDを閉じると EBADF などが起きる
- * - フラグ方式で “安全な地点” で再起動するのが定石
+ * - いまは accept_loop が接続を持っていない地点で再起動する
  *
  * 3) recv のサイズを sizeof(buf)-1 にする
  * - buf[len]='\0' の境界外アクセスを防ぐ
  *
- * 4) SA_NODEFER を外す
- * - 再入を防いだ方が安全
- *
- * 5) MAXFD 固定をやめる
+ * 4) MAXFD 固定をやめる
  * - RLIMIT_NOFILE を参照して全FDを確実に閉じる
  */
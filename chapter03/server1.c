@@ -28,6 +28,15 @@
  *    - close(conn_fd)
  * 3) （通常到達しないが）close(listen_fd)
  *
+ * ソケットアクティベーション（追加）：
+ * - スーパーバイザが LISTEN_PID / LISTEN_FDS で listen ソケットを渡してきたら、
+ *   それ（FD 3）をそのまま使い、getaddrinfo/socket/bind/listen を丸ごと省く
+ *   （このとき address/port 引数は使わない）
+ * - 起動前に来た接続もスーパーバイザの listen ソケットのバックログで待っているので、
+ *   再起動の隙間で接続拒否（ECONNREFUSED）にならず、起動した瞬間から accept できる
+ * - accept を始める直前に NOTIFY_SOCKET へ "READY=1" を送る（準備完了の通知）
+ * - 関数 listen_fds / notify_ready は daemon.c と同じもの
+ *
  * 注意（落とし穴）：
  * - recv のサイズが sizeof(buf) のため、len==512 になり得て buf[len]='\0' が境界外アクセス
  *   → 安全化するなら recv(..., sizeof(buf)-1, ...) が定番
@@ -38,6 +47,8 @@
 #include <sys/param.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>                    /* writev, struct iovec */
+#include <sys/un.h>                     /* NOTIFY_SOCKET（sockaddr_un） */
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
@@ -46,7 +57,10 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -58,6 +72,101 @@
  */
 void send_recv_loop(int acc);
 
+/* 受け取った listen ソケットの先頭 FD 番号（LISTEN_FDS 規約で 3 固定） */
+#define LISTEN_FDS_START 3
+
+/* スーパーバイザから渡された listen ソケットを受け取る（daemon.c と同じ）
+ *
+ * 戻り値：渡された FD の数（FD は LISTEN_FDS_START から連続） / 0（渡されていない）
+ * - LISTEN_PID が自分の PID と一致するときだけ LISTEN_FDS を信じる
+ * - unset_environment が真なら環境変数を消す
+ */
+int
+listen_fds(int unset_environment)
+{
+    const char *e;
+    char *end;
+    long pid, n;
+    int fd;
+
+    n = 0;
+    if ((e = getenv("LISTEN_PID")) == NULL) {
+        goto out;
+    }
+    pid = strtol(e, &end, 10);
+    if (*e == '\0' || *end != '\0' || pid != (long) getpid()) {
+        goto out;
+    }
+    if ((e = getenv("LISTEN_FDS")) == NULL) {
+        goto out;
+    }
+    n = strtol(e, &end, 10);
+    if (*e == '\0' || *end != '\0' || n <= 0 || n > INT_MAX - LISTEN_FDS_START) {
+        n = 0;
+        goto out;
+    }
+    for (fd = LISTEN_FDS_START; fd < LISTEN_FDS_START + (int) n; fd++) {
+        (void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+out:
+    if (unset_environment) {
+        (void) unsetenv("LISTEN_PID");
+        (void) unsetenv("LISTEN_FDS");
+        (void) unsetenv("LISTEN_FDNAMES");
+    }
+    return ((int) n);
+}
+
+/* 準備完了を NOTIFY_SOCKET に通知する（daemon.c と同じ）
+ *
+ * 戻り値: 1（送った） / 0（NOTIFY_SOCKET が無い） / -1（失敗）
+ */
+int
+notify_ready(const char *state)
+{
+    struct sockaddr_un sun;
+    const char *path;
+    size_t len;
+    int fd, ret;
+
+    if ((path = getenv("NOTIFY_SOCKET")) == NULL) {
+        return (0);
+    }
+    len = strlen(path);
+    if (len < 2 || len >= sizeof(sun.sun_path) || (path[0] != '/' && path[0] != '@')) {
+        return (-1);
+    }
+    (void) memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    (void) memcpy(sun.sun_path, path, len);
+    if (path[0] == '@') {
+        sun.sun_path[0] = '\0';
+    }
+    if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1) {
+        return (-1);
+    }
+    ret = sendto(fd, state, strlen(state), MSG_NOSIGNAL, (struct sockaddr *) &sun,
+                 (socklen_t) (offsetof(struct sockaddr_un, sun_path) + len)) == -1 ? -1 : 1;
+    (void) close(fd);
+    return (ret);
+}
+
+/* 渡された FD が listen 済みの TCP ソケットか確かめる
+ * （SO_ACCEPTCONN が立っていなければ、誤って渡された別の FD とみなす）
+ */
+int
+is_listening_socket(int fd)
+{
+    int val;
+    socklen_t len;
+
+    len = (socklen_t) sizeof(val);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &val, &len) == -1) {
+        return (0);
+    }
+    return (val != 0);
+}
+
 /* サーバソケットの準備（host指定版）
  *
  * hostnm: bind したいアドレス（例 "127.0.0.1" / "192.168.0.10" / "0.0.0.0" など）
@@ -215,48 +324,80 @@ accept_loop(int soc)
     }
 }
 
-/* サイズ指定文字列連結（strlcat相当）
+/* 応答の末尾に付ける文字列（受信時にこの分の tailroom を残しておく） */
+#define RESP_SUFFIX     ":OK\r\n"
+#define RESP_SUFFIX_LEN (sizeof(RESP_SUFFIX) - 1)
+
+/* 長さ付きバッファ（応答組み立て用）
  *
- * 目的：
- * - dst バッファのサイズ size を超えないように src を末尾に連結する
- * - バッファオーバーフローを起こしにくい連結手法
+ * base[0 .. size) の中で、データは base[off .. off+len) にある。
+ *
+ *   base                off            off+len                 size
+ *    |<-- headroom -->|<---- data ---->|<---- tailroom ---->|
  *
- * 返り値：
- * - 「本来連結したかった場合の合計長」を返す（切り詰めの検出に使える）
+ * mystrlcat + strlen との違い：
+ * - 長さを持っているので、連結のたびに NUL を探して先頭から数え直さない（O(1) で追記）
+ * - NUL 終端を必要としないので、recv したバイト列をそのまま扱える
+ * - 先頭側にも空き（headroom）を取れるので、ヘッダ等を後から前に付けられる
+ * - データ部をそのまま iovec にして writev に渡せる
  */
-size_t
-mystrlcat(char *dst, const char *src, size_t size)
+struct mbuf {
+    char *base;                         /* 領域の先頭 */
+    size_t size;                        /* 領域の大きさ */
+    size_t off;                         /* データの開始位置 */
+    size_t len;                         /* データ長 */
+};
+
+#define MBUF_DATA(m_)     ((m_)->base + (m_)->off)
+#define MBUF_TAIL(m_)     ((m_)->base + (m_)->off + (m_)->len)
+#define MBUF_HEADROOM(m_) ((m_)->off)
+#define MBUF_TAILROOM(m_) ((m_)->size - (m_)->off - (m_)->len)
+
+/* 領域 base[0..size) を、先頭に headroom バイト空けた空のバッファとして使い始める */
+void
+mbuf_init(struct mbuf *m, char *base, size_t size, size_t headroom)
 {
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
-    
-    /* dst の終端を探す（最大 size まで） */
-    for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--);
-    dlen = (size_t)(pd - dst);
-
-    /* dst がすでに size いっぱいなら、何も追加できない */
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
-    }
-
-    /* 書き込み可能な最後（終端NULのために1バイト残す） */
-    pde = dst + size - 1;
+    m->base = base;
+    m->size = size;
+    m->off = headroom < size ? headroom : size;
+    m->len = 0;
+}
 
-    /* src を入るだけコピー */
-    for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
+/* 末尾に n バイト追記する（tailroom が足りなければ何もせず -1） */
+int
+mbuf_append(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_TAILROOM(m)) {
+        return (-1);
     }
+    (void) memcpy(MBUF_TAIL(m), src, n);
+    m->len += n;
+    return (0);
+}
 
-    /* 終端NULで埋める */
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
+/* 先頭に n バイト付け足す（headroom が足りなければ何もせず -1） */
+int
+mbuf_prepend(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_HEADROOM(m)) {
+        return (-1);
     }
+    m->off -= n;
+    m->len += n;
+    (void) memcpy(MBUF_DATA(m), src, n);
+    return (0);
+}
 
-    /* src 長計算のため ps を最後まで進める */
-    while (*ps++);
-
-    return (dlen + (size_t)(ps - src - 1));
+/* データ部を iovec に変換する（戻り値は writev に渡す要素数） */
+int
+mbuf_iov(const struct mbuf *m, struct iovec *iov)
+{
+    if (m->len == 0) {
+        return (0);
+    }
+    iov[0].iov_base = MBUF_DATA(m);
+    iov[0].iov_len = m->len;
+    return (1);
 }
 
 /* 送受信ループ（エコー＋OK応答）
@@ -266,71 +407,96 @@ mystrlcat(char *dst, const char *src, size_t size)
  * アルゴリズム：
  * - recv でデータ受信
  * - 改行（\r または \n）までを1行として扱いログ表示
- * - 受信文字列に ":OK\r\n" を付けて返信
+ * - 行ごとに ":OK\r\n" を付けて返信
  * - クライアントが切断したら終了
  *
  * 注意：
- * - TCPストリームなので「1 recv = 1行」と限らない（教材的に単純化）
- * - recv のサイズ指定と NUL終端に境界問題がある（後述）
+ * - TCPストリームなので「1 recv = 1行」と限らない
+ *   → 改行の届いていない行の途中は次の recv まで持ち越す
  */
 void
 send_recv_loop(int acc)
 {
-    char buf[512], *ptr;
+    char buf[512];
+    struct mbuf m;
+    struct iovec iov[2];
+    size_t end, start, e;
     ssize_t len;
+    int cr;
 
+    /* 受信バッファを空にする（行の途中は先頭に詰めて次の recv まで持ち越す） */
+    mbuf_init(&m, buf, sizeof(buf), 0);
+    cr = 0;
     for (;;) {
-
-        /* 受信（ブロッキング）
+        /* 受信（ブロッキング。持ち越した行の途中の後ろに読む）
          * 戻り値：
          *  >0: 受信バイト数
          *   0: 相手が接続を閉じた（EOF）
          *  -1: エラー
          */
-        if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
+        if ((len = recv(acc, MBUF_TAIL(&m),
+                        MBUF_TAILROOM(&m), 0)) == -1) {
             perror("recv");
             break;
         }
 
         if (len == 0) {
             (void) fprintf(stderr, "recv:EOF\n");
-            break;
-        }
-
-        /* 文字列化
-         *
-         * !!! 注意：len==512 の場合、buf[512]='\0' は境界外書き込み !!!
-         * 安全化するなら recv の第3引数を sizeof(buf)-1 にするのが定番：
-         *   recv(acc, buf, sizeof(buf)-1, 0)
-         */
-        buf[len] = '\0';
+            /* 改行の届かなかった最後の行にも応答する */
+            end = m.len;
+        } else {
+            m.len += (size_t) len;
 
-        /* 改行があればそこで切る（1行として扱う） */
-        if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-            *ptr = '\0';
+            /* 最後の区切り（\r か \n）までに応答し、後ろ（改行の届いていない行の途中）は持ち越す
+             * 改行の無いまま buf が一杯なら、全部を 1 行とする
+             */
+            for (end = m.len; end > 0 && buf[end - 1] != '\r' && buf[end - 1] != '\n'; end--) {
+                ;
+            }
+            if (end == 0 && MBUF_TAILROOM(&m) == 0) {
+                end = m.len;
+            }
         }
 
-        (void) fprintf(stderr, "[client]%s\n", buf);
-
-        /* 応答文字列作成（末尾にOKを付加） */
-        (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-
-        len = (ssize_t) strlen(buf);
-
-        /* 応答送信
-         * 注意：send は部分送信があり得るが、このコードは単純化して1回で送れる前提
-         * 堅牢化するなら送信残量が0になるまでsendを繰り返す。
+        /* 1 行ずつ表示し、行ごとに ":OK\r\n" を付けて返す（続けて届いた要求にもそれぞれ返す）
+         * - 区切りは \r / \n / \r\n（recv の境目で分かれた \r\n も 1 つの区切り）
+         * - 応答は行と ":OK\r\n" を iovec で並べて送る（buf に書き足さない）
          */
-        if ((len = send(acc, buf, (size_t) len, 0)) == -1) {
-            perror("send");
+        for (start = 0; start < end; start = e + 1) {
+            for (e = start; e < end && buf[e] != '\r' && buf[e] != '\n'; e++) {
+                ;
+            }
+            if (e == start && e < end && buf[e] == '\n' && (e > 0 ? buf[e - 1] == '\r' : cr)) {
+                /* \r\n の \n */
+                continue;
+            }
+            (void) fprintf(stderr, "[client]%.*s\n", (int) (e - start), buf + start);
+            iov[0].iov_base = buf + start;
+            iov[0].iov_len = e - start;
+            iov[1].iov_base = RESP_SUFFIX;
+            iov[1].iov_len = RESP_SUFFIX_LEN;
+            if (writev(acc, iov, 2) == -1) {
+                perror("writev");
+                len = -1;
+                break;
+            }
+        }
+        if (len <= 0) {
+            /* EOF / 応答を送れなかった */
             break;
         }
+        cr = end == m.len && end > 0 && buf[end - 1] == '\r';
+
+        /* 行の途中を先頭に詰める */
+        m.len -= end;
+        (void) memmove(buf, buf + end, m.len);
     }
 }
 
 int
 main(int argc, char *argv[])
 {
+    char state[64];
     int soc;
 
     /* 引数にIPアドレス・ポート番号が指定されているか？
@@ -341,8 +507,14 @@ main(int argc, char *argv[])
         return (EX_USAGE);
     }
 
-    /* サーバソケットの準備（指定アドレスに bind する版） */
-    if ((soc = server_socket_by_hostname(argv[1], argv[2])) == -1) {
+    /* サーバソケットの準備
+     * - 渡された listen ソケットがあればそれを使う（bind しない）
+     * - 無ければ指定アドレスに bind する
+     */
+    if (listen_fds(1) >= 1 && is_listening_socket(LISTEN_FDS_START)) {
+        soc = LISTEN_FDS_START;
+        (void) fprintf(stderr, "socket activated:fd=%d\n", soc);
+    } else if ((soc = server_socket_by_hostname(argv[1], argv[2])) == -1) {
         (void) fprintf(stderr, "server_socket_by_hostname(%s,%s):error\n",
                        argv[1], argv[2]);
         return (EX_UNAVAILABLE);
@@ -350,6 +522,10 @@ main(int argc, char *argv[])
 
     (void) fprintf(stderr, "ready for accept\n");
 
+    /* 準備完了の通知（NOTIFY_SOCKET が無ければ何もしない） */
+    (void) snprintf(state, sizeof(state), "READY=1\nMAINPID=%ld", (long) getpid());
+    (void) notify_ready(state);
+
     /* アクセプトループ（無限） */
     accept_loop(soc);
 
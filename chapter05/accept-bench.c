@@ -0,0 +1,476 @@
+/*
+ * accept-bench: accept の分散方式を比べるベンチマーク
+ *
+ * 目的：
+ * - この章のサーバが使っている「複数のワーカーで 1 つのポートを accept する」方式を
+ *   同じ条件で動かし、どれを選ぶべきかの材料にする
+ *   - lockf     : ファイルロックで accept を直列化（server7 の既定）
+ *   - mutex     : 共有メモリ上の pthread mutex で直列化（server7 mutex / server8 の g_lock）
+ *   - epoll     : 共有 listen を各ワーカーの epoll に登録（参考：thundering herd が起きる）
+ *   - epollex   : 同上 + EPOLLEXCLUSIVE（server6 coro モード）
+ *   - reuseport : ワーカーごとに SO_REUSEPORT の listen を持つ（カーネルがハッシュで振り分け）
+ *   - cbpf      : reuseport + SO_ATTACH_REUSEPORT_CBPF で SO_INCOMING_CPU（受信 CPU）ごとに振り分け
+ *                 （ワーカー i は CPU i に固定する）
+ *
+ * 使い方：
+ *   accept-bench port [workers [conns [clients]]]
+ *     - port    : 先頭のポート番号（方式ごとに +1 して使う）
+ *     - workers : ワーカープロセス数（既定 4）
+ *     - conns   : 方式ごとの接続数（既定 10000）
+ *     - clients : 接続を張るクライアントプロセス数（既定 4）
+ *
+ * 計測内容（方式ごとに 1 行）：
+ * - rate     : 接続数 / 経過時間（クライアントは connect → 1 バイト受信 → RST で切断を繰り返す）
+ * - max/min  : ワーカーごとの accept 数の最大 / 最小（偏り。1.00 なら完全に均等）
+ * - cv       : ワーカーごとの accept 数の変動係数（標準偏差 / 平均）
+ * - wake/acc : ワーカーが待ち（accept / epoll_wait）から戻った回数 / accept できた数
+ *              （1.00 を超えた分は「起こされたのに接続が無かった」= thundering herd）
+ * - csw/acc  : ワーカーの自発的コンテキストスイッチ（眠った回数）の合計 / accept できた数
+ *              （epoll_wait はカーネル内で空振りを吸収して眠り直すので wake/acc には
+ *               出ない無駄な起床も、こちらには出る）
+ *
+ * 注意：
+ * - ワーカー・クライアント・カーネルの処理が同じマシンで競合するので、
+ *   絶対値より方式間の差を見ること。CPU が 1 つだと cbpf は全部ワーカー 0 に寄る
+ */
+
+#define _GNU_SOURCE                     /* accept4() / sched_setaffinity() */
+
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <arpa/inet.h>
+#include <linux/filter.h>               /* struct sock_filter / SKF_AD_CPU */
+#include <netinet/in.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51
+#endif
+
+/* 既定値 */
+#define WORKERS         4
+#define CONNS           10000
+#define CLIENTS         4
+#define MAX_WORKERS     64
+
+/* 方式 */
+#define SCHEME_LOCKF     0
+#define SCHEME_MUTEX     1
+#define SCHEME_EPOLL     2
+#define SCHEME_EPOLLEX   3
+#define SCHEME_REUSEPORT 4
+#define SCHEME_CBPF      5
+#define NUM_SCHEMES      6
+
+const char *g_scheme_name[NUM_SCHEMES] = {
+    "lockf", "mutex", "epoll", "epollex", "reuseport", "cbpf"
+};
+
+/*
+ * ワーカーごとの集計（共有メモリ。ワーカーは自分の分だけ書く）
+ * 隣のワーカーとキャッシュラインを共有しないよう 64 バイトに揃える
+ */
+struct wstat {
+    volatile long accepts;
+    volatile long wakeups;
+    char pad[64 - 2 * sizeof(long)];
+};
+
+/* 共有メモリの中身（fork 前に mmap する） */
+struct shared {
+    pthread_mutex_t mutex;
+    struct wstat w[MAX_WORKERS];
+};
+
+/* 単調増加時計の現在値（秒） */
+double
+now_sec(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec + (double) ts.tv_nsec / 1e9);
+}
+
+/*
+ * listen_socket(port, reuseport)
+ *   127.0.0.1:port で listen したソケットを返す（失敗 -1）
+ *   reuseport が真なら bind 前に SO_REUSEPORT を付ける（同じポートに何本でも bind できる）
+ */
+int
+listen_socket(int port, int reuseport)
+{
+    struct sockaddr_in sin;
+    int soc, opt;
+
+    if ((soc = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        perror("socket");
+        return (-1);
+    }
+    opt = 1;
+    (void) setsockopt(soc, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (reuseport) {
+        (void) setsockopt(soc, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    }
+    (void) memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons((unsigned short) port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(soc, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+        perror("bind");
+        (void) close(soc);
+        return (-1);
+    }
+    if (listen(soc, SOMAXCONN) == -1) {
+        perror("listen");
+        (void) close(soc);
+        return (-1);
+    }
+    return (soc);
+}
+
+/*
+ * attach_cbpf(soc, nworkers)
+ *   reuseport グループに「受信した CPU 番号 % nworkers 番目のソケットへ」という
+ *   クラシック BPF を付ける（グループ内の番号は bind した順）。成功 0 / 失敗 -1
+ */
+int
+attach_cbpf(int soc, int nworkers)
+{
+    struct sock_filter code[] = {
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },   /* A = 受信 CPU */
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, 0 },                         /* A %= nworkers */
+        { BPF_RET | BPF_A, 0, 0, 0 },                                   /* return A */
+    };
+    struct sock_fprog prog;
+
+    code[1].k = (unsigned int) nworkers;
+    prog.len = (unsigned short) (sizeof(code) / sizeof(code[0]));
+    prog.filter = code;
+    if (setsockopt(soc, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+        perror("setsockopt(SO_ATTACH_REUSEPORT_CBPF)");
+        return (-1);
+    }
+    return (0);
+}
+
+/* /proc/<pid>/status の voluntary_ctxt_switches を読む（読めなければ 0） */
+long
+voluntary_csw(pid_t pid)
+{
+    char path[64], line[256];
+    FILE *fp;
+    long v;
+
+    (void) snprintf(path, sizeof(path), "/proc/%d/status", (int) pid);
+    if ((fp = fopen(path, "r")) == NULL) {
+        return (0);
+    }
+    v = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "voluntary_ctxt_switches: %ld", &v) == 1) {
+            break;
+        }
+    }
+    (void) fclose(fp);
+    return (v);
+}
+
+/* 接続に 1 バイト返して閉じる（ワーカーの「処理」はこれだけ） */
+void
+serve(int acc)
+{
+    (void) write(acc, "x", 1);
+    (void) close(acc);
+}
+
+/*
+ * worker(scheme, soc, lock_fd, sh, me)
+ *   ワーカープロセス本体（親に SIGKILL されるまで accept を続ける）
+ *   - wakeups は「接続を待つ呼び出し（accept / epoll_wait）から戻った回数」
+ */
+void
+worker(int scheme, int soc, int lock_fd, struct shared *sh, struct wstat *me)
+{
+    struct epoll_event ev;
+    int acc, epfd;
+
+    if (scheme == SCHEME_EPOLL || scheme == SCHEME_EPOLLEX) {
+        if ((epfd = epoll_create1(0)) == -1) {
+            perror("epoll_create1");
+            return;
+        }
+        ev.events = EPOLLIN | (scheme == SCHEME_EPOLLEX ? EPOLLEXCLUSIVE : 0);
+        ev.data.fd = soc;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, soc, &ev) == -1) {
+            perror("epoll_ctl");
+            return;
+        }
+        for (;;) {
+            if (epoll_wait(epfd, &ev, 1, -1) <= 0) {
+                continue;
+            }
+            me->wakeups++;
+            if ((acc = accept4(soc, NULL, NULL, 0)) == -1) {
+                continue;                       /* 他のワーカーに先を越された */
+            }
+            me->accepts++;
+            serve(acc);
+        }
+    }
+
+    for (;;) {
+        if (scheme == SCHEME_LOCKF) {
+            (void) lockf(lock_fd, F_LOCK, 0);
+        } else if (scheme == SCHEME_MUTEX) {
+            if (pthread_mutex_lock(&sh->mutex) == EOWNERDEAD) {
+                (void) pthread_mutex_consistent(&sh->mutex);
+            }
+        }
+        acc = accept(soc, NULL, NULL);
+        me->wakeups++;
+        if (scheme == SCHEME_LOCKF) {
+            (void) lockf(lock_fd, F_ULOCK, 0);
+        } else if (scheme == SCHEME_MUTEX) {
+            (void) pthread_mutex_unlock(&sh->mutex);
+        }
+        if (acc == -1) {
+            continue;
+        }
+        me->accepts++;
+        serve(acc);
+    }
+}
+
+/*
+ * client(port, n)
+ *   クライアントプロセス本体：connect → 1 バイト受信 → 切断を n 回
+ *   - SO_LINGER 0 で close して RST で切る（TIME_WAIT で手元のポートを使い切らないため）
+ */
+void
+client(int port, long n)
+{
+    struct sockaddr_in sin;
+    struct linger lg;
+    long i;
+    int soc;
+    char c;
+
+    (void) memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons((unsigned short) port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    lg.l_onoff = 1;
+    lg.l_linger = 0;
+    for (i = 0; i < n; i++) {
+        if ((soc = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+            perror("socket");
+            return;
+        }
+        if (connect(soc, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+            perror("connect");
+            (void) close(soc);
+            continue;
+        }
+        (void) read(soc, &c, 1);
+        (void) setsockopt(soc, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        (void) close(soc);
+    }
+}
+
+/*
+ * run(scheme, port, nworkers, conns, nclients, sh)
+ *   1 つの方式を計測して 1 行表示する
+ *
+ * アルゴリズム：
+ *   1) listen ソケットを作る（reuseport/cbpf はワーカー数ぶん。cbpf は BPF も付ける）
+ *   2) ワーカーを fork し、待ちに入るまで少し待つ
+ *   3) クライアントを fork してパイプの close で一斉にスタート → 全員の終了までを計測
+ *   4) ワーカーのコンテキストスイッチ数を読んでから SIGKILL で止め、
+ *      共有メモリの集計から偏りと wake/acc / csw/acc を出す
+ */
+void
+run(int scheme, int port, int nworkers, long conns, int nclients, struct shared *sh)
+{
+    pid_t wpid[MAX_WORKERS];
+    int socs[MAX_WORKERS];
+    pthread_mutexattr_t attr;
+    double t0, t1, mean, var, cv;
+    long acc_total, wake_total, csw0, csw1, amax, amin, a;
+    int i, lock_fd, pfd[2], nsoc;
+    cpu_set_t cpus;
+    pid_t pid;
+    char ch;
+
+    (void) memset(sh, 0, sizeof(*sh));
+    (void) pthread_mutexattr_init(&attr);
+    (void) pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    (void) pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    (void) pthread_mutex_init(&sh->mutex, &attr);
+    (void) pthread_mutexattr_destroy(&attr);
+
+    /* 1) listen ソケット */
+    socs[0] = -1;
+    nsoc = (scheme == SCHEME_REUSEPORT || scheme == SCHEME_CBPF) ? nworkers : 1;
+    for (i = 0; i < nsoc; i++) {
+        if ((socs[i] = listen_socket(port, nsoc > 1)) == -1) {
+            while (--i >= 0) {
+                (void) close(socs[i]);
+            }
+            return;
+        }
+        if (scheme == SCHEME_EPOLL || scheme == SCHEME_EPOLLEX) {
+            (void) fcntl(socs[i], F_SETFL, O_NONBLOCK);
+        }
+    }
+    if (scheme == SCHEME_CBPF && attach_cbpf(socs[0], nworkers) == -1) {
+        (void) printf("%-10s (unsupported)\n", g_scheme_name[scheme]);
+        for (i = 0; i < nsoc; i++) {
+            (void) close(socs[i]);
+        }
+        return;
+    }
+    lock_fd = -1;
+    if (scheme == SCHEME_LOCKF) {
+        if ((lock_fd = open("./accept-bench.lock", O_RDWR | O_CREAT, 0666)) == -1) {
+            perror("open");
+            (void) close(socs[0]);
+            return;
+        }
+        (void) unlink("./accept-bench.lock");
+    }
+
+    /* 2) ワーカー */
+    for (i = 0; i < nworkers; i++) {
+        if ((wpid[i] = fork()) == 0) {
+            if (scheme == SCHEME_CBPF) {
+                CPU_ZERO(&cpus);
+                CPU_SET(i % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+                (void) sched_setaffinity(0, sizeof(cpus), &cpus);
+            }
+            worker(scheme, socs[nsoc > 1 ? i : 0], lock_fd, sh, &sh->w[i]);
+            _exit(1);
+        }
+    }
+    (void) usleep(200 * 1000);
+    csw0 = 0;
+    for (i = 0; i < nworkers; i++) {
+        csw0 += voluntary_csw(wpid[i]);
+    }
+
+    /* 3) クライアント */
+    if (pipe(pfd) == -1) {
+        perror("pipe");
+        return;
+    }
+    for (i = 0; i < nclients; i++) {
+        if ((pid = fork()) == 0) {
+            (void) close(pfd[1]);
+            (void) read(pfd[0], &ch, 1);        /* 親が close するまで待つ */
+            client(port, conns / nclients);
+            _exit(0);
+        }
+    }
+    (void) close(pfd[0]);
+    t0 = now_sec();
+    (void) close(pfd[1]);
+    for (i = 0; i < nclients; i++) {
+        (void) wait(NULL);
+    }
+    t1 = now_sec();
+
+    /* 4) 後始末と集計 */
+    (void) usleep(100 * 1000);                  /* 最後の accept の数え終わりを待つ */
+    csw1 = 0;
+    for (i = 0; i < nworkers; i++) {
+        csw1 += voluntary_csw(wpid[i]);
+    }
+    for (i = 0; i < nworkers; i++) {
+        (void) kill(wpid[i], SIGKILL);
+    }
+    for (i = 0; i < nworkers; i++) {
+        (void) waitpid(wpid[i], NULL, 0);
+    }
+    for (i = 0; i < nsoc; i++) {
+        (void) close(socs[i]);
+    }
+    if (lock_fd != -1) {
+        (void) close(lock_fd);
+    }
+
+    acc_total = wake_total = 0;
+    amax = 0;
+    amin = -1;
+    for (i = 0; i < nworkers; i++) {
+        a = sh->w[i].accepts;
+        acc_total += a;
+        wake_total += sh->w[i].wakeups;
+        amax = a > amax ? a : amax;
+        amin = (amin == -1 || a < amin) ? a : amin;
+    }
+    mean = (double) acc_total / nworkers;
+    var = 0.0;
+    for (i = 0; i < nworkers; i++) {
+        var += ((double) sh->w[i].accepts - mean) * ((double) sh->w[i].accepts - mean);
+    }
+    cv = mean > 0 ? sqrt(var / nworkers) / mean : 0.0;
+
+    (void) printf("%-10s %8ld %9.0f conn/s  max/min=%ld/%ld  cv=%5.3f"
+                  "  wake/acc=%5.2f  csw/acc=%5.2f\n",
+                  g_scheme_name[scheme], acc_total, (double) acc_total / (t1 - t0),
+                  amax, amin, cv,
+                  acc_total > 0 ? (double) wake_total / (double) acc_total : 0.0,
+                  acc_total > 0 ? (double) (csw1 - csw0) / (double) acc_total : 0.0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct shared *sh;
+    long conns;
+    int port, nworkers, nclients, k;
+
+    if (argc <= 1) {
+        (void) fprintf(stderr, "accept-bench port [workers [conns [clients]]]\n");
+        return (1);
+    }
+    port = atoi(argv[1]);
+    nworkers = argc > 2 ? atoi(argv[2]) : WORKERS;
+    conns = argc > 3 ? atol(argv[3]) : CONNS;
+    nclients = argc > 4 ? atoi(argv[4]) : CLIENTS;
+    if (port <= 0 || nworkers < 1 || nworkers > MAX_WORKERS || conns < 1 || nclients < 1) {
+        (void) fprintf(stderr, "accept-bench port [workers(1..%d) [conns [clients]]]\n",
+                       MAX_WORKERS);
+        return (1);
+    }
+
+    if ((sh = mmap(NULL, sizeof(*sh), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        perror("mmap");
+        return (1);
+    }
+
+    (void) printf("workers=%d conns=%ld clients=%d cpus=%ld\n",
+                  nworkers, conns, nclients, sysconf(_SC_NPROCESSORS_ONLN));
+    for (k = 0; k < NUM_SCHEMES; k++) {
+        run(k, port + k, nworkers, conns, nclients, sh);
+    }
+
+    (void) munmap(sh, sizeof(*sh));
+    return (0);
+}
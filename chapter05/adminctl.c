@@ -0,0 +1,98 @@
+/*
+ * adminctl: サーバの管理用ソケット（admin）にコマンドを 1 つ送り、応答を表示する
+ *
+ * 使い方：
+ *   adminctl path command [args...]
+ *     - path    : サーバが起動時に表示する管理用ソケットのパス
+ *                 （例 /tmp/server4.10000.admin）
+ *     - command : stats / conns / set KEY VALUE / drain / dump-histograms
+ *                 （args は空白 1 つでつないで 1 行にして送る）
+ *
+ * 動き：
+ * 1) AF_UNIX の SOCK_STREAM で path に connect
+ * 2) コマンドを 1 行（末尾 "\n"）送る
+ * 3) サーバが応答を書き終えて閉じるまで（EOF まで）読み、そのまま標準出力へ
+ *
+ * 戻り値：応答の 1 行目が "ERR" で始まれば EX_DATAERR、接続できなければ EX_UNAVAILABLE
+ */
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <unistd.h>
+
+int
+main(int argc, char *argv[])
+{
+    struct sockaddr_un sun;
+    char line[256], buf[4096];
+    size_t len;
+    ssize_t n;
+    int soc, i, first, err;
+
+    if (argc <= 2) {
+        (void) fprintf(stderr, "adminctl path command [args...]\n");
+        return (EX_USAGE);
+    }
+
+    /* コマンドを 1 行にまとめる */
+    line[0] = '\0';
+    len = 0;
+    for (i = 2; i < argc; i++) {
+        n = snprintf(line + len, sizeof(line) - len, "%s%s", i > 2 ? " " : "", argv[i]);
+        if (n < 0 || (size_t) n >= sizeof(line) - len - 1) {
+            (void) fprintf(stderr, "command too long\n");
+            return (EX_USAGE);
+        }
+        len += (size_t) n;
+    }
+    line[len++] = '\n';
+
+    if ((soc = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("socket");
+        return (EX_OSERR);
+    }
+    (void) memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(sun.sun_path)) {
+        (void) fprintf(stderr, "%s: path too long\n", argv[1]);
+        return (EX_USAGE);
+    }
+    (void) strcpy(sun.sun_path, argv[1]);
+    if (connect(soc, (struct sockaddr *) &sun, sizeof(sun)) == -1) {
+        perror(argv[1]);
+        (void) close(soc);
+        return (EX_UNAVAILABLE);
+    }
+    if (send(soc, line, len, MSG_NOSIGNAL) != (ssize_t) len) {
+        perror("send");
+        (void) close(soc);
+        return (EX_IOERR);
+    }
+
+    /* 応答を EOF まで中継する（1 行目だけ ERR かどうかを見る） */
+    first = 1;
+    err = 0;
+    while ((n = recv(soc, buf, sizeof(buf), 0)) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recv");
+            break;
+        }
+        if (first) {
+            err = n >= 3 && strncmp(buf, "ERR", 3) == 0;
+            first = 0;
+        }
+        (void) fwrite(buf, 1, (size_t) n, stdout);
+    }
+    (void) close(soc);
+    return (err ? EX_DATAERR : EX_OK);
+}
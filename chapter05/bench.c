@@ -0,0 +1,1420 @@
+/*
+ * bench: server2〜server9 に負荷をかけて計測するためのクライアント（Linux 専用）
+ *
+ * 目的：
+ * - サーバ側の改善（accept のまとめ取りなど）が “本当に効いているか” を数値で確認する
+ * - 同一マシン（ループバック）上でサーバと組み合わせて使うことを想定している
+ *
+ * 使い方：
+ *   bench host port storm N
+ *     - N 本の接続を一斉に張り、各接続で 1 行送って応答 1 回を受け取る（接続ストーム）
+ *     - 応答が返った接続数 / 経過時間 を “accept レート” として表示する
+ *     - 応答前に切られた接続（サーバが満杯で捨てた等）は shed、"BUSY" が返った接続
+ *       （server4 / server9 の受け付け制御で断られた）は busy として数える
+ *   bench host port churn N [P]
+ *     - 同時 P 本（既定 1）で「接続 → 1 往復 → 切断」を合計 N 回繰り返す（接続チャーン）
+ *     - accept 経路（接続元アドレスの文字列化など）の 1 接続あたりコストが効いてくる
+ *   bench host port rounds N [R]
+ *     - N 本の接続を同時に張り、各接続で 1 行の往復を R 回（既定 100）繰り返す
+ *     - 多数のセッションが同時に動くときの処理能力（往復/秒）を表示する
+ *   bench host port pingpong N [GAP]
+ *     - 1 本の接続で 1 行の往復を N 回、1 回ずつ待って繰り返し（次を送るのは応答を受けてから）、
+ *       往復時間（RTT）の平均 / p50 / p99 / 最大を µs で表示する
+ *     - GAP（µs、既定 0）を指定すると往復の間にその時間だけ休む（server4 の busy-poll で、
+ *       回り続けている間に次が来るか、眠る epoll_wait に戻ってから来るかを比べる）
+ *   bench host port bulk N SIZE [R]
+ *     - N 本の接続（1 接続 1 スレッド）で、SIZE バイトの行（最後が "z\r\n"）を送っては
+ *       応答を "z:OK\r\n" まで読む往復を R 回（既定 100）繰り返し、msg/s と MB/s を表示する
+ *     - 大きな要求の受信（server4 の受信バッファの大きさ合わせ / SO_RCVLOWAT）を見る。
+ *       サーバは 1 回の recv ごとに応答するので、途中で分かれた分の応答は読み捨てる
+ *     - 行を全部送ってから応答を読むので、SIZE は送受信バッファに収まる程度（〜256KB）にする
+ *   bench host port peerfmt N
+ *     - サーバに接続せず、getnameinfo と format_peer の 1 回あたりの時間を比べる
+ *   bench host port respbuild N
+ *     - サーバに接続せず、応答組み立て（mystrlcat + strlen と mbuf）の 1 メッセージあたりの
+ *       時間を 512B / 64KB で比べる
+ *   bench host port idle N [PID]
+ *     - N 本の接続で 1 往復だけして張ったままにし、サーバ（PID）のスレッド数と
+ *       1 接続あたりの RSS / 仮想メモリを /proc から表示する
+ *   bench host port spawn N
+ *     - サーバに接続せず、スレッド生成（create+join）とワーカーへの受け渡し（mutex/cond）の
+ *       1 接続あたりのコストを比べる
+ *   bench host port hammer N PID
+ *     - 「接続 → 1 往復 → 切断」を N 回繰り返しながら、サーバ（PID）に SIGHUP を送り続ける
+ *       （HAMMER_EVERY 接続ごとに 1 回。その接続は張ったまま SIGHUP を送り、再起動を
+ *        またいで応答が返るか = 処理中のクライアントが切れないかも見る）
+ *     - chapter03/re-exec の再起動中に失われた接続を数える：
+ *       refused（connect 失敗）/ dropped（応答前に切られた）
+ *   bench host port upgrade N PID
+ *     - N 本の接続を張り、各接続で 1 往復したあと行の前半 "keep-" だけを送っておく
+ *     - サーバ（PID）に SIGHUP を送り、すぐに全接続で行の後半 "alive\r\n" を送って
+ *       "keep-alive:OK\r\n" が返るかを確かめる（chapter03/re-exec の upgrade モード用）
+ *     - ok / reset（切られた）/ mismatch（応答が違う = バイト欠け）と、
+ *       SIGHUP から最初の応答・全応答までの時間を表示する
+ *   bench host port drain N PID
+ *     - N 本の接続を張り、各接続で 1 行 "before\r\n" を送った（応答はまだ読まない）状態で
+ *       サーバ（PID）に SIGTERM を送る（server2〜server9 / chapter03 の drain 用）
+ *     - 新しい接続が拒否されるか、送ってあった要求の応答と、その後の 1 往復が
+ *       返るかを確かめてから 1 本ずつ閉じ、サーバが終了するまでの時間を表示する
+ *
+ * 全体アルゴリズム（storm）：
+ * 1) getaddrinfo で接続先を 1 回だけ解決しておく
+ * 2) N 本のソケットをノンブロッキングで作り、一斉に connect（EINPROGRESS）
+ * 3) epoll で
+ *    - EPOLLOUT（connect 完了）→ SO_ERROR を確認して 1 行 send → EPOLLIN 待ちへ
+ *    - EPOLLIN（応答到着）→ recv できたら ok、0/エラーなら shed として close
+ * 4) 全接続が終わる（またはタイムアウト）まで回し、経過時間からレートを出す
+ *
+ * 注意：
+ * - サーバ側の listen バックログ（SOMAXCONN）を超える接続は SYN が再送されるので、
+ *   N を大きくすると 1 秒単位の待ちが混ざる（それ自体がストームの実態でもある）
+ */
+
+#include <sys/epoll.h>
+#include <sys/param.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sysexits.h>
+#include <time.h>
+#include <unistd.h>
+
+/* 1 回の計測の最大待ち時間（秒） */
+#define BENCH_TIMEOUT (30)
+
+/* hammer：何接続ごとに SIGHUP を送るか */
+#define HAMMER_EVERY (50)
+
+/* 接続ごとの状態（storm/churn 用） */
+#define ST_CONNECTING 0                 /* connect 完了待ち */
+#define ST_WAITING    1                 /* 応答待ち */
+#define ST_DONE       2                 /* 終了（close 済み） */
+#define ST_IDLE       3                 /* 応答済みで、張ったまま放置（idle 用） */
+
+/* 接続先アドレス（main で 1 回だけ解決する） */
+struct addrinfo *g_res0;
+
+/* 単調増加時計の現在値（秒） */
+double
+now_sec(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec + (double) ts.tv_nsec / 1e9);
+}
+
+/* RLIMIT_NOFILE をハードリミットまで引き上げる（大量接続を張るため） */
+void
+raise_nofile_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        perror("getrlimit");
+        return;
+    }
+    rl.rlim_cur = rl.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        perror("setrlimit");
+    }
+}
+
+/* ノンブロッキング connect を開始する
+ *
+ * 戻り値：
+ * - 成功：ソケット FD（connect は進行中または完了）
+ * - 失敗：-1
+ */
+int
+connect_nonblock(void)
+{
+    int soc;
+
+    if ((soc = socket(g_res0->ai_family, g_res0->ai_socktype | SOCK_NONBLOCK,
+                      g_res0->ai_protocol)) == -1) {
+        perror("socket");
+        return (-1);
+    }
+    if (connect(soc, g_res0->ai_addr, g_res0->ai_addrlen) == -1
+        && errno != EINPROGRESS) {
+        perror("connect");
+        (void) close(soc);
+        return (-1);
+    }
+    return (soc);
+}
+
+/* 接続ストーム / 接続チャーン（共通部）
+ *
+ * name     : 表示用のモード名
+ * n        : 合計で張る接続数
+ * parallel : 同時に張っておく接続数
+ *            - storm : parallel = n（全部を一斉に張る）
+ *            - churn : parallel は小さめ（接続→1往復→切断 を繰り返す）
+ *
+ * 表示：
+ * - ok   : 応答が返った（= サーバが accept して処理した）接続数
+ * - shed : 応答前に切断/エラーになった接続数
+ * - busy : 応答が "BUSY"（サーバが過負荷 / 満杯で断った）だった接続数
+ * - rate : ok / 経過時間（接続レート）
+ */
+int
+bench_conns(const char *name, int n, int parallel)
+{
+    struct epoll_event ev, *events;
+    int *state;
+    int epollfd, i, nfds, fd, err, live, started, ok, shed, busy, maxfd;
+    socklen_t errlen;
+    double start, elapsed;
+    ssize_t len;
+    char buf[512];
+
+    maxfd = parallel + 1024;
+    if ((state = calloc(maxfd, sizeof(int))) == NULL
+        || (events = malloc(sizeof(struct epoll_event) * 1024)) == NULL) {
+        perror("malloc");
+        return (-1);
+    }
+    if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return (-1);
+    }
+
+    start = now_sec();
+    live = started = ok = shed = busy = 0;
+
+    for (;;) {
+        /* 同時接続数が parallel になるまで connect を開始する */
+        while (live < parallel && started < n) {
+            if ((fd = connect_nonblock()) == -1) {
+                break;
+            }
+            if (fd >= maxfd) {
+                (void) close(fd);
+                break;
+            }
+            state[fd] = ST_CONNECTING;
+            ev.data.fd = fd;
+            ev.events = EPOLLOUT;
+            (void) epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+            live++;
+            started++;
+        }
+        if (live == 0 || now_sec() - start >= BENCH_TIMEOUT) {
+            break;
+        }
+
+        if ((nfds = epoll_wait(epollfd, events, 1024, 1000)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (i = 0; i < nfds; i++) {
+            fd = events[i].data.fd;
+            if (state[fd] == ST_CONNECTING) {
+                /* connect 完了：結果は SO_ERROR で確認する */
+                errlen = (socklen_t) sizeof(err);
+                err = 0;
+                (void) getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+                if (err != 0 || send(fd, "bench\r\n", 7, MSG_NOSIGNAL) == -1) {
+                    shed++;
+                    state[fd] = ST_DONE;
+                    (void) close(fd);
+                    live--;
+                    continue;
+                }
+                state[fd] = ST_WAITING;
+                ev.data.fd = fd;
+                ev.events = EPOLLIN;
+                (void) epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+            } else if (state[fd] == ST_WAITING) {
+                /* 応答到着（または切断） */
+                if ((len = recv(fd, buf, sizeof(buf), 0)) >= 4 && memcmp(buf, "BUSY", 4) == 0) {
+                    busy++;
+                } else if (len > 0) {
+                    ok++;
+                } else {
+                    shed++;
+                }
+                state[fd] = ST_DONE;
+                (void) close(fd);
+                live--;
+            }
+        }
+    }
+    elapsed = now_sec() - start;
+
+    (void) printf("%s: n=%d parallel=%d ok=%d shed=%d busy=%d timeout=%d elapsed=%.3fs"
+                  " rate=%.0f conn/s\n",
+                  name, n, parallel, ok, shed, busy, live, elapsed, ok / elapsed);
+
+    (void) close(epollfd);
+    free(events);
+    free(state);
+    return (0);
+}
+
+/* 多重往復（rounds）
+ *
+ * n : 同時に張る接続数
+ * r : 1 接続あたりの往復回数
+ *
+ * n 本の接続を張り、各接続で「1 行送る → 応答を受け取る」を r 回繰り返してから切断する。
+ * 多数のセッションが同時に動いているときの処理能力（往復/秒）を見る。
+ * - ok   : r 回の往復を終えた接続数
+ * - shed : 途中で切断/エラーになった接続数
+ * - busy : 最初の応答が "BUSY"（サーバが過負荷 / 満杯で断った）だった接続数
+ */
+int
+bench_rounds(int n, int r)
+{
+    struct epoll_event ev, *events;
+    int *state, *done;
+    int epollfd, i, nfds, fd, err, live, ok, shed, busy, maxfd;
+    long msgs;
+    socklen_t errlen;
+    double start, elapsed;
+    ssize_t len;
+    char buf[512];
+
+    maxfd = n + 1024;
+    if ((state = calloc(maxfd, sizeof(int))) == NULL
+        || (done = calloc(maxfd, sizeof(int))) == NULL
+        || (events = malloc(sizeof(struct epoll_event) * 1024)) == NULL) {
+        perror("malloc");
+        return (-1);
+    }
+    for (fd = 0; fd < maxfd; fd++) {
+        state[fd] = ST_DONE;
+    }
+    if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return (-1);
+    }
+
+    start = now_sec();
+    live = ok = shed = busy = 0;
+    msgs = 0;
+    for (i = 0; i < n; i++) {
+        if ((fd = connect_nonblock()) == -1) {
+            break;
+        }
+        if (fd >= maxfd) {
+            (void) close(fd);
+            break;
+        }
+        state[fd] = ST_CONNECTING;
+        done[fd] = 0;
+        ev.data.fd = fd;
+        ev.events = EPOLLOUT;
+        (void) epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+        live++;
+    }
+
+    while (live > 0 && now_sec() - start < BENCH_TIMEOUT) {
+        if ((nfds = epoll_wait(epollfd, events, 1024, 1000)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (i = 0; i < nfds; i++) {
+            fd = events[i].data.fd;
+            if (state[fd] == ST_CONNECTING) {
+                errlen = (socklen_t) sizeof(err);
+                err = 0;
+                (void) getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+                if (err != 0 || send(fd, "rounds\r\n", 8, MSG_NOSIGNAL) == -1) {
+                    shed++;
+                    state[fd] = ST_DONE;
+                    (void) close(fd);
+                    live--;
+                    continue;
+                }
+                state[fd] = ST_WAITING;
+                ev.data.fd = fd;
+                ev.events = EPOLLIN;
+                (void) epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+            } else if (state[fd] == ST_WAITING) {
+                if ((len = recv(fd, buf, sizeof(buf), 0)) <= 0) {
+                    shed++;
+                } else if (done[fd] == 0 && len >= 4 && memcmp(buf, "BUSY", 4) == 0) {
+                    busy++;
+                } else if (++done[fd] < r) {
+                    /* 次の往復 */
+                    msgs++;
+                    if (send(fd, "rounds\r\n", 8, MSG_NOSIGNAL) != -1) {
+                        continue;
+                    }
+                    shed++;
+                } else {
+                    msgs++;
+                    ok++;
+                }
+                state[fd] = ST_DONE;
+                (void) close(fd);
+                live--;
+            }
+        }
+    }
+    elapsed = now_sec() - start;
+
+    (void) printf("rounds: n=%d r=%d ok=%d shed=%d busy=%d timeout=%d elapsed=%.3fs"
+                  " rate=%.0f msg/s\n",
+                  n, r, ok, shed, busy, live, elapsed, msgs / elapsed);
+
+    for (fd = 0; fd < maxfd; fd++) {
+        if (state[fd] == ST_CONNECTING || state[fd] == ST_WAITING) {
+            (void) close(fd);
+        }
+    }
+    (void) close(epollfd);
+    free(events);
+    free(done);
+    free(state);
+    return (0);
+}
+
+/* 接続元アドレス文字列の最大長（"IPv6アドレス:ポート" + NUL） */
+#define PEER_STRLEN (INET6_ADDRSTRLEN + 8)
+
+/* 10 進数の書き出し（format_peer の下請け） */
+char *
+put_dec(char *p, unsigned int v)
+{
+    char tmp[10];
+    int n;
+
+    n = 0;
+    do {
+        tmp[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0) {
+        *p++ = tmp[--n];
+    }
+    return (p);
+}
+
+/* 接続元アドレスの文字列化（getnameinfo を使わない高速版）
+ *
+ * ss  : accept で得た生のアドレス（AF_INET / AF_INET6）
+ * buf : 出力先（PEER_STRLEN バイト以上）
+ *
+ * 出力形式は getnameinfo(NI_NUMERICHOST | NI_NUMERICSERV) の host と port を
+ * ':' でつないだもの（"127.0.0.1:50000"）と同じ。
+ *
+ * - getnameinfo は NSS/ロケールを経由し、内部でも書式化を行うので accept 毎に呼ぶと重い
+ * - ここでは 10 進/16 進の変換を手で書き、malloc も snprintf も使わない
+ * - IPv6 は RFC 5952 に従い、最長の 0 の連続（2 グループ以上）を "::" に縮める
+ *
+ * 戻り値：書き込んだ文字数（NUL を除く）
+ */
+size_t
+format_peer(const struct sockaddr_storage *ss, char *buf)
+{
+    static const char hex[] = "0123456789abcdef";
+    const struct sockaddr_in *sin;
+    const struct sockaddr_in6 *sin6;
+    const unsigned char *a;
+    unsigned int port, w;
+    int i, j, best, bestlen, shift;
+    char *p;
+
+    p = buf;
+    switch (ss->ss_family) {
+    case AF_INET:
+        sin = (const struct sockaddr_in *) ss;
+        a = (const unsigned char *) &sin->sin_addr;
+        for (i = 0; i < 4; i++) {
+            if (i > 0) {
+                *p++ = '.';
+            }
+            p = put_dec(p, a[i]);
+        }
+        port = ntohs(sin->sin_port);
+        break;
+
+    case AF_INET6:
+        sin6 = (const struct sockaddr_in6 *) ss;
+        a = sin6->sin6_addr.s6_addr;
+
+        /* 最長の 0 グループの連続を探す */
+        best = -1;
+        bestlen = 0;
+        for (i = 0; i < 8; i = j + 1) {
+            for (j = i; j < 8 && a[2 * j] == 0 && a[2 * j + 1] == 0; j++)
+                ;
+            if (j - i >= 2 && j - i > bestlen) {
+                best = i;
+                bestlen = j - i;
+            }
+        }
+
+        if (best == 0
+            && (bestlen == 6 || (bestlen == 5 && a[10] == 0xff && a[11] == 0xff))) {
+            /* IPv4 射影/互換アドレス（::ffff:a.b.c.d, ::a.b.c.d）は末尾 32bit を 10 進で書く
+             * （inet_ntop/getnameinfo と同じ判定） */
+            *p++ = ':';
+            *p++ = ':';
+            if (bestlen == 5) {
+                (void) memcpy(p, "ffff:", 5);
+                p += 5;
+            }
+            for (j = 12; j < 16; j++) {
+                if (j > 12) {
+                    *p++ = '.';
+                }
+                p = put_dec(p, a[j]);
+            }
+        } else {
+            for (i = 0; i < 8; i++) {
+                if (i == best) {
+                    *p++ = ':';
+                    *p++ = ':';
+                    i += bestlen - 1;
+                    continue;
+                }
+                if (i > 0 && i != best + bestlen) {
+                    *p++ = ':';
+                }
+                w = ((unsigned int) a[2 * i] << 8) | a[2 * i + 1];
+                for (shift = 12; shift > 0 && ((w >> shift) & 0xf) == 0; shift -= 4)
+                    ;
+                for (; shift >= 0; shift -= 4) {
+                    *p++ = hex[(w >> shift) & 0xf];
+                }
+            }
+        }
+        port = ntohs(sin6->sin6_port);
+        break;
+
+    default:
+        *p++ = '?';
+        port = 0;
+        break;
+    }
+
+    *p++ = ':';
+    p = put_dec(p, port);
+    *p = '\0';
+    return ((size_t) (p - buf));
+}
+
+/* 接続元アドレス文字列化のマイクロベンチマーク
+ *
+ * n: 1 方式あたりの繰り返し回数
+ *
+ * accept のたびにサーバが行っていた getnameinfo(NI_NUMERICHOST | NI_NUMERICSERV)
+ * と、サーバ側に入れた format_peer を同じアドレスで n 回ずつ呼び、1 回あたりの時間を比べる。
+ */
+int
+bench_peerfmt(int n)
+{
+    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV], pbuf[PEER_STRLEN];
+    struct sockaddr_storage ss[2];
+    struct sockaddr_in *sin;
+    struct sockaddr_in6 *sin6;
+    double start, t_gni, t_fmt;
+    int i, k;
+
+    (void) memset(ss, 0, sizeof(ss));
+    sin = (struct sockaddr_in *) &ss[0];
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(50000);
+    (void) inet_pton(AF_INET, "192.168.10.200", &sin->sin_addr);
+    sin6 = (struct sockaddr_in6 *) &ss[1];
+    sin6->sin6_family = AF_INET6;
+    sin6->sin6_port = htons(50000);
+    (void) inet_pton(AF_INET6, "2001:db8::8a2e:370:7334", &sin6->sin6_addr);
+
+    for (k = 0; k < 2; k++) {
+        start = now_sec();
+        for (i = 0; i < n; i++) {
+            (void) getnameinfo((struct sockaddr *) &ss[k], sizeof(ss[k]),
+                               hbuf, sizeof(hbuf), sbuf, sizeof(sbuf),
+                               NI_NUMERICHOST | NI_NUMERICSERV);
+        }
+        t_gni = now_sec() - start;
+
+        start = now_sec();
+        for (i = 0; i < n; i++) {
+            (void) format_peer(&ss[k], pbuf);
+        }
+        t_fmt = now_sec() - start;
+
+        (void) printf("peerfmt(%s): getnameinfo=%.1f ns/call format_peer=%.1f ns/call (x%.1f)\n",
+                      k == 0 ? "IPv4" : "IPv6",
+                      t_gni * 1e9 / n, t_fmt * 1e9 / n, t_gni / t_fmt);
+    }
+    return (0);
+}
+
+/* サイズ指定文字列連結（strlcat 相当の安全版：サーバ側で使っていた旧方式。比較用） */
+size_t
+mystrlcat(char *dst, const char *src, size_t size)
+{
+    const char *ps;
+    char *pd, *pde;
+    size_t dlen, lest;
+
+    for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--)
+        ;
+    dlen = pd - dst;
+
+    if (size - dlen == 0) {
+        return (dlen + strlen(src));
+    }
+
+    pde = dst + size - 1;
+    for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
+        *pd = *ps;
+    }
+    for (; pd <= pde; pd++) {
+        *pd = '\0';
+    }
+
+    while (*ps++)
+        ;
+    return (dlen + (ps - src - 1));
+}
+
+/* 応答の末尾に付ける文字列（受信時にこの分の tailroom を残しておく） */
+#define RESP_SUFFIX     ":OK\r\n"
+#define RESP_SUFFIX_LEN (sizeof(RESP_SUFFIX) - 1)
+
+/* 長さ付きバッファ（応答組み立て用）
+ *
+ * base[0 .. size) の中で、データは base[off .. off+len) にある。
+ *
+ *   base                off            off+len                 size
+ *    |<-- headroom -->|<---- data ---->|<---- tailroom ---->|
+ *
+ * mystrlcat + strlen との違い：
+ * - 長さを持っているので、連結のたびに NUL を探して先頭から数え直さない（O(1) で追記）
+ * - NUL 終端を必要としないので、recv したバイト列をそのまま扱える
+ * - 先頭側にも空き（headroom）を取れるので、ヘッダ等を後から前に付けられる
+ * - データ部をそのまま iovec にして writev に渡せる
+ */
+struct mbuf {
+    char *base;                         /* 領域の先頭 */
+    size_t size;                        /* 領域の大きさ */
+    size_t off;                         /* データの開始位置 */
+    size_t len;                         /* データ長 */
+};
+
+#define MBUF_DATA(m_)     ((m_)->base + (m_)->off)
+#define MBUF_TAIL(m_)     ((m_)->base + (m_)->off + (m_)->len)
+#define MBUF_HEADROOM(m_) ((m_)->off)
+#define MBUF_TAILROOM(m_) ((m_)->size - (m_)->off - (m_)->len)
+
+/* 領域 base[0..size) を、先頭に headroom バイト空けた空のバッファとして使い始める */
+void
+mbuf_init(struct mbuf *m, char *base, size_t size, size_t headroom)
+{
+    m->base = base;
+    m->size = size;
+    m->off = headroom < size ? headroom : size;
+    m->len = 0;
+}
+
+/* 末尾に n バイト追記する（tailroom が足りなければ何もせず -1） */
+int
+mbuf_append(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_TAILROOM(m)) {
+        return (-1);
+    }
+    (void) memcpy(MBUF_TAIL(m), src, n);
+    m->len += n;
+    return (0);
+}
+
+/* 先頭に n バイト付け足す（headroom が足りなければ何もせず -1） */
+int
+mbuf_prepend(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_HEADROOM(m)) {
+        return (-1);
+    }
+    m->off -= n;
+    m->len += n;
+    (void) memcpy(MBUF_DATA(m), src, n);
+    return (0);
+}
+
+/* データ部を iovec に変換する（戻り値は writev に渡す要素数） */
+int
+mbuf_iov(const struct mbuf *m, struct iovec *iov)
+{
+    if (m->len == 0) {
+        return (0);
+    }
+    iov[0].iov_base = MBUF_DATA(m);
+    iov[0].iov_len = m->len;
+    return (1);
+}
+
+/* 応答組み立てのマイクロベンチマーク
+ *
+ * n: 1 方式・1 サイズあたりの繰り返し回数
+ *
+ * 受信済みの 1 行（size - ":OK\r\n" - 1 バイト）に ":OK\r\n" を付けて送信長を得るまでを、
+ * - 旧方式：buf[len] = '\0' → mystrlcat（NUL を探して連結）→ strlen（送信長）
+ * - 新方式：mbuf_append（長さ付きで末尾に追記）→ mbuf_iov（writev 用の iovec）
+ * で比べ、1 メッセージあたりの時間と差（節約できた CPU 時間）を表示する。
+ * サイズはサーバの受信バッファ（512B）と、大きなメッセージ（64KB）の 2 通り。
+ */
+int
+bench_respbuild(int n)
+{
+    static const size_t sizes[] = { 512, 64 * 1024 };
+    struct mbuf m;
+    struct iovec iov[1];
+    double start, t_old, t_new;
+    size_t k, len, sink;
+    char *buf;
+    int i;
+
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        if ((buf = malloc(sizes[k])) == NULL) {
+            perror("malloc");
+            return (-1);
+        }
+        len = sizes[k] - RESP_SUFFIX_LEN - 1;
+        (void) memset(buf, 'x', len);
+        sink = 0;
+
+        start = now_sec();
+        for (i = 0; i < n; i++) {
+            buf[len] = '\0';
+            (void) mystrlcat(buf, RESP_SUFFIX, sizes[k]);
+            sink += strlen(buf);
+        }
+        t_old = now_sec() - start;
+
+        start = now_sec();
+        for (i = 0; i < n; i++) {
+            mbuf_init(&m, buf, sizes[k], 0);
+            m.len = len;
+            (void) mbuf_append(&m, RESP_SUFFIX, RESP_SUFFIX_LEN);
+            (void) mbuf_iov(&m, iov);
+            sink += iov[0].iov_len;
+        }
+        t_new = now_sec() - start;
+
+        (void) printf("respbuild(%zuB): mystrlcat+strlen=%.1f ns/msg mbuf=%.1f ns/msg saved=%.1f ns/msg (sink=%zu)\n",
+                      sizes[k], t_old * 1e9 / n, t_new * 1e9 / n,
+                      (t_old - t_new) * 1e9 / n, sink);
+        free(buf);
+    }
+    return (0);
+}
+
+/* /proc/<pid>/status から VmRSS / VmSize（KB）と Threads を読む */
+int
+proc_status(long pid, long *rss_kb, long *vsz_kb, long *threads)
+{
+    char path[64], line[256];
+    FILE *fp;
+
+    (void) snprintf(path, sizeof(path), "/proc/%ld/status", pid);
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        return (-1);
+    }
+    *rss_kb = *vsz_kb = *threads = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        /* 一致しない行では値は変わらない */
+        (void) sscanf(line, "VmRSS: %ld", rss_kb);
+        (void) sscanf(line, "VmSize: %ld", vsz_kb);
+        (void) sscanf(line, "Threads: %ld", threads);
+    }
+    (void) fclose(fp);
+    return (0);
+}
+
+/* 放置接続（idle）
+ *
+ * n   : 張ったままにする接続数
+ * pid : サーバのプロセス ID（0 ならメモリ表示を省く。同じマシン上のサーバに限る）
+ *
+ * 各接続で 1 往復だけしたあと、切らずに保持する。
+ * 応答の来ない接続が IDLE_SETTLE 秒増えなくなった時点で、サーバの
+ * スレッド数・RSS・仮想メモリを接続前と比べ、1 接続あたりのメモリを出す。
+ *
+ * 表示：
+ * - ok      : 応答が返った（サーバがスレッド/ワーカーを割り当てた）接続数
+ * - shed    : 応答前に切断/エラーになった接続数（キュー満杯での reject など）
+ * - pending : 繋がったまま応答が来ない接続数（ワーカー空き待ちでキューにいる等）
+ * - first   : connect 開始から最初の応答までの時間（平均 / 99% / 最大）
+ *             接続ごとにスレッドを起こすサーバでは、スレッド起動の遅延がここに出る
+ */
+#define IDLE_SETTLE (3)
+
+/* qsort 用（double の昇順） */
+int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x < y ? -1 : x > y ? 1 : 0);
+}
+
+/* 1 接続の往復時間（pingpong）
+ *
+ * - ブロッキングのソケットで send → recv を N 回繰り返し、1 回ごとの時間を記録する
+ * - 先に 1 往復して接続を温めておく（accept と最初のページフォルトを計測から外す）
+ * - TCP_NODELAY は付けない（1 行送るだけで、前の応答は受け取り済みなので Nagle で待たない）
+ */
+int
+bench_pingpong(int n, long gap_us)
+{
+    struct timeval tv;
+    char buf[512];
+    double *rtt, t0, sum;
+    int soc, i, ok;
+
+    if (n <= 0 || (rtt = calloc((size_t) n, sizeof(double))) == NULL) {
+        perror("calloc");
+        return (-1);
+    }
+    if ((soc = socket(g_res0->ai_family, g_res0->ai_socktype, g_res0->ai_protocol)) == -1
+        || connect(soc, g_res0->ai_addr, g_res0->ai_addrlen) == -1) {
+        perror("connect");
+        free(rtt);
+        return (-1);
+    }
+    tv.tv_sec = 10;
+    tv.tv_usec = 0;
+    (void) setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (send(soc, "warmup\r\n", 8, MSG_NOSIGNAL) == -1 || recv(soc, buf, sizeof(buf), 0) <= 0) {
+        perror("warmup");
+    }
+
+    sum = 0.0;
+    for (ok = 0, i = 0; i < n; i++) {
+        if (gap_us > 0) {
+            (void) usleep((useconds_t) gap_us);
+        }
+        t0 = now_sec();
+        if (send(soc, "ping\r\n", 6, MSG_NOSIGNAL) == -1 || recv(soc, buf, sizeof(buf), 0) <= 0) {
+            perror("pingpong");
+            break;
+        }
+        rtt[ok] = (now_sec() - t0) * 1e6;
+        sum += rtt[ok++];
+    }
+    (void) close(soc);
+
+    if (ok > 0) {
+        qsort(rtt, (size_t) ok, sizeof(double), cmp_double);
+        (void) printf("pingpong: n=%d gap=%ldus avg=%.1fus p50=%.1fus p99=%.1fus max=%.1fus\n",
+                      ok, gap_us, sum / ok, rtt[ok / 2], rtt[(int) (ok * 0.99)], rtt[ok - 1]);
+    }
+    free(rtt);
+    return (0);
+}
+
+/* bulk：1 スレッド分の引数と結果 */
+struct bulk_arg {
+    int size;                   /* 1 行のバイト数 */
+    int r;                      /* 往復の回数 */
+    int ok;                     /* 応答まで終わった往復 */
+};
+
+/* bulk：1 接続で SIZE バイトの行を R 回往復する */
+void *
+bulk_worker(void *arg)
+{
+    static const char want[] = "z:OK\r\n";
+    struct bulk_arg *b = arg;
+    struct timeval tv;
+    char *msg, buf[65536], tail[sizeof(want) - 1];
+    size_t done, tn;
+    ssize_t len;
+    int soc, i;
+
+    if ((msg = malloc((size_t) b->size)) == NULL) {
+        perror("malloc");
+        return (NULL);
+    }
+    (void) memset(msg, 'x', (size_t) b->size - 3);
+    (void) memcpy(msg + b->size - 3, "z\r\n", 3);
+    if ((soc = socket(g_res0->ai_family, g_res0->ai_socktype, g_res0->ai_protocol)) == -1
+        || connect(soc, g_res0->ai_addr, g_res0->ai_addrlen) == -1) {
+        perror("connect");
+        free(msg);
+        return (NULL);
+    }
+    tv.tv_sec = 10;
+    tv.tv_usec = 0;
+    (void) setsockopt(soc, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    for (i = 0; i < b->r; i++) {
+        for (done = 0; done < (size_t) b->size; done += (size_t) len) {
+            if ((len = send(soc, msg + done, (size_t) b->size - done, MSG_NOSIGNAL)) == -1) {
+                perror("send");
+                goto out;
+            }
+        }
+        /* 応答の末尾（直近 sizeof(want) - 1 バイト）が "z:OK\r\n" になるまで読む */
+        tn = 0;
+        while (tn < sizeof(tail) || memcmp(tail, want, sizeof(tail)) != 0) {
+            if ((len = recv(soc, buf, sizeof(buf), 0)) <= 0) {
+                perror("recv");
+                goto out;
+            }
+            if ((size_t) len >= sizeof(tail)) {
+                (void) memcpy(tail, buf + len - sizeof(tail), sizeof(tail));
+            } else {
+                (void) memmove(tail, tail + len, sizeof(tail) - (size_t) len);
+                (void) memcpy(tail + sizeof(tail) - len, buf, (size_t) len);
+            }
+            tn += (size_t) len;
+        }
+        b->ok++;
+    }
+out:
+    (void) close(soc);
+    free(msg);
+    return (NULL);
+}
+
+/* 大きな要求の往復（bulk） */
+int
+bench_bulk(int n, int size, int r)
+{
+    struct bulk_arg *args;
+    pthread_t *ids;
+    double start, elapsed;
+    long ok;
+    int i;
+
+    if (n <= 0 || size < 4 || r <= 0) {
+        (void) fprintf(stderr, "bulk: N > 0, SIZE >= 4, R > 0\n");
+        return (-1);
+    }
+    if ((args = calloc((size_t) n, sizeof(struct bulk_arg))) == NULL
+        || (ids = calloc((size_t) n, sizeof(pthread_t))) == NULL) {
+        perror("calloc");
+        return (-1);
+    }
+    start = now_sec();
+    for (i = 0; i < n; i++) {
+        args[i].size = size;
+        args[i].r = r;
+        if (pthread_create(&ids[i], NULL, bulk_worker, &args[i]) != 0) {
+            perror("pthread_create");
+            n = i;
+            break;
+        }
+    }
+    for (ok = 0, i = 0; i < n; i++) {
+        (void) pthread_join(ids[i], NULL);
+        ok += args[i].ok;
+    }
+    elapsed = now_sec() - start;
+    (void) printf("bulk: n=%d size=%d r=%d ok=%ld elapsed=%.3fs rate=%.0f msg/s %.1f MB/s\n",
+                  n, size, r, ok, elapsed, ok / elapsed, ok * (double) size / elapsed / 1e6);
+    free(ids);
+    free(args);
+    return (0);
+}
+
+int
+bench_idle(int n, long pid)
+{
+    struct epoll_event ev, *events;
+    int *state;
+    int epollfd, i, nfds, fd, err, ok, shed, maxfd, held;
+    long rss0, vsz0, thr0, rss1, vsz1, thr1;
+    socklen_t errlen;
+    double start, last, *t0, *lat, sum;
+    char buf[512];
+
+    maxfd = n + 1024;
+    if ((state = calloc(maxfd, sizeof(int))) == NULL
+        || (t0 = calloc(maxfd, sizeof(double))) == NULL
+        || (lat = calloc(n + 1, sizeof(double))) == NULL
+        || (events = malloc(sizeof(struct epoll_event) * 1024)) == NULL) {
+        perror("malloc");
+        return (-1);
+    }
+    for (fd = 0; fd < maxfd; fd++) {
+        state[fd] = ST_DONE;
+    }
+    if ((epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return (-1);
+    }
+    if (pid > 0 && proc_status(pid, &rss0, &vsz0, &thr0) == -1) {
+        pid = 0;
+    }
+
+    start = now_sec();
+    ok = shed = held = 0;
+    for (i = 0; i < n; i++) {
+        if ((fd = connect_nonblock()) == -1) {
+            break;
+        }
+        if (fd >= maxfd) {
+            (void) close(fd);
+            break;
+        }
+        state[fd] = ST_CONNECTING;
+        t0[fd] = now_sec();
+        ev.data.fd = fd;
+        ev.events = EPOLLOUT;
+        (void) epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev);
+        held++;
+    }
+
+    last = now_sec();
+    while (ok + shed < held && now_sec() - last < IDLE_SETTLE
+           && now_sec() - start < BENCH_TIMEOUT) {
+        if ((nfds = epoll_wait(epollfd, events, 1024, 500)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            break;
+        }
+        for (i = 0; i < nfds; i++) {
+            fd = events[i].data.fd;
+            last = now_sec();
+            if (state[fd] == ST_CONNECTING) {
+                errlen = (socklen_t) sizeof(err);
+                err = 0;
+                (void) getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+                if (err != 0 || send(fd, "idle\r\n", 6, MSG_NOSIGNAL) == -1) {
+                    shed++;
+                    state[fd] = ST_DONE;
+                    (void) close(fd);
+                    continue;
+                }
+                state[fd] = ST_WAITING;
+                ev.data.fd = fd;
+                ev.events = EPOLLIN;
+                (void) epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &ev);
+            } else if (state[fd] == ST_WAITING) {
+                if (recv(fd, buf, sizeof(buf), 0) > 0) {
+                    /* 応答が来た：監視を外し、接続は張ったまま置いておく */
+                    lat[ok] = now_sec() - t0[fd];
+                    ok++;
+                    state[fd] = ST_IDLE;
+                    (void) epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, &ev);
+                } else {
+                    shed++;
+                    state[fd] = ST_DONE;
+                    (void) close(fd);
+                }
+            }
+        }
+    }
+
+    (void) printf("idle: n=%d ok=%d shed=%d pending=%d elapsed=%.3fs\n",
+                  n, ok, shed, held - ok - shed, now_sec() - start);
+    if (ok > 0) {
+        qsort(lat, ok, sizeof(double), cmp_double);
+        for (i = 0, sum = 0; i < ok; i++) {
+            sum += lat[i];
+        }
+        (void) printf("idle: first avg=%.3fms p99=%.3fms max=%.3fms\n",
+                      sum / ok * 1e3, lat[(int) (ok * 0.99)] * 1e3, lat[ok - 1] * 1e3);
+    }
+    if (pid > 0 && proc_status(pid, &rss1, &vsz1, &thr1) == 0) {
+        (void) printf("idle: server threads=%ld->%ld rss=%ldKB->%ldKB vsz=%ldKB->%ldKB\n",
+                      thr0, thr1, rss0, rss1, vsz0, vsz1);
+        (void) printf("idle: per-connection rss=%.1fKB vsz=%.1fKB\n",
+                      (double) (rss1 - rss0) / (held - shed > 0 ? held - shed : 1),
+                      (double) (vsz1 - vsz0) / (held - shed > 0 ? held - shed : 1));
+    }
+
+    for (fd = 0; fd < maxfd; fd++) {
+        if (state[fd] != ST_DONE) {
+            (void) close(fd);
+        }
+    }
+    (void) close(epollfd);
+    free(events);
+    free(lat);
+    free(t0);
+    free(state);
+    return (0);
+}
+
+/* スレッド生成と受け渡しのコスト比較（spawn 用）
+ *
+ * - create : pthread_create + pthread_join（何もしないスレッド）を n 回
+ *            → server6 の thread モードが接続ごとに払うコストに相当
+ * - handoff: 起動済みのワーカー 1 本に mutex/cond で仕事を渡し、終わりを待つ を n 回
+ *            → pool モードで接続 FD をワーカーに渡すコストに相当
+ */
+pthread_mutex_t g_spawn_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_spawn_cond = PTHREAD_COND_INITIALIZER;
+int g_spawn_pending;                    /* 1: 仕事あり / 0: 無し / -1: 終了 */
+
+void *
+spawn_nop(void *arg)
+{
+    return (arg);
+}
+
+void *
+spawn_worker(void *arg)
+{
+    (void) arg;
+    (void) pthread_mutex_lock(&g_spawn_mutex);
+    for (;;) {
+        while (g_spawn_pending == 0) {
+            (void) pthread_cond_wait(&g_spawn_cond, &g_spawn_mutex);
+        }
+        if (g_spawn_pending == -1) {
+            break;
+        }
+        g_spawn_pending = 0;
+        (void) pthread_cond_broadcast(&g_spawn_cond);
+    }
+    (void) pthread_mutex_unlock(&g_spawn_mutex);
+    return (NULL);
+}
+
+int
+bench_spawn(int n)
+{
+    pthread_t id;
+    double start, t_create, t_handoff;
+    int i;
+
+    start = now_sec();
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&id, NULL, spawn_nop, NULL) != 0) {
+            perror("pthread_create");
+            return (-1);
+        }
+        (void) pthread_join(id, NULL);
+    }
+    t_create = now_sec() - start;
+
+    if (pthread_create(&id, NULL, spawn_worker, NULL) != 0) {
+        perror("pthread_create");
+        return (-1);
+    }
+    start = now_sec();
+    for (i = 0; i < n; i++) {
+        (void) pthread_mutex_lock(&g_spawn_mutex);
+        g_spawn_pending = 1;
+        (void) pthread_cond_broadcast(&g_spawn_cond);
+        while (g_spawn_pending != 0) {
+            (void) pthread_cond_wait(&g_spawn_cond, &g_spawn_mutex);
+        }
+        (void) pthread_mutex_unlock(&g_spawn_mutex);
+    }
+    t_handoff = now_sec() - start;
+
+    (void) pthread_mutex_lock(&g_spawn_mutex);
+    g_spawn_pending = -1;
+    (void) pthread_cond_broadcast(&g_spawn_cond);
+    (void) pthread_mutex_unlock(&g_spawn_mutex);
+    (void) pthread_join(id, NULL);
+
+    (void) printf("spawn: create+join=%.0f ns/conn handoff=%.0f ns/conn saved=%.0f ns/conn\n",
+                  t_create * 1e9 / n, t_handoff * 1e9 / n,
+                  (t_create - t_handoff) * 1e9 / n);
+    return (0);
+}
+
+/* 再起動をまたいだ接続の失敗数（hammer 用）
+ *
+ * アルゴリズム（1 接続ぶん。すべてブロッキング）：
+ *   1) socket → connect（失敗なら refused）
+ *   2) HAMMER_EVERY 接続ごとに、この接続を張ったまま SIGHUP を送って 2ms 待つ
+ *      （サーバは accept 済みのこの接続を抱えたまま再起動しようとする）
+ *   3) 1 行 send → 応答を recv（エラー / EOF なら dropped）
+ *   4) close
+ *   最後に ok / refused / dropped と送った SIGHUP の数、最も遅かった 1 往復を表示する
+ */
+int
+bench_hammer(int n, long pid)
+{
+    static const char line[] = "hammer\r\n";
+    char buf[256];
+    double start, t0, t, worst;
+    int i, soc, ok, refused, dropped, hups;
+    ssize_t len;
+
+    if (pid <= 0) {
+        (void) fprintf(stderr, "hammer: server PID is required\n");
+        return (-1);
+    }
+    ok = refused = dropped = hups = 0;
+    worst = 0.0;
+    start = now_sec();
+    for (i = 0; i < n; i++) {
+        t0 = now_sec();
+        if ((soc = socket(g_res0->ai_family, g_res0->ai_socktype, g_res0->ai_protocol)) == -1) {
+            perror("socket");
+            return (-1);
+        }
+        if (connect(soc, g_res0->ai_addr, g_res0->ai_addrlen) == -1) {
+            refused++;
+            (void) close(soc);
+            continue;
+        }
+        if (i % HAMMER_EVERY == HAMMER_EVERY - 1) {
+            if (kill((pid_t) pid, SIGHUP) == -1) {
+                perror("kill");
+                (void) close(soc);
+                return (-1);
+            }
+            hups++;
+            (void) usleep(2000);
+        }
+        if (send(soc, line, sizeof(line) - 1, MSG_NOSIGNAL) == -1
+            || (len = recv(soc, buf, sizeof(buf), 0)) <= 0) {
+            dropped++;
+        } else {
+            ok++;
+        }
+        (void) close(soc);
+        if ((t = now_sec() - t0) > worst) {
+            worst = t;
+        }
+    }
+    (void) printf("hammer: n=%d ok=%d refused=%d dropped=%d sighup=%d elapsed=%.3fs worst=%.1fms\n",
+                  n, ok, refused, dropped, hups, now_sec() - start, worst * 1e3);
+    return (0);
+}
+
+/* 接続ごとの引き継ぎの確認（upgrade 用）
+ *
+ * アルゴリズム（すべてブロッキング。recv には 10 秒のタイムアウトを付ける）：
+ *   1) N 本の接続それぞれで "hello\r\n" を送って応答を受け取り、続けて "keep-" だけ送る
+ *      （サーバのアプリ側バッファに途中までの行が残る）
+ *   2) SIGHUP を送る（サーバは新しいバイナリに全接続を渡す）
+ *   3) 全接続で "alive\r\n" を送り、"keep-alive:OK\r\n" が返るかを見る
+ */
+int
+bench_upgrade(int n, long pid)
+{
+    static const char want[] = "keep-alive:OK\r\n";
+    struct timeval tv;
+    char buf[256];
+    double t0, first, last;
+    int *socs, i, ok, reset, mismatch;
+    ssize_t len;
+
+    if (pid <= 0) {
+        (void) fprintf(stderr, "upgrade: server PID is required\n");
+        return (-1);
+    }
+    if ((socs = calloc((size_t) n, sizeof(int))) == NULL) {
+        perror("calloc");
+        return (-1);
+    }
+    tv.tv_sec = 10;
+    tv.tv_usec = 0;
+    for (i = 0; i < n; i++) {
+        if ((socs[i] = socket(g_res0->ai_family, g_res0->ai_socktype, g_res0->ai_protocol)) == -1
+            || connect(socs[i], g_res0->ai_addr, g_res0->ai_addrlen) == -1) {
+            perror("connect");
+            n = i;
+            break;
+        }
+        (void) setsockopt(socs[i], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (send(socs[i], "hello\r\n", 7, MSG_NOSIGNAL) == -1
+            || recv(socs[i], buf, sizeof(buf), 0) <= 0
+            || send(socs[i], "keep-", 5, MSG_NOSIGNAL) == -1) {
+            perror("prepare");
+        }
+    }
+
+    if (kill((pid_t) pid, SIGHUP) == -1) {
+        perror("kill");
+        return (-1);
+    }
+    t0 = now_sec();
+    first = last = 0.0;
+    ok = reset = mismatch = 0;
+    for (i = 0; i < n; i++) {
+        if (send(socs[i], "alive\r\n", 7, MSG_NOSIGNAL) == -1
+            || (len = recv(socs[i], buf, sizeof(buf), 0)) <= 0) {
+            reset++;
+        } else if ((size_t) len != sizeof(want) - 1 || memcmp(buf, want, sizeof(want) - 1) != 0) {
+            mismatch++;
+        } else {
+            ok++;
+        }
+        last = now_sec() - t0;
+        if (i == 0) {
+            first = last;
+        }
+        (void) close(socs[i]);
+    }
+    free(socs);
+    (void) printf("upgrade: n=%d ok=%d reset=%d mismatch=%d first=%.1fms all=%.1fms\n",
+                  n, ok, reset, mismatch, first * 1e3, last * 1e3);
+    return (0);
+}
+
+/* SIGTERM をまたいだ処理中の要求の確認（drain 用）
+ *
+ * アルゴリズム（すべてブロッキング。recv には 10 秒のタイムアウトを付ける）：
+ *   1) N 本の接続それぞれで 1 往復し、続けて "before\r\n" を送っておく（応答は読まない）
+ *   2) SIGTERM を送り、少し待ってから新しい接続を 1 本試す（drain 中は拒否されるはず）
+ *   3) 全接続で "before:OK" を受け取り、さらに "after\r\n" の 1 往復をしてから close
+ *   4) kill(PID, 0) が ESRCH になる（サーバが終了する）までの時間を測る
+ */
+int
+bench_drain(int n, long pid)
+{
+    static const char want1[] = "before:OK\r\n", want2[] = "after:OK\r\n";
+    struct timeval tv;
+    char buf[256];
+    double t0, closed;
+    int *socs, i, soc, ok, reset, mismatch, refused;
+    ssize_t len;
+
+    if (pid <= 0) {
+        (void) fprintf(stderr, "drain: server PID is required\n");
+        return (-1);
+    }
+    if ((socs = calloc((size_t) n, sizeof(int))) == NULL) {
+        perror("calloc");
+        return (-1);
+    }
+    tv.tv_sec = 10;
+    tv.tv_usec = 0;
+    for (i = 0; i < n; i++) {
+        if ((socs[i] = socket(g_res0->ai_family, g_res0->ai_socktype, g_res0->ai_protocol)) == -1
+            || connect(socs[i], g_res0->ai_addr, g_res0->ai_addrlen) == -1) {
+            perror("connect");
+            n = i;
+            break;
+        }
+        (void) setsockopt(socs[i], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        if (send(socs[i], "hello\r\n", 7, MSG_NOSIGNAL) == -1
+            || recv(socs[i], buf, sizeof(buf), 0) <= 0
+            || send(socs[i], "before\r\n", 8, MSG_NOSIGNAL) == -1) {
+            perror("prepare");
+        }
+    }
+
+    if (kill((pid_t) pid, SIGTERM) == -1) {
+        perror("kill");
+        return (-1);
+    }
+    t0 = now_sec();
+    (void) usleep(100000);
+    refused = 0;
+    if ((soc = socket(g_res0->ai_family, g_res0->ai_socktype, g_res0->ai_protocol)) != -1) {
+        if (connect(soc, g_res0->ai_addr, g_res0->ai_addrlen) == -1) {
+            refused = 1;
+        }
+        (void) close(soc);
+    }
+
+    ok = reset = mismatch = 0;
+    for (i = 0; i < n; i++) {
+        if ((len = recv(socs[i], buf, sizeof(buf), 0)) <= 0) {
+            reset++;
+        } else if ((size_t) len != sizeof(want1) - 1 || memcmp(buf, want1, sizeof(want1) - 1) != 0) {
+            mismatch++;
+        } else if (send(socs[i], "after\r\n", 7, MSG_NOSIGNAL) == -1
+                   || (len = recv(socs[i], buf, sizeof(buf), 0)) <= 0) {
+            reset++;
+        } else if ((size_t) len != sizeof(want2) - 1 || memcmp(buf, want2, sizeof(want2) - 1) != 0) {
+            mismatch++;
+        } else {
+            ok++;
+        }
+        (void) close(socs[i]);
+    }
+    free(socs);
+    closed = now_sec();
+
+    /* 最後の接続を閉じてからサーバが終了するまで */
+    while (kill((pid_t) pid, 0) == 0 && now_sec() - closed < BENCH_TIMEOUT) {
+        (void) usleep(1000);
+    }
+    (void) printf("drain: n=%d ok=%d reset=%d mismatch=%d new-conn=%s served=%.1fms exit=%.1fms%s\n",
+                  n, ok, reset, mismatch, refused ? "refused" : "ACCEPTED",
+                  (closed - t0) * 1e3, (now_sec() - closed) * 1e3,
+                  kill((pid_t) pid, 0) == 0 ? " (still running)" : "");
+    return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct addrinfo hints;
+    int errcode;
+
+    if (argc <= 4) {
+        (void) fprintf(stderr, "bench host port storm|churn|rounds|pingpong|bulk|peerfmt|respbuild|idle|spawn|hammer|upgrade|drain N [parallel|rounds|gap|size|pid]\n");
+        return (EX_USAGE);
+    }
+
+    /* 接続先の解決は計測の外で 1 回だけ行う */
+    (void) memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((errcode = getaddrinfo(argv[1], argv[2], &hints, &g_res0)) != 0) {
+        (void) fprintf(stderr, "getaddrinfo():%s\n", gai_strerror(errcode));
+        return (EX_NOHOST);
+    }
+
+    raise_nofile_limit();
+
+    if (strcmp(argv[3], "storm") == 0) {
+        (void) bench_conns("storm", atoi(argv[4]), atoi(argv[4]));
+    } else if (strcmp(argv[3], "churn") == 0) {
+        (void) bench_conns("churn", atoi(argv[4]), argc > 5 ? atoi(argv[5]) : 1);
+    } else if (strcmp(argv[3], "rounds") == 0) {
+        (void) bench_rounds(atoi(argv[4]), argc > 5 ? atoi(argv[5]) : 100);
+    } else if (strcmp(argv[3], "pingpong") == 0) {
+        (void) bench_pingpong(atoi(argv[4]), argc > 5 ? atol(argv[5]) : 0);
+    } else if (strcmp(argv[3], "bulk") == 0) {
+        (void) bench_bulk(atoi(argv[4]), argc > 5 ? atoi(argv[5]) : 65536,
+                          argc > 6 ? atoi(argv[6]) : 100);
+    } else if (strcmp(argv[3], "peerfmt") == 0) {
+        (void) bench_peerfmt(atoi(argv[4]));
+    } else if (strcmp(argv[3], "respbuild") == 0) {
+        (void) bench_respbuild(atoi(argv[4]));
+    } else if (strcmp(argv[3], "idle") == 0) {
+        (void) bench_idle(atoi(argv[4]), argc > 5 ? atol(argv[5]) : 0);
+    } else if (strcmp(argv[3], "spawn") == 0) {
+        (void) bench_spawn(atoi(argv[4]));
+    } else if (strcmp(argv[3], "hammer") == 0) {
+        (void) bench_hammer(atoi(argv[4]), argc > 5 ? atol(argv[5]) : 0);
+    } else if (strcmp(argv[3], "upgrade") == 0) {
+        (void) bench_upgrade(atoi(argv[4]), argc > 5 ? atol(argv[5]) : 0);
+    } else if (strcmp(argv[3], "drain") == 0) {
+        (void) bench_drain(atoi(argv[4]), argc > 5 ? atol(argv[5]) : 0);
+    } else {
+        (void) fprintf(stderr, "unknown mode:%s\n", argv[3]);
+        freeaddrinfo(g_res0);
+        return (EX_USAGE);
+    }
+
+    freeaddrinfo(g_res0);
+    return (EX_OK);
+}
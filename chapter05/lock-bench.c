@@ -0,0 +1,188 @@
+/*
+ * lock-bench: プロセス間ロック（lockf / 共有メモリ上の robust mutex）の競合ベンチマーク
+ *
+ * 目的：
+ * - server7 の accept 直列化に使うロックとして、
+ *   lockf（ファイルロック）と PTHREAD_PROCESS_SHARED な robust mutex を比べる
+ * - 子プロセス数を 1〜64 に変えて、競合が増えたときの 1 回あたりの時間を確認する
+ * - ネットワークは使わず、ロック/解放だけを繰り返す（accept の代わりに共有カウンタを +1 する）
+ *
+ * 使い方：
+ *   lock-bench [total_ops]
+ *     - total_ops : 1 計測あたりのロック/解放の合計回数（子プロセスで等分。既定 200000）
+ *
+ * 計測内容（lockf / mutex それぞれ、子プロセス数 1,2,4,8,16,32,64 について）：
+ * - ns/op   : 合計時間 / 合計回数（全員がロックを取り合う最悪ケース）
+ * - csw/op  : 子プロセスの自発的コンテキストスイッチ数 / 合計回数
+ *             （ロック待ちでカーネルに入って眠った回数の目安。
+ *               mutex は競合が無ければ 0 に近く、ユーザ空間だけで済んでいることが分かる）
+ * - 共有カウンタが合計回数と一致しなければ排他が壊れているので NG を表示する
+ */
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* 1 計測あたりのロック/解放の合計回数（既定値） */
+#define TOTAL_OPS 200000
+
+/* lockf 用の一時ファイル（open 後すぐ unlink する） */
+#define LOCK_FILE "./lock-bench.lock"
+
+/* 子プロセス間で共有する領域（fork 前に mmap する） */
+struct shared {
+    pthread_mutex_t mutex;
+    volatile long counter;              /* ロックの中でだけ +1 する */
+};
+
+/* ロックの方式 */
+#define LOCK_LOCKF      0
+#define LOCK_MUTEX      1
+
+/* 単調増加時計の現在値（秒） */
+double
+now_sec(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec + (double) ts.tv_nsec / 1e9);
+}
+
+/* ロックを取る（EOWNERDEAD は server7 と同じく回復させる） */
+void
+bench_lock(int mode, struct shared *sh, int fd)
+{
+    if (mode == LOCK_LOCKF) {
+        (void) lockf(fd, F_LOCK, 0);
+    } else if (pthread_mutex_lock(&sh->mutex) == EOWNERDEAD) {
+        (void) pthread_mutex_consistent(&sh->mutex);
+    }
+}
+
+/* ロックを放す */
+void
+bench_unlock(int mode, struct shared *sh, int fd)
+{
+    if (mode == LOCK_LOCKF) {
+        (void) lockf(fd, F_ULOCK, 0);
+    } else {
+        (void) pthread_mutex_unlock(&sh->mutex);
+    }
+}
+
+/*
+ * run(mode, nchild, total, sh, fd)
+ *   nchild 個の子プロセスで合計 total 回ロック/解放し、結果を 1 行表示する
+ *
+ * アルゴリズム：
+ *   1) 子プロセスをすべて fork し、スタート合図用のパイプの read で待たせる
+ *   2) 親が書き込み側を close した瞬間に全員が EOF で一斉に走り出す（ここから計測）
+ *   3) 各子は「ロック → counter++ → 解放」を total/nchild 回繰り返して終了
+ *   4) 親は全員を wait し、経過時間と子プロセスの rusage の差分を集計する
+ */
+void
+run(int mode, int nchild, long total, struct shared *sh, int fd)
+{
+    struct rusage ru0, ru1;
+    double t0, t1;
+    long per, i, ops, csw;
+    int pfd[2], c;
+    pid_t pid;
+    char ch;
+
+    per = total / nchild;
+    sh->counter = 0;
+
+    if (pipe(pfd) == -1) {
+        perror("pipe");
+        return;
+    }
+    (void) getrusage(RUSAGE_CHILDREN, &ru0);
+
+    for (c = 0; c < nchild; c++) {
+        if ((pid = fork()) == 0) {
+            (void) close(pfd[1]);
+            (void) read(pfd[0], &ch, 1);        /* 親が close するまで待つ */
+            for (i = 0; i < per; i++) {
+                bench_lock(mode, sh, fd);
+                sh->counter++;
+                bench_unlock(mode, sh, fd);
+            }
+            _exit(0);
+        } else if (pid == -1) {
+            perror("fork");
+            break;
+        }
+    }
+    (void) close(pfd[0]);
+
+    t0 = now_sec();
+    (void) close(pfd[1]);                       /* スタート合図 */
+    while (wait(NULL) > 0 || errno == EINTR) {
+    }
+    t1 = now_sec();
+
+    ops = per * c;                              /* fork に失敗した分は数えない */
+    (void) getrusage(RUSAGE_CHILDREN, &ru1);
+    csw = (ru1.ru_nvcsw - ru0.ru_nvcsw) + (ru1.ru_nivcsw - ru0.ru_nivcsw);
+
+    (void) printf("%-6s children=%-3d ops=%-8ld %9.1f ns/op %7.3f csw/op%s\n",
+                  mode == LOCK_MUTEX ? "mutex" : "lockf", nchild, ops,
+                  (t1 - t0) * 1e9 / (double) ops, (double) csw / (double) ops,
+                  sh->counter == ops ? "" : "  NG(counter)");
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const int nchildren[] = { 1, 2, 4, 8, 16, 32, 64 };
+    pthread_mutexattr_t attr;
+    struct shared *sh;
+    long total;
+    int fd, k;
+
+    total = argc > 1 ? atol(argv[1]) : TOTAL_OPS;
+    if (total < 64) {
+        (void) fprintf(stderr, "lock-bench [total_ops(>=64)]\n");
+        return (1);
+    }
+
+    /* lockf 用のファイル（名前はすぐ消す） */
+    if ((fd = open(LOCK_FILE, O_RDWR | O_CREAT, 0666)) == -1) {
+        perror("open");
+        return (1);
+    }
+    (void) unlink(LOCK_FILE);
+
+    /* mutex とカウンタを置く共有メモリ（server7 の mutex モードと同じ作り方） */
+    if ((sh = mmap(NULL, sizeof(*sh), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        perror("mmap");
+        return (1);
+    }
+    (void) pthread_mutexattr_init(&attr);
+    (void) pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    (void) pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    (void) pthread_mutex_init(&sh->mutex, &attr);
+    (void) pthread_mutexattr_destroy(&attr);
+
+    for (k = 0; k < (int) (sizeof(nchildren) / sizeof(nchildren[0])); k++) {
+        run(LOCK_LOCKF, nchildren[k], total, sh, fd);
+        run(LOCK_MUTEX, nchildren[k], total, sh, fd);
+    }
+
+    (void) munmap(sh, sizeof(*sh));
+    (void) close(fd);
+    return (0);
+}
@@ -0,0 +1,299 @@
+/*
+ * scan-bench: 行区切り（CR/LF）検索のマイクロベンチマーク
+ *
+ * 目的：
+ * - server2〜server9 に入れた scan_eol（SIMD 版）が
+ *   strpbrk / memchr と比べてどれだけ速いかを、バッファサイズ別に確認する
+ * - ネットワークは使わず、メモリ上のバッファだけで計測する
+ *
+ * 使い方：
+ *   scan-bench [line_len]
+ *     - line_len : 何バイトごとに "\r\n" を置くか（既定 80）
+ *
+ * 計測内容（64B〜64KB の各サイズについて）：
+ * - バッファ中の CR/LF をすべて見つけるまでの時間（1 バイトあたりの ns と GB/s）
+ *   - strpbrk : strpbrk(p, "\r\n") を見つかるたびに呼び直す（NUL 終端が必要）
+ *   - memchr  : memchr(p, '\n', rest) を繰り返す（LF しか探せない点に注意）
+ *   - scalar / sse2 / avx2 : scan_eol の各実装（CPU が対応していないものは省く）
+ * - 結果が一致しない場合は見つかった個数を表示して異常を知らせる
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>                  /* SSE2 / AVX2 組み込み関数（scan_eol） */
+#endif
+
+/* 計測ごとに走査する合計バイト数（小さいバッファは回数を増やす） */
+#define TOTAL_BYTES (256UL * 1024 * 1024)
+
+/* バッファサイズの上限（64KB） */
+#define MAX_BUF (64 * 1024)
+
+/* 単調増加時計の現在値（秒） */
+double
+now_sec(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec + (double) ts.tv_nsec / 1e9);
+}
+
+/* 行区切り（CR/LF）の一括検索
+ *
+ * buf[0..len) に含まれる '\r' / '\n' の位置（先頭からのオフセット）を
+ * 出現順に off[] へ最大 max 個書き込み、書き込んだ個数を返す。
+ *
+ * strpbrk(buf, "\r\n") との違い：
+ * - NUL 終端を必要としない（recv で得た len をそのまま渡せる）
+ * - 1 回の走査ですべての区切り位置が得られる（行の切り出しを上位で行える）
+ * - x86 では 16/32 バイト単位で比較する SIMD 版を使う
+ *
+ * 実装は 3 種類あり、scan_eol_init() で CPU を見て g_scan_eol に設定する：
+ * - scan_eol_scalar : 1 バイトずつ（どの CPU でも動く）
+ * - scan_eol_sse2   : 16 バイトずつ比較 → movemask でビット列にして位置を取り出す
+ * - scan_eol_avx2   : 32 バイトずつ（AVX2 がある CPU のみ）
+ */
+size_t
+scan_eol_scalar(const char *buf, size_t len, size_t *off, size_t max)
+{
+    size_t i, n;
+
+    for (i = 0, n = 0; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+size_t
+scan_eol_sse2(const char *buf, size_t len, size_t *off, size_t max)
+{
+    __m128i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
+
+    cr = _mm_set1_epi8('\r');
+    lf = _mm_set1_epi8('\n');
+    for (i = 0, n = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (buf + i));
+        mask = (unsigned int) _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        /* 立っているビット = 区切り文字の位置（下位ビットから順に取り出す） */
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
+            }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    /* 16 バイトに満たない残りは 1 バイトずつ */
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
+
+__attribute__((target("avx2")))
+size_t
+scan_eol_avx2(const char *buf, size_t len, size_t *off, size_t max)
+{
+    __m256i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
+
+    cr = _mm256_set1_epi8('\r');
+    lf = _mm256_set1_epi8('\n');
+    for (i = 0, n = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        mask = (unsigned int) _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
+            }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
+#endif
+
+/* 使用する実装（scan_eol_init で決まる。スレッド生成前に 1 回だけ呼ぶこと） */
+size_t (*g_scan_eol)(const char *, size_t, size_t *, size_t) = scan_eol_scalar;
+const char *g_scan_eol_name = "scalar";
+
+void
+scan_eol_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_scan_eol = scan_eol_avx2;
+        g_scan_eol_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        g_scan_eol = scan_eol_sse2;
+        g_scan_eol_name = "sse2";
+    }
+#endif
+}
+
+/* 最適化で計測ループが消されないよう、結果をここに足し込む */
+volatile size_t g_sink;
+
+/* strpbrk で CR/LF をすべて数える */
+size_t
+count_strpbrk(const char *buf, size_t len)
+{
+    const char *p;
+    size_t n;
+
+    (void) len;
+    for (n = 0, p = buf; (p = strpbrk(p, "\r\n")) != NULL; p++) {
+        n++;
+    }
+    return (n);
+}
+
+/* memchr で LF をすべて数える（CR は探せない） */
+size_t
+count_memchr(const char *buf, size_t len)
+{
+    const char *p, *end;
+    size_t n;
+
+    end = buf + len;
+    for (n = 0, p = buf; p < end && (p = memchr(p, '\n', (size_t) (end - p))) != NULL; p++) {
+        n++;
+    }
+    return (n);
+}
+
+/* scan_eol の 1 実装で CR/LF をすべて数える（off[] を使い回して複数回呼ぶ） */
+size_t
+count_scan(size_t (*scan)(const char *, size_t, size_t *, size_t),
+           const char *buf, size_t len)
+{
+    size_t off[64], n, k, pos;
+
+    for (n = 0, pos = 0; pos < len; ) {
+        k = scan(buf + pos, len - pos, off, 64);
+        n += k;
+        if (k < 64) {
+            break;
+        }
+        pos += off[63] + 1;
+    }
+    return (n);
+}
+
+/* 1 方式を計測して表示する */
+void
+run(const char *name, int kind,
+    size_t (*scan)(const char *, size_t, size_t *, size_t),
+    const char *buf, size_t len, size_t expect)
+{
+    double start, elapsed;
+    size_t iter, i, n;
+
+    iter = TOTAL_BYTES / len;
+    n = 0;
+    start = now_sec();
+    for (i = 0; i < iter; i++) {
+        switch (kind) {
+        case 0:
+            n = count_strpbrk(buf, len);
+            break;
+        case 1:
+            n = count_memchr(buf, len);
+            break;
+        default:
+            n = count_scan(scan, buf, len);
+            break;
+        }
+        g_sink += n;
+    }
+    elapsed = now_sec() - start;
+
+    (void) printf("  %-8s %7.3f ns/B %7.2f GB/s",
+                  name, elapsed * 1e9 / ((double) iter * len),
+                  (double) iter * len / elapsed / 1e9);
+    if (n != expect) {
+        (void) printf("  (found=%zu expect=%zu)", n, expect);
+    }
+    (void) printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const size_t sizes[] = { 64, 256, 1024, 4096, 16384, 65536 };
+    char *buf;
+    size_t line_len, len, i, k, ncrlf, nlf;
+
+    line_len = argc > 1 ? (size_t) atoi(argv[1]) : 80;
+    if (line_len < 2) {
+        (void) fprintf(stderr, "scan-bench [line_len(>=2)]\n");
+        return (1);
+    }
+
+    if ((buf = malloc(MAX_BUF + 1)) == NULL) {
+        perror("malloc");
+        return (1);
+    }
+
+    scan_eol_init();
+    (void) printf("scan_eol=%s line_len=%zu\n", g_scan_eol_name, line_len);
+
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        len = sizes[k];
+
+        /* 英小文字の行を "\r\n" で区切ったテキストを作る（末尾は NUL 終端） */
+        ncrlf = nlf = 0;
+        for (i = 0; i < len; i++) {
+            if (i % line_len == line_len - 2) {
+                buf[i] = '\r';
+                ncrlf++;
+            } else if (i % line_len == line_len - 1) {
+                buf[i] = '\n';
+                ncrlf++;
+                nlf++;
+            } else {
+                buf[i] = (char) ('a' + (i * 7) % 26);
+            }
+        }
+        buf[len] = '\0';
+
+        (void) printf("size=%zu (CR/LF=%zu)\n", len, ncrlf);
+        run("strpbrk", 0, NULL, buf, len, ncrlf);
+        run("memchr", 1, NULL, buf, len, nlf);
+        run("scalar", 2, scan_eol_scalar, buf, len, ncrlf);
+#if defined(__x86_64__) || defined(__i386__)
+        if (__builtin_cpu_supports("sse2")) {
+            run("sse2", 2, scan_eol_sse2, buf, len, ncrlf);
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            run("avx2", 2, scan_eol_avx2, buf, len, ncrlf);
+        }
+#endif
+    }
+
+    free(buf);
+    return (0);
+}
@@ -7,7 +7,7 @@
  *
  * 全体アルゴリズム（サーバ側）：
  * 1) server_socket(port) で listen ソケットを準備する
- *    - getaddrinfo → socket → setsockopt(SO_REUSEADDR) → bind → listen
+ *    - getaddrinfo → socket → setsockopt(SO_REUSEADDR) → tune_listen（プロファイル）→ bind → listen
  *
  * 2) accept_loop(listen_fd) でイベントループを回す
  *    - 監視対象 FD の集合（fd_set）を毎回作り直す
@@ -29,24 +29,165 @@
  * - buf[len]='\0' は len==sizeof(buf) の場合に境界外アクセスになり得る（後述）
  */
 
+#define _GNU_SOURCE                     /* accept4() */
+
+#include <sys/ioctl.h>                  /* ioctl(FIONREAD)（受信バッファの大きさ合わせ） */
 #include <sys/param.h>
+#include <sys/resource.h>              /* getrlimit / setrlimit */
+#ifdef __linux__
+#include <sys/signalfd.h>               /* signalfd（SIGTERM を FD で受け取る） */
+#endif
 #include <sys/socket.h>
+#include <sys/stat.h>                   /* chmod（管理用ソケット） */
 #include <sys/types.h>
+#include <sys/uio.h>                    /* writev, struct iovec */
+#include <sys/un.h>                     /* struct sockaddr_un（管理用ソケット） */
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>                /* TCP_KEEPIDLE / TCP_USER_TIMEOUT など（keepalive）、TCP_NODELAY など（プロファイル） */
 #include <netdb.h>
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>                      /* open, O_CLOEXEC */
+#include <limits.h>                     /* INT_MAX（set user_timeout） */
+#include <poll.h>                       /* poll（応答の送り残し） */
 #include <signal.h>
+#include <stdarg.h>                     /* va_list（admin_printf） */
+#include <stddef.h>                     /* offsetof（設定のキー表） */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>                       /* clock_gettime（drain の経過時間） */
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>                  /* SSE2 / AVX2 組み込み関数（scan_eol） */
+#endif
+
+/* 接続単位の TCP チューニング（プロファイル）
+ *
+ * 起動引数で 1 つ選ぶ（server2 port [latency|throughput|churn|none] ...、既定は none = SO_REUSEADDR のみ）。
+ * ポート番号の次に書き、省略できる（profile_arg）。
+ *
+ * - latency    : TCP_NODELAY（Nagle を切って小さな応答をすぐ出す）
+ *                TCP_QUICKACK（遅延 ACK をやめる。カーネルが自動で戻すので受信のたびに付け直す）
+ *                TCP_NOTSENT_LOWAT を小さく（未送信データを溜め込まず、書ける通知を早く返す）
+ * - throughput : SO_SNDBUF / SO_RCVBUF を大きく（ウィンドウを広げて 1 回あたりの転送量を増やす）
+ *                応答を複数回の write で組み立てるときは TCP_CORK で 1 セグメントにまとめる
+ *                （このサーバは行ごとの応答を 1 回の writev にしているので CORK は要らない）
+ * - churn      : TCP_DEFER_ACCEPT（最初のデータが届くまで accept を起こさない）
+ *                TCP_FASTOPEN（SYN に載ったデータを受け付ける。sysctl net.ipv4.tcp_fastopen の
+ *                2 のビットが立っていないと効かない）
+ *                listen のバックログを大きく（実際は net.core.somaxconn で頭打ち）
+ *
+ * - listen ソケットに付けた TCP_NODELAY / TCP_NOTSENT_LOWAT / SO_SNDBUF / SO_RCVBUF は
+ *   accept した接続に引き継がれる（Linux）。引き継がれない TCP_QUICKACK だけ tune_accepted で付ける
+ * - SO_RCVBUF はウィンドウスケールが決まる SYN より前（listen の前）に付ける必要がある
+ * - 効果の比較は tune-bench（ループバックで応答遅延・転送速度・接続の回転を計る）
+ */
+#define PROFILE_NONE        (0)
+#define PROFILE_LATENCY     (1)
+#define PROFILE_THROUGHPUT  (2)
+#define PROFILE_CHURN       (3)
+
+const char *g_profile_name[] = { "none", "latency", "throughput", "churn" };
+
+int g_profile = PROFILE_NONE;
+
+#define TUNE_NOTSENT_LOWAT  (16 * 1024)         /* latency：未送信データの上限 */
+#define TUNE_BUFSZ          (4 * 1024 * 1024)   /* throughput：送受信バッファ（wmem_max / rmem_max で頭打ち） */
+#define TUNE_DEFER_ACCEPT   (1)                 /* churn：データを待つ秒数 */
+#define TUNE_FASTOPEN_QLEN  (256)               /* churn：TFO の保留キュー */
+#define TUNE_BACKLOG        (65535)             /* churn：listen のバックログ */
+
+/* プロファイル名 → 番号（知らない名前なら -1） */
+int
+profile_lookup(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(g_profile_name) / sizeof(g_profile_name[0])); i++) {
+        if (strcmp(name, g_profile_name[i]) == 0) {
+            return (i);
+        }
+    }
+    return (-1);
+}
+
+/* 引数のポート番号の次がプロファイル名なら取り出し、後ろの引数を 1 つ前に詰める
+ * （省略できる。詰めるので、後ろの引数はプロファイルを書かないときと同じ位置で読める） */
+void
+profile_arg(int *argc, char *argv[])
+{
+    int i;
+
+    if (*argc > 2 && profile_lookup(argv[2]) != -1) {
+        g_profile = profile_lookup(argv[2]);
+        for (i = 2; i < *argc - 1; i++) {
+            argv[i] = argv[i + 1];
+        }
+        argv[--*argc] = NULL;
+    }
+    (void) fprintf(stderr, "profile=%s\n", g_profile_name[g_profile]);
+}
+
+/* listen ソケットにプロファイルを付ける（bind / listen の前に呼ぶ。失敗は表示して続行） */
+void
+tune_listen(int soc)
+{
+    int opt;
+
+    switch (g_profile) {
+    case PROFILE_LATENCY:
+        opt = 1;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_NODELAY)");
+        }
+        opt = TUNE_NOTSENT_LOWAT;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_NOTSENT_LOWAT)");
+        }
+        break;
+    case PROFILE_THROUGHPUT:
+        opt = TUNE_BUFSZ;
+        if (setsockopt(soc, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(SO_SNDBUF)");
+        }
+        if (setsockopt(soc, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(SO_RCVBUF)");
+        }
+        break;
+    case PROFILE_CHURN:
+        opt = TUNE_DEFER_ACCEPT;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_DEFER_ACCEPT)");
+        }
+        opt = TUNE_FASTOPEN_QLEN;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_FASTOPEN, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_FASTOPEN)");
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* accept した接続 / 受信した直後の接続に、引き継がれない分を付ける */
+void
+tune_accepted(int acc)
+{
+    int opt;
+
+    if (g_profile == PROFILE_LATENCY) {
+        opt = 1;
+        (void) setsockopt(acc, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt));
+    }
+}
+
 /* サーバソケットの準備（listen ソケットを作る）
  *
  * portnm: 文字列のポート番号（例: "55555"）
@@ -94,8 +235,13 @@ server_socket(const char *portnm)
     }
     (void) fprintf(stderr, "port=%s\n", sbuf);
 
-    /* ソケット生成 */
-    if ((soc = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol)) == -1) {
+    /* ソケット生成
+     * - SOCK_NONBLOCK：listen ソケットをノンブロッキングにする
+     *   （accept_loop で EAGAIN が返るまで accept を繰り返して “まとめて” 受け付けるため）
+     * - SOCK_CLOEXEC ：exec 時に FD を引き継がない
+     */
+    if ((soc = socket(res0->ai_family, res0->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                      res0->ai_protocol)) == -1) {
         perror("socket");
         freeaddrinfo(res0);
         return (-1);
@@ -111,33 +257,1194 @@ server_socket(const char *portnm)
         return (-1);
     }
 
-    /* bind：アドレス/ポートを割り当て */
-    if (bind(soc, res0->ai_addr, res0->ai_addrlen) == -1) {
-        perror("bind");
-        (void) close(soc);
-        freeaddrinfo(res0);
-        return (-1);
+    /* プロファイルの TCP オプション（バッファの大きさは SYN より前に決めておく） */
+    tune_listen(soc);
+
+    /* bind：アドレス/ポートを割り当て */
+    if (bind(soc, res0->ai_addr, res0->ai_addrlen) == -1) {
+        perror("bind");
+        (void) close(soc);
+        freeaddrinfo(res0);
+        return (-1);
+    }
+
+    /* listen：接続受付状態へ（churn はバックログを大きく） */
+    if (listen(soc, g_profile == PROFILE_CHURN ? TUNE_BACKLOG : SOMAXCONN) == -1) {
+        perror("listen");
+        (void) close(soc);
+        freeaddrinfo(res0);
+        return (-1);
+    }
+
+    freeaddrinfo(res0);
+    return (soc);
+}
+
+/* 接続元アドレス文字列の最大長（"IPv6アドレス:ポート" + NUL） */
+#define PEER_STRLEN (INET6_ADDRSTRLEN + 8)
+
+/* 10 進数の書き出し（format_peer の下請け） */
+char *
+put_dec(char *p, unsigned int v)
+{
+    char tmp[10];
+    int n;
+
+    n = 0;
+    do {
+        tmp[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0) {
+        *p++ = tmp[--n];
+    }
+    return (p);
+}
+
+/* 接続元アドレスの文字列化（getnameinfo を使わない高速版）
+ *
+ * ss  : accept で得た生のアドレス（AF_INET / AF_INET6）
+ * buf : 出力先（PEER_STRLEN バイト以上）
+ *
+ * 出力形式は getnameinfo(NI_NUMERICHOST | NI_NUMERICSERV) の host と port を
+ * ':' でつないだもの（"127.0.0.1:50000"）と同じ。
+ *
+ * - getnameinfo は NSS/ロケールを経由し、内部でも書式化を行うので accept 毎に呼ぶと重い
+ * - ここでは 10 進/16 進の変換を手で書き、malloc も snprintf も使わない
+ * - IPv6 は RFC 5952 に従い、最長の 0 の連続（2 グループ以上）を "::" に縮める
+ *
+ * 戻り値：書き込んだ文字数（NUL を除く）
+ */
+size_t
+format_peer(const struct sockaddr_storage *ss, char *buf)
+{
+    static const char hex[] = "0123456789abcdef";
+    const struct sockaddr_in *sin;
+    const struct sockaddr_in6 *sin6;
+    const unsigned char *a;
+    unsigned int port, w;
+    int i, j, best, bestlen, shift;
+    char *p;
+
+    p = buf;
+    switch (ss->ss_family) {
+    case AF_INET:
+        sin = (const struct sockaddr_in *) ss;
+        a = (const unsigned char *) &sin->sin_addr;
+        for (i = 0; i < 4; i++) {
+            if (i > 0) {
+                *p++ = '.';
+            }
+            p = put_dec(p, a[i]);
+        }
+        port = ntohs(sin->sin_port);
+        break;
+
+    case AF_INET6:
+        sin6 = (const struct sockaddr_in6 *) ss;
+        a = sin6->sin6_addr.s6_addr;
+
+        /* 最長の 0 グループの連続を探す */
+        best = -1;
+        bestlen = 0;
+        for (i = 0; i < 8; i = j + 1) {
+            for (j = i; j < 8 && a[2 * j] == 0 && a[2 * j + 1] == 0; j++)
+                ;
+            if (j - i >= 2 && j - i > bestlen) {
+                best = i;
+                bestlen = j - i;
+            }
+        }
+
+        if (best == 0
+            && (bestlen == 6 || (bestlen == 5 && a[10] == 0xff && a[11] == 0xff))) {
+            /* IPv4 射影/互換アドレス（::ffff:a.b.c.d, ::a.b.c.d）は末尾 32bit を 10 進で書く
+             * （inet_ntop/getnameinfo と同じ判定） */
+            *p++ = ':';
+            *p++ = ':';
+            if (bestlen == 5) {
+                (void) memcpy(p, "ffff:", 5);
+                p += 5;
+            }
+            for (j = 12; j < 16; j++) {
+                if (j > 12) {
+                    *p++ = '.';
+                }
+                p = put_dec(p, a[j]);
+            }
+        } else {
+            for (i = 0; i < 8; i++) {
+                if (i == best) {
+                    *p++ = ':';
+                    *p++ = ':';
+                    i += bestlen - 1;
+                    continue;
+                }
+                if (i > 0 && i != best + bestlen) {
+                    *p++ = ':';
+                }
+                w = ((unsigned int) a[2 * i] << 8) | a[2 * i + 1];
+                for (shift = 12; shift > 0 && ((w >> shift) & 0xf) == 0; shift -= 4)
+                    ;
+                for (; shift >= 0; shift -= 4) {
+                    *p++ = hex[(w >> shift) & 0xf];
+                }
+            }
+        }
+        port = ntohs(sin6->sin6_port);
+        break;
+
+    default:
+        *p++ = '?';
+        port = 0;
+        break;
+    }
+
+    *p++ = ':';
+    p = put_dec(p, port);
+    *p = '\0';
+    return ((size_t) (p - buf));
+}
+
+/* 1回の “listen FD が ready” で accept する最大件数（1イテレーションあたりの予算）
+ *
+ * - ready 1回につき 1件しか accept しないと、接続が殺到したときに
+ *   イベントループ1周ごとに 1件ずつしか捌けない（accept レートが頭打ちになる）
+ * - かといって無制限に accept し続けると既存接続の処理が遅れるので上限を設ける
+ * - 予算を使い切って残った接続は、次の周回でも listen FD が ready のままなので取りこぼさない
+ */
+#define ACCEPT_BUDGET (64)
+
+/* RLIMIT_NOFILE を引き上げた結果がこれを超える場合はこの値に丸める（テーブル確保量の上限） */
+#define NOFILE_MAX (65536)
+
+/* 接続管理以外で使う FD の見込み数（0,1,2 / listen / 予備FD / シグナル / 管理用ソケット など） */
+#define RESERVED_FD (16)
+
+/* EMFILE/ENFILE 対策の予備 FD（/dev/null を開いたまま確保しておく） */
+int g_spare_fd = -1;
+
+/* RLIMIT_NOFILE（プロセスが開ける FD 数）をハードリミットまで引き上げる
+ *
+ * - ソフトリミットは 1024 程度に絞られていることが多いが、
+ *   ハードリミットまでは一般ユーザでも引き上げられる
+ * - 起動時に1回呼び、戻り値から接続管理テーブルの大きさを決める
+ *
+ * 戻り値：
+ * - 成功：引き上げ後のソフトリミット
+ * - 失敗：-1
+ */
+int
+raise_nofile_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        perror("getrlimit");
+        return (-1);
+    }
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+            /* 引き上げに失敗しても現状の値で続行する */
+            perror("setrlimit");
+            (void) getrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
+
+    /* RLIM_INFINITY 等の巨大な値はテーブルを確保しきれないので丸める */
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > NOFILE_MAX) {
+        return (NOFILE_MAX);
+    }
+    return ((int) rl.rlim_cur);
+}
+
+/* ノンブロッキング accept（accept4）＋ EMFILE 時の “予備 FD による捨て accept”
+ *
+ * soc  : ノンブロッキングの listen ソケット
+ * from : 接続元アドレスの格納先
+ * len  : from のサイズ（入出力）
+ *
+ * アルゴリズム：
+ * 1) accept4(SOCK_NONBLOCK | SOCK_CLOEXEC) で受け付ける
+ *    - 接続 FD は最初からノンブロッキング/close-on-exec になるので fcntl が要らない
+ * 2) EMFILE/ENFILE（FD 枯渇）の場合：
+ *    - 予備 FD を close して空きを 1 つ作る
+ *    - その空きで accept して即 close（接続を “捨てる”）
+ *    - 予備 FD を開き直す
+ *    → listen キューから接続が取り除かれるので、listen FD が
+ *      “読み込み可能” を返し続けて CPU 100% で空回りすることが無くなる
+ *
+ * 戻り値：
+ * - 成功：接続 FD
+ * - 失敗：-1
+ *   - errno == EAGAIN       : listen キューが空になった（ドレイン完了）
+ *   - errno == ECONNABORTED : 接続を捨てた（呼び出し側は次の accept へ進んでよい）
+ */
+int
+accept_nonblock(int soc, struct sockaddr_storage *from, socklen_t *len)
+{
+    int acc, err;
+
+    for (;;) {
+        if ((acc = accept4(soc, (struct sockaddr *) from, len,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+            return (acc);
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno != EMFILE && errno != ENFILE) || g_spare_fd == -1) {
+            return (-1);
+        }
+
+        /* FD 枯渇：予備 FD を手放して 1 接続だけ受けて捨てる */
+        (void) close(g_spare_fd);
+        if ((acc = accept(soc, NULL, NULL)) != -1) {
+            (void) close(acc);
+            (void) fprintf(stderr, "accept:EMFILE:shed\n");
+            err = ECONNABORTED;
+        } else {
+            err = errno;
+        }
+        g_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        errno = err;
+        return (-1);
+    }
+}
+
+/* シグナルを FD で受け取る（sig_fd_init）
+ *
+ * - g_sig_fd   : signalfd、または自己パイプの読み側（イベントループで待てる）
+ * - g_sig_pipe : 自己パイプ（signalfd が使えないときだけ使う）
+ * - g_sig_mask : sig_fd_init で扱うシグナルの集合
+ */
+int g_sig_fd = -1;
+int g_sig_pipe[2] = { -1, -1 };
+sigset_t g_sig_mask;
+
+/* 自己パイプ用のシグナルハンドラ（signalfd が使えないとき）
+ *
+ * シグナル番号を 1 バイト書くだけ（write は async-signal-safe）。
+ */
+void
+sig_pipe_handler(int sig)
+{
+    unsigned char c;
+    int save;
+
+    save = errno;
+    c = (unsigned char) sig;
+    (void) write(g_sig_pipe[1], &c, 1);
+    errno = save;
+}
+
+/* sigs[0..nsigs) を「読める FD」で受け取るようにする
+ *
+ * 戻り値: イベントループで待つ FD / -1（失敗）
+ *
+ * アルゴリズム：
+ * 1) 対象のシグナルをブロック（以後、非同期に割り込まれない）
+ * 2) signalfd を作る → 届いたシグナルは signalfd_siginfo として read できる
+ * 3) signalfd が無ければ自己パイプ：ハンドラ（SA_RESTART）が番号を 1 バイト書き、
+ *    ブロックを外す
+ */
+int
+sig_fd_init(const int *sigs, int nsigs)
+{
+    struct sigaction sa;
+    int i;
+
+    (void) sigemptyset(&g_sig_mask);
+    for (i = 0; i < nsigs; i++) {
+        (void) sigaddset(&g_sig_mask, sigs[i]);
+    }
+    (void) sigprocmask(SIG_BLOCK, &g_sig_mask, NULL);
+#ifdef __linux__
+    if ((g_sig_fd = signalfd(-1, &g_sig_mask, SFD_NONBLOCK | SFD_CLOEXEC)) != -1) {
+        return (g_sig_fd);
+    }
+    perror("signalfd");
+#endif
+    if (pipe(g_sig_pipe) == -1) {
+        perror("pipe");
+        (void) sigprocmask(SIG_UNBLOCK, &g_sig_mask, NULL);
+        return (-1);
+    }
+    for (i = 0; i < 2; i++) {
+        (void) fcntl(g_sig_pipe[i], F_SETFL, fcntl(g_sig_pipe[i], F_GETFL, 0) | O_NONBLOCK);
+        (void) fcntl(g_sig_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_pipe_handler;
+    (void) sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    for (i = 0; i < nsigs; i++) {
+        (void) sigaction(sigs[i], &sa, NULL);
+    }
+    g_sig_fd = g_sig_pipe[0];
+    (void) sigprocmask(SIG_UNBLOCK, &g_sig_mask, NULL);
+    return (g_sig_fd);
+}
+
+/* シグナル FD から 1 つ取り出す（戻り値：シグナル番号 / 0 = もう無い） */
+int
+sig_fd_read(void)
+{
+#ifdef __linux__
+    struct signalfd_siginfo si;
+#endif
+    unsigned char c;
+
+    if (g_sig_pipe[0] == -1) {
+#ifdef __linux__
+        if (read(g_sig_fd, &si, sizeof(si)) == (ssize_t) sizeof(si)) {
+            return ((int) si.ssi_signo);
+        }
+#endif
+        return (0);
+    }
+    if (read(g_sig_fd, &c, 1) == 1) {
+        return (c);
+    }
+    return (0);
+}
+
+/* グレースフル停止（drain）
+ *
+ * SIGTERM / SIGINT（または管理用ソケットの drain）を受けたら即座に終わらず、次の順で止める：
+ * 1) listen ソケットを閉じて新しい接続を受けない
+ *    （ロードバランサやローリング再起動の相手は、ここで接続先を切り替える）
+ * 2) 既に受け付けた接続はこれまでどおり処理し、相手が閉じるのを待つ
+ * 3) 接続が 0 になったら終了。g_drain_timeout 秒を過ぎたら残りを閉じて終了する
+ *    （既定 DRAIN_TIMEOUT、管理用ソケットの set drain_timeout で変えられる）
+ * - 途中経過（残り接続数と経過時間）を約 1 秒ごとに表示する
+ * - g_drain_start が 0 でなければ drain 中
+ */
+#define DRAIN_TIMEOUT   (30)
+
+int g_drain_timeout = DRAIN_TIMEOUT;
+
+double g_drain_start = 0.0;     /* drain を始めた時刻（CLOCK_MONOTONIC、0 = 通常運転） */
+double g_drain_report = 0.0;    /* 最後に途中経過を表示した時刻 */
+
+/* 単調増加時計の現在値（秒） */
+double
+now_sec(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec + (double) ts.tv_nsec / 1e9);
+}
+
+/* drain を始める（sig：受けたシグナル / 0 = 管理用ソケットから、nconn：その時点の接続数） */
+void
+drain_begin(int sig, int nconn)
+{
+    g_drain_start = g_drain_report = now_sec();
+    if (sig == 0) {
+        (void) fprintf(stderr, "drain:admin, stop accepting, conns=%d, timeout=%ds\n",
+                       nconn, g_drain_timeout);
+    } else {
+        (void) fprintf(stderr, "drain:signal %d, stop accepting, conns=%d, timeout=%ds\n",
+                       sig, nconn, g_drain_timeout);
+    }
+}
+
+/* drain を終えてよいか調べる（nconn：残っている接続数）
+ *
+ * 戻り値：1 = 終了してよい（接続 0、または期限切れ） / 0 = まだ待つ
+ */
+int
+drain_check(int nconn)
+{
+    double now;
+
+    now = now_sec();
+    if (nconn == 0) {
+        (void) fprintf(stderr, "drain:done in %.1fs\n", now - g_drain_start);
+        return (1);
+    }
+    if (now - g_drain_start >= g_drain_timeout) {
+        (void) fprintf(stderr, "drain:deadline, closing %d conns\n", nconn);
+        return (1);
+    }
+    if (now - g_drain_report >= 1.0) {
+        g_drain_report = now;
+        (void) fprintf(stderr, "drain:conns=%d elapsed=%.1fs\n", nconn, now - g_drain_start);
+    }
+    return (0);
+}
+
+/* 最大同時 “接続管理” 数（child[] 配列の最大要素数）の既定値
+ *
+ * 注意：
+ * - ここでいう “child” は fork の子プロセスではなく、
+ *   accept 済みの “接続ソケット FD” を入れる配列という意味
+ * - 実際の大きさは main で RLIMIT_NOFILE を引き上げた結果から g_max_child に決め直す
+ *   （getrlimit に失敗した場合だけこの値を使う）
+ */
+#define MAX_CHILD (20)
+
+/* child[] 配列の大きさ（起動時に決まる） */
+int g_max_child = MAX_CHILD;
+
+/* 実際に受け付ける接続数の上限（1..g_max_child、管理用ソケットの set max_conn で変えられる） */
+int g_max_conn = MAX_CHILD;
+
+/* accept ごとに接続元を表示するなら 1（設定 verbose、既定 0） */
+int g_verbose = 0;
+
+/* 接続ごとの状態（FD を添字にする。child[] の添字とは別）
+ * - addr   : accept で得た接続元アドレス
+ *            生の sockaddr のまま保持し、文字列化はログや統計で必要になったときに
+ *            format_peer で行う（accept のたびに getnameinfo しない）
+ * - active : 使用中なら 1（管理用ソケットの conns で一覧にする）
+ * - since  : accept した時刻（now_sec、接続の経過時間と寿命のヒストグラムに使う）
+ * - nreq / rx / tx : この接続で処理した要求数 / 受信バイト数 / 送信バイト数
+ * - part / partlen / partcap / cr : 次の recv まで持ち越す行の途中（part_load / part_store）
+ * - rbuf 〜 rlast : 接続ごとの受信バッファ（下の「受信バッファの大きさ合わせ」を参照）
+ */
+struct conn {
+    struct sockaddr_storage addr;
+    int active;
+    double since;
+    unsigned long nreq;
+    unsigned long long rx, tx;
+    char *part;
+    size_t partlen, partcap;
+    int cr;
+    char *rbuf;                 /* 受信バッファ（NULL = 共有の g_buf で読む） */
+    size_t rsize;               /* rbuf の大きさ */
+    size_t rexpect;             /* 最近の要求の大きさ（要求ごとに 3/4 へ減衰させた最大値） */
+    double rlast;               /* 最後に受信した時刻 */
+};
+
+/* FD を添字にした接続状態テーブル（大きさ g_max_child + RESERVED_FD） */
+struct conn *g_conn;
+
+/* 稼働統計（管理用ソケットの stats / dump-histograms で返す）
+ *
+ * - イベントループのスレッドだけが更新・参照するのでロックは要らない
+ * - ヒストグラムは log2 の階級：hist[0] = [0,1)、hist[i] = [2^(i-1), 2^i)
+ *   （要求の処理時間はマイクロ秒、接続の寿命はミリ秒）
+ */
+#define HIST_BUCKETS    (32)
+
+struct stats {
+    double start;                       /* 起動時刻（now_sec） */
+    unsigned long accepted;             /* 受け付けた接続 */
+    unsigned long refused;              /* 上限で断った接続 */
+    unsigned long closed;               /* 閉じた接続 */
+    unsigned long requests;             /* 処理した要求（recv 1 回分） */
+    unsigned long long rx, tx;          /* 送受信バイト数 */
+    unsigned long recv_calls;           /* 接続の recv を呼んだ回数 */
+    unsigned long rbuf_conns;           /* rbuf を持っている接続（現在値） */
+    unsigned long rbuf_bytes;           /* rbuf の合計バイト数（現在値） */
+    unsigned long rbuf_grow;            /* rbuf を確保・拡張した回数 */
+    unsigned long rbuf_shrink;          /* rbuf を縮小・解放した回数 */
+    unsigned long reclaimed_timeout;    /* keepalive / user timeout で切れて閉じた接続 */
+    unsigned long reclaimed_reset;      /* RST などのエラーで閉じた接続 */
+    unsigned long hist_req[HIST_BUCKETS];
+    unsigned long hist_conn[HIST_BUCKETS];
+};
+
+struct stats g_stats;
+
+/* ヒストグラムの階級（v を切り捨てた整数のビット長） */
+int
+hist_bucket(double v)
+{
+    unsigned long x;
+    int b;
+
+    x = v < 1.0 ? 0 : (unsigned long) v;
+    for (b = 0; x != 0 && b < HIST_BUCKETS - 1; b++) {
+        x >>= 1;
+    }
+    return (b);
+}
+
+/* 受信バッファの大きさ合わせ
+ *
+ * 従来はどの接続も共有の g_buf（buf_size バイト、既定 512）に recv していた。大きな要求は
+ * buf_size ずつ何度も recv することになり、一方で何も来ない接続にはバッファ自体が要らない。そこで：
+ *
+ * - recv の前に ioctl(FIONREAD) で届いているバイト数を見て、最近の要求の大きさ（rexpect）と
+ *   持ち越しを合わせて g_buf で足りなければ、接続ごとのバッファ（rbuf）を 2 のべき乗で確保・拡張し
+ *   1 回の recv で読み切る（上限 RBUF_MAX）。g_buf で足りる間は従来どおり g_buf で読む
+ * - 小さな要求が続いて rexpect が g_buf に収まれば rbuf を解放し、rexpect に対して
+ *   4 倍より大きければ縮める。RBUF_IDLE 秒受信の無い接続の rbuf も見回り（rbuf_sweep）で
+ *   解放する → 待機中の接続は rbuf を持たない
+ * - 行の途中の持ち越しは従来どおり part に置く（rbuf は読むときだけ使うので、いつ解放してもよい）
+ * - 見回りは rbuf を持つ接続があるときだけ、select のループのタイムアウトを縮めて行う
+ * - server4 と違い SO_RCVLOWAT（throughput プロファイル）は使わない
+ * - 効果は管理用ソケットの stats（recv_per_kb / rbuf_conns / rbuf_bytes）と、
+ *   bench の bulk（大きな要求の往復）/ idle（待機中の接続 1 本あたりのメモリ）で見る
+ */
+#define RBUF_MIN        (1024)                  /* rbuf の下限（既定の buf_size の 2 倍） */
+#define RBUF_MAX        (1024 * 1024)           /* rbuf の上限 */
+#define RBUF_IDLE       (1.0)                   /* 秒：受信が無ければ rbuf を解放するまで */
+
+/* rbuf を n バイトにする（0 = 解放。失敗は -1 で元のまま） */
+int
+rbuf_resize(struct conn *c, size_t n)
+{
+    char *p;
+
+    if (n == 0) {
+        if (c->rbuf != NULL) {
+            free(c->rbuf);
+            g_stats.rbuf_conns--;
+            g_stats.rbuf_bytes -= c->rsize;
+        }
+        c->rbuf = NULL;
+        c->rsize = 0;
+        return (0);
+    }
+    if ((p = realloc(c->rbuf, n)) == NULL) {
+        perror("realloc");
+        return (-1);
+    }
+    if (c->rbuf == NULL) {
+        g_stats.rbuf_conns++;
+    }
+    g_stats.rbuf_bytes = g_stats.rbuf_bytes - c->rsize + n;
+    c->rbuf = p;
+    c->rsize = n;
+    return (0);
+}
+
+/* want バイトを読める rbuf の大きさ（2 のべき乗、RBUF_MIN 〜 RBUF_MAX） */
+size_t
+rbuf_roundup(size_t want)
+{
+    size_t n;
+
+    for (n = RBUF_MIN; n < want && n < RBUF_MAX; n <<= 1) {
+        ;
+    }
+    return (n);
+}
+
+/* rbuf を want バイト以上にする（足りている / すでに RBUF_MAX なら何もしない） */
+int
+rbuf_reserve(struct conn *c, size_t want)
+{
+    if (c->rbuf != NULL && c->rsize >= rbuf_roundup(want)) {
+        return (0);
+    }
+    g_stats.rbuf_grow++;
+    return (rbuf_resize(c, rbuf_roundup(want)));
+}
+
+/* 見回り：しばらく受信の無い接続の rbuf を解放する（child[0..child_no) を見る） */
+void
+rbuf_sweep(const int *child, int child_no, double now)
+{
+    struct conn *c;
+    int i;
+
+    for (i = 0; i < child_no; i++) {
+        if (child[i] == -1) {
+            continue;
+        }
+        c = &g_conn[child[i]];
+        if (c->rbuf != NULL && now - c->rlast >= RBUF_IDLE) {
+            (void) rbuf_resize(c, 0);
+            g_stats.rbuf_shrink++;
+        }
+    }
+}
+
+/* 接続 fd を閉じたときの後始末（寿命をヒストグラムに入れ、rbuf を解放する） */
+void
+conn_closed(int fd)
+{
+    (void) rbuf_resize(&g_conn[fd], 0);
+    g_conn[fd].rexpect = 0;
+    g_conn[fd].active = 0;
+    free(g_conn[fd].part);
+    g_conn[fd].part = NULL;
+    g_conn[fd].partlen = g_conn[fd].partcap = 0;
+    g_conn[fd].cr = 0;
+    g_stats.closed++;
+    g_stats.hist_conn[hist_bucket((now_sec() - g_conn[fd].since) * 1e3)]++;
+}
+
+/* 死んだ相手の接続を片付ける（keepalive / TCP_USER_TIMEOUT）
+ *
+ * 相手が FIN も RST も送らずに消える（電源断・ケーブル断・途中の NAT がエントリを捨てた等）と、
+ * こちらの接続は次の要求を待ったまま残り、接続の枠（max_conn）をいつまでも使い続ける。
+ * そこで accept した接続に次を付ける（管理用ソケットの set で変えられ、以後 accept する接続に効く）：
+ *
+ * - SO_KEEPALIVE + TCP_KEEPIDLE / TCP_KEEPINTVL / TCP_KEEPCNT
+ *   keepidle 秒なにも流れなければ keepintvl 秒おきにプローブを送り、keepcnt 回続けて応答が
+ *   無ければ接続をエラー（ETIMEDOUT）にする（keepidle 0 = keepalive を付けない）
+ * - TCP_USER_TIMEOUT（ミリ秒、0 = 付けない）
+ *   送ったデータ（応答やプローブ）が user_timeout の間 ACK されなければエラーにする。
+ *   付けると keepalive も keepcnt ではなくこの時間で打ち切られるので、
+ *   既定は keepidle + keepintvl * keepcnt に合わせてある
+ *
+ * エラーになった接続は読み込み可能になり、recv が ETIMEDOUT / ECONNRESET を返すので閉じる。
+ * select では相手の切断やエラーも「読み込み可能」として見えるので、recv の結果で判断する。
+ * 閉じた理由は stats の reclaimed_timeout / reclaimed_reset で数える
+ */
+#define KEEPIDLE        (60)                                    /* 秒 */
+#define KEEPINTVL       (10)                                    /* 秒 */
+#define KEEPCNT         (5)
+#define USER_TIMEOUT    ((KEEPIDLE + KEEPINTVL * KEEPCNT) * 1000) /* ミリ秒 */
+
+int g_keepidle = KEEPIDLE;
+int g_keepintvl = KEEPINTVL;
+int g_keepcnt = KEEPCNT;
+int g_user_timeout = USER_TIMEOUT;
+
+/* accept した接続に keepalive / TCP_USER_TIMEOUT を付ける（失敗は表示して続行） */
+void
+keepalive_set(int acc)
+{
+    int opt;
+
+    if (g_keepidle > 0) {
+        opt = 1;
+        if (setsockopt(acc, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt)) == -1
+            || setsockopt(acc, IPPROTO_TCP, TCP_KEEPIDLE, &g_keepidle, sizeof(g_keepidle)) == -1
+            || setsockopt(acc, IPPROTO_TCP, TCP_KEEPINTVL, &g_keepintvl, sizeof(g_keepintvl)) == -1
+            || setsockopt(acc, IPPROTO_TCP, TCP_KEEPCNT, &g_keepcnt, sizeof(g_keepcnt)) == -1) {
+            perror("setsockopt(SO_KEEPALIVE)");
+        }
+    }
+    if (g_user_timeout > 0
+        && setsockopt(acc, IPPROTO_TCP, TCP_USER_TIMEOUT,
+                      &g_user_timeout, sizeof(g_user_timeout)) == -1) {
+        perror("setsockopt(TCP_USER_TIMEOUT)");
+    }
+}
+
+/* 相手が消えた接続を閉じた理由を数える（err：recv / writev の errno） */
+void
+reclaim_count(int err)
+{
+    if (err == ETIMEDOUT) {
+        g_stats.reclaimed_timeout++;
+    } else {
+        g_stats.reclaimed_reset++;
+    }
+}
+
+/* 実行時設定（設定ファイル + SIGHUP での読み直し）
+ *
+ * server2 port [conf] の conf に「キー 値」（または「キー = 値」）を 1 行ずつ書く。
+ * '#' から行末まではコメント。書かなかったキーは既定値に戻る。
+ *
+ *   max_conn      同時接続の上限（既定：接続管理テーブルの大きさ。それより大きくはできない）
+ *   buf_size      共有の受信バッファ g_buf の大きさ（既定 BUF_SIZE。大きな要求の続く接続は
+ *                 接続ごとの rbuf で読む。下の「受信バッファの大きさ合わせ」）
+ *   drain_timeout drain の期限（秒、既定 DRAIN_TIMEOUT）
+ *   keepidle      keepalive を始めるまでの無通信時間（秒、既定 KEEPIDLE。0 = keepalive しない）
+ *   keepintvl     keepalive のプローブ間隔（秒、既定 KEEPINTVL）
+ *   keepcnt       応答の無いプローブがこの回数続いたら切る（既定 KEEPCNT）
+ *   user_timeout  TCP_USER_TIMEOUT（ミリ秒、既定 USER_TIMEOUT。0 = 付けない）
+ *   verbose       1 = accept ごとに接続元を表示する（既定 0。接続の多いときは表示が重いので、
+ *                 普段は管理用ソケットの conns で見る）
+ *
+ * 起動時に読み、SIGHUP で読み直して動いたまま反映する（conf_apply）。
+ * 1 行でも誤りがあれば、そのファイルは丸ごと使わない（起動時はエラー終了、SIGHUP なら今の値のまま）。
+ * 管理用ソケットの set も同じキーを 1 つだけ変えて conf_apply に渡す。
+ */
+#define BUF_SIZE    (512)
+
+struct config {
+    int max_conn;
+    int buf_size;
+    int drain_timeout;
+    int keepidle;
+    int keepintvl;
+    int keepcnt;
+    int user_timeout;
+    int verbose;
+};
+
+/* キー名と struct config の中の位置、受け付ける範囲 */
+struct conf_key {
+    const char *name;
+    size_t off;
+    int min;
+    int max;
+};
+
+const struct conf_key g_conf_keys[] = {
+    { "max_conn",      offsetof(struct config, max_conn),      1,   INT_MAX },
+    { "buf_size",      offsetof(struct config, buf_size),      64,  1 << 20 },
+    { "drain_timeout", offsetof(struct config, drain_timeout), 0,   86400 },
+    { "keepidle",      offsetof(struct config, keepidle),      0,   32767 },
+    { "keepintvl",     offsetof(struct config, keepintvl),     1,   32767 },
+    { "keepcnt",       offsetof(struct config, keepcnt),       1,   127 },
+    { "user_timeout",  offsetof(struct config, user_timeout),  0,   INT_MAX },
+    { "verbose",       offsetof(struct config, verbose),       0,   1 },
+};
+
+/* 設定ファイルのパス（NULL なら既定値だけで動く） */
+const char *g_conf_path = NULL;
+
+/* いま反映されている設定（管理用ソケットの set はこれを写して 1 つだけ変える） */
+struct config g_conf_cur;
+
+/* 受信バッファ（send_recv が使う。イベントループは 1 本なので全接続で共用する） */
+char *g_buf = NULL;
+size_t g_buf_size = 0;
+
+/* 既定値（接続上限は FD 上限から決めた接続管理テーブルの大きさ） */
+void
+conf_defaults(struct config *c)
+{
+    c->max_conn = g_max_child;
+    c->buf_size = BUF_SIZE;
+    c->drain_timeout = DRAIN_TIMEOUT;
+    c->keepidle = KEEPIDLE;
+    c->keepintvl = KEEPINTVL;
+    c->keepcnt = KEEPCNT;
+    c->user_timeout = USER_TIMEOUT;
+    c->verbose = 0;
+}
+
+/* path を読んで c を上書きする（戻り値：0 = 成功 / -1 = 開けない、または誤りがあった） */
+int
+conf_parse(const char *path, struct config *c)
+{
+    char line[256], key[64], *p, *end;
+    FILE *fp;
+    long v;
+    size_t k;
+    int lineno, err, n;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        return (-1);
+    }
+    err = 0;
+    lineno = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL) {
+            *p = '\0';
+        }
+        if ((p = strchr(line, '=')) != NULL) {
+            *p = ' ';
+        }
+        if (sscanf(line, "%63s%n", key, &n) != 1) {
+            continue;                   /* 空行・コメントだけの行 */
+        }
+        for (k = 0; k < sizeof(g_conf_keys) / sizeof(g_conf_keys[0]); k++) {
+            if (strcmp(key, g_conf_keys[k].name) == 0) {
+                break;
+            }
+        }
+        if (k == sizeof(g_conf_keys) / sizeof(g_conf_keys[0])) {
+            (void) fprintf(stderr, "conf:%s:%d: unknown key %s\n", path, lineno, key);
+            err = 1;
+            continue;
+        }
+        errno = 0;
+        v = strtol(line + n, &end, 10);
+        while (isspace((unsigned char) *end)) {
+            end++;
+        }
+        if (errno != 0 || end == line + n || *end != '\0'
+            || v < g_conf_keys[k].min || v > g_conf_keys[k].max) {
+            (void) fprintf(stderr, "conf:%s:%d: bad value for %s (%d..%d)\n",
+                           path, lineno, key, g_conf_keys[k].min, g_conf_keys[k].max);
+            err = 1;
+            continue;
+        }
+        *(int *) ((char *) c + g_conf_keys[k].off) = (int) v;
+    }
+    (void) fclose(fp);
+    return (err ? -1 : 0);
+}
+
+/* 設定 c を動いたまま反映する（イベントループから呼ぶ）
+ *
+ * - buf_size が変わったら受信バッファを取り直す（send_recv の外で呼ぶので中身は空）
+ *   → 確保できなければ今の大きさのまま
+ * - 接続上限・drain の期限・keepalive は変数を書き換えるだけ
+ *   （keepalive / user_timeout は以後 accept する接続に効く）
+ *   （max_conn を今の接続数より下げても既存の接続は切らない。新しい接続を断るだけ）
+ * g_conf_cur には実際に反映できた値だけを残す。
+ * 戻り値：0 = 全部反映した / -1 = buf_size を反映できなかった
+ */
+int
+conf_apply(const struct config *c)
+{
+    struct config applied;
+    char *p;
+    int ret;
+
+    applied = *c;
+    ret = 0;
+    if ((size_t) c->buf_size != g_buf_size) {
+        if ((p = realloc(g_buf, (size_t) c->buf_size)) == NULL) {
+            perror("realloc");
+            (void) fprintf(stderr, "conf: buf_size=%d not applied, keep %zu\n",
+                           c->buf_size, g_buf_size);
+            applied.buf_size = (int) g_buf_size;
+            ret = -1;
+        } else {
+            g_buf = p;
+            g_buf_size = (size_t) c->buf_size;
+        }
+    }
+    c = &applied;
+    g_max_conn = c->max_conn < g_max_child ? c->max_conn : g_max_child;
+    g_drain_timeout = c->drain_timeout;
+    g_keepidle = c->keepidle;
+    g_keepintvl = c->keepintvl;
+    g_keepcnt = c->keepcnt;
+    g_user_timeout = c->user_timeout;
+    g_verbose = c->verbose;
+    g_conf_cur = *c;
+
+    (void) fprintf(stderr,
+                   "conf: max_conn=%d buf_size=%zu drain_timeout=%d"
+                   " keepalive=%d/%d/%d user_timeout=%d verbose=%d\n",
+                   g_max_conn, g_buf_size, g_drain_timeout,
+                   g_keepidle, g_keepintvl, g_keepcnt, g_user_timeout, g_verbose);
+    return (ret);
+}
+
+/* SIGHUP：設定ファイルを読み直して反映する（誤りがあれば今の値のまま） */
+void
+conf_reload(void)
+{
+    struct config c;
+
+    if (g_conf_path == NULL) {
+        (void) fprintf(stderr, "conf: no file, keep current\n");
+        return;
+    }
+    conf_defaults(&c);
+    if (conf_parse(g_conf_path, &c) == -1) {
+        (void) fprintf(stderr, "conf:%s: not applied, keep current\n", g_conf_path);
+        return;
+    }
+    (void) conf_apply(&c);
+}
+
+/* 管理用ソケット（admin）
+ *
+ * 動いているサーバの状態を、stderr のログを grep せずに問い合わせるための AF_UNIX ソケット。
+ * adminctl（または socat 等）で 1 行のコマンドを送ると、テキストで応答して閉じる。
+ *
+ * コマンド：
+ * - stats           : 稼働時間、接続数、accept / 拒否 / 要求数、送受信バイト数
+ * - conns           : 接続ごとの fd、接続元、経過秒、要求数、送受信バイト数
+ * - set KEY VALUE   : 設定ファイルと同じキーを 1 つ変えて conf_apply で反映する
+ *                     （次の SIGHUP では設定ファイルの値に戻る）
+ * - drain           : SIGTERM と同じ drain を始める
+ * - dump-histograms : 要求の処理時間（µs）と接続の寿命（ms）の log2 ヒストグラム
+ *
+ * - パスは ADMIN_PATH_FMT にポート番号を入れたもの。権限 0600（起動したユーザだけが使える）
+ * - listen も接続もノンブロッキングで select の監視対象に加え、イベントループの中で処理する
+ *   （応答を送り切れなかった接続は、次の周回で書き込み可能を待つ）
+ *   （接続の処理を止めたりロックを取ったりせず、g_conn / g_stats をそのまま読む）
+ * - 同時に扱う管理接続は ADMIN_MAX 本まで。1 接続 1 コマンドで、応答を書き終えたら閉じる
+ */
+#define ADMIN_PATH_FMT  "/tmp/server2.%s.admin"
+#define ADMIN_MAX       (4)
+#define ADMIN_LINE      (256)
+
+struct admin {
+    int fd;                             /* -1 = 空き */
+    int replied;                        /* コマンドを実行済み（応答の送信中）なら 1 */
+    size_t inlen;                       /* in[] に溜まったコマンド行の長さ */
+    char in[ADMIN_LINE];
+    char *out;                          /* 応答（admin_printf で伸ばす） */
+    size_t outlen, outsize, outoff;     /* 応答の長さ / 確保量 / 送信済み */
+};
+
+struct admin g_admin[ADMIN_MAX];
+int g_admin_soc = -1;
+char g_admin_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+int g_admin_drain = 0;                  /* drain コマンドを受けたら 1（イベントループが見る） */
+
+/* 管理用ソケットを作る（失敗しても管理機能が無いだけで、サーバは続行する） */
+int
+admin_socket(const char *portnm)
+{
+    struct sockaddr_un sun;
+    int i;
+
+    for (i = 0; i < ADMIN_MAX; i++) {
+        g_admin[i].fd = -1;
+    }
+    (void) memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    (void) snprintf(sun.sun_path, sizeof(sun.sun_path), ADMIN_PATH_FMT, portnm);
+    if ((g_admin_soc = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket(AF_UNIX)");
+        return (-1);
+    }
+    (void) unlink(sun.sun_path);
+    if (bind(g_admin_soc, (struct sockaddr *) &sun, sizeof(sun)) == -1
+        || chmod(sun.sun_path, 0600) == -1
+        || listen(g_admin_soc, ADMIN_MAX) == -1) {
+        perror(sun.sun_path);
+        (void) close(g_admin_soc);
+        g_admin_soc = -1;
+        return (-1);
+    }
+    (void) strcpy(g_admin_path, sun.sun_path);
+    (void) fprintf(stderr, "admin=%s\n", g_admin_path);
+    return (g_admin_soc);
+}
+
+/* 応答に書式付きで追記する */
+void
+admin_printf(struct admin *a, const char *fmt, ...)
+{
+    va_list ap;
+    size_t need;
+    char *p;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    need = a->outlen + (size_t) n + 1;
+    if (need > a->outsize) {
+        if ((p = realloc(a->out, need < 4096 ? 4096 : need * 2)) == NULL) {
+            return;
+        }
+        a->out = p;
+        a->outsize = need < 4096 ? 4096 : need * 2;
+    }
+    va_start(ap, fmt);
+    (void) vsnprintf(a->out + a->outlen, (size_t) n + 1, fmt, ap);
+    va_end(ap);
+    a->outlen += (size_t) n;
+}
+
+/* 管理接続を閉じて枠を空ける */
+void
+admin_close(struct admin *a)
+{
+    (void) close(a->fd);
+    free(a->out);
+    (void) memset(a, 0, sizeof(*a));
+    a->fd = -1;
+}
+
+/* 管理用 listen ソケットが ready → 空き枠がある分だけ accept する */
+void
+admin_accept(void)
+{
+    int fd, i;
+
+    for (;;) {
+        for (i = 0; i < ADMIN_MAX && g_admin[i].fd != -1; i++)
+            ;
+        if ((fd = accept4(g_admin_soc, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+            return;
+        }
+        if (i == ADMIN_MAX || fd >= FD_SETSIZE) {
+            /* 枠が無い（または select で扱えない FD）：待たせずに断る */
+            (void) close(fd);
+            continue;
+        }
+        g_admin[i].fd = fd;
+    }
+}
+
+/* ヒストグラム 1 本を「階級の範囲 件数」で書き出す（0 件の階級は省く） */
+void
+admin_hist(struct admin *a, const char *name, const unsigned long *h)
+{
+    unsigned long total;
+    int i;
+
+    total = 0;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        total += h[i];
     }
+    admin_printf(a, "%s total=%lu\n", name, total);
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        if (h[i] != 0) {
+            admin_printf(a, "  [%lu,%lu) %lu\n",
+                         i == 0 ? 0UL : 1UL << (i - 1), 1UL << i, h[i]);
+        }
+    }
+}
 
-    /* listen：接続受付状態へ */
-    if (listen(soc, SOMAXCONN) == -1) {
-        perror("listen");
-        (void) close(soc);
-        freeaddrinfo(res0);
-        return (-1);
+/* set KEY VALUE：いまの設定を写して 1 つだけ変え、conf_apply で反映する */
+void
+admin_set(struct admin *a, const char *key, const char *val)
+{
+    struct config c;
+    char *end;
+    size_t k;
+    long v;
+
+    for (k = 0; k < sizeof(g_conf_keys) / sizeof(g_conf_keys[0]); k++) {
+        if (key != NULL && strcmp(key, g_conf_keys[k].name) == 0) {
+            break;
+        }
     }
+    if (k == sizeof(g_conf_keys) / sizeof(g_conf_keys[0]) || val == NULL) {
+        admin_printf(a, "ERR usage: set KEY VALUE (");
+        for (k = 0; k < sizeof(g_conf_keys) / sizeof(g_conf_keys[0]); k++) {
+            admin_printf(a, "%s%s", k > 0 ? "|" : "", g_conf_keys[k].name);
+        }
+        admin_printf(a, ")\n");
+        return;
+    }
+    errno = 0;
+    v = strtol(val, &end, 10);
+    if (errno != 0 || end == val || *end != '\0'
+        || v < g_conf_keys[k].min || v > g_conf_keys[k].max) {
+        admin_printf(a, "ERR bad value for %s (%d..%d)\n",
+                     key, g_conf_keys[k].min, g_conf_keys[k].max);
+        return;
+    }
+    c = g_conf_cur;
+    *(int *) ((char *) &c + g_conf_keys[k].off) = (int) v;
+    if (conf_apply(&c) == -1) {
+        admin_printf(a, "ERR %s=%ld not applied, keep %s=%d\n", key, v, key,
+                     *(int *) ((char *) &g_conf_cur + g_conf_keys[k].off));
+        return;
+    }
+    admin_printf(a, "OK %s=%ld\n", key, v);
+}
 
-    freeaddrinfo(res0);
-    return (soc);
+/* コマンド 1 行を実行して応答を組み立てる（nconn：現在の接続数） */
+void
+admin_command(struct admin *a, char *line, int nconn)
+{
+    char pbuf[PEER_STRLEN], *cmd, *key, *val;
+    double now;
+    int i;
+
+    now = now_sec();
+    cmd = strtok(line, " \t");
+    key = strtok(NULL, " \t");
+    val = strtok(NULL, " \t");
+    if (cmd == NULL) {
+        admin_printf(a, "ERR empty command\n");
+    } else if (strcmp(cmd, "stats") == 0) {
+        admin_printf(a, "uptime=%.1f\nconns=%d\nmax_conn=%d\ndraining=%d\n"
+                     "accepted=%lu\nrefused=%lu\nclosed=%lu\nrequests=%lu\n"
+                     "rx=%llu\ntx=%llu\ndrain_timeout=%d\n"
+                     "recv_calls=%lu\nrecv_per_kb=%.4f\nrbuf_conns=%lu\nrbuf_bytes=%lu\n"
+                     "rbuf_grow=%lu\nrbuf_shrink=%lu\n"
+                     "keepidle=%d\nkeepintvl=%d\nkeepcnt=%d\nuser_timeout=%d\n"
+                     "reclaimed_timeout=%lu\nreclaimed_reset=%lu\n",
+                     now - g_stats.start, nconn, g_max_conn, g_drain_start != 0.0,
+                     g_stats.accepted, g_stats.refused, g_stats.closed, g_stats.requests,
+                     g_stats.rx, g_stats.tx, g_drain_timeout,
+                     g_stats.recv_calls,
+                     g_stats.rx != 0 ? g_stats.recv_calls * 1024.0 / (double) g_stats.rx : 0.0,
+                     g_stats.rbuf_conns, g_stats.rbuf_bytes, g_stats.rbuf_grow, g_stats.rbuf_shrink,
+                     g_keepidle, g_keepintvl, g_keepcnt, g_user_timeout,
+                     g_stats.reclaimed_timeout, g_stats.reclaimed_reset);
+    } else if (strcmp(cmd, "conns") == 0) {
+        admin_printf(a, "fd peer age nreq rx tx\n");
+        for (i = 0; i < g_max_child + RESERVED_FD; i++) {
+            if (g_conn[i].active) {
+                (void) format_peer(&g_conn[i].addr, pbuf);
+                admin_printf(a, "%d %s %.1f %lu %llu %llu\n", i, pbuf,
+                             now - g_conn[i].since, g_conn[i].nreq, g_conn[i].rx, g_conn[i].tx);
+            }
+        }
+    } else if (strcmp(cmd, "set") == 0) {
+        admin_set(a, key, val);
+    } else if (strcmp(cmd, "drain") == 0) {
+        g_admin_drain = 1;
+        admin_printf(a, "OK draining conns=%d timeout=%d\n", nconn, g_drain_timeout);
+    } else if (strcmp(cmd, "dump-histograms") == 0) {
+        admin_hist(a, "request_us", g_stats.hist_req);
+        admin_hist(a, "conn_ms", g_stats.hist_conn);
+    } else {
+        admin_printf(a, "ERR unknown command %s "
+                     "(stats|conns|set|drain|dump-histograms)\n", cmd);
+    }
+    if (a->out != NULL) {
+        (void) fprintf(stderr, "admin:%s\n", cmd != NULL ? cmd : "");
+    }
 }
 
-/* 最大同時 “接続管理” 数（child[] 配列の最大要素数）
+/* 管理接続のイベント
  *
- * 注意：
- * - ここでいう “child” は fork の子プロセスではなく、
- *   accept 済みの “接続ソケット FD” を入れる配列という意味
+ * 1) コマンド行（'\n' まで）を溜める
+ * 2) 揃ったら admin_command で応答を作り、すぐに送り始める
+ * 3) 応答を送り切ったら閉じる（送れない分は、次の周回で書き込み可能を待って続ける）
  */
-#define MAX_CHILD (20)
+void
+admin_event(struct admin *a, int nconn)
+{
+    ssize_t n;
+    char *eol;
+
+    if (!a->replied) {
+        if ((n = recv(a->fd, a->in + a->inlen, sizeof(a->in) - 1 - a->inlen, 0)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                admin_close(a);
+            }
+            return;
+        }
+        if (n == 0) {
+            admin_close(a);
+            return;
+        }
+        a->inlen += (size_t) n;
+        a->in[a->inlen] = '\0';
+        if ((eol = strpbrk(a->in, "\r\n")) == NULL && a->inlen < sizeof(a->in) - 1) {
+            return;
+        }
+        if (eol != NULL) {
+            *eol = '\0';
+        }
+        admin_command(a, a->in, nconn);
+        if (a->out == NULL) {
+            admin_close(a);
+            return;
+        }
+        a->replied = 1;
+    }
+    if ((n = send(a->fd, a->out + a->outoff, a->outlen - a->outoff, MSG_NOSIGNAL)) == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            admin_close(a);
+        }
+        return;
+    }
+    a->outoff += (size_t) n;
+    if (a->outoff == a->outlen) {
+        admin_close(a);
+    }
+}
+
+/* 終了時：管理接続と管理用ソケットを閉じ、パスを消す */
+void
+admin_shutdown(void)
+{
+    int i;
+
+    if (g_admin_soc == -1) {
+        return;
+    }
+    for (i = 0; i < ADMIN_MAX; i++) {
+        if (g_admin[i].fd != -1) {
+            admin_close(&g_admin[i]);
+        }
+    }
+    (void) close(g_admin_soc);
+    (void) unlink(g_admin_path);
+    g_admin_soc = -1;
+}
+
 
 /* accept + select によるイベントループ
  *
@@ -151,6 +1458,11 @@ server_socket(const char *portnm)
  * 3) listen FD が ready なら accept し、child[] の空きに登録
  * 4) child[i] が ready なら send_recv(child[i], i) を1回呼ぶ
  *    - エラー/EOF なら close して child[i] = -1（空きに戻す）
+ * 5) シグナル FD が ready（SIGTERM / SIGINT）なら drain に入る
+ *    - listen ソケットを閉じて監視から外し、既存の接続だけを処理し続ける
+ *    - 接続が 0 になるか期限が来たら、残りを閉じて戻る
+ * 6) 管理用ソケット / 管理接続が ready なら admin_accept / admin_event
+ *    - 応答の送信中の管理接続だけは “書き込み可能” を待つ（wmask）
  *
  * この方式の性質：
  * - 1回の select で複数 FD が ready になり得るため、その分だけ順に処理する
@@ -160,16 +1472,27 @@ server_socket(const char *portnm)
 void
 accept_loop(int soc)
 {
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-    int child[MAX_CHILD];
+    char pbuf[PEER_STRLEN];
+    int *child;
     struct timeval timeout;
     struct sockaddr_storage from;
-    int acc, child_no, width, i, count, pos, ret;
+    struct admin *a;
+    int acc, child_no, width, i, n, count, pos, ret, sig;
     socklen_t len;
-    fd_set mask;
+    fd_set mask, wmask;
+    double last_sweep, now;
+
+    /* child 配列 / 接続状態テーブルの確保（大きさは RLIMIT_NOFILE から決めた g_max_child） */
+    if ((child = malloc(sizeof(int) * g_max_child)) == NULL
+        || (g_conn = calloc(g_max_child + RESERVED_FD, sizeof(struct conn))) == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    last_sweep = 0.0;
 
     /* child 配列の初期化：-1 を “空きスロット” とする */
-    for (i = 0; i < MAX_CHILD; i++) {
+    for (i = 0; i < g_max_child; i++) {
         child[i] = -1;
     }
 
@@ -181,10 +1504,22 @@ accept_loop(int soc)
     for (;;) {
         /* 1) select 用の fd_set（mask）を構築する */
         FD_ZERO(&mask);
+        FD_ZERO(&wmask);
 
-        /* listen FD を常に監視（新規接続が来たか） */
-        FD_SET(soc, &mask);
-        width = soc + 1;
+        /* listen FD を監視（新規接続が来たか）。drain 中は閉じてあるので外す */
+        width = 0;
+        if (soc != -1) {
+            FD_SET(soc, &mask);
+            width = soc + 1;
+        }
+
+        /* シグナル FD も監視（SIGTERM / SIGINT で drain に入る） */
+        if (g_sig_fd != -1) {
+            FD_SET(g_sig_fd, &mask);
+            if (g_sig_fd + 1 > width) {
+                width = g_sig_fd + 1;
+            }
+        }
 
         /* 既存接続（child[]）も監視に追加 */
         count = 0;
@@ -197,26 +1532,52 @@ accept_loop(int soc)
                     width = child[i] + 1;
                 }
 
-                /* 接続数カウント（デバッグ表示用） */
+                /* 接続数カウント（上限と drain の判定用） */
                 count++;
             }
         }
 
-        (void) fprintf(stderr, "<<child count:%d>>\n", count);
+        /* 管理用ソケットと管理接続（応答の送信中なら書き込み可能を待つ） */
+        if (g_admin_soc != -1) {
+            FD_SET(g_admin_soc, &mask);
+            if (g_admin_soc + 1 > width) {
+                width = g_admin_soc + 1;
+            }
+        }
+        for (i = 0; i < ADMIN_MAX; i++) {
+            a = &g_admin[i];
+            if (a->fd != -1) {
+                FD_SET(a->fd, a->replied ? &wmask : &mask);
+                if (a->fd + 1 > width) {
+                    width = a->fd + 1;
+                }
+            }
+        }
+
+        /* drain 中：接続が 0 になったか、期限が来たら抜ける */
+        if (g_drain_start != 0.0 && drain_check(count)) {
+            break;
+        }
 
-        /* 2) select のタイムアウト設定（10秒）
+        /* 2) select のタイムアウト設定（10秒、drain 中は途中経過と期限を見るため 1 秒）
          * - 10秒間何も起きなければ 0 が返る（タイムアウト）
          * - タイムアウト自体はこのコードでは “何もしない” が、
          *   監視ループが止まっていないことを確認しやすい
          */
-        timeout.tv_sec = 10;
+        timeout.tv_sec = g_drain_start != 0.0 ? 1 : 10;
         timeout.tv_usec = 0;
+        if (g_stats.rbuf_conns > 0) {
+            /* rbuf を持つ接続があれば、見回りの間隔で起きる */
+            timeout.tv_sec = 0;
+            timeout.tv_usec = (long) (RBUF_IDLE / 2 * 1e6);
+        }
 
         /* 3) select：読み込み可能 FD を待つ
          * - 第2引数：readfds（mask）
-         * - 第3/4引数：writefds/exceptfds は未使用
+         * - 第3引数：writefds（wmask、応答の送信中の管理接続だけ）
+         * - 第4引数：exceptfds は未使用
          */
-        switch (select(width, (fd_set *) &mask, NULL, NULL, &timeout)) {
+        switch (select(width, (fd_set *) &mask, &wmask, NULL, &timeout)) {
         case -1:
             /* select 自体のエラー */
             perror("select");
@@ -229,22 +1590,49 @@ accept_loop(int soc)
         default:
             /* 4) ready がある */
 
-            /* (a) listen FD が ready：新規接続の受付 */
-            if (FD_ISSET(soc, &mask)) {
-                len = (socklen_t) sizeof(from);
+            /* (a) listen FD が ready：新規接続の受付
+             *
+             * listen ソケットはノンブロッキングなので、EAGAIN になるまで
+             * （ただし ACCEPT_BUDGET 件まで）accept を繰り返して “まとめて” 受け付ける
+             */
+            if (soc != -1 && FD_ISSET(soc, &mask)) {
+                for (n = 0; n < ACCEPT_BUDGET; n++) {
+                    len = (socklen_t) sizeof(from);
+
+                    /* accept：接続専用ソケット（acc）を得る（最初からノンブロッキング） */
+                    if ((acc = accept_nonblock(soc, &from, &len)) == -1) {
+                        if (errno == ECONNABORTED) {
+                            /* 接続を捨てた（FD 枯渇など）：次の接続へ */
+                            continue;
+                        }
+                        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                            perror("accept");
+                        }
+                        /* EAGAIN：listen キューが空になった */
+                        break;
+                    }
+
+                    /* 接続元の表示は verbose のときだけ（普段は生の sockaddr を g_conn[] に
+                     * 残すだけで、文字列にするのは conns で見るとき） */
+                    if (g_verbose) {
+                        (void) format_peer(&from, pbuf);
+                        (void) fprintf(stderr, "accept:%s\n", pbuf);
+                    }
+
+                    /* select は FD_SETSIZE 以上の FD を扱えない */
+                    if (acc >= FD_SETSIZE) {
+                        (void) fprintf(stderr, "fd >= FD_SETSIZE : cannot accept\n");
+                        (void) close(acc);
+                        continue;
+                    }
 
-                /* accept：接続専用ソケット（acc）を得る */
-                if ((acc = accept(soc, (struct sockaddr *)&from, &len)) == -1) {
-                    if (errno != EINTR) {
-                        perror("accept");
+                    /* 接続上限（set max_conn）と接続状態テーブルの大きさ */
+                    if (count >= g_max_conn || acc >= g_max_child + RESERVED_FD) {
+                        (void) fprintf(stderr, "connection is full : cannot accept\n");
+                        (void) close(acc);
+                        g_stats.refused++;
+                        continue;
                     }
-                } else {
-                    /* 接続元の数値アドレス/ポートを表示 */
-                    (void) getnameinfo((struct sockaddr *) &from, len,
-                                       hbuf, sizeof(hbuf),
-                                       sbuf, sizeof(sbuf),
-                                       NI_NUMERICHOST | NI_NUMERICSERV);
-                    (void) fprintf(stderr, "accept:%s:%s\n", hbuf, sbuf);
 
                     /* child[] の空きスロットを探す（-1 が空き） */
                     pos = -1;
@@ -257,10 +1645,11 @@ accept_loop(int soc)
 
                     if (pos == -1) {
                         /* 空きが無い：child_no を伸ばして末尾に追加できるか検討 */
-                        if (child_no + 1 >= MAX_CHILD) {
+                        if (child_no + 1 >= g_max_child) {
                             /* これ以上保持できない：接続を受けたが保持できないので即クローズ */
                             (void) fprintf(stderr, "child is full : cannot accept\n");
                             (void) close(acc);
+                            g_stats.refused++;
                         } else {
                             /* 配列の “使用範囲” を拡張し、その末尾を使用 */
                             child_no++;
@@ -271,6 +1660,15 @@ accept_loop(int soc)
                     if (pos != -1) {
                         /* accept 済みソケットを登録（以降 select の監視対象になる） */
                         child[pos] = acc;
+                        g_conn[acc].addr = from;
+                        g_conn[acc].active = 1;
+                        g_conn[acc].since = now_sec();
+                        g_conn[acc].nreq = 0;
+                        g_conn[acc].rx = g_conn[acc].tx = 0;
+                        g_conn[acc].rlast = g_conn[acc].since;
+                        keepalive_set(acc);
+                        g_stats.accepted++;
+                        count++;
                     }
                 }
             }
@@ -286,63 +1684,492 @@ accept_loop(int soc)
                         if ((ret = send_recv(child[i], i)) == -1) {
                             /* エラーまたは切断：クローズして空きに戻す */
                             (void) close(child[i]);
+                            conn_closed(child[i]);
                             child[i] = -1;
+                            count--;
                         }
                     }
                 }
             }
+
+            /* (c) シグナル FD が ready：drain に入る
+             * - 同じ周回で ready だった listen FD は (a) で受け付け済みなので、
+             *   listen キューに届いていた接続まで処理してから閉じることになる
+             */
+            if (g_sig_fd != -1 && FD_ISSET(g_sig_fd, &mask)) {
+                while ((sig = sig_fd_read()) != 0) {
+                    if (sig == SIGHUP) {
+                        conf_reload();
+                    } else if (g_drain_start == 0.0) {
+                        drain_begin(sig, count);
+                        (void) close(soc);
+                        soc = -1;
+                    }
+                }
+            }
+
+            /* (d) 管理用ソケット：受け付け / コマンドを読む / 応答を書く */
+            for (i = 0; i < ADMIN_MAX; i++) {
+                a = &g_admin[i];
+                if (a->fd != -1 && (FD_ISSET(a->fd, &mask) || FD_ISSET(a->fd, &wmask))) {
+                    admin_event(a, count);
+                }
+            }
+            if (g_admin_soc != -1 && FD_ISSET(g_admin_soc, &mask)) {
+                admin_accept();
+            }
             break;
         }
+
+        /* 受信バッファの見回り（rbuf を持つ接続があるときだけ） */
+        if (g_stats.rbuf_conns > 0 && (now = now_sec()) - last_sweep >= RBUF_IDLE / 2) {
+            last_sweep = now;
+            rbuf_sweep(child, child_no, now);
+        }
+
+        /* 管理用ソケットの drain コマンド → シグナルと同じく listen ソケットを閉じる */
+        if (g_admin_drain && g_drain_start == 0.0) {
+            drain_begin(0, count);
+            (void) close(soc);
+            soc = -1;
+        }
+    }
+
+    /* drain の期限が来たときに残っている接続を閉じる */
+    for (i = 0; i < child_no; i++) {
+        if (child[i] != -1) {
+            (void) close(child[i]);
+        }
     }
+    admin_shutdown();
+    free(child);
+    free(g_conn);
+    g_conn = NULL;
 }
 
-/* サイズ指定文字列連結（strlcat 相当の安全版）
+/* 行区切り（CR/LF）の一括検索
  *
- * dst  : 連結先バッファ
- * src  : 追加する文字列
- * size : dst バッファ全体のサイズ
+ * buf[0..len) に含まれる '\r' / '\n' の位置（先頭からのオフセット）を
+ * 出現順に off[] へ最大 max 個書き込み、書き込んだ個数を返す。
  *
- * 目的：
- * - 応答文字列 ":OK\r\n" を付けるときにバッファオーバーフローしないようにする
+ * strpbrk(buf, "\r\n") との違い：
+ * - NUL 終端を必要としない（recv で得た len をそのまま渡せる）
+ * - 1 回の走査ですべての区切り位置が得られる（行の切り出しを上位で行える）
+ * - x86 では 16/32 バイト単位で比較する SIMD 版を使う
  *
- * 戻り値：
- * - “連結しようとした結果の総文字数” を返す（strlcat の流儀）
+ * 実装は 3 種類あり、scan_eol_init() で CPU を見て g_scan_eol に設定する：
+ * - scan_eol_scalar : 1 バイトずつ（どの CPU でも動く）
+ * - scan_eol_sse2   : 16 バイトずつ比較 → movemask でビット列にして位置を取り出す
+ * - scan_eol_avx2   : 32 バイトずつ（AVX2 がある CPU のみ）
  */
 size_t
-mystrlcat(char *dst, const char *src, size_t size)
+scan_eol_scalar(const char *buf, size_t len, size_t *off, size_t max)
 {
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
+    size_t i, n;
 
-    /* dst の終端まで進める（最大 size まで） */
-    for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--)
-        ;
-    dlen = pd - dst;
+    for (i = 0, n = 0; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+size_t
+scan_eol_sse2(const char *buf, size_t len, size_t *off, size_t max)
+{
+    __m128i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
+
+    cr = _mm_set1_epi8('\r');
+    lf = _mm_set1_epi8('\n');
+    for (i = 0, n = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (buf + i));
+        mask = (unsigned int) _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        /* 立っているビット = 区切り文字の位置（下位ビットから順に取り出す） */
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
+            }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    /* 16 バイトに満たない残りは 1 バイトずつ */
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
+
+__attribute__((target("avx2")))
+size_t
+scan_eol_avx2(const char *buf, size_t len, size_t *off, size_t max)
+{
+    __m256i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
+
+    cr = _mm256_set1_epi8('\r');
+    lf = _mm256_set1_epi8('\n');
+    for (i = 0, n = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        mask = (unsigned int) _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
+            }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
+#endif
 
-    /* 既に終端に到達していて追加できない場合 */
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
+/* 使用する実装（scan_eol_init で決まる。スレッド生成前に 1 回だけ呼ぶこと） */
+size_t (*g_scan_eol)(const char *, size_t, size_t *, size_t) = scan_eol_scalar;
+const char *g_scan_eol_name = "scalar";
+
+void
+scan_eol_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_scan_eol = scan_eol_avx2;
+        g_scan_eol_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        g_scan_eol = scan_eol_sse2;
+        g_scan_eol_name = "sse2";
     }
+#endif
+}
+
+/* 応答の末尾に付ける文字列（行ごとに iovec で後ろに並べる。受信バッファに場所は取らない） */
+#define RESP_SUFFIX     ":OK\r\n"
+#define RESP_SUFFIX_LEN (sizeof(RESP_SUFFIX) - 1)
+
+/* 長さ付きバッファ（応答組み立て用）
+ *
+ * base[0 .. size) の中で、データは base[off .. off+len) にある。
+ *
+ *   base                off            off+len                 size
+ *    |<-- headroom -->|<---- data ---->|<---- tailroom ---->|
+ *
+ * mystrlcat + strlen との違い：
+ * - 長さを持っているので、連結のたびに NUL を探して先頭から数え直さない（O(1) で追記）
+ * - NUL 終端を必要としないので、recv したバイト列をそのまま扱える
+ * - 先頭側にも空き（headroom）を取れるので、ヘッダ等を後から前に付けられる
+ * - データ部をそのまま iovec にして writev に渡せる
+ */
+struct mbuf {
+    char *base;                         /* 領域の先頭 */
+    size_t size;                        /* 領域の大きさ */
+    size_t off;                         /* データの開始位置 */
+    size_t len;                         /* データ長 */
+};
+
+#define MBUF_DATA(m_)     ((m_)->base + (m_)->off)
+#define MBUF_TAIL(m_)     ((m_)->base + (m_)->off + (m_)->len)
+#define MBUF_HEADROOM(m_) ((m_)->off)
+#define MBUF_TAILROOM(m_) ((m_)->size - (m_)->off - (m_)->len)
+
+/* 領域 base[0..size) を、先頭に headroom バイト空けた空のバッファとして使い始める */
+void
+mbuf_init(struct mbuf *m, char *base, size_t size, size_t headroom)
+{
+    m->base = base;
+    m->size = size;
+    m->off = headroom < size ? headroom : size;
+    m->len = 0;
+}
 
-    /* dst の最終書き込み可能位置（終端 '\0' 分を残す） */
-    pde = dst + size - 1;
+/* 末尾に n バイト追記する（tailroom が足りなければ何もせず -1） */
+int
+mbuf_append(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_TAILROOM(m)) {
+        return (-1);
+    }
+    (void) memcpy(MBUF_TAIL(m), src, n);
+    m->len += n;
+    return (0);
+}
 
-    /* src を dst の末尾にコピー（溢れない範囲まで） */
-    for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
+/* 先頭に n バイト付け足す（headroom が足りなければ何もせず -1） */
+int
+mbuf_prepend(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_HEADROOM(m)) {
+        return (-1);
     }
+    m->off -= n;
+    m->len += n;
+    (void) memcpy(MBUF_DATA(m), src, n);
+    return (0);
+}
 
-    /* 残りを '\0' で埋めて確実に終端 */
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
+/* データ部を iovec に変換する（戻り値は writev に渡す要素数） */
+int
+mbuf_iov(const struct mbuf *m, struct iovec *iov)
+{
+    if (m->len == 0) {
+        return (0);
     }
+    iov[0].iov_base = MBUF_DATA(m);
+    iov[0].iov_len = m->len;
+    return (1);
+}
 
-    /* src の長さ計算（ps を終端まで進める） */
-    while (*ps++)
-        ;
+/* 行ごとの応答（続けて届いた要求の切り出し）
+ *
+ * 1 回の recv には、クライアントが続けて送った複数の要求（行）が入っていることがある。
+ * g_scan_eol で区切りの位置をまとめて求め、1 行ごとに「行 + RESP_SUFFIX」の応答を 1 つずつ返す。
+ * - 区切りは CR / LF / CRLF（CR の直後の LF は同じ区切りとして読み飛ばす）
+ * - 改行で終わらない末尾は 1 行とする（呼び出し側はふつう line_end までしか渡さず、
+ *   行の途中は次の recv まで持ち越す。EOF のときと、改行の無いまま受信バッファが一杯に
+ *   なったときだけ末尾まで渡す）
+ * - 応答は受信バッファ内の行と RESP_SUFFIX を交互に並べた iovec にする（行をコピーしない）
+ *
+ * p[*pos..len) から最大 LINE_BATCH 行を iov[]（2 * LINE_BATCH 個）に並べて *pos を進め、
+ * 並べた応答の合計バイト数を *bytes に入れる。
+ * 戻り値：並べた iovec の数（行数の 2 倍。0 = もう行が無い）
+ */
+#define LINE_BATCH  (64)
+
+int
+frame_lines(const char *p, size_t len, size_t *pos, struct iovec *iov, size_t *bytes)
+{
+    size_t off[LINE_BATCH], base, start, e, n, k;
+    int cnt;
+
+    start = *pos;
+    /* 前の呼び出しが CR で終わっていれば、続く LF は同じ区切り */
+    if (start > 0 && start < len && p[start - 1] == '\r' && p[start] == '\n') {
+        start++;
+    }
+    cnt = 0;
+    *bytes = 0;
+    if (start >= len) {
+        *pos = len;
+        return (0);
+    }
+    base = start;
+    n = g_scan_eol(p + base, len - base, off, LINE_BATCH);
+    for (k = 0; k <= n; k++) {
+        if (k < n) {
+            e = base + off[k];
+            if (e == start && e > base && p[e] == '\n' && p[e - 1] == '\r') {
+                /* CRLF の LF */
+                start = e + 1;
+                continue;
+            }
+        } else if (n < LINE_BATCH && start < len) {
+            /* 改行で終わらない末尾 */
+            e = len;
+        } else {
+            break;
+        }
+        iov[cnt].iov_base = (char *) p + start;
+        iov[cnt].iov_len = e - start;
+        iov[cnt + 1].iov_base = RESP_SUFFIX;
+        iov[cnt + 1].iov_len = RESP_SUFFIX_LEN;
+        *bytes += e - start + RESP_SUFFIX_LEN;
+        cnt += 2;
+        start = e < len ? e + 1 : len;
+    }
+    *pos = start;
+    return (cnt);
+}
+
+/* p[0..len) の最後の区切り（CR / LF）の直後の位置（区切りが無ければ 0）
+ *
+ * recv の区切りは行の区切りと一致しないので、ここより後ろ（まだ改行の届いていない行の途中）は
+ * 応答せずに次の recv まで持ち越す
+ */
+size_t
+line_end(const char *p, size_t len)
+{
+    while (len > 0 && p[len - 1] != '\n' && p[len - 1] != '\r') {
+        len--;
+    }
+    return (len);
+}
+
+/* 行の持ち越し（接続ごと）
+ *
+ * recv の区切りは行の区切りと一致しない。最後の区切りより後ろ（まだ改行の届いていない行の途中）は
+ * 応答せずに接続の part に取っておき、次の recv の前に受信バッファの先頭へ戻す。
+ * - part_load ：持ち越しを buf の先頭へ写す（size に収まる分だけ。写した長さを返す）
+ * - part_store：buf[0..len)（先頭 loaded バイトは part_load で写した分）の最後の区切りより後ろを
+ *               持ち越しにして、応答する長さを返す（0 = まだ 1 行も揃っていない）
+ *   - 改行の無いまま buf が一杯（len == size）なら、そこまでを 1 行とする
+ *   - CR で終わったら cr に覚えておき、次の先頭の LF を同じ区切りとして読み飛ばす（*pos = 1）
+ * 持ち越しは改行を含まないので、残っていても応答を待っている要求は無い。
+ * buf_size を下げたあとは持ち越しが size を超えることがあり、収まらなかった分は part に残る。
+ */
+size_t
+part_load(const struct conn *c, char *buf, size_t size)
+{
+    size_t n;
+
+    n = c->partlen < size ? c->partlen : size;
+    if (n > 0) {
+        (void) memcpy(buf, c->part, n);
+    }
+    return (n);
+}
+
+size_t
+part_store(struct conn *c, const char *buf, size_t len, size_t loaded, size_t size, size_t *pos)
+{
+    size_t end, tail, rest;
+    char *p;
 
-    return (dlen + (ps - src - 1));
+    *pos = c->cr && len > 0 && buf[0] == '\n' ? 1 : 0;
+    if ((end = line_end(buf, len)) == 0 && len == size) {
+        end = len;
+    }
+    tail = len - end;
+    rest = c->partlen - loaded;
+    if (tail + rest > c->partcap) {
+        if ((p = realloc(c->part, tail + rest)) == NULL) {
+            /* 取っておけなければ、末尾までを 1 行として応答する */
+            perror("realloc");
+            end = len;
+            tail = 0;
+        } else {
+            c->part = p;
+            c->partcap = tail + rest;
+        }
+    }
+    if (rest > 0) {
+        (void) memmove(c->part + tail, c->part + loaded, rest);
+    }
+    if (tail > 0) {
+        (void) memcpy(c->part, buf + end, tail);
+    }
+    c->partlen = tail + rest;
+    c->cr = c->partlen == 0 && end > 0 && buf[end - 1] == '\r';
+    return (end);
+}
+
+/* 応答の送り残しを送る（iov[0..iovcnt) の done バイト目から後ろ。送信バッファが一杯なら
+ * SEND_WAIT ミリ秒まで待つ。iov は送った分だけ書き換える。戻り値：送った合計 = done + 残り）
+ *
+ * 接続 FD はノンブロッキングなので、writev は送信バッファに入る分しか送らず、
+ * 一杯なら EAGAIN になる。残りは POLLOUT を待って送り切る
+ * （相手が読まない間は select のループが止まる。教材として簡略化）
+ */
+#define SEND_WAIT (1000)
+
+ssize_t
+send_rest(int fd, struct iovec *iov, int iovcnt, size_t done)
+{
+    struct msghdr msg;
+    struct pollfd pfd;
+    size_t skip;
+    ssize_t n;
+
+    (void) memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t) iovcnt;
+    skip = done;
+    for (;;) {
+        /* 送り終えた iovec を飛ばし、途中まで送ったものは先頭をずらす */
+        while (msg.msg_iovlen > 0 && skip >= msg.msg_iov->iov_len) {
+            skip -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen == 0) {
+            break;
+        }
+        msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + skip;
+        msg.msg_iov->iov_len -= skip;
+        if ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1) {
+            skip = 0;
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return (-1);
+            }
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, SEND_WAIT) <= 0) {
+                errno = ETIMEDOUT;
+                return (-1);
+            }
+            continue;
+        }
+        skip = (size_t) n;
+        done += (size_t) n;
+    }
+    return ((ssize_t) done);
+}
+
+/* 行ごとの応答を返す（p[pos..end) を frame_lines で切り分ける。t0 は要求の処理を始めた時刻）
+ *
+ * 1 行ずつ表示し、行ごとに ":OK\r\n" を付けて返す（続けて届いた要求にも 1 行に 1 つ応答する）。
+ * 送信バッファに入りきらなかった分は send_rest で送り切る。
+ * 戻り値：0 = 続ける / -1 = 送れなかった（呼び出し側が close する）
+ */
+int
+send_lines(int acc, int child_no, const char *p, size_t pos, size_t end, double t0)
+{
+    struct iovec iov[2 * LINE_BATCH];
+    size_t total;
+    unsigned long nline;
+    ssize_t len;
+    int n, k, err;
+
+    nline = 0;
+    while ((n = frame_lines(p, end, &pos, iov, &total)) > 0) {
+        for (k = 0; k < n; k += 2) {
+            (void) fprintf(stderr, "[child%d]%.*s\n", child_no,
+                           (int) iov[k].iov_len, (char *) iov[k].iov_base);
+        }
+
+        /* 応答送信（送信バッファに入りきらなかった分は send_rest で送り切る） */
+        if ((len = writev(acc, iov, n)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                err = errno;
+                perror("writev");
+                reclaim_count(err);
+                return (-1);
+            }
+            len = 0;
+        }
+        if ((size_t) len < total && (len = send_rest(acc, iov, n, (size_t) len)) == -1) {
+            err = errno;
+            perror("send_rest");
+            reclaim_count(err);
+            return (-1);
+        }
+
+        /* 統計（管理用ソケットの conns / stats / dump-histograms で見る） */
+        g_conn[acc].tx += (unsigned long long) len;
+        g_conn[acc].nreq += (unsigned long) n / 2;
+        g_stats.tx += (unsigned long long) len;
+        g_stats.requests += (unsigned long) n / 2;
+        nline += (unsigned long) n / 2;
+    }
+    g_stats.hist_req[hist_bucket((now_sec() - t0) * 1e6)] += nline;
+    return (0);
 }
 
 /* 送受信（1回分）
@@ -351,69 +2178,144 @@ mystrlcat(char *dst, const char *src, size_t size)
  * child_no : どの child スロットか（ログ表示用の番号）
  *
  * アルゴリズム：
- * 1) recv で受信
- *    - len == 0 → 相手が切断（EOF）→ -1
+ * 0) FIONREAD と最近の要求の大きさから読むバッファを選ぶ（共有の g_buf / 接続ごとの rbuf）
+ * 1) 前回の持ち越し（行の途中）を受信バッファの先頭に戻し、その後ろに recv で受信
+ *    - len == 0 → 相手が切断（EOF）→ 持ち越しを最後の 1 行として応答して -1
  *    - len < 0  → エラー → -1
- * 2) 受信文字列を表示（改行は切って見やすく）
- * 3) ":OK\r\n" を付けて send で返す
+ * 2) 最後の区切りまでを send_lines で 1 行ずつ表示し、行ごとに ":OK\r\n" を付けて返す
+ * 3) 後ろの行の途中は次の recv まで持ち越す（part_store）
+ * 4) 次の要求に合わせて rbuf を縮める / 解放する
  *
  * 注意：
  * - TCP はストリームなので “1回 recv ＝ 1メッセージ” とは限らない
- * - send も部分送信があり得る（教材として単純化）
- * - buf[len]='\0' は len==sizeof(buf) の場合に境界外になる可能性がある
- *   → 安全化するなら recv(..., sizeof(buf)-1, ...) が定石
+ *   （1 回に複数の行が入ることも、1 行が何回かに分かれて届くこともある）
  */
 int
 send_recv(int acc, int child_no)
 {
-    char buf[512], *ptr;
+    struct conn *c;
+    struct mbuf m;
+    size_t loaded, pos, end, need;
     ssize_t len;
+    double t0;
+    int avail, err;
 
-    /* 受信 */
-    if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
-        perror("recv");
-        return (-1);
+    t0 = now_sec();
+    c = &g_conn[acc];
+
+    /* 届いているバイト数（取れなければ 0）と最近の要求の大きさに持ち越しを足して、
+       g_buf で足りなければ rbuf に読む（確保できなければ g_buf で読む） */
+    if (ioctl(acc, FIONREAD, &avail) == -1 || avail < 0) {
+        avail = 0;
     }
-    if (len == 0) {
-        (void) fprintf(stderr, "[child%d]recv:EOF\n", child_no);
-        return (-1);
+    need = c->partlen + MAX((size_t) avail, c->rexpect);
+    if (need > g_buf_size && rbuf_reserve(c, need) == 0 && c->rsize > g_buf_size) {
+        mbuf_init(&m, c->rbuf, c->rsize, 0);
+    } else {
+        mbuf_init(&m, g_buf, g_buf_size, 0);
     }
 
-    /* 文字列化（終端付与）
-     * NOTE: len==512 のとき buf[512] で境界外になり得る
-     */
-    buf[len] = '\0';
+    /* 受信バッファの先頭に持ち越しを戻す（応答は受信した行と RESP_SUFFIX を並べて送るので、
+       残りは全部読みに使える） */
+    m.len = loaded = part_load(c, MBUF_DATA(&m), m.size);
 
-    /* 改行を見つけたら切る（ログを1行に揃える） */
-    if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-        *ptr = '\0';
+    /* 受信（buf_size を下げて持ち越しだけで一杯なら、今回は読まずに一杯の規則で応答する） */
+    if (MBUF_TAILROOM(&m) > 0) {
+        g_stats.recv_calls++;
+        if ((len = recv(acc, MBUF_TAIL(&m), MBUF_TAILROOM(&m), 0)) == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                /* 接続 FD はノンブロッキング：まだ読めるデータが無いだけなので切断しない */
+                return (0);
+            }
+            err = errno;
+            perror("recv");
+            reclaim_count(err);
+            return (-1);
+        }
+        if (len == 0) {
+            (void) fprintf(stderr, "[child%d]recv:EOF\n", child_no);
+            /* 改行の届かなかった最後の行にも応答する */
+            (void) send_lines(acc, child_no, c->part, 0, c->partlen, t0);
+            c->partlen = 0;
+            return (-1);
+        }
+        m.len += (size_t) len;
+        tune_accepted(acc);     /* latency：TCP_QUICKACK を付け直す */
+        c->rlast = t0;
+        c->rx += (unsigned long long) len;
+        g_stats.rx += (unsigned long long) len;
     }
 
-    (void) fprintf(stderr, "[child%d]%s\n", child_no, buf);
-
-    /* 応答文字列作成（安全連結） */
-    (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-    len = strlen(buf);
-
-    /* 応答送信（部分送信は未考慮） */
-    if ((len = send(acc, buf, len, 0)) == -1) {
-        perror("send");
+    /* 最後の区切りまでに 1 行ごとに応答し、後ろは持ち越す */
+    end = part_store(c, MBUF_DATA(&m), m.len, loaded, m.size, &pos);
+    if (end > 0) {
+        /* 要求が揃った：大きさを覚える */
+        c->rexpect = MAX(m.len, c->rexpect - c->rexpect / 4);
+    }
+    if (send_lines(acc, child_no, MBUF_DATA(&m), pos, end, t0) == -1) {
         return (-1);
     }
 
+    /* 次の要求に合わせて rbuf を縮める（g_buf で足りるなら解放） */
+    if (c->rbuf != NULL) {
+        if (c->rexpect <= g_buf_size) {
+            (void) rbuf_resize(c, 0);
+            g_stats.rbuf_shrink++;
+        } else if (c->rsize > 4 * rbuf_roundup(c->rexpect)) {
+            (void) rbuf_resize(c, rbuf_roundup(c->rexpect));
+            g_stats.rbuf_shrink++;
+        }
+    }
     return (0);
 }
 
 int
 main(int argc, char *argv[])
 {
-    int soc;
+    static const int sigs[] = { SIGHUP, SIGTERM, SIGINT };
+    struct config conf;
+    int soc, nofile;
 
     /* 引数チェック */
     if (argc <= 1) {
-        (void) fprintf(stderr, "server2 port\n");
+        (void) fprintf(stderr, "server2 port [latency|throughput|churn|none] [conf]\n");
         return (EX_USAGE);
     }
+    profile_arg(&argc, argv);
+
+    /* FD 上限を引き上げ、接続管理テーブルの大きさを決める */
+    if ((nofile = raise_nofile_limit()) != -1) {
+        g_max_child = nofile - RESERVED_FD;
+    }
+
+    /* select の fd_set は FD_SETSIZE 未満の FD しか扱えないので、それ以上は無駄 */
+    if (g_max_child > FD_SETSIZE - RESERVED_FD) {
+        g_max_child = FD_SETSIZE - RESERVED_FD;
+    }
+    g_max_conn = g_max_child;
+    (void) fprintf(stderr, "nofile=%d max_child=%d\n", nofile, g_max_child);
+
+    /* 設定：既定値（FD 上限から）→ 設定ファイル → 反映（受信バッファもここで確保する） */
+    conf_defaults(&conf);
+    if (argc > 2) {
+        g_conf_path = argv[2];
+        if (conf_parse(g_conf_path, &conf) == -1) {
+            return (EX_CONFIG);
+        }
+    }
+    (void) conf_apply(&conf);
+    if (g_buf == NULL) {
+        return (EX_OSERR);
+    }
+
+    /* EMFILE 対策の予備 FD を確保しておく */
+    if ((g_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1) {
+        perror("open");
+    }
+
+    /* 行区切り検索の実装を CPU に合わせて選ぶ（スレッド/子プロセス生成前に 1 回だけ） */
+    scan_eol_init();
+    (void) fprintf(stderr, "scan_eol=%s\n", g_scan_eol_name);
 
     /* listen ソケット準備 */
     if ((soc = server_socket(argv[1])) == -1) {
@@ -421,13 +2323,24 @@ main(int argc, char *argv[])
         return (EX_UNAVAILABLE);
     }
 
+    /* 管理用ソケット（stats / conns / set / drain / dump-histograms） */
+    g_stats.start = now_sec();
+    (void) admin_socket(argv[1]);
+
+    /* SIGHUP（設定の読み直し）/ SIGTERM / SIGINT（drain）はシグナル FD で受け取る */
+    if (sig_fd_init(sigs, (int) (sizeof(sigs) / sizeof(sigs[0]))) == -1) {
+        (void) fprintf(stderr, "sig_fd_init:error (SIGTERM will kill without drain)\n");
+    }
+
     (void) fprintf(stderr, "ready for accept\n");
 
-    /* イベントループ（select）開始 */
+    /* イベントループ（select）開始
+     * - SIGTERM / SIGINT で drain に入り、接続が 0 になるか期限が来ると戻る
+     * - listen ソケットは drain に入るときに accept_loop の中で閉じている
+     */
     accept_loop(soc);
 
-    /* 実際は accept_loop は戻らない想定だが、形式上クローズ */
-    (void) close(soc);
+    (void) fprintf(stderr, "exit\n");
     return (EX_OK);
 }
 
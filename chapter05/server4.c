@@ -20,6 +20,7 @@
  * 3) 以後ループ：
  *    - epoll_wait() で ready イベントを待つ
  *    - listen_fd が ready → accept → 接続 FD を epoll に登録
+ *      （上限や過負荷なら "BUSY" を返して断る。後ろの「過負荷時の受け付け制御」）
  *    - 接続 FD が ready → send_recv()（1回分）→ EOF/エラーなら epoll 解除して close
  *
  * 注意：
@@ -27,32 +28,241 @@
  * - 受信・送信は簡略化されており、実運用向けの完全版ではない（部分送信等）
  */
 
+#define _GNU_SOURCE                     /* accept4() / sched_getcpu() */
+
 #include <sys/epoll.h>                  /* epoll_create, epoll_ctl, epoll_wait */
+#include <sys/ioctl.h>                  /* ioctl(FIONREAD)（受信バッファの大きさ合わせ） */
+#include <sys/mman.h>                   /* mlockall（busy-poll） */
 #include <sys/param.h>
+#include <sys/resource.h>              /* getrlimit / setrlimit */
+#include <sys/signalfd.h>               /* signalfd（SIGTERM を FD で受け取る） */
 #include <sys/socket.h>
+#include <sys/stat.h>                   /* chmod（管理用ソケット） */
 #include <sys/types.h>
+#include <sys/uio.h>                    /* writev, struct iovec */
+#include <sys/un.h>                     /* struct sockaddr_un（管理用ソケット） */
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>                /* TCP_NODELAY / TCP_QUICKACK / TCP_CORK など（プロファイル） */
 #include <netdb.h>
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>                      /* open, O_CLOEXEC */
+#include <limits.h>                     /* INT_MAX（set user_timeout） */
+#include <poll.h>                       /* poll（応答の送り残し） */
+#include <sched.h>                      /* sched_getcpu, sched_setaffinity（busy-poll） */
 #include <signal.h>
+#include <stdarg.h>                     /* va_list（admin_printf） */
+#include <stddef.h>                     /* offsetof（設定のキー表） */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>                       /* clock_gettime（drain の経過時間） */
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>                  /* SSE2 / AVX2 組み込み関数（scan_eol） */
+#endif
+
+/* 接続単位の TCP チューニング（プロファイル）
+ *
+ * 起動引数で 1 つ選ぶ（server4 port [latency|throughput|churn|none]、既定は none = SO_REUSEADDR のみ）。
+ *
+ * - latency    : TCP_NODELAY（Nagle を切って小さな応答をすぐ出す）
+ *                TCP_QUICKACK（遅延 ACK をやめる。カーネルが自動で戻すので受信のたびに付け直す）
+ *                TCP_NOTSENT_LOWAT を小さく（未送信データを溜め込まず、書ける通知を早く返す）
+ * - throughput : SO_SNDBUF / SO_RCVBUF を大きく（ウィンドウを広げて 1 回あたりの転送量を増やす）
+ *                応答を複数回の write で組み立てるときは TCP_CORK で 1 セグメントにまとめる
+ *                （このサーバは mbuf で 1 回の writev にしているので CORK は要らない）
+ * - churn      : TCP_DEFER_ACCEPT（最初のデータが届くまで accept を起こさない）
+ *                TCP_FASTOPEN（SYN に載ったデータを受け付ける。sysctl net.ipv4.tcp_fastopen の
+ *                2 のビットが立っていないと効かない）
+ *                listen のバックログを大きく（実際は net.core.somaxconn で頭打ち）
+ *
+ * - listen ソケットに付けた TCP_NODELAY / TCP_NOTSENT_LOWAT / SO_SNDBUF / SO_RCVBUF は
+ *   accept した接続に引き継がれる（Linux）。引き継がれない TCP_QUICKACK だけ tune_accepted で付ける
+ * - SO_RCVBUF はウィンドウスケールが決まる SYN より前（listen の前）に付ける必要がある
+ * - 効果の比較は tune-bench（ループバックで応答遅延・転送速度・接続の回転を計る）
+ */
+#define PROFILE_NONE        (0)
+#define PROFILE_LATENCY     (1)
+#define PROFILE_THROUGHPUT  (2)
+#define PROFILE_CHURN       (3)
+
+const char *g_profile_name[] = { "none", "latency", "throughput", "churn" };
+
+int g_profile = PROFILE_NONE;
+
+#define TUNE_NOTSENT_LOWAT  (16 * 1024)         /* latency：未送信データの上限 */
+#define TUNE_BUFSZ          (4 * 1024 * 1024)   /* throughput：送受信バッファ（wmem_max / rmem_max で頭打ち） */
+#define TUNE_DEFER_ACCEPT   (1)                 /* churn：データを待つ秒数 */
+#define TUNE_FASTOPEN_QLEN  (256)               /* churn：TFO の保留キュー */
+#define TUNE_BACKLOG        (65535)             /* churn：listen のバックログ */
+
+/* プロファイル名 → 番号（知らない名前なら -1） */
+int
+profile_lookup(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(g_profile_name) / sizeof(g_profile_name[0])); i++) {
+        if (strcmp(name, g_profile_name[i]) == 0) {
+            return (i);
+        }
+    }
+    return (-1);
+}
+
+/* listen ソケットにプロファイルを付ける（bind / listen の前に呼ぶ。失敗は表示して続行） */
+void
+tune_listen(int soc)
+{
+    int opt;
+
+    switch (g_profile) {
+    case PROFILE_LATENCY:
+        opt = 1;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_NODELAY)");
+        }
+        opt = TUNE_NOTSENT_LOWAT;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_NOTSENT_LOWAT)");
+        }
+        break;
+    case PROFILE_THROUGHPUT:
+        opt = TUNE_BUFSZ;
+        if (setsockopt(soc, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(SO_SNDBUF)");
+        }
+        if (setsockopt(soc, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(SO_RCVBUF)");
+        }
+        break;
+    case PROFILE_CHURN:
+        opt = TUNE_DEFER_ACCEPT;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_DEFER_ACCEPT)");
+        }
+        opt = TUNE_FASTOPEN_QLEN;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_FASTOPEN, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_FASTOPEN)");
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* accept した接続 / 受信した直後の接続に、引き継がれない分を付ける */
+void
+tune_accepted(int acc)
+{
+    int opt;
+
+    if (g_profile == PROFILE_LATENCY) {
+        opt = 1;
+        (void) setsockopt(acc, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt));
+    }
+}
+
+/* ビジーポーリング（busy-poll）モード
+ *
+ * 起動引数で有効にする（server4 port [profile] [spin_us [mlock]]、spin_us 0 = 無効で従来どおり）。
+ *
+ * 通常は epoll_wait を 10 秒のタイムアウトで呼んで眠って待つ。眠ったスレッドは
+ * イベントが来てから起こされ、CPU に載るまでに数 µs〜数十 µs かかる（CPU が省電力状態なら
+ * さらに長い）。busy-poll では CPU を 1 つ使い切る代わりに、この起床の遅れを無くす：
+ *
+ * - epoll_wait を timeout 0 で呼び続ける（イベントが無くてもすぐ戻る = 空振り）
+ * - 最後にイベントがあってから spin_us 経っても何も来なければ、従来の眠る epoll_wait に戻る
+ *   （暇なときまで CPU を燃やさない）。次にイベントが来たらまた回り始める
+ * - SO_BUSY_POLL（listen ソケットに付けると接続に引き継がれる）：recv のときカーネルが
+ *   NIC のキュー（NAPI）を直接ポーリングする時間（µs）。ループバックには NAPI が無いので効かない。
+ *   既定より大きな値には CAP_NET_ADMIN が要る（失敗は表示して続行）
+ * - イベントループのスレッドを起動時にいた CPU に固定する（sched_setaffinity）。
+ *   CPU を移るたびにキャッシュが冷えるのを避ける
+ * - mlock を付けると mlockall(MCL_CURRENT | MCL_FUTURE) でページを物理メモリに固定する
+ *   （RLIMIT_MEMLOCK が足りなければ表示して続行）。付けなくても、接続テーブル・events[]・
+ *   スタックは起動時に書き込んでおき（prefault）、処理の途中でページフォルトを起こさない
+ * - オンラインの CPU が 1 つしか無いときは回さない（spin_us を 0 に戻す）。回っている間は
+ *   相手（同じマシンのクライアントや他のプロセス）が CPU を使えず、タイムスライス
+ *   （ms 単位）の終わりまで待たされるので、眠って待つより遅くなる
+ * - 回す時間は管理用ソケットの set spin_us でも変えられる。ただし 0 以外にできるのは、
+ *   起動時に spin_us を指定して busy_poll_init が準備を済ませた（CPU が 2 つ以上あり、
+ *   CPU を固定した）ときだけ（CPU の固定と mlock は起動時だけ）
+ * - 効果は bench の pingpong（1 接続の往復時間の分布）で比べる
+ */
+#define BUSY_POLL_US        (50)                /* SO_BUSY_POLL の値（µs） */
+#define PREFAULT_STACK      (64 * 1024)         /* 起動時に触っておくスタックの大きさ */
+
+long g_spin_us = 0;             /* 空振りを続ける時間（µs、0 = busy-poll しない） */
+int g_mlock = 0;                /* 1 = mlockall する */
+int g_busy_poll = 0;            /* 1 = busy_poll_init で準備した（set spin_us で回せる） */
+
+/* スタックを PREFAULT_STACK だけ書き込んで、ページを割り当てさせておく */
+void
+prefault_stack(void)
+{
+    volatile char buf[PREFAULT_STACK];
+    size_t i;
+
+    for (i = 0; i < sizeof(buf); i += 4096) {
+        buf[i] = 0;
+    }
+}
+
+/* busy-poll の準備（listen ソケットを作った後、イベントループの前に 1 回。失敗は表示して続行） */
+void
+busy_poll_init(int soc)
+{
+    cpu_set_t cpus;
+    int opt, cpu;
+
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+        (void) fprintf(stderr, "busy-poll: only 1 CPU online, spinning would starve the peer; disabled\n");
+        g_spin_us = 0;
+        return;
+    }
+
+#ifdef SO_BUSY_POLL
+    opt = BUSY_POLL_US;
+    if (setsockopt(soc, SOL_SOCKET, SO_BUSY_POLL, &opt, sizeof(opt)) == -1) {
+        perror("setsockopt(SO_BUSY_POLL)");
+    }
+#else
+    (void) soc;
+    (void) opt;
+#endif
+
+    if ((cpu = sched_getcpu()) != -1) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) == -1) {
+            perror("sched_setaffinity");
+            cpu = -1;
+        }
+    }
+
+    if (g_mlock && mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+        perror("mlockall");
+    }
+    prefault_stack();
+    g_busy_poll = 1;
+    (void) fprintf(stderr, "busy-poll: spin_us=%ld cpu=%d mlock=%d\n", g_spin_us, cpu, g_mlock);
+}
+
 /* サーバソケットの準備（listen ソケットを作る）
  *
  * portnm: 文字列ポート番号（例: "55555"）
  *
  * アルゴリズム：
  * - getaddrinfo(NULL, port, AI_PASSIVE) で待受けアドレスを得る
- * - socket → setsockopt(SO_REUSEADDR) → bind → listen
+ * - socket → setsockopt(SO_REUSEADDR) → tune_listen（プロファイル）→ bind → listen
  */
 int
 server_socket(const char *portnm)
@@ -85,48 +295,1452 @@ server_socket(const char *portnm)
     }
     (void) fprintf(stderr, "port=%s\n", sbuf);
 
-    /* ソケット生成 */
-    if ((soc = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol)) == -1) {
-        perror("socket");
-        freeaddrinfo(res0);
-        return (-1);
+    /* ソケット生成
+     * - SOCK_NONBLOCK：listen ソケットをノンブロッキングにする
+     *   （accept_loop で EAGAIN が返るまで accept を繰り返して “まとめて” 受け付けるため）
+     * - SOCK_CLOEXEC ：exec 時に FD を引き継がない
+     */
+    if ((soc = socket(res0->ai_family, res0->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                      res0->ai_protocol)) == -1) {
+        perror("socket");
+        freeaddrinfo(res0);
+        return (-1);
+    }
+
+    /* 再起動時に bind しやすくする */
+    opt = 1;
+    opt_len = sizeof(opt);
+    if (setsockopt(soc, SOL_SOCKET, SO_REUSEADDR, &opt, opt_len) == -1) {
+        perror("setsockopt");
+        (void) close(soc);
+        freeaddrinfo(res0);
+        return (-1);
+    }
+
+    /* プロファイルの TCP オプション（バッファの大きさは SYN より前に決めておく） */
+    tune_listen(soc);
+
+    /* bind（待受けポートへ割当） */
+    if (bind(soc, res0->ai_addr, res0->ai_addrlen) == -1) {
+        perror("bind");
+        (void) close(soc);
+        freeaddrinfo(res0);
+        return (-1);
+    }
+
+    /* listen（接続待ち状態へ。churn はバックログを大きく） */
+    if (listen(soc, g_profile == PROFILE_CHURN ? TUNE_BACKLOG : SOMAXCONN) == -1) {
+        perror("listen");
+        (void) close(soc);
+        freeaddrinfo(res0);
+        return (-1);
+    }
+
+    freeaddrinfo(res0);
+    return (soc);
+}
+
+/* 接続元アドレス文字列の最大長（"IPv6アドレス:ポート" + NUL） */
+#define PEER_STRLEN (INET6_ADDRSTRLEN + 8)
+
+/* 10 進数の書き出し（format_peer の下請け） */
+char *
+put_dec(char *p, unsigned int v)
+{
+    char tmp[10];
+    int n;
+
+    n = 0;
+    do {
+        tmp[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0) {
+        *p++ = tmp[--n];
+    }
+    return (p);
+}
+
+/* 接続元アドレスの文字列化（getnameinfo を使わない高速版）
+ *
+ * ss  : accept で得た生のアドレス（AF_INET / AF_INET6）
+ * buf : 出力先（PEER_STRLEN バイト以上）
+ *
+ * 出力形式は getnameinfo(NI_NUMERICHOST | NI_NUMERICSERV) の host と port を
+ * ':' でつないだもの（"127.0.0.1:50000"）と同じ。
+ *
+ * - getnameinfo は NSS/ロケールを経由し、内部でも書式化を行うので accept 毎に呼ぶと重い
+ * - ここでは 10 進/16 進の変換を手で書き、malloc も snprintf も使わない
+ * - IPv6 は RFC 5952 に従い、最長の 0 の連続（2 グループ以上）を "::" に縮める
+ *
+ * 戻り値：書き込んだ文字数（NUL を除く）
+ */
+size_t
+format_peer(const struct sockaddr_storage *ss, char *buf)
+{
+    static const char hex[] = "0123456789abcdef";
+    const struct sockaddr_in *sin;
+    const struct sockaddr_in6 *sin6;
+    const unsigned char *a;
+    unsigned int port, w;
+    int i, j, best, bestlen, shift;
+    char *p;
+
+    p = buf;
+    switch (ss->ss_family) {
+    case AF_INET:
+        sin = (const struct sockaddr_in *) ss;
+        a = (const unsigned char *) &sin->sin_addr;
+        for (i = 0; i < 4; i++) {
+            if (i > 0) {
+                *p++ = '.';
+            }
+            p = put_dec(p, a[i]);
+        }
+        port = ntohs(sin->sin_port);
+        break;
+
+    case AF_INET6:
+        sin6 = (const struct sockaddr_in6 *) ss;
+        a = sin6->sin6_addr.s6_addr;
+
+        /* 最長の 0 グループの連続を探す */
+        best = -1;
+        bestlen = 0;
+        for (i = 0; i < 8; i = j + 1) {
+            for (j = i; j < 8 && a[2 * j] == 0 && a[2 * j + 1] == 0; j++)
+                ;
+            if (j - i >= 2 && j - i > bestlen) {
+                best = i;
+                bestlen = j - i;
+            }
+        }
+
+        if (best == 0
+            && (bestlen == 6 || (bestlen == 5 && a[10] == 0xff && a[11] == 0xff))) {
+            /* IPv4 射影/互換アドレス（::ffff:a.b.c.d, ::a.b.c.d）は末尾 32bit を 10 進で書く
+             * （inet_ntop/getnameinfo と同じ判定） */
+            *p++ = ':';
+            *p++ = ':';
+            if (bestlen == 5) {
+                (void) memcpy(p, "ffff:", 5);
+                p += 5;
+            }
+            for (j = 12; j < 16; j++) {
+                if (j > 12) {
+                    *p++ = '.';
+                }
+                p = put_dec(p, a[j]);
+            }
+        } else {
+            for (i = 0; i < 8; i++) {
+                if (i == best) {
+                    *p++ = ':';
+                    *p++ = ':';
+                    i += bestlen - 1;
+                    continue;
+                }
+                if (i > 0 && i != best + bestlen) {
+                    *p++ = ':';
+                }
+                w = ((unsigned int) a[2 * i] << 8) | a[2 * i + 1];
+                for (shift = 12; shift > 0 && ((w >> shift) & 0xf) == 0; shift -= 4)
+                    ;
+                for (; shift >= 0; shift -= 4) {
+                    *p++ = hex[(w >> shift) & 0xf];
+                }
+            }
+        }
+        port = ntohs(sin6->sin6_port);
+        break;
+
+    default:
+        *p++ = '?';
+        port = 0;
+        break;
+    }
+
+    *p++ = ':';
+    p = put_dec(p, port);
+    *p = '\0';
+    return ((size_t) (p - buf));
+}
+
+/* 1回の “listen FD が ready” で accept する最大件数（1イテレーションあたりの予算）
+ *
+ * - ready 1回につき 1件しか accept しないと、接続が殺到したときに
+ *   イベントループ1周ごとに 1件ずつしか捌けない（accept レートが頭打ちになる）
+ * - かといって無制限に accept し続けると既存接続の処理が遅れるので上限を設ける
+ * - 予算を使い切って残った接続は、次の周回でも listen FD が ready のままなので取りこぼさない
+ */
+#define ACCEPT_BUDGET (64)
+
+/* 受け付けられない接続に返す 1 行（黙って close すると、クライアントには RST に見えて
+ * すぐに接続し直されるので、断った理由を返してから閉じる。後ろの「過負荷時の受け付け制御」） */
+#define BUSY_MSG        "BUSY\r\n"
+#define BUSY_MSG_LEN    (sizeof(BUSY_MSG) - 1)
+
+/* RLIMIT_NOFILE を引き上げた結果がこれを超える場合はこの値に丸める（テーブル確保量の上限） */
+#define NOFILE_MAX (65536)
+
+/* 接続管理以外で使う FD の見込み数（0,1,2 / listen / 予備FD / epoll / シグナル / 管理用ソケット など） */
+#define RESERVED_FD (16)
+
+/* EMFILE/ENFILE 対策の予備 FD（/dev/null を開いたまま確保しておく） */
+int g_spare_fd = -1;
+
+/* RLIMIT_NOFILE（プロセスが開ける FD 数）をハードリミットまで引き上げる
+ *
+ * - ソフトリミットは 1024 程度に絞られていることが多いが、
+ *   ハードリミットまでは一般ユーザでも引き上げられる
+ * - 起動時に1回呼び、戻り値から接続管理テーブルの大きさを決める
+ *
+ * 戻り値：
+ * - 成功：引き上げ後のソフトリミット
+ * - 失敗：-1
+ */
+int
+raise_nofile_limit(void)
+{
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        perror("getrlimit");
+        return (-1);
+    }
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+            /* 引き上げに失敗しても現状の値で続行する */
+            perror("setrlimit");
+            (void) getrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
+
+    /* RLIM_INFINITY 等の巨大な値はテーブルを確保しきれないので丸める */
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > NOFILE_MAX) {
+        return (NOFILE_MAX);
+    }
+    return ((int) rl.rlim_cur);
+}
+
+/* ノンブロッキング accept（accept4）＋ EMFILE 時の “予備 FD による捨て accept”
+ *
+ * soc  : ノンブロッキングの listen ソケット
+ * from : 接続元アドレスの格納先
+ * len  : from のサイズ（入出力）
+ *
+ * アルゴリズム：
+ * 1) accept4(SOCK_NONBLOCK | SOCK_CLOEXEC) で受け付ける
+ *    - 接続 FD は最初からノンブロッキング/close-on-exec になるので fcntl が要らない
+ * 2) EMFILE/ENFILE（FD 枯渇）の場合：
+ *    - 予備 FD を close して空きを 1 つ作る
+ *    - その空きで accept して即 close（接続を “捨てる”）
+ *    - 予備 FD を開き直す
+ *    → listen キューから接続が取り除かれるので、listen FD が
+ *      “読み込み可能” を返し続けて CPU 100% で空回りすることが無くなる
+ *
+ * 戻り値：
+ * - 成功：接続 FD
+ * - 失敗：-1
+ *   - errno == EAGAIN       : listen キューが空になった（ドレイン完了）
+ *   - errno == ECONNABORTED : 接続を捨てた（呼び出し側は次の accept へ進んでよい）
+ */
+int
+accept_nonblock(int soc, struct sockaddr_storage *from, socklen_t *len)
+{
+    int acc, err;
+
+    for (;;) {
+        if ((acc = accept4(soc, (struct sockaddr *) from, len,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+            return (acc);
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno != EMFILE && errno != ENFILE) || g_spare_fd == -1) {
+            return (-1);
+        }
+
+        /* FD 枯渇：予備 FD を手放して 1 接続だけ受けて捨てる */
+        (void) close(g_spare_fd);
+        if ((acc = accept(soc, NULL, NULL)) != -1) {
+            (void) send(acc, BUSY_MSG, BUSY_MSG_LEN, MSG_NOSIGNAL | MSG_DONTWAIT);
+            (void) close(acc);
+            (void) fprintf(stderr, "accept:EMFILE:shed\n");
+            err = ECONNABORTED;
+        } else {
+            err = errno;
+        }
+        g_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        errno = err;
+        return (-1);
+    }
+}
+
+/* シグナルを FD で受け取る（sig_fd_init）
+ *
+ * - g_sig_fd   : signalfd、または自己パイプの読み側（イベントループで待てる）
+ * - g_sig_pipe : 自己パイプ（signalfd が使えないときだけ使う）
+ * - g_sig_mask : sig_fd_init で扱うシグナルの集合
+ */
+int g_sig_fd = -1;
+int g_sig_pipe[2] = { -1, -1 };
+sigset_t g_sig_mask;
+
+/* 自己パイプ用のシグナルハンドラ（signalfd が使えないとき）
+ *
+ * シグナル番号を 1 バイト書くだけ（write は async-signal-safe）。
+ */
+void
+sig_pipe_handler(int sig)
+{
+    unsigned char c;
+    int save;
+
+    save = errno;
+    c = (unsigned char) sig;
+    (void) write(g_sig_pipe[1], &c, 1);
+    errno = save;
+}
+
+/* sigs[0..nsigs) を「読める FD」で受け取るようにする
+ *
+ * 戻り値: イベントループで待つ FD / -1（失敗）
+ *
+ * アルゴリズム：
+ * 1) 対象のシグナルをブロック（以後、非同期に割り込まれない）
+ * 2) signalfd を作る → 届いたシグナルは signalfd_siginfo として read できる
+ * 3) signalfd が無ければ自己パイプ：ハンドラ（SA_RESTART）が番号を 1 バイト書き、
+ *    ブロックを外す
+ */
+int
+sig_fd_init(const int *sigs, int nsigs)
+{
+    struct sigaction sa;
+    int i;
+
+    (void) sigemptyset(&g_sig_mask);
+    for (i = 0; i < nsigs; i++) {
+        (void) sigaddset(&g_sig_mask, sigs[i]);
+    }
+    (void) sigprocmask(SIG_BLOCK, &g_sig_mask, NULL);
+#ifdef __linux__
+    if ((g_sig_fd = signalfd(-1, &g_sig_mask, SFD_NONBLOCK | SFD_CLOEXEC)) != -1) {
+        return (g_sig_fd);
+    }
+    perror("signalfd");
+#endif
+    if (pipe(g_sig_pipe) == -1) {
+        perror("pipe");
+        (void) sigprocmask(SIG_UNBLOCK, &g_sig_mask, NULL);
+        return (-1);
+    }
+    for (i = 0; i < 2; i++) {
+        (void) fcntl(g_sig_pipe[i], F_SETFL, fcntl(g_sig_pipe[i], F_GETFL, 0) | O_NONBLOCK);
+        (void) fcntl(g_sig_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_pipe_handler;
+    (void) sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    for (i = 0; i < nsigs; i++) {
+        (void) sigaction(sigs[i], &sa, NULL);
+    }
+    g_sig_fd = g_sig_pipe[0];
+    (void) sigprocmask(SIG_UNBLOCK, &g_sig_mask, NULL);
+    return (g_sig_fd);
+}
+
+/* シグナル FD から 1 つ取り出す（戻り値：シグナル番号 / 0 = もう無い） */
+int
+sig_fd_read(void)
+{
+#ifdef __linux__
+    struct signalfd_siginfo si;
+#endif
+    unsigned char c;
+
+    if (g_sig_pipe[0] == -1) {
+#ifdef __linux__
+        if (read(g_sig_fd, &si, sizeof(si)) == (ssize_t) sizeof(si)) {
+            return ((int) si.ssi_signo);
+        }
+#endif
+        return (0);
+    }
+    if (read(g_sig_fd, &c, 1) == 1) {
+        return (c);
+    }
+    return (0);
+}
+
+/* グレースフル停止（drain）
+ *
+ * SIGTERM / SIGINT（または管理用ソケットの drain）を受けたら即座に終わらず、次の順で止める：
+ * 1) listen ソケットを閉じて新しい接続を受けない
+ *    （ロードバランサやローリング再起動の相手は、ここで接続先を切り替える）
+ * 2) 既に受け付けた接続はこれまでどおり処理し、相手が閉じるのを待つ
+ * 3) 接続が 0 になったら終了。g_drain_timeout 秒を過ぎたら残りを閉じて終了する
+ *    （既定 DRAIN_TIMEOUT、管理用ソケットの set drain_timeout で変えられる）
+ * - 途中経過（残り接続数と経過時間）を約 1 秒ごとに表示する
+ * - g_drain_start が 0 でなければ drain 中
+ */
+#define DRAIN_TIMEOUT   (30)
+
+int g_drain_timeout = DRAIN_TIMEOUT;
+
+double g_drain_start = 0.0;     /* drain を始めた時刻（CLOCK_MONOTONIC、0 = 通常運転） */
+double g_drain_report = 0.0;    /* 最後に途中経過を表示した時刻 */
+
+/* 単調増加時計の現在値（秒） */
+double
+now_sec(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec + (double) ts.tv_nsec / 1e9);
+}
+
+/* drain を始める（sig：受けたシグナル / 0 = 管理用ソケットから、nconn：その時点の接続数） */
+void
+drain_begin(int sig, int nconn)
+{
+    g_drain_start = g_drain_report = now_sec();
+    if (sig == 0) {
+        (void) fprintf(stderr, "drain:admin, stop accepting, conns=%d, timeout=%ds\n",
+                       nconn, g_drain_timeout);
+    } else {
+        (void) fprintf(stderr, "drain:signal %d, stop accepting, conns=%d, timeout=%ds\n",
+                       sig, nconn, g_drain_timeout);
+    }
+}
+
+/* drain を終えてよいか調べる（nconn：残っている接続数）
+ *
+ * 戻り値：1 = 終了してよい（接続 0、または期限切れ） / 0 = まだ待つ
+ */
+int
+drain_check(int nconn)
+{
+    double now;
+
+    now = now_sec();
+    if (nconn == 0) {
+        (void) fprintf(stderr, "drain:done in %.1fs\n", now - g_drain_start);
+        return (1);
+    }
+    if (now - g_drain_start >= g_drain_timeout) {
+        (void) fprintf(stderr, "drain:deadline, closing %d conns\n", nconn);
+        return (1);
+    }
+    if (now - g_drain_report >= 1.0) {
+        g_drain_report = now;
+        (void) fprintf(stderr, "drain:conns=%d elapsed=%.1fs\n", nconn, now - g_drain_start);
+    }
+    return (0);
+}
+
+/* 最大同時接続（epoll に登録する “接続FD” の上限）の既定値
+ * NOTE:
+ * - 実際の上限は main で RLIMIT_NOFILE を引き上げた結果から g_max_child に決め直す
+ *   （getrlimit に失敗した場合だけこの値を使う）
+ */
+#define MAX_CHILD (20)
+
+/* 接続管理テーブル / events[] 配列の大きさ（起動時に決まる） */
+int g_max_child = MAX_CHILD;
+
+/* 実際に受け付ける接続数の上限（1..g_max_child、管理用ソケットの set max_conn で変えられる） */
+int g_max_conn = MAX_CHILD;
+
+/* accept ごとに接続元を表示するなら 1（設定 verbose、既定 0） */
+int g_verbose = 0;
+
+/* 接続ごとの状態
+ * - addr   : accept で得た接続元アドレス
+ *            生の sockaddr のまま保持し、文字列化はログや統計で必要になったときに
+ *            format_peer で行う（accept のたびに getnameinfo しない）
+ * - active : epoll に登録中なら 1（drain の期限切れで残りを閉じるときに使う）
+ * - since  : accept した時刻（now_sec、接続の経過時間と寿命のヒストグラムに使う）
+ * - nreq / rx / tx : この接続で処理した要求数 / 受信バイト数 / 送信バイト数
+ * - rbuf 〜 rlast : 接続ごとの受信バッファ（下の「受信バッファの大きさ合わせ」を参照）
+ */
+struct conn {
+    struct sockaddr_storage addr;
+    int active;
+    double since;
+    unsigned long nreq;
+    unsigned long long rx, tx;
+    char *rbuf;                 /* 受信バッファ（NULL = スタックの RBUF_STACK バイトで読む） */
+    size_t rsize;               /* rbuf の大きさ */
+    size_t rlen;                /* rbuf に持ち越している行の途中（改行がまだ届いていない分） */
+    size_t rexpect;             /* 最近の要求の大きさ（要求ごとに 3/4 へ減衰させた最大値） */
+    int lowat;                  /* 付けている SO_RCVLOWAT（0 = 付けていない） */
+    double rlast;               /* 最後に受信した時刻 */
+    int cr;                     /* 前の recv が CR で終わった（次の先頭の LF は同じ区切り） */
+};
+
+/* FD を添字にした接続状態テーブル（大きさ g_max_child + RESERVED_FD） */
+struct conn *g_conn;
+
+/* これまでに accept した最大の FD + 1（rbuf_sweep が走査する範囲） */
+int g_fd_hi = 0;
+
+/* 稼働統計（管理用ソケットの stats / dump-histograms で返す）
+ *
+ * - イベントループのスレッドだけが更新・参照するのでロックは要らない
+ * - ヒストグラムは log2 の階級：hist[0] = [0,1)、hist[i] = [2^(i-1), 2^i)
+ *   （要求の処理時間はマイクロ秒、接続の寿命はミリ秒）
+ */
+#define HIST_BUCKETS    (32)
+
+struct stats {
+    double start;                       /* 起動時刻（now_sec） */
+    unsigned long accepted;             /* 受け付けた接続 */
+    unsigned long refused;              /* 上限で断った接続 */
+    unsigned long closed;               /* 閉じた接続 */
+    unsigned long requests;             /* 処理した要求（recv 1 回分） */
+    unsigned long long rx, tx;          /* 送受信バイト数 */
+    unsigned long reclaimed_timeout;    /* keepalive / user timeout で切れて閉じた接続 */
+    unsigned long reclaimed_reset;      /* RST などのエラーで閉じた接続 */
+    unsigned long reclaimed_rdhup;      /* 相手が閉じたのを RDHUP で知って閉じた接続 */
+    unsigned long shed_full;            /* 上限（max_conn）で断った接続（refused の内訳） */
+    unsigned long shed_delay;           /* 待ち時間（overload）で断った接続（refused の内訳） */
+    unsigned long busy_sent;            /* BUSY を返せた接続 */
+    unsigned long accept_paused;        /* listen FD を epoll から外した回数 */
+    unsigned long recv_calls;           /* 接続の recv を呼んだ回数 */
+    unsigned long rbuf_conns;           /* rbuf を持っている接続（現在値） */
+    unsigned long rbuf_bytes;           /* rbuf の合計バイト数（現在値） */
+    unsigned long rbuf_grow;            /* rbuf を確保・拡張した回数 */
+    unsigned long rbuf_shrink;          /* rbuf を縮小・解放した回数 */
+    unsigned long lowat_set;            /* SO_RCVLOWAT を付けた回数 */
+    unsigned long lowat_miss;           /* 予想が外れて見回りが 1 に戻した回数 */
+    unsigned long polls;                /* busy-poll：timeout 0 の epoll_wait */
+    unsigned long idle_polls;           /* busy-poll：そのうち空振り */
+    unsigned long sleeps;               /* busy-poll：眠る epoll_wait に戻った回数 */
+    unsigned long hist_req[HIST_BUCKETS];
+    unsigned long hist_conn[HIST_BUCKETS];
+};
+
+struct stats g_stats;
+
+/* ヒストグラムの階級（v を切り捨てた整数のビット長） */
+int
+hist_bucket(double v)
+{
+    unsigned long x;
+    int b;
+
+    x = v < 1.0 ? 0 : (unsigned long) v;
+    for (b = 0; x != 0 && b < HIST_BUCKETS - 1; b++) {
+        x >>= 1;
+    }
+    return (b);
+}
+
+/* 受信バッファの大きさ合わせ
+ *
+ * 従来はどの接続もスタックの 512 バイトに recv していた。大きな要求は 512 バイトずつ
+ * 何度も recv することになり、一方で何も来ない接続にはバッファ自体が要らない。そこで：
+ *
+ * - recv の前に ioctl(FIONREAD) で届いているバイト数を見て、最近の要求の大きさ（rexpect）と
+ *   合わせて 512 バイトで足りなければ、接続ごとのバッファ（rbuf）を 2 のべき乗で確保・拡張し
+ *   1 回の recv で読み切る（上限 g_rbuf_max）。512 バイトで足りる間は従来どおりスタックで読む
+ * - 小さな要求が続いて rexpect が 512 バイトに収まれば rbuf を解放し、rexpect に対して
+ *   4 倍より大きければ縮める。RBUF_IDLE 秒受信の無い接続の rbuf も見回り（rbuf_sweep）で
+ *   解放する → 待機中の接続は rbuf を持たない
+ * - 改行の届いていない行の途中は rbuf に持ち越し、改行が届いてから応答する。
+ *   throughput プロファイル（大きな要求向け）では、溜めている間は残りの予想バイト数
+ *   （rexpect - 溜めた分）を SO_RCVLOWAT に付け、それだけ届くまで epoll に起こされないようにする（1 要求あたりの起床が減る）
+ * - 予想より短い要求だと残りが来ないので起こされない。RBUF_LOWAT_WAIT 秒たったら見回りが
+ *   SO_RCVLOWAT を 1 に戻す（戻すとカーネルがその場で EPOLLIN を出し直す）
+ * - 読まずに待つ間は ACK が遅延 ACK になり、Nagle の効いた送り手が MSS 未満の断片を
+ *   40ms 止めてしまう（ループバックは MSS が 64KB 近いので起きやすい）。付けるときに TCP_QUICKACK も付ける
+ * - 見回りは rbuf / SO_RCVLOWAT を持つ接続があるときだけ、g_fd_hi まで走査する
+ * - 効果は管理用ソケットの stats（recv_per_kb / rbuf_conns / rbuf_bytes）と、
+ *   bench の bulk（大きな要求の往復）/ idle（待機中の接続 1 本あたりのメモリ）で見る
+ */
+#define RBUF_STACK      (512)                   /* スタックで読む大きさ（従来の buf） */
+#define RBUF_MAX        (1024 * 1024)           /* rbuf の上限の既定値（設定 rbuf_max） */
+#define RBUF_IDLE       (1.0)                   /* 秒：受信が無ければ rbuf を解放するまで */
+#define RBUF_LOWAT_WAIT (0.02)                  /* 秒：SO_RCVLOWAT を 1 に戻すまで */
+
+int g_lowat_conns = 0;          /* SO_RCVLOWAT を付けている接続の数 */
+size_t g_rbuf_max = RBUF_MAX;   /* rbuf の上限（設定 rbuf_max） */
+
+/* rbuf を n バイトにする（0 = 解放。失敗は -1 で元のまま） */
+int
+rbuf_resize(struct conn *c, size_t n)
+{
+    char *p;
+
+    if (n == 0) {
+        if (c->rbuf != NULL) {
+            free(c->rbuf);
+            g_stats.rbuf_conns--;
+            g_stats.rbuf_bytes -= c->rsize;
+        }
+        c->rbuf = NULL;
+        c->rsize = 0;
+        return (0);
+    }
+    if ((p = realloc(c->rbuf, n)) == NULL) {
+        perror("realloc");
+        return (-1);
+    }
+    if (c->rbuf == NULL) {
+        g_stats.rbuf_conns++;
+    }
+    g_stats.rbuf_bytes = g_stats.rbuf_bytes - c->rsize + n;
+    c->rbuf = p;
+    c->rsize = n;
+    return (0);
+}
+
+/* want バイトを読める rbuf の大きさ（2 のべき乗、RBUF_STACK * 2 〜 g_rbuf_max） */
+size_t
+rbuf_roundup(size_t want)
+{
+    size_t n;
+
+    for (n = RBUF_STACK * 2; n < want && n < g_rbuf_max; n <<= 1) {
+        ;
+    }
+    return (n < g_rbuf_max ? n : g_rbuf_max);
+}
+
+/* rbuf を want バイト以上にする（足りている / すでに g_rbuf_max なら何もしない） */
+int
+rbuf_reserve(struct conn *c, size_t want)
+{
+    if (c->rbuf != NULL && c->rsize >= rbuf_roundup(want)) {
+        return (0);
+    }
+    g_stats.rbuf_grow++;
+    return (rbuf_resize(c, rbuf_roundup(want)));
+}
+
+/* SO_RCVLOWAT を付け替える（lowat 0 = 外す。値が変わるときだけ setsockopt） */
+void
+rbuf_lowat(int fd, int lowat)
+{
+    struct conn *c;
+    int opt;
+
+    c = &g_conn[fd];
+    if (c->lowat == lowat) {
+        return;
+    }
+    opt = lowat > 0 ? lowat : 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVLOWAT, &opt, sizeof(opt)) == -1) {
+        perror("setsockopt(SO_RCVLOWAT)");
+        return;
+    }
+    if (c->lowat == 0) {
+        g_lowat_conns++;
+    } else if (lowat == 0) {
+        g_lowat_conns--;
+    }
+    if (lowat > 0) {
+        /* 待っている間も ACK を遅らせない（送り手の Nagle が遅延 ACK の 40ms を待たないように） */
+        opt = 1;
+        (void) setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt));
+        g_stats.lowat_set++;
+    }
+    c->lowat = lowat;
+}
+
+/* 見回り：予想の外れた SO_RCVLOWAT を戻し、しばらく受信の無い接続の rbuf を解放する */
+void
+rbuf_sweep(double now)
+{
+    struct conn *c;
+    int fd;
+
+    for (fd = 0; fd < g_fd_hi; fd++) {
+        c = &g_conn[fd];
+        if (!c->active) {
+            continue;
+        }
+        if (c->lowat != 0 && now - c->rlast >= RBUF_LOWAT_WAIT) {
+            rbuf_lowat(fd, 0);
+            g_stats.lowat_miss++;
+        }
+        if (c->rbuf != NULL && c->rlen == 0 && now - c->rlast >= RBUF_IDLE) {
+            (void) rbuf_resize(c, 0);
+            g_stats.rbuf_shrink++;
+        }
+    }
+}
+
+/* 接続 fd を閉じたときの後始末（寿命をヒストグラムに入れ、rbuf を解放する） */
+void
+conn_closed(int fd)
+{
+    (void) rbuf_resize(&g_conn[fd], 0);
+    if (g_conn[fd].lowat != 0) {
+        g_lowat_conns--;
+    }
+    g_conn[fd].lowat = 0;
+    g_conn[fd].rlen = 0;
+    g_conn[fd].cr = 0;
+    g_conn[fd].active = 0;
+    g_stats.closed++;
+    g_stats.hist_conn[hist_bucket((now_sec() - g_conn[fd].since) * 1e3)]++;
+}
+
+/* 死んだ相手の接続を片付ける（keepalive / TCP_USER_TIMEOUT）
+ *
+ * 相手が FIN も RST も送らずに消える（電源断・ケーブル断・途中の NAT がエントリを捨てた等）と、
+ * こちらの接続は次の要求を待ったまま残り、接続の枠（max_conn）をいつまでも使い続ける。
+ * そこで accept した接続に次を付ける（管理用ソケットの set で変えられ、以後 accept する接続に効く）：
+ *
+ * - SO_KEEPALIVE + TCP_KEEPIDLE / TCP_KEEPINTVL / TCP_KEEPCNT
+ *   keepidle 秒なにも流れなければ keepintvl 秒おきにプローブを送り、keepcnt 回続けて応答が
+ *   無ければ接続をエラー（ETIMEDOUT）にする（keepidle 0 = keepalive を付けない）
+ * - TCP_USER_TIMEOUT（ミリ秒、0 = 付けない）
+ *   送ったデータ（応答やプローブ）が user_timeout の間 ACK されなければエラーにする。
+ *   付けると keepalive も keepcnt ではなくこの時間で打ち切られるので、
+ *   既定は keepidle + keepintvl * keepcnt に合わせてある
+ *
+ * エラーになった接続は読み込み可能になり、recv が ETIMEDOUT / ECONNRESET を返すので閉じる。
+ * epoll では EPOLLRDHUP（相手が送信側を閉じた）/ EPOLLHUP / EPOLLERR も見て、
+ * 壊れた接続は recv を待たずにその場で閉じ、閉じかけの接続は残りの要求に答えてから閉じる。
+ * 閉じた理由は stats の reclaimed_timeout / reclaimed_reset / reclaimed_rdhup で数える
+ */
+#define KEEPIDLE        (60)                                    /* 秒 */
+#define KEEPINTVL       (10)                                    /* 秒 */
+#define KEEPCNT         (5)
+#define USER_TIMEOUT    ((KEEPIDLE + KEEPINTVL * KEEPCNT) * 1000) /* ミリ秒 */
+
+int g_keepidle = KEEPIDLE;
+int g_keepintvl = KEEPINTVL;
+int g_keepcnt = KEEPCNT;
+int g_user_timeout = USER_TIMEOUT;
+
+/* accept した接続に keepalive / TCP_USER_TIMEOUT を付ける（失敗は表示して続行） */
+void
+keepalive_set(int acc)
+{
+    int opt;
+
+    if (g_keepidle > 0) {
+        opt = 1;
+        if (setsockopt(acc, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt)) == -1
+            || setsockopt(acc, IPPROTO_TCP, TCP_KEEPIDLE, &g_keepidle, sizeof(g_keepidle)) == -1
+            || setsockopt(acc, IPPROTO_TCP, TCP_KEEPINTVL, &g_keepintvl, sizeof(g_keepintvl)) == -1
+            || setsockopt(acc, IPPROTO_TCP, TCP_KEEPCNT, &g_keepcnt, sizeof(g_keepcnt)) == -1) {
+            perror("setsockopt(SO_KEEPALIVE)");
+        }
+    }
+    if (g_user_timeout > 0
+        && setsockopt(acc, IPPROTO_TCP, TCP_USER_TIMEOUT,
+                      &g_user_timeout, sizeof(g_user_timeout)) == -1) {
+        perror("setsockopt(TCP_USER_TIMEOUT)");
+    }
+}
+
+/* 相手が消えた接続を閉じた理由を数える（err：recv / writev の errno か SO_ERROR の値） */
+void
+reclaim_count(int err)
+{
+    if (err == ETIMEDOUT) {
+        g_stats.reclaimed_timeout++;
+    } else {
+        g_stats.reclaimed_reset++;
+    }
+}
+
+/* 接続に溜まっているエラー（SO_ERROR。取れない / 0 なら ECONNRESET とみなす） */
+int
+sock_error(int fd)
+{
+    socklen_t len;
+    int err;
+
+    err = 0;
+    len = (socklen_t) sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err == 0) {
+        err = ECONNRESET;
+    }
+    return (err);
+}
+
+/* 過負荷時の受け付け制御（admission）
+ *
+ * 接続の上限（max_conn）に達したときに accept してそのまま close すると、クライアントには
+ * RST / EOF にしか見えず、すぐに接続し直してくるので過負荷をかえって大きくする。また
+ * 接続数が上限より少なくても、処理が追いつかなければ要求の待ち時間は伸び続ける。そこで：
+ *
+ * - 断るときは BUSY_MSG（"BUSY\r\n"）を 1 行返してから閉じる（busy_reject）
+ *   - クライアントは「混んでいる」と分かるので、間を空けてから接続し直せる
+ *   - 届いている要求を読み捨ててから閉じる（未読のまま close すると RST になり、
+ *     BUSY より先に RST が届いて捨てられることがある）
+ * - 接続数の上限に加えて、実際に測った待ち時間（queueing delay）で断る
+ *   - epoll_wait が返ってから、その回の ready を全部処理し終えるまでの時間を 1 回分の
+ *     待ち時間とする（最後に処理された接続は、それだけ待たされている）
+ *   - qdelay_interval ミリ秒ごとに、その区間の待ち時間の「最小値」を target と比べる
+ *     （一瞬のバーストでは最小値は小さいまま。区間を通して一度も target を下回らない
+ *      = 待ち行列が捌けずに居座っているときだけ overload にする。CoDel と同じ考え方）
+ *   - overload の間の新しい接続は BUSY で断る（qdelay_target 0 = 待ち時間では断らない）
+ * - accept_pause 1 なら、上限 / overload の間は BUSY を返す代わりに listen FD を epoll から
+ *   外す（accept しない）。来た接続はカーネルの listen キュー（backlog）で待たせておき、
+ *   短いバーストなら取りこぼさずに済む（キューが溢れた分は SYN の再送で待たされる）
+ *
+ * qdelay_target / qdelay_interval / accept_pause は管理用ソケットの set で変えられる。
+ * 断った接続は stats の shed_full（上限）/ shed_delay（待ち時間）、BUSY を返せた数は
+ * busy_sent、listen FD を外した回数は accept_paused で数える
+ */
+#define QDELAY_TARGET   (5)             /* ミリ秒 */
+#define QDELAY_INTERVAL (100)           /* ミリ秒 */
+
+int g_qdelay_target = QDELAY_TARGET;
+int g_qdelay_interval = QDELAY_INTERVAL;
+int g_accept_pause = 0;
+
+/* 待ち時間の見張り（区間ごとの最小値）
+ * - start : 今の区間の始まり（now_sec）
+ * - min   : 今の区間の待ち時間の最小（秒、-1 = まだ標本が無い）
+ * - usec  : 直前の区間の最小（µs、stats で表示する）
+ * - overload : 直前の区間の最小が qdelay_target を超えていれば 1
+ */
+struct qdelay {
+    double start;
+    double min;
+    int usec;
+    int overload;
+};
+
+struct qdelay g_qdelay = { 0.0, -1.0, 0, 0 };
+
+/* 待ち時間を 1 つ記録する（d < 0 は標本なしで区間の切り替えだけ見る）
+ *
+ * 区間が終わっていれば最小値で overload を決め直す（標本の無い区間 = 待っていない = 0）。
+ * 戻り値：overload が変わったら 1
+ */
+int
+qdelay_sample(struct qdelay *qd, double d, double now)
+{
+    int prev;
+
+    if (d >= 0.0 && (qd->min < 0.0 || d < qd->min)) {
+        qd->min = d;
+    }
+    if ((now - qd->start) * 1e3 < (double) g_qdelay_interval) {
+        return (0);
+    }
+    prev = qd->overload;
+    qd->usec = qd->min > 0.0 ? (int) (qd->min * 1e6) : 0;
+    qd->overload = g_qdelay_target > 0 && qd->usec > g_qdelay_target * 1000;
+    qd->start = now;
+    qd->min = -1.0;
+    return (qd->overload != prev);
+}
+
+/* BUSY を返して接続を閉じる（送れなくても閉じる。受信バッファに届いている分は読み捨てる） */
+void
+busy_reject(int acc)
+{
+    char buf[512];
+
+    if (send(acc, BUSY_MSG, BUSY_MSG_LEN, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t) BUSY_MSG_LEN) {
+        g_stats.busy_sent++;
+    }
+    (void) shutdown(acc, SHUT_WR);
+    while (recv(acc, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+        ;
+    }
+    (void) close(acc);
+}
+
+/* listen FD を epoll から外す / 戻す（accept_pause。*paused を今の状態に合わせる） */
+void
+accept_pause(int epollfd, int soc, int pause, int *paused)
+{
+    struct epoll_event ev;
+
+    if (soc == -1 || pause == *paused) {
+        return;
+    }
+    ev.data.fd = soc;
+    ev.events = EPOLLIN;
+    if (epoll_ctl(epollfd, pause ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, soc, &ev) == -1) {
+        perror("epoll_ctl(accept_pause)");
+        return;
+    }
+    if (pause) {
+        g_stats.accept_paused++;
+    }
+    *paused = pause;
+    (void) fprintf(stderr, "admission: accept %s\n", pause ? "paused" : "resumed");
+}
+
+/* 実行時設定（設定ファイル + SIGHUP での読み直し）
+ *
+ * server4 port [profile] [conf] の conf に「キー 値」（または「キー = 値」）を 1 行ずつ書く
+ * （3 つ目の引数が数値なら従来どおり spin_us [mlock] として扱う）。
+ * '#' から行末まではコメント。書かなかったキーは既定値に戻る。
+ *
+ *   max_conn      同時接続の上限（既定：接続管理テーブルの大きさ。それより大きくはできない）
+ *   rbuf_max      接続ごとの受信バッファ（rbuf）の上限（既定 RBUF_MAX。下げても今ある rbuf は
+ *                 切り詰めず、以後の拡張をこの大きさで止める）
+ *   drain_timeout drain の期限（秒、既定 DRAIN_TIMEOUT）
+ *   keepidle      keepalive を始めるまでの無通信時間（秒、既定 KEEPIDLE。0 = keepalive しない）
+ *   keepintvl     keepalive のプローブ間隔（秒、既定 KEEPINTVL）
+ *   keepcnt       応答の無いプローブがこの回数続いたら切る（既定 KEEPCNT）
+ *   user_timeout  TCP_USER_TIMEOUT（ミリ秒、既定 USER_TIMEOUT。0 = 付けない）
+ *   spin_us       busy-poll で空振りを続ける時間（µs、既定 0。起動時に 0 より大きくして
+ *                 busy_poll_init で準備したときだけ、動いたまま変えられる）
+ *   qdelay_target   待ち時間の目標（ミリ秒、既定 QDELAY_TARGET。0 = 待ち時間では断らない）
+ *   qdelay_interval 待ち時間の最小値を見る区間（ミリ秒、既定 QDELAY_INTERVAL）
+ *   accept_pause    1 = 上限 / overload の間は BUSY で断らず accept を止める（既定 0）
+ *   verbose         1 = accept ごとに接続元を表示する（既定 0。接続の多いときは表示が重いので、
+ *                   普段は管理用ソケットの conns で見る）
+ *
+ * 起動時に読み、SIGHUP で読み直して動いたまま反映する（conf_apply）。
+ * 1 行でも誤りがあれば、そのファイルは丸ごと使わない（起動時はエラー終了、SIGHUP なら今の値のまま）。
+ * 管理用ソケットの set も同じキーを 1 つだけ変えて conf_apply に渡す。
+ */
+struct config {
+    int max_conn;
+    int rbuf_max;
+    int drain_timeout;
+    int keepidle;
+    int keepintvl;
+    int keepcnt;
+    int user_timeout;
+    int spin_us;
+    int qdelay_target;
+    int qdelay_interval;
+    int accept_pause;
+    int verbose;
+};
+
+/* キー名と struct config の中の位置、受け付ける範囲 */
+struct conf_key {
+    const char *name;
+    size_t off;
+    int min;
+    int max;
+};
+
+const struct conf_key g_conf_keys[] = {
+    { "max_conn",      offsetof(struct config, max_conn),      1,   INT_MAX },
+    { "rbuf_max",      offsetof(struct config, rbuf_max),      RBUF_STACK * 2, 1 << 26 },
+    { "drain_timeout", offsetof(struct config, drain_timeout), 0,   86400 },
+    { "keepidle",      offsetof(struct config, keepidle),      0,   32767 },
+    { "keepintvl",     offsetof(struct config, keepintvl),     1,   32767 },
+    { "keepcnt",       offsetof(struct config, keepcnt),       1,   127 },
+    { "user_timeout",  offsetof(struct config, user_timeout),  0,   INT_MAX },
+    { "spin_us",       offsetof(struct config, spin_us),       0,   1000000 },
+    { "qdelay_target", offsetof(struct config, qdelay_target), 0,   10000 },
+    { "qdelay_interval", offsetof(struct config, qdelay_interval), 1, 10000 },
+    { "accept_pause",  offsetof(struct config, accept_pause),  0,   1 },
+    { "verbose",       offsetof(struct config, verbose),       0,   1 },
+};
+
+/* 設定ファイルのパス（NULL なら既定値だけで動く） */
+const char *g_conf_path = NULL;
+
+/* いま反映されている設定（管理用ソケットの set はこれを写して 1 つだけ変える） */
+struct config g_conf_cur;
+
+/* 既定値（接続上限は FD 上限から決めた接続管理テーブルの大きさ） */
+void
+conf_defaults(struct config *c)
+{
+    c->max_conn = g_max_child;
+    c->rbuf_max = RBUF_MAX;
+    c->drain_timeout = DRAIN_TIMEOUT;
+    c->keepidle = KEEPIDLE;
+    c->keepintvl = KEEPINTVL;
+    c->keepcnt = KEEPCNT;
+    c->user_timeout = USER_TIMEOUT;
+    c->spin_us = 0;
+    c->qdelay_target = QDELAY_TARGET;
+    c->qdelay_interval = QDELAY_INTERVAL;
+    c->accept_pause = 0;
+    c->verbose = 0;
+}
+
+/* path を読んで c を上書きする（戻り値：0 = 成功 / -1 = 開けない、または誤りがあった） */
+int
+conf_parse(const char *path, struct config *c)
+{
+    char line[256], key[64], *p, *end;
+    FILE *fp;
+    long v;
+    size_t k;
+    int lineno, err, n;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        return (-1);
+    }
+    err = 0;
+    lineno = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL) {
+            *p = '\0';
+        }
+        if ((p = strchr(line, '=')) != NULL) {
+            *p = ' ';
+        }
+        if (sscanf(line, "%63s%n", key, &n) != 1) {
+            continue;                   /* 空行・コメントだけの行 */
+        }
+        for (k = 0; k < sizeof(g_conf_keys) / sizeof(g_conf_keys[0]); k++) {
+            if (strcmp(key, g_conf_keys[k].name) == 0) {
+                break;
+            }
+        }
+        if (k == sizeof(g_conf_keys) / sizeof(g_conf_keys[0])) {
+            (void) fprintf(stderr, "conf:%s:%d: unknown key %s\n", path, lineno, key);
+            err = 1;
+            continue;
+        }
+        errno = 0;
+        v = strtol(line + n, &end, 10);
+        while (isspace((unsigned char) *end)) {
+            end++;
+        }
+        if (errno != 0 || end == line + n || *end != '\0'
+            || v < g_conf_keys[k].min || v > g_conf_keys[k].max) {
+            (void) fprintf(stderr, "conf:%s:%d: bad value for %s (%d..%d)\n",
+                           path, lineno, key, g_conf_keys[k].min, g_conf_keys[k].max);
+            err = 1;
+            continue;
+        }
+        *(int *) ((char *) c + g_conf_keys[k].off) = (int) v;
+    }
+    (void) fclose(fp);
+    return (err ? -1 : 0);
+}
+
+/* 設定 c を動いたまま反映する（イベントループから呼ぶ）
+ *
+ * - spin_us は busy_poll_init で準備してあるときだけ 0 より大きくできる（無ければ今の値のまま）
+ * - それ以外は変数を書き換えるだけ
+ *   （keepalive / user_timeout は以後 accept する接続に効く）
+ *   （max_conn を今の接続数より下げても既存の接続は切らない。新しい接続を断るだけ）
+ * g_conf_cur には実際に反映できた値だけを残す。
+ * 戻り値：0 = 全部反映した / -1 = spin_us を反映できなかった
+ */
+int
+conf_apply(const struct config *c)
+{
+    struct config applied;
+    int ret;
+
+    applied = *c;
+    ret = 0;
+    if (c->spin_us > 0 && !g_busy_poll) {
+        (void) fprintf(stderr, "conf: spin_us=%d not applied (busy-poll is not set up), keep %ld\n",
+                       c->spin_us, g_spin_us);
+        applied.spin_us = (int) g_spin_us;
+        ret = -1;
+    }
+    c = &applied;
+    g_max_conn = c->max_conn < g_max_child ? c->max_conn : g_max_child;
+    g_rbuf_max = (size_t) c->rbuf_max;
+    g_drain_timeout = c->drain_timeout;
+    g_keepidle = c->keepidle;
+    g_keepintvl = c->keepintvl;
+    g_keepcnt = c->keepcnt;
+    g_user_timeout = c->user_timeout;
+    g_spin_us = c->spin_us;
+    g_qdelay_target = c->qdelay_target;
+    g_qdelay_interval = c->qdelay_interval;
+    g_accept_pause = c->accept_pause;
+    g_verbose = c->verbose;
+    g_conf_cur = *c;
+
+    (void) fprintf(stderr,
+                   "conf: max_conn=%d rbuf_max=%zu drain_timeout=%d"
+                   " keepalive=%d/%d/%d user_timeout=%d spin_us=%ld"
+                   " qdelay=%d/%d accept_pause=%d verbose=%d\n",
+                   g_max_conn, g_rbuf_max, g_drain_timeout,
+                   g_keepidle, g_keepintvl, g_keepcnt, g_user_timeout, g_spin_us,
+                   g_qdelay_target, g_qdelay_interval, g_accept_pause, g_verbose);
+    return (ret);
+}
+
+/* SIGHUP：設定ファイルを読み直して反映する（誤りがあれば今の値のまま） */
+void
+conf_reload(void)
+{
+    struct config c;
+
+    if (g_conf_path == NULL) {
+        (void) fprintf(stderr, "conf: no file, keep current\n");
+        return;
+    }
+    conf_defaults(&c);
+    if (conf_parse(g_conf_path, &c) == -1) {
+        (void) fprintf(stderr, "conf:%s: not applied, keep current\n", g_conf_path);
+        return;
+    }
+    (void) conf_apply(&c);
+}
+
+/* 管理用ソケット（admin）
+ *
+ * 動いているサーバの状態を、stderr のログを grep せずに問い合わせるための AF_UNIX ソケット。
+ * adminctl（または socat 等）で 1 行のコマンドを送ると、テキストで応答して閉じる。
+ *
+ * コマンド：
+ * - stats           : 稼働時間、接続数、accept / 拒否 / 要求数、送受信バイト数
+ * - conns           : 接続ごとの fd、接続元、経過秒、要求数、送受信バイト数
+ * - set KEY VALUE   : 設定ファイルと同じキーを 1 つ変えて conf_apply で反映する
+ *                     （次の SIGHUP では設定ファイルの値に戻る）
+ * - drain           : SIGTERM と同じ drain を始める
+ * - dump-histograms : 要求の処理時間（µs）と接続の寿命（ms）の log2 ヒストグラム
+ *
+ * - パスは ADMIN_PATH_FMT にポート番号を入れたもの。権限 0600（起動したユーザだけが使える）
+ * - listen も接続もノンブロッキングで epoll に載せ、イベントループの中で処理する
+ *   （接続の処理を止めたりロックを取ったりせず、g_conn / g_stats をそのまま読む）
+ * - 同時に扱う管理接続は ADMIN_MAX 本まで。1 接続 1 コマンドで、応答を書き終えたら閉じる
+ */
+#define ADMIN_PATH_FMT  "/tmp/server4.%s.admin"
+#define ADMIN_MAX       (4)
+#define ADMIN_LINE      (256)
+
+struct admin {
+    int fd;                             /* -1 = 空き */
+    int replied;                        /* コマンドを実行済み（応答の送信中）なら 1 */
+    size_t inlen;                       /* in[] に溜まったコマンド行の長さ */
+    char in[ADMIN_LINE];
+    char *out;                          /* 応答（admin_printf で伸ばす） */
+    size_t outlen, outsize, outoff;     /* 応答の長さ / 確保量 / 送信済み */
+};
+
+struct admin g_admin[ADMIN_MAX];
+int g_admin_soc = -1;
+char g_admin_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+int g_admin_drain = 0;                  /* drain コマンドを受けたら 1（イベントループが見る） */
+
+/* 管理用ソケットを作る（失敗しても管理機能が無いだけで、サーバは続行する） */
+int
+admin_socket(const char *portnm)
+{
+    struct sockaddr_un sun;
+    int i;
+
+    for (i = 0; i < ADMIN_MAX; i++) {
+        g_admin[i].fd = -1;
+    }
+    (void) memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    (void) snprintf(sun.sun_path, sizeof(sun.sun_path), ADMIN_PATH_FMT, portnm);
+    if ((g_admin_soc = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket(AF_UNIX)");
+        return (-1);
+    }
+    (void) unlink(sun.sun_path);
+    if (bind(g_admin_soc, (struct sockaddr *) &sun, sizeof(sun)) == -1
+        || chmod(sun.sun_path, 0600) == -1
+        || listen(g_admin_soc, ADMIN_MAX) == -1) {
+        perror(sun.sun_path);
+        (void) close(g_admin_soc);
+        g_admin_soc = -1;
+        return (-1);
+    }
+    (void) strcpy(g_admin_path, sun.sun_path);
+    (void) fprintf(stderr, "admin=%s\n", g_admin_path);
+    return (g_admin_soc);
+}
+
+/* 応答に書式付きで追記する */
+void
+admin_printf(struct admin *a, const char *fmt, ...)
+{
+    va_list ap;
+    size_t need;
+    char *p;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    need = a->outlen + (size_t) n + 1;
+    if (need > a->outsize) {
+        if ((p = realloc(a->out, need < 4096 ? 4096 : need * 2)) == NULL) {
+            return;
+        }
+        a->out = p;
+        a->outsize = need < 4096 ? 4096 : need * 2;
+    }
+    va_start(ap, fmt);
+    (void) vsnprintf(a->out + a->outlen, (size_t) n + 1, fmt, ap);
+    va_end(ap);
+    a->outlen += (size_t) n;
+}
+
+/* 管理接続を閉じて枠を空ける */
+void
+admin_close(int epollfd, struct admin *a)
+{
+    (void) epoll_ctl(epollfd, EPOLL_CTL_DEL, a->fd, NULL);
+    (void) close(a->fd);
+    free(a->out);
+    (void) memset(a, 0, sizeof(*a));
+    a->fd = -1;
+}
+
+/* 管理用 listen ソケットが ready → 空き枠がある分だけ accept する */
+void
+admin_accept(int epollfd)
+{
+    struct epoll_event ev;
+    int fd, i;
+
+    for (;;) {
+        for (i = 0; i < ADMIN_MAX && g_admin[i].fd != -1; i++)
+            ;
+        if ((fd = accept4(g_admin_soc, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+            return;
+        }
+        if (i == ADMIN_MAX) {
+            /* 枠が無い：待たせずに断る */
+            (void) close(fd);
+            continue;
+        }
+        ev.data.fd = fd;
+        ev.events = EPOLLIN;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl");
+            (void) close(fd);
+            continue;
+        }
+        g_admin[i].fd = fd;
+    }
+}
+
+/* fd が管理接続なら、その枠を返す */
+struct admin *
+admin_lookup(int fd)
+{
+    int i;
+
+    for (i = 0; i < ADMIN_MAX; i++) {
+        if (g_admin[i].fd == fd) {
+            return (&g_admin[i]);
+        }
+    }
+    return (NULL);
+}
+
+/* ヒストグラム 1 本を「階級の範囲 件数」で書き出す（0 件の階級は省く） */
+void
+admin_hist(struct admin *a, const char *name, const unsigned long *h)
+{
+    unsigned long total;
+    int i;
+
+    total = 0;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        total += h[i];
+    }
+    admin_printf(a, "%s total=%lu\n", name, total);
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        if (h[i] != 0) {
+            admin_printf(a, "  [%lu,%lu) %lu\n",
+                         i == 0 ? 0UL : 1UL << (i - 1), 1UL << i, h[i]);
+        }
+    }
+}
+
+/* set KEY VALUE：いまの設定を写して 1 つだけ変え、conf_apply で反映する */
+void
+admin_set(struct admin *a, const char *key, const char *val)
+{
+    struct config c;
+    char *end;
+    size_t k;
+    long v;
+
+    for (k = 0; k < sizeof(g_conf_keys) / sizeof(g_conf_keys[0]); k++) {
+        if (key != NULL && strcmp(key, g_conf_keys[k].name) == 0) {
+            break;
+        }
+    }
+    if (k == sizeof(g_conf_keys) / sizeof(g_conf_keys[0]) || val == NULL) {
+        admin_printf(a, "ERR usage: set KEY VALUE (");
+        for (k = 0; k < sizeof(g_conf_keys) / sizeof(g_conf_keys[0]); k++) {
+            admin_printf(a, "%s%s", k > 0 ? "|" : "", g_conf_keys[k].name);
+        }
+        admin_printf(a, ")\n");
+        return;
+    }
+    errno = 0;
+    v = strtol(val, &end, 10);
+    if (errno != 0 || end == val || *end != '\0'
+        || v < g_conf_keys[k].min || v > g_conf_keys[k].max) {
+        admin_printf(a, "ERR bad value for %s (%d..%d)\n",
+                     key, g_conf_keys[k].min, g_conf_keys[k].max);
+        return;
+    }
+    if (strcmp(key, "spin_us") == 0 && v > 0 && !g_busy_poll) {
+        /* 1 CPU のときや、起動時に準備していないときは回さない（busy_poll_init） */
+        admin_printf(a, "ERR spin_us: busy-poll is not set up "
+                     "(start with spin_us > 0 on a host with 2+ CPUs)\n");
+        return;
+    }
+    c = g_conf_cur;
+    *(int *) ((char *) &c + g_conf_keys[k].off) = (int) v;
+    if (conf_apply(&c) == -1) {
+        admin_printf(a, "ERR %s=%ld not applied, keep %s=%d\n", key, v, key,
+                     *(int *) ((char *) &g_conf_cur + g_conf_keys[k].off));
+        return;
+    }
+    admin_printf(a, "OK %s=%ld\n", key, v);
+}
+
+/* コマンド 1 行を実行して応答を組み立てる（nconn：現在の接続数） */
+void
+admin_command(struct admin *a, char *line, int nconn)
+{
+    char pbuf[PEER_STRLEN], *cmd, *key, *val;
+    double now;
+    int i;
+
+    now = now_sec();
+    cmd = strtok(line, " \t");
+    key = strtok(NULL, " \t");
+    val = strtok(NULL, " \t");
+    if (cmd == NULL) {
+        admin_printf(a, "ERR empty command\n");
+    } else if (strcmp(cmd, "stats") == 0) {
+        admin_printf(a, "uptime=%.1f\nconns=%d\nmax_conn=%d\ndraining=%d\n"
+                     "accepted=%lu\nrefused=%lu\nclosed=%lu\nrequests=%lu\n"
+                     "rx=%llu\ntx=%llu\ndrain_timeout=%d\n"
+                     "keepidle=%d\nkeepintvl=%d\nkeepcnt=%d\nuser_timeout=%d\n"
+                     "reclaimed_timeout=%lu\nreclaimed_reset=%lu\nreclaimed_rdhup=%lu\n"
+                     "recv_calls=%lu\nrecv_per_kb=%.4f\nrbuf_conns=%lu\nrbuf_bytes=%lu\n"
+                     "rbuf_grow=%lu\nrbuf_shrink=%lu\nlowat_set=%lu\nlowat_miss=%lu\n"
+                     "spin_us=%ld\npolls=%lu\nidle_polls=%lu\nsleeps=%lu\n"
+                     "qdelay_target=%d\nqdelay_interval=%d\naccept_pause=%d\n"
+                     "qdelay_us=%d\noverload=%d\nshed_full=%lu\nshed_delay=%lu\n"
+                     "busy_sent=%lu\naccept_paused=%lu\n",
+                     now - g_stats.start, nconn, g_max_conn, g_drain_start != 0.0,
+                     g_stats.accepted, g_stats.refused, g_stats.closed, g_stats.requests,
+                     g_stats.rx, g_stats.tx, g_drain_timeout,
+                     g_keepidle, g_keepintvl, g_keepcnt, g_user_timeout,
+                     g_stats.reclaimed_timeout, g_stats.reclaimed_reset,
+                     g_stats.reclaimed_rdhup,
+                     g_stats.recv_calls,
+                     g_stats.rx != 0 ? g_stats.recv_calls * 1024.0 / (double) g_stats.rx : 0.0,
+                     g_stats.rbuf_conns, g_stats.rbuf_bytes, g_stats.rbuf_grow, g_stats.rbuf_shrink,
+                     g_stats.lowat_set, g_stats.lowat_miss,
+                     g_spin_us, g_stats.polls, g_stats.idle_polls, g_stats.sleeps,
+                     g_qdelay_target, g_qdelay_interval, g_accept_pause,
+                     g_qdelay.usec, g_qdelay.overload, g_stats.shed_full, g_stats.shed_delay,
+                     g_stats.busy_sent, g_stats.accept_paused);
+    } else if (strcmp(cmd, "conns") == 0) {
+        admin_printf(a, "fd peer age nreq rx tx\n");
+        for (i = 0; i < g_max_child + RESERVED_FD; i++) {
+            if (g_conn[i].active) {
+                (void) format_peer(&g_conn[i].addr, pbuf);
+                admin_printf(a, "%d %s %.1f %lu %llu %llu\n", i, pbuf,
+                             now - g_conn[i].since, g_conn[i].nreq, g_conn[i].rx, g_conn[i].tx);
+            }
+        }
+    } else if (strcmp(cmd, "set") == 0) {
+        admin_set(a, key, val);
+    } else if (strcmp(cmd, "drain") == 0) {
+        g_admin_drain = 1;
+        admin_printf(a, "OK draining conns=%d timeout=%d\n", nconn, g_drain_timeout);
+    } else if (strcmp(cmd, "dump-histograms") == 0) {
+        admin_hist(a, "request_us", g_stats.hist_req);
+        admin_hist(a, "conn_ms", g_stats.hist_conn);
+    } else {
+        admin_printf(a, "ERR unknown command %s "
+                     "(stats|conns|set|drain|dump-histograms)\n", cmd);
     }
-
-    /* 再起動時に bind しやすくする */
-    opt = 1;
-    opt_len = sizeof(opt);
-    if (setsockopt(soc, SOL_SOCKET, SO_REUSEADDR, &opt, opt_len) == -1) {
-        perror("setsockopt");
-        (void) close(soc);
-        freeaddrinfo(res0);
-        return (-1);
+    if (a->out != NULL) {
+        (void) fprintf(stderr, "admin:%s\n", cmd != NULL ? cmd : "");
     }
+}
 
-    /* bind（待受けポートへ割当） */
-    if (bind(soc, res0->ai_addr, res0->ai_addrlen) == -1) {
-        perror("bind");
-        (void) close(soc);
-        freeaddrinfo(res0);
-        return (-1);
-    }
+/* 管理接続のイベント
+ *
+ * 1) コマンド行（'\n' まで）を溜める
+ * 2) 揃ったら admin_command で応答を作り、EPOLLOUT 待ちに切り替える
+ * 3) 応答を送り切ったら閉じる（送れない分は次の EPOLLOUT で続ける）
+ */
+void
+admin_event(int epollfd, struct admin *a, int nconn)
+{
+    struct epoll_event ev;
+    ssize_t n;
+    char *eol;
 
-    /* listen（接続待ち状態へ） */
-    if (listen(soc, SOMAXCONN) == -1) {
-        perror("listen");
-        (void) close(soc);
-        freeaddrinfo(res0);
-        return (-1);
+    if (!a->replied) {
+        if ((n = recv(a->fd, a->in + a->inlen, sizeof(a->in) - 1 - a->inlen, 0)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                admin_close(epollfd, a);
+            }
+            return;
+        }
+        if (n == 0) {
+            admin_close(epollfd, a);
+            return;
+        }
+        a->inlen += (size_t) n;
+        a->in[a->inlen] = '\0';
+        if ((eol = strpbrk(a->in, "\r\n")) == NULL && a->inlen < sizeof(a->in) - 1) {
+            return;
+        }
+        if (eol != NULL) {
+            *eol = '\0';
+        }
+        admin_command(a, a->in, nconn);
+        if (a->out == NULL) {
+            admin_close(epollfd, a);
+            return;
+        }
+        a->replied = 1;
+        ev.data.fd = a->fd;
+        ev.events = EPOLLOUT;
+        (void) epoll_ctl(epollfd, EPOLL_CTL_MOD, a->fd, &ev);
+    }
+    if ((n = send(a->fd, a->out + a->outoff, a->outlen - a->outoff, MSG_NOSIGNAL)) == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            admin_close(epollfd, a);
+        }
+        return;
+    }
+    a->outoff += (size_t) n;
+    if (a->outoff == a->outlen) {
+        admin_close(epollfd, a);
     }
-
-    freeaddrinfo(res0);
-    return (soc);
 }
 
-/* 最大同時接続（epoll に登録する “接続FD” の上限を教材的に設ける）
- * NOTE:
- * - 実運用の epoll はもっと大きい値を扱えるが、ここは分かりやすさ優先
- */
-#define MAX_CHILD (20)
+/* 終了時：管理接続と管理用ソケットを閉じ、パスを消す */
+void
+admin_shutdown(int epollfd)
+{
+    int i;
+
+    if (g_admin_soc == -1) {
+        return;
+    }
+    for (i = 0; i < ADMIN_MAX; i++) {
+        if (g_admin[i].fd != -1) {
+            admin_close(epollfd, &g_admin[i]);
+        }
+    }
+    (void) close(g_admin_soc);
+    (void) unlink(g_admin_path);
+    g_admin_soc = -1;
+}
 
 /* epoll ベースの accept ループ（イベントループ）
  *
@@ -141,14 +1755,24 @@ server_socket(const char *portnm)
  * 4) ready になった FD ごとに処理する
  *    - listen FD → accept → 接続FDを epoll に ADD
  *    - 接続FD → recv/send → 終了なら epoll から DEL して close
+ *      （EPOLLERR / EPOLLHUP ならその場で、EPOLLRDHUP なら残りに答えてから閉じる）
+ *    - シグナル FD（SIGTERM / SIGINT）→ drain：listen FD を DEL して閉じ、
+ *      既存の接続だけを処理し続ける（接続が 0 になるか期限が来たら戻る）
+ *    - 管理用ソケット / 管理接続 → admin_accept / admin_event（drain 中も受け付ける）
+ * 5) busy-poll（g_spin_us > 0）：最後のイベントから spin_us の間は timeout 0 で 3) を回し続ける
+ * 6) 1 回分の ready を処理し終えるまでの時間を待ち時間として qdelay_sample に渡し、
+ *    overload の間は新しい接続を BUSY で断る（accept_pause なら listen FD を外す）
  */
 void
 accept_loop(int soc)
 {
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+    char pbuf[PEER_STRLEN];
     struct sockaddr_storage from;
-    int acc, count, i, epollfd, nfds, ret;
+    int acc, count, i, n, epollfd, nfds, ret, sig, timeout;
     socklen_t len;
+    double last_event, last_sweep, now, sweep;
+    double t0;                   /* epoll_wait が返った時刻（待ち時間の見張り） */
+    int paused;                  /* listen FD を epoll から外している（accept_pause） */
 
     /* epoll_event:
      * - events : 監視したいイベント種別（EPOLLIN など）
@@ -160,15 +1784,29 @@ accept_loop(int soc)
     /* epoll_wait() が返す ready イベントの配列
      * NOTE:
      * - 第3引数の maxevents と合わせたサイズにするのが基本
-     * - ここは MAX_CHILD になっているが、wait 側は MAX_CHILD+1 を渡しているのでズレがある
-     *   （教材としては events[MAX_CHILD+1] に揃える方が安全）
+     * - listen FD + シグナル FD + 管理用（1 + ADMIN_MAX）+ 接続FD（最大 g_max_child）の分を確保する
      */
-    struct epoll_event events[MAX_CHILD];
+    struct epoll_event *events;
+    struct admin *a;
+    int maxevents;
+
+    maxevents = g_max_child + 3 + ADMIN_MAX;
+    if ((events = malloc(sizeof(struct epoll_event) * maxevents)) == NULL
+        || (g_conn = calloc(g_max_child + RESERVED_FD, sizeof(struct conn))) == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    /* busy-poll：ページを書き込んで割り当てさせておく（calloc したままでは実体が無い） */
+    if (g_spin_us > 0) {
+        (void) memset(events, 0, sizeof(struct epoll_event) * maxevents);
+        (void) memset(g_conn, 0, sizeof(struct conn) * (g_max_child + RESERVED_FD));
+    }
 
     /* epoll インスタンス生成
      * - 古い API では “サイズヒント” を渡す（Linux 2.6.8 以降はほぼ無視される）
      */
-    if ((epollfd = epoll_create(MAX_CHILD + 1)) == -1) {
+    if ((epollfd = epoll_create(g_max_child + 1)) == -1) {
         perror("epoll_create");
         return;
     }
@@ -182,75 +1820,198 @@ accept_loop(int soc)
         return;
     }
 
+    /* シグナル FD も登録（SIGTERM / SIGINT で drain に入る） */
+    ev.data.fd = g_sig_fd;
+    ev.events = EPOLLIN;
+    if (g_sig_fd != -1 && epoll_ctl(epollfd, EPOLL_CTL_ADD, g_sig_fd, &ev) == -1) {
+        perror("epoll_ctl");
+    }
+
+    /* 管理用ソケットも登録 */
+    ev.data.fd = g_admin_soc;
+    ev.events = EPOLLIN;
+    if (g_admin_soc != -1 && epoll_ctl(epollfd, EPOLL_CTL_ADD, g_admin_soc, &ev) == -1) {
+        perror("epoll_ctl");
+    }
+
     /* 接続数のカウント（教材用の上限管理）
-     * - epoll 自体は “child 配列” 不要だが、ここでは MAX_CHILD 制限のため count を持つ
+     * - epoll 自体は “child 配列” 不要だが、ここでは g_max_child 制限のため count を持つ
      */
     count = 0;
+    last_event = last_sweep = t0 = 0.0;
+    paused = 0;
 
     for (;;) {
-        (void) fprintf(stderr, "<<child count:%d>>\n", count);
+        /* drain 中：接続が 0 になったか、期限が来たら抜ける */
+        if (g_drain_start != 0.0 && drain_check(count)) {
+            break;
+        }
 
         /* epoll_wait：
          * - ready イベントが発生するまで待つ
-         * - timeout は ms（ここでは 10 秒）
+         * - timeout は ms（ここでは 10 秒、drain 中は途中経過と期限を見るため 1 秒）
+         * - busy-poll 中（最後のイベントから spin_us 以内）は 0：待たずにすぐ戻る
          * - 戻り値 nfds は events[] に入った件数
-         *
-         * NOTE:
-         * - 第3引数 maxevents を MAX_CHILD+1 にしているのに
-         *   events[] が MAX_CHILD だとオーバーランの危険がある
-         *   （ここは教材として “配列サイズと maxevents を一致” させるのが重要）
          */
-        switch ((nfds = epoll_wait(epollfd, events, MAX_CHILD + 1, 10 * 1000))) {
+        timeout = g_drain_start != 0.0 ? 1000 : 10 * 1000;
+
+        /* rbuf / SO_RCVLOWAT を持つ接続があれば、見回りの間隔で起きる */
+        sweep = g_lowat_conns > 0 ? RBUF_LOWAT_WAIT / 2 : g_stats.rbuf_conns > 0 ? RBUF_IDLE / 2 : 0.0;
+        if (sweep != 0.0 && timeout > (int) (sweep * 1000)) {
+            timeout = (int) (sweep * 1000);
+        }
+
+        /* overload / accept_pause の間は、区間ごとに起きて解除できるかを見る */
+        if ((g_qdelay.overload || paused) && timeout > g_qdelay_interval) {
+            timeout = g_qdelay_interval;
+        }
+        if (g_spin_us > 0) {
+            if ((now_sec() - last_event) * 1e6 < (double) g_spin_us) {
+                timeout = 0;
+                g_stats.polls++;
+            } else {
+                g_stats.sleeps++;
+            }
+        }
+        switch ((nfds = epoll_wait(epollfd, events, maxevents, timeout))) {
         case -1:
             perror("epoll_wait");
             break;
 
         case 0:
-            /* タイムアウト：何もしないでループ継続 */
+            /* タイムアウト（busy-poll の空振りを含む）：何もしないでループ継続 */
+            if (timeout == 0) {
+                g_stats.idle_polls++;
+            }
             break;
 
         default:
+            /* イベントがあった：ここから spin_us の間は回り続ける */
+            t0 = now_sec();
+            if (g_spin_us > 0) {
+                last_event = t0;
+            }
+
             /* ready なイベントを nfds 個処理する */
             for (i = 0; i < nfds; i++) {
 
                 /* どのFDのイベントかを識別（data.fd を使う） */
-                if (events[i].data.fd == soc) {
-                    /* listen FD のイベント → accept */
-                    len = (socklen_t) sizeof(from);
+                if (events[i].data.fd == g_sig_fd) {
+                    /* シグナル FD のイベント → SIGHUP は設定の読み直し、それ以外は drain に入る
+                     * - listen FD を epoll から外して閉じる（以後 soc は -1 なので一致しない）
+                     * - listen キューに残っていた未 accept の接続は、閉じた時点で RST になる
+                     */
+                    while ((sig = sig_fd_read()) != 0) {
+                        if (sig == SIGHUP) {
+                            conf_reload();
+                        } else if (g_drain_start == 0.0) {
+                            drain_begin(sig, count);
+                            (void) epoll_ctl(epollfd, EPOLL_CTL_DEL, soc, &ev);
+                            (void) close(soc);
+                            soc = -1;
+                        }
+                    }
+
+                } else if (events[i].data.fd == g_admin_soc) {
+                    /* 管理用ソケット → 管理接続を受け付ける */
+                    admin_accept(epollfd);
 
-                    if ((acc = accept(soc, (struct sockaddr *)&from, &len)) == -1) {
-                        if (errno != EINTR) {
-                            perror("accept");
+                } else if ((a = admin_lookup(events[i].data.fd)) != NULL) {
+                    /* 管理接続 → コマンドを読む / 応答を書く */
+                    admin_event(epollfd, a, count);
+
+                } else if (events[i].data.fd == soc) {
+                    /* listen FD のイベント → accept
+                     *
+                     * listen ソケットはノンブロッキングなので、EAGAIN になるまで
+                     * （ただし ACCEPT_BUDGET 件まで）accept を繰り返して “まとめて” 受け付ける
+                     */
+                    for (n = 0; n < ACCEPT_BUDGET; n++) {
+                        /* accept_pause：上限 / overload なら残りは listen キューで待たせる */
+                        if (g_accept_pause && (count >= g_max_conn || g_qdelay.overload)) {
+                            break;
+                        }
+                        len = (socklen_t) sizeof(from);
+
+                        if ((acc = accept_nonblock(soc, &from, &len)) == -1) {
+                            if (errno == ECONNABORTED) {
+                                /* 接続を捨てた（FD 枯渇など）：次の接続へ */
+                                continue;
+                            }
+                            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                                perror("accept");
+                            }
+                            /* EAGAIN：listen キューが空になった */
+                            break;
+                        }
+
+                        /* 接続元の表示は verbose のときだけ（普段は生の sockaddr を g_conn[] に
+                         * 残すだけで、文字列にするのは conns で見るとき） */
+                        if (g_verbose) {
+                            (void) format_peer(&from, pbuf);
+                            (void) fprintf(stderr, "accept:%s\n", pbuf);
                         }
-                    } else {
-                        /* 接続元の数値アドレス/ポートを表示 */
-                        (void) getnameinfo((struct sockaddr *) &from, len,
-                                           hbuf, sizeof(hbuf),
-                                           sbuf, sizeof(sbuf),
-                                           NI_NUMERICHOST | NI_NUMERICSERV);
-                        (void) fprintf(stderr, "accept:%s:%s\n", hbuf, sbuf);
-
-                        /* 接続上限チェック（教材用） */
-                        if (count + 1 >= MAX_CHILD) {
+
+                        /* 受け付け制御：接続上限、または待ち時間が target を超え続けていれば
+                         * BUSY を返して断る */
+                        if (count >= g_max_conn || acc >= g_max_child + RESERVED_FD) {
                             (void) fprintf(stderr, "connection is full : cannot accept\n");
+                            busy_reject(acc);
+                            g_stats.refused++;
+                            g_stats.shed_full++;
+                            continue;
+                        }
+                        if (g_qdelay.overload) {
+                            (void) fprintf(stderr, "overloaded (qdelay=%dus) : busy\n",
+                                           g_qdelay.usec);
+                            busy_reject(acc);
+                            g_stats.refused++;
+                            g_stats.shed_delay++;
+                            continue;
+                        }
+
+                        /* 接続FDを epoll に登録（以後、このFDの受信イベントを待てる） */
+                        ev.data.fd = acc;
+                        ev.events = EPOLLIN | EPOLLRDHUP;  /* 読み込み可能と、相手が閉じたことを監視 */
+                        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, acc, &ev) == -1) {
+                            perror("epoll_ctl");
                             (void) close(acc);
-                        } else {
-                            /* 接続FDを epoll に登録（以後、このFDの受信イベントを待てる） */
-                            ev.data.fd = acc;
-                            ev.events = EPOLLIN;  /* 読み込み可能を監視 */
-                            if (epoll_ctl(epollfd, EPOLL_CTL_ADD, acc, &ev) == -1) {
-                                perror("epoll_ctl");
-                                (void) close(acc);
-                                (void) close(epollfd);
-                                return;
-                            }
-                            count++;
+                            (void) close(epollfd);
+                            return;
+                        }
+                        tune_accepted(acc);
+                        keepalive_set(acc);
+                        g_conn[acc].addr = from;
+                        g_conn[acc].active = 1;
+                        g_conn[acc].since = now_sec();
+                        g_conn[acc].nreq = 0;
+                        g_conn[acc].rx = g_conn[acc].tx = 0;
+                        g_conn[acc].rexpect = 0;
+                        g_conn[acc].rlast = g_conn[acc].since;
+                        if (acc >= g_fd_hi) {
+                            g_fd_hi = acc + 1;
                         }
+                        g_stats.accepted++;
+                        count++;
                     }
 
                 } else {
-                    /* 接続FDのイベント → recv/send（1回分） */
-                    if ((ret = send_recv(events[i].data.fd, events[i].data.fd)) == -1) {
+                    /* 接続FDのイベント
+                     * - EPOLLERR / EPOLLHUP：RST や keepalive / user timeout 切れ
+                     *   → 応答を返す先が無いので recv せずに、理由（SO_ERROR）を数えて閉じる
+                     * - それ以外 → recv/send（1回分）。EPOLLRDHUP（相手が送信側を閉じた）なら
+                     *   届いている分に答えたあと、残りが無ければ次の epoll_wait を待たずに閉じる
+                     */
+                    if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                        reclaim_count(sock_error(events[i].data.fd));
+                        ret = -1;
+                    } else if ((ret = send_recv(events[i].data.fd, events[i].data.fd)) == 0
+                               && (events[i].events & EPOLLRDHUP)
+                               && ioctl(events[i].data.fd, FIONREAD, &n) == 0 && n == 0) {
+                        g_stats.reclaimed_rdhup++;
+                        ret = -1;
+                    }
+                    if (ret == -1) {
                         /* EOF/エラー：監視解除してクローズ */
 
                         /* epoll から削除（DEL）
@@ -265,45 +2026,420 @@ accept_loop(int soc)
                         }
 
                         (void) close(events[i].data.fd);
+                        conn_closed(events[i].data.fd);
                         count--;
                     }
                 }
             }
             break;
         }
+
+        /* 待ち時間の見張り：この回の ready を全部処理し終えるまでの時間
+         * （ready が無かった回は区間の切り替えだけ見る） */
+        now = now_sec();
+        if (qdelay_sample(&g_qdelay, nfds > 0 ? now - t0 : -1.0, now)) {
+            (void) fprintf(stderr, "admission: overload=%d qdelay=%dus\n",
+                           g_qdelay.overload, g_qdelay.usec);
+        }
+
+        /* 受信バッファの見回り */
+        if (sweep != 0.0 && now - last_sweep >= sweep) {
+            last_sweep = now;
+            rbuf_sweep(now);
+        }
+
+        /* 管理用ソケットの drain コマンド → シグナルと同じく listen FD を閉じる */
+        if (g_admin_drain && g_drain_start == 0.0) {
+            drain_begin(0, count);
+            (void) epoll_ctl(epollfd, EPOLL_CTL_DEL, soc, &ev);
+            (void) close(soc);
+            soc = -1;
+        }
+
+        /* accept_pause：上限 / overload の間は listen FD を外し、解けたら戻す */
+        accept_pause(epollfd, soc, g_accept_pause && (count >= g_max_conn || g_qdelay.overload),
+                     &paused);
     }
 
-    /* 実際には戻らない想定だが形式上 */
+    /* drain の期限が来たときに残っている接続を閉じる */
+    for (i = 0; i < g_max_child + RESERVED_FD; i++) {
+        if (g_conn[i].active) {
+            (void) close(i);
+            g_conn[i].active = 0;
+        }
+    }
+    admin_shutdown(epollfd);
     (void) close(epollfd);
+    free(events);
 }
 
-/* サイズ指定文字列連結（strlcat 相当の安全版） */
+/* 行区切り（CR/LF）の一括検索
+ *
+ * buf[0..len) に含まれる '\r' / '\n' の位置（先頭からのオフセット）を
+ * 出現順に off[] へ最大 max 個書き込み、書き込んだ個数を返す。
+ *
+ * strpbrk(buf, "\r\n") との違い：
+ * - NUL 終端を必要としない（recv で得た len をそのまま渡せる）
+ * - 1 回の走査ですべての区切り位置が得られる（行の切り出しを上位で行える）
+ * - x86 では 16/32 バイト単位で比較する SIMD 版を使う
+ *
+ * 実装は 3 種類あり、scan_eol_init() で CPU を見て g_scan_eol に設定する：
+ * - scan_eol_scalar : 1 バイトずつ（どの CPU でも動く）
+ * - scan_eol_sse2   : 16 バイトずつ比較 → movemask でビット列にして位置を取り出す
+ * - scan_eol_avx2   : 32 バイトずつ（AVX2 がある CPU のみ）
+ */
 size_t
-mystrlcat(char *dst, const char *src, size_t size)
+scan_eol_scalar(const char *buf, size_t len, size_t *off, size_t max)
 {
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
+    size_t i, n;
 
-    for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--)
-        ;
-    dlen = pd - dst;
+    for (i = 0, n = 0; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+size_t
+scan_eol_sse2(const char *buf, size_t len, size_t *off, size_t max)
+{
+    __m128i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
+
+    cr = _mm_set1_epi8('\r');
+    lf = _mm_set1_epi8('\n');
+    for (i = 0, n = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (buf + i));
+        mask = (unsigned int) _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        /* 立っているビット = 区切り文字の位置（下位ビットから順に取り出す） */
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
+            }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    /* 16 バイトに満たない残りは 1 バイトずつ */
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
+
+__attribute__((target("avx2")))
+size_t
+scan_eol_avx2(const char *buf, size_t len, size_t *off, size_t max)
+{
+    __m256i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
+
+    cr = _mm256_set1_epi8('\r');
+    lf = _mm256_set1_epi8('\n');
+    for (i = 0, n = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        mask = (unsigned int) _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
+            }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
+#endif
+
+/* 使用する実装（scan_eol_init で決まる。スレッド生成前に 1 回だけ呼ぶこと） */
+size_t (*g_scan_eol)(const char *, size_t, size_t *, size_t) = scan_eol_scalar;
+const char *g_scan_eol_name = "scalar";
+
+void
+scan_eol_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_scan_eol = scan_eol_avx2;
+        g_scan_eol_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        g_scan_eol = scan_eol_sse2;
+        g_scan_eol_name = "sse2";
+    }
+#endif
+}
+
+/* 応答の末尾に付ける文字列（行ごとに iovec で後ろに並べる。受信バッファに場所は取らない） */
+#define RESP_SUFFIX     ":OK\r\n"
+#define RESP_SUFFIX_LEN (sizeof(RESP_SUFFIX) - 1)
+
+/* 長さ付きバッファ（応答組み立て用）
+ *
+ * base[0 .. size) の中で、データは base[off .. off+len) にある。
+ *
+ *   base                off            off+len                 size
+ *    |<-- headroom -->|<---- data ---->|<---- tailroom ---->|
+ *
+ * mystrlcat + strlen との違い：
+ * - 長さを持っているので、連結のたびに NUL を探して先頭から数え直さない（O(1) で追記）
+ * - NUL 終端を必要としないので、recv したバイト列をそのまま扱える
+ * - 先頭側にも空き（headroom）を取れるので、ヘッダ等を後から前に付けられる
+ * - データ部をそのまま iovec にして writev に渡せる
+ */
+struct mbuf {
+    char *base;                         /* 領域の先頭 */
+    size_t size;                        /* 領域の大きさ */
+    size_t off;                         /* データの開始位置 */
+    size_t len;                         /* データ長 */
+};
+
+#define MBUF_DATA(m_)     ((m_)->base + (m_)->off)
+#define MBUF_TAIL(m_)     ((m_)->base + (m_)->off + (m_)->len)
+#define MBUF_HEADROOM(m_) ((m_)->off)
+#define MBUF_TAILROOM(m_) ((m_)->size - (m_)->off - (m_)->len)
+
+/* 領域 base[0..size) を、先頭に headroom バイト空けた空のバッファとして使い始める */
+void
+mbuf_init(struct mbuf *m, char *base, size_t size, size_t headroom)
+{
+    m->base = base;
+    m->size = size;
+    m->off = headroom < size ? headroom : size;
+    m->len = 0;
+}
+
+/* 末尾に n バイト追記する（tailroom が足りなければ何もせず -1） */
+int
+mbuf_append(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_TAILROOM(m)) {
+        return (-1);
+    }
+    (void) memcpy(MBUF_TAIL(m), src, n);
+    m->len += n;
+    return (0);
+}
+
+/* 先頭に n バイト付け足す（headroom が足りなければ何もせず -1） */
+int
+mbuf_prepend(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_HEADROOM(m)) {
+        return (-1);
+    }
+    m->off -= n;
+    m->len += n;
+    (void) memcpy(MBUF_DATA(m), src, n);
+    return (0);
+}
 
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
+/* データ部を iovec に変換する（戻り値は writev に渡す要素数） */
+int
+mbuf_iov(const struct mbuf *m, struct iovec *iov)
+{
+    if (m->len == 0) {
+        return (0);
     }
+    iov[0].iov_base = MBUF_DATA(m);
+    iov[0].iov_len = m->len;
+    return (1);
+}
 
-    pde = dst + size - 1;
-    for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
+/* 行ごとの応答（続けて届いた要求の切り出し）
+ *
+ * 1 回の recv には、クライアントが続けて送った複数の要求（行）が入っていることがある。
+ * g_scan_eol で区切りの位置をまとめて求め、1 行ごとに「行 + RESP_SUFFIX」の応答を 1 つずつ返す。
+ * - 区切りは CR / LF / CRLF（CR の直後の LF は同じ区切りとして読み飛ばす）
+ * - 改行で終わらない末尾は 1 行とする（呼び出し側はふつう line_end までしか渡さず、
+ *   行の途中は次の recv まで持ち越す。EOF のときと、改行の無いまま受信バッファが一杯に
+ *   なったときだけ末尾まで渡す）
+ * - 応答は受信バッファ内の行と RESP_SUFFIX を交互に並べた iovec にする（行をコピーしない）
+ *
+ * p[*pos..len) から最大 LINE_BATCH 行を iov[]（2 * LINE_BATCH 個）に並べて *pos を進め、
+ * 並べた応答の合計バイト数を *bytes に入れる。
+ * 戻り値：並べた iovec の数（行数の 2 倍。0 = もう行が無い）
+ */
+#define LINE_BATCH  (64)
+
+int
+frame_lines(const char *p, size_t len, size_t *pos, struct iovec *iov, size_t *bytes)
+{
+    size_t off[LINE_BATCH], base, start, e, n, k;
+    int cnt;
+
+    start = *pos;
+    /* 前の呼び出しが CR で終わっていれば、続く LF は同じ区切り */
+    if (start > 0 && start < len && p[start - 1] == '\r' && p[start] == '\n') {
+        start++;
+    }
+    cnt = 0;
+    *bytes = 0;
+    if (start >= len) {
+        *pos = len;
+        return (0);
     }
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
+    base = start;
+    n = g_scan_eol(p + base, len - base, off, LINE_BATCH);
+    for (k = 0; k <= n; k++) {
+        if (k < n) {
+            e = base + off[k];
+            if (e == start && e > base && p[e] == '\n' && p[e - 1] == '\r') {
+                /* CRLF の LF */
+                start = e + 1;
+                continue;
+            }
+        } else if (n < LINE_BATCH && start < len) {
+            /* 改行で終わらない末尾 */
+            e = len;
+        } else {
+            break;
+        }
+        iov[cnt].iov_base = (char *) p + start;
+        iov[cnt].iov_len = e - start;
+        iov[cnt + 1].iov_base = RESP_SUFFIX;
+        iov[cnt + 1].iov_len = RESP_SUFFIX_LEN;
+        *bytes += e - start + RESP_SUFFIX_LEN;
+        cnt += 2;
+        start = e < len ? e + 1 : len;
     }
+    *pos = start;
+    return (cnt);
+}
 
-    while (*ps++)
-        ;
-    return (dlen + (ps - src - 1));
+/* p[0..len) の最後の区切り（CR / LF）の直後の位置（区切りが無ければ 0）
+ *
+ * recv の区切りは行の区切りと一致しないので、ここより後ろ（まだ改行の届いていない行の途中）は
+ * 応答せずに次の recv まで持ち越す
+ */
+size_t
+line_end(const char *p, size_t len)
+{
+    while (len > 0 && p[len - 1] != '\n' && p[len - 1] != '\r') {
+        len--;
+    }
+    return (len);
+}
+
+/* 応答の送り残しを送る（iov[0..iovcnt) の done バイト目から後ろ。送信バッファが一杯なら
+ * SEND_WAIT ミリ秒まで待つ。iov は送った分だけ書き換える。戻り値：送った合計 = done + 残り）
+ *
+ * 大きな要求を 1 回で読むようになって、応答も大きくなり得る。ノンブロッキングの writev は
+ * 送信バッファに入る分しか送らないので、残りは POLLOUT を待って送り切る
+ * （相手が読まない間はイベントループが止まる。教材として簡略化）
+ */
+#define SEND_WAIT (1000)
+
+ssize_t
+send_rest(int fd, struct iovec *iov, int iovcnt, size_t done)
+{
+    struct msghdr msg;
+    struct pollfd pfd;
+    size_t skip;
+    ssize_t n;
+
+    (void) memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t) iovcnt;
+    skip = done;
+    for (;;) {
+        /* 送り終えた iovec を飛ばし、途中まで送ったものは先頭をずらす */
+        while (msg.msg_iovlen > 0 && skip >= msg.msg_iov->iov_len) {
+            skip -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen == 0) {
+            break;
+        }
+        msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + skip;
+        msg.msg_iov->iov_len -= skip;
+        if ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1) {
+            skip = 0;
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return (-1);
+            }
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, SEND_WAIT) <= 0) {
+                errno = ETIMEDOUT;
+                return (-1);
+            }
+            continue;
+        }
+        skip = (size_t) n;
+        done += (size_t) n;
+    }
+    return ((ssize_t) done);
+}
+
+/* 行ごとの応答を返す（p[pos..end) を frame_lines で切り分ける。t0 は要求の処理を始めた時刻）
+ *
+ * 1 行ずつ表示し、行ごとに ":OK\r\n" を付けて writev で返す（続けて届いた要求にも 1 行に 1 つ応答する）。
+ * 送信バッファに入りきらなかった分は send_rest で送り切る。
+ * 戻り値：0 = 続ける / -1 = 送れなかった（呼び出し側が close する）
+ */
+int
+send_lines(int acc, int child_no, const char *p, size_t pos, size_t end, double t0)
+{
+    struct conn *c;
+    struct iovec iov[2 * LINE_BATCH];
+    size_t total;
+    unsigned long nline;
+    ssize_t len;
+    int n, k, err;
+
+    c = &g_conn[acc];
+    nline = 0;
+    while ((n = frame_lines(p, end, &pos, iov, &total)) > 0) {
+        for (k = 0; k < n; k += 2) {
+            (void) fprintf(stderr, "[child%d]%.*s\n", child_no,
+                           (int) iov[k].iov_len, (char *) iov[k].iov_base);
+        }
+
+        /* 応答送信（送信バッファに入りきらなかった分は send_rest で送り切る） */
+        if ((len = writev(acc, iov, n)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                err = errno;
+                perror("writev");
+                reclaim_count(err);
+                return (-1);
+            }
+            len = 0;
+        }
+        if ((size_t) len < total && (len = send_rest(acc, iov, n, (size_t) len)) == -1) {
+            err = errno;
+            perror("send_rest");
+            reclaim_count(err);
+            return (-1);
+        }
+
+        /* 統計（管理用ソケットの conns / stats / dump-histograms で見る） */
+        c->tx += (unsigned long long) len;
+        c->nreq += (unsigned long) n / 2;
+        g_stats.tx += (unsigned long long) len;
+        g_stats.requests += (unsigned long) n / 2;
+        nline += (unsigned long) n / 2;
+    }
+    g_stats.hist_req[hist_bucket((now_sec() - t0) * 1e6)] += nline;
+    return (0);
 }
 
 /* 送受信（1回分）
@@ -312,65 +2448,189 @@ mystrlcat(char *dst, const char *src, size_t size)
  * child_no : ログ表示用番号（ここでは fd を渡している）
  *
  * アルゴリズム：
- * - recv で受信（エラー/EOFなら -1）
- * - 受信内容を表示し ":OK\r\n" を付けて send で返す
+ * - FIONREAD と最近の要求の大きさから読むバッファを選ぶ（スタック / 接続ごとの rbuf）
+ *   （持ち越した行の途中があれば rbuf の続きに読む）
+ * - recv で受信（エラーなら -1。EOF なら持ち越しを最後の 1 行として応答して -1）
+ * - 最後の区切りまでを send_lines で 1 行ずつ表示し、行ごとに ":OK\r\n" を付けて返す
+ * - 後ろの行の途中は rbuf に持ち越す。1 行も揃っていなければ溜めて次を待つ
+ *   （throughput プロファイルでは SO_RCVLOWAT で残りを待つ）
+ * - 次の要求に合わせて rbuf を縮める / 解放する
  *
  * 注意：
- * - buf[len] = '\0' は len==sizeof(buf) のとき境界外になり得る
- *   → recv を sizeof(buf)-1 にするのが安全
- * - send は部分送信があり得る（教材として簡略化）
+ * - TCP はストリームなので、1 回に複数の行が入ることも、1 行が何回かに分かれて届くこともある
+ * - 改行の無いままバッファが一杯になったら、そこまでを 1 行とする
  */
 int
 send_recv(int acc, int child_no)
 {
-    char buf[512], *ptr;
+    char buf[RBUF_STACK];
+    struct conn *c;
+    struct mbuf m;
+    size_t need, pos, end, tail;
     ssize_t len;
+    int avail, err;
+    double t0;
+
+    t0 = now_sec();
+    c = &g_conn[acc];
+
+    /* 届いているバイト数（取れなければ 0）と最近の要求の大きさから、読むバッファを選ぶ
+     * - 持ち越している途中（rlen > 0）なら rbuf の続きに読む
+     */
+    if (ioctl(acc, FIONREAD, &avail) == -1 || avail < 0) {
+        avail = 0;
+    }
+    need = c->rlen + MAX((size_t) avail, c->rexpect);
+    if (c->rlen == 0 && (need <= RBUF_STACK || rbuf_reserve(c, need) == -1)) {
+        mbuf_init(&m, buf, sizeof(buf), 0);
+    } else {
+        (void) rbuf_reserve(c, need);
+        mbuf_init(&m, c->rbuf, c->rsize, 0);
+        m.len = c->rlen;
+    }
 
     /* 受信 */
-    if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
+    g_stats.recv_calls++;
+    if ((len = recv(acc, MBUF_TAIL(&m), MBUF_TAILROOM(&m), 0)) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            /* 接続 FD はノンブロッキング：まだ読めるデータが無いだけなので切断しない */
+            return (0);
+        }
+        err = errno;
         perror("recv");
+        reclaim_count(err);
         return (-1);
     }
     if (len == 0) {
         (void) fprintf(stderr, "[child%d]recv:EOF\n", child_no);
+        /* 改行の届かなかった最後の行にも応答する */
+        (void) send_lines(acc, child_no, MBUF_DATA(&m), 0, m.len, t0);
+        c->rlen = 0;
         return (-1);
     }
 
-    /* 文字列化（終端付与）
-     * NOTE: len==512 のとき境界外になり得る
-     */
-    buf[len] = '\0';
+    m.len += (size_t) len;
+    c->rlast = t0;
+    tune_accepted(acc);
+    c->rx += (unsigned long long) len;
+    g_stats.rx += (unsigned long long) len;
 
-    /* 改行を除去してログを1行化 */
-    if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-        *ptr = '\0';
+    /* 最後の区切りまでに応答し、後ろ（改行の届いていない行の途中）は rbuf に持ち越す
+     * - 改行の無いままバッファが一杯なら、全部を 1 行とする
+     * - スタックで読んだときは持ち越す分の rbuf を確保する（できなければ全部を応答する）
+     */
+    if ((end = line_end(MBUF_DATA(&m), m.len)) == 0 && MBUF_TAILROOM(&m) == 0) {
+        end = m.len;
+    }
+    if (end < m.len && m.base == buf && rbuf_reserve(c, m.len - end + 1) == -1) {
+        end = m.len;
+    }
+    tail = m.len - end;
+    if (end == 0) {
+        /* まだ 1 行も揃っていない：rbuf に溜めて次を待つ */
+        if (m.base == buf) {
+            (void) memcpy(c->rbuf, MBUF_DATA(&m), m.len);
+        }
+        c->rlen = m.len;
+        if (g_profile == PROFILE_THROUGHPUT && c->rexpect > c->rlen) {
+            /* throughput：残りの予想バイト数が届くまで起こさない */
+            rbuf_lowat(acc, (int) MIN(c->rexpect - c->rlen, g_rbuf_max / 2));
+        }
+        return (0);
     }
 
-    (void) fprintf(stderr, "[child%d]%s\n", child_no, buf);
-
-    /* 応答文字列作成 */
-    (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-    len = strlen(buf);
+    /* 要求が揃った：SO_RCVLOWAT を外し、要求の大きさを覚える */
+    rbuf_lowat(acc, 0);
+    c->rexpect = MAX(m.len, c->rexpect - c->rexpect / 4);
 
-    /* 応答送信 */
-    if ((len = send(acc, buf, len, 0)) == -1) {
-        perror("send");
+    /* 1 行ごとに応答する（前の recv が CR で終わっていれば、続く LF は同じ区切りなので読み飛ばす） */
+    pos = c->cr && MBUF_DATA(&m)[0] == '\n' ? 1 : 0;
+    c->cr = tail == 0 && MBUF_DATA(&m)[end - 1] == '\r';
+    if (send_lines(acc, child_no, MBUF_DATA(&m), pos, end, t0) == -1) {
         return (-1);
     }
 
+    /* 行の途中を rbuf の先頭に詰めて持ち越す */
+    if (tail > 0) {
+        (void) memmove(c->rbuf, MBUF_DATA(&m) + end, tail);
+    }
+    c->rlen = tail;
+
+    /* 次の要求に合わせて rbuf を縮める（512 バイトで足りるなら解放。持ち越しがあれば次に回す） */
+    if (c->rbuf != NULL && c->rlen == 0) {
+        if (c->rexpect <= RBUF_STACK) {
+            (void) rbuf_resize(c, 0);
+            g_stats.rbuf_shrink++;
+        } else if (c->rsize > 4 * rbuf_roundup(c->rexpect)) {
+            (void) rbuf_resize(c, rbuf_roundup(c->rexpect));
+            g_stats.rbuf_shrink++;
+        }
+    }
+
     return (0);
 }
 
 int
 main(int argc, char *argv[])
 {
-    int soc;
+    static const int sigs[] = { SIGHUP, SIGTERM, SIGINT };
+    struct config conf;
+    char *end;
+    long v;
+    int soc, nofile;
 
     /* 引数にポート番号が指定されているか？ */
     if (argc <= 1) {
-        (void) fprintf(stderr, "server4 port\n");
+        (void) fprintf(stderr,
+                       "server4 port [latency|throughput|churn|none] [conf | spin_us [mlock]]\n");
         return (EX_USAGE);
     }
+    if (argc > 2 && (g_profile = profile_lookup(argv[2])) == -1) {
+        (void) fprintf(stderr, "%s: unknown profile (latency|throughput|churn|none)\n", argv[2]);
+        return (EX_USAGE);
+    }
+    (void) fprintf(stderr, "profile=%s\n", g_profile_name[g_profile]);
+
+    /* FD 上限を引き上げ、接続管理テーブルの大きさを決める */
+    if ((nofile = raise_nofile_limit()) != -1) {
+        g_max_child = nofile - RESERVED_FD;
+    }
+    g_max_conn = g_max_child;
+    (void) fprintf(stderr, "nofile=%d max_child=%d\n", nofile, g_max_child);
+
+    /* 設定：既定値（FD 上限から）→ 3 つ目の引数（数値なら spin_us [mlock]、それ以外は設定ファイル） */
+    conf_defaults(&conf);
+    if (argc > 3) {
+        v = strtol(argv[3], &end, 10);
+        if (*end == '\0' && end != argv[3]) {
+            if (v < 0 || v > 1000000) {
+                (void) fprintf(stderr, "%s: bad spin_us (0..1000000)\n", argv[3]);
+                return (EX_USAGE);
+            }
+            conf.spin_us = (int) v;
+        } else {
+            g_conf_path = argv[3];
+            if (conf_parse(g_conf_path, &conf) == -1) {
+                return (EX_CONFIG);
+            }
+        }
+    }
+    if (argc > 4) {
+        if (g_conf_path != NULL || strcmp(argv[4], "mlock") != 0) {
+            (void) fprintf(stderr, "%s: unknown option (mlock after spin_us)\n", argv[4]);
+            return (EX_USAGE);
+        }
+        g_mlock = 1;
+    }
+
+    /* EMFILE 対策の予備 FD を確保しておく */
+    if ((g_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1) {
+        perror("open");
+    }
+
+    /* 行区切り検索の実装を CPU に合わせて選ぶ（スレッド/子プロセス生成前に 1 回だけ） */
+    scan_eol_init();
+    (void) fprintf(stderr, "scan_eol=%s\n", g_scan_eol_name);
 
     /* listen ソケット準備 */
     if ((soc = server_socket(argv[1])) == -1) {
@@ -378,12 +2638,33 @@ main(int argc, char *argv[])
         return (EX_UNAVAILABLE);
     }
 
+    /* 管理用ソケット（stats / conns / set / drain / dump-histograms） */
+    g_stats.start = now_sec();
+    (void) admin_socket(argv[1]);
+
+    /* SIGHUP（設定の読み直し）/ SIGTERM / SIGINT（drain）はシグナル FD で受け取る */
+    if (sig_fd_init(sigs, (int) (sizeof(sigs) / sizeof(sigs[0]))) == -1) {
+        (void) fprintf(stderr, "sig_fd_init:error (SIGTERM will kill without drain)\n");
+    }
+
+    /* busy-poll：SO_BUSY_POLL、CPU の固定、mlockall / prefault
+       （1 CPU なら busy_poll_init が spin_us を 0 に戻す）→ 設定を反映する */
+    g_spin_us = conf.spin_us;
+    if (g_spin_us > 0) {
+        busy_poll_init(soc);
+    }
+    conf.spin_us = (int) g_spin_us;
+    (void) conf_apply(&conf);
+
     (void) fprintf(stderr, "ready for accept\n");
 
-    /* epoll ベースのイベントループ */
+    /* epoll ベースのイベントループ
+     * - SIGTERM / SIGINT で drain に入り、接続が 0 になるか期限が来ると戻る
+     * - listen ソケットは drain に入るときに accept_loop の中で閉じている
+     */
     accept_loop(soc);
 
-    (void) close(soc);
+    (void) fprintf(stderr, "exit\n");
     return (EX_OK);
 }
 
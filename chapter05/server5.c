@@ -10,9 +10,27 @@
  * 2) 新しい接続 acc を accept したら fork()
  *    - 子プロセス：listen ソケット(soc) を閉じ、acc で送受信して終了
  *    - 親プロセス：acc を閉じ、次の accept に戻る
- * 3) 子が終了すると SIGCHLD が親に飛ぶので、ハンドラで wait() して回収する
+ * 3) 子が終了すると SIGCHLD が親に飛ぶので、回収する
  *    - 回収しないと zombie（ゾンビプロセス）が溜まる
  *
+ * シグナルの受け取り方（signalfd）：
+ * - SIGCHLD / SIGHUP / SIGTERM / SIGINT はブロックし、signalfd（読める FD）で受け取る
+ *   （signalfd が無い環境では自己パイプ：ハンドラは番号を 1 バイト write するだけ）
+ * - 親は listen ソケットとシグナル FD を poll で同時に待ち、シグナルを
+ *   「ループのイベント」として処理する（ハンドラの中で wait/fprintf をしない）
+ *   - SIGCHLD : reap_children が waitpid(-1, WNOHANG) を回して終わった子を回収し尽くす
+ *               （同時に何人終わっても通知は 1 回にまとまり得るので、1 回の wait では足りない）
+ *   - SIGHUP  : 生きている子の数を表示する
+ *   - SIGTERM / SIGINT : accept をやめて listen ソケットを閉じ、処理中の子が終わるのを待って
+ *                        終了する（drain。下記 drain_begin / drain_check）
+ * - シグナルはブロックしているので accept/fork の途中に割り込まれず、EINTR も起きない
+ * - 子は fork 直後にシグナルの設定を既定に戻す（子はシグナル FD を使わない）
+ *
+ * 管理用ソケット：
+ * - /tmp/server5.<port>.admin に stats / conns / set / drain を送ると、子（= 接続）ごとの状態を
+ *   返す / 値を変える / drain を始める（後ろの「管理用ソケット」。adminctl で送れる）
+ * - 親の poll ループで処理する（管理スレッドは作らない。理由は「管理用ソケット」の説明）
+ *
  * このモデルの特徴：
  * - 長所：実装が直感的／各接続が別プロセスなので “状態の分離” が簡単
  * - 短所：接続数が増えると fork コスト・コンテキストスイッチで重くなる
@@ -22,34 +40,174 @@
  * - fork 後に “どの FD を閉じるか” が重要
  *   - 子は listen FD を閉じる（不要、かつ親の accept を邪魔しない）
  *   - 親は acc を閉じる（子に任せる。親が持ち続けると切断検知が遅れる等）
-vv * - SIGCHLD ハンドラ内での wait の扱い（複数同時終了・再入・安全性）は奥が深い
+ * - SIGCHLD ハンドラ内での wait の扱い（複数同時終了・再入・安全性）は奥が深い
+ *   → ハンドラをやめ、signalfd でループのイベントにしている（上記）
  */
 
 #include <sys/param.h>
+#ifdef __linux__
+#include <sys/prctl.h>                  /* prctl(PR_SET_PDEATHSIG) */
+#endif
+#ifdef __linux__
+#include <sys/signalfd.h>               /* signalfd（シグナルを FD で受け取る） */
+#endif
+#include <sys/mman.h>                   /* mmap（子ごとの統計を親と共有する） */
 #include <sys/socket.h>
+#include <sys/stat.h>                   /* chmod（管理用ソケット） */
 #include <sys/types.h>
+#include <sys/uio.h>                    /* writev, struct iovec */
+#include <sys/un.h>                     /* struct sockaddr_un（管理用ソケット） */
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>                /* TCP_NODELAY / TCP_QUICKACK など（プロファイル） */
 #include <netdb.h>
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdarg.h>                     /* va_list（admin_printf） */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>                       /* clock_gettime（drain の経過時間） */
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>                  /* SSE2 / AVX2 組み込み関数（scan_eol） */
+#endif
+
+/* 接続単位の TCP チューニング（プロファイル）
+ *
+ * 起動引数で 1 つ選ぶ（server5 port [latency|throughput|churn|none] ...、既定は none = SO_REUSEADDR のみ）。
+ * ポート番号の次に書き、省略できる（profile_arg）。
+ *
+ * - latency    : TCP_NODELAY（Nagle を切って小さな応答をすぐ出す）
+ *                TCP_QUICKACK（遅延 ACK をやめる。カーネルが自動で戻すので受信のたびに付け直す）
+ *                TCP_NOTSENT_LOWAT を小さく（未送信データを溜め込まず、書ける通知を早く返す）
+ * - throughput : SO_SNDBUF / SO_RCVBUF を大きく（ウィンドウを広げて 1 回あたりの転送量を増やす）
+ *                応答を複数回の write で組み立てるときは TCP_CORK で 1 セグメントにまとめる
+ *                （このサーバは行ごとの応答を 1 回の writev にしているので CORK は要らない）
+ * - churn      : TCP_DEFER_ACCEPT（最初のデータが届くまで accept を起こさない）
+ *                TCP_FASTOPEN（SYN に載ったデータを受け付ける。sysctl net.ipv4.tcp_fastopen の
+ *                2 のビットが立っていないと効かない）
+ *                listen のバックログを大きく（実際は net.core.somaxconn で頭打ち）
+ *
+ * - listen ソケットに付けた TCP_NODELAY / TCP_NOTSENT_LOWAT / SO_SNDBUF / SO_RCVBUF は
+ *   accept した接続に引き継がれる（Linux）。引き継がれない TCP_QUICKACK だけ tune_accepted で付ける
+ * - SO_RCVBUF はウィンドウスケールが決まる SYN より前（listen の前）に付ける必要がある
+ * - 効果の比較は tune-bench（ループバックで応答遅延・転送速度・接続の回転を計る）
+ */
+#define PROFILE_NONE        (0)
+#define PROFILE_LATENCY     (1)
+#define PROFILE_THROUGHPUT  (2)
+#define PROFILE_CHURN       (3)
+
+const char *g_profile_name[] = { "none", "latency", "throughput", "churn" };
+
+int g_profile = PROFILE_NONE;
+
+#define TUNE_NOTSENT_LOWAT  (16 * 1024)         /* latency：未送信データの上限 */
+#define TUNE_BUFSZ          (4 * 1024 * 1024)   /* throughput：送受信バッファ（wmem_max / rmem_max で頭打ち） */
+#define TUNE_DEFER_ACCEPT   (1)                 /* churn：データを待つ秒数 */
+#define TUNE_FASTOPEN_QLEN  (256)               /* churn：TFO の保留キュー */
+#define TUNE_BACKLOG        (65535)             /* churn：listen のバックログ */
+
+/* プロファイル名 → 番号（知らない名前なら -1） */
+int
+profile_lookup(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(g_profile_name) / sizeof(g_profile_name[0])); i++) {
+        if (strcmp(name, g_profile_name[i]) == 0) {
+            return (i);
+        }
+    }
+    return (-1);
+}
+
+/* 引数のポート番号の次がプロファイル名なら取り出し、後ろの引数を 1 つ前に詰める
+ * （省略できる。詰めるので、後ろの引数はプロファイルを書かないときと同じ位置で読める） */
+void
+profile_arg(int *argc, char *argv[])
+{
+    int i;
+
+    if (*argc > 2 && profile_lookup(argv[2]) != -1) {
+        g_profile = profile_lookup(argv[2]);
+        for (i = 2; i < *argc - 1; i++) {
+            argv[i] = argv[i + 1];
+        }
+        argv[--*argc] = NULL;
+    }
+    (void) fprintf(stderr, "profile=%s\n", g_profile_name[g_profile]);
+}
+
+/* listen ソケットにプロファイルを付ける（bind / listen の前に呼ぶ。失敗は表示して続行） */
+void
+tune_listen(int soc)
+{
+    int opt;
+
+    switch (g_profile) {
+    case PROFILE_LATENCY:
+        opt = 1;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_NODELAY)");
+        }
+        opt = TUNE_NOTSENT_LOWAT;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_NOTSENT_LOWAT)");
+        }
+        break;
+    case PROFILE_THROUGHPUT:
+        opt = TUNE_BUFSZ;
+        if (setsockopt(soc, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(SO_SNDBUF)");
+        }
+        if (setsockopt(soc, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(SO_RCVBUF)");
+        }
+        break;
+    case PROFILE_CHURN:
+        opt = TUNE_DEFER_ACCEPT;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_DEFER_ACCEPT)");
+        }
+        opt = TUNE_FASTOPEN_QLEN;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_FASTOPEN, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_FASTOPEN)");
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* accept した接続 / 受信した直後の接続に、引き継がれない分を付ける */
+void
+tune_accepted(int acc)
+{
+    int opt;
+
+    if (g_profile == PROFILE_LATENCY) {
+        opt = 1;
+        (void) setsockopt(acc, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt));
+    }
+}
+
 /* サーバソケットの準備（listen ソケットを作る）
  *
  * portnm: 待受ポート（文字列）
  *
  * 手順：
  * - getaddrinfo(NULL, port, AI_PASSIVE) で待受け用アドレスを得る
- * - socket → setsockopt(SO_REUSEADDR) → bind → listen
+ * - socket → setsockopt(SO_REUSEADDR) → tune_listen（プロファイル）→ bind → listen
  */
 int
 server_socket(const char *portnm)
@@ -99,6 +257,9 @@ server_socket(const char *portnm)
         return (-1);
     }
 
+    /* プロファイルの TCP オプション（バッファの大きさは SYN より前に決めておく） */
+    tune_listen(soc);
+
     /* bind（待受けポートに割当） */
     if (bind(soc, res0->ai_addr, res0->ai_addrlen) == -1) {
         perror("bind");
@@ -107,8 +268,8 @@ server_socket(const char *portnm)
         return (-1);
     }
 
-    /* listen（接続待ち開始） */
-    if (listen(soc, SOMAXCONN) == -1) {
+    /* listen（接続待ち開始。churn はバックログを大きく） */
+    if (listen(soc, g_profile == PROFILE_CHURN ? TUNE_BACKLOG : SOMAXCONN) == -1) {
         perror("listen");
         (void) close(soc);
         freeaddrinfo(res0);
@@ -119,55 +280,923 @@ server_socket(const char *portnm)
     return (soc);
 }
 
+/* シグナルを FD で受け取る（sig_fd_init）
+ *
+ * - g_sig_fd   : signalfd、または自己パイプの読み側（poll で待てる）
+ * - g_sig_pipe : 自己パイプ（signalfd が使えないときだけ使う）
+ * - g_sig_mask : sig_fd_init で扱うシグナルの集合（子で既定に戻すときに使う）
+ * - g_stop     : SIGTERM / SIGINT でそのシグナル番号（accept_loop を抜ける）
+ * - g_nchild   : 生きている子の数（fork で +1、回収で -1）
+ */
+int g_sig_fd = -1;
+int g_sig_pipe[2] = { -1, -1 };
+sigset_t g_sig_mask;
+int g_stop = 0;
+int g_nchild = 0;
+
+/* accept ごとに接続元を表示するなら 1（既定 0）
+ * - 接続の多いときは表示そのものが重いので、普段は出さない
+ * - 起動時に環境変数 SERVER_VERBOSE が 1 以上なら立てる（管理用ソケットの set でも変わる）
+ */
+int g_verbose = 0;
+
+/* 回収した子の枠を空ける（定義は後ろの「子ごとの統計」） */
+void child_release(pid_t pid);
+
+/* 自己パイプ用のシグナルハンドラ（signalfd が使えないとき）
+ *
+ * シグナル番号を 1 バイト書くだけ（write は async-signal-safe）。
+ */
+void
+sig_pipe_handler(int sig)
+{
+    unsigned char c;
+    int save;
+
+    save = errno;
+    c = (unsigned char) sig;
+    (void) write(g_sig_pipe[1], &c, 1);
+    errno = save;
+}
+
+/* sigs[0..nsigs) を「読める FD」で受け取るようにする
+ *
+ * 戻り値: poll で待つ FD / -1（失敗）
+ *
+ * アルゴリズム：
+ * 1) 対象のシグナルをブロック（以後、非同期に割り込まれない）
+ * 2) signalfd を作る → 届いたシグナルは signalfd_siginfo として read できる
+ * 3) signalfd が無ければ自己パイプ：ハンドラ（SA_RESTART）が番号を 1 バイト書き、
+ *    ブロックを外す
+ */
+int
+sig_fd_init(const int *sigs, int nsigs)
+{
+    struct sigaction sa;
+    int i;
+
+    (void) sigemptyset(&g_sig_mask);
+    for (i = 0; i < nsigs; i++) {
+        (void) sigaddset(&g_sig_mask, sigs[i]);
+    }
+    (void) sigprocmask(SIG_BLOCK, &g_sig_mask, NULL);
+#ifdef __linux__
+    if ((g_sig_fd = signalfd(-1, &g_sig_mask, SFD_NONBLOCK | SFD_CLOEXEC)) != -1) {
+        return (g_sig_fd);
+    }
+    perror("signalfd");
+#endif
+    if (pipe(g_sig_pipe) == -1) {
+        perror("pipe");
+        (void) sigprocmask(SIG_UNBLOCK, &g_sig_mask, NULL);
+        return (-1);
+    }
+    for (i = 0; i < 2; i++) {
+        (void) fcntl(g_sig_pipe[i], F_SETFL, fcntl(g_sig_pipe[i], F_GETFL, 0) | O_NONBLOCK);
+        (void) fcntl(g_sig_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_pipe_handler;
+    (void) sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    for (i = 0; i < nsigs; i++) {
+        (void) sigaction(sigs[i], &sa, NULL);
+    }
+    g_sig_fd = g_sig_pipe[0];
+    (void) sigprocmask(SIG_UNBLOCK, &g_sig_mask, NULL);
+    return (g_sig_fd);
+}
+
+/* シグナル FD から 1 つ取り出す（戻り値：シグナル番号 / 0 = もう無い） */
+int
+sig_fd_read(void)
+{
+#ifdef __linux__
+    struct signalfd_siginfo si;
+#endif
+    unsigned char c;
+
+    if (g_sig_pipe[0] == -1) {
+#ifdef __linux__
+        if (read(g_sig_fd, &si, sizeof(si)) == (ssize_t) sizeof(si)) {
+            return ((int) si.ssi_signo);
+        }
+#endif
+        return (0);
+    }
+    if (read(g_sig_fd, &c, 1) == 1) {
+        return (c);
+    }
+    return (0);
+}
+
+/* fork した子で、シグナルの扱いを既定に戻す
+ *
+ * - シグナル FD（と自己パイプ）を閉じる
+ * - 自己パイプのハンドラを既定動作に戻し、ブロックを外す
+ *   （子は SIGTERM で普通に終了してよい）
+ */
+void
+sig_fd_child(void)
+{
+    int sig;
+
+    (void) close(g_sig_fd);
+    if (g_sig_pipe[0] != -1) {
+        (void) close(g_sig_pipe[1]);
+        for (sig = 1; sig < NSIG; sig++) {
+            if (sigismember(&g_sig_mask, sig) == 1) {
+                (void) signal(sig, SIG_DFL);
+            }
+        }
+    }
+    (void) sigprocmask(SIG_UNBLOCK, &g_sig_mask, NULL);
+}
+
+/* 終わった子を回収し尽くす（SIGCHLD のイベントで呼ぶ）
+ *
+ * - waitpid(-1, WNOHANG) を 0（まだ生きている）か -1（子がいない）になるまで回す
+ * - SIGCHLD は同時に何人終わっても 1 回にまとまり得るので、1 人ずつでは取りこぼす
+ */
+void
+reap_children(void)
+{
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        g_nchild--;
+        child_release(pid);
+        (void) fprintf(stderr, "reap_children:waitpid:pid=%d,status=%d\n", pid, status);
+        (void) fprintf(stderr,
+                       "  WIFEXITED:%d,WEXITSTATUS:%d,WIFSIGNALED:%d,"
+                       "WTERMSIG:%d,WIFSTOPPED:%d,WSTOPSIG:%d\n",
+                       WIFEXITED(status),
+                       WEXITSTATUS(status),
+                       WIFSIGNALED(status),
+                       WTERMSIG(status),
+                       WIFSTOPPED(status),
+                       WSTOPSIG(status));
+    }
+}
+
+/* 届いているシグナルをすべて処理する（accept_loop から呼ぶ） */
+void
+sig_dispatch(void)
+{
+    int sig;
+
+    while ((sig = sig_fd_read()) != 0) {
+        switch (sig) {
+        case SIGCHLD:
+            reap_children();
+            break;
+        case SIGHUP:
+            (void) fprintf(stderr, "SIGHUP:children=%d\n", g_nchild);
+            break;
+        case SIGTERM:
+        case SIGINT:
+            if (!g_stop) {
+                g_stop = sig;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/* グレースフル停止（drain）
+ *
+ * SIGTERM / SIGINT を受けたら即座に終わらず、次の順で止める：
+ * 1) listen ソケットを閉じて新しい接続を受けない
+ *    （ロードバランサやローリング再起動の相手は、ここで接続先を切り替える）
+ * 2) 既に受け付けた接続（1 接続 = 1 子プロセス）は子がそのまま最後まで処理し、
+ *    親は終わった子を回収しながら待つ（接続数 = g_nchild）
+ * 3) 子が 0 になったら終了。g_drain_timeout 秒（既定 DRAIN_TIMEOUT、set drain_timeout）を
+ *    過ぎたら親が先に終了し、
+ *    残った子には PR_SET_PDEATHSIG で SIGTERM が届く（子の側で接続が閉じる）
+ * - 途中経過（残り接続数と経過時間）を約 1 秒ごとに表示する
+ * - g_drain_start が 0 でなければ drain 中
+ */
+#define DRAIN_TIMEOUT   (30)
+
+int g_drain_timeout = DRAIN_TIMEOUT;
+double g_drain_start = 0.0;     /* drain を始めた時刻（CLOCK_MONOTONIC、0 = 通常運転） */
+double g_drain_report = 0.0;    /* 最後に途中経過を表示した時刻 */
+
+/* 単調増加時計の現在値（秒） */
+double
+now_sec(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec + (double) ts.tv_nsec / 1e9);
+}
+
+/* drain を始める（sig：受けたシグナル / 0 = 管理用ソケットから、nconn：その時点の接続数） */
+void
+drain_begin(int sig, int nconn)
+{
+    g_drain_start = g_drain_report = now_sec();
+    if (sig == 0) {
+        (void) fprintf(stderr, "drain:admin, stop accepting, conns=%d, timeout=%ds\n",
+                       nconn, g_drain_timeout);
+    } else {
+        (void) fprintf(stderr, "drain:signal %d, stop accepting, conns=%d, timeout=%ds\n",
+                       sig, nconn, g_drain_timeout);
+    }
+}
+
+/* drain を終えてよいか調べる（nconn：残っている接続数）
+ *
+ * 戻り値：1 = 終了してよい（接続 0、または期限切れ） / 0 = まだ待つ
+ */
+int
+drain_check(int nconn)
+{
+    double now;
+
+    now = now_sec();
+    if (nconn == 0) {
+        (void) fprintf(stderr, "drain:done in %.1fs\n", now - g_drain_start);
+        return (1);
+    }
+    if (now - g_drain_start >= g_drain_timeout) {
+        (void) fprintf(stderr, "drain:deadline, closing %d conns\n", nconn);
+        return (1);
+    }
+    if (now - g_drain_report >= 1.0) {
+        g_drain_report = now;
+        (void) fprintf(stderr, "drain:conns=%d elapsed=%.1fs\n", nconn, now - g_drain_start);
+    }
+    return (0);
+}
+
+/* 接続元アドレス文字列の最大長（"IPv6アドレス:ポート" + NUL） */
+#define PEER_STRLEN (INET6_ADDRSTRLEN + 8)
+
+/* 10 進数の書き出し（format_peer の下請け） */
+char *
+put_dec(char *p, unsigned int v)
+{
+    char tmp[10];
+    int n;
+
+    n = 0;
+    do {
+        tmp[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0) {
+        *p++ = tmp[--n];
+    }
+    return (p);
+}
+
+/* 接続元アドレスの文字列化（getnameinfo を使わない高速版）
+ *
+ * ss  : accept で得た生のアドレス（AF_INET / AF_INET6）
+ * buf : 出力先（PEER_STRLEN バイト以上）
+ *
+ * 出力形式は getnameinfo(NI_NUMERICHOST | NI_NUMERICSERV) の host と port を
+ * ':' でつないだもの（"127.0.0.1:50000"）と同じ。
+ *
+ * - getnameinfo は NSS/ロケールを経由し、内部でも書式化を行うので accept 毎に呼ぶと重い
+ * - ここでは 10 進/16 進の変換を手で書き、malloc も snprintf も使わない
+ * - IPv6 は RFC 5952 に従い、最長の 0 の連続（2 グループ以上）を "::" に縮める
+ *
+ * 戻り値：書き込んだ文字数（NUL を除く）
+ */
+size_t
+format_peer(const struct sockaddr_storage *ss, char *buf)
+{
+    static const char hex[] = "0123456789abcdef";
+    const struct sockaddr_in *sin;
+    const struct sockaddr_in6 *sin6;
+    const unsigned char *a;
+    unsigned int port, w;
+    int i, j, best, bestlen, shift;
+    char *p;
+
+    p = buf;
+    switch (ss->ss_family) {
+    case AF_INET:
+        sin = (const struct sockaddr_in *) ss;
+        a = (const unsigned char *) &sin->sin_addr;
+        for (i = 0; i < 4; i++) {
+            if (i > 0) {
+                *p++ = '.';
+            }
+            p = put_dec(p, a[i]);
+        }
+        port = ntohs(sin->sin_port);
+        break;
+
+    case AF_INET6:
+        sin6 = (const struct sockaddr_in6 *) ss;
+        a = sin6->sin6_addr.s6_addr;
+
+        /* 最長の 0 グループの連続を探す */
+        best = -1;
+        bestlen = 0;
+        for (i = 0; i < 8; i = j + 1) {
+            for (j = i; j < 8 && a[2 * j] == 0 && a[2 * j + 1] == 0; j++)
+                ;
+            if (j - i >= 2 && j - i > bestlen) {
+                best = i;
+                bestlen = j - i;
+            }
+        }
+
+        if (best == 0
+            && (bestlen == 6 || (bestlen == 5 && a[10] == 0xff && a[11] == 0xff))) {
+            /* IPv4 射影/互換アドレス（::ffff:a.b.c.d, ::a.b.c.d）は末尾 32bit を 10 進で書く
+             * （inet_ntop/getnameinfo と同じ判定） */
+            *p++ = ':';
+            *p++ = ':';
+            if (bestlen == 5) {
+                (void) memcpy(p, "ffff:", 5);
+                p += 5;
+            }
+            for (j = 12; j < 16; j++) {
+                if (j > 12) {
+                    *p++ = '.';
+                }
+                p = put_dec(p, a[j]);
+            }
+        } else {
+            for (i = 0; i < 8; i++) {
+                if (i == best) {
+                    *p++ = ':';
+                    *p++ = ':';
+                    i += bestlen - 1;
+                    continue;
+                }
+                if (i > 0 && i != best + bestlen) {
+                    *p++ = ':';
+                }
+                w = ((unsigned int) a[2 * i] << 8) | a[2 * i + 1];
+                for (shift = 12; shift > 0 && ((w >> shift) & 0xf) == 0; shift -= 4)
+                    ;
+                for (; shift >= 0; shift -= 4) {
+                    *p++ = hex[(w >> shift) & 0xf];
+                }
+            }
+        }
+        port = ntohs(sin6->sin6_port);
+        break;
+
+    default:
+        *p++ = '?';
+        port = 0;
+        break;
+    }
+
+    *p++ = ':';
+    p = put_dec(p, port);
+    *p = '\0';
+    return ((size_t) (p - buf));
+}
+
+/* 子ごとの統計（管理用ソケットの stats / conns で表示する）
+ *
+ * 子は別プロセスなので、カウンタは起動時に MAP_SHARED で確保した表 g_child[] に置く。
+ * - 親は fork の前に空き枠を 1 つ予約し（child_alloc）、接続元と時刻を書いてから fork する。
+ *   pid は fork の後で親が書く（0 = 空き、-1 = 予約中）
+ * - 子は自分の枠（g_self）の nreq / rx / tx だけを __atomic の relaxed で足す
+ * - 親は子を回収したら（child_release）、その枠のカウンタを g_stats の累計に足して空ける
+ * - 枠は CHILD_MAX 個。足りないときの子は conns に出ず、要求数 / バイト数も数えない
+ */
+#define CHILD_MAX   (4096)
+
+struct child {
+    pid_t pid;                          /* 0 = 空き / -1 = 予約中（親だけが書く） */
+    double since;                       /* 接続した時刻（now_sec） */
+    struct sockaddr_storage addr;       /* 接続元 */
+    unsigned long nreq;                 /* 応答した行の数（子が足す） */
+    unsigned long long rx, tx;          /* 受信 / 送信バイト数（子が足す） */
+};
+
+/* 回収した子の累計（親だけが使う） */
+struct stats {
+    double start;                       /* 起動した時刻（now_sec） */
+    unsigned long accepted, closed, requests;
+    unsigned long long rx, tx;
+};
+
+struct child *g_child = NULL;
+int g_child_hiwat = 0;                  /* 使ったことのある枠の数（探すのはここまで） */
+struct child *g_self = NULL;            /* 子プロセスで、自分の枠（親では NULL） */
+struct stats g_stats;
+
+/* 子ごとの統計の表を確保する（fork した子と共有する） */
+int
+child_init(void)
+{
+    void *p;
+
+    if ((p = mmap(NULL, sizeof(struct child) * CHILD_MAX, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        perror("mmap");
+        return (-1);
+    }
+    g_child = p;
+    g_stats.start = now_sec();
+    return (0);
+}
+
+/* fork の前に空き枠を予約する（戻り値：枠 / NULL = 空きが無い） */
+struct child *
+child_alloc(const struct sockaddr_storage *from)
+{
+    struct child *c;
+    int i;
+
+    for (i = 0; i < CHILD_MAX && g_child[i].pid != 0; i++)
+        ;
+    if (i == CHILD_MAX) {
+        return (NULL);
+    }
+    if (i >= g_child_hiwat) {
+        g_child_hiwat = i + 1;
+    }
+    c = &g_child[i];
+    c->pid = -1;
+    c->since = now_sec();
+    c->addr = *from;
+    c->nreq = 0;
+    c->rx = c->tx = 0;
+    return (c);
+}
+
+void
+child_release(pid_t pid)
+{
+    struct child *c;
+    int i;
+
+    for (i = 0; i < g_child_hiwat; i++) {
+        c = &g_child[i];
+        if (c->pid == pid) {
+            /* 子はもう終わっているので、ふつうに読んでよい */
+            g_stats.closed++;
+            g_stats.requests += c->nreq;
+            g_stats.rx += c->rx;
+            g_stats.tx += c->tx;
+            c->pid = 0;
+            return;
+        }
+    }
+}
+
+/* 管理用ソケット（admin）
+ *
+ * 動いているサーバの状態を、stderr のログを grep せずに問い合わせるための AF_UNIX ソケット。
+ * adminctl（または socat 等）で 1 行のコマンドを送ると、テキストで応答して閉じる。
+ *
+ * コマンド：
+ * - stats         : 稼働時間、子（= 接続）の数、accept / 要求数、送受信バイト数
+ * - conns         : 子ごとの pid、接続元、経過秒、要求数、送受信バイト数
+ * - set KEY VALUE : g_tunables の値を 1 つ変える
+ * - drain         : SIGTERM と同じ drain を始める
+ *
+ * - パスは ADMIN_PATH_FMT にポート番号を入れたもの。権限 0600（起動したユーザだけが使える）
+ * - 管理スレッドは作らず、listen も接続もノンブロッキングで親の poll に加える
+ *   （accept_loop と drain の待ち合わせ。子の統計は g_child を読むだけで子は止めない）
+ *   - 親は接続ごとに fork するので、スレッドを持たせない。別のスレッドが malloc や stdio の
+ *     ロックを持った瞬間に fork すると、子はそのロックが掛かったままの状態で始まる
+ *   - 親の仕事は accept / fork / 回収だけで短いので、同じ poll で待っても接続を待たせない
+ * - 子は fork 直後に管理用の FD を閉じる（admin_child。持ったままだと応答後の close が
+ *   相手に伝わらない）
+ * - 同時に扱う管理接続は ADMIN_MAX 本まで。1 接続 1 コマンドで、応答を書き終えたら閉じる
+ */
+#define ADMIN_PATH_FMT  "/tmp/server5.%s.admin"
+#define ADMIN_MAX       (4)
+#define ADMIN_LINE      (256)
+#define ADMIN_NPFD      (1 + ADMIN_MAX) /* admin_pollfd が並べる pollfd の数 */
+
+struct admin {
+    int fd;                             /* -1 = 空き */
+    int replied;                        /* コマンドを実行済み（応答の送信中）なら 1 */
+    size_t inlen;                       /* in[] に溜まったコマンド行の長さ */
+    char in[ADMIN_LINE];
+    char *out;                          /* 応答（admin_printf で伸ばす） */
+    size_t outlen, outsize, outoff;     /* 応答の長さ / 確保量 / 送信済み */
+};
+
+struct admin g_admin[ADMIN_MAX];
+int g_admin_soc = -1;
+char g_admin_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+int g_admin_drain = 0;                  /* drain コマンドを受けたら 1（accept_loop が見る） */
+
+/* set で変えられる値（名前、変数、受け付ける範囲） */
+struct tunable {
+    const char *name;
+    int *var;
+    int min;
+    int max;
+};
+
+const struct tunable g_tunables[] = {
+    { "drain_timeout", &g_drain_timeout, 0, 86400 },
+    { "verbose",       &g_verbose,       0, 1 },
+};
+
+/* 管理用ソケットを作る（失敗しても管理機能が無いだけで、サーバは続行する） */
+int
+admin_socket(const char *portnm)
+{
+    struct sockaddr_un sun;
+    int i;
+
+    for (i = 0; i < ADMIN_MAX; i++) {
+        g_admin[i].fd = -1;
+    }
+    (void) memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    (void) snprintf(sun.sun_path, sizeof(sun.sun_path), ADMIN_PATH_FMT, portnm);
+    if ((g_admin_soc = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        perror("socket(AF_UNIX)");
+        return (-1);
+    }
+    (void) fcntl(g_admin_soc, F_SETFL, fcntl(g_admin_soc, F_GETFL, 0) | O_NONBLOCK);
+    (void) fcntl(g_admin_soc, F_SETFD, FD_CLOEXEC);
+    (void) unlink(sun.sun_path);
+    if (bind(g_admin_soc, (struct sockaddr *) &sun, sizeof(sun)) == -1
+        || chmod(sun.sun_path, 0600) == -1
+        || listen(g_admin_soc, ADMIN_MAX) == -1) {
+        perror(sun.sun_path);
+        (void) close(g_admin_soc);
+        g_admin_soc = -1;
+        return (-1);
+    }
+    (void) strcpy(g_admin_path, sun.sun_path);
+    (void) fprintf(stderr, "admin=%s\n", g_admin_path);
+    return (g_admin_soc);
+}
+
+/* 応答に書式付きで追記する */
+void
+admin_printf(struct admin *a, const char *fmt, ...)
+{
+    va_list ap;
+    size_t need;
+    char *p;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    need = a->outlen + (size_t) n + 1;
+    if (need > a->outsize) {
+        if ((p = realloc(a->out, need < 4096 ? 4096 : need * 2)) == NULL) {
+            return;
+        }
+        a->out = p;
+        a->outsize = need < 4096 ? 4096 : need * 2;
+    }
+    va_start(ap, fmt);
+    (void) vsnprintf(a->out + a->outlen, (size_t) n + 1, fmt, ap);
+    va_end(ap);
+    a->outlen += (size_t) n;
+}
+
+/* 管理接続を閉じて枠を空ける */
+void
+admin_close(struct admin *a)
+{
+    (void) close(a->fd);
+    free(a->out);
+    (void) memset(a, 0, sizeof(*a));
+    a->fd = -1;
+}
+
+/* 管理用 listen ソケットが ready → 空き枠がある分だけ accept する */
+void
+admin_accept(void)
+{
+    int fd, i;
+
+    for (;;) {
+        for (i = 0; i < ADMIN_MAX && g_admin[i].fd != -1; i++)
+            ;
+        if ((fd = accept(g_admin_soc, NULL, NULL)) == -1) {
+            return;
+        }
+        if (i == ADMIN_MAX) {
+            /* 枠が無い：待たせずに断る */
+            (void) close(fd);
+            continue;
+        }
+        (void) fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        (void) fcntl(fd, F_SETFD, FD_CLOEXEC);
+        g_admin[i].fd = fd;
+    }
+}
+
+/* set KEY VALUE：g_tunables の 1 つを書き換える（これから fork する子にも引き継がれる） */
+void
+admin_set(struct admin *a, const char *key, const char *val)
+{
+    const struct tunable *t;
+    char *end;
+    size_t k;
+    long v;
+
+    for (k = 0; k < sizeof(g_tunables) / sizeof(g_tunables[0]); k++) {
+        if (key != NULL && strcmp(key, g_tunables[k].name) == 0) {
+            break;
+        }
+    }
+    if (k == sizeof(g_tunables) / sizeof(g_tunables[0]) || val == NULL) {
+        admin_printf(a, "ERR usage: set KEY VALUE (");
+        for (k = 0; k < sizeof(g_tunables) / sizeof(g_tunables[0]); k++) {
+            admin_printf(a, "%s%s", k > 0 ? "|" : "", g_tunables[k].name);
+        }
+        admin_printf(a, ")\n");
+        return;
+    }
+    t = &g_tunables[k];
+    errno = 0;
+    v = strtol(val, &end, 10);
+    if (errno != 0 || end == val || *end != '\0' || v < t->min || v > t->max) {
+        admin_printf(a, "ERR bad value for %s (%d..%d)\n", key, t->min, t->max);
+        return;
+    }
+    *t->var = (int) v;
+    (void) fprintf(stderr, "set: %s=%ld\n", key, v);
+    admin_printf(a, "OK %s=%ld\n", key, v);
+}
+
+/* コマンド 1 行を実行して応答を組み立てる（接続数は g_nchild） */
+void
+admin_command(struct admin *a, char *line)
+{
+    unsigned long nreq;
+    unsigned long long rx, tx;
+    char pbuf[PEER_STRLEN], *cmd, *key, *val;
+    struct child *c;
+    double now;
+    int i;
+
+    now = now_sec();
+    cmd = strtok(line, " \t");
+    key = strtok(NULL, " \t");
+    val = strtok(NULL, " \t");
+    if (cmd == NULL) {
+        admin_printf(a, "ERR empty command\n");
+    } else if (strcmp(cmd, "stats") == 0) {
+        nreq = g_stats.requests;
+        rx = g_stats.rx;
+        tx = g_stats.tx;
+        for (i = 0; i < g_child_hiwat; i++) {
+            c = &g_child[i];
+            if (c->pid > 0) {
+                nreq += __atomic_load_n(&c->nreq, __ATOMIC_RELAXED);
+                rx += __atomic_load_n(&c->rx, __ATOMIC_RELAXED);
+                tx += __atomic_load_n(&c->tx, __ATOMIC_RELAXED);
+            }
+        }
+        admin_printf(a, "uptime=%.1f\nconns=%d\ndraining=%d\n"
+                     "accepted=%lu\nclosed=%lu\nrequests=%lu\nrx=%llu\ntx=%llu\n"
+                     "drain_timeout=%d\nverbose=%d\n",
+                     now - g_stats.start, g_nchild, g_drain_start != 0.0,
+                     g_stats.accepted, g_stats.closed, nreq, rx, tx,
+                     g_drain_timeout, g_verbose);
+    } else if (strcmp(cmd, "conns") == 0) {
+        admin_printf(a, "pid peer age nreq rx tx\n");
+        for (i = 0; i < g_child_hiwat; i++) {
+            c = &g_child[i];
+            if (c->pid > 0) {
+                (void) format_peer(&c->addr, pbuf);
+                admin_printf(a, "%d %s %.1f %lu %llu %llu\n", (int) c->pid, pbuf,
+                             now - c->since, __atomic_load_n(&c->nreq, __ATOMIC_RELAXED),
+                             __atomic_load_n(&c->rx, __ATOMIC_RELAXED),
+                             __atomic_load_n(&c->tx, __ATOMIC_RELAXED));
+            }
+        }
+    } else if (strcmp(cmd, "set") == 0) {
+        admin_set(a, key, val);
+    } else if (strcmp(cmd, "drain") == 0) {
+        g_admin_drain = 1;
+        admin_printf(a, "OK draining conns=%d timeout=%d\n", g_nchild, g_drain_timeout);
+    } else {
+        admin_printf(a, "ERR unknown command %s (stats|conns|set|drain)\n", cmd);
+    }
+    if (a->out != NULL) {
+        (void) fprintf(stderr, "admin:%s\n", cmd != NULL ? cmd : "");
+    }
+}
+
+/* 管理接続のイベント
+ *
+ * 1) コマンド行（'\n' まで）を溜める
+ * 2) 揃ったら admin_command で応答を作り、すぐに送り始める
+ * 3) 応答を送り切ったら閉じる（送れない分は、次の poll で書き込み可能を待って続ける）
+ */
+void
+admin_event(struct admin *a)
+{
+    ssize_t n;
+    char *eol;
+
+    if (!a->replied) {
+        if ((n = recv(a->fd, a->in + a->inlen, sizeof(a->in) - 1 - a->inlen, 0)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                admin_close(a);
+            }
+            return;
+        }
+        if (n == 0) {
+            admin_close(a);
+            return;
+        }
+        a->inlen += (size_t) n;
+        a->in[a->inlen] = '\0';
+        if ((eol = strpbrk(a->in, "\r\n")) == NULL && a->inlen < sizeof(a->in) - 1) {
+            return;
+        }
+        if (eol != NULL) {
+            *eol = '\0';
+        }
+        admin_command(a, a->in);
+        if (a->out == NULL) {
+            admin_close(a);
+            return;
+        }
+        a->replied = 1;
+    }
+    if ((n = send(a->fd, a->out + a->outoff, a->outlen - a->outoff, MSG_NOSIGNAL)) == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            admin_close(a);
+        }
+        return;
+    }
+    a->outoff += (size_t) n;
+    if (a->outoff == a->outlen) {
+        admin_close(a);
+    }
+}
+
+/* 管理用ソケットと管理接続を pfd[0..ADMIN_NPFD) に並べる
+ * （空き枠は -1 で poll に無視される。応答の送信中は POLLOUT を待つ） */
+void
+admin_pollfd(struct pollfd *pfd)
+{
+    int i;
+
+    pfd[0].fd = g_admin_soc;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    for (i = 0; i < ADMIN_MAX; i++) {
+        pfd[1 + i].fd = g_admin[i].fd;
+        pfd[1 + i].events = g_admin[i].replied ? POLLOUT : POLLIN;
+        pfd[1 + i].revents = 0;
+    }
+}
+
+/* admin_pollfd で並べた分の poll の結果を処理する */
+void
+admin_dispatch(const struct pollfd *pfd)
+{
+    int i;
+
+    for (i = 0; i < ADMIN_MAX; i++) {
+        if (pfd[1 + i].fd != -1 && pfd[1 + i].fd == g_admin[i].fd && pfd[1 + i].revents != 0) {
+            admin_event(&g_admin[i]);
+        }
+    }
+    if (pfd[0].revents & POLLIN) {
+        admin_accept();
+    }
+}
+
+/* fork した子で、管理用の FD を閉じる（パスは消さない） */
+void
+admin_child(void)
+{
+    int i;
+
+    for (i = 0; i < ADMIN_MAX; i++) {
+        if (g_admin[i].fd != -1) {
+            (void) close(g_admin[i].fd);
+        }
+    }
+    if (g_admin_soc != -1) {
+        (void) close(g_admin_soc);
+    }
+}
+
+/* 終了時：管理接続と管理用ソケットを閉じ、パスを消す */
+void
+admin_shutdown(void)
+{
+    int i;
+
+    if (g_admin_soc == -1) {
+        return;
+    }
+    for (i = 0; i < ADMIN_MAX; i++) {
+        if (g_admin[i].fd != -1) {
+            admin_close(&g_admin[i]);
+        }
+    }
+    (void) close(g_admin_soc);
+    (void) unlink(g_admin_path);
+    g_admin_soc = -1;
+}
+
+
 /* アクセプトループ（fork 型並列サーバの中核）
  *
  * soc: listen ソケット FD（親プロセスが保持）
  *
  * アルゴリズム：
- * - 親：accept で新規接続 acc を得る
+ * - 親：listen ソケットとシグナル FD と管理用ソケットを poll で待つ
+ *   - シグナル FD が読めれば sig_dispatch（子の回収・停止要求）
+ *   - 管理用ソケット / 管理接続が読めれば（書ければ）admin_dispatch
+ *   - listen ソケットが読めれば accept で新規接続 acc を得る
  * - fork()
- *   - 子：soc を close → acc で send_recv_loop → close(acc) → _exit
- *   - 親：acc を close（子が担当）→ 次の accept
+ *   - 子：シグナルを既定に戻し、soc を close → acc で send_recv_loop → close(acc) → _exit
+ *   - 親：acc を close（子が担当）→ 次の poll
+ * - g_stop（または管理用ソケットの drain）が立ったら戻る（main が listen ソケットを閉じる）
  *
- * さらに：
- * - ここでは waitpid(-1, ..., WNOHANG) を “保険” で呼び、
- *   シグナルで回収し損ねた子がいないかを確認している
- *   （ただし、SIGCHLD ハンドラでも wait しているので “二重回収” の設計には注意）
+ * 子の回収は SIGCHLD のイベント（reap_children）だけで行う（“二重回収” の保険は不要になった）。
  */
 void
 accept_loop(int soc)
 {
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+    char pbuf[PEER_STRLEN];
     struct sockaddr_storage from;
-    int acc, status;
+    struct pollfd pfd[2 + ADMIN_NPFD];
+    struct child *slot;
+    int acc;
     pid_t pid;
     socklen_t len;
 
-    for (;;) {
+    pfd[0].fd = soc;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = g_sig_fd;
+    pfd[1].events = POLLIN;
+    while (!g_stop && !g_admin_drain) {
+        admin_pollfd(&pfd[2]);
+        if (poll(pfd, 2 + ADMIN_NPFD, -1) == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+            }
+            continue;
+        }
+        if (pfd[1].revents & POLLIN) {
+            sig_dispatch();
+        }
+        admin_dispatch(&pfd[2]);
+        if ((pfd[0].revents & POLLIN) == 0) {
+            continue;
+        }
         len = (socklen_t) sizeof(from);
 
         /* 新規接続受付
-         * - accept はブロッキングで待つ
-         * - EINTR はシグナル割り込みなので、通常は再試行の対象
+         * - poll で読めると分かってから呼ぶので、通常は待たずに返る
+         * - シグナルはブロック中なので EINTR は（自己パイプの SA_RESTART でも）通常起きない
          */
         if ((acc = accept(soc, (struct sockaddr *) &from, &len)) == -1) {
             if (errno != EINTR) {
                 perror("accept");
             }
         } else {
-            /* 接続元アドレス表示（学習用ログ） */
-            (void) getnameinfo((struct sockaddr *) &from, len,
-                               hbuf, sizeof(hbuf),
-                               sbuf, sizeof(sbuf),
-                               NI_NUMERICHOST | NI_NUMERICSERV);
-            (void) fprintf(stderr, "accept:%s:%s\n", hbuf, sbuf);
+            /* 接続元の表示は verbose のときだけ */
+            if (g_verbose) {
+                (void) format_peer(&from, pbuf);
+                (void) fprintf(stderr, "accept:%s\n", pbuf);
+            }
 
-            /* fork：接続ごとに子プロセスを作る */
+            /* fork：接続ごとに子プロセスを作る（統計の枠は fork の前に予約する） */
+            g_stats.accepted++;
+            slot = child_alloc(&from);
             if ((pid = fork()) == 0) {
                 /* ===== 子プロセス =====
                  * 子は “この acc を処理する担当”
                  */
 
+                /* シグナル FD と管理用の FD を閉じ、シグナルの扱いを既定に戻す */
+                sig_fd_child();
+                admin_child();
+                g_self = slot;
+
+#ifdef __linux__
+                /* 親が先に終わったら（drain の期限切れ）SIGTERM を受けて終わる
+                 * - prctl の前に親が終わっていた場合に備えて getppid も見る
+                 */
+                if (prctl(PR_SET_PDEATHSIG, SIGTERM) == 0 && getppid() == 1) {
+                    _exit(1);
+                }
+#endif
+
                 /* 子は listen ソケットを使わない（親が accept する）
                  * - 子が soc を持ち続けると、親が落ちた時にポート解放が遅れるなど
                  *   不要な副作用を生むので close するのが定石
@@ -197,67 +1226,284 @@ accept_loop(int soc)
                  */
                 (void) close(acc);
                 acc = -1;
+                g_nchild++;
+                if (slot != NULL) {
+                    slot->pid = pid;
+                }
 
             } else {
                 /* fork 失敗：資源不足など */
                 perror("fork");
                 (void) close(acc);
                 acc = -1;
+                if (slot != NULL) {
+                    slot->pid = 0;
+                }
+            }
+        }
+    }
+}
+
+/* 行区切り（CR/LF）の一括検索
+ *
+ * buf[0..len) に含まれる '\r' / '\n' の位置（先頭からのオフセット）を
+ * 出現順に off[] へ最大 max 個書き込み、書き込んだ個数を返す。
+ *
+ * strpbrk(buf, "\r\n") との違い：
+ * - NUL 終端を必要としない（recv で得た len をそのまま渡せる）
+ * - 1 回の走査ですべての区切り位置が得られる（行の切り出しを上位で行える）
+ * - x86 では 16/32 バイト単位で比較する SIMD 版を使う
+ *
+ * 実装は 3 種類あり、scan_eol_init() で CPU を見て g_scan_eol に設定する：
+ * - scan_eol_scalar : 1 バイトずつ（どの CPU でも動く）
+ * - scan_eol_sse2   : 16 バイトずつ比較 → movemask でビット列にして位置を取り出す
+ * - scan_eol_avx2   : 32 バイトずつ（AVX2 がある CPU のみ）
+ */
+size_t
+scan_eol_scalar(const char *buf, size_t len, size_t *off, size_t max)
+{
+    size_t i, n;
+
+    for (i = 0, n = 0; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+size_t
+scan_eol_sse2(const char *buf, size_t len, size_t *off, size_t max)
+{
+    __m128i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
+
+    cr = _mm_set1_epi8('\r');
+    lf = _mm_set1_epi8('\n');
+    for (i = 0, n = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (buf + i));
+        mask = (unsigned int) _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        /* 立っているビット = 区切り文字の位置（下位ビットから順に取り出す） */
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
             }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    /* 16 バイトに満たない残りは 1 バイトずつ */
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
 
-            /* “保険” の zombie 回収（WNOHANG）
-             * - waitpid(-1, ..., WNOHANG) は “終了している子がいれば1つ回収”
-             * - SIGCHLD ハンドラでも wait() しているので、設計としては
-             *   「どちらか一方に統一」する方が分かりやすいことが多い
-             */
-            if ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
-                (void) fprintf(stderr,
-                               "accept_loop:waitpid:pid=%d,status=%d\n",
-                               pid, status);
-
-                (void) fprintf(stderr,
-                               "  WIFEXITED:%d,WEXITSTATUS:%d,WIFSIGNALED:%d,"
-                               "WTERMSIG:%d,WIFSTOPPED:%d,WSTOPSIG:%d\n",
-                               WIFEXITED(status),
-                               WEXITSTATUS(status),
-                               WIFSIGNALED(status),
-                               WTERMSIG(status),
-                               WIFSTOPPED(status),
-                               WSTOPSIG(status));
+__attribute__((target("avx2")))
+size_t
+scan_eol_avx2(const char *buf, size_t len, size_t *off, size_t max)
+{
+    __m256i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
+
+    cr = _mm256_set1_epi8('\r');
+    lf = _mm256_set1_epi8('\n');
+    for (i = 0, n = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        mask = (unsigned int) _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
             }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
         }
     }
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
+#endif
+
+/* 使用する実装（scan_eol_init で決まる。スレッド生成前に 1 回だけ呼ぶこと） */
+size_t (*g_scan_eol)(const char *, size_t, size_t *, size_t) = scan_eol_scalar;
+const char *g_scan_eol_name = "scalar";
+
+void
+scan_eol_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_scan_eol = scan_eol_avx2;
+        g_scan_eol_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        g_scan_eol = scan_eol_sse2;
+        g_scan_eol_name = "sse2";
+    }
+#endif
 }
 
-/* サイズ指定文字列連結（strlcat 相当）
- * - dst のサイズ上限 size を超えないように連結する
+/* 応答の末尾に付ける文字列（行ごとに iovec で後ろに並べる。受信バッファに場所は取らない） */
+#define RESP_SUFFIX     ":OK\r\n"
+#define RESP_SUFFIX_LEN (sizeof(RESP_SUFFIX) - 1)
+
+/* 長さ付きバッファ（応答組み立て用）
+ *
+ * base[0 .. size) の中で、データは base[off .. off+len) にある。
+ *
+ *   base                off            off+len                 size
+ *    |<-- headroom -->|<---- data ---->|<---- tailroom ---->|
+ *
+ * mystrlcat + strlen との違い：
+ * - 長さを持っているので、連結のたびに NUL を探して先頭から数え直さない（O(1) で追記）
+ * - NUL 終端を必要としないので、recv したバイト列をそのまま扱える
+ * - 先頭側にも空き（headroom）を取れるので、ヘッダ等を後から前に付けられる
+ * - データ部をそのまま iovec にして writev に渡せる
  */
-size_t
-mystrlcat(char *dst, const char *src, size_t size)
+struct mbuf {
+    char *base;                         /* 領域の先頭 */
+    size_t size;                        /* 領域の大きさ */
+    size_t off;                         /* データの開始位置 */
+    size_t len;                         /* データ長 */
+};
+
+#define MBUF_DATA(m_)     ((m_)->base + (m_)->off)
+#define MBUF_TAIL(m_)     ((m_)->base + (m_)->off + (m_)->len)
+#define MBUF_HEADROOM(m_) ((m_)->off)
+#define MBUF_TAILROOM(m_) ((m_)->size - (m_)->off - (m_)->len)
+
+/* 領域 base[0..size) を、先頭に headroom バイト空けた空のバッファとして使い始める */
+void
+mbuf_init(struct mbuf *m, char *base, size_t size, size_t headroom)
 {
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
+    m->base = base;
+    m->size = size;
+    m->off = headroom < size ? headroom : size;
+    m->len = 0;
+}
 
-    for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--)
-        ;
-    dlen = pd - dst;
+/* 末尾に n バイト追記する（tailroom が足りなければ何もせず -1） */
+int
+mbuf_append(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_TAILROOM(m)) {
+        return (-1);
+    }
+    (void) memcpy(MBUF_TAIL(m), src, n);
+    m->len += n;
+    return (0);
+}
 
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
+/* 先頭に n バイト付け足す（headroom が足りなければ何もせず -1） */
+int
+mbuf_prepend(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_HEADROOM(m)) {
+        return (-1);
     }
+    m->off -= n;
+    m->len += n;
+    (void) memcpy(MBUF_DATA(m), src, n);
+    return (0);
+}
 
-    pde = dst + size - 1;
-    for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
+/* データ部を iovec に変換する（戻り値は writev に渡す要素数） */
+int
+mbuf_iov(const struct mbuf *m, struct iovec *iov)
+{
+    if (m->len == 0) {
+        return (0);
     }
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
+    iov[0].iov_base = MBUF_DATA(m);
+    iov[0].iov_len = m->len;
+    return (1);
+}
+
+/* 行ごとの応答（続けて届いた要求の切り出し）
+ *
+ * 1 回の recv には、クライアントが続けて送った複数の要求（行）が入っていることがある。
+ * g_scan_eol で区切りの位置をまとめて求め、1 行ごとに「行 + RESP_SUFFIX」の応答を 1 つずつ返す。
+ * - 区切りは CR / LF / CRLF（CR の直後の LF は同じ区切りとして読み飛ばす）
+ * - 改行で終わらない末尾は 1 行とする（呼び出し側はふつう line_end までしか渡さず、
+ *   行の途中は次の recv まで持ち越す。EOF のときと、改行の無いまま受信バッファが一杯に
+ *   なったときだけ末尾まで渡す）
+ * - 応答は受信バッファ内の行と RESP_SUFFIX を交互に並べた iovec にする（行をコピーしない）
+ *
+ * p[*pos..len) から最大 LINE_BATCH 行を iov[]（2 * LINE_BATCH 個）に並べて *pos を進め、
+ * 並べた応答の合計バイト数を *bytes に入れる。
+ * 戻り値：並べた iovec の数（行数の 2 倍。0 = もう行が無い）
+ */
+#define LINE_BATCH  (64)
+
+int
+frame_lines(const char *p, size_t len, size_t *pos, struct iovec *iov, size_t *bytes)
+{
+    size_t off[LINE_BATCH], base, start, e, n, k;
+    int cnt;
+
+    start = *pos;
+    /* 前の呼び出しが CR で終わっていれば、続く LF は同じ区切り */
+    if (start > 0 && start < len && p[start - 1] == '\r' && p[start] == '\n') {
+        start++;
+    }
+    cnt = 0;
+    *bytes = 0;
+    if (start >= len) {
+        *pos = len;
+        return (0);
+    }
+    base = start;
+    n = g_scan_eol(p + base, len - base, off, LINE_BATCH);
+    for (k = 0; k <= n; k++) {
+        if (k < n) {
+            e = base + off[k];
+            if (e == start && e > base && p[e] == '\n' && p[e - 1] == '\r') {
+                /* CRLF の LF */
+                start = e + 1;
+                continue;
+            }
+        } else if (n < LINE_BATCH && start < len) {
+            /* 改行で終わらない末尾 */
+            e = len;
+        } else {
+            break;
+        }
+        iov[cnt].iov_base = (char *) p + start;
+        iov[cnt].iov_len = e - start;
+        iov[cnt + 1].iov_base = RESP_SUFFIX;
+        iov[cnt + 1].iov_len = RESP_SUFFIX_LEN;
+        *bytes += e - start + RESP_SUFFIX_LEN;
+        cnt += 2;
+        start = e < len ? e + 1 : len;
     }
+    *pos = start;
+    return (cnt);
+}
 
-    while (*ps++)
-        ;
-    return (dlen + (ps - src - 1));
+/* p[0..len) の最後の区切り（CR / LF）の直後の位置（区切りが無ければ 0）
+ *
+ * recv の区切りは行の区切りと一致しないので、ここより後ろ（まだ改行の届いていない行の途中）は
+ * 応答せずに次の recv まで持ち越す
+ */
+size_t
+line_end(const char *p, size_t len)
+{
+    while (len > 0 && p[len - 1] != '\n' && p[len - 1] != '\r') {
+        len--;
+    }
+    return (len);
 }
 
 /* 送受信ループ（子プロセスが接続1本に対して回し続ける）
@@ -267,106 +1513,111 @@ mystrlcat(char *dst, const char *src, size_t size)
  * アルゴリズム：
  * - recv で受信
  *   - len==0 なら相手が close（EOF）
- * - ":OK\r\n" を付けて send
+ * - 行ごとに ":OK\r\n" を付けて送る（行の途中は次の recv まで持ち越す）
  *
  * ログに getpid() を入れているのが学習上ポイント：
  * - “接続ごとに別PIDで動いている” ことが可視化できる
  *
- * 注意：
- * - buf[len] = '\0' は len==sizeof(buf) のとき境界外になり得る
- *   → 教材としては recv を sizeof(buf)-1 にするのが安全
+ * 受信 / 送信バイト数と応答した行の数は、親と共有している自分の枠（g_self）に足す
  */
 void
 send_recv_loop(int acc)
 {
-    char buf[512], *ptr;
+    char buf[512];
+    struct mbuf m;
+    struct iovec iov[2 * LINE_BATCH];
+    size_t pos, end, total;
     ssize_t len;
+    int n, k, cr;
 
+    /* 受信バッファを空にする（行の途中は先頭に詰めて次の recv まで持ち越す） */
+    mbuf_init(&m, buf, sizeof(buf), 0);
+    cr = 0;
     for (;;) {
         /* 受信 */
-        if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
+        if ((len = recv(acc, MBUF_TAIL(&m),
+                        MBUF_TAILROOM(&m), 0)) == -1) {
             perror("recv");
             break;
         }
+        if (g_self != NULL) {
+            (void) __atomic_fetch_add(&g_self->rx, (unsigned long long) len, __ATOMIC_RELAXED);
+        }
         if (len == 0) {
             (void) fprintf(stderr, "<%d>recv:EOF\n", getpid());
-            break;
+            /* 改行の届かなかった最後の行にも応答する */
+            end = m.len;
+        } else {
+            m.len += (size_t) len;
+            tune_accepted(acc);     /* latency：TCP_QUICKACK を付け直す */
+            /* 最後の区切りまでに応答し、後ろは持ち越す（改行の無いまま一杯なら全部を 1 行とする） */
+            if ((end = line_end(MBUF_DATA(&m), m.len)) == 0 && MBUF_TAILROOM(&m) == 0) {
+                end = m.len;
+            }
         }
 
-        /* 文字列化（終端付与） */
-        buf[len] = '\0';
-
-        /* 改行除去してログを整形 */
-        if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-            *ptr = '\0';
+        /* 1 行ごとに応答する（続けて届いた要求にもそれぞれ返す）
+         * 前の recv が CR で終わっていれば、続く LF は同じ区切りなので読み飛ばす */
+        pos = cr && end > 0 && MBUF_DATA(&m)[0] == '\n' ? 1 : 0;
+        cr = end == m.len && end > 0 && MBUF_DATA(&m)[end - 1] == '\r';
+        while ((n = frame_lines(MBUF_DATA(&m), end, &pos, iov, &total)) > 0) {
+            for (k = 0; k < n; k += 2) {
+                (void) fprintf(stderr, "<%d>[client]%.*s\n", getpid(),
+                               (int) iov[k].iov_len, (char *) iov[k].iov_base);
+            }
+            if (writev(acc, iov, n) == -1) {
+                perror("writev");
+                break;
+            }
+            if (g_self != NULL) {
+                (void) __atomic_fetch_add(&g_self->nreq, (unsigned long) n / 2, __ATOMIC_RELAXED);
+                (void) __atomic_fetch_add(&g_self->tx, (unsigned long long) total,
+                                          __ATOMIC_RELAXED);
+            }
         }
-        (void) fprintf(stderr, "<%d>[client]%s\n", getpid(), buf);
-
-        /* 応答作成 */
-        (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-        len = (ssize_t) strlen(buf);
-
-        /* 応答送信 */
-        if ((len = send(acc, buf, (size_t) len, 0)) == -1) {
-            perror("send");
+        if (n > 0 || len == 0) {
+            /* 応答を送れなかった / EOF */
             break;
         }
-    }
-}
-
-/* 子プロセス終了（SIGCHLD）ハンドラ
- *
- * 目的：
- * - 子プロセスが終了したときに wait() して回収し、zombie を防ぐ
- *
- * 重要ポイント：
- * - SIGCHLD は “複数の子が同時に終わる” と 1回の通知でまとめて来ることがある
- *   → 実運用では waitpid(-1, &status, WNOHANG) をループして “回収し尽くす” のが定石
- *
- * このコードは wait(&status) を 1回だけ呼ぶため、
- * 短時間に子が複数終了すると回収漏れが起き、zombie が残る可能性がある。
- * （ただし accept_loop 側の waitpid(WNOHANG) が保険になっている設計）
- */
-void
-sig_chld_handler(int sig)
-{
-    int status;
-    pid_t pid;
-
-    /* wait：終了した子を1つ回収（ブロックする可能性がある）
-     * - SIGCHLD ハンドラ内でのブロックは設計として注意が必要
-     * - 教材として “終了回収が必要” を示す意図が強い実装
-     */
-    pid = wait(&status);
 
-    (void) fprintf(stderr, "sig_chld_handler:wait:pid=%d,status=%d\n", pid, status);
-    (void) fprintf(stderr,
-                   "  WIFEXITED:%d,WEXITSTATUS:%d,WIFSIGNALED:%d,"
-                   "WTERMSIG:%d,WIFSTOPPED:%d,WSTOPSIG:%d\n",
-                   WIFEXITED(status),
-                   WEXITSTATUS(status),
-                   WIFSIGNALED(status),
-                   WTERMSIG(status),
-                   WIFSTOPPED(status),
-                   WSTOPSIG(status));
+        /* 行の途中を先頭に詰める */
+        m.len -= end;
+        (void) memmove(MBUF_DATA(&m), MBUF_DATA(&m) + end, m.len);
+    }
 }
 
 int
 main(int argc, char *argv[])
 {
+    static const int sigs[] = { SIGCHLD, SIGHUP, SIGTERM, SIGINT };
+    struct pollfd pfd[1 + ADMIN_NPFD];
+    char *p;
     int soc;
 
     /* 引数チェック */
     if (argc <= 1) {
-        (void) fprintf(stderr, "server5 port\n");
+        (void) fprintf(stderr, "server5 port [latency|throughput|churn|none]\n");
         return (EX_USAGE);
     }
+    profile_arg(&argc, argv);
+
+    /* 環境変数 SERVER_VERBOSE：accept ごとに接続元を表示する */
+    if ((p = getenv("SERVER_VERBOSE")) != NULL && atoi(p) > 0) {
+        g_verbose = 1;
+    }
 
-    /* 子プロセス終了シグナル（SIGCHLD）のハンドラ登録
-     * - 子が終了するたびに SIGCHLD が親に届く
-     * - ハンドラで wait して回収し、zombie を防ぐ
+    /* シグナルを FD で受け取る
+     * - 子が終了するたびに SIGCHLD が親に届く → accept_loop が回収し、zombie を防ぐ
      */
-    (void) signal(SIGCHLD, sig_chld_handler);
+    if (sig_fd_init(sigs, (int) (sizeof(sigs) / sizeof(sigs[0]))) == -1) {
+        return (EX_OSERR);
+    }
+    (void) fprintf(stderr, "signal fd=%d (%s)\n", g_sig_fd,
+                   g_sig_pipe[0] == -1 ? "signalfd" : "self-pipe");
+
+    /* 行区切り検索の実装を CPU に合わせて選ぶ（スレッド/子プロセス生成前に 1 回だけ） */
+    scan_eol_init();
+    (void) fprintf(stderr, "scan_eol=%s\n", g_scan_eol_name);
 
     /* listen ソケット作成 */
     if ((soc = server_socket(argv[1])) == -1) {
@@ -374,24 +1625,49 @@ main(int argc, char *argv[])
         return (EX_UNAVAILABLE);
     }
 
+    /* 子ごとの統計の表と、管理用ソケット（管理用ソケットは無くてもサーバは動く） */
+    if (child_init() == -1) {
+        (void) close(soc);
+        return (EX_OSERR);
+    }
+    (void) admin_socket(argv[1]);
+
     (void) fprintf(stderr, "ready for accept\n");
 
-    /* accept + fork のメインループ */
+    /* accept + fork のメインループ（SIGTERM / SIGINT で戻る） */
     accept_loop(soc);
 
-    /* 形式上（通常ここには戻らない） */
+    /* drain：新しい接続を受けないように listen ソケットを閉じ、処理中の子が終わるのを待つ
+     * - 子の終了は SIGCHLD のイベント（sig_dispatch → reap_children）で数える
+     * - poll の 1 秒タイムアウトで途中経過と期限を見る
+     * - 管理用ソケットは drain 中も受け付ける（g_stop が 0 なら管理用ソケットの drain）
+     */
     (void) close(soc);
+    drain_begin(g_stop, g_nchild);
+    pfd[0].fd = g_sig_fd;
+    pfd[0].events = POLLIN;
+    while (!drain_check(g_nchild)) {
+        admin_pollfd(&pfd[1]);
+        if (poll(pfd, 1 + ADMIN_NPFD, 1000) > 0) {
+            if (pfd[0].revents & POLLIN) {
+                sig_dispatch();
+            }
+            admin_dispatch(&pfd[1]);
+        }
+    }
+    admin_shutdown();
+    (void) fprintf(stderr, "stopped:children=%d\n", g_nchild);
     return (EX_OK);
 }
 
 /*
  * 学習の次の一歩（fork サーバの改善アイデア）
  *
- * 1) SIGCHLD ハンドラを “waitpid(-1, &status, WNOHANG) ループ” にする
+ * 1) SIGCHLD を “waitpid(-1, &status, WNOHANG) ループ” で回収する（対応済み：reap_children）
  *    - まとめて複数終了しても確実に回収できる
  *
- * 2) accept_loop 内の waitpid(WNOHANG) と “二重回収” にならないよう整理する
- *    - ハンドラ側だけ、またはループ側だけ、どちらかに寄せると設計が明確
+ * 2) “二重回収” にならないよう整理する（対応済み）
+ *    - 回収は signalfd のイベントからの reap_children だけに寄せた
  *
  * 3) さらにスケールさせたいなら：
  *    - fork ではなく thread 版（pthread）や
@@ -1,22 +1,45 @@
+#define _GNU_SOURCE                     /* accept4() */
+
+#include <sys/epoll.h>                  /* epoll（coro モードのスケジューラ） */
+#include <sys/mman.h>                   /* mmap, mprotect（cached モードのスタック） */
+#include <sys/ioctl.h>                  /* ioctl(FIONREAD)（受信バッファの大きさ合わせ） */
 #include <sys/param.h>
+#include <sys/resource.h>               /* getrlimit, setpriority */
+#include <sys/signalfd.h>               /* signalfd（SIGTERM を FD で受け取る） */
 #include <sys/socket.h>
+#include <sys/stat.h>                   /* chmod（管理用ソケット） */
+#include <sys/syscall.h>                /* SYS_gettid */
+#include <sys/time.h>                   /* struct timeval（SO_RCVTIMEO） */
 #include <sys/types.h>
+#include <sys/uio.h>                    /* writev, struct iovec */
+#include <sys/un.h>                     /* struct sockaddr_un（管理用ソケット） */
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>                /* TCP_NODELAY / TCP_QUICKACK など（プロファイル） */
 #include <netdb.h>
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>                      /* fcntl, O_NONBLOCK */
+#include <poll.h>
 #include <pthread.h>                    /* 追加：POSIXスレッド(pthread)を使うため */
 #include <signal.h>
+#include <stdarg.h>                     /* va_list（admin_printf） */
+#include <stdatomic.h>                  /* 処理中の接続数（drain） */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>                       /* clock_gettime */
+#include <ucontext.h>                   /* getcontext, makecontext, swapcontext */
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>                  /* SSE2 / AVX2 組み込み関数（scan_eol） */
+#endif
+
 /*
  * このプログラム（server6）の狙い：
  * - TCPサーバを立て、accept() で接続を受けたら
@@ -39,7 +62,201 @@
  * - スレッドは同一プロセスのメモリ空間を共有するため、共有データがある場合は排他制御が必要。
  *   このサンプルでは各スレッドが持つのは acc（接続FD）とローカルバッファ程度なので、
  *   競合が起こりにくい構成になっている。
+ *
+ * 動作モード（第2引数）：
+ *   server6 port [thread|pool [workers [queue_limit]]]
+ * - thread : 上記のとおり接続ごとに pthread_create する（元の動作）
+ * - pool   : 起動時に workers 本のワーカースレッドを作っておき（既定は CPU コア数 × POOL_PER_CPU）、
+ *            accept した接続 FD をキューに積んでワーカーに渡す（既定のモード）
+ *   - 接続ごとのスレッド生成コスト（と 1 スレッドあたり数 MB のスタック予約）が無くなる
+ *   - スレッド数に上限が付く。キューが queue_limit 件で満杯なら、その接続はすぐに close する（fast reject）
+ *   server6 port cached [stack_kb [prealloc]]
+ * - cached : 接続ごとに 1 スレッドだが、スタックは stack_kb（既定 64KB、ガードページ付き）で
+ *            キャッシュから使い回し、接続が終わったスレッドは次の接続に再利用する
+ *            （prealloc 本分のスタックは起動時に確保しておく）
+ *   server6 port coro [schedulers [stack_kb]]
+ * - coro   : 接続ごとにコルーチン（ユーザ空間スレッド、既定 64KB スタック）を作り、
+ *            schedulers 本（既定は CPU コア数）の OS スレッド上の epoll スケジューラで動かす
+ *            （send_recv_loop は同じブロッキングの書き方のまま）
+ *
+ * 停止（どのモードでも）：
+ * - SIGTERM / SIGINT で drain に入る：listen ソケットを閉じ、処理中の接続が
+ *   すべて終わる（g_active が 0 になる）か DRAIN_TIMEOUT 秒が過ぎたら終了する
+ *
+ * 管理用ソケット（どのモードでも）：
+ * - /tmp/server6.<port>.admin に stats / conns / set / drain を送ると、接続の状態を返す /
+ *   値を変える / drain を始める（後ろの「管理用ソケット」。adminctl で送れる）
+ */
+
+/* 動作モード */
+#define MODE_THREAD 0                   /* 接続ごとに 1 スレッド */
+#define MODE_POOL   1                   /* 固定数のワーカースレッド + 接続 FD キュー */
+#define MODE_CACHED 2                   /* 小さいスタックの接続ごとスレッド + スレッド再利用 */
+#define MODE_CORO   3                   /* コルーチン + epoll スケジューラ */
+int g_mode = MODE_POOL;
+
+/* ワーカー数の既定値（CPU コア数 × POOL_PER_CPU） */
+#define POOL_PER_CPU     (4)
+
+/* 接続 FD キューの上限の既定値 */
+#define POOL_QUEUE_LIMIT (1024)
+
+/* 接続 FD キュー（pool モード用のリングバッファ）
+ * - fd[]   : accept 済みでワーカー待ちの接続 FD（size = limit + 1 の循環配列）
+ * - front  : 次に取り出す位置（ワーカーが使う）
+ * - last   : 次に書き込む位置（accept 側が使う）
+ * - mutex  : front/last/fd へのアクセス保護
+ * - cond   : 「新しい接続が積まれた」ことをワーカーに通知するため
+ */
+struct fd_queue {
+    int *fd;
+    int size;
+    int front;
+    int last;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+struct fd_queue g_fdq;
+
+/* ワーカー数・キュー上限（main で決まる。キュー上限は管理用ソケットの set で下げ / 戻せる） */
+int g_workers;
+atomic_int g_queue_limit = POOL_QUEUE_LIMIT;
+
+/* キュー満杯で捨てた接続数（accept ループが足し、管理スレッドが読む） */
+atomic_long g_rejected;
+
+/* 処理中の接続数（drain で 0 になるのを待つ）
+ * - 接続をスレッド / キュー / コルーチンに渡すときに +1
+ * - その接続を close したスレッド / コルーチンが -1
+ */
+atomic_int g_active;
+
+/* accept ごとに接続元を表示するなら 1（既定 0）
+ * - 接続の多いときは表示そのものが重いので、普段は出さない
+ * - 起動時に環境変数 SERVER_VERBOSE が 1 以上なら立てる（管理用ソケットの set でも変わる）
+ */
+atomic_int g_verbose;
+
+/* 接続単位の TCP チューニング（プロファイル）
+ *
+ * 起動引数で 1 つ選ぶ（server6 port [latency|throughput|churn|none] ...、既定は none = SO_REUSEADDR のみ）。
+ * ポート番号の次に書き、省略できる（profile_arg）。
+ *
+ * - latency    : TCP_NODELAY（Nagle を切って小さな応答をすぐ出す）
+ *                TCP_QUICKACK（遅延 ACK をやめる。カーネルが自動で戻すので受信のたびに付け直す）
+ *                TCP_NOTSENT_LOWAT を小さく（未送信データを溜め込まず、書ける通知を早く返す）
+ * - throughput : SO_SNDBUF / SO_RCVBUF を大きく（ウィンドウを広げて 1 回あたりの転送量を増やす）
+ *                応答を複数回の write で組み立てるときは TCP_CORK で 1 セグメントにまとめる
+ *                （このサーバは行ごとの応答を 1 回の writev にしているので CORK は要らない）
+ * - churn      : TCP_DEFER_ACCEPT（最初のデータが届くまで accept を起こさない）
+ *                TCP_FASTOPEN（SYN に載ったデータを受け付ける。sysctl net.ipv4.tcp_fastopen の
+ *                2 のビットが立っていないと効かない）
+ *                listen のバックログを大きく（実際は net.core.somaxconn で頭打ち）
+ *
+ * - listen ソケットに付けた TCP_NODELAY / TCP_NOTSENT_LOWAT / SO_SNDBUF / SO_RCVBUF は
+ *   accept した接続に引き継がれる（Linux）。引き継がれない TCP_QUICKACK だけ tune_accepted で付ける
+ * - SO_RCVBUF はウィンドウスケールが決まる SYN より前（listen の前）に付ける必要がある
+ * - 効果の比較は tune-bench（ループバックで応答遅延・転送速度・接続の回転を計る）
  */
+#define PROFILE_NONE        (0)
+#define PROFILE_LATENCY     (1)
+#define PROFILE_THROUGHPUT  (2)
+#define PROFILE_CHURN       (3)
+
+const char *g_profile_name[] = { "none", "latency", "throughput", "churn" };
+
+int g_profile = PROFILE_NONE;
+
+#define TUNE_NOTSENT_LOWAT  (16 * 1024)         /* latency：未送信データの上限 */
+#define TUNE_BUFSZ          (4 * 1024 * 1024)   /* throughput：送受信バッファ（wmem_max / rmem_max で頭打ち） */
+#define TUNE_DEFER_ACCEPT   (1)                 /* churn：データを待つ秒数 */
+#define TUNE_FASTOPEN_QLEN  (256)               /* churn：TFO の保留キュー */
+#define TUNE_BACKLOG        (65535)             /* churn：listen のバックログ */
+
+/* プロファイル名 → 番号（知らない名前なら -1） */
+int
+profile_lookup(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(g_profile_name) / sizeof(g_profile_name[0])); i++) {
+        if (strcmp(name, g_profile_name[i]) == 0) {
+            return (i);
+        }
+    }
+    return (-1);
+}
+
+/* 引数のポート番号の次がプロファイル名なら取り出し、後ろの引数を 1 つ前に詰める
+ * （省略できる。詰めるので、後ろの引数はプロファイルを書かないときと同じ位置で読める） */
+void
+profile_arg(int *argc, char *argv[])
+{
+    int i;
+
+    if (*argc > 2 && profile_lookup(argv[2]) != -1) {
+        g_profile = profile_lookup(argv[2]);
+        for (i = 2; i < *argc - 1; i++) {
+            argv[i] = argv[i + 1];
+        }
+        argv[--*argc] = NULL;
+    }
+    (void) fprintf(stderr, "profile=%s\n", g_profile_name[g_profile]);
+}
+
+/* listen ソケットにプロファイルを付ける（bind / listen の前に呼ぶ。失敗は表示して続行） */
+void
+tune_listen(int soc)
+{
+    int opt;
+
+    switch (g_profile) {
+    case PROFILE_LATENCY:
+        opt = 1;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_NODELAY)");
+        }
+        opt = TUNE_NOTSENT_LOWAT;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_NOTSENT_LOWAT)");
+        }
+        break;
+    case PROFILE_THROUGHPUT:
+        opt = TUNE_BUFSZ;
+        if (setsockopt(soc, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(SO_SNDBUF)");
+        }
+        if (setsockopt(soc, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(SO_RCVBUF)");
+        }
+        break;
+    case PROFILE_CHURN:
+        opt = TUNE_DEFER_ACCEPT;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_DEFER_ACCEPT)");
+        }
+        opt = TUNE_FASTOPEN_QLEN;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_FASTOPEN, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_FASTOPEN)");
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* accept した接続 / 受信した直後の接続に、引き継がれない分を付ける */
+void
+tune_accepted(int acc)
+{
+    int opt;
+
+    if (g_profile == PROFILE_LATENCY) {
+        opt = 1;
+        (void) setsockopt(acc, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt));
+    }
+}
 
 /* サーバソケットの準備 */
 int
@@ -106,6 +323,9 @@ server_socket(const char *portnm)
         return (-1);
     }
 
+    /* プロファイルの TCP オプション（バッファの大きさは SYN より前に決めておく） */
+    tune_listen(soc);
+
     /*
      * bind()：ソケットに「待受アドレス・ポート」を関連付ける。
      * これによりこのポートで接続を受けられるようになる。
@@ -119,9 +339,9 @@ server_socket(const char *portnm)
 
     /*
      * listen()：受動オープン（待受状態）へ移行。
-     * SOMAXCONN はOSが許す最大バックログ数を指定する。
+     * SOMAXCONN はOSが許す最大バックログ数を指定する（churn はもっと大きく頼む）。
      */
-    if (listen(soc, SOMAXCONN) == -1) {
+    if (listen(soc, g_profile == PROFILE_CHURN ? TUNE_BACKLOG : SOMAXCONN) == -1) {
         perror("listen");
         (void) close(soc);
         freeaddrinfo(res0);
@@ -132,6 +352,292 @@ server_socket(const char *portnm)
     return (soc);
 }
 
+/* 接続元アドレス文字列の最大長（"IPv6アドレス:ポート" + NUL） */
+#define PEER_STRLEN (INET6_ADDRSTRLEN + 8)
+
+/* 10 進数の書き出し（format_peer の下請け） */
+char *
+put_dec(char *p, unsigned int v)
+{
+    char tmp[10];
+    int n;
+
+    n = 0;
+    do {
+        tmp[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0) {
+        *p++ = tmp[--n];
+    }
+    return (p);
+}
+
+/* 接続元アドレスの文字列化（getnameinfo を使わない高速版）
+ *
+ * ss  : accept で得た生のアドレス（AF_INET / AF_INET6）
+ * buf : 出力先（PEER_STRLEN バイト以上）
+ *
+ * 出力形式は getnameinfo(NI_NUMERICHOST | NI_NUMERICSERV) の host と port を
+ * ':' でつないだもの（"127.0.0.1:50000"）と同じ。
+ *
+ * - getnameinfo は NSS/ロケールを経由し、内部でも書式化を行うので accept 毎に呼ぶと重い
+ * - ここでは 10 進/16 進の変換を手で書き、malloc も snprintf も使わない
+ * - IPv6 は RFC 5952 に従い、最長の 0 の連続（2 グループ以上）を "::" に縮める
+ *
+ * 戻り値：書き込んだ文字数（NUL を除く）
+ */
+size_t
+format_peer(const struct sockaddr_storage *ss, char *buf)
+{
+    static const char hex[] = "0123456789abcdef";
+    const struct sockaddr_in *sin;
+    const struct sockaddr_in6 *sin6;
+    const unsigned char *a;
+    unsigned int port, w;
+    int i, j, best, bestlen, shift;
+    char *p;
+
+    p = buf;
+    switch (ss->ss_family) {
+    case AF_INET:
+        sin = (const struct sockaddr_in *) ss;
+        a = (const unsigned char *) &sin->sin_addr;
+        for (i = 0; i < 4; i++) {
+            if (i > 0) {
+                *p++ = '.';
+            }
+            p = put_dec(p, a[i]);
+        }
+        port = ntohs(sin->sin_port);
+        break;
+
+    case AF_INET6:
+        sin6 = (const struct sockaddr_in6 *) ss;
+        a = sin6->sin6_addr.s6_addr;
+
+        /* 最長の 0 グループの連続を探す */
+        best = -1;
+        bestlen = 0;
+        for (i = 0; i < 8; i = j + 1) {
+            for (j = i; j < 8 && a[2 * j] == 0 && a[2 * j + 1] == 0; j++)
+                ;
+            if (j - i >= 2 && j - i > bestlen) {
+                best = i;
+                bestlen = j - i;
+            }
+        }
+
+        if (best == 0
+            && (bestlen == 6 || (bestlen == 5 && a[10] == 0xff && a[11] == 0xff))) {
+            /* IPv4 射影/互換アドレス（::ffff:a.b.c.d, ::a.b.c.d）は末尾 32bit を 10 進で書く
+             * （inet_ntop/getnameinfo と同じ判定） */
+            *p++ = ':';
+            *p++ = ':';
+            if (bestlen == 5) {
+                (void) memcpy(p, "ffff:", 5);
+                p += 5;
+            }
+            for (j = 12; j < 16; j++) {
+                if (j > 12) {
+                    *p++ = '.';
+                }
+                p = put_dec(p, a[j]);
+            }
+        } else {
+            for (i = 0; i < 8; i++) {
+                if (i == best) {
+                    *p++ = ':';
+                    *p++ = ':';
+                    i += bestlen - 1;
+                    continue;
+                }
+                if (i > 0 && i != best + bestlen) {
+                    *p++ = ':';
+                }
+                w = ((unsigned int) a[2 * i] << 8) | a[2 * i + 1];
+                for (shift = 12; shift > 0 && ((w >> shift) & 0xf) == 0; shift -= 4)
+                    ;
+                for (; shift >= 0; shift -= 4) {
+                    *p++ = hex[(w >> shift) & 0xf];
+                }
+            }
+        }
+        port = ntohs(sin6->sin6_port);
+        break;
+
+    default:
+        *p++ = '?';
+        port = 0;
+        break;
+    }
+
+    *p++ = ':';
+    p = put_dec(p, port);
+    *p = '\0';
+    return ((size_t) (p - buf));
+}
+
+/* シグナルを FD で受け取る（sig_fd_init）
+ *
+ * - g_sig_fd   : signalfd、または自己パイプの読み側（イベントループで待てる）
+ * - g_sig_pipe : 自己パイプ（signalfd が使えないときだけ使う）
+ * - g_sig_mask : sig_fd_init で扱うシグナルの集合
+ */
+int g_sig_fd = -1;
+int g_sig_pipe[2] = { -1, -1 };
+sigset_t g_sig_mask;
+
+/* 自己パイプ用のシグナルハンドラ（signalfd が使えないとき）
+ *
+ * シグナル番号を 1 バイト書くだけ（write は async-signal-safe）。
+ */
+void
+sig_pipe_handler(int sig)
+{
+    unsigned char c;
+    int save;
+
+    save = errno;
+    c = (unsigned char) sig;
+    (void) write(g_sig_pipe[1], &c, 1);
+    errno = save;
+}
+
+/* sigs[0..nsigs) を「読める FD」で受け取るようにする
+ *
+ * 戻り値: イベントループで待つ FD / -1（失敗）
+ *
+ * アルゴリズム：
+ * 1) 対象のシグナルをブロック（以後、非同期に割り込まれない）
+ * 2) signalfd を作る → 届いたシグナルは signalfd_siginfo として read できる
+ * 3) signalfd が無ければ自己パイプ：ハンドラ（SA_RESTART）が番号を 1 バイト書き、
+ *    ブロックを外す
+ */
+int
+sig_fd_init(const int *sigs, int nsigs)
+{
+    struct sigaction sa;
+    int i;
+
+    (void) sigemptyset(&g_sig_mask);
+    for (i = 0; i < nsigs; i++) {
+        (void) sigaddset(&g_sig_mask, sigs[i]);
+    }
+    (void) sigprocmask(SIG_BLOCK, &g_sig_mask, NULL);
+#ifdef __linux__
+    if ((g_sig_fd = signalfd(-1, &g_sig_mask, SFD_NONBLOCK | SFD_CLOEXEC)) != -1) {
+        return (g_sig_fd);
+    }
+    perror("signalfd");
+#endif
+    if (pipe(g_sig_pipe) == -1) {
+        perror("pipe");
+        (void) sigprocmask(SIG_UNBLOCK, &g_sig_mask, NULL);
+        return (-1);
+    }
+    for (i = 0; i < 2; i++) {
+        (void) fcntl(g_sig_pipe[i], F_SETFL, fcntl(g_sig_pipe[i], F_GETFL, 0) | O_NONBLOCK);
+        (void) fcntl(g_sig_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_pipe_handler;
+    (void) sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    for (i = 0; i < nsigs; i++) {
+        (void) sigaction(sigs[i], &sa, NULL);
+    }
+    g_sig_fd = g_sig_pipe[0];
+    (void) sigprocmask(SIG_UNBLOCK, &g_sig_mask, NULL);
+    return (g_sig_fd);
+}
+
+/* シグナル FD から 1 つ取り出す（戻り値：シグナル番号 / 0 = もう無い） */
+int
+sig_fd_read(void)
+{
+#ifdef __linux__
+    struct signalfd_siginfo si;
+#endif
+    unsigned char c;
+
+    if (g_sig_pipe[0] == -1) {
+#ifdef __linux__
+        if (read(g_sig_fd, &si, sizeof(si)) == (ssize_t) sizeof(si)) {
+            return ((int) si.ssi_signo);
+        }
+#endif
+        return (0);
+    }
+    if (read(g_sig_fd, &c, 1) == 1) {
+        return (c);
+    }
+    return (0);
+}
+
+/* グレースフル停止（drain）
+ *
+ * SIGTERM / SIGINT を受けたら即座に終わらず、次の順で止める：
+ * 1) listen ソケットを閉じて新しい接続を受けない（coro モードは coro_stop_listen で止める）
+ *    （ロードバランサやローリング再起動の相手は、ここで接続先を切り替える）
+ * 2) 既に受け付けた接続（pool のキューで待っている分も含む）はワーカー / コルーチンが
+ *    これまでどおり処理し、メインスレッドは g_active が 0 になるのを待つ
+ * 3) 接続が 0 になったら終了。g_drain_timeout 秒（既定 DRAIN_TIMEOUT、set drain_timeout）を
+ *    過ぎたら残りを閉じて終了する
+ *    （main から戻る = プロセス終了で、残っている接続 FD はまとめて閉じられる）
+ * - 途中経過（残り接続数と経過時間）を約 1 秒ごとに表示する
+ * - g_drain_start が 0 でなければ drain 中
+ */
+#define DRAIN_TIMEOUT   (30)
+
+atomic_int g_drain_timeout = DRAIN_TIMEOUT;
+double g_drain_start = 0.0;     /* drain を始めた時刻（CLOCK_MONOTONIC、0 = 通常運転） */
+double g_drain_report = 0.0;    /* 最後に途中経過を表示した時刻 */
+
+/* 単調増加時計の現在値（秒） */
+double
+now_sec(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec + (double) ts.tv_nsec / 1e9);
+}
+
+/* drain を始める（sig：受けたシグナル、nconn：その時点の接続数） */
+void
+drain_begin(int sig, int nconn)
+{
+    g_drain_start = g_drain_report = now_sec();
+    (void) fprintf(stderr, "drain:signal %d, stop accepting, conns=%d, timeout=%ds\n",
+                   sig, nconn, atomic_load(&g_drain_timeout));
+}
+
+/* drain を終えてよいか調べる（nconn：残っている接続数）
+ *
+ * 戻り値：1 = 終了してよい（接続 0、または期限切れ） / 0 = まだ待つ
+ */
+int
+drain_check(int nconn)
+{
+    double now;
+
+    now = now_sec();
+    if (nconn == 0) {
+        (void) fprintf(stderr, "drain:done in %.1fs\n", now - g_drain_start);
+        return (1);
+    }
+    if (now - g_drain_start >= atomic_load(&g_drain_timeout)) {
+        (void) fprintf(stderr, "drain:deadline, closing %d conns\n", nconn);
+        return (1);
+    }
+    if (now - g_drain_report >= 1.0) {
+        g_drain_report = now;
+        (void) fprintf(stderr, "drain:conns=%d elapsed=%.1fs\n", nconn, now - g_drain_start);
+    }
+    return (0);
+}
+
 /*
  * accept ループ（メインスレッド側の役割）
  *
@@ -139,6 +645,8 @@ server_socket(const char *portnm)
  * - soc（listen FD）で accept() を繰り返し、接続FD acc を得る
  * - 接続ごとに pthread_create() でワーカースレッドを作成し、acc を渡す
  * - 以降の送受信はワーカースレッドに任せ、自分は accept に戻る
+ * - listen ソケットとシグナル FD を poll で待ち、SIGTERM / SIGINT が来たら
+ *   drain_begin して listen ソケットを閉じ、戻る（残りの待ち合わせは main の drain_wait）
  *
  * マルチスレッド多重化のポイント：
  * - 「同時接続数 ≒ スレッド数」になりやすい（接続ごとにスレッドを作るため）
@@ -148,9 +656,10 @@ server_socket(const char *portnm)
 void
 accept_loop(int soc)
 {
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+    char pbuf[PEER_STRLEN];
     struct sockaddr_storage from;
-    int acc;
+    struct pollfd pfd[2];
+    int acc, sig;
     socklen_t len;
 
     /*
@@ -165,8 +674,30 @@ accept_loop(int soc)
      * 本来はファイル先頭にプロトタイプ宣言しておく方が読みやすい。
      */
     void *send_recv_thread(void *arg);
+    int pool_push(int acc);
+    int cached_dispatch(int acc);
 
+    pfd[0].fd = soc;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = g_sig_fd;
+    pfd[1].events = POLLIN;
     for (;;) {
+        if (poll(pfd, 2, -1) == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+            }
+            continue;
+        }
+        if (pfd[1].revents & POLLIN) {
+            if ((sig = sig_fd_read()) != 0) {
+                drain_begin(sig, atomic_load(&g_active));
+                (void) close(soc);
+                return;
+            }
+        }
+        if ((pfd[0].revents & POLLIN) == 0) {
+            continue;
+        }
         len = (socklen_t) sizeof(from);
 
         /*
@@ -180,14 +711,41 @@ accept_loop(int soc)
             }
         } else {
             /*
-             * 接続元（クライアント）の IP/port をログに出す。
-             * これにより接続が来たこと、どこから来たかが分かる。
+             * 接続元（クライアント）の IP/port は verbose のときだけログに出す。
+             * 文字列化も表示も accept のたびに払うには重い。
              */
-            (void) getnameinfo((struct sockaddr *) &from, len,
-                               hbuf, sizeof(hbuf),
-                               sbuf, sizeof(sbuf),
-                               NI_NUMERICHOST | NI_NUMERICSERV);
-            (void) fprintf(stderr, "accept:%s:%s\n", hbuf, sbuf);
+            if (g_verbose) {
+                (void) format_peer(&from, pbuf);
+                (void) fprintf(stderr, "accept:%s\n", pbuf);
+            }
+
+            if (g_mode == MODE_POOL) {
+                /*
+                 * pool モード：スレッドは作らず、キューに積んでワーカーに任せる。
+                 * キューが満杯なら待たせずにすぐ切断する（fast reject）。
+                 * 待たせても処理されるまでの時間が延びるだけで、クライアントにとっては
+                 * すぐ失敗が分かる方が再試行しやすい。
+                 */
+                atomic_fetch_add(&g_active, 1);
+                if (pool_push(acc) == -1) {
+                    atomic_fetch_sub(&g_active, 1);
+                    g_rejected++;
+                    (void) format_peer(&from, pbuf);    /* verbose でなければまだ文字列化していない */
+                    (void) fprintf(stderr, "reject:%s:queue full(rejected=%ld)\n",
+                                   pbuf, g_rejected);
+                    (void) close(acc);
+                }
+                continue;
+            }
+            if (g_mode == MODE_CACHED) {
+                /* cached モード：待機中のスレッドへ渡す（居なければ小さいスタックで作る） */
+                atomic_fetch_add(&g_active, 1);
+                if (cached_dispatch(acc) == -1) {
+                    atomic_fetch_sub(&g_active, 1);
+                    (void) close(acc);
+                }
+                continue;
+            }
 
             /*
              * スレッド生成：
@@ -201,9 +759,11 @@ accept_loop(int soc)
              *    教材としては malloc で int を確保してポインタで渡すか、
              *    intptr_t を使うのが安全。
              */
+            atomic_fetch_add(&g_active, 1);
             if (pthread_create(&thread_id, NULL, send_recv_thread, (void *) acc)
                 != 0) {
                 perror("pthread_create");
+                atomic_fetch_sub(&g_active, 1);
                 /*
                  * スレッド生成に失敗した場合、acc を誰も処理しないので close すべき。
                  * （現コードだと close が無いので FD リークの可能性がある点に注意）
@@ -230,128 +790,664 @@ accept_loop(int soc)
     }
 }
 
-/* サイズ指定文字列連結（strlcat 互換の自作） */
+/* 行区切り（CR/LF）の一括検索
+ *
+ * buf[0..len) に含まれる '\r' / '\n' の位置（先頭からのオフセット）を
+ * 出現順に off[] へ最大 max 個書き込み、書き込んだ個数を返す。
+ *
+ * strpbrk(buf, "\r\n") との違い：
+ * - NUL 終端を必要としない（recv で得た len をそのまま渡せる）
+ * - 1 回の走査ですべての区切り位置が得られる（行の切り出しを上位で行える）
+ * - x86 では 16/32 バイト単位で比較する SIMD 版を使う
+ *
+ * 実装は 3 種類あり、scan_eol_init() で CPU を見て g_scan_eol に設定する：
+ * - scan_eol_scalar : 1 バイトずつ（どの CPU でも動く）
+ * - scan_eol_sse2   : 16 バイトずつ比較 → movemask でビット列にして位置を取り出す
+ * - scan_eol_avx2   : 32 バイトずつ（AVX2 がある CPU のみ）
+ */
 size_t
-mystrlcat(char *dst, const char *src, size_t size)
+scan_eol_scalar(const char *buf, size_t len, size_t *off, size_t max)
 {
-    /*
-     * 目的：
-     * - dst の末尾に src を連結するが、バッファサイズ size を超えないようにする。
-     * - 戻り値は「連結しようとした結果の総長さ（dst初期長 + src長）」で、
-     *   size <= 戻り値 なら切り詰めが発生したと分かる、という strlcat の流儀。
-     */
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
-
-    /* dst の終端を探しつつ、残り容量（lest）を減らしていく */
-    for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--) ;
-    dlen = (size_t)(pd - dst);
+    size_t i, n;
 
-    /* dst が size いっぱいで終端が無い場合：何も足せない */
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
+    for (i = 0, n = 0; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
     }
+    return (n);
+}
 
-    /* pde は「最後に書ける位置」（終端 '\0' を置くため size-1） */
-    pde = dst + size - 1;
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+size_t
+scan_eol_sse2(const char *buf, size_t len, size_t *off, size_t max)
+{
+    __m128i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
 
-    /* src を可能な限りコピー */
-    for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
+    cr = _mm_set1_epi8('\r');
+    lf = _mm_set1_epi8('\n');
+    for (i = 0, n = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (buf + i));
+        mask = (unsigned int) _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        /* 立っているビット = 区切り文字の位置（下位ビットから順に取り出す） */
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
+            }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    /* 16 バイトに満たない残りは 1 バイトずつ */
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
     }
+    return (n);
+}
+
+__attribute__((target("avx2")))
+size_t
+scan_eol_avx2(const char *buf, size_t len, size_t *off, size_t max)
+{
+    __m256i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
 
-    /* 残りを '\0' で埋めて安全に終端 */
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
+    cr = _mm256_set1_epi8('\r');
+    lf = _mm256_set1_epi8('\n');
+    for (i = 0, n = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        mask = (unsigned int) _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
+            }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
     }
+    return (n);
+}
+#endif
+
+/* 使用する実装（scan_eol_init で決まる。スレッド生成前に 1 回だけ呼ぶこと） */
+size_t (*g_scan_eol)(const char *, size_t, size_t *, size_t) = scan_eol_scalar;
+const char *g_scan_eol_name = "scalar";
 
-    /* ps を src の終端まで進めて長さ計算（strlcat の返り値仕様） */
-    while (*ps++) ;
-    return (dlen + (size_t)(ps - src - 1));
+void
+scan_eol_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_scan_eol = scan_eol_avx2;
+        g_scan_eol_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        g_scan_eol = scan_eol_sse2;
+        g_scan_eol_name = "sse2";
+    }
+#endif
 }
 
-/*
- * 送受信スレッド（接続ごとに 1 スレッド起動される）
+/* 応答の末尾に付ける文字列（行ごとに iovec で後ろに並べる。受信バッファに場所は取らない） */
+#define RESP_SUFFIX     ":OK\r\n"
+#define RESP_SUFFIX_LEN (sizeof(RESP_SUFFIX) - 1)
+
+/* 長さ付きバッファ（応答組み立て用）
  *
- * 役割：
- * - arg で渡された acc（接続FD）を使い、recv→応答(send) を繰り返す
- * - 切断（len==0）またはエラーで終了し、close(acc) してスレッド終了
+ * base[0 .. size) の中で、データは base[off .. off+len) にある。
  *
- * スレッドにする利点（教材観点）：
- * - accept ループがブロックせず、複数接続を並列にさばける
- * - fork より軽いことが多い（プロセス生成よりスレッド生成が軽量）
+ *   base                off            off+len                 size
+ *    |<-- headroom -->|<---- data ---->|<---- tailroom ---->|
  *
- * 注意：
- * - 共有資源（共有バッファ、共有ログファイル、共有カウンタなど）を使うなら mutex が必要。
- * - ここでは標準エラー出力に複数スレッドが同時に書くため、ログが混ざる可能性はある。
+ * mystrlcat + strlen との違い：
+ * - 長さを持っているので、連結のたびに NUL を探して先頭から数え直さない（O(1) で追記）
+ * - NUL 終端を必要としないので、recv したバイト列をそのまま扱える
+ * - 先頭側にも空き（headroom）を取れるので、ヘッダ等を後から前に付けられる
+ * - データ部をそのまま iovec にして writev に渡せる
  */
-void *
-send_recv_thread(void *arg)
-{
-    char buf[512], *ptr;
-    ssize_t len;
-    int acc;
+struct mbuf {
+    char *base;                         /* 領域の先頭 */
+    size_t size;                        /* 領域の大きさ */
+    size_t off;                         /* データの開始位置 */
+    size_t len;                         /* データ長 */
+};
 
-    /*
-     * スレッドをデタッチ：
-     * - join しない（親が pthread_join で回収しない）設計にする。
-     * - デタッチされたスレッドは終了時に OS が自動的に資源を回収する。
-     *
-     * つまりこのサンプルでは「スレッドの生死管理を簡単にする」ため detach している。
-     */
-    (void) pthread_detach(pthread_self());
+#define MBUF_DATA(m_)     ((m_)->base + (m_)->off)
+#define MBUF_TAIL(m_)     ((m_)->base + (m_)->off + (m_)->len)
+#define MBUF_HEADROOM(m_) ((m_)->off)
+#define MBUF_TAILROOM(m_) ((m_)->size - (m_)->off - (m_)->len)
 
-    /*
-     * 引数の取得：
-     * - accept_loop から (void*)acc で渡されているので int に戻す。
-     * - 64bit 環境では危険になり得る（前述）。
-     */
-    acc = (int) arg;
+/* 領域 base[0..size) を、先頭に headroom バイト空けた空のバッファとして使い始める */
+void
+mbuf_init(struct mbuf *m, char *base, size_t size, size_t headroom)
+{
+    m->base = base;
+    m->size = size;
+    m->off = headroom < size ? headroom : size;
+    m->len = 0;
+}
 
-    for (;;) {
-        /* 受信：TCPなので「受けた分だけ」返る（メッセージ境界は保証されない） */
-        if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
-            perror("recv");
-            break;
-        }
-        if (len == 0) {
-            /* 相手が close した（EOF） */
-            (void) fprintf(stderr, "<%d>recv:EOF\n", (int) pthread_self());
-            break;
-        }
+/* 末尾に n バイト追記する（tailroom が足りなければ何もせず -1） */
+int
+mbuf_append(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_TAILROOM(m)) {
+        return (-1);
+    }
+    (void) memcpy(MBUF_TAIL(m), src, n);
+    m->len += n;
+    return (0);
+}
 
-        /*
-         * 文字列化：
-         * - recv は生バイト列を返すので '\0' は付かない
-         * - buf[len] = '\0' でC文字列化してログ出力しやすくする
-         *
-         * 注意：len が sizeof(buf) と同じ場合、buf[len] は範囲外になる。
-         * 安全にするなら recv のサイズを sizeof(buf)-1 にすべき。
-         */
-        buf[len] = '\0';
+/* 先頭に n バイト付け足す（headroom が足りなければ何もせず -1） */
+int
+mbuf_prepend(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_HEADROOM(m)) {
+        return (-1);
+    }
+    m->off -= n;
+    m->len += n;
+    (void) memcpy(MBUF_DATA(m), src, n);
+    return (0);
+}
 
-        /* CR/LF を見つけたらそこを終端にして1行として扱う */
-        if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-            *ptr = '\0';
-        }
+/* データ部を iovec に変換する（戻り値は writev に渡す要素数） */
+int
+mbuf_iov(const struct mbuf *m, struct iovec *iov)
+{
+    if (m->len == 0) {
+        return (0);
+    }
+    iov[0].iov_base = MBUF_DATA(m);
+    iov[0].iov_len = m->len;
+    return (1);
+}
 
-        /* スレッドID付きログ：どの接続がどのスレッドで処理されているか分かる */
-        (void) fprintf(stderr, "<%d>[client]%s\n", (int) pthread_self(), buf);
+/* 行ごとの応答（続けて届いた要求の切り出し）
+ *
+ * 1 回の recv には、クライアントが続けて送った複数の要求（行）が入っていることがある。
+ * g_scan_eol で区切りの位置をまとめて求め、1 行ごとに「行 + RESP_SUFFIX」の応答を 1 つずつ返す。
+ * - 区切りは CR / LF / CRLF（CR の直後の LF は同じ区切りとして読み飛ばす）
+ * - 改行で終わらない末尾は 1 行とする（呼び出し側はふつう line_end までしか渡さず、
+ *   行の途中は次の recv まで持ち越す。EOF のときと、改行の無いまま受信バッファが一杯に
+ *   なったときだけ末尾まで渡す）
+ * - 応答は受信バッファ内の行と RESP_SUFFIX を交互に並べた iovec にする（行をコピーしない）
+ *
+ * p[*pos..len) から最大 LINE_BATCH 行を iov[]（2 * LINE_BATCH 個）に並べて *pos を進め、
+ * 並べた応答の合計バイト数を *bytes に入れる。
+ * 戻り値：並べた iovec の数（行数の 2 倍。0 = もう行が無い）
+ */
+#define LINE_BATCH  (64)
 
-        /* 応答文字列作成：受信文字列に ":OK\r\n" を付ける */
-        (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-        len = (ssize_t) strlen(buf);
+int
+frame_lines(const char *p, size_t len, size_t *pos, struct iovec *iov, size_t *bytes)
+{
+    size_t off[LINE_BATCH], base, start, e, n, k;
+    int cnt;
 
-        /* 応答送信 */
-        if ((len = send(acc, buf, (size_t) len, 0)) == -1) {
-            perror("send");
+    start = *pos;
+    /* 前の呼び出しが CR で終わっていれば、続く LF は同じ区切り */
+    if (start > 0 && start < len && p[start - 1] == '\r' && p[start] == '\n') {
+        start++;
+    }
+    cnt = 0;
+    *bytes = 0;
+    if (start >= len) {
+        *pos = len;
+        return (0);
+    }
+    base = start;
+    n = g_scan_eol(p + base, len - base, off, LINE_BATCH);
+    for (k = 0; k <= n; k++) {
+        if (k < n) {
+            e = base + off[k];
+            if (e == start && e > base && p[e] == '\n' && p[e - 1] == '\r') {
+                /* CRLF の LF */
+                start = e + 1;
+                continue;
+            }
+        } else if (n < LINE_BATCH && start < len) {
+            /* 改行で終わらない末尾 */
+            e = len;
+        } else {
             break;
         }
+        iov[cnt].iov_base = (char *) p + start;
+        iov[cnt].iov_len = e - start;
+        iov[cnt + 1].iov_base = RESP_SUFFIX;
+        iov[cnt + 1].iov_len = RESP_SUFFIX_LEN;
+        *bytes += e - start + RESP_SUFFIX_LEN;
+        cnt += 2;
+        start = e < len ? e + 1 : len;
     }
+    *pos = start;
+    return (cnt);
+}
 
-    /* スレッドが責任を持って接続FDを閉じる（accept側では閉じない） */
+/* p[0..len) の最後の区切り（CR / LF）の直後の位置（区切りが無ければ 0）
+ *
+ * recv の区切りは行の区切りと一致しないので、ここより後ろ（まだ改行の届いていない行の途中）は
+ * 応答せずに次の recv まで持ち越す
+ */
+size_t
+line_end(const char *p, size_t len)
+{
+    while (len > 0 && p[len - 1] != '\n' && p[len - 1] != '\r') {
+        len--;
+    }
+    return (len);
+}
+
+/*
+ * coro モード：コルーチン（ユーザ空間スレッド）で send_recv_loop を動かす
+ *
+ * - send_recv_loop はブロッキング I/O の書き方のまま、recv/writev を co_recv/co_writev 経由で呼ぶ
+ * - コルーチンの中では接続 FD はノンブロッキングで、EAGAIN になったら
+ *   「この FD が読める/書けるようになったら再開して」と epoll に登録して
+ *   スケジューラ（coro_sched）に制御を返す（swapcontext）
+ * - スケジューラは epoll_wait で ready になった FD のコルーチンを再開するだけ
+ * - 1 本のスケジューラ（OS スレッド）の上で何千ものセッションが動く
+ * - コルーチンの外（thread/pool/cached モード）から呼ばれたときは普通の recv/writev になる
+ *
+ * コンテキスト切り替えは ucontext（getcontext/makecontext/swapcontext）を使う。
+ * swapcontext はシグナルマスクの保存/復元でシステムコールを 1 回呼ぶので、
+ * 専用のアセンブリ版より遅いが、移植性と読みやすさを優先している。
+ */
+struct coro {
+    ucontext_t ctx;                     /* このコルーチンのレジスタ・スタック */
+    char *stack;                        /* mmap した領域の先頭（ガードページを含む） */
+    size_t stack_len;
+    int acc;                            /* 担当する接続 */
+    int registered;                     /* acc を epoll に登録済みか */
+    int done;                           /* send_recv_loop が終わった */
+    struct coro *next;                  /* 空きリスト用 */
+};
+
+/* スケジューラごと（= OS スレッドごと）の状態 */
+__thread ucontext_t t_sched_ctx;        /* スケジューラ側のコンテキスト */
+__thread struct coro *t_co_current;     /* 実行中のコルーチン（NULL: コルーチン外） */
+__thread int t_epollfd = -1;
+
+/* FD が events（EPOLLIN/EPOLLOUT）になるまでコルーチンを止め、スケジューラへ戻る
+ *
+ * 戻り値：0 = 再開された / -1 = epoll に登録できなかった
+ */
+int
+co_wait_fd(int fd, unsigned int events)
+{
+    struct coro *co;
+    struct epoll_event ev;
+
+    co = t_co_current;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = co;
+    if (epoll_ctl(t_epollfd, co->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return (-1);
+    }
+    co->registered = 1;
+    (void) swapcontext(&co->ctx, &t_sched_ctx);
+    return (0);
+}
+
+/* recv の代わり（コルーチン内なら EAGAIN で待つ） */
+ssize_t
+co_recv(int fd, void *buf, size_t len, int flags)
+{
+    ssize_t ret;
+
+    for (;;) {
+        ret = recv(fd, buf, len, flags);
+        if (ret == -1 && t_co_current != NULL
+            && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (co_wait_fd(fd, EPOLLIN) == -1) {
+                return (-1);
+            }
+            continue;
+        }
+        return (ret);
+    }
+}
+
+/* writev の代わり（コルーチン内なら EAGAIN で待つ） */
+ssize_t
+co_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+
+    for (;;) {
+        ret = writev(fd, iov, iovcnt);
+        if (ret == -1 && t_co_current != NULL
+            && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (co_wait_fd(fd, EPOLLOUT) == -1) {
+                return (-1);
+            }
+            continue;
+        }
+        return (ret);
+    }
+}
+
+/* 接続の統計（管理用ソケットの stats / conns で表示する）
+ *
+ * - g_conn[]  : 処理中の接続ごとの状態（FD を添字にする。CONN_MAX 以上の FD は conns に出ない）
+ *   - 書くのはその接続を処理するスレッド（coro モードではコルーチン）だけ、読むのは管理スレッド
+ *     （カウンタは relaxed の atomic。他のスレッドとキャッシュラインを取り合わない）
+ *   - active は他の欄を書いてから立てる（release）。管理スレッドは active を見てから読む（acquire）
+ *   - 閉じた直後に同じ FD が再利用されると、conns の 1 行に新旧が混ざることはある（表示だけなので許す）
+ * - g_stats   : 閉じた接続の累計（conn_close で 1 回だけ足す。要求ごとには共有の変数に触らない）
+ *   stats の requests / rx / tx は、この累計に処理中の接続の分を足したもの
+ */
+#define CONN_MAX    (65536)
+
+struct conn {
+    atomic_int active;
+    double since;                       /* 接続した時刻（now_sec） */
+    struct sockaddr_storage addr;       /* 接続元 */
+    atomic_ulong nreq;                  /* 応答した行の数 */
+    atomic_ulong nrecv;                 /* recv を呼んだ回数 */
+    atomic_ullong rx, tx;               /* 受信 / 送信バイト数 */
+};
+
+struct stats {
+    double start;                       /* 起動した時刻（now_sec） */
+    atomic_ulong accepted, closed, requests;
+    atomic_ulong recv_calls;
+    atomic_ullong rx, tx;
+    atomic_ulong rbuf_conns;            /* ヒープの受信バッファを持っている接続（現在値） */
+    atomic_ullong rbuf_bytes;           /* その合計バイト数（現在値） */
+    atomic_ulong rbuf_grow, rbuf_shrink;
+};
+
+struct conn *g_conn;
+int g_conn_max;
+struct stats g_stats;
+
+/* 接続の表を用意する（FD の上限の分。CONN_MAX まで） */
+int
+conn_init(void)
+{
+    struct rlimit rl;
+
+    g_conn_max = CONN_MAX;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+        && rl.rlim_cur < CONN_MAX) {
+        g_conn_max = (int) rl.rlim_cur;
+    }
+    if ((g_conn = calloc((size_t) g_conn_max, sizeof(struct conn))) == NULL) {
+        perror("calloc");
+        return (-1);
+    }
+    g_stats.start = now_sec();
+    return (0);
+}
+
+/* 接続の処理を始める（表に載らない FD は local に数えて、閉じるときの累計にだけ足す） */
+struct conn *
+conn_open(int acc, struct conn *local)
+{
+    struct conn *c;
+    socklen_t len;
+
+    c = acc < g_conn_max ? &g_conn[acc] : local;
+    c->since = now_sec();
+    len = (socklen_t) sizeof(c->addr);
+    if (getpeername(acc, (struct sockaddr *) &c->addr, &len) == -1) {
+        c->addr.ss_family = AF_UNSPEC;
+    }
+    atomic_store_explicit(&c->nreq, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->nrecv, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->rx, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->tx, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->active, 1, memory_order_release);
+    atomic_fetch_add_explicit(&g_stats.accepted, 1, memory_order_relaxed);
+    return (c);
+}
+
+/* 接続の処理を終える（close の前に呼ぶ。FD が再利用される前に表から外す） */
+void
+conn_close(struct conn *c)
+{
+    atomic_fetch_add_explicit(&g_stats.requests,
+                              atomic_load_explicit(&c->nreq, memory_order_relaxed),
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_stats.recv_calls,
+                              atomic_load_explicit(&c->nrecv, memory_order_relaxed),
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_stats.rx, atomic_load_explicit(&c->rx, memory_order_relaxed),
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_stats.tx, atomic_load_explicit(&c->tx, memory_order_relaxed),
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_stats.closed, 1, memory_order_relaxed);
+    atomic_store_explicit(&c->active, 0, memory_order_release);
+}
+
+/* 受信バッファの大きさ合わせ
+ *
+ * 従来は各スレッド / コルーチンのスタックの 512 バイトに recv していた。大きな要求は 512 バイトずつ
+ * 何度も recv し、改行の無いまま一杯になると途中で切れた応答を返していた。そこで：
+ *
+ * - recv の前に ioctl(FIONREAD) で届いているバイト数を見て、最近の要求の大きさ（rexpect）と
+ *   持ち越しを合わせて 512 バイトで足りなければ、ヒープのバッファを 2 のべき乗で確保・拡張し
+ *   1 回の recv で読み切る（上限 RBUF_MAX。改行の無いまま一杯になったら広げて読み続け、
+ *   RBUF_MAX で一杯になったときだけそこまでを 1 行とする）
+ * - 持ち越しが無く何も届いていない（次の要求を待って recv で止まる）ときはスタックに戻して
+ *   ヒープを解放する → 待機中の接続はヒープのバッファを持たない
+ *   （その後に大きな要求が届いたら、最初の 512 バイトを読んでから広げる）
+ * - rexpect に対して 4 倍より大きければ縮める
+ * - 効果は管理用ソケットの stats（recv_per_kb / rbuf_conns / rbuf_bytes）で見る
+ */
+#define RBUF_STACK      (512)                   /* スタックで読む大きさ（従来の buf） */
+#define RBUF_MAX        (1024 * 1024)           /* ヒープのバッファの上限 */
+
+/* want バイトを読めるバッファの大きさ（2 のべき乗、RBUF_STACK * 2 〜 RBUF_MAX） */
+size_t
+rbuf_roundup(size_t want)
+{
+    size_t n;
+
+    for (n = RBUF_STACK * 2; n < want && n < RBUF_MAX; n <<= 1) {
+        ;
+    }
+    return (n);
+}
+
+/* 受信バッファ m を need バイトに合わせる（stack：RBUF_STACK バイトのスタックのバッファ）
+ *
+ * - need が RBUF_STACK 以下ならスタックに戻してヒープを解放する
+ * - それより大きければヒープを確保・拡張する（4 倍より大きいときだけ縮める）
+ * m のデータ（持ち越し。m->off は 0）は移す。確保に失敗したら今のまま
+ */
+void
+rbuf_fit(struct mbuf *m, char *stack, size_t need)
+{
+    size_t n;
+    char *p;
+
+    if (need <= RBUF_STACK) {
+        if (m->base != stack) {
+            (void) memcpy(stack, m->base, m->len);
+            free(m->base);
+            atomic_fetch_sub_explicit(&g_stats.rbuf_conns, 1, memory_order_relaxed);
+            atomic_fetch_sub_explicit(&g_stats.rbuf_bytes, m->size, memory_order_relaxed);
+            atomic_fetch_add_explicit(&g_stats.rbuf_shrink, 1, memory_order_relaxed);
+            m->base = stack;
+            m->size = RBUF_STACK;
+        }
+        return;
+    }
+    n = rbuf_roundup(need);
+    if (n == m->size || (m->base != stack && n < m->size && n * 4 > m->size)) {
+        return;
+    }
+    if ((p = m->base == stack ? malloc(n) : realloc(m->base, n)) == NULL) {
+        perror("malloc");
+        return;
+    }
+    if (m->base == stack) {
+        (void) memcpy(p, stack, m->len);
+        atomic_fetch_add_explicit(&g_stats.rbuf_conns, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_sub_explicit(&g_stats.rbuf_bytes, m->size, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&g_stats.rbuf_bytes, n, memory_order_relaxed);
+    atomic_fetch_add_explicit(n > m->size ? &g_stats.rbuf_grow : &g_stats.rbuf_shrink, 1,
+                              memory_order_relaxed);
+    m->base = p;
+    m->size = n;
+}
+
+/*
+ * 送受信ループ（1 接続分：どのモードでも使う）
+ *
+ * - acc（接続FD）で recv→応答(send) を繰り返す
+ * - 切断（len==0）またはエラーで戻る（close は呼び出し側で行う）
+ * - recv/writev は co_recv/co_writev 経由（coro モードでは EAGAIN で他のセッションに譲る）
+ * - 大きな要求は FIONREAD に合わせて広げたヒープのバッファで読む（rbuf_fit）
+ * - 受信 / 送信バイト数と応答した行の数を g_conn[acc] に数える（管理用ソケットの conns）
+ */
+void
+send_recv_loop(int acc)
+{
+    char buf[RBUF_STACK];
+    struct conn local, *c;
+    struct mbuf m;
+    struct iovec iov[2 * LINE_BATCH];
+    size_t pos, end, total, rexpect;
+    ssize_t len;
+    int n, k, cr, avail;
+
+    /* 受信バッファを空にする（行の途中は先頭に詰めて次の recv まで持ち越す） */
+    mbuf_init(&m, buf, sizeof(buf), 0);
+    cr = 0;
+    rexpect = 0;
+    c = conn_open(acc, &local);
+    for (;;) {
+        /* 届いているバイト数（取れなければ 0）と最近の要求の大きさから、読むバッファを選ぶ
+         * - 持ち越しが無く何も届いていなければ、待つ間はスタックで足りる
+         * - 持ち越しで一杯なら、少なくとも 1 バイトは読めるように広げる */
+        if (ioctl(acc, FIONREAD, &avail) == -1 || avail < 0) {
+            avail = 0;
+        }
+        if (m.len == 0 && avail == 0) {
+            rbuf_fit(&m, buf, 0);
+        } else {
+            rbuf_fit(&m, buf, m.len + MAX(MAX((size_t) avail, rexpect), 1));
+        }
+
+        /* 受信：TCPなので「受けた分だけ」返る（メッセージ境界は保証されない） */
+        if ((len = co_recv(acc, MBUF_TAIL(&m),
+                           MBUF_TAILROOM(&m), 0)) == -1) {
+            perror("recv");
+            break;
+        }
+        atomic_fetch_add_explicit(&c->nrecv, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&c->rx, (unsigned long long) len, memory_order_relaxed);
+        if (len == 0) {
+            /* 相手が close した（EOF） */
+            (void) fprintf(stderr, "<%d>recv:EOF\n", (int) pthread_self());
+            /* 改行の届かなかった最後の行にも応答する */
+            end = m.len;
+        } else {
+            m.len += (size_t) len;
+            tune_accepted(acc);     /* latency：TCP_QUICKACK を付け直す */
+            /* 最後の区切りまでに応答し、後ろは持ち越す
+             * （改行の無いまま一杯なら、次の周回で広げて読み続ける。RBUF_MAX なら全部を 1 行とする） */
+            if ((end = line_end(MBUF_DATA(&m), m.len)) == 0 && MBUF_TAILROOM(&m) == 0
+                && m.size >= RBUF_MAX) {
+                end = m.len;
+            }
+            if (end > 0) {
+                /* 要求が揃った：大きさを覚える（要求ごとに 3/4 へ減衰させた最大値） */
+                rexpect = MAX(m.len, rexpect - rexpect / 4);
+            }
+        }
+
+        /* 1 行ごとに応答する（続けて届いた要求にもそれぞれ返す）
+         * スレッドID付きログ：どの接続がどのスレッドで処理されているか分かる
+         * 前の recv が CR で終わっていれば、続く LF は同じ区切りなので読み飛ばす */
+        pos = cr && end > 0 && MBUF_DATA(&m)[0] == '\n' ? 1 : 0;
+        cr = end == m.len && end > 0 && MBUF_DATA(&m)[end - 1] == '\r';
+        while ((n = frame_lines(MBUF_DATA(&m), end, &pos, iov, &total)) > 0) {
+            for (k = 0; k < n; k += 2) {
+                (void) fprintf(stderr, "<%d>[client]%.*s\n", (int) pthread_self(),
+                               (int) iov[k].iov_len, (char *) iov[k].iov_base);
+            }
+            if (co_writev(acc, iov, n) == -1) {
+                perror("writev");
+                break;
+            }
+            atomic_fetch_add_explicit(&c->nreq, (unsigned long) n / 2, memory_order_relaxed);
+            atomic_fetch_add_explicit(&c->tx, (unsigned long long) total, memory_order_relaxed);
+        }
+        if (n > 0 || len == 0) {
+            /* 応答を送れなかった / EOF */
+            break;
+        }
+
+        /* 行の途中を先頭に詰める */
+        m.len -= end;
+        (void) memmove(MBUF_DATA(&m), MBUF_DATA(&m) + end, m.len);
+    }
+    rbuf_fit(&m, buf, 0);
+    conn_close(c);
+}
+
+/*
+ * 送受信スレッド（thread モード：接続ごとに 1 スレッド起動される）
+ *
+ * 役割：
+ * - arg で渡された acc（接続FD）を使い、recv→応答(send) を繰り返す
+ * - 切断（len==0）またはエラーで終了し、close(acc) してスレッド終了
+ *
+ * スレッドにする利点（教材観点）：
+ * - accept ループがブロックせず、複数接続を並列にさばける
+ * - fork より軽いことが多い（プロセス生成よりスレッド生成が軽量）
+ *
+ * 注意：
+ * - 共有資源（共有バッファ、共有ログファイル、共有カウンタなど）を使うなら mutex が必要。
+ * - ここでは標準エラー出力に複数スレッドが同時に書くため、ログが混ざる可能性はある。
+ */
+void *
+send_recv_thread(void *arg)
+{
+    int acc;
+
+    /*
+     * スレッドをデタッチ：
+     * - join しない（親が pthread_join で回収しない）設計にする。
+     * - デタッチされたスレッドは終了時に OS が自動的に資源を回収する。
+     *
+     * つまりこのサンプルでは「スレッドの生死管理を簡単にする」ため detach している。
+     */
+    (void) pthread_detach(pthread_self());
+
+    /*
+     * 引数の取得：
+     * - accept_loop から (void*)acc で渡されているので int に戻す。
+     * - 64bit 環境では危険になり得る（前述）。
+     */
+    acc = (int) arg;
+
+    send_recv_loop(acc);
+
+    /* スレッドが責任を持って接続FDを閉じる（accept側では閉じない） */
     (void) close(acc);
+    atomic_fetch_sub(&g_active, 1);
 
     /*
      * スレッド終了：
@@ -364,16 +1460,927 @@ send_recv_thread(void *arg)
     return ((void *) 0);
 }
 
+/* 接続 FD をキューに積む（accept ループから呼ぶ）
+ *
+ * 戻り値：0 = 積んだ / -1 = キュー満杯（呼び出し側で close する）
+ * - 満杯は「g_queue_limit 件溜まっている」こと（set queue_limit で起動時の大きさまでの範囲で変わる）
+ */
+int
+pool_push(int acc)
+{
+    int next;
+
+    (void) pthread_mutex_lock(&g_fdq.mutex);
+    next = (g_fdq.last + 1) % g_fdq.size;
+    if (next == g_fdq.front
+        || (g_fdq.last - g_fdq.front + g_fdq.size) % g_fdq.size >= atomic_load(&g_queue_limit)) {
+        /* 満杯：last が front に追いつく（1 要素は空けておき、空と満杯を区別する） */
+        (void) pthread_mutex_unlock(&g_fdq.mutex);
+        return (-1);
+    }
+    g_fdq.fd[g_fdq.last] = acc;
+    g_fdq.last = next;
+    (void) pthread_cond_signal(&g_fdq.cond);
+    (void) pthread_mutex_unlock(&g_fdq.mutex);
+    return (0);
+}
+
+/* ワーカースレッド（pool モード）
+ *
+ * - キューから接続 FD を 1 つ取り出し、切断されるまで send_recv_loop で処理する
+ * - 終わったら close して次の接続を待つ（スレッド自体は終了しない）
+ */
+void *
+pool_worker(void *arg)
+{
+    int acc;
+
+    (void) arg;
+    for (;;) {
+        (void) pthread_mutex_lock(&g_fdq.mutex);
+        while (g_fdq.front == g_fdq.last) {
+            /* キューが空：accept 側の cond_signal を待つ */
+            (void) pthread_cond_wait(&g_fdq.cond, &g_fdq.mutex);
+        }
+        acc = g_fdq.fd[g_fdq.front];
+        g_fdq.front = (g_fdq.front + 1) % g_fdq.size;
+        (void) pthread_mutex_unlock(&g_fdq.mutex);
+
+        send_recv_loop(acc);
+        (void) close(acc);
+        atomic_fetch_sub(&g_active, 1);
+    }
+
+    /*NOT REACHED*/
+    return ((void *) 0);
+}
+
+/* プールの準備：キューを確保し、ワーカースレッドを workers 本起動する
+ *
+ * 戻り値：0 = 成功 / -1 = 失敗
+ */
+int
+pool_init(int workers, int queue_limit)
+{
+    pthread_t thread_id;
+    int i;
+
+    g_fdq.size = queue_limit + 1;
+    g_fdq.front = g_fdq.last = 0;
+    if ((g_fdq.fd = malloc(sizeof(int) * g_fdq.size)) == NULL) {
+        perror("malloc");
+        return (-1);
+    }
+    (void) pthread_mutex_init(&g_fdq.mutex, NULL);
+    (void) pthread_cond_init(&g_fdq.cond, NULL);
+
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&thread_id, NULL, pool_worker, NULL) != 0) {
+            perror("pthread_create");
+            return (-1);
+        }
+        (void) pthread_detach(thread_id);
+    }
+    return (0);
+}
+
+/*
+ * cached モード：小さいスタックの「接続ごと 1 スレッド」＋ スレッドの再利用
+ *
+ * thread モードと同じくブロッキングな send_recv_loop を接続ごとのスレッドで回すが、
+ * - スタックは pthread_attr_setstack で CACHED_STACK_KB（既定 64KB）に固定する
+ *   （既定の 8MB 予約をやめ、1 万接続でも仮想メモリを食い尽くさない）
+ * - スタックは mmap で確保し、最下部 1 ページを PROT_NONE のガードページにする
+ *   （setstack を使うと glibc はガードページを付けないため自前で付ける）
+ * - 接続が終わったスレッドは終了せずに待機リスト（g_parked）に入り、次の接続を受け取る
+ *   （pthread_create を毎回呼ばない）
+ * - CACHED_IDLE_SEC 秒仕事が来なかったスレッドは終了し、その構造体とスタックは
+ *   g_stack_cache に戻って次に作るスレッドで使い回される
+ */
+#define CACHED_STACK_KB  (64)
+#define CACHED_IDLE_SEC  (30)
+
+struct cthread {
+    pthread_t id;
+    char *stack;                        /* mmap した領域の先頭（ガードページを含む） */
+    size_t stack_len;                   /* mmap した長さ */
+    int acc;                            /* 割り当てられた接続（-1: 無し） */
+    pthread_cond_t cond;                /* 接続が割り当てられたことの通知 */
+    struct cthread *next;
+};
+
+struct cthread *g_parked;               /* 接続待ちのスレッド */
+struct cthread *g_exited;               /* 終了したスレッド（join してスタックを回収する） */
+struct cthread *g_stack_cache;          /* 使われていない構造体 + スタック */
+pthread_mutex_t g_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+size_t g_cached_stack = CACHED_STACK_KB * 1024;
+
+/* 統計（g_cache_mutex で保護） */
+long g_cached_created;                  /* pthread_create した回数 */
+long g_cached_reused;                   /* 待機中スレッドに渡した回数 */
+
+/* スタック付きの構造体を 1 つ得る（キャッシュに無ければ mmap で作る） */
+struct cthread *
+cthread_alloc(void)
+{
+    struct cthread *t;
+    size_t page;
+
+    (void) pthread_mutex_lock(&g_cache_mutex);
+    if ((t = g_stack_cache) != NULL) {
+        g_stack_cache = t->next;
+    }
+    (void) pthread_mutex_unlock(&g_cache_mutex);
+    if (t != NULL) {
+        return (t);
+    }
+
+    if ((t = calloc(1, sizeof(struct cthread))) == NULL) {
+        perror("calloc");
+        return (NULL);
+    }
+    page = (size_t) sysconf(_SC_PAGESIZE);
+    t->stack_len = g_cached_stack + page;
+    if ((t->stack = mmap(NULL, t->stack_len, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0)) == MAP_FAILED) {
+        perror("mmap");
+        free(t);
+        return (NULL);
+    }
+    /* スタックは下に伸びるので、最下部をガードページにする（溢れたら SIGSEGV） */
+    if (mprotect(t->stack, page, PROT_NONE) == -1) {
+        perror("mprotect");
+    }
+    (void) pthread_cond_init(&t->cond, NULL);
+    return (t);
+}
+
+/* 終了済みスレッドを join し、構造体とスタックをキャッシュに戻す（accept 側から呼ぶ） */
+void
+cthread_reap(void)
+{
+    struct cthread *t, *next;
+
+    (void) pthread_mutex_lock(&g_cache_mutex);
+    t = g_exited;
+    g_exited = NULL;
+    (void) pthread_mutex_unlock(&g_cache_mutex);
+
+    for (; t != NULL; t = next) {
+        next = t->next;
+        /* スレッドはもう戻るだけなので join はすぐ終わる（以後スタックを再利用できる） */
+        (void) pthread_join(t->id, NULL);
+        (void) pthread_mutex_lock(&g_cache_mutex);
+        t->next = g_stack_cache;
+        g_stack_cache = t;
+        (void) pthread_mutex_unlock(&g_cache_mutex);
+    }
+}
+
+/* cached モードのスレッド本体 */
+void *
+cthread_main(void *arg)
+{
+    struct cthread *t, **pp;
+    struct timespec ts;
+    int acc;
+
+    t = (struct cthread *) arg;
+    acc = t->acc;
+    for (;;) {
+        send_recv_loop(acc);
+        (void) close(acc);
+        atomic_fetch_sub(&g_active, 1);
+
+        /* 終わったら待機リストに入り、次の接続を待つ */
+        (void) pthread_mutex_lock(&g_cache_mutex);
+        t->acc = -1;
+        t->next = g_parked;
+        g_parked = t;
+        (void) clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += CACHED_IDLE_SEC;
+        while (t->acc == -1) {
+            if (pthread_cond_timedwait(&t->cond, &g_cache_mutex, &ts) == ETIMEDOUT
+                && t->acc == -1) {
+                /* 長く仕事が無い：待機リストから外して終了する */
+                for (pp = &g_parked; *pp != NULL; pp = &(*pp)->next) {
+                    if (*pp == t) {
+                        *pp = t->next;
+                        break;
+                    }
+                }
+                t->next = g_exited;
+                g_exited = t;
+                (void) pthread_mutex_unlock(&g_cache_mutex);
+                return ((void *) 0);
+            }
+        }
+        acc = t->acc;
+        (void) pthread_mutex_unlock(&g_cache_mutex);
+    }
+}
+
+/* 接続を cached モードのスレッドに渡す（accept ループから呼ぶ）
+ *
+ * - 待機中のスレッドがあればそれに渡す（スレッド生成なし）
+ * - 無ければキャッシュのスタックで新しいスレッドを作る
+ *
+ * 戻り値：0 = 渡した / -1 = 失敗（呼び出し側で close する）
+ */
+int
+cached_dispatch(int acc)
+{
+    struct cthread *t;
+    pthread_attr_t attr;
+    int ret;
+
+    cthread_reap();
+
+    (void) pthread_mutex_lock(&g_cache_mutex);
+    if ((t = g_parked) != NULL) {
+        g_parked = t->next;
+        t->acc = acc;
+        g_cached_reused++;
+        (void) pthread_cond_signal(&t->cond);
+        (void) pthread_mutex_unlock(&g_cache_mutex);
+        return (0);
+    }
+    (void) pthread_mutex_unlock(&g_cache_mutex);
+
+    if ((t = cthread_alloc()) == NULL) {
+        return (-1);
+    }
+    t->acc = acc;
+    (void) pthread_attr_init(&attr);
+    (void) pthread_attr_setstack(&attr, t->stack + (t->stack_len - g_cached_stack),
+                                 g_cached_stack);
+    if ((ret = pthread_create(&t->id, &attr, cthread_main, t)) != 0) {
+        (void) fprintf(stderr, "pthread_create:%s\n", strerror(ret));
+        (void) pthread_attr_destroy(&attr);
+        (void) pthread_mutex_lock(&g_cache_mutex);
+        t->next = g_stack_cache;
+        g_stack_cache = t;
+        (void) pthread_mutex_unlock(&g_cache_mutex);
+        return (-1);
+    }
+    (void) pthread_attr_destroy(&attr);
+
+    (void) pthread_mutex_lock(&g_cache_mutex);
+    g_cached_created++;
+    (void) pthread_mutex_unlock(&g_cache_mutex);
+    return (0);
+}
+
+/* 起動時に n 本分のスタックを先に確保しておく（最初の接続ストームで mmap を呼ばないため） */
+void
+cached_prealloc(int n)
+{
+    struct cthread *t;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if ((t = cthread_alloc()) == NULL) {
+            break;
+        }
+        (void) pthread_mutex_lock(&g_cache_mutex);
+        t->next = g_stack_cache;
+        g_stack_cache = t;
+        (void) pthread_mutex_unlock(&g_cache_mutex);
+    }
+}
+
+/* coro モードの既定値：スケジューラ数は CPU コア数、スタックは CORO_STACK_KB */
+#define CORO_STACK_KB (64)
+#define CORO_EVENTS   (256)             /* 1 回の epoll_wait で受け取る最大イベント数 */
+
+int g_schedulers;
+size_t g_coro_stack = CORO_STACK_KB * 1024;
+int g_listen_soc = -1;
+
+/* drain で listen を止める（coro_stop_listen）
+ * - g_listen_stop : 1 = 以後 accept しない（スケジューラが accept4 の前に見る）
+ * - g_sched_epfd  : スケジューラごとの epoll（-1 = まだ作っていない）。listen を外すのに使う
+ */
+atomic_int g_listen_stop;
+atomic_int *g_sched_epfd;
+
+/* スケジューラごとの空きコルーチン（スタックごと使い回す） */
+__thread struct coro *t_co_free;
+
+/* コルーチンの入口（makecontext から呼ばれる） */
+void
+co_entry(void)
+{
+    struct coro *co;
+
+    co = t_co_current;
+    send_recv_loop(co->acc);
+    (void) close(co->acc);
+    atomic_fetch_sub(&g_active, 1);
+    co->done = 1;
+    /* 戻ると uc_link（= スケジューラ）に切り替わる */
+}
+
+/* 接続 acc を担当するコルーチンを用意する（空きリストに無ければスタックを mmap） */
+struct coro *
+coro_alloc(int acc)
+{
+    struct coro *co;
+    size_t page;
+
+    if ((co = t_co_free) != NULL) {
+        t_co_free = co->next;
+    } else {
+        if ((co = calloc(1, sizeof(struct coro))) == NULL) {
+            perror("calloc");
+            return (NULL);
+        }
+        page = (size_t) sysconf(_SC_PAGESIZE);
+        co->stack_len = g_coro_stack + page;
+        if ((co->stack = mmap(NULL, co->stack_len, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0)) == MAP_FAILED) {
+            perror("mmap");
+            free(co);
+            return (NULL);
+        }
+        /* 最下部をガードページにする（スタック溢れを SIGSEGV で検出） */
+        if (mprotect(co->stack, page, PROT_NONE) == -1) {
+            perror("mprotect");
+        }
+    }
+    co->acc = acc;
+    co->registered = 0;
+    co->done = 0;
+    (void) getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->stack + (co->stack_len - g_coro_stack);
+    co->ctx.uc_stack.ss_size = g_coro_stack;
+    co->ctx.uc_link = &t_sched_ctx;
+    makecontext(&co->ctx, co_entry, 0);
+    return (co);
+}
+
+/* コルーチンを次に止まる（EAGAIN か終了）まで動かす */
+void
+coro_resume(struct coro *co)
+{
+    t_co_current = co;
+    (void) swapcontext(&t_sched_ctx, &co->ctx);
+    t_co_current = NULL;
+    if (co->done) {
+        /* 終わったコルーチンは空きリストへ（acc は close 済みなので epoll からも消えている） */
+        co->next = t_co_free;
+        t_co_free = co;
+    }
+}
+
+/* スケジューラ（OS スレッド 1 本分）
+ *
+ * - 自分専用の epoll に listen ソケットを EPOLLEXCLUSIVE で登録する
+ *   （接続が来たとき、全スケジューラではなく 1 本だけが起こされる）
+ * - listen が ready → accept できるだけ accept し、接続ごとにコルーチンを作って動かす
+ * - 接続 FD が ready → 待っていたコルーチンを再開する
+ * - drain ではメインスレッドが coro_stop_listen で listen をこの epoll から外す
+ *   （以後は既存のコルーチンだけを動かす）
+ * - arg は atomic_int*（g_sched_epfd の自分の欄。作った epoll をここに書く）
+ */
+void *
+coro_sched(void *arg)
+{
+    struct epoll_event ev, events[CORO_EVENTS];
+    struct sockaddr_storage from;
+    char pbuf[PEER_STRLEN];
+    struct coro *co;
+    socklen_t len;
+    int i, nfds, acc;
+
+    if ((t_epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return ((void *) -1);
+    }
+    atomic_store((atomic_int *) arg, t_epollfd);
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(t_epollfd, EPOLL_CTL_ADD, g_listen_soc, &ev) == -1) {
+        perror("epoll_ctl");
+        return ((void *) -1);
+    }
+    /* 登録の前に drain が始まっていたら（メインスレッドがこの epoll を見る前）、自分で外す */
+    if (atomic_load(&g_listen_stop)) {
+        (void) epoll_ctl(t_epollfd, EPOLL_CTL_DEL, g_listen_soc, NULL);
+    }
+
+    for (;;) {
+        if ((nfds = epoll_wait(t_epollfd, events, CORO_EVENTS, -1)) == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            continue;
+        }
+        for (i = 0; i < nfds; i++) {
+            if (events[i].data.ptr != NULL) {
+                coro_resume((struct coro *) events[i].data.ptr);
+                continue;
+            }
+            /* listen ソケット：キューが空になるまで受け付ける（drain が始まったら止める） */
+            while (!atomic_load(&g_listen_stop)) {
+                len = (socklen_t) sizeof(from);
+                if ((acc = accept4(g_listen_soc, (struct sockaddr *) &from, &len,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+                    /* EINVAL：drain でメインスレッドが listen ソケットを shutdown した */
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+                        && errno != EINVAL) {
+                        perror("accept4");
+                    }
+                    break;
+                }
+                if (g_verbose) {
+                    (void) format_peer(&from, pbuf);
+                    (void) fprintf(stderr, "accept:%s\n", pbuf);
+                }
+                if ((co = coro_alloc(acc)) == NULL) {
+                    (void) close(acc);
+                    continue;
+                }
+                atomic_fetch_add(&g_active, 1);
+                coro_resume(co);
+            }
+        }
+    }
+
+    /*NOT REACHED*/
+    return ((void *) 0);
+}
+
+/* coro モードの開始：listen をノンブロッキングにしてスケジューラを n 本起動する
+ * （メインスレッドはスケジューラにならず、戻ってシグナルを待つ）
+ */
+int
+coro_start(int soc, int n)
+{
+    pthread_t thread_id;
+    int i;
+
+    if (fcntl(soc, F_SETFL, fcntl(soc, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("fcntl");
+        return (-1);
+    }
+    g_listen_soc = soc;
+    if ((g_sched_epfd = calloc((size_t) n, sizeof(atomic_int))) == NULL) {
+        perror("calloc");
+        return (-1);
+    }
+    for (i = 0; i < n; i++) {
+        atomic_init(&g_sched_epfd[i], -1);
+    }
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&thread_id, NULL, coro_sched, (void *) &g_sched_epfd[i]) != 0) {
+            perror("pthread_create");
+            return (-1);
+        }
+        (void) pthread_detach(thread_id);
+    }
+    return (0);
+}
+
+/* drain（coro モード）：新しい接続を受けるのをやめる
+ *
+ * - g_listen_stop を立ててから、各スケジューラの epoll から listen ソケットを外す
+ *   （まだ epoll を作っていないスケジューラは、登録の後に g_listen_stop を見て自分で外す）
+ * - listen ソケットは close せず shutdown する：epoll_wait から戻って accept4 に向かっている
+ *   スケジューラがいても、FD 番号が（管理用ソケットの接続などに）再利用されることはなく、
+ *   accept4 は EINVAL で戻る。FD はプロセスの終了で閉じる
+ */
+void
+coro_stop_listen(int soc)
+{
+    int i, epfd;
+
+    atomic_store(&g_listen_stop, 1);
+    for (i = 0; i < g_schedulers; i++) {
+        if ((epfd = atomic_load(&g_sched_epfd[i])) != -1) {
+            (void) epoll_ctl(epfd, EPOLL_CTL_DEL, soc, NULL);
+        }
+    }
+    if (shutdown(soc, SHUT_RDWR) == -1) {
+        perror("shutdown");
+    }
+}
+
+/* drain の待ち合わせ（メインスレッド）
+ *
+ * - drain 前（coro モード）：シグナルが来るまで待ち、来たら coro_stop_listen で listen を止める
+ * - drain 中：処理中の接続（g_active）が 0 になるか期限が来るまで待つ
+ *   （接続を閉じるのはワーカー側で通知が無いので 100ms ごとに見る。途中経過は 1 秒ごと）
+ */
+void
+drain_wait(int soc)
+{
+    struct pollfd pfd;
+    int sig;
+
+    pfd.fd = g_sig_fd;
+    pfd.events = POLLIN;
+    while (g_drain_start == 0.0) {
+        if (poll(&pfd, 1, -1) > 0 && (sig = sig_fd_read()) != 0) {
+            drain_begin(sig, atomic_load(&g_active));
+            coro_stop_listen(soc);
+        }
+    }
+    while (!drain_check(atomic_load(&g_active))) {
+        if (poll(&pfd, 1, 100) > 0) {
+            while (sig_fd_read() != 0) {
+                /* drain 中の 2 回目以降のシグナルは読み捨てる */
+            }
+        }
+    }
+}
+
+/* --------------------------- 管理用ソケット --------------------------- */
+
+/* 管理用ソケット（admin）
+ *
+ * 動いているサーバの状態を、stderr のログを grep せずに問い合わせるための AF_UNIX ソケット。
+ * adminctl（または socat 等）で 1 行のコマンドを送ると、テキストで応答して閉じる。
+ *
+ * コマンド：
+ * - stats         : 稼働時間、モード、処理中の接続数、accept / 拒否 / 要求数、送受信バイト数、
+ *                   モードごとの状態（pool のキューの溜まり、cached のスレッド生成 / 再利用）
+ * - conns         : 接続ごとの fd、接続元、経過秒、要求数、送受信バイト数
+ * - set KEY VALUE : g_tunables の値を 1 つ変える（queue_limit は pool モードで、起動時の値まで）
+ * - drain         : SIGTERM と同じ drain を始める（自分に SIGTERM を送り、メインスレッドが受ける）
+ *
+ * - パスは ADMIN_PATH_FMT にポート番号を入れたもの。権限 0600（起動したユーザだけが使える）
+ * - 管理スレッド（admin_thread）1 本が accept → 1 行読む → 応答 → close を 1 接続ずつ行う
+ *   - 接続を処理するスレッド / コルーチンは止めず、g_conn / g_stats の atomic を読むだけ
+ *     （pool のキューの深さと cached の統計だけは、それぞれの mutex を一瞬取って読む）
+ *   - nice を ADMIN_NICE 下げ、CPU が混んでいるときは接続の処理を先にさせる
+ *   - 送ってこない / 読まない相手で止まり続けないよう、管理接続には ADMIN_WAIT 秒の
+ *     SO_RCVTIMEO / SO_SNDTIMEO を付ける
+ */
+#define ADMIN_PATH_FMT  "/tmp/server6.%s.admin"
+#define ADMIN_BACKLOG   (4)
+#define ADMIN_LINE      (256)
+#define ADMIN_WAIT      (1)             /* 秒 */
+#define ADMIN_NICE      (10)
+
+struct admin {
+    int fd;
+    char *out;                          /* 応答（admin_printf で伸ばす） */
+    size_t outlen, outsize;             /* 応答の長さ / 確保量 */
+};
+
+int g_admin_soc = -1;
+char g_admin_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+/* set で変えられる値（名前、変数、受け付ける範囲） */
+struct tunable {
+    const char *name;
+    atomic_int *var;
+    int min;
+    int max;
+};
+
+const struct tunable g_tunables[] = {
+    { "queue_limit",   &g_queue_limit,   1, 1 << 20 },
+    { "drain_timeout", &g_drain_timeout, 0, 86400 },
+    { "verbose",       &g_verbose,       0, 1 },
+};
+
+/* 管理用ソケットを作る（失敗しても管理機能が無いだけで、サーバは続行する） */
+int
+admin_socket(const char *portnm)
+{
+    struct sockaddr_un sun;
+
+    (void) memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    (void) snprintf(sun.sun_path, sizeof(sun.sun_path), ADMIN_PATH_FMT, portnm);
+    if ((g_admin_soc = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket(AF_UNIX)");
+        return (-1);
+    }
+    (void) unlink(sun.sun_path);
+    if (bind(g_admin_soc, (struct sockaddr *) &sun, sizeof(sun)) == -1
+        || chmod(sun.sun_path, 0600) == -1
+        || listen(g_admin_soc, ADMIN_BACKLOG) == -1) {
+        perror(sun.sun_path);
+        (void) close(g_admin_soc);
+        g_admin_soc = -1;
+        return (-1);
+    }
+    (void) strcpy(g_admin_path, sun.sun_path);
+    (void) fprintf(stderr, "admin=%s\n", g_admin_path);
+    return (g_admin_soc);
+}
+
+/* 応答に書式付きで追記する */
+void
+admin_printf(struct admin *a, const char *fmt, ...)
+{
+    va_list ap;
+    size_t need;
+    char *p;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    need = a->outlen + (size_t) n + 1;
+    if (need > a->outsize) {
+        if ((p = realloc(a->out, need < 4096 ? 4096 : need * 2)) == NULL) {
+            return;
+        }
+        a->out = p;
+        a->outsize = need < 4096 ? 4096 : need * 2;
+    }
+    va_start(ap, fmt);
+    (void) vsnprintf(a->out + a->outlen, (size_t) n + 1, fmt, ap);
+    va_end(ap);
+    a->outlen += (size_t) n;
+}
+
+/* set KEY VALUE：g_tunables の 1 つを書き換える（動いているスレッドは次に見たときから新しい値） */
+void
+admin_set(struct admin *a, const char *key, const char *val)
+{
+    const struct tunable *t;
+    char *end;
+    size_t k;
+    long v;
+
+    for (k = 0; k < sizeof(g_tunables) / sizeof(g_tunables[0]); k++) {
+        if (key != NULL && strcmp(key, g_tunables[k].name) == 0) {
+            break;
+        }
+    }
+    if (k == sizeof(g_tunables) / sizeof(g_tunables[0]) || val == NULL) {
+        admin_printf(a, "ERR usage: set KEY VALUE (");
+        for (k = 0; k < sizeof(g_tunables) / sizeof(g_tunables[0]); k++) {
+            admin_printf(a, "%s%s", k > 0 ? "|" : "", g_tunables[k].name);
+        }
+        admin_printf(a, ")\n");
+        return;
+    }
+    t = &g_tunables[k];
+    errno = 0;
+    v = strtol(val, &end, 10);
+    if (errno != 0 || end == val || *end != '\0' || v < t->min || v > t->max) {
+        admin_printf(a, "ERR bad value for %s (%d..%d)\n", key, t->min, t->max);
+        return;
+    }
+    if (t->var == &g_queue_limit && g_mode != MODE_POOL) {
+        admin_printf(a, "ERR queue_limit is for pool mode only\n");
+        return;
+    }
+    if (t->var == &g_queue_limit && v > g_fdq.size - 1) {
+        /* キューの配列は起動時に確保したので、それより大きくはできない */
+        admin_printf(a, "ERR bad value for %s (%d..%d)\n", key, t->min, g_fdq.size - 1);
+        return;
+    }
+    atomic_store(t->var, (int) v);
+    (void) fprintf(stderr, "set: %s=%ld\n", key, v);
+    admin_printf(a, "OK %s=%ld\n", key, v);
+}
+
+/* コマンド 1 行を実行して応答を組み立てる */
+void
+admin_command(struct admin *a, char *line)
+{
+    static const char *const modes[] = { "thread", "pool", "cached", "coro" };
+    unsigned long nreq, nrecv;
+    unsigned long long rx, tx;
+    char pbuf[PEER_STRLEN], *cmd, *key, *val;
+    struct conn *c;
+    double now;
+    long created, reused;
+    int i, depth;
+
+    now = now_sec();
+    cmd = strtok(line, " \t");
+    key = strtok(NULL, " \t");
+    val = strtok(NULL, " \t");
+    if (cmd == NULL) {
+        admin_printf(a, "ERR empty command\n");
+    } else if (strcmp(cmd, "stats") == 0) {
+        nreq = atomic_load_explicit(&g_stats.requests, memory_order_relaxed);
+        nrecv = atomic_load_explicit(&g_stats.recv_calls, memory_order_relaxed);
+        rx = atomic_load_explicit(&g_stats.rx, memory_order_relaxed);
+        tx = atomic_load_explicit(&g_stats.tx, memory_order_relaxed);
+        for (i = 0; i < g_conn_max; i++) {
+            c = &g_conn[i];
+            if (atomic_load_explicit(&c->active, memory_order_acquire)) {
+                nreq += atomic_load_explicit(&c->nreq, memory_order_relaxed);
+                nrecv += atomic_load_explicit(&c->nrecv, memory_order_relaxed);
+                rx += atomic_load_explicit(&c->rx, memory_order_relaxed);
+                tx += atomic_load_explicit(&c->tx, memory_order_relaxed);
+            }
+        }
+        admin_printf(a, "uptime=%.1f\nmode=%s\nconns=%d\ndraining=%d\n"
+                     "accepted=%lu\nrejected=%ld\nclosed=%lu\nrequests=%lu\nrx=%llu\ntx=%llu\n"
+                     "recv_calls=%lu\nrecv_per_kb=%.4f\nrbuf_conns=%lu\nrbuf_bytes=%llu\n"
+                     "rbuf_grow=%lu\nrbuf_shrink=%lu\n"
+                     "drain_timeout=%d\nverbose=%d\n",
+                     now - g_stats.start, modes[g_mode], atomic_load(&g_active),
+                     g_drain_start != 0.0,
+                     atomic_load_explicit(&g_stats.accepted, memory_order_relaxed),
+                     atomic_load(&g_rejected),
+                     atomic_load_explicit(&g_stats.closed, memory_order_relaxed),
+                     nreq, rx, tx,
+                     nrecv, rx != 0 ? nrecv * 1024.0 / (double) rx : 0.0,
+                     atomic_load_explicit(&g_stats.rbuf_conns, memory_order_relaxed),
+                     atomic_load_explicit(&g_stats.rbuf_bytes, memory_order_relaxed),
+                     atomic_load_explicit(&g_stats.rbuf_grow, memory_order_relaxed),
+                     atomic_load_explicit(&g_stats.rbuf_shrink, memory_order_relaxed),
+                     atomic_load(&g_drain_timeout), atomic_load(&g_verbose));
+        if (g_mode == MODE_POOL) {
+            (void) pthread_mutex_lock(&g_fdq.mutex);
+            depth = (g_fdq.last - g_fdq.front + g_fdq.size) % g_fdq.size;
+            (void) pthread_mutex_unlock(&g_fdq.mutex);
+            admin_printf(a, "workers=%d\nqueue_depth=%d\nqueue_limit=%d\n",
+                         g_workers, depth, atomic_load(&g_queue_limit));
+        } else if (g_mode == MODE_CACHED) {
+            (void) pthread_mutex_lock(&g_cache_mutex);
+            created = g_cached_created;
+            reused = g_cached_reused;
+            (void) pthread_mutex_unlock(&g_cache_mutex);
+            admin_printf(a, "stack_kb=%zu\ncreated=%ld\nreused=%ld\n",
+                         g_cached_stack / 1024, created, reused);
+        } else if (g_mode == MODE_CORO) {
+            admin_printf(a, "schedulers=%d\nstack_kb=%zu\n",
+                         g_schedulers, g_coro_stack / 1024);
+        }
+    } else if (strcmp(cmd, "conns") == 0) {
+        admin_printf(a, "fd peer age nreq rx tx\n");
+        for (i = 0; i < g_conn_max; i++) {
+            c = &g_conn[i];
+            if (atomic_load_explicit(&c->active, memory_order_acquire)) {
+                (void) format_peer(&c->addr, pbuf);
+                admin_printf(a, "%d %s %.1f %lu %llu %llu\n", i, pbuf, now - c->since,
+                             atomic_load_explicit(&c->nreq, memory_order_relaxed),
+                             atomic_load_explicit(&c->rx, memory_order_relaxed),
+                             atomic_load_explicit(&c->tx, memory_order_relaxed));
+            }
+        }
+    } else if (strcmp(cmd, "set") == 0) {
+        admin_set(a, key, val);
+    } else if (strcmp(cmd, "drain") == 0) {
+        /* シグナルと同じ道を通す（drain はメインスレッドが行う） */
+        if (kill(getpid(), SIGTERM) == -1) {
+            admin_printf(a, "ERR kill: %s\n", strerror(errno));
+        } else {
+            admin_printf(a, "OK draining conns=%d timeout=%d\n",
+                         atomic_load(&g_active), atomic_load(&g_drain_timeout));
+        }
+    } else {
+        admin_printf(a, "ERR unknown command %s (stats|conns|set|drain)\n", cmd);
+    }
+    if (a->out != NULL) {
+        (void) fprintf(stderr, "admin:%s\n", cmd != NULL ? cmd : "");
+    }
+}
+
+/*
+ * admin_thread(arg)
+ *   - 管理用ソケットで 1 接続ずつ accept し、コマンド行（'\n' まで）を読んで応答を書き、閉じる
+ *   - 時間切れ / 相手が閉じたときは応答せずに閉じる
+ */
+void *
+admin_thread(void *arg)
+{
+    struct admin a;
+    struct timeval tv;
+    char in[ADMIN_LINE], *eol;
+    size_t inlen, off;
+    ssize_t n;
+
+    (void) arg;
+    (void) pthread_detach(pthread_self());
+    (void) setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), ADMIN_NICE);
+    for (;;) {
+        if ((a.fd = accept4(g_admin_soc, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept4(admin)");
+            return (NULL);
+        }
+        tv.tv_sec = ADMIN_WAIT;
+        tv.tv_usec = 0;
+        (void) setsockopt(a.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        (void) setsockopt(a.fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        inlen = 0;
+        eol = NULL;
+        while (eol == NULL && inlen < sizeof(in) - 1
+               && (n = recv(a.fd, in + inlen, sizeof(in) - 1 - inlen, 0)) > 0) {
+            inlen += (size_t) n;
+            in[inlen] = '\0';
+            eol = strpbrk(in, "\r\n");
+        }
+        if (eol != NULL || inlen == sizeof(in) - 1) {
+            if (eol != NULL) {
+                *eol = '\0';
+            }
+            a.out = NULL;
+            a.outlen = a.outsize = 0;
+            admin_command(&a, in);
+            for (off = 0; off < a.outlen; off += (size_t) n) {
+                if ((n = send(a.fd, a.out + off, a.outlen - off, MSG_NOSIGNAL)) <= 0) {
+                    break;
+                }
+            }
+            free(a.out);
+        }
+        (void) close(a.fd);
+    }
+}
+
+/* 終了時：管理用ソケットのパスを消す */
+void
+admin_shutdown(void)
+{
+    if (g_admin_soc != -1) {
+        (void) unlink(g_admin_path);
+    }
+}
+
 int
 main(int argc, char *argv[])
 {
-    int soc;
+    static const int term_sigs[] = { SIGTERM, SIGINT };
+    pthread_t admin_id;
+    long ncpu;
+    char *p;
+    int soc, prealloc;
 
     /* 引数にポート番号が指定されているか？ */
     if (argc <= 1) {
-        (void) fprintf(stderr, "server6 port\n");
+        (void) fprintf(stderr,
+                       "server6 port [latency|throughput|churn|none] [thread|pool [workers [queue_limit]]|cached [stack_kb [prealloc]]"
+                       "|coro [schedulers [stack_kb]]]\n");
         return (EX_USAGE);
     }
+    profile_arg(&argc, argv);
+
+    /* 動作モードとプールの大きさ（省略時は pool、CPU コア数 × POOL_PER_CPU 本） */
+    if (argc > 2) {
+        if (strcmp(argv[2], "thread") == 0) {
+            g_mode = MODE_THREAD;
+        } else if (strcmp(argv[2], "pool") == 0) {
+            g_mode = MODE_POOL;
+        } else if (strcmp(argv[2], "cached") == 0) {
+            g_mode = MODE_CACHED;
+        } else if (strcmp(argv[2], "coro") == 0) {
+            g_mode = MODE_CORO;
+        } else {
+            (void) fprintf(stderr,
+                       "server6 port [latency|throughput|churn|none] [thread|pool [workers [queue_limit]]|cached [stack_kb [prealloc]]"
+                       "|coro [schedulers [stack_kb]]]\n");
+            return (EX_USAGE);
+        }
+    }
+    if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+        ncpu = 1;
+    }
+    g_workers = (int) ncpu * POOL_PER_CPU;
+    prealloc = 0;
+    if (g_mode == MODE_CACHED) {
+        /* cached：第3引数はスタックサイズ（KB）、第4引数は先に確保するスタック数 */
+        if (argc > 3 && atoi(argv[3]) > 0) {
+            g_cached_stack = (size_t) atoi(argv[3]) * 1024;
+        }
+        if (argc > 4 && atoi(argv[4]) > 0) {
+            prealloc = atoi(argv[4]);
+        }
+    } else if (g_mode == MODE_CORO) {
+        /* coro：第3引数はスケジューラ数、第4引数はコルーチンのスタックサイズ（KB） */
+        g_schedulers = (int) ncpu;
+        if (argc > 3 && atoi(argv[3]) > 0) {
+            g_schedulers = atoi(argv[3]);
+        }
+        if (argc > 4 && atoi(argv[4]) > 0) {
+            g_coro_stack = (size_t) atoi(argv[4]) * 1024;
+        }
+    } else {
+        if (argc > 3 && atoi(argv[3]) > 0) {
+            g_workers = atoi(argv[3]);
+        }
+        if (argc > 4 && atoi(argv[4]) > 0) {
+            g_queue_limit = atoi(argv[4]);
+        }
+    }
+
+    /* 環境変数 SERVER_VERBOSE：accept ごとに接続元を表示する */
+    if ((p = getenv("SERVER_VERBOSE")) != NULL && atoi(p) > 0) {
+        g_verbose = 1;
+    }
+
+    /* 行区切り検索の実装を CPU に合わせて選ぶ（スレッド/子プロセス生成前に 1 回だけ） */
+    scan_eol_init();
+    (void) fprintf(stderr, "scan_eol=%s\n", g_scan_eol_name);
 
     /* サーバソケットの準備（listen開始） */
     if ((soc = server_socket(argv[1])) == -1) {
@@ -381,12 +2388,61 @@ main(int argc, char *argv[])
         return (EX_UNAVAILABLE);
     }
 
+    /* SIGTERM / SIGINT はシグナル FD で受け取り、drain に使う
+     * - スレッドを作る前にブロックしておく（以後のスレッドはブロックを引き継ぎ、
+     *   シグナルはメインスレッドの signalfd だけで受け取る）
+     */
+    if (sig_fd_init(term_sigs, 2) == -1) {
+        (void) close(soc);
+        return (EX_OSERR);
+    }
+
+    /* 接続の表と、管理用ソケット・管理スレッド（管理用ソケットは無くてもサーバは動く） */
+    if (conn_init() == -1) {
+        (void) close(soc);
+        return (EX_OSERR);
+    }
+    if (admin_socket(argv[1]) != -1
+        && pthread_create(&admin_id, NULL, admin_thread, NULL) != 0) {
+        perror("pthread_create(admin)");
+    }
+
+    if (g_mode == MODE_POOL) {
+        if (pool_init(g_workers, g_queue_limit) == -1) {
+            (void) close(soc);
+            return (EX_OSERR);
+        }
+        (void) fprintf(stderr, "mode=pool workers=%d queue_limit=%d\n",
+                       g_workers, g_queue_limit);
+    } else if (g_mode == MODE_CACHED) {
+        cached_prealloc(prealloc);
+        (void) fprintf(stderr, "mode=cached stack=%zuKB prealloc=%d\n",
+                       g_cached_stack / 1024, prealloc);
+    } else if (g_mode == MODE_CORO) {
+        (void) fprintf(stderr, "mode=coro schedulers=%d stack=%zuKB\n",
+                       g_schedulers, g_coro_stack / 1024);
+        if (coro_start(soc, g_schedulers) == -1) {
+            (void) close(soc);
+            return (EX_OSERR);
+        }
+        (void) fprintf(stderr, "ready for accept\n");
+        /* accept はスケジューラが行う。メインスレッドは SIGTERM を待って drain する */
+        drain_wait(soc);
+        admin_shutdown();
+        (void) fprintf(stderr, "exit\n");
+        return (EX_OK);
+    } else {
+        (void) fprintf(stderr, "mode=thread\n");
+    }
+
     (void) fprintf(stderr, "ready for accept\n");
 
-    /* アクセプトループ（ここから先は基本戻らない） */
+    /* アクセプトループ（SIGTERM / SIGINT で listen ソケットを閉じて戻る） */
     accept_loop(soc);
 
-    /* 通常ここには来ないが、念のため */
-    (void) close(soc);
+    /* 処理中の接続が終わるのを待つ（戻ったらプロセスごと終了） */
+    drain_wait(soc);
+    admin_shutdown();
+    (void) fprintf(stderr, "exit\n");
     return (EX_OK);
 }
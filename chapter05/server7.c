@@ -20,21 +20,87 @@
  *   また設計としては SO_REUSEPORT + 複数 listen、または epoll などのイベント駆動が一般的。
  * - ただ教材としては「プロセス間排他（ファイルロック）」「fork 後の FD 共有」
  *   「accept とワーカ処理の責務分離」を一度に学べて良い例である。
+ *
+ * ロックの方式（第2引数で選ぶ。既定は lockf）：
+ *   server7 port [lockf|mutex|pass]
+ * - lockf : 上記のファイルロック。取るたび・放すたびに必ずシステムコール（ファイルロック）になる
+ * - mutex : fork 前に作った無名共有メモリ（mmap MAP_SHARED|MAP_ANONYMOUS）に
+ *           PTHREAD_PROCESS_SHARED + PTHREAD_MUTEX_ROBUST の pthread mutex を置く
+ *           - 競合が無ければロック/解放はユーザ空間の atomic 命令だけで済む（futex）
+ *           - ロックを握ったまま子が死んでも（accept 待ち中に kill -9 等）、
+ *             次にロックを取ろうとした子に EOWNERDEAD が返るので、
+ *             pthread_mutex_consistent() で回復して続行する
+ *             （robust でない mutex だと全員が永久に待ち続ける）
+ *   lockf との比較は lock-bench.c（2〜64 プロセスでのロック/解放の速度）で行う。
+ *
+ * prefork マスター（Apache の prefork MPM 風）：
+ *   server7 port [lockf|mutex|pass [min_spare [max_spare [max_children [max_requests]]]]]
+ * - 子は共有メモリの「スコアボード」（1 子 1 スロット）に自分の状態
+ *   （起動中 / 待機 idle / 処理中 busy / 終了中）と処理した接続数を書く
+ * - 親は 1 秒ごと（子が死んだら SIGCHLD ですぐ）スコアボードを見て：
+ *   - 待機中の子が min_spare 未満なら（max_children まで）足りない分を fork する
+ *   - 待機中の子が max_spare を超えていたら 1 本ずつ引退させる
+ *     （スロットに retire を立てて SIGUSR1 で accept/ロック待ちから起こす）
+ *   - シグナルや異常終了で死んだ子（crash）はすぐ代わりを fork する
+ * - 子は max_requests 個の接続を処理したら自分から終了する（メモリの膨張を抑える recycle）
+ *   → 足りなくなった分は親が次の見回りで補充する
+ * - 親は 10 秒ごとにロック状態とスコアボードの集計を表示する
+ *
+ * 集中 acceptor モード（第2引数 pass）：
+ * - listen ソケットで accept するのは親（acceptor）だけ。子（worker）はロックも accept もしない
+ * - 親は poll → accept4 を繰り返して最大 PASS_BATCH 個の接続をまとめて受け取り、
+ *   それぞれを「いま担当している接続がいちばん少ない worker」に割り当てる
+ *   （負荷 = 親が渡した数 - worker がスコアボードに書いた処理済み数）
+ * - 同じ worker 宛ての fd は 1 回の sendmsg（SCM_RIGHTS）にまとめて Unix ドメインの
+ *   socketpair（SOCK_SEQPACKET）で渡す → 1 接続あたりのシステムコールが減る
+ * - worker は受け取った接続を poll でまとめて多重化する（長い接続を持っても他を待たせない）
+ *   接続は accept4 の SOCK_NONBLOCK でノンブロッキングにしてから渡す。読む相手が遅くて
+ *   応答を送り切れなければ、残りを接続ごとに取っておいて POLLOUT で送り、その間はその接続を読まない
+ *   （1 本の接続の recv / writev で worker 全体が止まらない）
+ * - カーネル任せの accept 分散と違い、長く続く接続でも担当数がぴったり均等になる
+ * - worker の数は min_spare 本で固定（1 本が多数の接続を持つので spare/recycle の調整はしない）
+ *   死んだ worker は他のモードと同じくすぐ作り直す（持っていた接続は失われる）
+ *
+ * 実行時設定（どのモードでも）：
+ *   server7 port [lockf|mutex|pass [min_spare [max_spare [max_children [max_requests [conf]]]]]]
+ * - conf に「キー 値」を書いておくと起動時に読み、親に SIGHUP を送ると読み直して
+ *   次の見回りから新しい値で子を増減する（下記 conf_apply）
+ * - 既定値はオンライン CPU 数から決める（conf_defaults）
+ *
+ * 停止（どのモードでも）：
+ * - 親に SIGTERM / SIGINT を送ると drain に入る：新しい接続を受けるのをやめ、
+ *   子が処理中の接続を終えて全員終了するか、drain_timeout 秒（既定 DRAIN_TIMEOUT）が過ぎたら終了する
+ *
+ * 管理用ソケット（どのモードでも）：
+ * - /tmp/server7.<port>.admin に stats / conns / set / drain を送ると、スコアボードの集計と
+ *   子ごとの状態を返す / 設定を変える / drain を始める（後ろの「管理用ソケット」。adminctl で送れる）
  */
 
+#define _GNU_SOURCE                     /* accept4() / MSG_CMSG_CLOEXEC */
+
 #include <sys/file.h>                   /* lockf() / flock() 系のため（実装により） */
+#include <sys/mman.h>                   /* mmap（mutex を置く共有メモリ） */
+#include <poll.h>                       /* pass モードの acceptor / worker */
 #include <sys/param.h>
 #include <sys/socket.h>
+#include <sys/stat.h>                   /* chmod（管理用ソケット） */
 #include <sys/types.h>
+#include <sys/uio.h>                    /* writev, struct iovec */
+#include <sys/un.h>                     /* struct sockaddr_un（管理用ソケット） */
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>                /* TCP_NODELAY / TCP_QUICKACK など（プロファイル） */
 #include <netdb.h>
 
 #include <ctype.h>
+#include <time.h>                       /* pthread_mutex_timedlock の期限 */
+#include <pthread.h>                    /* プロセス間共有 robust mutex */
 #include <errno.h>
 #include <signal.h>
+#include <stdarg.h>                     /* va_list（admin_printf） */
+#include <stddef.h>                     /* offsetof */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,9 +110,136 @@
 /* ※このコードでは open() を使っているので本来 <fcntl.h> が必要（O_RDWR/O_CREAT） */
 #include <fcntl.h>                      /* ★追加：open(), O_RDWR, O_CREAT の定義 */
 
-/* 生成する子プロセス数（同時ワーカー数の上限に近いイメージ） */
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>                  /* SSE2 / AVX2 組み込み関数（scan_eol） */
+#endif
+
+/* 最初に生成する子プロセス数 */
 #define NUM_CHILD 2
 
+/* prefork マスターの既定値（引数・設定ファイルで変えられる。CPU 数が多ければ conf_defaults で増やす） */
+#define MIN_SPARE       2               /* 待機中の子をこれ以上に保つ（CPU 数） */
+#define MAX_SPARE       4               /* 待機中の子がこれを超えたら引退させる（CPU 数 * 2） */
+#define MAX_CHILDREN    32              /* 子の総数の上限（CPU 数 * 8） */
+#define MAX_REQUESTS    1000            /* 1 つの子が処理する接続数の上限（0 なら無制限） */
+#define BOARD_SLOTS     256             /* スコアボードの大きさ（max_children の上限） */
+
+int g_min_spare = MIN_SPARE;
+int g_max_spare = MAX_SPARE;
+int g_max_children = MAX_CHILDREN;
+long g_max_requests = MAX_REQUESTS;
+
+/* accept ごとに接続元を表示するなら 1（設定 verbose、既定 0） */
+int g_verbose = 0;
+
+/*
+ * スコアボード（fork 前に無名共有メモリに置き、親子で同じものを見る）
+ * - 子は自分のスロットの state / requests だけを書く
+ * - 親は pid / retire を書き、全スロットを読んで集計する
+ * - 1 つの int を書くだけなのでロックは使わない（多少古い値を読んでも次の見回りで直る）
+ */
+#define SLOT_EMPTY      0               /* 空き */
+#define SLOT_STARTING   1               /* fork 直後（まだ accept_loop に入っていない） */
+#define SLOT_IDLE       2               /* ロック待ち / accept 待ち */
+#define SLOT_BUSY       3               /* 接続を処理中 */
+#define SLOT_EXITING    4               /* 終了処理中（recycle / retire） */
+
+struct board_slot {
+    volatile pid_t pid;
+    volatile int state;
+    volatile int retire;                /* 親が 1 にしたら次の区切りで終了する */
+    volatile long requests;             /* この子が処理した接続数 */
+};
+struct board_slot *g_board = NULL;
+
+/* 親の集計（親プロセスだけが使う。g_handled は回収した子が処理した接続数の累計） */
+long g_spawned, g_crashed, g_exited, g_handled;
+
+/*
+ * pass モード用（親プロセスだけが使う）
+ * - g_chan[i] : スロット i の worker へ fd を送る socketpair の親側（無ければ -1）
+ * - g_sent[i] : スロット i の worker へ渡した接続の累計（処理済みは g_board[i].requests）
+ */
+#define PASS_BATCH      16              /* 1 回の accept ループ / sendmsg でまとめる接続数の上限 */
+#define PASS_MAX_CONN   1024            /* 1 つの worker が同時に持つ接続数の上限 */
+int g_chan[BOARD_SLOTS];
+long g_sent[BOARD_SLOTS];
+int g_pass_next;                        /* 負荷が同じ worker の間で順番に回すための開始位置 */
+
+/* グレースフル停止（drain。親プロセスが行う）
+ *
+ * SIGTERM / SIGINT を受けたら（term_handler が g_term_sig を立てる）、見回りループが次の順で止める：
+ * 1) 子の補充・増減をやめ、listen ソケットで新しい接続を受けないようにする
+ *    - lockf / mutex：全スロットに retire を立ててから listen を shutdown する
+ *      （listen は子と共有しているので close だけでは閉じない。shutdown は全員の分が閉じる）
+ *      → SIGUSR1 でロック待ち / accept から起こし、待機中の子はそのまま終了する
+ *    - pass：親が listen を閉じ、worker へのチャネルも閉じる
+ *      （worker は渡し済みの接続を最後まで処理してから終了する）
+ * 2) 処理中の子は今の接続が終わるまで動かし、終わった子を回収する
+ * 3) 子が 0 になったら終了。g_drain_timeout 秒（既定 DRAIN_TIMEOUT、設定 drain_timeout）を
+ *    過ぎたら残りの子に SIGTERM を送って終了する
+ * - 途中経過（残りの子と接続の数、経過時間）を約 1 秒ごとに表示する
+ * - g_drain_start が 0 でなければ drain 中
+ */
+#define DRAIN_TIMEOUT   (30)
+
+int g_drain_timeout = DRAIN_TIMEOUT;
+volatile sig_atomic_t g_term_sig = 0;   /* 受けた SIGTERM / SIGINT（0 = まだ） */
+volatile sig_atomic_t g_hup = 0;        /* SIGHUP を受けた（設定を読み直す） */
+double g_drain_start = 0.0;     /* drain を始めた時刻（CLOCK_MONOTONIC、0 = 通常運転） */
+double g_drain_report = 0.0;    /* 最後に途中経過を表示した時刻 */
+
+/* 単調増加時計の現在値（秒） */
+double
+now_sec(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec + (double) ts.tv_nsec / 1e9);
+}
+
+/* drain を始める（sig：受けたシグナル / 0 = 管理用ソケットから、nconn：その時点の接続数） */
+void
+drain_begin(int sig, int nconn)
+{
+    g_drain_start = g_drain_report = now_sec();
+    if (sig == 0) {
+        (void) fprintf(stderr, "drain:admin, stop accepting, conns=%d, timeout=%ds\n",
+                       nconn, g_drain_timeout);
+    } else {
+        (void) fprintf(stderr, "drain:signal %d, stop accepting, conns=%d, timeout=%ds\n",
+                       sig, nconn, g_drain_timeout);
+    }
+}
+
+/* drain を終えてよいか調べる（nchild：残っている子、nconn：処理中の接続）
+ *
+ * 戻り値：1 = 終了してよい（子が 0、または期限切れ） / 0 = まだ待つ
+ */
+int
+drain_check(int nchild, int nconn)
+{
+    double now;
+
+    now = now_sec();
+    if (nchild == 0) {
+        (void) fprintf(stderr, "drain:done in %.1fs\n", now - g_drain_start);
+        return (1);
+    }
+    if (now - g_drain_start >= g_drain_timeout) {
+        (void) fprintf(stderr, "drain:deadline, terminating %d children (conns=%d)\n",
+                       nchild, nconn);
+        return (1);
+    }
+    if (now - g_drain_report >= 1.0) {
+        g_drain_report = now;
+        (void) fprintf(stderr, "drain:children=%d conns=%d elapsed=%.1fs\n",
+                       nchild, nconn, now - g_drain_start);
+    }
+    return (0);
+}
+
 /*
  * ロック用のファイル名。
  * - open() で FD を得て、その FD に対して lockf() で排他する。
@@ -58,10 +251,170 @@
 /* ロック用ファイルディスクリプタ（全プロセスで共有される “同じオープンファイル”） */
 int g_lock_fd = -1;
 
+/* ロックの方式 */
+#define LOCK_LOCKF      0               /* ファイルロック（元の方式） */
+#define LOCK_MUTEX      1               /* 共有メモリ上の robust mutex */
+#define LOCK_PASS       2               /* ロックなし：親が accept して SCM_RIGHTS で渡す */
+int g_lock_mode = LOCK_LOCKF;
+
+/*
+ * mutex モードで子プロセス間に共有する領域（fork 前に mmap する）
+ * - owner     : いまロックを握っている子の pid（親の監視表示用。0 なら誰も握っていない）
+ * - recovered : EOWNERDEAD から回復した回数
+ */
+struct accept_lock_shm {
+    pthread_mutex_t mutex;
+    volatile pid_t owner;
+    volatile long recovered;
+};
+struct accept_lock_shm *g_lock_shm = NULL;
+
+/* 接続ごとの受信の持ち越しと送り残し（echo_once が使う）
+ * - buf[0..len)：まだ改行の届いていない行の途中（次の recv はこの後ろに読む）
+ * - cr         ：前の recv が CR で終わった（次の先頭の LF は同じ区切り）
+ * - eof        ：相手が閉じた（送り残しを送り切ったら閉じる）
+ * - out[0..outlen)：送信バッファが一杯で送れなかった応答（ノンブロッキングの接続だけ。
+ *                  送り切るまで次の要求は読まない）
+ */
+struct line_buf {
+    char buf[512];
+    size_t len;
+    int cr;
+    int eof;
+    char *out;
+    size_t outlen, outcap;
+};
+
 /* プロトタイプ宣言（このコードは関数が後ろにあるので宣言が必要） */
-void accept_loop(int soc);
+void accept_loop(int soc, int slot);
+int spawn_child(int soc);
+int accept_lock_init(void);
+int accept_lock(void);
+int accept_unlock(void);
 void send_recv_loop(int acc);
-size_t mystrlcat(char *dst, const char *src, size_t size);
+int echo_once(int acc, struct line_buf *lb);
+void pass_worker(int chan, int slot);
+void admin_child(void);
+
+/* 接続単位の TCP チューニング（プロファイル）
+ *
+ * 起動引数で 1 つ選ぶ（server7 port [latency|throughput|churn|none] ...、既定は none = SO_REUSEADDR のみ）。
+ * ポート番号の次に書き、省略できる（profile_arg）。
+ *
+ * - latency    : TCP_NODELAY（Nagle を切って小さな応答をすぐ出す）
+ *                TCP_QUICKACK（遅延 ACK をやめる。カーネルが自動で戻すので受信のたびに付け直す）
+ *                TCP_NOTSENT_LOWAT を小さく（未送信データを溜め込まず、書ける通知を早く返す）
+ * - throughput : SO_SNDBUF / SO_RCVBUF を大きく（ウィンドウを広げて 1 回あたりの転送量を増やす）
+ *                応答を複数回の write で組み立てるときは TCP_CORK で 1 セグメントにまとめる
+ *                （このサーバは行ごとの応答を 1 回の writev にしているので CORK は要らない）
+ * - churn      : TCP_DEFER_ACCEPT（最初のデータが届くまで accept を起こさない）
+ *                TCP_FASTOPEN（SYN に載ったデータを受け付ける。sysctl net.ipv4.tcp_fastopen の
+ *                2 のビットが立っていないと効かない）
+ *                listen のバックログを大きく（実際は net.core.somaxconn で頭打ち）
+ *
+ * - listen ソケットに付けた TCP_NODELAY / TCP_NOTSENT_LOWAT / SO_SNDBUF / SO_RCVBUF は
+ *   accept した接続に引き継がれる（Linux）。引き継がれない TCP_QUICKACK だけ tune_accepted で付ける
+ * - SO_RCVBUF はウィンドウスケールが決まる SYN より前（listen の前）に付ける必要がある
+ * - 効果の比較は tune-bench（ループバックで応答遅延・転送速度・接続の回転を計る）
+ */
+#define PROFILE_NONE        (0)
+#define PROFILE_LATENCY     (1)
+#define PROFILE_THROUGHPUT  (2)
+#define PROFILE_CHURN       (3)
+
+const char *g_profile_name[] = { "none", "latency", "throughput", "churn" };
+
+int g_profile = PROFILE_NONE;
+
+#define TUNE_NOTSENT_LOWAT  (16 * 1024)         /* latency：未送信データの上限 */
+#define TUNE_BUFSZ          (4 * 1024 * 1024)   /* throughput：送受信バッファ（wmem_max / rmem_max で頭打ち） */
+#define TUNE_DEFER_ACCEPT   (1)                 /* churn：データを待つ秒数 */
+#define TUNE_FASTOPEN_QLEN  (256)               /* churn：TFO の保留キュー */
+#define TUNE_BACKLOG        (65535)             /* churn：listen のバックログ */
+
+/* プロファイル名 → 番号（知らない名前なら -1） */
+int
+profile_lookup(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(g_profile_name) / sizeof(g_profile_name[0])); i++) {
+        if (strcmp(name, g_profile_name[i]) == 0) {
+            return (i);
+        }
+    }
+    return (-1);
+}
+
+/* 引数のポート番号の次がプロファイル名なら取り出し、後ろの引数を 1 つ前に詰める
+ * （省略できる。詰めるので、後ろの引数はプロファイルを書かないときと同じ位置で読める） */
+void
+profile_arg(int *argc, char *argv[])
+{
+    int i;
+
+    if (*argc > 2 && profile_lookup(argv[2]) != -1) {
+        g_profile = profile_lookup(argv[2]);
+        for (i = 2; i < *argc - 1; i++) {
+            argv[i] = argv[i + 1];
+        }
+        argv[--*argc] = NULL;
+    }
+    (void) fprintf(stderr, "profile=%s\n", g_profile_name[g_profile]);
+}
+
+/* listen ソケットにプロファイルを付ける（bind / listen の前に呼ぶ。失敗は表示して続行） */
+void
+tune_listen(int soc)
+{
+    int opt;
+
+    switch (g_profile) {
+    case PROFILE_LATENCY:
+        opt = 1;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_NODELAY)");
+        }
+        opt = TUNE_NOTSENT_LOWAT;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_NOTSENT_LOWAT)");
+        }
+        break;
+    case PROFILE_THROUGHPUT:
+        opt = TUNE_BUFSZ;
+        if (setsockopt(soc, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(SO_SNDBUF)");
+        }
+        if (setsockopt(soc, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(SO_RCVBUF)");
+        }
+        break;
+    case PROFILE_CHURN:
+        opt = TUNE_DEFER_ACCEPT;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_DEFER_ACCEPT)");
+        }
+        opt = TUNE_FASTOPEN_QLEN;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_FASTOPEN, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_FASTOPEN)");
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* accept した接続 / 受信した直後の接続に、引き継がれない分を付ける */
+void
+tune_accepted(int acc)
+{
+    int opt;
+
+    if (g_profile == PROFILE_LATENCY) {
+        opt = 1;
+        (void) setsockopt(acc, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt));
+    }
+}
 
 /* サーバソケットの準備（listen まで） */
 int
@@ -120,6 +473,9 @@ server_socket(const char *portnm)
         return (-1);
     }
 
+    /* プロファイルの TCP オプション（バッファの大きさは SYN より前に決めておく） */
+    tune_listen(soc);
+
     /* ソケットにアドレスを割り当て（待受ポートを確保） */
     if (bind(soc, res0->ai_addr, res0->ai_addrlen) == -1) {
         perror("bind");
@@ -128,8 +484,8 @@ server_socket(const char *portnm)
         return (-1);
     }
 
-    /* listen：待受状態へ。SOMAXCONN はバックログの上限（OS依存） */
-    if (listen(soc, SOMAXCONN) == -1) {
+    /* listen：待受状態へ。SOMAXCONN はバックログの上限（OS依存。churn はもっと大きく頼む） */
+    if (listen(soc, g_profile == PROFILE_CHURN ? TUNE_BACKLOG : SOMAXCONN) == -1) {
         perror("listen");
         (void) close(soc);
         freeaddrinfo(res0);
@@ -140,13 +496,242 @@ server_socket(const char *portnm)
     return (soc);
 }
 
+/* 接続元アドレス文字列の最大長（"IPv6アドレス:ポート" + NUL） */
+#define PEER_STRLEN (INET6_ADDRSTRLEN + 8)
+
+/* 10 進数の書き出し（format_peer の下請け） */
+char *
+put_dec(char *p, unsigned int v)
+{
+    char tmp[10];
+    int n;
+
+    n = 0;
+    do {
+        tmp[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0) {
+        *p++ = tmp[--n];
+    }
+    return (p);
+}
+
+/* 接続元アドレスの文字列化（getnameinfo を使わない高速版）
+ *
+ * ss  : accept で得た生のアドレス（AF_INET / AF_INET6）
+ * buf : 出力先（PEER_STRLEN バイト以上）
+ *
+ * 出力形式は getnameinfo(NI_NUMERICHOST | NI_NUMERICSERV) の host と port を
+ * ':' でつないだもの（"127.0.0.1:50000"）と同じ。
+ *
+ * - getnameinfo は NSS/ロケールを経由し、内部でも書式化を行うので accept 毎に呼ぶと重い
+ * - ここでは 10 進/16 進の変換を手で書き、malloc も snprintf も使わない
+ * - IPv6 は RFC 5952 に従い、最長の 0 の連続（2 グループ以上）を "::" に縮める
+ *
+ * 戻り値：書き込んだ文字数（NUL を除く）
+ */
+size_t
+format_peer(const struct sockaddr_storage *ss, char *buf)
+{
+    static const char hex[] = "0123456789abcdef";
+    const struct sockaddr_in *sin;
+    const struct sockaddr_in6 *sin6;
+    const unsigned char *a;
+    unsigned int port, w;
+    int i, j, best, bestlen, shift;
+    char *p;
+
+    p = buf;
+    switch (ss->ss_family) {
+    case AF_INET:
+        sin = (const struct sockaddr_in *) ss;
+        a = (const unsigned char *) &sin->sin_addr;
+        for (i = 0; i < 4; i++) {
+            if (i > 0) {
+                *p++ = '.';
+            }
+            p = put_dec(p, a[i]);
+        }
+        port = ntohs(sin->sin_port);
+        break;
+
+    case AF_INET6:
+        sin6 = (const struct sockaddr_in6 *) ss;
+        a = sin6->sin6_addr.s6_addr;
+
+        /* 最長の 0 グループの連続を探す */
+        best = -1;
+        bestlen = 0;
+        for (i = 0; i < 8; i = j + 1) {
+            for (j = i; j < 8 && a[2 * j] == 0 && a[2 * j + 1] == 0; j++)
+                ;
+            if (j - i >= 2 && j - i > bestlen) {
+                best = i;
+                bestlen = j - i;
+            }
+        }
+
+        if (best == 0
+            && (bestlen == 6 || (bestlen == 5 && a[10] == 0xff && a[11] == 0xff))) {
+            /* IPv4 射影/互換アドレス（::ffff:a.b.c.d, ::a.b.c.d）は末尾 32bit を 10 進で書く
+             * （inet_ntop/getnameinfo と同じ判定） */
+            *p++ = ':';
+            *p++ = ':';
+            if (bestlen == 5) {
+                (void) memcpy(p, "ffff:", 5);
+                p += 5;
+            }
+            for (j = 12; j < 16; j++) {
+                if (j > 12) {
+                    *p++ = '.';
+                }
+                p = put_dec(p, a[j]);
+            }
+        } else {
+            for (i = 0; i < 8; i++) {
+                if (i == best) {
+                    *p++ = ':';
+                    *p++ = ':';
+                    i += bestlen - 1;
+                    continue;
+                }
+                if (i > 0 && i != best + bestlen) {
+                    *p++ = ':';
+                }
+                w = ((unsigned int) a[2 * i] << 8) | a[2 * i + 1];
+                for (shift = 12; shift > 0 && ((w >> shift) & 0xf) == 0; shift -= 4)
+                    ;
+                for (; shift >= 0; shift -= 4) {
+                    *p++ = hex[(w >> shift) & 0xf];
+                }
+            }
+        }
+        port = ntohs(sin6->sin6_port);
+        break;
+
+    default:
+        *p++ = '?';
+        port = 0;
+        break;
+    }
+
+    *p++ = ':';
+    p = put_dec(p, port);
+    *p = '\0';
+    return ((size_t) (p - buf));
+}
+
+/*
+ * accept_lock_init()
+ *   accept 直列化用のロックを準備する（fork 前に親が 1 回だけ呼ぶ）
+ *
+ * lockf モード：
+ *   ロックファイルを open して FD を得る。fork 後、子プロセスも同じ FD
+ *   （同じ open file description）を引き継ぐのでプロセス間排他として機能する。
+ *   ファイル名はすぐ unlink して “名前だけ消す”（実体は FD が閉じられるまで残る）。
+ *
+ * mutex モード：
+ *   無名共有メモリに mutex を置く。
+ *   - PTHREAD_PROCESS_SHARED : 別プロセス（fork した子）からも使える
+ *   - PTHREAD_MUTEX_ROBUST   : 持ち主が死んだら次の取得者に EOWNERDEAD で知らせる
+ *   MAP_SHARED なので fork 後も親子で同じ物理ページを見る（コピーされない）。
+ */
+int
+accept_lock_init(void)
+{
+    pthread_mutexattr_t attr;
+    int err;
+
+    if (g_lock_mode == LOCK_LOCKF) {
+        if ((g_lock_fd = open(LOCK_FILE, O_RDWR | O_CREAT, 0666)) == -1) {
+            perror("open");
+            return (-1);
+        }
+        (void) unlink(LOCK_FILE);
+        return (0);
+    }
+
+    if ((g_lock_shm = mmap(NULL, sizeof(*g_lock_shm), PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        perror("mmap");
+        g_lock_shm = NULL;
+        return (-1);
+    }
+    (void) pthread_mutexattr_init(&attr);
+    (void) pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    (void) pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    if ((err = pthread_mutex_init(&g_lock_shm->mutex, &attr)) != 0) {
+        (void) fprintf(stderr, "pthread_mutex_init:%s\n", strerror(err));
+        (void) pthread_mutexattr_destroy(&attr);
+        return (-1);
+    }
+    (void) pthread_mutexattr_destroy(&attr);
+    g_lock_shm->owner = 0;
+    g_lock_shm->recovered = 0;
+    return (0);
+}
+
+/*
+ * accept_lock()
+ *   ロックを取る（取れるまで待つ）。成功 0 / 失敗 -1
+ *
+ * mutex モードで EOWNERDEAD が返ったとき：
+ *   - ロックは「取れている」が、前の持ち主が途中で死んだことを意味する
+ *   - このロックが守っているのは accept() の直列化だけで、共有データの整合性を
+ *     直す必要は無いので、そのまま pthread_mutex_consistent() で回復させる
+ *   - consistent を呼ばずに解放すると mutex は ENOTRECOVERABLE（二度と使えない）になる
+ */
+int
+accept_lock(void)
+{
+    struct timespec ts;
+    int err;
+
+    if (g_lock_mode == LOCK_LOCKF) {
+        return (lockf(g_lock_fd, F_LOCK, 0));
+    }
+
+    /*
+     * futex の待ちはシグナルでは中断されないので、1 秒で一度戻って
+     * 親からの引退指示（retire）を見られるように timedlock にする
+     */
+    (void) clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += 1;
+    if ((err = pthread_mutex_timedlock(&g_lock_shm->mutex, &ts)) == ETIMEDOUT) {
+        errno = ETIMEDOUT;
+        return (-1);
+    } else if (err == EOWNERDEAD) {
+        (void) fprintf(stderr, "<%d>前の持ち主<%d>が死んでいたのでロックを回復\n",
+                       getpid(), (int) g_lock_shm->owner);
+        g_lock_shm->recovered++;
+        (void) pthread_mutex_consistent(&g_lock_shm->mutex);
+    } else if (err != 0) {
+        (void) fprintf(stderr, "pthread_mutex_lock:%s\n", strerror(err));
+        return (-1);
+    }
+    g_lock_shm->owner = getpid();
+    return (0);
+}
+
+/* accept_unlock() ロックを放す。成功 0 / 失敗 -1 */
+int
+accept_unlock(void)
+{
+    if (g_lock_mode == LOCK_LOCKF) {
+        return (lockf(g_lock_fd, F_ULOCK, 0));
+    }
+    g_lock_shm->owner = 0;
+    return (pthread_mutex_unlock(&g_lock_shm->mutex) == 0 ? 0 : -1);
+}
+
 /*
  * accept_loop（子プロセス側のメインループ）
  *
  * アルゴリズムの要点：
  * - 複数の子プロセスが同じ soc を共有している（fork 後も FD はコピーされる）
  * - そのまま全員が accept() をすると “同時に accept に突っ込む” ことになる
- * - ここでは lockf を使い、「accept に入る前に排他ロック」を取る
+ * - ここでは lockf（または共有 mutex）を使い、「accept に入る前に排他ロック」を取る
  *   → accept を呼べるのは常に 1 プロセスのみ（直列化）
  *
  * lockf の使い方：
@@ -157,24 +742,52 @@ server_socket(const char *portnm)
  * ここでの “ロックの役割”：
  * - OSの accept 実装・wake-up の挙動に依存しない形で、
  *   「どの子が accept を処理したか」を明確に観察できるようにする。
+ *
+ * スコアボード（slot は自分のスロット番号）：
+ * - ロック待ち・accept 待ちの間は SLOT_IDLE、接続を処理している間は SLOT_BUSY
+ * - 親が retire を立てたら（SIGUSR1 でロック待ち/accept から起こされる）ループを抜ける
+ * - 処理中は SIGUSR1 をブロックしておき、recv/send が EINTR で切れないようにする
+ * - max_requests 個処理したら自分でループを抜ける（recycle）
  */
 void
-accept_loop(int soc)
+accept_loop(int soc, int slot)
 {
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+    char pbuf[PEER_STRLEN];
     struct sockaddr_storage from;
+    struct board_slot *me;
+    sigset_t busy_mask;
     int acc;
     socklen_t len;
 
+    me = &g_board[slot];
+    (void) sigemptyset(&busy_mask);
+    (void) sigaddset(&busy_mask, SIGUSR1);
+
     for (;;) {
+        if (me->retire) {
+            (void) fprintf(stderr, "<%d>引退（retire）\n", getpid());
+            break;
+        }
+        me->state = SLOT_IDLE;
+
         /* ====== accept に入る前に排他制御 ====== */
         (void) fprintf(stderr, "<%d>ロック獲得開始\n", getpid());
 
         /*
-         * F_LOCK はブロッキング：他プロセスがロック中ならここで待つ。
+         * F_LOCK（mutex なら pthread_mutex_lock）はブロッキング：他プロセスがロック中ならここで待つ。
          * つまり “accept 待ち行列” に入る前に “ロック待ち行列” を作っている。
          */
-        (void) lockf(g_lock_fd, F_LOCK, 0);
+        if (accept_lock() == -1) {
+            /* EINTR（SIGUSR1）/ ETIMEDOUT（mutex）は retire を見直すだけ */
+            if (errno != EINTR && errno != ETIMEDOUT) {
+                (void) sleep(1);
+            }
+            continue;
+        }
+        if (me->retire) {
+            (void) accept_unlock();
+            continue;
+        }
 
         (void) fprintf(stderr, "<%d>ロック獲得！\n", getpid());
 
@@ -184,22 +797,25 @@ accept_loop(int soc)
             /*
              * accept が失敗するケース：
              * - EINTR : シグナル割り込み（ここでは継続したい）
+             * - EINVAL: drain で親が listen を shutdown した（retire も立っている）
              * - それ以外：エラー
              * 失敗した場合でもロックは必ず解放する必要がある。
              */
-            if (errno != EINTR) {
+            if (errno != EINTR && !me->retire) {
                 perror("accept");
             }
             (void) fprintf(stderr, "<%d>ロック解放\n", getpid());
-            (void) lockf(g_lock_fd, F_ULOCK, 0);
+            (void) accept_unlock();
         } else {
-            /* 接続元のIP/portをログに出す（観察用） */
-            (void) getnameinfo((struct sockaddr *) &from, len,
-                               hbuf, sizeof(hbuf),
-                               sbuf, sizeof(sbuf),
-                               NI_NUMERICHOST | NI_NUMERICSERV);
+            /* ここから処理が終わるまでは busy（引退の合図は後回し） */
+            (void) sigprocmask(SIG_BLOCK, &busy_mask, NULL);
+            me->state = SLOT_BUSY;
 
-            (void) fprintf(stderr, "<%d>accept:%s:%s\n", getpid(), hbuf, sbuf);
+            /* 接続元の表示は verbose のときだけ（fork 時の値を使う） */
+            if (g_verbose) {
+                (void) format_peer(&from, pbuf);
+                (void) fprintf(stderr, "<%d>accept:%s\n", getpid(), pbuf);
+            }
 
             /*
              * accept が完了したら “すぐロックを解放” するのがポイント：
@@ -209,178 +825,1742 @@ accept_loop(int soc)
              *   その後の I/O 処理は各プロセスが並列に実行できるようにする。
              */
             (void) fprintf(stderr, "<%d>ロック解放\n", getpid());
-            (void) lockf(g_lock_fd, F_ULOCK, 0);
+            (void) accept_unlock();
 
             /* 接続（acc）に対して送受信処理（この間、別の子が accept 可能） */
             send_recv_loop(acc);
 
             /* 1接続の処理が終わったら acc をクローズ（プロセスが責務を持つ） */
             (void) close(acc);
+
+            me->requests++;
+            (void) sigprocmask(SIG_UNBLOCK, &busy_mask, NULL);
+
+            /* 決まった数を処理したら終了して、親に新しい子と入れ替えてもらう */
+            if (g_max_requests > 0 && me->requests >= g_max_requests) {
+                (void) fprintf(stderr, "<%d>%ld 接続を処理したので終了（recycle）\n",
+                               getpid(), me->requests);
+                break;
+            }
         }
     }
+    me->state = SLOT_EXITING;
 }
 
-/* サイズ指定文字列連結（strlcat 相当：バッファサイズを超えないように連結） */
+/* 行区切り（CR/LF）の一括検索
+ *
+ * buf[0..len) に含まれる '\r' / '\n' の位置（先頭からのオフセット）を
+ * 出現順に off[] へ最大 max 個書き込み、書き込んだ個数を返す。
+ *
+ * strpbrk(buf, "\r\n") との違い：
+ * - NUL 終端を必要としない（recv で得た len をそのまま渡せる）
+ * - 1 回の走査ですべての区切り位置が得られる（行の切り出しを上位で行える）
+ * - x86 では 16/32 バイト単位で比較する SIMD 版を使う
+ *
+ * 実装は 3 種類あり、scan_eol_init() で CPU を見て g_scan_eol に設定する：
+ * - scan_eol_scalar : 1 バイトずつ（どの CPU でも動く）
+ * - scan_eol_sse2   : 16 バイトずつ比較 → movemask でビット列にして位置を取り出す
+ * - scan_eol_avx2   : 32 バイトずつ（AVX2 がある CPU のみ）
+ */
 size_t
-mystrlcat(char *dst, const char *src, size_t size)
+scan_eol_scalar(const char *buf, size_t len, size_t *off, size_t max)
 {
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
+    size_t i, n;
 
-    /* dst の終端まで進める（size を超えない範囲で） */
-    for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--)
-        ;
-    dlen = (size_t)(pd - dst);
-
-    /* dst が既に size いっぱいなら連結できない（必要長だけ返す） */
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
+    for (i = 0, n = 0; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
     }
+    return (n);
+}
 
-    /* dst の末尾（終端 NUL を置ける位置まで） */
-    pde = dst + size - 1;
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+size_t
+scan_eol_sse2(const char *buf, size_t len, size_t *off, size_t max)
+{
+    __m128i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
 
-    /* src を dst にコピー（終端を超えない） */
-    for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
+    cr = _mm_set1_epi8('\r');
+    lf = _mm_set1_epi8('\n');
+    for (i = 0, n = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (buf + i));
+        mask = (unsigned int) _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        /* 立っているビット = 区切り文字の位置（下位ビットから順に取り出す） */
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
+            }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
     }
-
-    /* NUL 終端する（残りを 0 で埋める） */
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
+    /* 16 バイトに満たない残りは 1 バイトずつ */
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
     }
-
-    /* src の長さを数える（戻り値計算用） */
-    while (*ps++)
-        ;
-    return (dlen + (size_t)(ps - src - 1));
+    return (n);
 }
 
-/*
- * send_recv_loop（子プロセスが “担当した接続” を処理する）
- *
- * 重要：
- * - ここは accept のロックとは無関係に動く（並列に動作可能）
- * - 各子プロセスは自分が accept した acc だけを触る
- */
-void
-send_recv_loop(int acc)
+__attribute__((target("avx2")))
+size_t
+scan_eol_avx2(const char *buf, size_t len, size_t *off, size_t max)
 {
-    char buf[512], *ptr;
-    ssize_t len;
+    __m256i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
 
-    for (;;) {
-        /* 受信（TCPストリームなので “1回の recv が1行” とは限らないが教材では簡略化） */
-        if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
-            perror("recv");
-            break;
+    cr = _mm256_set1_epi8('\r');
+    lf = _mm256_set1_epi8('\n');
+    for (i = 0, n = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        mask = (unsigned int) _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
+            }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
         }
-        if (len == 0) {
-            /* 相手が close した（EOF） */
-            (void) fprintf(stderr, "<%d>recv:EOF\n", getpid());
-            break;
+    }
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
         }
+    }
+    return (n);
+}
+#endif
 
-        /* 受信データを文字列として扱うために終端（※len==512だと範囲外なので本来防御が必要） */
-        buf[len] = '\0';
+/* 使用する実装（scan_eol_init で決まる。スレッド生成前に 1 回だけ呼ぶこと） */
+size_t (*g_scan_eol)(const char *, size_t, size_t *, size_t) = scan_eol_scalar;
+const char *g_scan_eol_name = "scalar";
 
-        /* 改行を切ってログ表示しやすくする */
-        if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-            *ptr = '\0';
-        }
-        (void) fprintf(stderr, "<%d>[client]%s\n", getpid(), buf);
+void
+scan_eol_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_scan_eol = scan_eol_avx2;
+        g_scan_eol_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        g_scan_eol = scan_eol_sse2;
+        g_scan_eol_name = "sse2";
+    }
+#endif
+}
 
-        /* 応答を作って返す（元文字列 + ":OK\r\n"） */
-        (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-        len = (ssize_t) strlen(buf);
+/* 応答の末尾に付ける文字列（行ごとに iovec で後ろに並べる。受信バッファに場所は取らない） */
+#define RESP_SUFFIX     ":OK\r\n"
+#define RESP_SUFFIX_LEN (sizeof(RESP_SUFFIX) - 1)
 
-        if (send(acc, buf, (size_t)len, 0) == -1) {
-            perror("send");
-            break;
-        }
-    }
+/* 長さ付きバッファ（応答組み立て用）
+ *
+ * base[0 .. size) の中で、データは base[off .. off+len) にある。
+ *
+ *   base                off            off+len                 size
+ *    |<-- headroom -->|<---- data ---->|<---- tailroom ---->|
+ *
+ * mystrlcat + strlen との違い：
+ * - 長さを持っているので、連結のたびに NUL を探して先頭から数え直さない（O(1) で追記）
+ * - NUL 終端を必要としないので、recv したバイト列をそのまま扱える
+ * - 先頭側にも空き（headroom）を取れるので、ヘッダ等を後から前に付けられる
+ * - データ部をそのまま iovec にして writev に渡せる
+ */
+struct mbuf {
+    char *base;                         /* 領域の先頭 */
+    size_t size;                        /* 領域の大きさ */
+    size_t off;                         /* データの開始位置 */
+    size_t len;                         /* データ長 */
+};
+
+#define MBUF_DATA(m_)     ((m_)->base + (m_)->off)
+#define MBUF_TAIL(m_)     ((m_)->base + (m_)->off + (m_)->len)
+#define MBUF_HEADROOM(m_) ((m_)->off)
+#define MBUF_TAILROOM(m_) ((m_)->size - (m_)->off - (m_)->len)
+
+/* 領域 base[0..size) を、先頭に headroom バイト空けた空のバッファとして使い始める */
+void
+mbuf_init(struct mbuf *m, char *base, size_t size, size_t headroom)
+{
+    m->base = base;
+    m->size = size;
+    m->off = headroom < size ? headroom : size;
+    m->len = 0;
 }
 
+/* 末尾に n バイト追記する（tailroom が足りなければ何もせず -1） */
 int
-main(int argc, char *argv[])
+mbuf_append(struct mbuf *m, const void *src, size_t n)
 {
-    int i, soc;
-    pid_t pid;
-
-    /* 引数チェック */
-    if (argc <= 1) {
-        (void) fprintf(stderr, "server7 port\n");
-        return (EX_USAGE);
+    if (n > MBUF_TAILROOM(m)) {
+        return (-1);
     }
+    (void) memcpy(MBUF_TAIL(m), src, n);
+    m->len += n;
+    return (0);
+}
 
-    /* listen 用ソケットを準備（親が1回だけ作る → fork 後は子と共有） */
-    if ((soc = server_socket(argv[1])) == -1) {
-        (void) fprintf(stderr, "server_socket(%s):error\n", argv[1]);
-        return (EX_UNAVAILABLE);
+/* 先頭に n バイト付け足す（headroom が足りなければ何もせず -1） */
+int
+mbuf_prepend(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_HEADROOM(m)) {
+        return (-1);
     }
+    m->off -= n;
+    m->len += n;
+    (void) memcpy(MBUF_DATA(m), src, n);
+    return (0);
+}
 
-    /*
-     * ロックファイルを open して FD を得る
-     * - この FD に対して lockf で排他制御を行う
-     * - fork 後、子プロセスも同じ FD（同じ open file description）を引き継ぐので
-     *   プロセス間排他として機能する
-     */
-    if ((g_lock_fd = open(LOCK_FILE, O_RDWR | O_CREAT, 0666)) == -1) {
-        perror("open");
-        return (EX_UNAVAILABLE);
+/* データ部を iovec に変換する（戻り値は writev に渡す要素数） */
+int
+mbuf_iov(const struct mbuf *m, struct iovec *iov)
+{
+    if (m->len == 0) {
+        return (0);
     }
+    iov[0].iov_base = MBUF_DATA(m);
+    iov[0].iov_len = m->len;
+    return (1);
+}
 
-    /*
-     * ファイル名を unlink して “名前だけ消す”
-     * - 実体（inode）は FD が閉じられるまで残る
-     * - プログラム終了時にファイルが残らず後始末が楽
-     */
-    (void) unlink(LOCK_FILE);
+/* 行ごとの応答（続けて届いた要求の切り出し）
+ *
+ * 1 回の recv には、クライアントが続けて送った複数の要求（行）が入っていることがある。
+ * g_scan_eol で区切りの位置をまとめて求め、1 行ごとに「行 + RESP_SUFFIX」の応答を 1 つずつ返す。
+ * - 区切りは CR / LF / CRLF（CR の直後の LF は同じ区切りとして読み飛ばす）
+ * - 改行で終わらない末尾は 1 行とする（呼び出し側はふつう line_end までしか渡さず、
+ *   行の途中は次の recv まで持ち越す。EOF のときと、改行の無いまま受信バッファが一杯に
+ *   なったときだけ末尾まで渡す）
+ * - 応答は受信バッファ内の行と RESP_SUFFIX を交互に並べた iovec にする（行をコピーしない）
+ *
+ * p[*pos..len) から最大 LINE_BATCH 行を iov[]（2 * LINE_BATCH 個）に並べて *pos を進め、
+ * 並べた応答の合計バイト数を *bytes に入れる。
+ * 戻り値：並べた iovec の数（行数の 2 倍。0 = もう行が無い）
+ */
+#define LINE_BATCH  (64)
 
-    (void) fprintf(stderr, "start %d children\n", NUM_CHILD);
+int
+frame_lines(const char *p, size_t len, size_t *pos, struct iovec *iov, size_t *bytes)
+{
+    size_t off[LINE_BATCH], base, start, e, n, k;
+    int cnt;
 
-    /* 子プロセスを NUM_CHILD 個生成 */
-    for (i = 0; i < NUM_CHILD; i++) {
-        if ((pid = fork()) == 0) {
-            /*
-             * 子プロセス：
-             * - soc と g_lock_fd を共有している
-             * - accept_loop に入り、ロックで accept を直列化しつつ
-             *   自分が取った接続を処理する
-             */
-            accept_loop(soc);
-            _exit(1);
-        } else if (pid > 0) {
-            /* 親プロセス：生成を続けるだけ（この例では accept しない） */
+    start = *pos;
+    /* 前の呼び出しが CR で終わっていれば、続く LF は同じ区切り */
+    if (start > 0 && start < len && p[start - 1] == '\r' && p[start] == '\n') {
+        start++;
+    }
+    cnt = 0;
+    *bytes = 0;
+    if (start >= len) {
+        *pos = len;
+        return (0);
+    }
+    base = start;
+    n = g_scan_eol(p + base, len - base, off, LINE_BATCH);
+    for (k = 0; k <= n; k++) {
+        if (k < n) {
+            e = base + off[k];
+            if (e == start && e > base && p[e] == '\n' && p[e - 1] == '\r') {
+                /* CRLF の LF */
+                start = e + 1;
+                continue;
+            }
+        } else if (n < LINE_BATCH && start < len) {
+            /* 改行で終わらない末尾 */
+            e = len;
         } else {
-            /* fork失敗 */
-            perror("fork");
+            break;
         }
+        iov[cnt].iov_base = (char *) p + start;
+        iov[cnt].iov_len = e - start;
+        iov[cnt + 1].iov_base = RESP_SUFFIX;
+        iov[cnt + 1].iov_len = RESP_SUFFIX_LEN;
+        *bytes += e - start + RESP_SUFFIX_LEN;
+        cnt += 2;
+        start = e < len ? e + 1 : len;
+    }
+    *pos = start;
+    return (cnt);
+}
+
+/* p[0..len) の最後の区切り（CR / LF）の直後の位置（区切りが無ければ 0）
+ *
+ * recv の区切りは行の区切りと一致しないので、ここより後ろ（まだ改行の届いていない行の途中）は
+ * 応答せずに次の recv まで持ち越す
+ */
+size_t
+line_end(const char *p, size_t len)
+{
+    while (len > 0 && p[len - 1] != '\n' && p[len - 1] != '\r') {
+        len--;
+    }
+    return (len);
+}
+
+/* 応答の送り残しを lb->out の後ろに足す（iov[0..n) の skip バイト目から後ろ）。失敗は -1 */
+int
+out_append(struct line_buf *lb, const struct iovec *iov, int n, size_t skip)
+{
+    size_t need, len;
+    char *p;
+    int k;
+
+    need = lb->outlen;
+    for (k = 0; k < n; k++) {
+        need += iov[k].iov_len;
+    }
+    need -= skip;
+    if (need > lb->outcap) {
+        if ((p = realloc(lb->out, need)) == NULL) {
+            perror("realloc");
+            return (-1);
+        }
+        lb->out = p;
+        lb->outcap = need;
+    }
+    for (k = 0; k < n; k++) {
+        if (skip >= iov[k].iov_len) {
+            skip -= iov[k].iov_len;
+            continue;
+        }
+        len = iov[k].iov_len - skip;
+        (void) memcpy(lb->out + lb->outlen, (char *) iov[k].iov_base + skip, len);
+        lb->outlen += len;
+        skip = 0;
+    }
+    return (0);
+}
+
+/* 送り残しを送れるだけ送る（0 = 送り切った / まだ残っている、-1 = エラー） */
+int
+out_flush(int acc, struct line_buf *lb)
+{
+    ssize_t n;
+
+    while (lb->outlen > 0) {
+        if ((n = send(acc, lb->out, lb->outlen, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return (0);
+            }
+            perror("send");
+            return (-1);
+        }
+        lb->outlen -= (size_t) n;
+        (void) memmove(lb->out, lb->out + n, lb->outlen);
+    }
+    return (0);
+}
+
+/*
+ * echo_once(acc, lb)
+ *   接続 acc から 1 回 recv して、受け取った行ごとに 行 + ":OK\r\n" を返す
+ *   戻り値：0 = 続ける / -1 = EOF またはエラー（呼び出し側が close する）
+ *   - send_recv_loop（1 接続をブロッキングで処理）と
+ *     pass_worker（poll で多数の接続を処理）の両方から使う
+ *   - TCP はストリームなので 1 回の recv が 1 行とは限らない。最後の区切りより後ろ（行の途中）は
+ *     lb に残して次の呼び出しで続きを読む（改行の無いまま lb が一杯なら全部を 1 行とする）
+ *   - ノンブロッキングの接続（pass モード）では、読むものが無ければ（EAGAIN）何もせず 0。
+ *     送り切れなかった応答は lb->out に取っておき、次の呼び出しで先に送る
+ *     （残っている間は 0 を返して読まない。呼び出し側は lb->outlen > 0 なら POLLOUT を待つ）
+ */
+int
+echo_once(int acc, struct line_buf *lb)
+{
+    struct mbuf m;
+    struct iovec iov[2 * LINE_BATCH];
+    size_t pos, end, total;
+    ssize_t len, sent;
+    int n, k;
+
+    /* 送り残しがあれば先に送る（送り切るまで次の要求は読まない） */
+    if (lb->outlen > 0) {
+        if (out_flush(acc, lb) == -1) {
+            return (-1);
+        }
+        if (lb->outlen > 0) {
+            return (0);
+        }
+    }
+    if (lb->eof) {
+        return (-1);
+    }
+
+    /* 受信バッファは持ち越した行の途中の後ろから */
+    mbuf_init(&m, lb->buf, sizeof(lb->buf), 0);
+    m.len = lb->len;
+
+    /* 受信 */
+    if ((len = recv(acc, MBUF_TAIL(&m),
+                    MBUF_TAILROOM(&m), 0)) == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+            return (0);
+        }
+        perror("recv");
+        return (-1);
+    }
+    if (len == 0) {
+        /* 相手が close した（EOF）。改行の届かなかった最後の行にも応答する */
+        (void) fprintf(stderr, "<%d>recv:EOF\n", getpid());
+        end = m.len;
+    } else {
+        m.len += (size_t) len;
+        tune_accepted(acc);     /* latency：TCP_QUICKACK を付け直す */
+        /* 最後の区切りまでに応答し、後ろは持ち越す */
+        if ((end = line_end(MBUF_DATA(&m), m.len)) == 0 && MBUF_TAILROOM(&m) == 0) {
+            end = m.len;
+        }
+    }
+
+    /* 1 行ごとに応答する（続けて届いた要求にもそれぞれ返す）
+     * 前の recv が CR で終わっていれば、続く LF は同じ区切りなので読み飛ばす */
+    pos = lb->cr && end > 0 && MBUF_DATA(&m)[0] == '\n' ? 1 : 0;
+    lb->cr = end == m.len && end > 0 && MBUF_DATA(&m)[end - 1] == '\r';
+    while ((n = frame_lines(MBUF_DATA(&m), end, &pos, iov, &total)) > 0) {
+        for (k = 0; k < n; k += 2) {
+            (void) fprintf(stderr, "<%d>[client]%.*s\n", getpid(),
+                           (int) iov[k].iov_len, (char *) iov[k].iov_base);
+        }
+        /* 送り残しがあれば順序を保つため後ろに足すだけ。送れなかった分も取っておく */
+        sent = 0;
+        if (lb->outlen == 0 && (sent = writev(acc, iov, n)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("writev");
+                break;
+            }
+            sent = 0;
+        }
+        if ((size_t) sent < total && out_append(lb, iov, n, (size_t) sent) == -1) {
+            break;
+        }
+    }
+    if (n > 0) {
+        /* 応答を送れなかった */
+        return (-1);
+    }
+    if (len == 0) {
+        /* EOF：送り残しがあれば送り切ってから閉じる */
+        lb->eof = 1;
+        return (lb->outlen > 0 ? 0 : -1);
+    }
+
+    /* 行の途中を先頭に詰める */
+    lb->len = m.len - end;
+    (void) memmove(lb->buf, MBUF_DATA(&m) + end, lb->len);
+    return (0);
+}
+
+/*
+ * send_recv_loop（子プロセスが “担当した接続” を処理する）
+ *
+ * 重要：
+ * - ここは accept のロックとは無関係に動く（並列に動作可能）
+ * - 各子プロセスは自分が accept した acc だけを触る
+ */
+void
+send_recv_loop(int acc)
+{
+    struct line_buf lb;
+
+    (void) memset(&lb, 0, sizeof(lb));
+    while (echo_once(acc, &lb) == 0) {
+    }
+    free(lb.out);
+}
+
+/*
+ * send_fds(chan, fds, n)
+ *   fds[0..n) を 1 回の sendmsg で chan の相手に渡す（SCM_RIGHTS）。成功 0 / 失敗 -1
+ *   - 本文は 1 バイト（個数）だけ。fd は補助データ（cmsg）に並べる
+ *   - 受け取った側には「同じオープンファイルを指す新しい fd 番号」が作られる
+ */
+int
+send_fds(int chan, const int *fds, int n)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * PASS_BATCH)];
+        struct cmsghdr align;
+    } u;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    unsigned char cnt;
+
+    cnt = (unsigned char) n;
+    iov.iov_base = &cnt;
+    iov.iov_len = 1;
+    (void) memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    (void) memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+    if (sendmsg(chan, &msg, MSG_NOSIGNAL) == -1) {
+        perror("sendmsg");
+        return (-1);
+    }
+    return (0);
+}
+
+/*
+ * recv_fds(chan, fds, max)
+ *   send_fds で送られた fd を受け取り fds[] に入れる
+ *   戻り値：受け取った個数 / 0 = 相手（親）が閉じた / -1 = エラー
+ */
+int
+recv_fds(int chan, int *fds, int max)
+{
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * PASS_BATCH)];
+        struct cmsghdr align;
+    } u;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct iovec iov;
+    unsigned char cnt;
+    ssize_t len;
+    int n;
+
+    iov.iov_base = &cnt;
+    iov.iov_len = 1;
+    (void) memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = u.buf;
+    msg.msg_controllen = sizeof(u.buf);
+    if ((len = recvmsg(chan, &msg, MSG_CMSG_CLOEXEC)) <= 0) {
+        if (len == -1 && errno != EINTR) {
+            perror("recvmsg");
+        }
+        return (len == 0 ? 0 : -1);
+    }
+    n = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            n = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+            if (n > max) {
+                n = max;
+            }
+            (void) memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n);
+        }
+    }
+    return (n);
+}
+
+/*
+ * pass_worker(chan, slot)
+ *   pass モードの子プロセス本体：親から渡された接続を poll でまとめて処理する
+ *
+ * アルゴリズム：
+ *   pfd[0] は親とのチャネル、pfd[1..n) が担当中の接続（lb[i] がその受信の持ち越し）
+ *   1) poll で待つ
+ *   2) チャネルが読めたら recv_fds で fd をまとめて受け取り、pfd の末尾に足す
+ *      （EOF なら親が drain に入ったか居なくなったので、チャネルを監視から外す）
+ *   3) 読める（送り残しがあれば書ける）接続ごとに echo_once を 1 回。送り残しがあれば
+ *      その接続は POLLOUT だけを待つ。終わった接続は close して
+ *      スコアボードの requests を +1（親はこれで負荷を知る）、pfd の末尾と入れ替えて詰める
+ *   4) 担当が 0 なら SLOT_IDLE、1 つでもあれば SLOT_BUSY をスコアボードに書く
+ *   5) チャネルが閉じていて担当も 0 になったら終了する（渡し済みの接続は最後まで処理する）
+ */
+void
+pass_worker(int chan, int slot)
+{
+    static struct line_buf lb[PASS_MAX_CONN + 1];
+    struct pollfd pfd[PASS_MAX_CONN + 1];
+    struct board_slot *me;
+    int fds[PASS_BATCH];
+    int i, k, n, nfds;
+
+    me = &g_board[slot];
+    pfd[0].fd = chan;
+    pfd[0].events = POLLIN;
+    nfds = 1;
+    me->state = SLOT_IDLE;
+
+    for (;;) {
+        if (poll(pfd, (nfds_t) nfds, -1) == -1) {
+            if (errno != EINTR) {
+                perror("poll");
+                break;
+            }
+            continue;
+        }
+
+        /* 新しい接続を受け取る */
+        if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+            if ((n = recv_fds(chan, fds, PASS_BATCH)) == 0) {
+                /* poll は負の fd を無視する（以後は担当中の接続だけを待つ） */
+                (void) fprintf(stderr, "<%d>acceptor が閉じた（担当 %d 本を終えたら終了）\n",
+                               getpid(), nfds - 1);
+                pfd[0].fd = -1;
+            }
+            for (k = 0; k < n; k++) {
+                if (nfds > PASS_MAX_CONN) {
+                    /* 上限を超えた分は断る（処理済みとして数え、親の負荷計算を合わせる） */
+                    (void) close(fds[k]);
+                    me->requests++;
+                    continue;
+                }
+                pfd[nfds].fd = fds[k];
+                pfd[nfds].events = POLLIN;
+                pfd[nfds].revents = 0;
+                lb[nfds].len = 0;
+                lb[nfds].cr = 0;
+                lb[nfds].eof = 0;
+                lb[nfds].out = NULL;
+                lb[nfds].outlen = lb[nfds].outcap = 0;
+                nfds++;
+            }
+        }
+
+        /* 担当中の接続を処理する（後ろから見るので詰めても取りこぼさない） */
+        for (i = nfds - 1; i >= 1; i--) {
+            if (pfd[i].revents == 0) {
+                continue;
+            }
+            if (echo_once(pfd[i].fd, &lb[i]) == -1) {
+                (void) close(pfd[i].fd);
+                free(lb[i].out);
+                me->requests++;
+                pfd[i] = pfd[--nfds];
+                lb[i] = lb[nfds];
+                continue;
+            }
+            /* 送り残しがあれば送れるようになるまで読まない */
+            pfd[i].events = lb[i].outlen > 0 ? POLLOUT : POLLIN;
+        }
+        me->state = nfds > 1 ? SLOT_BUSY : SLOT_IDLE;
+        if (pfd[0].fd == -1 && nfds == 1) {
+            break;
+        }
+    }
+    me->state = SLOT_EXITING;
+}
+
+/*
+ * pass_pick()
+ *   いま担当している接続（渡した数 - 処理済み数）がいちばん少ない worker のスロットを返す
+ *   - 同じ負荷なら g_pass_next から順に見て最初のもの（短い接続が 1 本に偏らないように）
+ *   - worker が 1 本も居なければ -1
+ */
+int
+pass_pick(void)
+{
+    long load, best_load;
+    int i, k, best;
+
+    best = -1;
+    best_load = 0;
+    for (k = 0; k < BOARD_SLOTS; k++) {
+        i = (g_pass_next + k) % BOARD_SLOTS;
+        if (g_chan[i] == -1 || g_board[i].state == SLOT_EMPTY) {
+            continue;
+        }
+        load = g_sent[i] - g_board[i].requests;
+        if (best == -1 || load < best_load) {
+            best = i;
+            best_load = load;
+        }
+    }
+    if (best != -1) {
+        g_pass_next = (best + 1) % BOARD_SLOTS;
+    }
+    return (best);
+}
+
+/*
+ * pass_accept(soc)
+ *   pass モードの acceptor：listen（ノンブロッキング）から最大 PASS_BATCH 個 accept して、
+ *   worker ごとにまとめて send_fds で渡す。親側の fd は渡したらすぐ close する
+ *   - 接続は SOCK_NONBLOCK で受ける（O_NONBLOCK はオープンファイルの属性なので、渡した先の
+ *     worker の fd もノンブロッキングになる）
+ */
+void
+pass_accept(int soc)
+{
+    char pbuf[PEER_STRLEN];
+    struct sockaddr_storage from;
+    int acc[PASS_BATCH], who[PASS_BATCH], batch[PASS_BATCH];
+    int i, j, n, nb, w;
+    socklen_t len;
+
+    /* 1) 受け取れるだけ受け取り、それぞれの渡し先を決める */
+    for (n = 0; n < PASS_BATCH; n++) {
+        len = (socklen_t) sizeof(from);
+        if ((acc[n] = accept4(soc, (struct sockaddr *) &from, &len,
+                              SOCK_CLOEXEC | SOCK_NONBLOCK)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept4");
+            }
+            break;
+        }
+        if ((who[n] = pass_pick()) == -1) {
+            (void) close(acc[n]);
+            n--;
+            continue;
+        }
+        g_sent[who[n]]++;
+        if (g_verbose) {
+            (void) format_peer(&from, pbuf);
+            (void) fprintf(stderr, "<<%d>>accept:%s → worker<%d>\n",
+                           getpid(), pbuf, (int) g_board[who[n]].pid);
+        }
+    }
+
+    /* 2) 同じ worker 宛てをまとめて 1 回の sendmsg で渡す */
+    for (i = 0; i < n; i++) {
+        if ((w = who[i]) == -1) {
+            continue;
+        }
+        nb = 0;
+        for (j = i; j < n; j++) {
+            if (who[j] == w) {
+                batch[nb++] = acc[j];
+                who[j] = -1;
+            }
+        }
+        if (send_fds(g_chan[w], batch, nb) == -1) {
+            /* 渡せなかった分は処理済み扱いにして負荷計算を合わせる（接続は切れる） */
+            g_sent[w] -= nb;
+        }
+        for (j = 0; j < nb; j++) {
+            (void) close(batch[j]);
+        }
+    }
+}
+
+/* SIGUSR1 / SIGCHLD 用：何もしない（ブロック中のシステムコールを EINTR で起こすためだけ） */
+void
+wakeup_handler(int sig)
+{
+    (void) sig;
+}
+
+/* SA_RESTART なしでハンドラを登録する（accept / sleep を中断させたい） */
+void
+set_wakeup_handler(int sig)
+{
+    struct sigaction sa;
+
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = wakeup_handler;
+    (void) sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    (void) sigaction(sig, &sa, NULL);
+}
+
+/* SIGTERM / SIGINT 用：受けたシグナルを覚えるだけ（見回りループが drain に入る） */
+void
+term_handler(int sig)
+{
+    g_term_sig = sig;
+}
+
+/* SIGHUP 用：フラグを立てるだけ（見回りループが設定を読み直す） */
+void
+hup_handler(int sig)
+{
+    (void) sig;
+    g_hup = 1;
+}
+
+/*
+ * spawn_child(soc)
+ *   空きスロットを 1 つ取って子プロセスを 1 つ fork する。成功 0 / 失敗 -1
+ *   - スロットは fork 前に SLOT_STARTING にしておく（親の集計で待機中として数える）
+ *   - 子は accept_loop から戻ったら exit(0)。それ以外の終わり方は crash とみなす
+ */
+int
+spawn_child(int soc)
+{
+    pid_t pid;
+    int i, j, sv[2];
+
+    for (i = 0; i < g_max_children; i++) {
+        if (g_board[i].state == SLOT_EMPTY) {
+            break;
+        }
+    }
+    if (i >= g_max_children) {
+        return (-1);
+    }
+    g_board[i].pid = 0;
+    g_board[i].retire = 0;
+    g_board[i].requests = 0;
+    g_board[i].state = SLOT_STARTING;
+
+    /* pass モード：親 → worker の fd 受け渡し用チャネル（メッセージ境界を保つ SEQPACKET） */
+    if (g_lock_mode == LOCK_PASS) {
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == -1) {
+            perror("socketpair");
+            g_board[i].state = SLOT_EMPTY;
+            return (-1);
+        }
+    }
+
+    if ((pid = fork()) == 0) {
+        /*
+         * 子プロセス：
+         * - soc とロック（g_lock_fd / 共有 mutex）を共有している
+         * - accept_loop に入り、ロックで accept を直列化しつつ
+         *   自分が取った接続を処理する
+         */
+        (void) signal(SIGCHLD, SIG_DFL);
+        (void) signal(SIGTERM, SIG_DFL);
+        (void) signal(SIGINT, SIG_DFL);
+        (void) signal(SIGHUP, SIG_IGN);     /* 設定の読み直しは親だけが行う */
+        set_wakeup_handler(SIGUSR1);
+        admin_child();                      /* 管理用ソケットは親だけが使う */
+        g_board[i].pid = getpid();
+        if (g_lock_mode == LOCK_PASS) {
+            /*
+             * worker は listen も他の worker のチャネルも使わない
+             * （他のチャネルの親側を持ったままだと、親が死んでも EOF にならない）
+             */
+            (void) close(soc);
+            (void) close(sv[0]);
+            for (j = 0; j < BOARD_SLOTS; j++) {
+                if (g_chan[j] != -1) {
+                    (void) close(g_chan[j]);
+                }
+            }
+            pass_worker(sv[1], i);
+        } else {
+            accept_loop(soc, i);
+        }
+        _exit(0);
+    } else if (pid == -1) {
+        /* fork失敗 */
+        perror("fork");
+        if (g_lock_mode == LOCK_PASS) {
+            (void) close(sv[0]);
+            (void) close(sv[1]);
+        }
+        g_board[i].state = SLOT_EMPTY;
+        return (-1);
+    }
+    if (g_lock_mode == LOCK_PASS) {
+        (void) close(sv[1]);
+        g_chan[i] = sv[0];
+        g_sent[i] = 0;
+    }
+    g_board[i].pid = pid;
+    g_spawned++;
+    return (0);
+}
+
+/*
+ * reap_children(soc)
+ *   終了した子を回収してスロットを空ける（親が見回りのたびに呼ぶ）
+ *   - 正常終了（exit 0：recycle / retire）はスロットを空けるだけ
+ *   - シグナルや exit 0 以外で死んだ子は crash として、すぐ代わりを fork する
+ *     （drain 中は代わりを作らない）
+ */
+void
+reap_children(int soc)
+{
+    pid_t pid;
+    int i, status;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        for (i = 0; i < BOARD_SLOTS; i++) {
+            if (g_board[i].pid == pid) {
+                break;
+            }
+        }
+        if (i < BOARD_SLOTS) {
+            g_handled += g_board[i].requests;
+            g_board[i].state = SLOT_EMPTY;
+            g_board[i].pid = 0;
+            if (g_chan[i] != -1) {
+                (void) close(g_chan[i]);
+                g_chan[i] = -1;
+            }
+        }
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            g_exited++;
+            continue;
+        }
+        g_crashed++;
+        (void) fprintf(stderr, "<<%d>>子<%d>が異常終了（%s %d）→ 代わりを起動\n",
+                       getpid(), (int) pid,
+                       WIFSIGNALED(status) ? "signal" : "exit",
+                       WIFSIGNALED(status) ? WTERMSIG(status) : WEXITSTATUS(status));
+        if (g_drain_start == 0.0) {
+            (void) spawn_child(soc);
+        }
+    }
+}
+
+/* スコアボードを数える（retire を立てた子は待機中に数えない） */
+void
+board_count(int *ptotal, int *pidle, int *pbusy)
+{
+    int i, st;
+
+    *ptotal = *pidle = *pbusy = 0;
+    for (i = 0; i < BOARD_SLOTS; i++) {
+        if ((st = g_board[i].state) == SLOT_EMPTY) {
+            continue;
+        }
+        (*ptotal)++;
+        if (g_board[i].retire) {
+            continue;
+        }
+        if (st == SLOT_STARTING || st == SLOT_IDLE) {
+            (*pidle)++;
+        } else if (st == SLOT_BUSY) {
+            (*pbusy)++;
+        }
+    }
+}
+
+/* 処理中の接続数（drain の途中経過用）
+ * - pass：worker ごとの担当数（渡した数 - 処理済み数）の合計
+ * - それ以外：busy の子の数（1 つの子は 1 接続ずつ処理する）
+ */
+int
+board_conns(void)
+{
+    int i, n;
+
+    n = 0;
+    for (i = 0; i < BOARD_SLOTS; i++) {
+        if (g_board[i].state == SLOT_EMPTY) {
+            continue;
+        }
+        if (g_lock_mode == LOCK_PASS) {
+            n += (int) (g_sent[i] - g_board[i].requests);
+        } else if (g_board[i].state == SLOT_BUSY) {
+            n++;
+        }
+    }
+    return (n);
+}
+
+/*
+ * drain_children(soc)
+ *   drain の開始：listen で新しい接続を受けないようにし、子に終了を伝える
+ *   - lockf / mutex：retire を全員に立ててから listen を shutdown し、SIGUSR1 で起こす
+ *     （busy の子は SIGUSR1 をブロック中なので、今の接続が終わってから retire を見る）
+ *   - pass：listen を閉じ、worker へのチャネルを閉じる（worker は担当を終えてから終了）
+ */
+void
+drain_children(int soc)
+{
+    int i;
+
+    drain_begin(g_term_sig, board_conns());
+    for (i = 0; i < BOARD_SLOTS; i++) {
+        if (g_board[i].state != SLOT_EMPTY) {
+            g_board[i].retire = 1;
+        }
+    }
+    if (g_lock_mode != LOCK_PASS && shutdown(soc, SHUT_RDWR) == -1) {
+        perror("shutdown");
+    }
+    (void) close(soc);
+    for (i = 0; i < BOARD_SLOTS; i++) {
+        if (g_chan[i] != -1) {
+            (void) close(g_chan[i]);
+            g_chan[i] = -1;
+        }
+        if (g_board[i].state != SLOT_EMPTY && g_board[i].pid > 0) {
+            (void) kill(g_board[i].pid, SIGUSR1);
+        }
+    }
+}
+
+/*
+ * maintain_spares(soc)
+ *   待機中の子の数を [min_spare, max_spare] に保つ
+ *   - 足りなければ不足分をまとめて fork する（子の総数は max_children まで）
+ *   - 多すぎれば待機中の子を 1 本だけ引退させる（急に減らしすぎないように 1 秒に 1 本）
+ *   - SIGHUP で max_children が今の子の数より下がったときも、同じように待機中の子から減らす
+ *     （処理中の子は切らない。スロット番号は max_children を超えていてもよいので、
+ *      スコアボードの走査は常に BOARD_SLOTS 全体を見る）
+ */
+void
+maintain_spares(int soc)
+{
+    int i, total, idle, busy, last, nworker;
+
+    board_count(&total, &idle, &busy);
+    if (g_lock_mode == LOCK_PASS) {
+        /* pass モード：worker の数を min_spare 本に保つだけ
+           - 数えるのはチャネルが開いている（新しい接続を渡せる）worker
+           - 多すぎればチャネルを閉じて 1 本引退させる（渡し済みの接続を処理し終えてから終了する） */
+        last = -1;
+        for (nworker = 0, i = 0; i < BOARD_SLOTS; i++) {
+            if (g_chan[i] != -1) {
+                nworker++;
+                last = i;
+            }
+        }
+        for (; nworker < g_min_spare; nworker++) {
+            if (spawn_child(soc) == -1) {
+                break;
+            }
+        }
+        if (nworker > g_min_spare && last != -1) {
+            g_board[last].retire = 1;
+            (void) close(g_chan[last]);
+            g_chan[last] = -1;
+        }
+        return;
+    }
+    for (; idle < g_min_spare && total < g_max_children; idle++, total++) {
+        if (spawn_child(soc) == -1) {
+            break;
+        }
+    }
+    if (idle > g_max_spare || total > g_max_children) {
+        for (i = 0; i < BOARD_SLOTS; i++) {
+            if (g_board[i].state == SLOT_IDLE && !g_board[i].retire && g_board[i].pid > 0) {
+                g_board[i].retire = 1;
+                (void) kill(g_board[i].pid, SIGUSR1);
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * 実行時設定（設定ファイル + SIGHUP での読み直し）
+ *
+ * conf に「キー 値」（または「キー = 値」）を 1 行ずつ書く。'#' から行末まではコメント。
+ *
+ *   min_spare     待機中の子の下限（pass モードでは worker の数。既定：CPU 数と MIN_SPARE の大きい方）
+ *   max_spare     待機中の子の上限（既定：CPU 数 * 2 と MAX_SPARE の大きい方）
+ *   max_children  子の総数の上限（既定：CPU 数 * 8 と MAX_CHILDREN の大きい方。BOARD_SLOTS まで）
+ *   max_requests  1 つの子が処理する接続数の上限（0 = 無制限。子は fork 時の値を使うので、
+ *                 変えると新しく fork した子から効く）
+ *   drain_timeout drain の期限（秒、既定 DRAIN_TIMEOUT）
+ *   verbose       1 = accept ごとに接続元を表示する（既定 0。prefork の子は fork 時の値を使う）
+ *
+ * 値の優先順位は 既定値 → 引数 → conf。SIGHUP では「既定値 + 引数」から conf を読み直すので、
+ * conf から消したキーは引数（無ければ既定値）に戻る。
+ * 1 行でも誤りがあれば、そのファイルは丸ごと使わない（起動時はエラー終了、SIGHUP なら今の値のまま）。
+ * 反映は親の変数を書き換えるだけで、子の増減は次の見回り（maintain_spares）が行う。
+ */
+struct config {
+    int min_spare;
+    int max_spare;
+    int max_children;
+    int max_requests;
+    int drain_timeout;
+    int verbose;
+};
+
+/* キー名と struct config の中の位置、受け付ける範囲 */
+struct conf_key {
+    const char *name;
+    size_t off;
+    int min;
+    int max;
+};
+
+const struct conf_key g_conf_keys[] = {
+    { "min_spare",     offsetof(struct config, min_spare),     1, BOARD_SLOTS },
+    { "max_spare",     offsetof(struct config, max_spare),     1, BOARD_SLOTS },
+    { "max_children",  offsetof(struct config, max_children),  1, BOARD_SLOTS },
+    { "max_requests",  offsetof(struct config, max_requests),  0, 1 << 30 },
+    { "drain_timeout", offsetof(struct config, drain_timeout), 0, 86400 },
+    { "verbose",       offsetof(struct config, verbose),       0, 1 },
+};
+
+/* 設定ファイルのパス（NULL なら既定値と引数だけで動く） / 既定値 + 引数 / 反映中の設定 */
+const char *g_conf_path = NULL;
+struct config g_conf_base;
+struct config g_conf_cur;
+
+/* 既定値（CPU 数から決める） */
+void
+conf_defaults(struct config *c)
+{
+    long ncpu;
+
+    if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+        ncpu = 1;
+    }
+    c->min_spare = ncpu > MIN_SPARE ? (int) ncpu : MIN_SPARE;
+    c->max_spare = ncpu * 2 > MAX_SPARE ? (int) ncpu * 2 : MAX_SPARE;
+    c->max_children = ncpu * 8 > MAX_CHILDREN ? (int) ncpu * 8 : MAX_CHILDREN;
+    if (c->max_children > BOARD_SLOTS) {
+        c->max_children = BOARD_SLOTS;
+    }
+    c->max_requests = MAX_REQUESTS;
+    c->drain_timeout = DRAIN_TIMEOUT;
+    c->verbose = 0;
+}
+
+/* path を読んで c を上書きする（戻り値：0 = 成功 / -1 = 開けない、または誤りがあった） */
+int
+conf_parse(const char *path, struct config *c)
+{
+    char line[256], key[64], *p, *end;
+    FILE *fp;
+    long v;
+    size_t k;
+    int lineno, err, n;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        return (-1);
+    }
+    err = 0;
+    lineno = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL) {
+            *p = '\0';
+        }
+        if ((p = strchr(line, '=')) != NULL) {
+            *p = ' ';
+        }
+        if (sscanf(line, "%63s%n", key, &n) != 1) {
+            continue;                   /* 空行・コメントだけの行 */
+        }
+        for (k = 0; k < sizeof(g_conf_keys) / sizeof(g_conf_keys[0]); k++) {
+            if (strcmp(key, g_conf_keys[k].name) == 0) {
+                break;
+            }
+        }
+        if (k == sizeof(g_conf_keys) / sizeof(g_conf_keys[0])) {
+            (void) fprintf(stderr, "conf:%s:%d: unknown key %s\n", path, lineno, key);
+            err = 1;
+            continue;
+        }
+        errno = 0;
+        v = strtol(line + n, &end, 10);
+        while (isspace((unsigned char) *end)) {
+            end++;
+        }
+        if (errno != 0 || end == line + n || *end != '\0'
+            || v < g_conf_keys[k].min || v > g_conf_keys[k].max) {
+            (void) fprintf(stderr, "conf:%s:%d: bad value for %s (%d..%d)\n",
+                           path, lineno, key, g_conf_keys[k].min, g_conf_keys[k].max);
+            err = 1;
+            continue;
+        }
+        *(int *) ((char *) c + g_conf_keys[k].off) = (int) v;
+    }
+    (void) fclose(fp);
+    return (err ? -1 : 0);
+}
+
+/* 設定 c を反映する（親の見回りループから呼ぶ） */
+void
+conf_apply(const struct config *c)
+{
+    g_conf_cur = *c;
+    g_min_spare = c->min_spare;
+    g_max_spare = c->max_spare < c->min_spare ? c->min_spare : c->max_spare;
+    g_max_children = c->max_children < c->min_spare ? c->min_spare : c->max_children;
+    g_max_requests = c->max_requests;
+    g_drain_timeout = c->drain_timeout;
+    g_verbose = c->verbose;
+    (void) fprintf(stderr,
+                   "<<%d>>conf: spare=%d..%d max_children=%d max_requests=%ld drain_timeout=%d"
+                   " verbose=%d\n",
+                   getpid(), g_min_spare, g_max_spare, g_max_children, g_max_requests,
+                   g_drain_timeout, g_verbose);
+}
+
+/* SIGHUP：設定ファイルを読み直して反映する（誤りがあれば今の値のまま） */
+void
+conf_reload(void)
+{
+    struct config c;
+
+    if (g_conf_path == NULL) {
+        (void) fprintf(stderr, "conf: no file, keep current\n");
+        return;
+    }
+    c = g_conf_base;
+    if (conf_parse(g_conf_path, &c) == -1) {
+        (void) fprintf(stderr, "conf:%s: not applied, keep current\n", g_conf_path);
+        return;
+    }
+    conf_apply(&c);
+}
+
+/* 管理用ソケット（admin）
+ *
+ * 動いているサーバの状態を、stderr のログを grep せずに問い合わせるための AF_UNIX ソケット。
+ * adminctl（または socat 等）で 1 行のコマンドを送ると、テキストで応答して閉じる。
+ *
+ * コマンド：
+ * - stats         : 稼働時間、子の数（idle / busy）、処理中の接続数、fork / 終了 / crash の累計、
+ *                   処理した接続数、設定値
+ * - conns         : スコアボードの子ごとの slot、pid、状態、担当中の接続数、処理した接続数
+ *                   （接続を持っているのは子なので、親から見えるのは子ごとの集計）
+ * - set KEY VALUE : 設定ファイルと同じキーを 1 つ変えて conf_apply で反映する
+ *                   （次の SIGHUP では設定ファイルの値に戻る）
+ * - drain         : SIGTERM と同じ drain を始める
+ *
+ * - パスは ADMIN_PATH_FMT にポート番号を入れたもの。権限 0600（起動したユーザだけが使える）
+ * - 親（マスター）の見回りループの poll で待ち、そのまま処理する（子は止めず、スコアボードを
+ *   読むだけ）。子は fork 直後に管理用の FD を閉じる（admin_child）
+ * - 同時に扱う管理接続は ADMIN_MAX 本まで。1 接続 1 コマンドで、応答を書き終えたら閉じる
+ */
+#define ADMIN_PATH_FMT  "/tmp/server7.%s.admin"
+#define ADMIN_MAX       (4)
+#define ADMIN_LINE      (256)
+#define ADMIN_NPFD      (1 + ADMIN_MAX) /* admin_pollfd が並べる pollfd の数 */
+
+struct admin {
+    int fd;                             /* -1 = 空き */
+    int replied;                        /* コマンドを実行済み（応答の送信中）なら 1 */
+    size_t inlen;                       /* in[] に溜まったコマンド行の長さ */
+    char in[ADMIN_LINE];
+    char *out;                          /* 応答（admin_printf で伸ばす） */
+    size_t outlen, outsize, outoff;     /* 応答の長さ / 確保量 / 送信済み */
+};
+
+struct admin g_admin[ADMIN_MAX];
+int g_admin_soc = -1;
+char g_admin_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+int g_admin_drain = 0;                  /* drain コマンドを受けたら 1（見回りループが見る） */
+double g_start;                         /* 起動した時刻（stats の uptime） */
+
+/* 管理用ソケットを作る（失敗しても管理機能が無いだけで、サーバは続行する） */
+int
+admin_socket(const char *portnm)
+{
+    struct sockaddr_un sun;
+    int i;
+
+    for (i = 0; i < ADMIN_MAX; i++) {
+        g_admin[i].fd = -1;
+    }
+    (void) memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    (void) snprintf(sun.sun_path, sizeof(sun.sun_path), ADMIN_PATH_FMT, portnm);
+    if ((g_admin_soc = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket(AF_UNIX)");
+        return (-1);
+    }
+    (void) unlink(sun.sun_path);
+    if (bind(g_admin_soc, (struct sockaddr *) &sun, sizeof(sun)) == -1
+        || chmod(sun.sun_path, 0600) == -1
+        || listen(g_admin_soc, ADMIN_MAX) == -1) {
+        perror(sun.sun_path);
+        (void) close(g_admin_soc);
+        g_admin_soc = -1;
+        return (-1);
+    }
+    (void) strcpy(g_admin_path, sun.sun_path);
+    (void) fprintf(stderr, "admin=%s\n", g_admin_path);
+    return (g_admin_soc);
+}
+
+/* 応答に書式付きで追記する */
+void
+admin_printf(struct admin *a, const char *fmt, ...)
+{
+    va_list ap;
+    size_t need;
+    char *p;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    need = a->outlen + (size_t) n + 1;
+    if (need > a->outsize) {
+        if ((p = realloc(a->out, need < 4096 ? 4096 : need * 2)) == NULL) {
+            return;
+        }
+        a->out = p;
+        a->outsize = need < 4096 ? 4096 : need * 2;
+    }
+    va_start(ap, fmt);
+    (void) vsnprintf(a->out + a->outlen, (size_t) n + 1, fmt, ap);
+    va_end(ap);
+    a->outlen += (size_t) n;
+}
+
+/* 管理接続を閉じて枠を空ける */
+void
+admin_close(struct admin *a)
+{
+    (void) close(a->fd);
+    free(a->out);
+    (void) memset(a, 0, sizeof(*a));
+    a->fd = -1;
+}
+
+/* 管理用 listen ソケットが ready → 空き枠がある分だけ accept する */
+void
+admin_accept(void)
+{
+    int fd, i;
+
+    for (;;) {
+        for (i = 0; i < ADMIN_MAX && g_admin[i].fd != -1; i++)
+            ;
+        if ((fd = accept4(g_admin_soc, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+            return;
+        }
+        if (i == ADMIN_MAX) {
+            /* 枠が無い：待たせずに断る */
+            (void) close(fd);
+            continue;
+        }
+        g_admin[i].fd = fd;
+    }
+}
+
+/* set KEY VALUE：いまの設定を写して 1 つだけ変え、conf_apply で反映する
+ * （子の増減は次の見回りの maintain_spares が行う） */
+void
+admin_set(struct admin *a, const char *key, const char *val)
+{
+    struct config c;
+    char *end;
+    size_t k;
+    long v;
+
+    for (k = 0; k < sizeof(g_conf_keys) / sizeof(g_conf_keys[0]); k++) {
+        if (key != NULL && strcmp(key, g_conf_keys[k].name) == 0) {
+            break;
+        }
+    }
+    if (k == sizeof(g_conf_keys) / sizeof(g_conf_keys[0]) || val == NULL) {
+        admin_printf(a, "ERR usage: set KEY VALUE (");
+        for (k = 0; k < sizeof(g_conf_keys) / sizeof(g_conf_keys[0]); k++) {
+            admin_printf(a, "%s%s", k > 0 ? "|" : "", g_conf_keys[k].name);
+        }
+        admin_printf(a, ")\n");
+        return;
+    }
+    errno = 0;
+    v = strtol(val, &end, 10);
+    if (errno != 0 || end == val || *end != '\0'
+        || v < g_conf_keys[k].min || v > g_conf_keys[k].max) {
+        admin_printf(a, "ERR bad value for %s (%d..%d)\n",
+                     key, g_conf_keys[k].min, g_conf_keys[k].max);
+        return;
+    }
+    c = g_conf_cur;
+    *(int *) ((char *) &c + g_conf_keys[k].off) = (int) v;
+    conf_apply(&c);
+    admin_printf(a, "OK %s=%ld\n", key, v);
+}
+
+/* コマンド 1 行を実行して応答を組み立てる */
+void
+admin_command(struct admin *a, char *line)
+{
+    static const char *const states[] = { "empty", "starting", "idle", "busy", "exiting" };
+    char *cmd, *key, *val;
+    long handled;
+    int i, st, total, idle, busy;
+
+    cmd = strtok(line, " \t");
+    key = strtok(NULL, " \t");
+    val = strtok(NULL, " \t");
+    if (cmd == NULL) {
+        admin_printf(a, "ERR empty command\n");
+    } else if (strcmp(cmd, "stats") == 0) {
+        board_count(&total, &idle, &busy);
+        handled = g_handled;
+        for (i = 0; i < BOARD_SLOTS; i++) {
+            if (g_board[i].state != SLOT_EMPTY) {
+                handled += g_board[i].requests;
+            }
+        }
+        admin_printf(a, "uptime=%.1f\nlock=%s\nchildren=%d\nidle=%d\nbusy=%d\nconns=%d\n"
+                     "draining=%d\nspawned=%ld\nexited=%ld\ncrashed=%ld\nhandled=%ld\n"
+                     "min_spare=%d\nmax_spare=%d\nmax_children=%d\nmax_requests=%ld\n"
+                     "drain_timeout=%d\nverbose=%d\n",
+                     now_sec() - g_start,
+                     g_lock_mode == LOCK_PASS ? "pass" : g_lock_mode == LOCK_MUTEX ? "mutex" : "lockf",
+                     total, idle, busy, board_conns(), g_drain_start != 0.0,
+                     g_spawned, g_exited, g_crashed, handled,
+                     g_min_spare, g_max_spare, g_max_children, g_max_requests,
+                     g_drain_timeout, g_verbose);
+    } else if (strcmp(cmd, "conns") == 0) {
+        admin_printf(a, "slot pid state conns handled\n");
+        for (i = 0; i < BOARD_SLOTS; i++) {
+            if ((st = g_board[i].state) == SLOT_EMPTY || st > SLOT_EXITING) {
+                continue;
+            }
+            admin_printf(a, "%d %d %s%s %ld %ld\n", i, (int) g_board[i].pid, states[st],
+                         g_board[i].retire ? "(retire)" : "",
+                         g_lock_mode == LOCK_PASS ? g_sent[i] - g_board[i].requests
+                         : (long) (st == SLOT_BUSY),
+                         g_board[i].requests);
+        }
+    } else if (strcmp(cmd, "set") == 0) {
+        admin_set(a, key, val);
+    } else if (strcmp(cmd, "drain") == 0) {
+        g_admin_drain = 1;
+        admin_printf(a, "OK draining conns=%d timeout=%d\n", board_conns(), g_drain_timeout);
+    } else {
+        admin_printf(a, "ERR unknown command %s (stats|conns|set|drain)\n", cmd);
+    }
+    if (a->out != NULL) {
+        (void) fprintf(stderr, "admin:%s\n", cmd != NULL ? cmd : "");
+    }
+}
+
+/* 管理接続のイベント
+ *
+ * 1) コマンド行（'\n' まで）を溜める
+ * 2) 揃ったら admin_command で応答を作り、すぐに送り始める
+ * 3) 応答を送り切ったら閉じる（送れない分は、次の poll で書き込み可能を待って続ける）
+ */
+void
+admin_event(struct admin *a)
+{
+    ssize_t n;
+    char *eol;
+
+    if (!a->replied) {
+        if ((n = recv(a->fd, a->in + a->inlen, sizeof(a->in) - 1 - a->inlen, 0)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                admin_close(a);
+            }
+            return;
+        }
+        if (n == 0) {
+            admin_close(a);
+            return;
+        }
+        a->inlen += (size_t) n;
+        a->in[a->inlen] = '\0';
+        if ((eol = strpbrk(a->in, "\r\n")) == NULL && a->inlen < sizeof(a->in) - 1) {
+            return;
+        }
+        if (eol != NULL) {
+            *eol = '\0';
+        }
+        admin_command(a, a->in);
+        if (a->out == NULL) {
+            admin_close(a);
+            return;
+        }
+        a->replied = 1;
+    }
+    if ((n = send(a->fd, a->out + a->outoff, a->outlen - a->outoff, MSG_NOSIGNAL)) == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            admin_close(a);
+        }
+        return;
+    }
+    a->outoff += (size_t) n;
+    if (a->outoff == a->outlen) {
+        admin_close(a);
+    }
+}
+
+/* 管理用ソケットと管理接続を pfd[0..ADMIN_NPFD) に並べる
+ * （空き枠は -1 で poll に無視される。応答の送信中は POLLOUT を待つ） */
+void
+admin_pollfd(struct pollfd *pfd)
+{
+    int i;
+
+    pfd[0].fd = g_admin_soc;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+    for (i = 0; i < ADMIN_MAX; i++) {
+        pfd[1 + i].fd = g_admin[i].fd;
+        pfd[1 + i].events = g_admin[i].replied ? POLLOUT : POLLIN;
+        pfd[1 + i].revents = 0;
+    }
+}
+
+/* admin_pollfd で並べた分の poll の結果を処理する */
+void
+admin_dispatch(const struct pollfd *pfd)
+{
+    int i;
+
+    for (i = 0; i < ADMIN_MAX; i++) {
+        if (pfd[1 + i].fd != -1 && pfd[1 + i].fd == g_admin[i].fd && pfd[1 + i].revents != 0) {
+            admin_event(&g_admin[i]);
+        }
+    }
+    if (pfd[0].revents & POLLIN) {
+        admin_accept();
+    }
+}
+
+/* fork した子で、管理用の FD を閉じる（パスは消さない） */
+void
+admin_child(void)
+{
+    int i;
+
+    for (i = 0; i < ADMIN_MAX; i++) {
+        if (g_admin[i].fd != -1) {
+            (void) close(g_admin[i].fd);
+        }
+    }
+    if (g_admin_soc != -1) {
+        (void) close(g_admin_soc);
+    }
+}
+
+/* 終了時：管理接続と管理用ソケットを閉じ、パスを消す */
+void
+admin_shutdown(void)
+{
+    int i;
+
+    if (g_admin_soc == -1) {
+        return;
+    }
+    for (i = 0; i < ADMIN_MAX; i++) {
+        if (g_admin[i].fd != -1) {
+            admin_close(&g_admin[i]);
+        }
+    }
+    (void) close(g_admin_soc);
+    (void) unlink(g_admin_path);
+    g_admin_soc = -1;
+}
+
+
+int
+main(int argc, char *argv[])
+{
+    struct sigaction sa;
+    struct pollfd pfd[1 + ADMIN_NPFD];
+    struct config conf;
+    time_t last, now, report;
+    int i, soc, total, idle, busy, status;
+
+    /* 引数チェック */
+    if (argc <= 1) {
+        (void) fprintf(stderr,
+                       "server7 port [latency|throughput|churn|none] [lockf|mutex|pass [min_spare [max_spare [max_children [max_requests [conf]]]]]]\n");
+        return (EX_USAGE);
+    }
+    profile_arg(&argc, argv);
+    if (argc > 2) {
+        if (strcmp(argv[2], "lockf") == 0) {
+            g_lock_mode = LOCK_LOCKF;
+        } else if (strcmp(argv[2], "mutex") == 0) {
+            g_lock_mode = LOCK_MUTEX;
+        } else if (strcmp(argv[2], "pass") == 0) {
+            g_lock_mode = LOCK_PASS;
+        } else {
+            (void) fprintf(stderr,
+                           "server7 port [latency|throughput|churn|none] [lockf|mutex|pass [min_spare [max_spare [max_children [max_requests [conf]]]]]]\n");
+            return (EX_USAGE);
+        }
+    }
+    /* 設定：既定値 → 引数 → 設定ファイル（反映は conf_apply） */
+    conf_defaults(&g_conf_base);
+    if (argc > 3 && atoi(argv[3]) > 0) {
+        g_conf_base.min_spare = atoi(argv[3]);
+    }
+    if (argc > 4 && atoi(argv[4]) > 0) {
+        g_conf_base.max_spare = atoi(argv[4]);
+    }
+    if (argc > 5 && atoi(argv[5]) > 0) {
+        g_conf_base.max_children = atoi(argv[5]);
+    }
+    if (argc > 6) {
+        g_conf_base.max_requests = atoi(argv[6]);
+    }
+    if (g_conf_base.max_children > BOARD_SLOTS) {
+        g_conf_base.max_children = BOARD_SLOTS;
+    }
+    conf = g_conf_base;
+    if (argc > 7) {
+        g_conf_path = argv[7];
+        if (conf_parse(g_conf_path, &conf) == -1) {
+            return (EX_CONFIG);
+        }
+    }
+    conf_apply(&conf);
+
+    /* 行区切り検索の実装を CPU に合わせて選ぶ（スレッド/子プロセス生成前に 1 回だけ） */
+    scan_eol_init();
+    (void) fprintf(stderr, "scan_eol=%s\n", g_scan_eol_name);
+    g_start = now_sec();
+
+    /* listen 用ソケットを準備（親が1回だけ作る → fork 後は子と共有） */
+    if ((soc = server_socket(argv[1])) == -1) {
+        (void) fprintf(stderr, "server_socket(%s):error\n", argv[1]);
+        return (EX_UNAVAILABLE);
+    }
+
+    /*
+     * accept 用ロックを準備（fork 前に作るのが肝心）
+     * - lockf : ロックファイルを open → unlink（FD を子が引き継ぐ）
+     * - mutex : 無名共有メモリに robust mutex を置く（マッピングを子が引き継ぐ）
+     */
+    if (g_lock_mode == LOCK_PASS) {
+        /* pass モード：ロックは使わない。親だけが accept するので listen をノンブロッキングにする */
+        if (fcntl(soc, F_SETFL, fcntl(soc, F_GETFL, 0) | O_NONBLOCK) == -1) {
+            perror("fcntl");
+            return (EX_UNAVAILABLE);
+        }
+    } else if (accept_lock_init() == -1) {
+        return (EX_UNAVAILABLE);
+    }
+    for (i = 0; i < BOARD_SLOTS; i++) {
+        g_chan[i] = -1;
+    }
+
+    /* スコアボードを準備（これも fork 前。MAP_SHARED なので子の書き込みが親に見える） */
+    if ((g_board = mmap(NULL, sizeof(struct board_slot) * BOARD_SLOTS,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        perror("mmap");
+        return (EX_UNAVAILABLE);
+    }
+
+    /* 子が死んだら sleep を中断してすぐ回収・補充する */
+    set_wakeup_handler(SIGCHLD);
+
+    /* SIGTERM / SIGINT で drain に入る（SA_RESTART なし：sleep / poll をすぐ中断させる） */
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = term_handler;
+    (void) sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    (void) sigaction(SIGTERM, &sa, NULL);
+    (void) sigaction(SIGINT, &sa, NULL);
+
+    /* SIGHUP で設定を読み直す（同じく SA_RESTART なし。読み直しは見回りループで行う） */
+    sa.sa_handler = hup_handler;
+    (void) sigaction(SIGHUP, &sa, NULL);
+
+    (void) fprintf(stderr,
+                   "start %d children (lock=%s spare=%d..%d max_children=%d max_requests=%ld)\n",
+                   NUM_CHILD,
+                   g_lock_mode == LOCK_PASS ? "pass" : g_lock_mode == LOCK_MUTEX ? "mutex" : "lockf",
+                   g_min_spare, g_max_spare, g_max_children, g_max_requests);
+
+    /* 管理用ソケット（無くてもサーバは動く。子は fork 直後に閉じる） */
+    (void) admin_socket(argv[1]);
+
+    /* 子プロセスを NUM_CHILD 個生成（以後の増減は maintain_spares に任せる） */
+    for (i = 0; i < NUM_CHILD; i++) {
+        (void) spawn_child(soc);
     }
 
     (void) fprintf(stderr, "ready for accept\n");
 
     /*
-     * 親プロセスは “デモ用の監視” をする：
-     * - lockf(F_TEST) でロック状態を観察する（学習用）
-     *   返り値 0 ならロック可能（誰も握ってない）
-     *   -1 ならロック不可（誰かが握ってる）※errnoで詳細
-     *
-     * 注意：
-     * - この親は accept をしないので、実際の接続処理は子だけが行う。
+     * 親プロセスは prefork マスターとして見回りをする（pass モード以外では accept をしない）：
+     * - 1 秒ごと（SIGCHLD が来たらすぐ）に死んだ子を回収し、待機中の子の数を調整する
+     * - 10 秒ごとにロック状態とスコアボードを表示する
+     *   - lockf(F_TEST) の返り値 0 ならロック可能（誰も握ってない）、-1 なら誰かが握ってる
+     *   - mutex モードでは trylock すると親が一瞬ロックを奪ってしまうので、
+     *     共有領域の owner（握っている子の pid）と回復回数を表示する
+     * - SIGHUP を受けたら設定ファイルを読み直す（子の増減は続く maintain_spares が行う）
+     * - SIGTERM / SIGINT（または管理用ソケットの drain）を受けたら drain に入り、
+     *   子が全員終わるか期限が来たらループを抜ける
+     * - 待つのは 1 秒の poll（pass モードの listen と管理用ソケット）。シグナルでも EINTR で起きる
      */
+    last = report = time(NULL);
     for (;;) {
-        (void) sleep(10);
+        /* pass モード：親が acceptor。1 秒で poll を切り上げて見回りもする（他のモードと drain 中は -1） */
+        pfd[0].fd = g_lock_mode == LOCK_PASS ? soc : -1;
+        pfd[0].events = POLLIN;
+        pfd[0].revents = 0;
+        admin_pollfd(&pfd[1]);
+        if (poll(pfd, 1 + ADMIN_NPFD, 1000) > 0) {
+            if (pfd[0].revents & POLLIN) {
+                pass_accept(soc);
+            }
+            admin_dispatch(&pfd[1]);
+        }
+        reap_children(soc);
+        if (g_hup && g_drain_start == 0.0) {
+            g_hup = 0;
+            conf_reload();
+        }
+        if ((g_term_sig != 0 || g_admin_drain) && g_drain_start == 0.0) {
+            drain_children(soc);
+            soc = -1;
+        }
+        if (g_drain_start != 0.0) {
+            board_count(&total, &idle, &busy);
+            if (drain_check(total, board_conns())) {
+                break;
+            }
+            continue;
+        }
+        if ((now = time(NULL)) == last) {
+            continue;
+        }
+        last = now;
+        maintain_spares(soc);
+        if (now - report < 10) {
+            continue;
+        }
+        report = now;
+        if (g_lock_mode == LOCK_PASS) {
+            /* 各 worker の担当数（渡した数 - 処理済み数）が均等かを見る */
+            for (i = 0; i < BOARD_SLOTS; i++) {
+                if (g_chan[i] != -1) {
+                    (void) fprintf(stderr, "<<%d>>worker<%d>：担当=%ld 累計=%ld\n",
+                                   getpid(), (int) g_board[i].pid,
+                                   g_sent[i] - g_board[i].requests, g_sent[i]);
+                }
+            }
+        } else if (g_lock_mode == LOCK_MUTEX) {
+            (void) fprintf(stderr,
+                           "<<%d>>ロック状態：owner=%d recovered=%ld\n",
+                           getpid(),
+                           (int) g_lock_shm->owner,
+                           g_lock_shm->recovered);
+        } else {
+            (void) fprintf(stderr,
+                           "<<%d>>ロック状態：%d\n",
+                           getpid(),
+                           lockf(g_lock_fd, F_TEST, 0));
+        }
+        board_count(&total, &idle, &busy);
         (void) fprintf(stderr,
-                       "<<%d>>ロック状態：%d\n",
-                       getpid(),
-                       lockf(g_lock_fd, F_TEST, 0));
+                       "<<%d>>board: children=%d idle=%d busy=%d spawned=%ld exited=%ld crashed=%ld\n",
+                       getpid(), total, idle, busy, g_spawned, g_exited, g_crashed);
     }
 
-    /* NOT REACHED（ここには来ない） */
-    (void) close(soc);
-    (void) close(g_lock_fd);
+    /* 期限切れで残った子を止めて回収する（子の SIGTERM は既定の動作 = 終了） */
+    for (i = 0; i < BOARD_SLOTS; i++) {
+        if (g_board[i].state != SLOT_EMPTY && g_board[i].pid > 0) {
+            (void) kill(g_board[i].pid, SIGTERM);
+        }
+    }
+    while (waitpid(-1, &status, 0) > 0 || errno == EINTR) {
+        /* 全員回収するまで待つ */
+    }
+    (void) fprintf(stderr, "<<%d>>exit: spawned=%ld exited=%ld crashed=%ld\n",
+                   getpid(), g_spawned, g_exited, g_crashed);
+    admin_shutdown();
+    if (g_lock_fd != -1) {
+        (void) close(g_lock_fd);
+    }
     return (EX_OK);
 }
 
@@ -394,9 +2574,9 @@ main(int argc, char *argv[])
  *    recv のサイズが sizeof(buf) のとき len==512 になり得る。
  *    → 文字列化するなら recv を sizeof(buf)-1 にするのが安全。
  *
- * 3) lockf のエラー処理：
- *    このコードは lockf の返り値をチェックしていない。
- *    教材としては挙動観察が主だが、実務なら戻り値と errno を見るべき。
+ * 3) ロックのエラー処理：
+ *    accept_lock() が失敗したら 1 秒待ってやり直すだけにしている。
+ *    mutex モードの EOWNERDEAD は accept_lock() の中で回復させる。
  *
  * 4) マルチプロセスで accept を直列化すると、accept の並列性は消える：
  *    ただし “accept は短時間” なので、I/O処理の並列性（send_recv_loop）が主役になる。
@@ -1,22 +1,48 @@
+#define _GNU_SOURCE                     /* accept4() */
+
+#include <sys/epoll.h>                  /* epoll（coro モードのスケジューラ） */
+#include <sys/ioctl.h>                  /* ioctl(FIONREAD)（受信バッファの大きさ合わせ） */
+#include <sys/mman.h>                   /* mmap（コルーチンのスタック） */
 #include <sys/param.h>
+#include <sys/resource.h>              /* getrlimit（max_threads の既定値） */
+#include <sys/signalfd.h>               /* signalfd（SIGTERM を FD で受け取る） */
 #include <sys/socket.h>
+#include <sys/stat.h>                   /* chmod（管理用ソケット） */
+#include <sys/syscall.h>                /* SYS_futex, SYS_gettid */
+#include <sys/time.h>                   /* struct timeval（SO_RCVTIMEO） */
 #include <sys/types.h>
+#include <sys/uio.h>                    /* writev, struct iovec */
+#include <sys/un.h>                     /* struct sockaddr_un（管理用ソケット） */
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
+#include <linux/futex.h>                /* FUTEX_WAIT_PRIVATE / FUTEX_WAKE_PRIVATE */
 #include <netinet/in.h>
+#include <netinet/tcp.h>                /* TCP_NODELAY / TCP_QUICKACK など（プロファイル） */
 #include <netdb.h>
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>                      /* fcntl, O_NONBLOCK */
+#include <limits.h>
+#include <poll.h>                       /* poll（accept 待ちのタイムアウト） */
 #include <pthread.h>                    /* POSIXスレッド API を使うために必要 */
 #include <signal.h>
+#include <stdarg.h>                     /* va_list（admin_printf） */
+#include <stdatomic.h>                  /* atomic_int（プールの統計） */
+#include <stddef.h>                     /* offsetof */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>                       /* clock_gettime */
+#include <ucontext.h>                   /* getcontext / makecontext / swapcontext（coro モード） */
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>                  /* SSE2 / AVX2 組み込み関数（scan_eol） */
+#endif
+
 /*
  * server8: pthread_mutex による accept() の直列化 + スレッド並列処理
  *
@@ -41,15 +67,93 @@
  *   - accept は直列（mutex で 1 スレッドに限定）
  *   - 接続処理（send_recv_loop）は並列（接続ごとにスレッドが担当）
  *
+ * 伸縮するプール（elastic pool）：
+ *   server8 port [lock|lf [min_idle [max_threads [idle_timeout [conf]]]]]
+ *   - accept 待ち（idle）のスレッドが min_idle 本（既定 NUM_CHILD）を下回ったら、
+ *     接続を受けたスレッドが新しい accept_thread を 1 本足す（最大 max_threads 本まで。既定 MAX_THREADS）
+ *   - idle_timeout 秒（既定 IDLE_TIMEOUT）接続が来なかった idle スレッドは、
+ *     idle が min_idle より多ければ終了する
+ *   - idle/busy/合計の本数は atomic 変数で数え、増減のたびに "pool:" 行を標準エラーに出す
+ *     （親スレッドも 10 秒ごとに同じ形式で出すので、min_idle/max_threads の調整に使える）
+ *   - min_idle / max_threads / idle_timeout は設定ファイル conf にも書け、
+ *     SIGHUP で読み直して動いたまま変えられる（下記「実行時設定」）
+ *
+ * leader/follower モード（第2引数 lf。既定は上記の lock）：
+ *   - g_lock の代わりに「リーダー権」を表す int 1 つ（g_lf_leader）を futex で受け渡す
+ *   - リーダーは 1 本だけで、listen を poll → accept する。接続を得たらすぐに
+ *     リーダー権を手放して待っている follower を 1 本起こし（futex wake）、自分はその接続を処理する
+ *   - mutex の取り合い（と accept のたびのロック獲得/解放のログ）が無く、待っている follower が
+ *     居ないときは wake のシステムコールも呼ばない
+ *   - accept したスレッドがそのまま最初の recv を行うので、キャッシュの局所性も保たれる
+ *
+ * coro モード（第2引数 coro）：
+ *   server8 port coro [schedulers [stack_kb [conf]]]
+ *   - 接続ごとにスレッドを使わず、コルーチン（ユーザ空間スレッド、既定 64KB スタック）を作り、
+ *     schedulers 本（既定は CPU コア数）の OS スレッド上の epoll スケジューラで動かす
+ *     （server6 の coro モードと同じ仕組み。send_recv_loop は同じブロッキングの書き方のまま）
+ *   - プールは使わない（min_idle / max_threads / idle_timeout は効かない）。
+ *     stats の busy は処理中の接続数、threads はスケジューラの本数になる
+ *
+ * 停止：
+ *   - SIGTERM / SIGINT で drain に入る（新しい接続を受けず、処理中の接続が終わるのを待つ。
+ *     下記 drain_begin / drain_check）
+ *
+ * 管理用ソケット：
+ *   - /tmp/server8.<port>.admin に stats / conns / set / drain を送ると、プールと接続の状態を
+ *     返す / 設定を変える / drain を始める（後ろの「管理用ソケット」。adminctl で送れる）
+ *
  * 注意：
  *   - 本コードは教材/実験用の雰囲気が強い。
  *     実運用では「accept を直列化する必要があるか？」や「1接続=1スレッドはスケールするか？」
  *     を再検討することが多い（スレッドプール、epoll、SO_REUSEPORT 等）。
  */
 
-/* accept スレッド数（並列 worker 数） */
+/* accept スレッド数（並列 worker 数）：起動時の本数であり、idle の下限の既定値
+   （CPU 数の方が多ければそちら。conf_defaults） */
 #define NUM_CHILD       2
 
+/* スレッド数の上限の既定値（CPU 数 * 16 の方が多ければそちら。conf_defaults） */
+#define MAX_THREADS     64
+
+/* idle スレッドを終了させるまでの秒数の既定値 */
+#define IDLE_TIMEOUT    30
+
+/* 動作モード */
+#define MODE_LOCK       0               /* g_lock で accept を直列化（元の方式） */
+#define MODE_LF         1               /* leader/follower（futex でリーダー権を渡す） */
+#define MODE_CORO       2               /* コルーチン + epoll スケジューラ（プールを使わない） */
+int g_mode = MODE_LOCK;
+
+/*
+ * leader/follower の状態
+ * - g_lf_leader  : 0 = リーダー不在（誰でもなれる） / 1 = リーダーがいる（futex の待ち合わせ対象）
+ * - g_lf_waiters : リーダー権を待って futex で寝ている follower の数（0 なら wake を省く）
+ */
+atomic_int g_lf_leader;
+atomic_int g_lf_waiters;
+
+/* プールの設定（main で 既定値 → 引数 → 設定ファイル の順に決まり、SIGHUP で変わる）
+   - 動いているスレッドが読むので atomic にする */
+atomic_int g_min_idle = NUM_CHILD;
+atomic_int g_max_threads = MAX_THREADS;
+atomic_int g_idle_timeout = IDLE_TIMEOUT;
+
+/* accept ごとに接続元を表示するなら 1（設定 verbose、既定 0） */
+atomic_int g_verbose;
+
+/*
+ * プールの状態（複数スレッドから更新するので atomic にする）
+ * - g_total : 生きている accept_thread の本数
+ * - g_idle  : accept 待ち（ロック待ち + accept 中）の本数
+ * - g_busy  : 接続を処理中（send_recv_loop 中）の本数
+ * - g_spawned / g_retired : 起動時以降に増やした/減らした累計
+ */
+atomic_int g_total;
+atomic_int g_idle;
+atomic_int g_busy;
+atomic_long g_spawned;
+atomic_long g_retired;
+
 /*
  * accept() を直列化するための mutex。
  * - PTHREAD_MUTEX_INITIALIZER で静的初期化しているので main() で init は不要。
@@ -68,8 +172,291 @@ pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
  */
 int g_lock_id = -1;
 
+/* シグナルを FD で受け取る（sig_fd_init）
+ *
+ * - g_sig_fd   : signalfd、または自己パイプの読み側（イベントループで待てる）
+ * - g_sig_pipe : 自己パイプ（signalfd が使えないときだけ使う）
+ * - g_sig_mask : sig_fd_init で扱うシグナルの集合
+ */
+int g_sig_fd = -1;
+int g_sig_pipe[2] = { -1, -1 };
+sigset_t g_sig_mask;
+
+/* 自己パイプ用のシグナルハンドラ（signalfd が使えないとき）
+ *
+ * シグナル番号を 1 バイト書くだけ（write は async-signal-safe）。
+ */
+void
+sig_pipe_handler(int sig)
+{
+    unsigned char c;
+    int save;
+
+    save = errno;
+    c = (unsigned char) sig;
+    (void) write(g_sig_pipe[1], &c, 1);
+    errno = save;
+}
+
+/* sigs[0..nsigs) を「読める FD」で受け取るようにする
+ *
+ * 戻り値: イベントループで待つ FD / -1（失敗）
+ *
+ * アルゴリズム：
+ * 1) 対象のシグナルをブロック（以後、非同期に割り込まれない）
+ * 2) signalfd を作る → 届いたシグナルは signalfd_siginfo として read できる
+ * 3) signalfd が無ければ自己パイプ：ハンドラ（SA_RESTART）が番号を 1 バイト書き、
+ *    ブロックを外す
+ */
+int
+sig_fd_init(const int *sigs, int nsigs)
+{
+    struct sigaction sa;
+    int i;
+
+    (void) sigemptyset(&g_sig_mask);
+    for (i = 0; i < nsigs; i++) {
+        (void) sigaddset(&g_sig_mask, sigs[i]);
+    }
+    (void) sigprocmask(SIG_BLOCK, &g_sig_mask, NULL);
+#ifdef __linux__
+    if ((g_sig_fd = signalfd(-1, &g_sig_mask, SFD_NONBLOCK | SFD_CLOEXEC)) != -1) {
+        return (g_sig_fd);
+    }
+    perror("signalfd");
+#endif
+    if (pipe(g_sig_pipe) == -1) {
+        perror("pipe");
+        (void) sigprocmask(SIG_UNBLOCK, &g_sig_mask, NULL);
+        return (-1);
+    }
+    for (i = 0; i < 2; i++) {
+        (void) fcntl(g_sig_pipe[i], F_SETFL, fcntl(g_sig_pipe[i], F_GETFL, 0) | O_NONBLOCK);
+        (void) fcntl(g_sig_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_pipe_handler;
+    (void) sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    for (i = 0; i < nsigs; i++) {
+        (void) sigaction(sigs[i], &sa, NULL);
+    }
+    g_sig_fd = g_sig_pipe[0];
+    (void) sigprocmask(SIG_UNBLOCK, &g_sig_mask, NULL);
+    return (g_sig_fd);
+}
+
+/* シグナル FD から 1 つ取り出す（戻り値：シグナル番号 / 0 = もう無い） */
+int
+sig_fd_read(void)
+{
+#ifdef __linux__
+    struct signalfd_siginfo si;
+#endif
+    unsigned char c;
+
+    if (g_sig_pipe[0] == -1) {
+#ifdef __linux__
+        if (read(g_sig_fd, &si, sizeof(si)) == (ssize_t) sizeof(si)) {
+            return ((int) si.ssi_signo);
+        }
+#endif
+        return (0);
+    }
+    if (read(g_sig_fd, &c, 1) == 1) {
+        return (c);
+    }
+    return (0);
+}
+
+/* グレースフル停止（drain）
+ *
+ * SIGTERM / SIGINT を受けたら（メインスレッドがシグナル FD で受け取る）、次の順で止める：
+ * 1) g_draining を立て、listen ソケットを shutdown する
+ *    - 新しい接続は拒否され、poll / accept で待っているスレッドもすぐ起こされる
+ *      （別スレッドが poll 中の FD を close しても起こされないので shutdown を使う）
+ *    - スレッドの補充（pool_spawn）もやめる
+ * 2) idle のスレッドはそのまま終了し、busy のスレッドは今の接続を最後まで処理してから終了する
+ * 3) スレッドが 0 になったら終了。g_drain_timeout 秒（既定 DRAIN_TIMEOUT、設定 drain_timeout）を
+ *    過ぎたら残りの接続ごと終了する
+ *    （main から戻る = プロセス終了で、残っている接続 FD はまとめて閉じられる）
+ * - 途中経過（残りのスレッドと接続の数、経過時間）を約 1 秒ごとに表示する
+ */
+#define DRAIN_TIMEOUT   (30)
+
+atomic_int g_drain_timeout = DRAIN_TIMEOUT;     /* 管理スレッドの set でも変わるので atomic */
+atomic_int g_draining;          /* 1 = drain 中（スレッドは次の区切りで終了する） */
+double g_drain_start = 0.0;     /* drain を始めた時刻（CLOCK_MONOTONIC、メインスレッドだけが使う） */
+double g_drain_report = 0.0;    /* 最後に途中経過を表示した時刻 */
+
+/* 単調増加時計の現在値（秒） */
+double
+now_sec(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec + (double) ts.tv_nsec / 1e9);
+}
+
+/* drain を始める（sig：受けたシグナル、nconn：その時点の接続数） */
+void
+drain_begin(int sig, int nconn)
+{
+    g_drain_start = g_drain_report = now_sec();
+    (void) fprintf(stderr, "drain:signal %d, stop accepting, conns=%d, timeout=%ds\n",
+                   sig, nconn, g_drain_timeout);
+}
+
+/* drain を終えてよいか調べる（nthread：残っているスレッド、nconn：処理中の接続）
+ *
+ * 戻り値：1 = 終了してよい（スレッドが 0、または期限切れ） / 0 = まだ待つ
+ */
+int
+drain_check(int nthread, int nconn)
+{
+    double now;
+
+    now = now_sec();
+    if (nthread == 0) {
+        (void) fprintf(stderr, "drain:done in %.1fs\n", now - g_drain_start);
+        return (1);
+    }
+    if (now - g_drain_start >= g_drain_timeout) {
+        (void) fprintf(stderr, "drain:deadline, closing %d conns (threads=%d)\n",
+                       nconn, nthread);
+        return (1);
+    }
+    if (now - g_drain_report >= 1.0) {
+        g_drain_report = now;
+        (void) fprintf(stderr, "drain:threads=%d conns=%d elapsed=%.1fs\n",
+                       nthread, nconn, now - g_drain_start);
+    }
+    return (0);
+}
+
 /* --------------------------- サーバソケット準備 --------------------------- */
 
+/* 接続単位の TCP チューニング（プロファイル）
+ *
+ * 起動引数で 1 つ選ぶ（server8 port [latency|throughput|churn|none] ...、既定は none = SO_REUSEADDR のみ）。
+ * ポート番号の次に書き、省略できる（profile_arg）。
+ *
+ * - latency    : TCP_NODELAY（Nagle を切って小さな応答をすぐ出す）
+ *                TCP_QUICKACK（遅延 ACK をやめる。カーネルが自動で戻すので受信のたびに付け直す）
+ *                TCP_NOTSENT_LOWAT を小さく（未送信データを溜め込まず、書ける通知を早く返す）
+ * - throughput : SO_SNDBUF / SO_RCVBUF を大きく（ウィンドウを広げて 1 回あたりの転送量を増やす）
+ *                応答を複数回の write で組み立てるときは TCP_CORK で 1 セグメントにまとめる
+ *                （このサーバは行ごとの応答を 1 回の writev にしているので CORK は要らない）
+ * - churn      : TCP_DEFER_ACCEPT（最初のデータが届くまで accept を起こさない）
+ *                TCP_FASTOPEN（SYN に載ったデータを受け付ける。sysctl net.ipv4.tcp_fastopen の
+ *                2 のビットが立っていないと効かない）
+ *                listen のバックログを大きく（実際は net.core.somaxconn で頭打ち）
+ *
+ * - listen ソケットに付けた TCP_NODELAY / TCP_NOTSENT_LOWAT / SO_SNDBUF / SO_RCVBUF は
+ *   accept した接続に引き継がれる（Linux）。引き継がれない TCP_QUICKACK だけ tune_accepted で付ける
+ * - SO_RCVBUF はウィンドウスケールが決まる SYN より前（listen の前）に付ける必要がある
+ * - 効果の比較は tune-bench（ループバックで応答遅延・転送速度・接続の回転を計る）
+ */
+#define PROFILE_NONE        (0)
+#define PROFILE_LATENCY     (1)
+#define PROFILE_THROUGHPUT  (2)
+#define PROFILE_CHURN       (3)
+
+const char *g_profile_name[] = { "none", "latency", "throughput", "churn" };
+
+int g_profile = PROFILE_NONE;
+
+#define TUNE_NOTSENT_LOWAT  (16 * 1024)         /* latency：未送信データの上限 */
+#define TUNE_BUFSZ          (4 * 1024 * 1024)   /* throughput：送受信バッファ（wmem_max / rmem_max で頭打ち） */
+#define TUNE_DEFER_ACCEPT   (1)                 /* churn：データを待つ秒数 */
+#define TUNE_FASTOPEN_QLEN  (256)               /* churn：TFO の保留キュー */
+#define TUNE_BACKLOG        (65535)             /* churn：listen のバックログ */
+
+/* プロファイル名 → 番号（知らない名前なら -1） */
+int
+profile_lookup(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(g_profile_name) / sizeof(g_profile_name[0])); i++) {
+        if (strcmp(name, g_profile_name[i]) == 0) {
+            return (i);
+        }
+    }
+    return (-1);
+}
+
+/* 引数のポート番号の次がプロファイル名なら取り出し、後ろの引数を 1 つ前に詰める
+ * （省略できる。詰めるので、後ろの引数はプロファイルを書かないときと同じ位置で読める） */
+void
+profile_arg(int *argc, char *argv[])
+{
+    int i;
+
+    if (*argc > 2 && profile_lookup(argv[2]) != -1) {
+        g_profile = profile_lookup(argv[2]);
+        for (i = 2; i < *argc - 1; i++) {
+            argv[i] = argv[i + 1];
+        }
+        argv[--*argc] = NULL;
+    }
+    (void) fprintf(stderr, "profile=%s\n", g_profile_name[g_profile]);
+}
+
+/* listen ソケットにプロファイルを付ける（bind / listen の前に呼ぶ。失敗は表示して続行） */
+void
+tune_listen(int soc)
+{
+    int opt;
+
+    switch (g_profile) {
+    case PROFILE_LATENCY:
+        opt = 1;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_NODELAY)");
+        }
+        opt = TUNE_NOTSENT_LOWAT;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_NOTSENT_LOWAT)");
+        }
+        break;
+    case PROFILE_THROUGHPUT:
+        opt = TUNE_BUFSZ;
+        if (setsockopt(soc, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(SO_SNDBUF)");
+        }
+        if (setsockopt(soc, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(SO_RCVBUF)");
+        }
+        break;
+    case PROFILE_CHURN:
+        opt = TUNE_DEFER_ACCEPT;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_DEFER_ACCEPT)");
+        }
+        opt = TUNE_FASTOPEN_QLEN;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_FASTOPEN, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_FASTOPEN)");
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* accept した接続 / 受信した直後の接続に、引き継がれない分を付ける */
+void
+tune_accepted(int acc)
+{
+    int opt;
+
+    if (g_profile == PROFILE_LATENCY) {
+        opt = 1;
+        (void) setsockopt(acc, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt));
+    }
+}
+
 /*
  * server_socket(portnm)
  *   - TCP/IPv4 の listening socket を生成し、指定ポートで待ち受け開始する。
@@ -147,6 +534,9 @@ server_socket(const char *portnm)
         return (-1);
     }
 
+    /* プロファイルの TCP オプション（バッファの大きさは SYN より前に決めておく） */
+    tune_listen(soc);
+
     /* ソケットにアドレスを指定 */
     if (bind(soc, res0->ai_addr, res0->ai_addrlen) == -1) {
         perror("bind");
@@ -157,9 +547,9 @@ server_socket(const char *portnm)
 
     /*
      * listen():
-     *   - backlog に SOMAXCONN を指定（OSが許す最大級の待ち行列）
+     *   - backlog に SOMAXCONN を指定（OSが許す最大級の待ち行列。churn はもっと大きく頼む）
      */
-    if (listen(soc, SOMAXCONN) == -1) {
+    if (listen(soc, g_profile == PROFILE_CHURN ? TUNE_BACKLOG : SOMAXCONN) == -1) {
         perror("listen");
         (void) close(soc);
         freeaddrinfo(res0);
@@ -170,175 +560,939 @@ server_socket(const char *portnm)
     return (soc);
 }
 
-/* --------------------------- 送受信処理（1接続） --------------------------- */
+/* 接続元アドレス文字列の最大長（"IPv6アドレス:ポート" + NUL） */
+#define PEER_STRLEN (INET6_ADDRSTRLEN + 8)
 
-/*
- * サイズ指定文字列連結 mystrlcat()
+/* 10 進数の書き出し（format_peer の下請け） */
+char *
+put_dec(char *p, unsigned int v)
+{
+    char tmp[10];
+    int n;
+
+    n = 0;
+    do {
+        tmp[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0) {
+        *p++ = tmp[--n];
+    }
+    return (p);
+}
+
+/* 接続元アドレスの文字列化（getnameinfo を使わない高速版）
  *
- * 目的：
- *   - dst の末尾に src を連結するが、全体サイズ size を超えないようにする。
- *   - 典型的な strlcat 系の実装で、バッファオーバーフローを避ける教材。
+ * ss  : accept で得た生のアドレス（AF_INET / AF_INET6）
+ * buf : 出力先（PEER_STRLEN バイト以上）
+ *
+ * 出力形式は getnameinfo(NI_NUMERICHOST | NI_NUMERICSERV) の host と port を
+ * ':' でつないだもの（"127.0.0.1:50000"）と同じ。
  *
- * 返り値：
- *   - 連結しようとした結果の理想長（切り詰めが起きると size 以上になる可能性がある）
+ * - getnameinfo は NSS/ロケールを経由し、内部でも書式化を行うので accept 毎に呼ぶと重い
+ * - ここでは 10 進/16 進の変換を手で書き、malloc も snprintf も使わない
+ * - IPv6 は RFC 5952 に従い、最長の 0 の連続（2 グループ以上）を "::" に縮める
+ *
+ * 戻り値：書き込んだ文字数（NUL を除く）
  */
 size_t
-mystrlcat(char *dst, const char *src, size_t size)
+format_peer(const struct sockaddr_storage *ss, char *buf)
 {
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
+    static const char hex[] = "0123456789abcdef";
+    const struct sockaddr_in *sin;
+    const struct sockaddr_in6 *sin6;
+    const unsigned char *a;
+    unsigned int port, w;
+    int i, j, best, bestlen, shift;
+    char *p;
 
-    /* dst の終端を探しつつ、残りサイズを計算する */
-    for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--) ;
-    dlen = (size_t)(pd - dst);
+    p = buf;
+    switch (ss->ss_family) {
+    case AF_INET:
+        sin = (const struct sockaddr_in *) ss;
+        a = (const unsigned char *) &sin->sin_addr;
+        for (i = 0; i < 4; i++) {
+            if (i > 0) {
+                *p++ = '.';
+            }
+            p = put_dec(p, a[i]);
+        }
+        port = ntohs(sin->sin_port);
+        break;
 
-    /* 既にサイズを使い切っているなら、理想長だけ返す */
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
-    }
+    case AF_INET6:
+        sin6 = (const struct sockaddr_in6 *) ss;
+        a = sin6->sin6_addr.s6_addr;
 
-    /* dst の書き込み可能最終位置（終端 '\0' の分を残す） */
-    pde = dst + size - 1;
+        /* 最長の 0 グループの連続を探す */
+        best = -1;
+        bestlen = 0;
+        for (i = 0; i < 8; i = j + 1) {
+            for (j = i; j < 8 && a[2 * j] == 0 && a[2 * j + 1] == 0; j++)
+                ;
+            if (j - i >= 2 && j - i > bestlen) {
+                best = i;
+                bestlen = j - i;
+            }
+        }
 
-    /* src を連結（入りきる分だけ） */
-    for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
-    }
+        if (best == 0
+            && (bestlen == 6 || (bestlen == 5 && a[10] == 0xff && a[11] == 0xff))) {
+            /* IPv4 射影/互換アドレス（::ffff:a.b.c.d, ::a.b.c.d）は末尾 32bit を 10 進で書く
+             * （inet_ntop/getnameinfo と同じ判定） */
+            *p++ = ':';
+            *p++ = ':';
+            if (bestlen == 5) {
+                (void) memcpy(p, "ffff:", 5);
+                p += 5;
+            }
+            for (j = 12; j < 16; j++) {
+                if (j > 12) {
+                    *p++ = '.';
+                }
+                p = put_dec(p, a[j]);
+            }
+        } else {
+            for (i = 0; i < 8; i++) {
+                if (i == best) {
+                    *p++ = ':';
+                    *p++ = ':';
+                    i += bestlen - 1;
+                    continue;
+                }
+                if (i > 0 && i != best + bestlen) {
+                    *p++ = ':';
+                }
+                w = ((unsigned int) a[2 * i] << 8) | a[2 * i + 1];
+                for (shift = 12; shift > 0 && ((w >> shift) & 0xf) == 0; shift -= 4)
+                    ;
+                for (; shift >= 0; shift -= 4) {
+                    *p++ = hex[(w >> shift) & 0xf];
+                }
+            }
+        }
+        port = ntohs(sin6->sin6_port);
+        break;
 
-    /* 残りを '\0' で埋める（確実に終端する） */
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
+    default:
+        *p++ = '?';
+        port = 0;
+        break;
     }
 
-    /* src の長さを数える（ps を末尾まで進める） */
-    while (*ps++) ;
-    return (dlen + (size_t)(ps - src - 1));
+    *p++ = ':';
+    p = put_dec(p, port);
+    *p = '\0';
+    return ((size_t) (p - buf));
 }
 
-/*
- * send_recv_loop(acc)
+/* --------------------------- 送受信処理（1接続） --------------------------- */
+
+/* 行区切り（CR/LF）の一括検索
  *
- * 役割：
- *   - 接続済みソケット acc から 1 行受信し、":OK\r\n" を付けて返信する。
- *   - クライアントが切断したら終了する。
+ * buf[0..len) に含まれる '\r' / '\n' の位置（先頭からのオフセット）を
+ * 出現順に off[] へ最大 max 個書き込み、書き込んだ個数を返す。
  *
- * 実装のポイント：
- *   - recv() が 0 を返すと相手が閉じた（EOF）と判断できる。
- *   - 受信データは文字列として扱うので buf[len] = '\0' を入れる。
- *   - ログにスレッドID（pthread_self）を出して「どのスレッドが処理したか」を可視化。
+ * strpbrk(buf, "\r\n") との違い：
+ * - NUL 終端を必要としない（recv で得た len をそのまま渡せる）
+ * - 1 回の走査ですべての区切り位置が得られる（行の切り出しを上位で行える）
+ * - x86 では 16/32 バイト単位で比較する SIMD 版を使う
+ *
+ * 実装は 3 種類あり、scan_eol_init() で CPU を見て g_scan_eol に設定する：
+ * - scan_eol_scalar : 1 バイトずつ（どの CPU でも動く）
+ * - scan_eol_sse2   : 16 バイトずつ比較 → movemask でビット列にして位置を取り出す
+ * - scan_eol_avx2   : 32 バイトずつ（AVX2 がある CPU のみ）
  */
-void
-send_recv_loop(int acc)
+size_t
+scan_eol_scalar(const char *buf, size_t len, size_t *off, size_t max)
 {
-    char buf[512], *ptr;
-    ssize_t len;
+    size_t i, n;
 
-    for (;;) {
-        /* 受信 */
-        if ((len = recv(acc, buf, sizeof(buf), 0)) == -1) {
-            /* ソケット受信エラー */
-            perror("recv");
-            break;
+    for (i = 0, n = 0; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
         }
+    }
+    return (n);
+}
 
-        if (len == 0) {
-            /* 相手が close した（EOF） */
-            (void) fprintf(stderr, "<%d>recv:EOF\n", (int) pthread_self());
-            break;
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+size_t
+scan_eol_sse2(const char *buf, size_t len, size_t *off, size_t max)
+{
+    __m128i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
+
+    cr = _mm_set1_epi8('\r');
+    lf = _mm_set1_epi8('\n');
+    for (i = 0, n = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (buf + i));
+        mask = (unsigned int) _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        /* 立っているビット = 区切り文字の位置（下位ビットから順に取り出す） */
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
+            }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    /* 16 バイトに満たない残りは 1 バイトずつ */
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
         }
+    }
+    return (n);
+}
 
-        /* 受信内容を C 文字列にする（表示・加工のため） */
-        buf[len] = '\0';
+__attribute__((target("avx2")))
+size_t
+scan_eol_avx2(const char *buf, size_t len, size_t *off, size_t max)
+{
+    __m256i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
 
-        /*
-         * 改行コードを含むならそこで切る（ログを1行に収める）。
-         * 例: "hello\r\n" -> "hello"
-         */
-        if ((ptr = strpbrk(buf, "\r\n")) != NULL) {
-            *ptr = '\0';
+    cr = _mm256_set1_epi8('\r');
+    lf = _mm256_set1_epi8('\n');
+    for (i = 0, n = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        mask = (unsigned int) _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
+            }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
         }
+    }
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
+#endif
 
-        /* 受信内容のログ */
-        (void) fprintf(stderr, "<%d>[client]%s\n", (int) pthread_self(), buf);
-
-        /* 応答文字列作成（元の文字列 + ":OK\r\n"） */
-        (void) mystrlcat(buf, ":OK\r\n", sizeof(buf));
-        len = (ssize_t) strlen(buf);
+/* 使用する実装（scan_eol_init で決まる。スレッド生成前に 1 回だけ呼ぶこと） */
+size_t (*g_scan_eol)(const char *, size_t, size_t *, size_t) = scan_eol_scalar;
+const char *g_scan_eol_name = "scalar";
 
-        /* 応答送信 */
-        if ((len = send(acc, buf, (size_t) len, 0)) == -1) {
-            perror("send");
-            break;
-        }
+void
+scan_eol_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_scan_eol = scan_eol_avx2;
+        g_scan_eol_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        g_scan_eol = scan_eol_sse2;
+        g_scan_eol_name = "sse2";
     }
+#endif
 }
 
-/* --------------------------- accept 多重化（スレッド） --------------------------- */
+/* 応答の末尾に付ける文字列（行ごとに iovec で後ろに並べる。受信バッファに場所は取らない） */
+#define RESP_SUFFIX     ":OK\r\n"
+#define RESP_SUFFIX_LEN (sizeof(RESP_SUFFIX) - 1)
 
-/*
- * accept_thread(arg)
+/* 長さ付きバッファ（応答組み立て用）
  *
- * 引数：
- *   arg は int*（listening socket の FD へのポインタ）を想定。
- *
- * アルゴリズム（ループ1回あたり）：
- *   1) mutex ロック（accept 権を獲得）
- *   2) accept(soc) で接続を受ける（ここがブロックしうる）
- *   3) mutex アンロック（次のスレッドに accept 機会を譲る）
- *   4) 受け取った acc で send_recv_loop()（接続処理はロック外で並列）
- *   5) acc を close して次へ
+ * base[0 .. size) の中で、データは base[off .. off+len) にある。
  *
- * なぜ mutex が必要？
- *   - 実際には OS は複数スレッドからの accept をある程度安全に扱えるが、
- *     教材として「accept の担当を 1 スレッドに限定する」ことで挙動を読みやすくする意図。
+ *   base                off            off+len                 size
+ *    |<-- headroom -->|<---- data ---->|<---- tailroom ---->|
  *
- * 注意点：
- *   - この実装は「ロックを取ってから accept を呼ぶ」ため、
- *     そのスレッドが accept 待ちでブロックしている間、他スレッドは accept に入れない。
- *   - つまり accept の並列性をあえて潰している（意図的）。
+ * mystrlcat + strlen との違い：
+ * - 長さを持っているので、連結のたびに NUL を探して先頭から数え直さない（O(1) で追記）
+ * - NUL 終端を必要としないので、recv したバイト列をそのまま扱える
+ * - 先頭側にも空き（headroom）を取れるので、ヘッダ等を後から前に付けられる
+ * - データ部をそのまま iovec にして writev に渡せる
  */
-void *
-accept_thread(void *arg)
-{
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-    struct sockaddr_storage from;
-    int acc, soc;
-    socklen_t len;
+struct mbuf {
+    char *base;                         /* 領域の先頭 */
+    size_t size;                        /* 領域の大きさ */
+    size_t off;                         /* データの開始位置 */
+    size_t len;                         /* データ長 */
+};
 
-    /* 引数（listening socket FD）を取り出す */
-    soc = *(int *) arg;
+#define MBUF_DATA(m_)     ((m_)->base + (m_)->off)
+#define MBUF_TAIL(m_)     ((m_)->base + (m_)->off + (m_)->len)
+#define MBUF_HEADROOM(m_) ((m_)->off)
+#define MBUF_TAILROOM(m_) ((m_)->size - (m_)->off - (m_)->len)
 
-    /* スレッドをデタッチ（join 不要にする） */
-    pthread_detach(pthread_self());
+/* 領域 base[0..size) を、先頭に headroom バイト空けた空のバッファとして使い始める */
+void
+mbuf_init(struct mbuf *m, char *base, size_t size, size_t headroom)
+{
+    m->base = base;
+    m->size = size;
+    m->off = headroom < size ? headroom : size;
+    m->len = 0;
+}
 
-    for (;;) {
-        (void) fprintf(stderr, "<%d>ロック獲得開始\n", (int) pthread_self());
+/* 末尾に n バイト追記する（tailroom が足りなければ何もせず -1） */
+int
+mbuf_append(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_TAILROOM(m)) {
+        return (-1);
+    }
+    (void) memcpy(MBUF_TAIL(m), src, n);
+    m->len += n;
+    return (0);
+}
 
-        /* mutex を取る（accept の順番待ち） */
-        (void) pthread_mutex_lock(&g_lock);
+/* 先頭に n バイト付け足す（headroom が足りなければ何もせず -1） */
+int
+mbuf_prepend(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_HEADROOM(m)) {
+        return (-1);
+    }
+    m->off -= n;
+    m->len += n;
+    (void) memcpy(MBUF_DATA(m), src, n);
+    return (0);
+}
 
-        /* 監視用：今ロックを持っているスレッドIDを記録 */
-        g_lock_id = (int) pthread_self();
+/* データ部を iovec に変換する（戻り値は writev に渡す要素数） */
+int
+mbuf_iov(const struct mbuf *m, struct iovec *iov)
+{
+    if (m->len == 0) {
+        return (0);
+    }
+    iov[0].iov_base = MBUF_DATA(m);
+    iov[0].iov_len = m->len;
+    return (1);
+}
 
-        (void) fprintf(stderr, "<%d>ロック獲得！\n", (int) pthread_self());
+/* 行ごとの応答（続けて届いた要求の切り出し）
+ *
+ * 1 回の recv には、クライアントが続けて送った複数の要求（行）が入っていることがある。
+ * g_scan_eol で区切りの位置をまとめて求め、1 行ごとに「行 + RESP_SUFFIX」の応答を 1 つずつ返す。
+ * - 区切りは CR / LF / CRLF（CR の直後の LF は同じ区切りとして読み飛ばす）
+ * - 改行で終わらない末尾は 1 行とする（呼び出し側はふつう line_end までしか渡さず、
+ *   行の途中は次の recv まで持ち越す。EOF のときと、改行の無いまま受信バッファが一杯に
+ *   なったときだけ末尾まで渡す）
+ * - 応答は受信バッファ内の行と RESP_SUFFIX を交互に並べた iovec にする（行をコピーしない）
+ *
+ * p[*pos..len) から最大 LINE_BATCH 行を iov[]（2 * LINE_BATCH 個）に並べて *pos を進め、
+ * 並べた応答の合計バイト数を *bytes に入れる。
+ * 戻り値：並べた iovec の数（行数の 2 倍。0 = もう行が無い）
+ */
+#define LINE_BATCH  (64)
 
-        len = (socklen_t) sizeof(from);
+int
+frame_lines(const char *p, size_t len, size_t *pos, struct iovec *iov, size_t *bytes)
+{
+    size_t off[LINE_BATCH], base, start, e, n, k;
+    int cnt;
 
-        /*
-         * accept():
-         *   - 新しい接続が来るまでブロックする可能性がある。
-         *   - このコードでは mutex を保持したまま accept するため、
-         *     ここで止まっている間、他スレッドは lock で待つ（= accept が直列化される）。
-         */
-        if ((acc = accept(soc, (struct sockaddr *) &from, &len)) == -1) {
-            /*
-             * EINTR:
-             *   - シグナル割り込みで accept が中断されることがある。
-             *   - それ以外のエラーなら perror。
-             */
-            if (errno != EINTR) {
-                perror("accept");
+    start = *pos;
+    /* 前の呼び出しが CR で終わっていれば、続く LF は同じ区切り */
+    if (start > 0 && start < len && p[start - 1] == '\r' && p[start] == '\n') {
+        start++;
+    }
+    cnt = 0;
+    *bytes = 0;
+    if (start >= len) {
+        *pos = len;
+        return (0);
+    }
+    base = start;
+    n = g_scan_eol(p + base, len - base, off, LINE_BATCH);
+    for (k = 0; k <= n; k++) {
+        if (k < n) {
+            e = base + off[k];
+            if (e == start && e > base && p[e] == '\n' && p[e - 1] == '\r') {
+                /* CRLF の LF */
+                start = e + 1;
+                continue;
+            }
+        } else if (n < LINE_BATCH && start < len) {
+            /* 改行で終わらない末尾 */
+            e = len;
+        } else {
+            break;
+        }
+        iov[cnt].iov_base = (char *) p + start;
+        iov[cnt].iov_len = e - start;
+        iov[cnt + 1].iov_base = RESP_SUFFIX;
+        iov[cnt + 1].iov_len = RESP_SUFFIX_LEN;
+        *bytes += e - start + RESP_SUFFIX_LEN;
+        cnt += 2;
+        start = e < len ? e + 1 : len;
+    }
+    *pos = start;
+    return (cnt);
+}
+
+/* p[0..len) の最後の区切り（CR / LF）の直後の位置（区切りが無ければ 0）
+ *
+ * recv の区切りは行の区切りと一致しないので、ここより後ろ（まだ改行の届いていない行の途中）は
+ * 応答せずに次の recv まで持ち越す
+ */
+size_t
+line_end(const char *p, size_t len)
+{
+    while (len > 0 && p[len - 1] != '\n' && p[len - 1] != '\r') {
+        len--;
+    }
+    return (len);
+}
+
+/* 接続の統計（管理用ソケットの stats / conns で表示する）
+ *
+ * - g_conn[]  : 処理中の接続ごとの状態（FD を添字にする。CONN_MAX 以上の FD は conns に出ない）
+ *   - 書くのはその接続を処理するスレッドだけ、読むのは管理スレッド
+ *     （カウンタは relaxed の atomic。他のスレッドとキャッシュラインを取り合わない）
+ *   - active は他の欄を書いてから立てる（release）。管理スレッドは active を見てから読む（acquire）
+ *   - 閉じた直後に同じ FD が再利用されると、conns の 1 行に新旧が混ざることはある（表示だけなので許す）
+ * - g_stats   : 閉じた接続の累計（conn_close で 1 回だけ足す。要求ごとには共有の変数に触らない）
+ *   stats の requests / rx / tx は、この累計に処理中の接続の分を足したもの
+ */
+#define CONN_MAX    (65536)
+
+struct conn {
+    atomic_int active;
+    double since;                       /* 接続した時刻（now_sec） */
+    struct sockaddr_storage addr;       /* 接続元 */
+    atomic_ulong nreq;                  /* 応答した行の数 */
+    atomic_ulong nrecv;                 /* recv を呼んだ回数 */
+    atomic_ullong rx, tx;               /* 受信 / 送信バイト数 */
+};
+
+struct stats {
+    double start;                       /* 起動した時刻（now_sec） */
+    atomic_ulong accepted, closed, requests;
+    atomic_ulong recv_calls;
+    atomic_ullong rx, tx;
+    atomic_ulong rbuf_conns;            /* ヒープの受信バッファを持っている接続（現在値） */
+    atomic_ullong rbuf_bytes;           /* その合計バイト数（現在値） */
+    atomic_ulong rbuf_grow, rbuf_shrink;
+};
+
+struct conn *g_conn;
+int g_conn_max;
+struct stats g_stats;
+
+/* 接続の表を用意する（FD の上限の分。CONN_MAX まで） */
+int
+conn_init(void)
+{
+    struct rlimit rl;
+
+    g_conn_max = CONN_MAX;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+        && rl.rlim_cur < CONN_MAX) {
+        g_conn_max = (int) rl.rlim_cur;
+    }
+    if ((g_conn = calloc((size_t) g_conn_max, sizeof(struct conn))) == NULL) {
+        perror("calloc");
+        return (-1);
+    }
+    g_stats.start = now_sec();
+    return (0);
+}
+
+/* 接続の処理を始める（表に載らない FD は local に数えて、閉じるときの累計にだけ足す） */
+struct conn *
+conn_open(int acc, struct conn *local)
+{
+    struct conn *c;
+    socklen_t len;
+
+    c = acc < g_conn_max ? &g_conn[acc] : local;
+    c->since = now_sec();
+    len = (socklen_t) sizeof(c->addr);
+    if (getpeername(acc, (struct sockaddr *) &c->addr, &len) == -1) {
+        c->addr.ss_family = AF_UNSPEC;
+    }
+    atomic_store_explicit(&c->nreq, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->nrecv, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->rx, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->tx, 0, memory_order_relaxed);
+    atomic_store_explicit(&c->active, 1, memory_order_release);
+    atomic_fetch_add_explicit(&g_stats.accepted, 1, memory_order_relaxed);
+    return (c);
+}
+
+/* 接続の処理を終える（close の前に呼ぶ。FD が再利用される前に表から外す） */
+void
+conn_close(struct conn *c)
+{
+    atomic_fetch_add_explicit(&g_stats.requests,
+                              atomic_load_explicit(&c->nreq, memory_order_relaxed),
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_stats.recv_calls,
+                              atomic_load_explicit(&c->nrecv, memory_order_relaxed),
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_stats.rx, atomic_load_explicit(&c->rx, memory_order_relaxed),
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_stats.tx, atomic_load_explicit(&c->tx, memory_order_relaxed),
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&g_stats.closed, 1, memory_order_relaxed);
+    atomic_store_explicit(&c->active, 0, memory_order_release);
+}
+
+/* 受信バッファの大きさ合わせ
+ *
+ * 従来は各スレッドのスタックの 512 バイトに recv していた。大きな要求は 512 バイトずつ
+ * 何度も recv し、改行の無いまま一杯になると途中で切れた応答を返していた。そこで：
+ *
+ * - recv の前に ioctl(FIONREAD) で届いているバイト数を見て、最近の要求の大きさ（rexpect）と
+ *   持ち越しを合わせて 512 バイトで足りなければ、ヒープのバッファを 2 のべき乗で確保・拡張し
+ *   1 回の recv で読み切る（上限 RBUF_MAX。改行の無いまま一杯になったら広げて読み続け、
+ *   RBUF_MAX で一杯になったときだけそこまでを 1 行とする）
+ * - 持ち越しが無く何も届いていない（次の要求を待って recv で止まる）ときはスタックに戻して
+ *   ヒープを解放する → 待機中の接続はヒープのバッファを持たない
+ *   （その後に大きな要求が届いたら、最初の 512 バイトを読んでから広げる）
+ * - rexpect に対して 4 倍より大きければ縮める
+ * - 効果は管理用ソケットの stats（recv_per_kb / rbuf_conns / rbuf_bytes）で見る
+ */
+#define RBUF_STACK      (512)                   /* スタックで読む大きさ（従来の buf） */
+#define RBUF_MAX        (1024 * 1024)           /* ヒープのバッファの上限 */
+
+/* want バイトを読めるバッファの大きさ（2 のべき乗、RBUF_STACK * 2 〜 RBUF_MAX） */
+size_t
+rbuf_roundup(size_t want)
+{
+    size_t n;
+
+    for (n = RBUF_STACK * 2; n < want && n < RBUF_MAX; n <<= 1) {
+        ;
+    }
+    return (n);
+}
+
+/* 受信バッファ m を need バイトに合わせる（stack：RBUF_STACK バイトのスタックのバッファ）
+ *
+ * - need が RBUF_STACK 以下ならスタックに戻してヒープを解放する
+ * - それより大きければヒープを確保・拡張する（4 倍より大きいときだけ縮める）
+ * m のデータ（持ち越し。m->off は 0）は移す。確保に失敗したら今のまま
+ */
+void
+rbuf_fit(struct mbuf *m, char *stack, size_t need)
+{
+    size_t n;
+    char *p;
+
+    if (need <= RBUF_STACK) {
+        if (m->base != stack) {
+            (void) memcpy(stack, m->base, m->len);
+            free(m->base);
+            atomic_fetch_sub_explicit(&g_stats.rbuf_conns, 1, memory_order_relaxed);
+            atomic_fetch_sub_explicit(&g_stats.rbuf_bytes, m->size, memory_order_relaxed);
+            atomic_fetch_add_explicit(&g_stats.rbuf_shrink, 1, memory_order_relaxed);
+            m->base = stack;
+            m->size = RBUF_STACK;
+        }
+        return;
+    }
+    n = rbuf_roundup(need);
+    if (n == m->size || (m->base != stack && n < m->size && n * 4 > m->size)) {
+        return;
+    }
+    if ((p = m->base == stack ? malloc(n) : realloc(m->base, n)) == NULL) {
+        perror("malloc");
+        return;
+    }
+    if (m->base == stack) {
+        (void) memcpy(p, stack, m->len);
+        atomic_fetch_add_explicit(&g_stats.rbuf_conns, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_sub_explicit(&g_stats.rbuf_bytes, m->size, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&g_stats.rbuf_bytes, n, memory_order_relaxed);
+    atomic_fetch_add_explicit(n > m->size ? &g_stats.rbuf_grow : &g_stats.rbuf_shrink, 1,
+                              memory_order_relaxed);
+    m->base = p;
+    m->size = n;
+}
+
+/*
+ * coro モード：コルーチン（ユーザ空間スレッド）で send_recv_loop を動かす
+ *
+ * - send_recv_loop はブロッキング I/O の書き方のまま、recv/writev を co_recv/co_writev 経由で呼ぶ
+ * - コルーチンの中では接続 FD はノンブロッキングで、EAGAIN になったら
+ *   「この FD が読める/書けるようになったら再開して」と epoll に登録して
+ *   スケジューラ（coro_sched）に制御を返す（swapcontext）
+ * - コルーチンの外（lock/lf モードのスレッド）から呼ばれたときは普通の recv/writev になる
+ * - スケジューラ側（coro_sched など）は後ろの「コルーチン」
+ */
+struct coro {
+    ucontext_t ctx;                     /* このコルーチンのレジスタ・スタック */
+    char *stack;                        /* mmap した領域の先頭（ガードページを含む） */
+    size_t stack_len;
+    int acc;                            /* 担当する接続 */
+    int registered;                     /* acc を epoll に登録済みか */
+    int done;                           /* send_recv_loop が終わった */
+    struct coro *next;                  /* 空きリスト用 */
+};
+
+/* スケジューラごと（= OS スレッドごと）の状態 */
+__thread ucontext_t t_sched_ctx;        /* スケジューラ側のコンテキスト */
+__thread struct coro *t_co_current;     /* 実行中のコルーチン（NULL: コルーチン外） */
+__thread int t_epollfd = -1;
+
+/* FD が events（EPOLLIN/EPOLLOUT）になるまでコルーチンを止め、スケジューラへ戻る
+ *
+ * 戻り値：0 = 再開された / -1 = epoll に登録できなかった
+ */
+int
+co_wait_fd(int fd, unsigned int events)
+{
+    struct coro *co;
+    struct epoll_event ev;
+
+    co = t_co_current;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = co;
+    if (epoll_ctl(t_epollfd, co->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl");
+        return (-1);
+    }
+    co->registered = 1;
+    (void) swapcontext(&co->ctx, &t_sched_ctx);
+    return (0);
+}
+
+/* recv の代わり（コルーチン内なら EAGAIN で待つ） */
+ssize_t
+co_recv(int fd, void *buf, size_t len, int flags)
+{
+    ssize_t ret;
+
+    for (;;) {
+        ret = recv(fd, buf, len, flags);
+        if (ret == -1 && t_co_current != NULL
+            && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (co_wait_fd(fd, EPOLLIN) == -1) {
+                return (-1);
+            }
+            continue;
+        }
+        return (ret);
+    }
+}
+
+/* writev の代わり（コルーチン内なら EAGAIN で待つ） */
+ssize_t
+co_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    ssize_t ret;
+
+    for (;;) {
+        ret = writev(fd, iov, iovcnt);
+        if (ret == -1 && t_co_current != NULL
+            && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            if (co_wait_fd(fd, EPOLLOUT) == -1) {
+                return (-1);
+            }
+            continue;
+        }
+        return (ret);
+    }
+}
+
+/*
+ * send_recv_loop(acc)
+ *
+ * 役割：
+ *   - 接続済みソケット acc から 1 行受信し、":OK\r\n" を付けて返信する。
+ *   - クライアントが切断したら終了する。
+ *
+ * 実装のポイント：
+ *   - recv() が 0 を返すと相手が閉じた（EOF）と判断できる。
+ *   - 受信データは行ごとに区切って応答する（行の途中は次の recv まで持ち越す）。
+ *   - 大きな要求は FIONREAD に合わせて広げたヒープのバッファで読む（rbuf_fit）。
+ *   - recv/writev は co_recv/co_writev 経由（coro モードでは EAGAIN で他の接続に譲る）。
+ *   - ログにスレッドID（pthread_self）を出して「どのスレッドが処理したか」を可視化。
+ *   - 受信 / 送信バイト数と応答した行の数を g_conn[acc] に数える（管理用ソケットの conns）。
+ */
+void
+send_recv_loop(int acc)
+{
+    char buf[RBUF_STACK];
+    struct conn local, *c;
+    struct mbuf m;
+    struct iovec iov[2 * LINE_BATCH];
+    size_t pos, end, total, rexpect;
+    ssize_t len;
+    int n, k, cr, avail;
+
+    /* 受信バッファを空にする（行の途中は先頭に詰めて次の recv まで持ち越す） */
+    mbuf_init(&m, buf, sizeof(buf), 0);
+    cr = 0;
+    rexpect = 0;
+    c = conn_open(acc, &local);
+    for (;;) {
+        /* 届いているバイト数（取れなければ 0）と最近の要求の大きさから、読むバッファを選ぶ
+         * - 持ち越しが無く何も届いていなければ、待つ間はスタックで足りる
+         * - 持ち越しで一杯なら、少なくとも 1 バイトは読めるように広げる */
+        if (ioctl(acc, FIONREAD, &avail) == -1 || avail < 0) {
+            avail = 0;
+        }
+        if (m.len == 0 && avail == 0) {
+            rbuf_fit(&m, buf, 0);
+        } else {
+            rbuf_fit(&m, buf, m.len + MAX(MAX((size_t) avail, rexpect), 1));
+        }
+
+        /* 受信 */
+        if ((len = co_recv(acc, MBUF_TAIL(&m),
+                           MBUF_TAILROOM(&m), 0)) == -1) {
+            perror("recv");
+            break;
+        }
+        atomic_fetch_add_explicit(&c->nrecv, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&c->rx, (unsigned long long) len, memory_order_relaxed);
+        if (len == 0) {
+            /* 相手が close した（EOF） */
+            (void) fprintf(stderr, "<%d>recv:EOF\n", (int) pthread_self());
+            /* 改行の届かなかった最後の行にも応答する */
+            end = m.len;
+        } else {
+            m.len += (size_t) len;
+            tune_accepted(acc);     /* latency：TCP_QUICKACK を付け直す */
+            /* 最後の区切りまでに応答し、後ろは持ち越す
+             * （改行の無いまま一杯なら、次の周回で広げて読み続ける。RBUF_MAX なら全部を 1 行とする） */
+            if ((end = line_end(MBUF_DATA(&m), m.len)) == 0 && MBUF_TAILROOM(&m) == 0
+                && m.size >= RBUF_MAX) {
+                end = m.len;
+            }
+            if (end > 0) {
+                /* 要求が揃った：大きさを覚える（要求ごとに 3/4 へ減衰させた最大値） */
+                rexpect = MAX(m.len, rexpect - rexpect / 4);
+            }
+        }
+
+        /* 1 行ごとに応答する（続けて届いた要求にもそれぞれ返す）
+         * 前の recv が CR で終わっていれば、続く LF は同じ区切りなので読み飛ばす */
+        pos = cr && end > 0 && MBUF_DATA(&m)[0] == '\n' ? 1 : 0;
+        cr = end == m.len && end > 0 && MBUF_DATA(&m)[end - 1] == '\r';
+        while ((n = frame_lines(MBUF_DATA(&m), end, &pos, iov, &total)) > 0) {
+            for (k = 0; k < n; k += 2) {
+                (void) fprintf(stderr, "<%d>[client]%.*s\n", (int) pthread_self(),
+                               (int) iov[k].iov_len, (char *) iov[k].iov_base);
+            }
+            if (co_writev(acc, iov, n) == -1) {
+                perror("writev");
+                break;
+            }
+            atomic_fetch_add_explicit(&c->nreq, (unsigned long) n / 2, memory_order_relaxed);
+            atomic_fetch_add_explicit(&c->tx, (unsigned long long) total, memory_order_relaxed);
+        }
+        if (n > 0 || len == 0) {
+            /* 応答を送れなかった / EOF */
+            break;
+        }
+
+        /* 行の途中を先頭に詰める */
+        m.len -= end;
+        (void) memmove(MBUF_DATA(&m), MBUF_DATA(&m) + end, m.len);
+    }
+    rbuf_fit(&m, buf, 0);
+    conn_close(c);
+}
+
+/* --------------------------- accept 多重化（スレッド） --------------------------- */
+
+/* プールの状態を 1 行で出す（why: 出力のきっかけ） */
+void
+pool_report(const char *why)
+{
+    (void) fprintf(stderr, "pool:%s total=%d idle=%d busy=%d spawned=%ld retired=%ld\n",
+                   why, atomic_load(&g_total), atomic_load(&g_idle),
+                   atomic_load(&g_busy), atomic_load(&g_spawned),
+                   atomic_load(&g_retired));
+}
+
+/*
+ * pool_spawn(psoc)
+ *   - accept_thread を 1 本足す（g_total が max_threads に達していれば何もしない）
+ *   - 本数の予約（g_total/g_idle の加算）を pthread_create より先に行い、
+ *     複数スレッドが同時に足そうとしても上限を超えないようにする
+ *
+ * 戻り値：0 = 足した / -1 = 上限または失敗
+ */
+int
+pool_spawn(int *psoc)
+{
+    void *accept_thread(void *arg);
+    void *lf_thread(void *arg);
+    pthread_t thread_id;
+    int total;
+
+    /* drain 中は足さない。coro モードはプールを使わない */
+    if (atomic_load(&g_draining) || g_mode == MODE_CORO) {
+        return (-1);
+    }
+    total = atomic_load(&g_total);
+    do {
+        if (total >= g_max_threads) {
+            return (-1);
+        }
+    } while (!atomic_compare_exchange_weak(&g_total, &total, total + 1));
+    atomic_fetch_add(&g_idle, 1);
+
+    if (pthread_create(&thread_id, NULL,
+                       g_mode == MODE_LF ? lf_thread : accept_thread, (void *) psoc) != 0) {
+        perror("pthread_create");
+        atomic_fetch_sub(&g_idle, 1);
+        atomic_fetch_sub(&g_total, 1);
+        return (-1);
+    }
+    atomic_fetch_add(&g_spawned, 1);
+    pool_report("spawn");
+    return (0);
+}
+
+/*
+ * pool_retire()
+ *   - idle が min_idle より多いときだけ、自分を idle から外して終了扱いにする
+ *
+ * 戻り値：1 = 終了してよい / 0 = 下限なので残る
+ */
+int
+pool_retire(void)
+{
+    int idle;
+
+    idle = atomic_load(&g_idle);
+    do {
+        if (idle <= g_min_idle) {
+            return (0);
+        }
+    } while (!atomic_compare_exchange_weak(&g_idle, &idle, idle - 1));
+    atomic_fetch_sub(&g_total, 1);
+    atomic_fetch_add(&g_retired, 1);
+    pool_report("retire");
+    return (1);
+}
+
+/* drain：idle のスレッドを（min_idle に関係なく）プールから外す。スレッドはこの後終了する */
+void
+pool_leave(void)
+{
+    atomic_fetch_sub(&g_idle, 1);
+    atomic_fetch_sub(&g_total, 1);
+}
+
+/*
+ * accept_thread(arg)
+ *
+ * 引数：
+ *   arg は int*（listening socket の FD へのポインタ）を想定。
+ *
+ * アルゴリズム（ループ1回あたり）：
+ *   1) mutex ロック（accept 権を獲得）
+ *      - idle_timeout 秒取れなければ（他の idle が多い）pool_retire() で終了を試みる
+ *   2) poll で接続を待ち、accept(soc) で接続を受ける
+ *      - idle_timeout 秒来なければロックを返して pool_retire() で終了を試みる
+ *   3) mutex アンロック（次のスレッドに accept 機会を譲る）
+ *   4) idle → busy に移り、idle が min_idle を下回ったら pool_spawn() で 1 本足す
+ *   5) 受け取った acc で send_recv_loop()（接続処理はロック外で並列）
+ *   6) acc を close し、busy → idle に戻って次へ
+ *   - drain 中（g_draining）ならロックを取った時点 / 接続を終えた時点で終了する
+ *     （ロックを次のスレッドに渡してから抜けるので、待っているスレッドも順に抜けていく）
+ *
+ * なぜ mutex が必要？
+ *   - 実際には OS は複数スレッドからの accept をある程度安全に扱えるが、
+ *     教材として「accept の担当を 1 スレッドに限定する」ことで挙動を読みやすくする意図。
+ *
+ * 注意点：
+ *   - この実装は「ロックを取ってから accept を呼ぶ」ため、
+ *     そのスレッドが accept 待ちでブロックしている間、他スレッドは accept に入れない。
+ *   - つまり accept の並列性をあえて潰している（意図的）。
+ */
+void *
+accept_thread(void *arg)
+{
+    char pbuf[PEER_STRLEN];
+    struct sockaddr_storage from;
+    struct pollfd pfd;
+    struct timespec ts;
+    int acc, soc, ret;
+    socklen_t len;
+
+    /* 引数（listening socket FD）を取り出す */
+    soc = *(int *) arg;
+
+    /* スレッドをデタッチ（join 不要にする） */
+    pthread_detach(pthread_self());
+
+    for (;;) {
+        if (atomic_load(&g_draining)) {
+            pool_leave();
+            break;
+        }
+        (void) fprintf(stderr, "<%d>ロック獲得開始\n", (int) pthread_self());
+
+        /* mutex を取る（accept の順番待ち：idle_timeout 秒で諦める） */
+        (void) clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += g_idle_timeout;
+        if ((ret = pthread_mutex_timedlock(&g_lock, &ts)) != 0) {
+            if (ret == ETIMEDOUT && pool_retire()) {
+                break;
+            }
+            continue;
+        }
+
+        /* drain 中：ロックを次へ渡して終了する */
+        if (atomic_load(&g_draining)) {
+            (void) pthread_mutex_unlock(&g_lock);
+            pool_leave();
+            break;
+        }
+
+        /* 監視用：今ロックを持っているスレッドIDを記録 */
+        g_lock_id = (int) pthread_self();
+
+        (void) fprintf(stderr, "<%d>ロック獲得！\n", (int) pthread_self());
+
+        /* 接続を待つ（idle_timeout 秒来なければ、ロックを返して終了を試みる） */
+        pfd.fd = soc;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, g_idle_timeout * 1000) == 0) {
+            g_lock_id = -1;
+            (void) pthread_mutex_unlock(&g_lock);
+            if (pool_retire()) {
+                break;
+            }
+            continue;
+        }
+
+        len = (socklen_t) sizeof(from);
+
+        /*
+         * accept():
+         *   - 新しい接続が来るまでブロックする可能性がある。
+         *   - このコードでは mutex を保持したまま accept するため、
+         *     ここで止まっている間、他スレッドは lock で待つ（= accept が直列化される）。
+         */
+        if ((acc = accept(soc, (struct sockaddr *) &from, &len)) == -1) {
+            /*
+             * EINTR:
+             *   - シグナル割り込みで accept が中断されることがある。
+             * EAGAIN:
+             *   - listen はノンブロッキング。poll の後に接続がリセットされると起きる。
+             * EINVAL:
+             *   - drain でメインスレッドが listen を shutdown した（次のループで終了する）
+             *   - それ以外のエラーなら perror。
+             */
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK
+                && !atomic_load(&g_draining)) {
+                perror("accept");
             }
 
             /* ロック解放（失敗でも必ず unlock する） */
@@ -346,30 +1500,191 @@ accept_thread(void *arg)
             g_lock_id = -1;
             (void) pthread_mutex_unlock(&g_lock);
 
-            /* 失敗したので次ループへ */
+            /* 失敗したので次ループへ */
+            continue;
+        }
+
+        /* 接続元の表示は verbose のときだけ */
+        if (g_verbose) {
+            (void) format_peer(&from, pbuf);
+            (void) fprintf(stderr, "accept:%s\n", pbuf);
+        }
+
+        /*
+         * 重要：ここでロックを解放する
+         * - 受け付け処理（accept）だけを直列化したいので、接続処理はロック外へ出す。
+         */
+        (void) fprintf(stderr, "<%d>ロック解放\n", (int) pthread_self());
+        g_lock_id = -1;
+        (void) pthread_mutex_unlock(&g_lock);
+
+        /* idle → busy。accept 待ちが少なくなったら 1 本足しておく */
+        atomic_fetch_sub(&g_idle, 1);
+        atomic_fetch_add(&g_busy, 1);
+        if (atomic_load(&g_idle) < g_min_idle) {
+            (void) pool_spawn((int *) arg);
+        }
+
+        /* 送受信ループ（このスレッドが acc を担当して処理） */
+        send_recv_loop(acc);
+
+        /* 接続終了：accept ソケットを閉じる */
+        (void) close(acc);
+
+        /* busy → idle */
+        atomic_fetch_sub(&g_busy, 1);
+        atomic_fetch_add(&g_idle, 1);
+    }
+
+    pthread_exit((void *) 0);
+    /*NOT REACHED*/
+    return ((void *) 0);
+}
+
+/* --------------------------- leader/follower --------------------------- */
+
+/* futex：*addr が val のままなら timeout まで（NULL なら無期限）眠る */
+int
+futex_wait(atomic_int *addr, int val, const struct timespec *timeout)
+{
+    return ((int) syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0));
+}
+
+/* futex：addr で眠っているスレッドを最大 n 本起こす */
+int
+futex_wake(atomic_int *addr, int n)
+{
+    return ((int) syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0));
+}
+
+/*
+ * lf_become_leader(timeout_sec)
+ *   - リーダー権（g_lf_leader: 0 → 1）を取る。取れなければ futex で眠って待つ
+ *   - timeout_sec 秒起こされなければ -1（プール縮小の判断に使う）
+ *
+ * 取りこぼしが無い理由：
+ *   follower は「CAS 失敗 → waiters++ → futex_wait(値が 1 なら眠る)」の順、
+ *   リーダーは「0 を書く → waiters を読む」の順なので、
+ *   リーダーが waiters==0 を見て wake を省いた場合は、follower の futex_wait が
+ *   値 0 を見て即座に戻り（EAGAIN）、もう一度 CAS する。
+ */
+int
+lf_become_leader(int timeout_sec)
+{
+    struct timespec ts;
+    int expected, ret;
+
+    ts.tv_sec = timeout_sec;
+    ts.tv_nsec = 0;
+    for (;;) {
+        expected = 0;
+        if (atomic_compare_exchange_strong(&g_lf_leader, &expected, 1)) {
+            return (0);
+        }
+        atomic_fetch_add(&g_lf_waiters, 1);
+        ret = futex_wait(&g_lf_leader, 1, &ts);
+        atomic_fetch_sub(&g_lf_waiters, 1);
+        if (ret == -1 && errno == ETIMEDOUT) {
+            return (-1);
+        }
+    }
+}
+
+/* リーダー権を手放し、待っている follower がいれば 1 本だけ起こす */
+void
+lf_promote(void)
+{
+    atomic_store(&g_lf_leader, 0);
+    if (atomic_load(&g_lf_waiters) > 0) {
+        (void) futex_wake(&g_lf_leader, 1);
+    }
+}
+
+/*
+ * lf_thread(arg)
+ *   leader/follower モードのスレッド本体（arg は listen ソケットへのポインタ）
+ *
+ * アルゴリズム（ループ1回あたり）：
+ *   1) リーダー権を取る（取れるまで follower として futex で眠る）
+ *   2) リーダーとして listen を poll → accept
+ *   3) 接続を得たらすぐ lf_promote() で次のリーダーを起こす
+ *   4) 自分は idle → busy になり、そのまま send_recv_loop() で処理する
+ *   5) 終わったら busy → idle に戻り 1) へ
+ *   - idle_timeout 秒何も無ければ pool_retire() で終了を試みる（lock モードと同じ）
+ *   - drain 中はリーダーになった時点 / 接続を終えた時点で終了する
+ *     （リーダー権を次へ渡してから抜けるので、眠っている follower も順に抜けていく）
+ */
+void *
+lf_thread(void *arg)
+{
+    char pbuf[PEER_STRLEN];
+    struct sockaddr_storage from;
+    struct pollfd pfd;
+    int acc, soc;
+    socklen_t len;
+
+    soc = *(int *) arg;
+    (void) pthread_detach(pthread_self());
+
+    for (;;) {
+        if (atomic_load(&g_draining)) {
+            pool_leave();
+            break;
+        }
+
+        /* follower：リーダー権を待つ */
+        if (lf_become_leader(g_idle_timeout) == -1) {
+            if (pool_retire()) {
+                break;
+            }
+            continue;
+        }
+        if (atomic_load(&g_draining)) {
+            lf_promote();
+            pool_leave();
+            break;
+        }
+
+        /* leader：接続を待つ */
+        pfd.fd = soc;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, g_idle_timeout * 1000) == 0) {
+            lf_promote();
+            if (pool_retire()) {
+                break;
+            }
+            continue;
+        }
+        len = (socklen_t) sizeof(from);
+        if ((acc = accept4(soc, (struct sockaddr *) &from, &len, SOCK_CLOEXEC)) == -1) {
+            /* EINVAL：drain でメインスレッドが listen を shutdown した */
+            if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK
+                && !atomic_load(&g_draining)) {
+                perror("accept4");
+            }
+            lf_promote();
             continue;
         }
 
-        /* accept 成功：接続元を表示 */
-        (void) getnameinfo((struct sockaddr *) &from, len,
-                           hbuf, sizeof(hbuf),
-                           sbuf, sizeof(sbuf),
-                           NI_NUMERICHOST | NI_NUMERICSERV);
-        (void) fprintf(stderr, "accept:%s:%s\n", hbuf, sbuf);
+        /* 接続を得たので、すぐに次のリーダーへ渡す（自分は処理役になる） */
+        lf_promote();
 
-        /*
-         * 重要：ここでロックを解放する
-         * - 受け付け処理（accept）だけを直列化したいので、接続処理はロック外へ出す。
-         */
-        (void) fprintf(stderr, "<%d>ロック解放\n", (int) pthread_self());
-        g_lock_id = -1;
-        (void) pthread_mutex_unlock(&g_lock);
+        if (g_verbose) {
+            (void) format_peer(&from, pbuf);
+            (void) fprintf(stderr, "accept:%s\n", pbuf);
+        }
 
-        /* 送受信ループ（このスレッドが acc を担当して処理） */
-        send_recv_loop(acc);
+        atomic_fetch_sub(&g_idle, 1);
+        atomic_fetch_add(&g_busy, 1);
+        if (atomic_load(&g_idle) < g_min_idle) {
+            (void) pool_spawn((int *) arg);
+        }
 
-        /* 接続終了：accept ソケットを閉じる */
+        send_recv_loop(acc);
         (void) close(acc);
+
+        atomic_fetch_sub(&g_busy, 1);
+        atomic_fetch_add(&g_idle, 1);
     }
 
     pthread_exit((void *) 0);
@@ -377,19 +1692,731 @@ accept_thread(void *arg)
     return ((void *) 0);
 }
 
+/* --------------------------- コルーチン（coro モード） --------------------------- */
+
+/* coro モードの既定値：スケジューラ数は CPU コア数、スタックは CORO_STACK_KB */
+#define CORO_STACK_KB (64)
+#define CORO_EVENTS   (256)             /* 1 回の epoll_wait で受け取る最大イベント数 */
+
+int g_schedulers;
+size_t g_coro_stack = CORO_STACK_KB * 1024;
+int g_listen_soc = -1;
+
+/* スケジューラごとの epoll（-1 = まだ作っていない）。drain で listen を外すのに使う */
+atomic_int *g_sched_epfd;
+
+/* スケジューラごとの空きコルーチン（スタックごと使い回す） */
+__thread struct coro *t_co_free;
+
+/* コルーチンの入口（makecontext から呼ばれる） */
+void
+co_entry(void)
+{
+    struct coro *co;
+
+    co = t_co_current;
+    send_recv_loop(co->acc);
+    (void) close(co->acc);
+    atomic_fetch_sub(&g_busy, 1);
+    co->done = 1;
+    /* 戻ると uc_link（= スケジューラ）に切り替わる */
+}
+
+/* 接続 acc を担当するコルーチンを用意する（空きリストに無ければスタックを mmap） */
+struct coro *
+coro_alloc(int acc)
+{
+    struct coro *co;
+    size_t page;
+
+    if ((co = t_co_free) != NULL) {
+        t_co_free = co->next;
+    } else {
+        if ((co = calloc(1, sizeof(struct coro))) == NULL) {
+            perror("calloc");
+            return (NULL);
+        }
+        page = (size_t) sysconf(_SC_PAGESIZE);
+        co->stack_len = g_coro_stack + page;
+        if ((co->stack = mmap(NULL, co->stack_len, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0)) == MAP_FAILED) {
+            perror("mmap");
+            free(co);
+            return (NULL);
+        }
+        /* 最下部をガードページにする（スタック溢れを SIGSEGV で検出） */
+        if (mprotect(co->stack, page, PROT_NONE) == -1) {
+            perror("mprotect");
+        }
+    }
+    co->acc = acc;
+    co->registered = 0;
+    co->done = 0;
+    (void) getcontext(&co->ctx);
+    co->ctx.uc_stack.ss_sp = co->stack + (co->stack_len - g_coro_stack);
+    co->ctx.uc_stack.ss_size = g_coro_stack;
+    co->ctx.uc_link = &t_sched_ctx;
+    makecontext(&co->ctx, co_entry, 0);
+    return (co);
+}
+
+/* コルーチンを次に止まる（EAGAIN か終了）まで動かす */
+void
+coro_resume(struct coro *co)
+{
+    t_co_current = co;
+    (void) swapcontext(&t_sched_ctx, &co->ctx);
+    t_co_current = NULL;
+    if (co->done) {
+        /* 終わったコルーチンは空きリストへ（acc は close 済みなので epoll からも消えている） */
+        co->next = t_co_free;
+        t_co_free = co;
+    }
+}
+
+/* スケジューラ（OS スレッド 1 本分）
+ *
+ * - 自分専用の epoll に listen ソケットを EPOLLEXCLUSIVE で登録する
+ *   （接続が来たとき、全スケジューラではなく 1 本だけが起こされる）
+ * - listen が ready → accept できるだけ accept し、接続ごとにコルーチンを作って動かす
+ * - 接続 FD が ready → 待っていたコルーチンを再開する
+ * - drain ではメインスレッドが coro_stop_listen で listen をこの epoll から外し、
+ *   g_draining が立っていれば accept しない（以後は既存のコルーチンだけを動かす）
+ * - arg は atomic_int*（g_sched_epfd の自分の欄。作った epoll をここに書く）
+ */
+void *
+coro_sched(void *arg)
+{
+    struct epoll_event ev, events[CORO_EVENTS];
+    struct sockaddr_storage from;
+    char pbuf[PEER_STRLEN];
+    struct coro *co;
+    socklen_t len;
+    int i, nfds, acc;
+
+    if ((t_epollfd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+        perror("epoll_create1");
+        return ((void *) -1);
+    }
+    atomic_store((atomic_int *) arg, t_epollfd);
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(t_epollfd, EPOLL_CTL_ADD, g_listen_soc, &ev) == -1) {
+        perror("epoll_ctl");
+        return ((void *) -1);
+    }
+    /* 登録の前に drain が始まっていたら（メインスレッドがこの epoll を見る前）、自分で外す */
+    if (atomic_load(&g_draining)) {
+        (void) epoll_ctl(t_epollfd, EPOLL_CTL_DEL, g_listen_soc, NULL);
+    }
+
+    for (;;) {
+        if ((nfds = epoll_wait(t_epollfd, events, CORO_EVENTS, -1)) == -1) {
+            if (errno != EINTR) {
+                perror("epoll_wait");
+            }
+            continue;
+        }
+        for (i = 0; i < nfds; i++) {
+            if (events[i].data.ptr != NULL) {
+                coro_resume((struct coro *) events[i].data.ptr);
+                continue;
+            }
+            /* listen ソケット：キューが空になるまで受け付ける（drain が始まったら止める） */
+            while (!atomic_load(&g_draining)) {
+                len = (socklen_t) sizeof(from);
+                if ((acc = accept4(g_listen_soc, (struct sockaddr *) &from, &len,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+                    /* EINVAL：drain でメインスレッドが listen ソケットを shutdown した */
+                    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+                        && errno != EINVAL) {
+                        perror("accept4");
+                    }
+                    break;
+                }
+                if (g_verbose) {
+                    (void) format_peer(&from, pbuf);
+                    (void) fprintf(stderr, "accept:%s\n", pbuf);
+                }
+                if ((co = coro_alloc(acc)) == NULL) {
+                    (void) close(acc);
+                    continue;
+                }
+                atomic_fetch_add(&g_busy, 1);
+                coro_resume(co);
+            }
+        }
+    }
+
+    /*NOT REACHED*/
+    return ((void *) 0);
+}
+
+/* coro モードの開始：スケジューラを n 本起動する（listen は main でノンブロッキング済み）
+ * - g_total はスケジューラの本数にする（stats の threads）
+ * - メインスレッドはスケジューラにならず、戻ってシグナルを待つ
+ */
+int
+coro_start(int soc, int n)
+{
+    pthread_t thread_id;
+    int i;
+
+    g_listen_soc = soc;
+    if ((g_sched_epfd = calloc((size_t) n, sizeof(atomic_int))) == NULL) {
+        perror("calloc");
+        return (-1);
+    }
+    for (i = 0; i < n; i++) {
+        atomic_init(&g_sched_epfd[i], -1);
+    }
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&thread_id, NULL, coro_sched, (void *) &g_sched_epfd[i]) != 0) {
+            perror("pthread_create");
+            return (-1);
+        }
+        (void) pthread_detach(thread_id);
+        atomic_fetch_add(&g_total, 1);
+    }
+    return (0);
+}
+
+/* drain（coro モード）：各スケジューラの epoll から listen ソケットを外す
+ * （g_draining を立てた後に呼ぶ。まだ epoll を作っていないスケジューラは、
+ *   登録の後に g_draining を見て自分で外す）
+ */
+void
+coro_stop_listen(int soc)
+{
+    int i, epfd;
+
+    for (i = 0; i < g_schedulers; i++) {
+        if ((epfd = atomic_load(&g_sched_epfd[i])) != -1) {
+            (void) epoll_ctl(epfd, EPOLL_CTL_DEL, soc, NULL);
+        }
+    }
+}
+
+/* --------------------------- 実行時設定 --------------------------- */
+
+/*
+ * 設定ファイル + SIGHUP での読み直し
+ *
+ * server8 port [lock|lf [min_idle [max_threads [idle_timeout [conf]]]]] の conf に
+ * 「キー 値」（または「キー = 値」）を 1 行ずつ書く。'#' から行末まではコメント。
+ *
+ *   min_idle      idle スレッドの下限（既定：オンライン CPU 数と NUM_CHILD の大きい方）
+ *   max_threads   スレッド数の上限（既定：MAX_THREADS と CPU 数 * 16 の大きい方。
+ *                 1 スレッドが 1 接続を持つので RLIMIT_NOFILE も超えない）
+ *   idle_timeout  idle スレッドを減らすまでの秒数（既定 IDLE_TIMEOUT）
+ *   drain_timeout drain の期限（秒、既定 DRAIN_TIMEOUT）
+ *   verbose       1 = accept ごとに接続元を表示する（既定 0）
+ *
+ * 値の優先順位は 既定値 → 引数 → conf。SIGHUP では「既定値 + 引数」から conf を読み直すので、
+ * conf から消したキーは引数（無ければ既定値）に戻る。
+ * 1 行でも誤りがあれば、そのファイルは丸ごと使わない（起動時はエラー終了、SIGHUP なら今の値のまま）。
+ *
+ * 反映は変数を書き換えるだけ（atomic なので各スレッドは次に見たときから新しい値）。
+ * 書き換えるのはメインスレッド（起動時と SIGHUP）と管理スレッド（set）で、g_conf_lock で 1 本ずつにする。
+ * - min_idle を上げたら、足りない分はメインスレッドがすぐ pool_spawn する
+ * - min_idle を下げた / max_threads を下げた場合、余ったスレッドは idle_timeout で順に減っていく
+ *   （処理中の接続は切らない）
+ */
+struct config {
+    int min_idle;
+    int max_threads;
+    int idle_timeout;
+    int drain_timeout;
+    int verbose;
+};
+
+/* キー名と struct config の中の位置、受け付ける範囲 */
+struct conf_key {
+    const char *name;
+    size_t off;
+    int min;
+    int max;
+};
+
+const struct conf_key g_conf_keys[] = {
+    { "min_idle",      offsetof(struct config, min_idle),      1, 65536 },
+    { "max_threads",   offsetof(struct config, max_threads),   1, 65536 },
+    { "idle_timeout",  offsetof(struct config, idle_timeout),  1, 86400 },
+    { "drain_timeout", offsetof(struct config, drain_timeout), 0, 86400 },
+    { "verbose",       offsetof(struct config, verbose),       0, 1 },
+};
+
+/* 設定ファイルのパス（NULL なら既定値と引数だけで動く） / 既定値 + 引数 / 反映中の設定 */
+const char *g_conf_path = NULL;
+struct config g_conf_base;
+struct config g_conf_cur;
+pthread_mutex_t g_conf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* 既定値（CPU 数と FD 上限から決める） */
+void
+conf_defaults(struct config *c)
+{
+    struct rlimit rl;
+    long ncpu;
+
+    if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+        ncpu = 1;
+    }
+    c->min_idle = ncpu > NUM_CHILD ? (int) ncpu : NUM_CHILD;
+    c->max_threads = ncpu * 16 > MAX_THREADS ? (int) ncpu * 16 : MAX_THREADS;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+        && rl.rlim_cur > 32 && (rlim_t) c->max_threads > rl.rlim_cur - 16) {
+        c->max_threads = (int) rl.rlim_cur - 16;
+    }
+    c->idle_timeout = IDLE_TIMEOUT;
+    c->drain_timeout = DRAIN_TIMEOUT;
+    c->verbose = 0;
+}
+
+/* path を読んで c を上書きする（戻り値：0 = 成功 / -1 = 開けない、または誤りがあった） */
+int
+conf_parse(const char *path, struct config *c)
+{
+    char line[256], key[64], *p, *end;
+    FILE *fp;
+    long v;
+    size_t k;
+    int lineno, err, n;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        return (-1);
+    }
+    err = 0;
+    lineno = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL) {
+            *p = '\0';
+        }
+        if ((p = strchr(line, '=')) != NULL) {
+            *p = ' ';
+        }
+        if (sscanf(line, "%63s%n", key, &n) != 1) {
+            continue;                   /* 空行・コメントだけの行 */
+        }
+        for (k = 0; k < sizeof(g_conf_keys) / sizeof(g_conf_keys[0]); k++) {
+            if (strcmp(key, g_conf_keys[k].name) == 0) {
+                break;
+            }
+        }
+        if (k == sizeof(g_conf_keys) / sizeof(g_conf_keys[0])) {
+            (void) fprintf(stderr, "conf:%s:%d: unknown key %s\n", path, lineno, key);
+            err = 1;
+            continue;
+        }
+        errno = 0;
+        v = strtol(line + n, &end, 10);
+        while (isspace((unsigned char) *end)) {
+            end++;
+        }
+        if (errno != 0 || end == line + n || *end != '\0'
+            || v < g_conf_keys[k].min || v > g_conf_keys[k].max) {
+            (void) fprintf(stderr, "conf:%s:%d: bad value for %s (%d..%d)\n",
+                           path, lineno, key, g_conf_keys[k].min, g_conf_keys[k].max);
+            err = 1;
+            continue;
+        }
+        *(int *) ((char *) c + g_conf_keys[k].off) = (int) v;
+    }
+    (void) fclose(fp);
+    return (err ? -1 : 0);
+}
+
+/* 設定 c を反映する（起動時のほかは g_conf_lock を持って呼ぶ。psoc は pool_spawn に渡す listen ソケット） */
+void
+conf_apply(const struct config *c, int *psoc)
+{
+    g_conf_cur = *c;
+    g_max_threads = c->max_threads < c->min_idle ? c->min_idle : c->max_threads;
+    g_min_idle = c->min_idle;
+    g_idle_timeout = c->idle_timeout;
+    g_drain_timeout = c->drain_timeout;
+    g_verbose = c->verbose;
+    (void) fprintf(stderr, "conf: min_idle=%d max_threads=%d idle_timeout=%d drain_timeout=%d"
+                   " verbose=%d\n",
+                   atomic_load(&g_min_idle), atomic_load(&g_max_threads),
+                   atomic_load(&g_idle_timeout), atomic_load(&g_drain_timeout),
+                   atomic_load(&g_verbose));
+
+    /* idle が新しい下限に足りなければ、ここで足しておく（上限に達したら止める） */
+    while (psoc != NULL && atomic_load(&g_idle) < g_min_idle && pool_spawn(psoc) == 0) {
+        /* pool_spawn が g_idle を増やす */
+    }
+}
+
+/* SIGHUP：設定ファイルを読み直して反映する（誤りがあれば今の値のまま） */
+void
+conf_reload(int *psoc)
+{
+    struct config c;
+
+    if (g_conf_path == NULL) {
+        (void) fprintf(stderr, "conf: no file, keep current\n");
+        return;
+    }
+    c = g_conf_base;
+    if (conf_parse(g_conf_path, &c) == -1) {
+        (void) fprintf(stderr, "conf:%s: not applied, keep current\n", g_conf_path);
+        return;
+    }
+    (void) pthread_mutex_lock(&g_conf_lock);
+    conf_apply(&c, psoc);
+    (void) pthread_mutex_unlock(&g_conf_lock);
+}
+
+/* --------------------------- 管理用ソケット --------------------------- */
+
+/* 管理用ソケット（admin）
+ *
+ * 動いているサーバの状態を、stderr のログを grep せずに問い合わせるための AF_UNIX ソケット。
+ * adminctl（または socat 等）で 1 行のコマンドを送ると、テキストで応答して閉じる。
+ *
+ * コマンド：
+ * - stats         : 稼働時間、スレッドの本数（idle / busy）、accept / 要求数、送受信バイト数、設定値
+ * - conns         : 接続ごとの fd、接続元、経過秒、要求数、送受信バイト数
+ * - set KEY VALUE : 設定ファイルと同じキーを 1 つ変えて conf_apply で反映する
+ *                   （次の SIGHUP では設定ファイルの値に戻る）
+ * - drain         : SIGTERM と同じ drain を始める（自分に SIGTERM を送り、メインスレッドが受ける）
+ *
+ * - パスは ADMIN_PATH_FMT にポート番号を入れたもの。権限 0600（起動したユーザだけが使える）
+ * - 管理スレッド（admin_thread）1 本が accept → 1 行読む → 応答 → close を 1 接続ずつ行う
+ *   - 接続を処理するスレッドのロックは取らず、g_conn / g_stats / プールの atomic を読むだけ
+ *   - nice を ADMIN_NICE 下げ、CPU が混んでいるときは接続の処理を先にさせる
+ *   - 送ってこない / 読まない相手で止まり続けないよう、管理接続には ADMIN_WAIT 秒の
+ *     SO_RCVTIMEO / SO_SNDTIMEO を付ける
+ */
+#define ADMIN_PATH_FMT  "/tmp/server8.%s.admin"
+#define ADMIN_BACKLOG   (4)
+#define ADMIN_LINE      (256)
+#define ADMIN_WAIT      (1)             /* 秒 */
+#define ADMIN_NICE      (10)
+
+struct admin {
+    int fd;
+    char *out;                          /* 応答（admin_printf で伸ばす） */
+    size_t outlen, outsize;             /* 応答の長さ / 確保量 */
+};
+
+int g_admin_soc = -1;
+char g_admin_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+/* 管理用ソケットを作る（失敗しても管理機能が無いだけで、サーバは続行する） */
+int
+admin_socket(const char *portnm)
+{
+    struct sockaddr_un sun;
+
+    (void) memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    (void) snprintf(sun.sun_path, sizeof(sun.sun_path), ADMIN_PATH_FMT, portnm);
+    if ((g_admin_soc = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket(AF_UNIX)");
+        return (-1);
+    }
+    (void) unlink(sun.sun_path);
+    if (bind(g_admin_soc, (struct sockaddr *) &sun, sizeof(sun)) == -1
+        || chmod(sun.sun_path, 0600) == -1
+        || listen(g_admin_soc, ADMIN_BACKLOG) == -1) {
+        perror(sun.sun_path);
+        (void) close(g_admin_soc);
+        g_admin_soc = -1;
+        return (-1);
+    }
+    (void) strcpy(g_admin_path, sun.sun_path);
+    (void) fprintf(stderr, "admin=%s\n", g_admin_path);
+    return (g_admin_soc);
+}
+
+/* 応答に書式付きで追記する */
+void
+admin_printf(struct admin *a, const char *fmt, ...)
+{
+    va_list ap;
+    size_t need;
+    char *p;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    need = a->outlen + (size_t) n + 1;
+    if (need > a->outsize) {
+        if ((p = realloc(a->out, need < 4096 ? 4096 : need * 2)) == NULL) {
+            return;
+        }
+        a->out = p;
+        a->outsize = need < 4096 ? 4096 : need * 2;
+    }
+    va_start(ap, fmt);
+    (void) vsnprintf(a->out + a->outlen, (size_t) n + 1, fmt, ap);
+    va_end(ap);
+    a->outlen += (size_t) n;
+}
+
+/* set KEY VALUE：いまの設定を写して 1 つだけ変え、conf_apply で反映する */
+void
+admin_set(struct admin *a, const char *key, const char *val, int *psoc)
+{
+    struct config c;
+    char *end;
+    size_t k;
+    long v;
+
+    for (k = 0; k < sizeof(g_conf_keys) / sizeof(g_conf_keys[0]); k++) {
+        if (key != NULL && strcmp(key, g_conf_keys[k].name) == 0) {
+            break;
+        }
+    }
+    if (k == sizeof(g_conf_keys) / sizeof(g_conf_keys[0]) || val == NULL) {
+        admin_printf(a, "ERR usage: set KEY VALUE (");
+        for (k = 0; k < sizeof(g_conf_keys) / sizeof(g_conf_keys[0]); k++) {
+            admin_printf(a, "%s%s", k > 0 ? "|" : "", g_conf_keys[k].name);
+        }
+        admin_printf(a, ")\n");
+        return;
+    }
+    errno = 0;
+    v = strtol(val, &end, 10);
+    if (errno != 0 || end == val || *end != '\0'
+        || v < g_conf_keys[k].min || v > g_conf_keys[k].max) {
+        admin_printf(a, "ERR bad value for %s (%d..%d)\n",
+                     key, g_conf_keys[k].min, g_conf_keys[k].max);
+        return;
+    }
+    (void) pthread_mutex_lock(&g_conf_lock);
+    c = g_conf_cur;
+    *(int *) ((char *) &c + g_conf_keys[k].off) = (int) v;
+    conf_apply(&c, psoc);
+    (void) pthread_mutex_unlock(&g_conf_lock);
+    admin_printf(a, "OK %s=%ld\n", key, v);
+}
+
+/* コマンド 1 行を実行して応答を組み立てる（psoc：pool_spawn に渡す listen ソケット） */
+void
+admin_command(struct admin *a, char *line, int *psoc)
+{
+    unsigned long nreq, nrecv;
+    unsigned long long rx, tx;
+    char pbuf[PEER_STRLEN], *cmd, *key, *val;
+    struct conn *c;
+    double now;
+    int i;
+
+    now = now_sec();
+    cmd = strtok(line, " \t");
+    key = strtok(NULL, " \t");
+    val = strtok(NULL, " \t");
+    if (cmd == NULL) {
+        admin_printf(a, "ERR empty command\n");
+    } else if (strcmp(cmd, "stats") == 0) {
+        nreq = atomic_load_explicit(&g_stats.requests, memory_order_relaxed);
+        nrecv = atomic_load_explicit(&g_stats.recv_calls, memory_order_relaxed);
+        rx = atomic_load_explicit(&g_stats.rx, memory_order_relaxed);
+        tx = atomic_load_explicit(&g_stats.tx, memory_order_relaxed);
+        for (i = 0; i < g_conn_max; i++) {
+            c = &g_conn[i];
+            if (atomic_load_explicit(&c->active, memory_order_acquire)) {
+                nreq += atomic_load_explicit(&c->nreq, memory_order_relaxed);
+                nrecv += atomic_load_explicit(&c->nrecv, memory_order_relaxed);
+                rx += atomic_load_explicit(&c->rx, memory_order_relaxed);
+                tx += atomic_load_explicit(&c->tx, memory_order_relaxed);
+            }
+        }
+        admin_printf(a, "uptime=%.1f\nmode=%s\nthreads=%d\nidle=%d\nbusy=%d\n"
+                     "spawned=%ld\nretired=%ld\ndraining=%d\n"
+                     "accepted=%lu\nclosed=%lu\nrequests=%lu\nrx=%llu\ntx=%llu\n"
+                     "recv_calls=%lu\nrecv_per_kb=%.4f\nrbuf_conns=%lu\nrbuf_bytes=%llu\n"
+                     "rbuf_grow=%lu\nrbuf_shrink=%lu\n"
+                     "min_idle=%d\nmax_threads=%d\nidle_timeout=%d\ndrain_timeout=%d\n"
+                     "verbose=%d\n",
+                     now - g_stats.start,
+                     g_mode == MODE_CORO ? "coro" : g_mode == MODE_LF ? "lf" : "lock",
+                     atomic_load(&g_total), atomic_load(&g_idle), atomic_load(&g_busy),
+                     atomic_load(&g_spawned), atomic_load(&g_retired),
+                     atomic_load(&g_draining),
+                     atomic_load_explicit(&g_stats.accepted, memory_order_relaxed),
+                     atomic_load_explicit(&g_stats.closed, memory_order_relaxed),
+                     nreq, rx, tx,
+                     nrecv, rx != 0 ? nrecv * 1024.0 / (double) rx : 0.0,
+                     atomic_load_explicit(&g_stats.rbuf_conns, memory_order_relaxed),
+                     atomic_load_explicit(&g_stats.rbuf_bytes, memory_order_relaxed),
+                     atomic_load_explicit(&g_stats.rbuf_grow, memory_order_relaxed),
+                     atomic_load_explicit(&g_stats.rbuf_shrink, memory_order_relaxed),
+                     atomic_load(&g_min_idle), atomic_load(&g_max_threads),
+                     atomic_load(&g_idle_timeout), atomic_load(&g_drain_timeout),
+                     atomic_load(&g_verbose));
+    } else if (strcmp(cmd, "conns") == 0) {
+        admin_printf(a, "fd peer age nreq rx tx\n");
+        for (i = 0; i < g_conn_max; i++) {
+            c = &g_conn[i];
+            if (atomic_load_explicit(&c->active, memory_order_acquire)) {
+                (void) format_peer(&c->addr, pbuf);
+                admin_printf(a, "%d %s %.1f %lu %llu %llu\n", i, pbuf, now - c->since,
+                             atomic_load_explicit(&c->nreq, memory_order_relaxed),
+                             atomic_load_explicit(&c->rx, memory_order_relaxed),
+                             atomic_load_explicit(&c->tx, memory_order_relaxed));
+            }
+        }
+    } else if (strcmp(cmd, "set") == 0) {
+        admin_set(a, key, val, psoc);
+    } else if (strcmp(cmd, "drain") == 0) {
+        /* シグナルと同じ道を通す（drain はメインスレッドが行う） */
+        if (kill(getpid(), SIGTERM) == -1) {
+            admin_printf(a, "ERR kill: %s\n", strerror(errno));
+        } else {
+            admin_printf(a, "OK draining conns=%d timeout=%d\n",
+                         atomic_load(&g_busy), atomic_load(&g_drain_timeout));
+        }
+    } else {
+        admin_printf(a, "ERR unknown command %s (stats|conns|set|drain)\n", cmd);
+    }
+    if (a->out != NULL) {
+        (void) fprintf(stderr, "admin:%s\n", cmd != NULL ? cmd : "");
+    }
+}
+
+/*
+ * admin_thread(arg)
+ *   - 管理用ソケットで 1 接続ずつ accept し、コマンド行（'\n' まで）を読んで応答を書き、閉じる
+ *   - 時間切れ / 相手が閉じたときは応答せずに閉じる
+ *   - arg は int*（pool_spawn に渡す listen ソケット）
+ */
+void *
+admin_thread(void *arg)
+{
+    struct admin a;
+    struct timeval tv;
+    char in[ADMIN_LINE], *eol;
+    size_t inlen, off;
+    ssize_t n;
+
+    (void) pthread_detach(pthread_self());
+    (void) setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), ADMIN_NICE);
+    for (;;) {
+        if ((a.fd = accept4(g_admin_soc, NULL, NULL, SOCK_CLOEXEC)) == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            perror("accept4(admin)");
+            return (NULL);
+        }
+        tv.tv_sec = ADMIN_WAIT;
+        tv.tv_usec = 0;
+        (void) setsockopt(a.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        (void) setsockopt(a.fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        inlen = 0;
+        eol = NULL;
+        while (eol == NULL && inlen < sizeof(in) - 1
+               && (n = recv(a.fd, in + inlen, sizeof(in) - 1 - inlen, 0)) > 0) {
+            inlen += (size_t) n;
+            in[inlen] = '\0';
+            eol = strpbrk(in, "\r\n");
+        }
+        if (eol != NULL || inlen == sizeof(in) - 1) {
+            if (eol != NULL) {
+                *eol = '\0';
+            }
+            a.out = NULL;
+            a.outlen = a.outsize = 0;
+            admin_command(&a, in, (int *) arg);
+            for (off = 0; off < a.outlen; off += (size_t) n) {
+                if ((n = send(a.fd, a.out + off, a.outlen - off, MSG_NOSIGNAL)) <= 0) {
+                    break;
+                }
+            }
+            free(a.out);
+        }
+        (void) close(a.fd);
+    }
+}
+
 /* --------------------------- エントリポイント --------------------------- */
 
 int
 main(int argc, char *argv[])
 {
-    int i, soc;
-    pthread_t thread_id;
+    static const int sigs[] = { SIGHUP, SIGTERM, SIGINT };
+    struct config conf;
+    struct pollfd pfd;
+    static const char *const modes[] = { "lock", "lf", "coro" };
+    pthread_t admin_id;
+    int soc, sig, conf_arg;
 
     /* 引数にポート番号が指定されているか？ */
     if (argc <= 1) {
-        (void) fprintf(stderr, "server8 port\n");
+        (void) fprintf(stderr, "server8 port [latency|throughput|churn|none] [lock|lf [min_idle [max_threads [idle_timeout [conf]]]]"
+                       "|coro [schedulers [stack_kb [conf]]]]\n");
         return (EX_USAGE);
     }
+    profile_arg(&argc, argv);
+
+    /* 動作モード（省略時は lock） */
+    if (argc > 2) {
+        if (strcmp(argv[2], "lock") == 0) {
+            g_mode = MODE_LOCK;
+        } else if (strcmp(argv[2], "lf") == 0) {
+            g_mode = MODE_LF;
+        } else if (strcmp(argv[2], "coro") == 0) {
+            g_mode = MODE_CORO;
+        } else {
+            (void) fprintf(stderr, "server8 port [latency|throughput|churn|none] [lock|lf [min_idle [max_threads [idle_timeout [conf]]]]"
+                       "|coro [schedulers [stack_kb [conf]]]]\n");
+            return (EX_USAGE);
+        }
+    }
+
+    /* プールの設定（既定値 → 引数 → 設定ファイル。反映は conf_apply）
+     * coro：第3引数はスケジューラ数、第4引数はコルーチンのスタックサイズ（KB）、第5引数が設定ファイル */
+    conf_defaults(&g_conf_base);
+    if (g_mode == MODE_CORO) {
+        if ((g_schedulers = (int) sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+            g_schedulers = 1;
+        }
+        if (argc > 3 && atoi(argv[3]) > 0) {
+            g_schedulers = atoi(argv[3]);
+        }
+        if (argc > 4 && atoi(argv[4]) > 0) {
+            g_coro_stack = (size_t) atoi(argv[4]) * 1024;
+        }
+        conf_arg = 5;
+    } else {
+        if (argc > 3 && atoi(argv[3]) > 0) {
+            g_conf_base.min_idle = atoi(argv[3]);
+        }
+        if (argc > 4 && atoi(argv[4]) > 0) {
+            g_conf_base.max_threads = atoi(argv[4]);
+        }
+        if (argc > 5 && atoi(argv[5]) > 0) {
+            g_conf_base.idle_timeout = atoi(argv[5]);
+        }
+        conf_arg = 6;
+    }
+    conf = g_conf_base;
+    if (argc > conf_arg) {
+        g_conf_path = argv[conf_arg];
+        if (conf_parse(g_conf_path, &conf) == -1) {
+            return (EX_CONFIG);
+        }
+    }
+
+    /* 行区切り検索の実装を CPU に合わせて選ぶ（スレッド/子プロセス生成前に 1 回だけ） */
+    scan_eol_init();
+    (void) fprintf(stderr, "scan_eol=%s\n", g_scan_eol_name);
+
+    /* 接続の表（管理用ソケットの stats / conns） */
+    if (conn_init() == -1) {
+        return (EX_OSERR);
+    }
 
     /* サーバソケットの準備 */
     if ((soc = server_socket(argv[1])) == -1) {
@@ -398,40 +2425,101 @@ main(int argc, char *argv[])
     }
 
     /*
-     * accept スレッドを NUM_CHILD 本生成する。
+     * listen をノンブロッキングにする：
+     * - accept の前に poll で待つので、ロック保持者が accept でブロックし続けることはない
+     * - poll の後に接続が消えても accept は EAGAIN で戻る
+     */
+    if (fcntl(soc, F_SETFL, fcntl(soc, F_GETFL) | O_NONBLOCK) == -1) {
+        perror("fcntl");
+    }
+
+    /* SIGHUP / SIGTERM / SIGINT はシグナル FD で受け取り、設定の読み直しと drain に使う
+     * - スレッドを作る前にブロックしておく（以後のスレッドはブロックを引き継ぎ、
+     *   シグナルはメインスレッドの signalfd だけで受け取る）
+     */
+    if (sig_fd_init(sigs, (int) (sizeof(sigs) / sizeof(sigs[0]))) == -1) {
+        (void) close(soc);
+        return (EX_OSERR);
+    }
+
+    /*
+     * accept スレッドを min_idle 本生成する（conf_apply の中で pool_spawn）。
      * - 全スレッドに &soc を渡す（全員が同一 listening socket を共有する）。
      * - soc は main のスタック上にあるが、main は終了せずループし続けるため寿命的には問題になりにくい。
      *   ただし教材としては「soc をグローバルにする」方が誤解が少ないこともある。
+     * - 以後の増減は accept_thread 自身が行う（pool_spawn / pool_retire）。
      */
-    for (i = 0; i < NUM_CHILD; i++) {
-        if (pthread_create(&thread_id, NULL, accept_thread, (void *) &soc) != 0) {
-            perror("pthread_create");
-        } else {
-            (void) fprintf(stderr,
-                           "pthread_create:create:thread_id=%d\n",
-                           (int) thread_id);
+    (void) fprintf(stderr, "mode=%s\n", modes[g_mode]);
+    conf_apply(&conf, &soc);
+
+    /* coro：accept はスケジューラが行う（conf_apply はプールを作らない） */
+    if (g_mode == MODE_CORO) {
+        (void) fprintf(stderr, "coro: schedulers=%d stack=%zuKB\n",
+                       g_schedulers, g_coro_stack / 1024);
+        if (coro_start(soc, g_schedulers) == -1) {
+            (void) close(soc);
+            return (EX_OSERR);
         }
     }
 
+    /* 管理用ソケットと管理スレッド（無くてもサーバは動く） */
+    if (admin_socket(argv[1]) != -1
+        && pthread_create(&admin_id, NULL, admin_thread, (void *) &soc) != 0) {
+        perror("pthread_create(admin)");
+    }
+
     (void) fprintf(stderr, "ready for accept\n");
 
     /*
      * 親スレッドは accept しない。
      * 代わりに 10 秒ごとに「誰がロックを持っているか」を表示して可視化する。
+     * シグナル FD を待ちながら眠り、SIGHUP なら設定を読み直す。
+     * SIGTERM / SIGINT が来たらループを抜けて drain に入る。
      */
+    pfd.fd = g_sig_fd;
+    pfd.events = POLLIN;
     for (;;) {
-        (void) sleep(10);
+        if (poll(&pfd, 1, 10 * 1000) > 0 && (sig = sig_fd_read()) != 0) {
+            if (sig != SIGHUP) {
+                break;
+            }
+            conf_reload(&soc);
+            continue;
+        }
         (void) fprintf(stderr,
                        "<<%d>>ロック状態：%d\n",
                        (int) pthread_self(),
                        g_lock_id);
+        pool_report("stat");
     }
 
-    /*
-     * 以下は到達しない（無限ループのため）。
-     * 実運用ではシグナル等で抜けて close/destroy する設計にする。
+    /* drain：listen を shutdown してスレッドを起こし、全員が抜けるのを待つ
+     * - 接続を終えたスレッドは自分で抜けるが、通知は無いので 100ms ごとに見る
+     * - coro：先に各スケジューラの epoll から listen を外す。スケジューラは終わらないので、
+     *   処理中の接続（g_busy）が 0 になるのを待つ
      */
+    drain_begin(sig, atomic_load(&g_busy));
+    atomic_store(&g_draining, 1);
+    if (g_mode == MODE_CORO) {
+        coro_stop_listen(soc);
+    }
+    if (shutdown(soc, SHUT_RDWR) == -1) {
+        perror("shutdown");
+    }
+    while (!drain_check(atomic_load(g_mode == MODE_CORO ? &g_busy : &g_total),
+                        atomic_load(&g_busy))) {
+        if (poll(&pfd, 1, 100) > 0) {
+            while (sig_fd_read() != 0) {
+                /* drain 中の 2 回目以降のシグナルは読み捨てる */
+            }
+        }
+    }
+    pool_report("exit");
+
+    /* スレッドが残っていても（期限切れ）main から戻ればプロセスごと終了する */
+    if (g_admin_soc != -1) {
+        (void) unlink(g_admin_path);
+    }
     (void) close(soc);
-    (void) pthread_mutex_destroy(&g_lock);
     return (EX_OK);
 }
@@ -13,74 +13,396 @@
     - recv した結果（acc, buf, len）をリングバッファ（queue）へ push する（producer）
     - 送信スレッドがリングバッファから pop して send する（consumer）
     - producer/consumer を mutex + cond で同期する
+    - 送信スレッド数・キューの大きさ・接続上限などは設定ファイルに書き、
+      SIGHUP で読み直して動いたまま変えられる（後ろの「実行時設定」）
 
     注意（学習用として理解しておくポイント）
     --------------------------------------
     - この実装は「受信は epoll スレッド、送信は別スレッド」という分離であり、
       「1接続=1スレッド」型ではなく、イベント駆動 + ワーカー（送信）という構造に近い。
-    - キューのオーバーフロー対策が薄い（MAXQUEUESZ を超えると last が front を追い越し得る）。
-      本番では「満杯なら捨てる / ブロック / 拡張」など方針が必要。
+    - キューが queue_hiwat まで溜まった接続は recv を後回しにする（last が front を追い越さない）。
+      データはソケットの受信バッファに残り、送信スレッドが追いつくと読まれる。
     - epoll 側で recv したあとに mutex を取って last を進めているが、
       recv 実行自体は mutex 外で行われている。ここは設計として “どこを排他すべきか” を意識する。
 */
 
+#define _GNU_SOURCE                     /* accept4() */
+
 #include <sys/epoll.h>                  /* epoll_create / epoll_ctl / epoll_wait */
+#include <sys/eventfd.h>                /* eventfd（閉じかけの接続の close を main に頼む） */
+#include <sys/ioctl.h>                  /* ioctl(FIONREAD)（閉じかけの接続に残りがあるか） */
 #include <sys/param.h>
+#include <sys/resource.h>              /* getrlimit / setrlimit */
+#ifdef __linux__
+#include <sys/signalfd.h>
+#endif
 #include <sys/socket.h>
+#include <sys/stat.h>                   /* chmod（管理用ソケット） */
 #include <sys/types.h>
+#include <sys/uio.h>                    /* struct iovec（sendmsg） */
+#include <sys/un.h>                     /* struct sockaddr_un（管理用ソケット） */
 #include <sys/wait.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>                /* TCP_NODELAY / TCP_KEEPIDLE / TCP_USER_TIMEOUT など */
 #include <netdb.h>
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>                      /* open, O_CLOEXEC */
+#include <limits.h>                     /* INT_MAX */
+#include <poll.h>                       /* poll（応答の送り残し） */
 #include <pthread.h>                    /* pthread_* */
+#include <sched.h>                      /* sched_yield */
 #include <signal.h>
+#include <stdarg.h>                     /* va_list（admin_printf） */
+#include <stddef.h>                     /* offsetof */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sysexits.h>
+#include <time.h>
 #include <unistd.h>
 
-/* リングバッファ（キュー）の最大要素数
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>                  /* SSE2 / AVX2 組み込み関数（scan_eol） */
+#endif
+
+/* リングバッファ（キュー）1 本の要素数の既定値（設定 queue_size）
    - 4096 件まで「受信済みデータ（acc, buf, len）」を溜められる想定 */
 #define MAXQUEUESZ 4096
 
-/* 送信スレッド（= キュー）の数
-   - MAXSENDER 個のキューを用意し、fd % MAXSENDER で振り分ける */
-#define MAXSENDER  2
+/* 送信スレッド（= キュー）の数の上限
+   - 既定はオンライン CPU 数（設定 senders）。fd % 本数 でキューに振り分ける */
+#define MAXSENDER  64
+
+/* 1 要素の受信バッファの大きさの既定値（設定 buf_size） */
+#define QUEUE_BUFSZ 512
+
+/* リングバッファの次のインデックス / 溜まっている件数（循環） */
+#define QUEUE_NEXT(q_, i_)  (((i_) + 1) % (q_)->size)
+#define QUEUE_DEPTH(q_, front_) \
+    (((q_)->last - (front_) + (q_)->size) % (q_)->size)
+
+/* 処理時間ヒストグラムの階級数（log2。後ろの「稼働統計」） */
+#define HIST_BUCKETS    (32)
+
+/* 過負荷時の受け付け制御（admission）
+ *
+ * 接続の上限（max_conn）に達したときに accept してそのまま close すると、クライアントには
+ * RST / EOF にしか見えず、すぐに接続し直してくるので過負荷をかえって大きくする。また
+ * 接続数が上限より少なくても、処理が追いつかなければ要求の待ち時間は伸び続ける。そこで：
+ *
+ * - 断るときは BUSY_MSG（"BUSY\r\n"）を 1 行返してから閉じる（busy_reject）
+ *   - クライアントは「混んでいる」と分かるので、間を空けてから接続し直せる
+ *   - 届いている要求を読み捨ててから閉じる（未読のまま close すると RST になり、
+ *     BUSY より先に RST が届いて捨てられることがある）
+ * - 接続数の上限に加えて、実際に測った待ち時間（queueing delay）で断る
+ *   - 送信スレッドがキューから要素を取り出したときの「recv してからの経過時間」を、
+ *     キューごとに待ち時間として測る（送信スレッドが追いつかないほど伸びる）
+ *   - qdelay_interval ミリ秒ごとに、その区間の待ち時間の「最小値」を target と比べる
+ *     （一瞬のバーストでは最小値は小さいまま。区間を通して一度も target を下回らない
+ *      = 待ち行列が捌けずに居座っているときだけ overload にする。CoDel と同じ考え方）
+ *   - overload のキューに振り分けられる新しい接続は BUSY で断る
+ *     （qdelay_target 0 = 待ち時間では断らない。キューが空になったら overload を解く）
+ * - 振り分け先のキューが queue_hiwat まで溜まっている（処理待ちの要求が上限）ときも断る
+ * - accept_pause 1 なら、上限 / どれかのキューが overload の間は BUSY を返す代わりに
+ *   listen FD を epoll から外す（accept しない）。来た接続はカーネルの listen キュー（backlog）で待たせておき、
+ *   短いバーストなら取りこぼさずに済む（キューが溢れた分は SYN の再送で待たされる）
+ *
+ * qdelay_target / qdelay_interval / accept_pause は設定ファイル / 管理用ソケットの set で
+ * 変えられる。
+ * 断った接続は stats の shed_full（上限）/ shed_delay（待ち時間）、BUSY を返せた数は
+ * busy_sent、listen FD を外した回数は accept_paused で数える
+ */
+#define QDELAY_TARGET   (5)             /* ミリ秒 */
+#define QDELAY_INTERVAL (100)           /* ミリ秒 */
+
+/* qdelay_target / qdelay_interval は main（conf_apply）が書いて送信スレッド（qdelay_sample）が
+   読むので atomic に読み書きする。accept_pause は main しか触らない */
+int g_qdelay_target = QDELAY_TARGET;
+int g_qdelay_interval = QDELAY_INTERVAL;
+int g_accept_pause = 0;
+
+/* 待ち時間の見張り（区間ごとの最小値。struct queue に 1 つずつ持ち、送信スレッドが更新する）
+ * - start : 今の区間の始まり（now_sec）
+ * - min   : 今の区間の待ち時間の最小（秒、-1 = まだ標本が無い）
+ * - usec  : 直前の区間の最小（µs、stats で表示する）
+ * - overload : 直前の区間の最小が qdelay_target を超えていれば 1
+ *   （usec / overload は main が accept のときに読むので atomic に読み書きする）
+ */
+struct qdelay {
+    double start;
+    double min;
+    int usec;
+    int overload;
+};
+
+/* 待ち時間を 1 つ記録する（d < 0 は標本なしで区間の切り替えだけ見る）
+ *
+ * 区間が終わっていれば最小値で overload を決め直す（標本の無い区間 = 待っていない = 0）。
+ * 戻り値：overload が変わったら 1
+ */
+int
+qdelay_sample(struct qdelay *qd, double d, double now)
+{
+    int prev, cur, usec, target;
 
-/* リングバッファの次のインデックス（循環） */
-#define QUEUE_NEXT(i_)             (((i_) + 1) % MAXQUEUESZ)
+    if (d >= 0.0 && (qd->min < 0.0 || d < qd->min)) {
+        qd->min = d;
+    }
+    if ((now - qd->start) * 1e3 < (double) __atomic_load_n(&g_qdelay_interval, __ATOMIC_RELAXED)) {
+        return (0);
+    }
+    prev = __atomic_load_n(&qd->overload, __ATOMIC_RELAXED);
+    usec = qd->min > 0.0 ? (int) (qd->min * 1e6) : 0;
+    target = __atomic_load_n(&g_qdelay_target, __ATOMIC_RELAXED);
+    cur = target > 0 && usec > target * 1000;
+    __atomic_store_n(&qd->usec, usec, __ATOMIC_RELAXED);
+    __atomic_store_n(&qd->overload, cur, __ATOMIC_RELAXED);
+    qd->start = now;
+    qd->min = -1.0;
+    return (cur != prev);
+}
 
 /* キューに積む 1 件分のデータ
    - acc: 接続ソケット FD
-   - buf: 受信バッファ（メッセージ）
-   - len: recv で得たバイト数（-1: error, 0: EOF, >0: 正常） */
+   - buf: 受信バッファ（メッセージ。キューの bufs の中を指す）
+   - len: recv で得たバイト数（-1: error, 0: EOF, >0: 正常）
+   - t  : recv した時刻（now_sec。応答を送り終えるまでの時間を測る） */
 struct queue_data {
     int acc;
-    char buf[512];
+    char *buf;
     ssize_t len;
+    double t;
 };
 
 /* producer-consumer 用リングバッファ
-   - front: 次に取り出す位置（consumer が使う）
-   - last : 次に書き込む位置（producer が使う）
-   - mutex: front/last/data へのアクセス保護
-   - cond : 「新規データが来た」ことを consumer に通知するため */
+   - front : 次に取り出す位置（consumer が使う）
+   - last  : 次に書き込む位置（producer が使う）
+   - size  : data[] の要素数 / bufsz：1 要素のバッファ長（設定の再読み込みで変わる）
+   - bufs  : data[i].buf の実体（size * bufsz バイトを 1 つ確保）
+   - busy  : consumer が pop した要素をロックの外で処理中なら 1
+   - stop  : 1 = キューが空になったら consumer を終える
+   - resizing : producer（main）が busy = 0 を待っている
+                1 = 作り直しの間 consumer は次を pop せずに待つ / 2 = キューが空になるまで処理を続ける
+   - mutex : front/last/data へのアクセス保護
+   - cond  : 「新規データが来た」ことを consumer に通知するため
+   - idle  : consumer が要素を 1 件処理し終えたことを resizing 中の main に通知する
+   - nreq / tx / hist : consumer が応答した件数・バイト数・処理時間（µs）のヒストグラム
+                        （書くのは consumer だけ。管理用ソケットから main が読む）
+   - qd    : 待ち時間の見張り（consumer が書き、main が accept のときに overload を読む） */
 struct queue {
     int front;
     int last;
-    struct queue_data data[MAXQUEUESZ];
+    int size;
+    size_t bufsz;
+    struct queue_data *data;
+    char *bufs;
+    int busy;
+    int stop;
+    int resizing;
     pthread_mutex_t mutex;
     pthread_cond_t cond;
+    pthread_cond_t idle;
+    unsigned long nreq;
+    unsigned long long tx;
+    unsigned long hist[HIST_BUCKETS];
+    struct qdelay qd;
 };
 
-/* 送信スレッド数分のキュー（qi=0..MAXSENDER-1） */
+/* 送信スレッドの上限数ぶんのキュー（使うのは qi=0..g_nsender-1）
+   - 配列の大きさは固定なので、本数を変えても動いているスレッドのキューは動かない */
 struct queue g_queue[MAXSENDER];
 
+/* 送信スレッドの ID（終了時・本数を減らすときに join する） */
+pthread_t g_sender[MAXSENDER];
+
+/* 動いている送信スレッドの本数（main スレッドだけが変える） */
+int g_nsender = 0;
+
+/* これ以上溜まったキューに振り分けられる接続は recv を後回しにする（設定 queue_hiwat） */
+int g_queue_hiwat = MAXQUEUESZ - 1;
+
+/* 応答の末尾に付ける文字列（行ごとに iovec で後ろに並べる。受信バッファに場所は取らない） */
+#define RESP_SUFFIX     ":OK\r\n"
+#define RESP_SUFFIX_LEN (sizeof(RESP_SUFFIX) - 1)
+
+/* 長さ付きバッファ（応答組み立て用）
+ *
+ * base[0 .. size) の中で、データは base[off .. off+len) にある。
+ *
+ *   base                off            off+len                 size
+ *    |<-- headroom -->|<---- data ---->|<---- tailroom ---->|
+ *
+ * mystrlcat + strlen との違い：
+ * - 長さを持っているので、連結のたびに NUL を探して先頭から数え直さない（O(1) で追記）
+ * - NUL 終端を必要としないので、recv したバイト列をそのまま扱える
+ * - 先頭側にも空き（headroom）を取れるので、ヘッダ等を後から前に付けられる
+ * - データ部をそのまま iovec にして writev に渡せる
+ */
+struct mbuf {
+    char *base;                         /* 領域の先頭 */
+    size_t size;                        /* 領域の大きさ */
+    size_t off;                         /* データの開始位置 */
+    size_t len;                         /* データ長 */
+};
+
+#define MBUF_DATA(m_)     ((m_)->base + (m_)->off)
+#define MBUF_TAIL(m_)     ((m_)->base + (m_)->off + (m_)->len)
+#define MBUF_HEADROOM(m_) ((m_)->off)
+#define MBUF_TAILROOM(m_) ((m_)->size - (m_)->off - (m_)->len)
+
+/* 領域 base[0..size) を、先頭に headroom バイト空けた空のバッファとして使い始める */
+void
+mbuf_init(struct mbuf *m, char *base, size_t size, size_t headroom)
+{
+    m->base = base;
+    m->size = size;
+    m->off = headroom < size ? headroom : size;
+    m->len = 0;
+}
+
+/* 末尾に n バイト追記する（tailroom が足りなければ何もせず -1） */
+int
+mbuf_append(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_TAILROOM(m)) {
+        return (-1);
+    }
+    (void) memcpy(MBUF_TAIL(m), src, n);
+    m->len += n;
+    return (0);
+}
+
+/* 先頭に n バイト付け足す（headroom が足りなければ何もせず -1） */
+int
+mbuf_prepend(struct mbuf *m, const void *src, size_t n)
+{
+    if (n > MBUF_HEADROOM(m)) {
+        return (-1);
+    }
+    m->off -= n;
+    m->len += n;
+    (void) memcpy(MBUF_DATA(m), src, n);
+    return (0);
+}
+
+/* データ部を iovec に変換する（戻り値は writev / sendmsg に渡す要素数） */
+int
+mbuf_iov(const struct mbuf *m, struct iovec *iov)
+{
+    if (m->len == 0) {
+        return (0);
+    }
+    iov[0].iov_base = MBUF_DATA(m);
+    iov[0].iov_len = m->len;
+    return (1);
+}
+
+/* 接続単位の TCP チューニング（プロファイル）
+ *
+ * 起動引数で 1 つ選ぶ（server9 port [latency|throughput|churn] [conf]、既定は none = SO_REUSEADDR のみ）。
+ *
+ * - latency    : TCP_NODELAY（Nagle を切って小さな応答をすぐ出す）
+ *                TCP_QUICKACK（遅延 ACK をやめる。カーネルが自動で戻すので受信のたびに付け直す）
+ *                TCP_NOTSENT_LOWAT を小さく（未送信データを溜め込まず、書ける通知を早く返す）
+ * - throughput : SO_SNDBUF / SO_RCVBUF を大きく（ウィンドウを広げて 1 回あたりの転送量を増やす）
+ *                応答を複数回の write で組み立てるときは TCP_CORK で 1 セグメントにまとめる
+ *                （このサーバは送信スレッドが mbuf で 1 回の sendmsg にしているので CORK は要らない）
+ * - churn      : TCP_DEFER_ACCEPT（最初のデータが届くまで accept を起こさない）
+ *                TCP_FASTOPEN（SYN に載ったデータを受け付ける。sysctl net.ipv4.tcp_fastopen の
+ *                2 のビットが立っていないと効かない）
+ *                listen のバックログを大きく（実際は net.core.somaxconn で頭打ち）
+ *
+ * - listen ソケットに付けた TCP_NODELAY / TCP_NOTSENT_LOWAT / SO_SNDBUF / SO_RCVBUF は
+ *   accept した接続に引き継がれる（Linux）。引き継がれない TCP_QUICKACK だけ tune_accepted で付ける
+ * - SO_RCVBUF はウィンドウスケールが決まる SYN より前（listen の前）に付ける必要がある
+ * - 効果の比較は tune-bench（ループバックで応答遅延・転送速度・接続の回転を計る）
+ */
+#define PROFILE_NONE        (0)
+#define PROFILE_LATENCY     (1)
+#define PROFILE_THROUGHPUT  (2)
+#define PROFILE_CHURN       (3)
+
+const char *g_profile_name[] = { "none", "latency", "throughput", "churn" };
+
+int g_profile = PROFILE_NONE;
+
+#define TUNE_NOTSENT_LOWAT  (16 * 1024)         /* latency：未送信データの上限 */
+#define TUNE_BUFSZ          (4 * 1024 * 1024)   /* throughput：送受信バッファ（wmem_max / rmem_max で頭打ち） */
+#define TUNE_DEFER_ACCEPT   (1)                 /* churn：データを待つ秒数 */
+#define TUNE_FASTOPEN_QLEN  (256)               /* churn：TFO の保留キュー */
+#define TUNE_BACKLOG        (65535)             /* churn：listen のバックログ */
+
+/* プロファイル名 → 番号（知らない名前なら -1） */
+int
+profile_lookup(const char *name)
+{
+    int i;
+
+    for (i = 0; i < (int) (sizeof(g_profile_name) / sizeof(g_profile_name[0])); i++) {
+        if (strcmp(name, g_profile_name[i]) == 0) {
+            return (i);
+        }
+    }
+    return (-1);
+}
+
+/* listen ソケットにプロファイルを付ける（bind / listen の前に呼ぶ。失敗は表示して続行） */
+void
+tune_listen(int soc)
+{
+    int opt;
+
+    switch (g_profile) {
+    case PROFILE_LATENCY:
+        opt = 1;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_NODELAY)");
+        }
+        opt = TUNE_NOTSENT_LOWAT;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_NOTSENT_LOWAT)");
+        }
+        break;
+    case PROFILE_THROUGHPUT:
+        opt = TUNE_BUFSZ;
+        if (setsockopt(soc, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(SO_SNDBUF)");
+        }
+        if (setsockopt(soc, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(SO_RCVBUF)");
+        }
+        break;
+    case PROFILE_CHURN:
+        opt = TUNE_DEFER_ACCEPT;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_DEFER_ACCEPT)");
+        }
+        opt = TUNE_FASTOPEN_QLEN;
+        if (setsockopt(soc, IPPROTO_TCP, TCP_FASTOPEN, &opt, sizeof(opt)) == -1) {
+            perror("setsockopt(TCP_FASTOPEN)");
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* accept した接続 / 受信した直後の接続に、引き継がれない分を付ける */
+void
+tune_accepted(int acc)
+{
+    int opt;
+
+    if (g_profile == PROFILE_LATENCY) {
+        opt = 1;
+        (void) setsockopt(acc, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt));
+    }
+}
+
 /* サーバソケットの準備 */
 int
 server_socket(const char *portnm)
@@ -113,8 +435,13 @@ server_socket(const char *portnm)
     }
     (void) fprintf(stderr, "port=%s\n", sbuf);
 
-    /* ソケット生成 */
-    if ((soc = socket(res0->ai_family, res0->ai_socktype, res0->ai_protocol)) == -1) {
+    /* ソケット生成
+     * - SOCK_NONBLOCK：listen ソケットをノンブロッキングにする
+     *   （accept_loop で EAGAIN が返るまで accept を繰り返して “まとめて” 受け付けるため）
+     * - SOCK_CLOEXEC ：exec 時に FD を引き継がない
+     */
+    if ((soc = socket(res0->ai_family, res0->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                      res0->ai_protocol)) == -1) {
         perror("socket");
         freeaddrinfo(res0);
         return (-1);
@@ -130,6 +457,9 @@ server_socket(const char *portnm)
         return (-1);
     }
 
+    /* プロファイルの TCP オプション（バッファの大きさは SYN より前に決めておく） */
+    tune_listen(soc);
+
     /* bind：ローカルアドレス（ポート）をソケットに割り当て */
     if (bind(soc, res0->ai_addr, res0->ai_addrlen) == -1) {
         perror("bind");
@@ -138,8 +468,8 @@ server_socket(const char *portnm)
         return (-1);
     }
 
-    /* listen：受動オープン開始。SOMAXCONN は OS 依存の最大バックログ */
-    if (listen(soc, SOMAXCONN) == -1) {
+    /* listen：受動オープン開始。SOMAXCONN は OS 依存の最大バックログ（churn はさらに大きく） */
+    if (listen(soc, g_profile == PROFILE_CHURN ? TUNE_BACKLOG : SOMAXCONN) == -1) {
         perror("listen");
         (void) close(soc);
         freeaddrinfo(res0);
@@ -150,330 +480,2379 @@ server_socket(const char *portnm)
     return (soc);
 }
 
-/* 同時に epoll 管理する最大接続数（学習用） */
-#define    MAX_CHILD    (20)
+/* 接続元アドレス文字列の最大長（"IPv6アドレス:ポート" + NUL） */
+#define PEER_STRLEN (INET6_ADDRSTRLEN + 8)
 
-/* アクセプトループ（epoll で accept と recv を多重化）
-   - listening socket (soc) + 接続ソケット（acc群）を epoll に登録
-   - epoll_wait で「読み取り可能」になった FD を拾う
-   - listening socket が ready → accept して新しい接続を epoll に追加
-   - 接続ソケットが ready → recv してキューへ push、送信スレッドに処理を渡す */
-void
-accept_loop(int soc)
+/* 10 進数の書き出し（format_peer の下請け） */
+char *
+put_dec(char *p, unsigned int v)
 {
-    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-    struct sockaddr_storage from;
-
-    int acc;            /* accept で返る接続ソケット */
-    int count;          /* 現在管理中の接続数（MAX_CHILD 以内に制限） */
-    int i;              /* ループ用 */
-    int qi;             /* キュー番号（fd % MAXSENDER） */
-    int epollfd;        /* epoll インスタンス FD */
-    int nfds;           /* epoll_wait で返るイベント件数 */
-
-    socklen_t flen;     /* accept/getnameinfo 用 */
-
-    struct epoll_event ev;
-    struct epoll_event events[MAX_CHILD + 1]; /* soc + acc で最大 MAX_CHILD+1 */
-
-    /* epoll インスタンス生成
-       - Linux では size 引数は無視されるが、1 を渡すのが一般的 */
-    if ((epollfd = epoll_create(1)) == -1) {
-        perror("epoll_create");
-        return;
-    }
-
-    /* listening socket を epoll へ登録（読み取り可能=接続到来） */
-    ev.data.fd = soc;
-    ev.events = EPOLLIN;
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, soc, &ev) == -1) {
-        perror("epoll_ctl");
-        (void) close(epollfd);
-        return;
+    char tmp[10];
+    int n;
+
+    n = 0;
+    do {
+        tmp[n++] = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    while (n > 0) {
+        *p++ = tmp[--n];
     }
+    return (p);
+}
 
-    count = 0;
-
-    for (;;) {
-        (void) fprintf(stderr,"<<child count:%d>>\n", count);
-
-        /* epoll_wait：
-           - events に ready FD を詰めて返す
-           - timeout = 10秒（10*1000ms） */
-        nfds = epoll_wait(epollfd, events, MAX_CHILD + 1, 10 * 1000);
-
-        switch (nfds) {
-        case -1:
-            /* エラー（EINTR で割り込みの可能性もあるが、ここでは単純化） */
-            perror("epoll_wait");
-            break;
-
-        case 0:
-            /* タイムアウト：何も起きなかった */
-            break;
-
-        default:
-            /* ready FD が nfds 件 */
-            for (i = 0; i < nfds; i++) {
-
-                /* ready FD が listening socket なら accept */
-                if (events[i].data.fd == soc) {
-
-                    flen = (socklen_t) sizeof(from);
-
-                    /* 接続受付（新しい acc を得る） */
-                    acc = accept(soc, (struct sockaddr *) &from, &flen);
-                    if (acc == -1) {
-                        if (errno != EINTR) {
-                            perror("accept");
-                        }
-                        continue;
-                    }
-
-                    /* 相手をログ表示 */
-                    (void) getnameinfo((struct sockaddr *) &from, flen,
-                                       hbuf, sizeof(hbuf),
-                                       sbuf, sizeof(sbuf),
-                                       NI_NUMERICHOST | NI_NUMERICSERV);
-                    (void) fprintf(stderr, "accept:%s:%s\n", hbuf, sbuf);
-
-                    /* 接続数制限（学習用） */
-                    if (count + 1 >= MAX_CHILD) {
-                        (void) fprintf(stderr, "connection is full : cannot accept\n");
-                        (void) close(acc);
-                        continue;
-                    }
+/* 接続元アドレスの文字列化（getnameinfo を使わない高速版）
+ *
+ * ss  : accept で得た生のアドレス（AF_INET / AF_INET6）
+ * buf : 出力先（PEER_STRLEN バイト以上）
+ *
+ * 出力形式は getnameinfo(NI_NUMERICHOST | NI_NUMERICSERV) の host と port を
+ * ':' でつないだもの（"127.0.0.1:50000"）と同じ。
+ *
+ * - getnameinfo は NSS/ロケールを経由し、内部でも書式化を行うので accept 毎に呼ぶと重い
+ * - ここでは 10 進/16 進の変換を手で書き、malloc も snprintf も使わない
+ * - IPv6 は RFC 5952 に従い、最長の 0 の連続（2 グループ以上）を "::" に縮める
+ *
+ * 戻り値：書き込んだ文字数（NUL を除く）
+ */
+size_t
+format_peer(const struct sockaddr_storage *ss, char *buf)
+{
+    static const char hex[] = "0123456789abcdef";
+    const struct sockaddr_in *sin;
+    const struct sockaddr_in6 *sin6;
+    const unsigned char *a;
+    unsigned int port, w;
+    int i, j, best, bestlen, shift;
+    char *p;
+
+    p = buf;
+    switch (ss->ss_family) {
+    case AF_INET:
+        sin = (const struct sockaddr_in *) ss;
+        a = (const unsigned char *) &sin->sin_addr;
+        for (i = 0; i < 4; i++) {
+            if (i > 0) {
+                *p++ = '.';
+            }
+            p = put_dec(p, a[i]);
+        }
+        port = ntohs(sin->sin_port);
+        break;
+
+    case AF_INET6:
+        sin6 = (const struct sockaddr_in6 *) ss;
+        a = sin6->sin6_addr.s6_addr;
+
+        /* 最長の 0 グループの連続を探す */
+        best = -1;
+        bestlen = 0;
+        for (i = 0; i < 8; i = j + 1) {
+            for (j = i; j < 8 && a[2 * j] == 0 && a[2 * j + 1] == 0; j++)
+                ;
+            if (j - i >= 2 && j - i > bestlen) {
+                best = i;
+                bestlen = j - i;
+            }
+        }
 
-                    /* acc を epoll に追加（受信可能を監視） */
-                    ev.data.fd = acc;
-                    ev.events = EPOLLIN;
-                    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, acc, &ev) == -1) {
-                        perror("epoll_ctl");
-                        (void) close(acc);
-                        (void) close(epollfd);
-                        return;
-                    }
-                    count++;
+        if (best == 0
+            && (bestlen == 6 || (bestlen == 5 && a[10] == 0xff && a[11] == 0xff))) {
+            /* IPv4 射影/互換アドレス（::ffff:a.b.c.d, ::a.b.c.d）は末尾 32bit を 10 進で書く
+             * （inet_ntop/getnameinfo と同じ判定） */
+            *p++ = ':';
+            *p++ = ':';
+            if (bestlen == 5) {
+                (void) memcpy(p, "ffff:", 5);
+                p += 5;
+            }
+            for (j = 12; j < 16; j++) {
+                if (j > 12) {
+                    *p++ = '.';
+                }
+                p = put_dec(p, a[j]);
+            }
+        } else {
+            for (i = 0; i < 8; i++) {
+                if (i == best) {
+                    *p++ = ':';
+                    *p++ = ':';
+                    i += bestlen - 1;
                     continue;
                 }
+                if (i > 0 && i != best + bestlen) {
+                    *p++ = ':';
+                }
+                w = ((unsigned int) a[2 * i] << 8) | a[2 * i + 1];
+                for (shift = 12; shift > 0 && ((w >> shift) & 0xf) == 0; shift -= 4)
+                    ;
+                for (; shift >= 0; shift -= 4) {
+                    *p++ = hex[(w >> shift) & 0xf];
+                }
+            }
+        }
+        port = ntohs(sin6->sin6_port);
+        break;
 
-                /* ここに来るのは「接続ソケットが ready」なケース（=受信できる） */
-                {
-                    int fd = events[i].data.fd;
-
-                    /* fd を送信スレッド（キュー）へ割り当て
-                       - 単純に fd % MAXSENDER で振り分け（負荷分散の簡易版） */
-                    qi = fd % MAXSENDER;
-
-                    /* ここでは g_queue[qi].last のスロットへ受信結果を格納する。
-                       注意：この時点では mutex を取っていないので、
-                             producer が複数いる設計にすると破綻する。
-                             今回は accept_loop が 1 スレッド（producer 1本）なので成立している。 */
-                    g_queue[qi].data[g_queue[qi].last].acc = fd;
-
-                    g_queue[qi].data[g_queue[qi].last].len =
-                        recv(g_queue[qi].data[g_queue[qi].last].acc,
-                             g_queue[qi].data[g_queue[qi].last].buf,
-                             sizeof(g_queue[qi].data[g_queue[qi].last].buf),
-                             0);
-
-                    /* recv の結果で分岐 */
-                    switch (g_queue[qi].data[g_queue[qi].last].len) {
+    default:
+        *p++ = '?';
+        port = 0;
+        break;
+    }
 
-                    case -1:
-                        /* エラー（EAGAIN 等の可能性もあるが、この実装は単純化） */
-                        perror("recv");
-                        /* fall through */
+    *p++ = ':';
+    p = put_dec(p, port);
+    *p = '\0';
+    return ((size_t) (p - buf));
+}
 
-                    case 0:
-                        /* EOF：クライアント切断 */
-                        (void) fprintf(stderr, "[child%d]recv:EOF\n", fd);
+/* 1回の “listen FD が ready” で accept する最大件数（1イテレーションあたりの予算）
+ *
+ * - ready 1回につき 1件しか accept しないと、接続が殺到したときに
+ *   イベントループ1周ごとに 1件ずつしか捌けない（accept レートが頭打ちになる）
+ * - かといって無制限に accept し続けると既存接続の処理が遅れるので上限を設ける
+ * - 予算を使い切って残った接続は、次の周回でも listen FD が ready のままなので取りこぼさない
+ */
+#define ACCEPT_BUDGET (64)
+
+/* 受け付けられない接続に返す 1 行（黙って close すると、クライアントには RST に見えて
+ * すぐに接続し直されるので、断った理由を返してから閉じる。前の「過負荷時の受け付け制御」） */
+#define BUSY_MSG        "BUSY\r\n"
+#define BUSY_MSG_LEN    (sizeof(BUSY_MSG) - 1)
+
+/* RLIMIT_NOFILE を引き上げた結果がこれを超える場合はこの値に丸める（テーブル確保量の上限） */
+#define NOFILE_MAX (65536)
+
+/* 接続管理以外で使う FD の見込み数（0,1,2 / listen / 予備FD / epoll / シグナル / 管理用ソケット など） */
+#define RESERVED_FD (16)
+
+/* EMFILE/ENFILE 対策の予備 FD（/dev/null を開いたまま確保しておく） */
+int g_spare_fd = -1;
+
+/* RLIMIT_NOFILE（プロセスが開ける FD 数）をハードリミットまで引き上げる
+ *
+ * - ソフトリミットは 1024 程度に絞られていることが多いが、
+ *   ハードリミットまでは一般ユーザでも引き上げられる
+ * - 起動時に1回呼び、戻り値から接続管理テーブルの大きさを決める
+ *
+ * 戻り値：
+ * - 成功：引き上げ後のソフトリミット
+ * - 失敗：-1
+ */
+int
+raise_nofile_limit(void)
+{
+    struct rlimit rl;
 
-                        /* epoll から削除（監視不要に） */
-                        if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, &ev) == -1) {
-                            perror("epoll_ctl");
-                            (void) close(epollfd);
-                            return;
-                        }
+    if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+        perror("getrlimit");
+        return (-1);
+    }
+    if (rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+            /* 引き上げに失敗しても現状の値で続行する */
+            perror("setrlimit");
+            (void) getrlimit(RLIMIT_NOFILE, &rl);
+        }
+    }
 
-                        /* ソケットクローズ */
-                        (void) close(fd);
-                        count--;
-                        break;
+    /* RLIM_INFINITY 等の巨大な値はテーブルを確保しきれないので丸める */
+    if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > NOFILE_MAX) {
+        return (NOFILE_MAX);
+    }
+    return ((int) rl.rlim_cur);
+}
 
-                    default:
-                        /* 正常受信：キューへ “1件追加” を確定させる
-                           - last を進める操作は共有データなので mutex で保護
-                           - cond_signal で送信スレッドを起こす */
-                        (void) pthread_mutex_lock(&g_queue[qi].mutex);
+/* ノンブロッキング accept（accept4）＋ EMFILE 時の “予備 FD による捨て accept”
+ *
+ * soc  : ノンブロッキングの listen ソケット
+ * from : 接続元アドレスの格納先
+ * len  : from のサイズ（入出力）
+ *
+ * アルゴリズム：
+ * 1) accept4(SOCK_NONBLOCK | SOCK_CLOEXEC) で受け付ける
+ *    - 接続 FD は最初からノンブロッキング/close-on-exec になるので fcntl が要らない
+ * 2) EMFILE/ENFILE（FD 枯渇）の場合：
+ *    - 予備 FD を close して空きを 1 つ作る
+ *    - その空きで accept して即 close（接続を “捨てる”）
+ *    - 予備 FD を開き直す
+ *    → listen キューから接続が取り除かれるので、listen FD が
+ *      “読み込み可能” を返し続けて CPU 100% で空回りすることが無くなる
+ *
+ * 戻り値：
+ * - 成功：接続 FD
+ * - 失敗：-1
+ *   - errno == EAGAIN       : listen キューが空になった（ドレイン完了）
+ *   - errno == ECONNABORTED : 接続を捨てた（呼び出し側は次の accept へ進んでよい）
+ */
+int
+accept_nonblock(int soc, struct sockaddr_storage *from, socklen_t *len)
+{
+    int acc, err;
 
-                        g_queue[qi].last = QUEUE_NEXT(g_queue[qi].last);
+    for (;;) {
+        if ((acc = accept4(soc, (struct sockaddr *) from, len,
+                           SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+            return (acc);
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno != EMFILE && errno != ENFILE) || g_spare_fd == -1) {
+            return (-1);
+        }
 
-                        (void) pthread_cond_signal(&g_queue[qi].cond);
-                        (void) pthread_mutex_unlock(&g_queue[qi].mutex);
-                        break;
-                    }
-                }
-            }
-            break;
+        /* FD 枯渇：予備 FD を手放して 1 接続だけ受けて捨てる */
+        (void) close(g_spare_fd);
+        if ((acc = accept(soc, NULL, NULL)) != -1) {
+            (void) send(acc, BUSY_MSG, BUSY_MSG_LEN, MSG_NOSIGNAL | MSG_DONTWAIT);
+            (void) close(acc);
+            (void) fprintf(stderr, "accept:EMFILE:shed\n");
+            err = ECONNABORTED;
+        } else {
+            err = errno;
         }
+        g_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        errno = err;
+        return (-1);
     }
-
-    /* 通常は到達しないが、終了パスとして close */
-    (void) close(epollfd);
 }
 
-/* サイズ指定文字列連結（strlcat 風）
-   - dst のサイズ上限 size を超えないように src を連結する
-   - 返り値は “連結後に必要だった長さ” 相当（strlcat の慣例） */
-size_t
-mystrlcat(char *dst, const char *src, size_t size)
+/* シグナルを FD で受け取る（sig_fd_init）
+ *
+ * - g_sig_fd   : signalfd、または自己パイプの読み側（イベントループで待てる）
+ * - g_sig_pipe : 自己パイプ（signalfd が使えないときだけ使う）
+ * - g_sig_mask : sig_fd_init で扱うシグナルの集合
+ */
+int g_sig_fd = -1;
+int g_sig_pipe[2] = { -1, -1 };
+sigset_t g_sig_mask;
+
+/* 自己パイプ用のシグナルハンドラ（signalfd が使えないとき）
+ *
+ * シグナル番号を 1 バイト書くだけ（write は async-signal-safe）。
+ */
+void
+sig_pipe_handler(int sig)
 {
-    const char *ps;
-    char *pd, *pde;
-    size_t dlen, lest;
+    unsigned char c;
+    int save;
 
-    /* dst の終端（あるいは size 到達）まで進める */
-    for (pd = dst, lest = size; *pd != '\0' && lest != 0; pd++, lest--)
-        ;
+    save = errno;
+    c = (unsigned char) sig;
+    (void) write(g_sig_pipe[1], &c, 1);
+    errno = save;
+}
 
-    dlen = (size_t)(pd - dst);
+/* sigs[0..nsigs) を「読める FD」で受け取るようにする
+ *
+ * 戻り値: イベントループで待つ FD / -1（失敗）
+ *
+ * アルゴリズム：
+ * 1) 対象のシグナルをブロック（以後、非同期に割り込まれない）
+ * 2) signalfd を作る → 届いたシグナルは signalfd_siginfo として read できる
+ * 3) signalfd が無ければ自己パイプ：ハンドラ（SA_RESTART）が番号を 1 バイト書き、
+ *    ブロックを外す
+ */
+int
+sig_fd_init(const int *sigs, int nsigs)
+{
+    struct sigaction sa;
+    int i;
 
-    /* dst がすでに size いっぱいなら、src を全部足した長さを返すだけ */
-    if (size - dlen == 0) {
-        return (dlen + strlen(src));
+    (void) sigemptyset(&g_sig_mask);
+    for (i = 0; i < nsigs; i++) {
+        (void) sigaddset(&g_sig_mask, sigs[i]);
     }
-
-    /* pde は “書き込み可能な最後の位置” (NUL 終端用に -1) */
-    pde = dst + size - 1;
-
-    /* src を dst にコピー（pde を超えない範囲） */
-    for (ps = src; *ps != '\0' && pd < pde; pd++, ps++) {
-        *pd = *ps;
+    (void) sigprocmask(SIG_BLOCK, &g_sig_mask, NULL);
+#ifdef __linux__
+    if ((g_sig_fd = signalfd(-1, &g_sig_mask, SFD_NONBLOCK | SFD_CLOEXEC)) != -1) {
+        return (g_sig_fd);
+    }
+    perror("signalfd");
+#endif
+    if (pipe(g_sig_pipe) == -1) {
+        perror("pipe");
+        (void) sigprocmask(SIG_UNBLOCK, &g_sig_mask, NULL);
+        return (-1);
+    }
+    for (i = 0; i < 2; i++) {
+        (void) fcntl(g_sig_pipe[i], F_SETFL, fcntl(g_sig_pipe[i], F_GETFL, 0) | O_NONBLOCK);
+        (void) fcntl(g_sig_pipe[i], F_SETFD, FD_CLOEXEC);
     }
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_pipe_handler;
+    (void) sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    for (i = 0; i < nsigs; i++) {
+        (void) sigaction(sigs[i], &sa, NULL);
+    }
+    g_sig_fd = g_sig_pipe[0];
+    (void) sigprocmask(SIG_UNBLOCK, &g_sig_mask, NULL);
+    return (g_sig_fd);
+}
 
-    /* 残りを NUL で埋める（安全側） */
-    for (; pd <= pde; pd++) {
-        *pd = '\0';
+/* シグナル FD から 1 つ取り出す（戻り値：シグナル番号 / 0 = もう無い） */
+int
+sig_fd_read(void)
+{
+#ifdef __linux__
+    struct signalfd_siginfo si;
+#endif
+    unsigned char c;
+
+    if (g_sig_pipe[0] == -1) {
+#ifdef __linux__
+        if (read(g_sig_fd, &si, sizeof(si)) == (ssize_t) sizeof(si)) {
+            return ((int) si.ssi_signo);
+        }
+#endif
+        return (0);
+    }
+    if (read(g_sig_fd, &c, 1) == 1) {
+        return (c);
     }
+    return (0);
+}
 
-    /* src の残り長を数える */
-    while (*ps++)
-        ;
 
-    return (dlen + (size_t)(ps - src - 1));
-}
+/* グレースフル停止（drain）
+ *
+ * SIGTERM / SIGINT（または管理用ソケットの drain）を受けたら即座に終わらず、次の順で止める：
+ * 1) listen ソケットを閉じて新しい接続を受けない
+ *    （ロードバランサやローリング再起動の相手は、ここで接続先を切り替える）
+ * 2) 既に受け付けた接続はこれまでどおり処理し、相手が閉じるのを待つ
+ * 3) 接続が 0 になったら終了。g_drain_timeout 秒を過ぎたら残りを閉じて終了する
+ *    （既定 DRAIN_TIMEOUT、設定 drain_timeout）
+ * - 途中経過（残り接続数と経過時間）を約 1 秒ごとに表示する
+ * - g_drain_start が 0 でなければ drain 中
+ */
+#define DRAIN_TIMEOUT   (30)
 
-/* 送信スレッド（consumer）
-   - qi（0..MAXSENDER-1）に対応するキューからデータを取り出して応答する
-   - キューが空なら cond_wait でスリープし、producer からの signal で起きる */
-void *
-send_thread(void *arg)
-{
-    char *ptr;
-    ssize_t len;
+int g_drain_timeout = DRAIN_TIMEOUT;
 
-    int i;   /* pop した要素のインデックス */
-    int qi;  /* 自分のキュー番号 */
+double g_drain_start = 0.0;     /* drain を始めた時刻（CLOCK_MONOTONIC、0 = 通常運転） */
+double g_drain_report = 0.0;    /* 最後に途中経過を表示した時刻 */
 
-    /* 引数：qi を受け取る
-       注意：本来は intptr_t を使うのが安全（64bit 環境でのポインタ/整数変換） */
-    qi = (int) arg;
+/* 単調増加時計の現在値（秒） */
+double
+now_sec(void)
+{
+    struct timespec ts;
 
-    for (;;) {
-        /* キューの排他制御開始 */
-        (void) pthread_mutex_lock(&g_queue[qi].mutex);
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec + (double) ts.tv_nsec / 1e9);
+}
 
-        if (g_queue[qi].last != g_queue[qi].front) {
-            /* キューにデータがある：front を 1つ進めて pop */
-            i = g_queue[qi].front;
-            g_queue[qi].front = QUEUE_NEXT(g_queue[qi].front);
+/* drain を始める（sig：受けたシグナル / 0 = 管理用ソケットから、nconn：その時点の接続数） */
+void
+drain_begin(int sig, int nconn)
+{
+    g_drain_start = g_drain_report = now_sec();
+    if (sig == 0) {
+        (void) fprintf(stderr, "drain:admin, stop accepting, conns=%d, timeout=%ds\n",
+                       nconn, g_drain_timeout);
+    } else {
+        (void) fprintf(stderr, "drain:signal %d, stop accepting, conns=%d, timeout=%ds\n",
+                       sig, nconn, g_drain_timeout);
+    }
+}
 
-            /* pop が確定したのでロック解除（以降は自分だけが i の要素を触る想定） */
-            (void) pthread_mutex_unlock(&g_queue[qi].mutex);
-        } else {
-            /* キューが空：新しいデータが来るまで待つ
-               - cond_wait は mutex を一時解放し、起床時に再ロックして戻る */
-            (void) pthread_cond_wait(&g_queue[qi].cond, &g_queue[qi].mutex);
-            (void) pthread_mutex_unlock(&g_queue[qi].mutex);
-            continue;
-        }
+/* drain を終えてよいか調べる（nconn：残っている接続数）
+ *
+ * 戻り値：1 = 終了してよい（接続 0、または期限切れ） / 0 = まだ待つ
+ */
+int
+drain_check(int nconn)
+{
+    double now;
 
-        /* ここからは “i の要素” を処理して応答する */
+    now = now_sec();
+    if (nconn == 0) {
+        (void) fprintf(stderr, "drain:done in %.1fs\n", now - g_drain_start);
+        return (1);
+    }
+    if (now - g_drain_start >= g_drain_timeout) {
+        (void) fprintf(stderr, "drain:deadline, closing %d conns\n", nconn);
+        return (1);
+    }
+    if (now - g_drain_report >= 1.0) {
+        g_drain_report = now;
+        (void) fprintf(stderr, "drain:conns=%d elapsed=%.1fs\n", nconn, now - g_drain_start);
+    }
+    return (0);
+}
 
-        /* 受信バッファを NUL 終端して文字列として扱えるようにする */
-        g_queue[qi].data[i].buf[g_queue[qi].data[i].len] = '\0';
 
-        /* CR/LF を潰してログを整形 */
-        if ((ptr = strpbrk(g_queue[qi].data[i].buf, "\r\n")) != NULL) {
-            *ptr = '\0';
-        }
+/* 同時に epoll 管理する最大接続数の既定値
+   - 実際の上限は main で RLIMIT_NOFILE を引き上げた結果から g_conn_cap に決め直す
+     （getrlimit に失敗した場合だけこの値を使う） */
+#define    MAX_CHILD    (20)
 
-        /* ログ出力（child は fd を出しているが、ここでは acc を表示） */
-        (void) fprintf(stderr,
-                       "[child%d]%s\n",
-                       g_queue[qi].data[i].acc,
-                       g_queue[qi].data[i].buf);
+/* 接続上限（設定 max_conn。g_conn_cap 以下で動いたまま変えられる） */
+int g_max_child = MAX_CHILD;
+
+/* g_conn[] / events[] 配列の大きさの元になる上限（起動時に決まり、以後変わらない） */
+int g_conn_cap = MAX_CHILD;
+
+/* accept ごとに接続元を表示するなら 1（設定 verbose、既定 0） */
+int g_verbose = 0;
+
+/* 接続ごとの状態
+ * - addr   : accept で得た接続元アドレス
+ *            生の sockaddr のまま保持し、文字列化はログや統計で必要になったときに
+ *            format_peer で行う（accept のたびに getnameinfo しない）
+ * - active : 使用中なら 1（drain の期限切れで残りを閉じるときに使う）
+ * - since  : accept した時刻（now_sec、接続の経過時間と寿命のヒストグラムに使う）
+ * - nreq / rx : この接続から受信した回数 / バイト数（main が書く）
+ * - tx     : この接続へ送ったバイト数（この fd を受け持つ送信スレッドが書く）
+ * - queued : キューに積まれて応答待ちの件数（main が +1、送信スレッドが -1）
+ *            close は queued が 0 になってから行う（conn_release）ので、accept の時点では常に 0
+ * - closing: 閉じかけ（epoll から外して、応答待ちが捌けるのを待っている）なら CONN_EOF / CONN_BROKEN
+ *            書くのは main だけ、送信スレッドは読むだけ
+ * - part / partlen / partcap / cr : 次の recv まで持ち越す行の途中（part_load / part_store、main だけが使う）
+ */
+struct conn {
+    struct sockaddr_storage addr;
+    int active;
+    double since;
+    unsigned long nreq;
+    unsigned long long rx, tx;
+    int queued;
+    int closing;
+    char *part;
+    size_t partlen, partcap;
+    int cr;
+};
 
-        /* 応答文字列を作成（末尾に :OK\r\n） */
-        (void) mystrlcat(g_queue[qi].data[i].buf,
-                         ":OK\r\n",
-                         sizeof(g_queue[qi].data[i].buf));
+/* conn.closing の値 */
+#define CONN_EOF     (1)    /* 相手が送信を閉じた：積まれた応答は送り切ってから閉じる */
+#define CONN_BROKEN  (2)    /* 壊れた接続（RST / エラー）：積まれた応答は捨てて閉じる */
+
+/* 閉じかけの接続の応答待ちが 0 になったことを送信スレッドが main に知らせる eventfd */
+int g_reap_fd = -1;
+
+/* FD を添字にした接続状態テーブル（大きさ g_conn_cap + RESERVED_FD） */
+struct conn *g_conn;
+
+/* 稼働統計（管理用ソケットの stats / dump-histograms で返す）
+ *
+ * - g_stats は main スレッドだけが書く。送信スレッド側の件数は各キューの nreq / tx / hist にあり、
+ *   問い合わせのたびに足し合わせる（送信スレッドを止めたときは g_stats に繰り入れる）
+ * - ヒストグラムは log2 の階級：hist[0] = [0,1)、hist[i] = [2^(i-1), 2^i)
+ *   （要求は recv から応答を送り終えるまでのマイクロ秒、接続の寿命はミリ秒）
+ */
+struct stats {
+    double start;                       /* 起動時刻（now_sec） */
+    unsigned long accepted;             /* 受け付けた接続 */
+    unsigned long refused;              /* 上限で断った接続 */
+    unsigned long closed;               /* 閉じた接続 */
+    unsigned long received;             /* キューに積んだ要求（recv 1 回分） */
+    unsigned long requests;             /* 止めた送信スレッドが応答した件数 */
+    unsigned long long rx, tx;          /* 受信バイト数 / 止めた送信スレッドの送信バイト数 */
+    unsigned long reclaimed_timeout;    /* keepalive / user timeout で切れて閉じた接続 */
+    unsigned long reclaimed_reset;      /* RST などのエラーで閉じた接続 */
+    unsigned long reclaimed_rdhup;      /* 相手が閉じたのを RDHUP で知って閉じた接続 */
+    unsigned long shed_full;            /* 上限（max_conn）で断った接続（refused の内訳） */
+    unsigned long shed_delay;           /* 待ち時間（overload）で断った接続（refused の内訳） */
+    unsigned long busy_sent;            /* BUSY を返せた接続 */
+    unsigned long accept_paused;        /* listen FD を epoll から外した回数 */
+    unsigned long hist_req[HIST_BUCKETS];
+    unsigned long hist_conn[HIST_BUCKETS];
+};
 
-        g_queue[qi].data[i].len = (ssize_t) strlen(g_queue[qi].data[i].buf);
+struct stats g_stats;
 
-        /* 応答送信 */
-        if ((len = send(g_queue[qi].data[i].acc,
-                        g_queue[qi].data[i].buf,
-                        (size_t) g_queue[qi].data[i].len, 0)) == -1) {
-            perror("send");
-        }
+/* ヒストグラムの階級（v を切り捨てた整数のビット長） */
+int
+hist_bucket(double v)
+{
+    unsigned long x;
+    int b;
 
-        /* この実装では send 失敗時も切断処理まではしない（学習用簡略） */
+    x = v < 1.0 ? 0 : (unsigned long) v;
+    for (b = 0; x != 0 && b < HIST_BUCKETS - 1; b++) {
+        x >>= 1;
     }
+    return (b);
+}
 
-    pthread_exit((void *) 0);
-    return ((void *) 0);
+/* 接続 fd を閉じたときの後始末（寿命をヒストグラムに入れる） */
+void
+conn_closed(int fd)
+{
+    g_conn[fd].active = 0;
+    free(g_conn[fd].part);
+    g_conn[fd].part = NULL;
+    g_conn[fd].partlen = g_conn[fd].partcap = 0;
+    g_conn[fd].cr = 0;
+    g_stats.closed++;
+    g_stats.hist_conn[hist_bucket((now_sec() - g_conn[fd].since) * 1e3)]++;
 }
 
+/* 接続を閉じる（main だけが呼ぶ）
+ *
+ * 送信スレッドがこの fd 宛ての応答を抱えている（queued > 0）うちに close すると、
+ * その応答は閉じた fd か、同じ番号で accept し直した別の接続に書かれてしまう。
+ * そこで epoll から外して closing を立てるだけにし、close は queued が 0 になってから行う：
+ * - 今 0 なら、ここで閉じる
+ * - そうでなければ最後の応答を片付けた送信スレッドが g_reap_fd で知らせ、conn_reap で閉じる
+ * main は closing を立ててから queued を読み、送信スレッドは queued を減らしてから closing を読む
+ * （どちらも SEQ_CST）ので、少なくとも片方は相手の書き込みを見る（閉じ忘れない）。
+ * 戻り値：閉じたら 1、送信スレッド待ちなら 0（呼び出し側の接続数はその分だけ減らす）
+ */
 int
-main(int argc, char *argv[])
+conn_release(int epollfd, int fd, int how)
 {
-    int soc, i;
-    pthread_t id;
+    struct epoll_event ev;
 
-    /* 引数：ポート番号 */
-    if (argc <= 1) {
-        (void) fprintf(stderr,"server9 port\n");
-        return (EX_USAGE);
+    if (epoll_ctl(epollfd, EPOLL_CTL_DEL, fd, &ev) == -1) {
+        perror("epoll_ctl");
     }
+    __atomic_store_n(&g_conn[fd].closing, how, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&g_conn[fd].queued, __ATOMIC_SEQ_CST) != 0) {
+        return (0);
+    }
+    (void) close(fd);
+    __atomic_store_n(&g_conn[fd].closing, 0, __ATOMIC_RELAXED);
+    conn_closed(fd);
+    return (1);
+}
 
-    /* 送信スレッド（consumer）を MAXSENDER 本起動し、対応するキューを初期化 */
-    for (i = 0; i < MAXSENDER; i++) {
-        /* mutex / cond の初期化（queue.front/last はゼロ初期値を前提） */
-        (void) pthread_mutex_init(&g_queue[i].mutex, NULL);
-        (void) pthread_cond_init(&g_queue[i].cond, NULL);
-
-        /* 送信スレッド生成
-           - i を arg に渡す（qi）
-           注意：64bit 環境では (void*)i が危険なので、本来は (void*)(intptr_t)i が良い */
-        (void) pthread_create(&id, NULL, (void *) send_thread, (void *) i);
+/* 応答待ちが捌けた閉じかけの接続を閉じる（g_reap_fd が読めたとき、main）
+   - 知らせは eventfd に貯まって 1 回で読めるので、テーブルを一巡して全部拾う
+   - 戻り値：閉じた接続の数 */
+int
+conn_reap(void)
+{
+    eventfd_t v;
+    int fd, n;
+
+    (void) eventfd_read(g_reap_fd, &v);
+    n = 0;
+    for (fd = 0; fd < g_conn_cap + RESERVED_FD; fd++) {
+        if (__atomic_load_n(&g_conn[fd].closing, __ATOMIC_RELAXED) != 0
+            && __atomic_load_n(&g_conn[fd].queued, __ATOMIC_ACQUIRE) == 0) {
+            (void) close(fd);
+            __atomic_store_n(&g_conn[fd].closing, 0, __ATOMIC_RELAXED);
+            conn_closed(fd);
+            n++;
+        }
     }
+    return (n);
+}
 
-    /* listening socket を作成 */
+/* q->last の要素（fd から受けた len バイト）を積んで送信スレッドを起こす（main だけが呼ぶ）
+   - last を進める操作は共有データなので mutex で保護
+   - cond_signal で送信スレッドを起こす */
+void
+queue_put(struct queue *q, int fd, size_t len)
+{
+    q->data[q->last].len = (ssize_t) len;
+    q->data[q->last].t = now_sec();
+    g_conn[fd].nreq++;
+    __atomic_add_fetch(&g_conn[fd].queued, 1, __ATOMIC_RELAXED);
+    g_stats.received++;
+    (void) pthread_mutex_lock(&q->mutex);
+
+    q->last = QUEUE_NEXT(q, q->last);
+
+    (void) pthread_cond_signal(&q->cond);
+    (void) pthread_mutex_unlock(&q->mutex);
+}
+
+/* 死んだ相手の接続を片付ける（keepalive / TCP_USER_TIMEOUT）
+ *
+ * 相手が FIN も RST も送らずに消える（電源断・ケーブル断・途中の NAT がエントリを捨てた等）と、
+ * こちらの接続は次の要求を待ったまま残り、接続の枠（max_conn）をいつまでも使い続ける。
+ * そこで accept した接続に次を付ける（設定ファイル / 管理用ソケットの set で変えられ、
+ * 以後 accept する接続に効く）：
+ *
+ * - SO_KEEPALIVE + TCP_KEEPIDLE / TCP_KEEPINTVL / TCP_KEEPCNT
+ *   keepidle 秒なにも流れなければ keepintvl 秒おきにプローブを送り、keepcnt 回続けて応答が
+ *   無ければ接続をエラー（ETIMEDOUT）にする（keepidle 0 = keepalive を付けない）
+ * - TCP_USER_TIMEOUT（ミリ秒、0 = 付けない）
+ *   送ったデータ（応答やプローブ）が user_timeout の間 ACK されなければエラーにする。
+ *   付けると keepalive も keepcnt ではなくこの時間で打ち切られるので、
+ *   既定は keepidle + keepintvl * keepcnt に合わせてある
+ *
+ * エラーになった接続は読み込み可能になり、recv が ETIMEDOUT / ECONNRESET を返すので閉じる。
+ * epoll では EPOLLHUP / EPOLLERR の接続を recv せずに閉じ（積まれた応答は捨てる）、EPOLLRDHUP
+ * （相手が送信側を閉じた）の接続も、読み残しが無ければ recv を待たずに閉じる（応答は送り切る）。
+ * どちらも応答待ち（queued）が残っていれば、close は送信スレッドが捌き終えてから（conn_release）。
+ * 閉じた理由は stats の reclaimed_timeout / reclaimed_reset / reclaimed_rdhup で数える
+ */
+#define KEEPIDLE        (60)                                    /* 秒 */
+#define KEEPINTVL       (10)                                    /* 秒 */
+#define KEEPCNT         (5)
+#define USER_TIMEOUT    ((KEEPIDLE + KEEPINTVL * KEEPCNT) * 1000) /* ミリ秒 */
+
+int g_keepidle = KEEPIDLE;
+int g_keepintvl = KEEPINTVL;
+int g_keepcnt = KEEPCNT;
+int g_user_timeout = USER_TIMEOUT;
+
+/* accept した接続に keepalive / TCP_USER_TIMEOUT を付ける（失敗は表示して続行） */
+void
+keepalive_set(int acc)
+{
+    int opt;
+
+    if (g_keepidle > 0) {
+        opt = 1;
+        if (setsockopt(acc, SOL_SOCKET, SO_KEEPALIVE, &opt, sizeof(opt)) == -1
+            || setsockopt(acc, IPPROTO_TCP, TCP_KEEPIDLE, &g_keepidle, sizeof(g_keepidle)) == -1
+            || setsockopt(acc, IPPROTO_TCP, TCP_KEEPINTVL, &g_keepintvl, sizeof(g_keepintvl)) == -1
+            || setsockopt(acc, IPPROTO_TCP, TCP_KEEPCNT, &g_keepcnt, sizeof(g_keepcnt)) == -1) {
+            perror("setsockopt(SO_KEEPALIVE)");
+        }
+    }
+    if (g_user_timeout > 0
+        && setsockopt(acc, IPPROTO_TCP, TCP_USER_TIMEOUT,
+                      &g_user_timeout, sizeof(g_user_timeout)) == -1) {
+        perror("setsockopt(TCP_USER_TIMEOUT)");
+    }
+}
+
+/* 相手が消えた接続を閉じた理由を数える（err：recv / writev の errno か SO_ERROR の値） */
+void
+reclaim_count(int err)
+{
+    if (err == ETIMEDOUT) {
+        g_stats.reclaimed_timeout++;
+    } else {
+        g_stats.reclaimed_reset++;
+    }
+}
+
+/* 接続に溜まっているエラー（SO_ERROR。取れない / 0 なら ECONNRESET とみなす） */
+int
+sock_error(int fd)
+{
+    socklen_t len;
+    int err;
+
+    err = 0;
+    len = (socklen_t) sizeof(err);
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err == 0) {
+        err = ECONNRESET;
+    }
+    return (err);
+}
+
+/* accept_pause で accept を止めるか（接続数が上限、またはどれかのキューが overload） */
+int
+accept_full(int nconn)
+{
+    int i;
+
+    if (nconn + 1 >= g_max_child) {
+        return (1);
+    }
+    for (i = 0; i < g_nsender; i++) {
+        if (__atomic_load_n(&g_queue[i].qd.overload, __ATOMIC_RELAXED)) {
+            return (1);
+        }
+    }
+    return (0);
+}
+
+/* BUSY を返して接続を閉じる（前の「過負荷時の受け付け制御」）
+ * - 送れなくても閉じる。受信バッファに届いている分は読み捨てる */
+void
+busy_reject(int acc)
+{
+    char buf[512];
+
+    if (send(acc, BUSY_MSG, BUSY_MSG_LEN, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t) BUSY_MSG_LEN) {
+        g_stats.busy_sent++;
+    }
+    (void) shutdown(acc, SHUT_WR);
+    while (recv(acc, buf, sizeof(buf), MSG_DONTWAIT) > 0) {
+        ;
+    }
+    (void) close(acc);
+}
+
+/* listen FD を epoll から外す / 戻す（accept_pause。*paused を今の状態に合わせる） */
+void
+accept_pause(int epollfd, int soc, int pause, int *paused)
+{
+    struct epoll_event ev;
+
+    if (soc == -1 || pause == *paused) {
+        return;
+    }
+    ev.data.fd = soc;
+    ev.events = EPOLLIN;
+    if (epoll_ctl(epollfd, pause ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, soc, &ev) == -1) {
+        perror("epoll_ctl(accept_pause)");
+        return;
+    }
+    if (pause) {
+        g_stats.accept_paused++;
+    }
+    *paused = pause;
+    (void) fprintf(stderr, "admission: accept %s\n", pause ? "paused" : "resumed");
+}
+
+/* 設定ファイルを読み直して反映する（SIGHUP。定義は後ろの「実行時設定」） */
+void conf_reload(void);
+
+/* 行の持ち越し（定義は後ろの「行ごとの応答」） */
+size_t part_load(const struct conn *c, char *buf, size_t size);
+size_t part_store(struct conn *c, const char *buf, size_t len, size_t loaded, size_t size, size_t *pos);
+
+/* 管理用ソケット（定義は後ろの「管理用ソケット」） */
+#define ADMIN_PATH_FMT  "/tmp/server9.%s.admin"
+#define ADMIN_MAX       (4)
+#define ADMIN_LINE      (256)
+
+struct admin;
+int g_admin_soc = -1;
+int g_admin_drain = 0;                  /* drain コマンドを受けたら 1（イベントループが見る） */
+void admin_accept(int epollfd);
+struct admin *admin_lookup(int fd);
+void admin_event(int epollfd, struct admin *a, int nconn);
+void admin_shutdown(int epollfd);
+
+/* アクセプトループ（epoll で accept と recv を多重化）
+   - listening socket (soc) + 接続ソケット（acc群）を epoll に登録
+   - epoll_wait で「読み取り可能」になった FD を拾う
+   - listening socket が ready → accept して新しい接続を epoll に追加
+   - 接続ソケットが ready → recv してキューへ push、送信スレッドに処理を渡す
+   - シグナル FD が ready → SIGHUP なら設定を読み直す。SIGTERM / SIGINT なら
+     drain に入る（listen ソケットを外して閉じる）
+   - 管理用ソケット / 管理接続が ready → admin_accept / admin_event（drain 中も受け付ける）
+     接続が 0 になるか期限が切れたら戻る（残った接続は main が送信スレッドの後で閉じる） */
+void
+accept_loop(int soc)
+{
+    char pbuf[PEER_STRLEN];
+    struct sockaddr_storage from;
+
+    int acc;            /* accept で返る接続ソケット */
+    int count;          /* 現在管理中の接続数（g_max_child 以内に制限） */
+    int i, n;           /* ループ用 */
+    int deferred;       /* このラウンドで recv を後回しにした接続の数 */
+    struct queue *q;    /* 振り分け先のキュー（fd % g_nsender） */
+    struct queue_data *d;   /* 受信結果を入れる要素（q->last） */
+    struct conn *c;
+    size_t loaded;      /* d->buf の先頭に戻した持ち越しの長さ */
+    size_t end, pos;    /* 積む長さ / 詰める先頭の LF */
+    ssize_t len;        /* recv の結果（-2 = 持ち越しだけで一杯なので読まなかった） */
+    int epollfd;        /* epoll インスタンス FD */
+    int nfds;           /* epoll_wait で返るイベント件数 */
+    int paused;         /* listen ソケットを epoll から外している（accept_pause） */
+
+    socklen_t flen;     /* accept/getnameinfo 用 */
+
+    struct epoll_event ev;
+    struct epoll_event *events;  /* soc + シグナル FD + eventfd + 管理用 + acc の分 */
+    struct admin *a;             /* 管理接続 */
+    int maxevents;
+
+    maxevents = g_conn_cap + 4 + ADMIN_MAX;
+    if ((events = malloc(sizeof(struct epoll_event) * maxevents)) == NULL
+        || (g_conn = calloc(g_conn_cap + RESERVED_FD, sizeof(struct conn))) == NULL) {
+        perror("malloc");
+        return;
+    }
+
+    /* epoll インスタンス生成
+       - Linux では size 引数は無視されるが、1 を渡すのが一般的 */
+    if ((epollfd = epoll_create(1)) == -1) {
+        perror("epoll_create");
+        return;
+    }
+
+    /* listening socket を epoll へ登録（読み取り可能=接続到来） */
+    ev.data.fd = soc;
+    ev.events = EPOLLIN;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, soc, &ev) == -1) {
+        perror("epoll_ctl");
+        (void) close(epollfd);
+        return;
+    }
+
+    /* シグナル FD も同じ epoll で待つ（SIGTERM / SIGINT で drain） */
+    ev.data.fd = g_sig_fd;
+    ev.events = EPOLLIN;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, g_sig_fd, &ev) == -1) {
+        perror("epoll_ctl");
+        (void) close(epollfd);
+        return;
+    }
+
+    /* 閉じかけの接続の close を送信スレッドから頼まれる eventfd も登録（conn_release） */
+    if ((g_reap_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+        perror("eventfd");
+        (void) close(epollfd);
+        return;
+    }
+    ev.data.fd = g_reap_fd;
+    ev.events = EPOLLIN;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, g_reap_fd, &ev) == -1) {
+        perror("epoll_ctl");
+        (void) close(epollfd);
+        return;
+    }
+
+    /* 管理用ソケットも登録（stats / conns / set / drain / dump-histograms） */
+    ev.data.fd = g_admin_soc;
+    ev.events = EPOLLIN;
+    if (g_admin_soc != -1 && epoll_ctl(epollfd, EPOLL_CTL_ADD, g_admin_soc, &ev) == -1) {
+        perror("epoll_ctl");
+    }
+
+    count = 0;
+    paused = 0;
+
+    for (;;) {
+        /* drain 中：接続が 0、または期限切れなら抜ける */
+        if (g_drain_start != 0.0 && drain_check(count)) {
+            break;
+        }
+
+        /* epoll_wait：
+           - events に ready FD を詰めて返す
+           - timeout = 10秒（10*1000ms）、drain 中は途中経過と期限を見るため 1 秒
+           - accept_pause で listen ソケットを外している間は、区間ごとに起きて戻せるかを見る */
+        nfds = epoll_wait(epollfd, events, maxevents,
+                          g_drain_start != 0.0 ? 1000 : paused ? g_qdelay_interval : 10 * 1000);
+
+        switch (nfds) {
+        case -1:
+            /* エラー（EINTR で割り込みの可能性もあるが、ここでは単純化） */
+            perror("epoll_wait");
+            break;
+
+        case 0:
+            /* タイムアウト：何も起きなかった */
+            break;
+
+        default:
+            /* ready FD が nfds 件 */
+            deferred = 0;
+            for (i = 0; i < nfds; i++) {
+
+                /* シグナル：SIGHUP は設定の読み直し。
+                   それ以外は listen ソケットを epoll から外して閉じ、drain に入る */
+                if (events[i].data.fd == g_sig_fd) {
+                    while ((n = sig_fd_read()) != 0) {
+                        if (n == SIGHUP) {
+                            conf_reload();
+                        } else if (soc != -1) {
+                            drain_begin(n, count);
+                            (void) epoll_ctl(epollfd, EPOLL_CTL_DEL, soc, &ev);
+                            (void) close(soc);
+                            soc = -1;
+                        }
+                    }
+                    continue;
+                }
+
+                /* eventfd：送信スレッドが応答待ちを捌いた閉じかけの接続を閉じる */
+                if (events[i].data.fd == g_reap_fd) {
+                    count -= conn_reap();
+                    continue;
+                }
+
+                /* 管理用ソケット → 管理接続を受け付ける / 管理接続 → コマンドを読む・応答を書く */
+                if (events[i].data.fd == g_admin_soc) {
+                    admin_accept(epollfd);
+                    continue;
+                }
+                if ((a = admin_lookup(events[i].data.fd)) != NULL) {
+                    admin_event(epollfd, a, count);
+                    continue;
+                }
+
+                /* ready FD が listening socket なら accept
+                   - listen ソケットはノンブロッキングなので、EAGAIN になるまで
+                     （ただし ACCEPT_BUDGET 件まで）accept を繰り返して “まとめて” 受け付ける */
+                if (events[i].data.fd == soc) {
+
+                    for (n = 0; n < ACCEPT_BUDGET; n++) {
+                        /* accept_pause：上限 / overload なら残りは listen キューで待たせる */
+                        if (g_accept_pause && accept_full(count)) {
+                            break;
+                        }
+                        flen = (socklen_t) sizeof(from);
+
+                        /* 接続受付（新しい acc を得る。最初からノンブロッキング） */
+                        acc = accept_nonblock(soc, &from, &flen);
+                        if (acc == -1) {
+                            if (errno == ECONNABORTED) {
+                                /* 接続を捨てた（FD 枯渇など）：次の接続へ */
+                                continue;
+                            }
+                            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                                perror("accept");
+                            }
+                            /* EAGAIN：listen キューが空になった */
+                            break;
+                        }
+
+                        /* 接続元の表示は verbose のときだけ（普段は生の sockaddr を g_conn[] に
+                         * 残すだけで、文字列にするのは conns で見るとき） */
+                        if (g_verbose) {
+                            (void) format_peer(&from, pbuf);
+                            (void) fprintf(stderr, "accept:%s\n", pbuf);
+                        }
+
+                        /* 受け付け制御：接続数の上限、振り分け先のキューが queue_hiwat まで
+                           溜まっている、またはその待ち時間が target を超え続けていれば
+                           BUSY を返して断る */
+                        q = &g_queue[acc % g_nsender];
+                        if (count + 1 >= g_max_child || acc >= g_conn_cap + RESERVED_FD
+                            || QUEUE_DEPTH(q, __atomic_load_n(&q->front, __ATOMIC_ACQUIRE))
+                               >= g_queue_hiwat) {
+                            (void) fprintf(stderr, "connection is full : cannot accept\n");
+                            busy_reject(acc);
+                            g_stats.refused++;
+                            g_stats.shed_full++;
+                            continue;
+                        }
+                        if (__atomic_load_n(&q->qd.overload, __ATOMIC_RELAXED)) {
+                            (void) fprintf(stderr, "overloaded (queue[%d] qdelay=%dus) : busy\n",
+                                           (int) (q - g_queue),
+                                           __atomic_load_n(&q->qd.usec, __ATOMIC_RELAXED));
+                            busy_reject(acc);
+                            g_stats.refused++;
+                            g_stats.shed_delay++;
+                            continue;
+                        }
+
+                        /* acc を epoll に追加（受信可能を監視） */
+                        ev.data.fd = acc;
+                        ev.events = EPOLLIN | EPOLLRDHUP;
+                        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, acc, &ev) == -1) {
+                            perror("epoll_ctl");
+                            (void) close(acc);
+                            (void) close(epollfd);
+                            return;
+                        }
+                        tune_accepted(acc);
+                        keepalive_set(acc);
+                        g_conn[acc].addr = from;
+                        g_conn[acc].active = 1;
+                        g_conn[acc].since = now_sec();
+                        g_conn[acc].nreq = 0;
+                        g_conn[acc].rx = 0;
+                        __atomic_store_n(&g_conn[acc].tx, 0, __ATOMIC_RELAXED);
+                        g_stats.accepted++;
+                        count++;
+                    }
+                    continue;
+                }
+
+                /* ここに来るのは「接続ソケットが ready」なケース（=受信できる） */
+                {
+                    int fd = events[i].data.fd;
+
+                    /* 壊れた接続（EPOLLERR / EPOLLHUP：RST、keepalive / user timeout 切れ）と、
+                       相手が閉じて（EPOLLRDHUP）読み残しも持ち越しも無い接続は、recv せずに閉じる
+                       - 応答待ちが残っていれば close は送信スレッドが捌き終えてから（conn_release）
+                       - 送信だけ閉じた相手（half-close）には残りの応答を送り切る */
+                    if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                        reclaim_count(sock_error(fd));
+                        count -= conn_release(epollfd, fd, CONN_BROKEN);
+                        continue;
+                    }
+                    if ((events[i].events & EPOLLRDHUP) && g_conn[fd].partlen == 0
+                        && ioctl(fd, FIONREAD, &n) == 0 && n == 0) {
+                        g_stats.reclaimed_rdhup++;
+                        count -= conn_release(epollfd, fd, CONN_EOF);
+                        continue;
+                    }
+
+                    /* fd を送信スレッド（キュー）へ割り当て
+                       - 単純に fd % g_nsender で振り分け（負荷分散の簡易版）
+                       - g_nsender が変わるのは全キューが空のときだけ（conf_apply）なので、
+                         同じ接続の応答が 2 つのスレッドに分かれて順序が入れ替わることはない */
+                    q = &g_queue[fd % g_nsender];
+
+                    /* キューが queue_hiwat まで溜まっていたら今回は読まない
+                       - front は consumer が進めるだけなので、ロック無しで古い値を読んでも
+                         「実際より多く溜まっている」側に外れるだけ
+                       - epoll はレベルトリガなので、読み残したデータで次のラウンドにまた来る */
+                    if (QUEUE_DEPTH(q, __atomic_load_n(&q->front, __ATOMIC_ACQUIRE))
+                        >= g_queue_hiwat) {
+                        deferred++;
+                        continue;
+                    }
+
+                    /* ここでは q->last のスロットへ受信結果を格納する。
+                       注意：この時点では mutex を取っていないので、
+                             producer が複数いる設計にすると破綻する。
+                             今回は accept_loop が 1 スレッド（producer 1本）なので成立している。
+                             キューの作り直し（conf_apply）も同じスレッドで行う。 */
+                    d = &q->data[q->last];
+                    d->acc = fd;
+
+                    /* 前回の持ち越し（改行の届いていない行の途中）を先頭に置き、その後ろに読む
+                       （buf_size を下げて持ち越しだけで一杯なら、今回は読まずに一杯の規則で積む） */
+                    loaded = part_load(&g_conn[fd], d->buf, q->bufsz);
+                    len = loaded < q->bufsz ? recv(fd, d->buf + loaded, q->bufsz - loaded, 0)
+                                            : (ssize_t) -2;
+
+                    /* recv の結果で分岐 */
+                    switch (len) {
+
+                    case -1:
+                        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                            /* 接続 FD はノンブロッキング：まだ読めるデータが無いだけ
+                               （last を進めないのでスロットは次回また使われる） */
+                            break;
+                        }
+                        n = errno;
+                        perror("recv");
+                        reclaim_count(n);
+
+                        /* 壊れた接続：積まれた応答は捨てて閉じる */
+                        count -= conn_release(epollfd, fd, CONN_BROKEN);
+                        break;
+
+                    case 0:
+                        /* EOF：クライアント切断 */
+                        (void) fprintf(stderr, "[child%d]recv:EOF\n", fd);
+
+                        /* 改行の届かなかった最後の行も積む
+                           （収まらなかった持ち越しは、次のラウンドでまた EOF を見て積む） */
+                        if (loaded > 0) {
+                            c = &g_conn[fd];
+                            c->partlen -= loaded;
+                            (void) memmove(c->part, c->part + loaded, c->partlen);
+                            queue_put(q, fd, loaded);
+                            if (c->partlen > 0) {
+                                break;
+                            }
+                        }
+
+                        /* epoll から外してクローズ（応答待ちが残っていれば送り切ってから） */
+                        count -= conn_release(epollfd, fd, CONN_EOF);
+                        break;
+
+                    default:
+                        /* 正常受信：最後の区切りまでをキューへ “1件追加” し、後ろは持ち越す
+                           （前が CR で終わっていて先頭が LF なら、同じ区切りなので詰める） */
+                        if (len > 0) {
+                            tune_accepted(fd);
+                            g_conn[fd].rx += (unsigned long long) len;
+                            g_stats.rx += (unsigned long long) len;
+                        } else {
+                            len = 0;
+                        }
+                        end = part_store(&g_conn[fd], d->buf, loaded + (size_t) len, loaded,
+                                         q->bufsz, &pos);
+                        if (pos > 0) {
+                            (void) memmove(d->buf, d->buf + pos, end - pos);
+                            end -= pos;
+                        }
+                        if (end > 0) {
+                            queue_put(q, fd, end);
+                        }
+                        break;
+                    }
+                }
+            }
+
+            /* 後回しにした接続があれば、送信スレッドに CPU を譲ってから次のラウンドへ */
+            if (deferred > 0) {
+                (void) sched_yield();
+            }
+            break;
+        }
+
+        /* 管理用ソケットの drain コマンド → シグナルと同じく listen ソケットを閉じる */
+        if (g_admin_drain && soc != -1) {
+            drain_begin(0, count);
+            (void) epoll_ctl(epollfd, EPOLL_CTL_DEL, soc, &ev);
+            (void) close(soc);
+            soc = -1;
+        }
+
+        /* accept_pause：上限 / overload の間は listen ソケットを外し、解けたら戻す */
+        accept_pause(epollfd, soc, g_accept_pause && accept_full(count), &paused);
+    }
+
+    admin_shutdown(epollfd);
+    (void) close(epollfd);
+    free(events);
+}
+
+/* 行区切り（CR/LF）の一括検索
+ *
+ * buf[0..len) に含まれる '\r' / '\n' の位置（先頭からのオフセット）を
+ * 出現順に off[] へ最大 max 個書き込み、書き込んだ個数を返す。
+ *
+ * strpbrk(buf, "\r\n") との違い：
+ * - NUL 終端を必要としない（recv で得た len をそのまま渡せる）
+ * - 1 回の走査ですべての区切り位置が得られる（行の切り出しを上位で行える）
+ * - x86 では 16/32 バイト単位で比較する SIMD 版を使う
+ *
+ * 実装は 3 種類あり、scan_eol_init() で CPU を見て g_scan_eol に設定する：
+ * - scan_eol_scalar : 1 バイトずつ（どの CPU でも動く）
+ * - scan_eol_sse2   : 16 バイトずつ比較 → movemask でビット列にして位置を取り出す
+ * - scan_eol_avx2   : 32 バイトずつ（AVX2 がある CPU のみ）
+ */
+size_t
+scan_eol_scalar(const char *buf, size_t len, size_t *off, size_t max)
+{
+    size_t i, n;
+
+    for (i = 0, n = 0; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+size_t
+scan_eol_sse2(const char *buf, size_t len, size_t *off, size_t max)
+{
+    __m128i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
+
+    cr = _mm_set1_epi8('\r');
+    lf = _mm_set1_epi8('\n');
+    for (i = 0, n = 0; i + 16 <= len; i += 16) {
+        v = _mm_loadu_si128((const __m128i *) (buf + i));
+        mask = (unsigned int) _mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf)));
+        /* 立っているビット = 区切り文字の位置（下位ビットから順に取り出す） */
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
+            }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    /* 16 バイトに満たない残りは 1 バイトずつ */
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
+
+__attribute__((target("avx2")))
+size_t
+scan_eol_avx2(const char *buf, size_t len, size_t *off, size_t max)
+{
+    __m256i cr, lf, v;
+    unsigned int mask;
+    size_t i, n;
+
+    cr = _mm256_set1_epi8('\r');
+    lf = _mm256_set1_epi8('\n');
+    for (i = 0, n = 0; i + 32 <= len; i += 32) {
+        v = _mm256_loadu_si256((const __m256i *) (buf + i));
+        mask = (unsigned int) _mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(v, lf)));
+        while (mask != 0) {
+            if (n == max) {
+                return (n);
+            }
+            off[n++] = i + (size_t) __builtin_ctz(mask);
+            mask &= mask - 1;
+        }
+    }
+    for (; i < len && n < max; i++) {
+        if (buf[i] == '\r' || buf[i] == '\n') {
+            off[n++] = i;
+        }
+    }
+    return (n);
+}
+#endif
+
+/* 使用する実装（scan_eol_init で決まる。スレッド生成前に 1 回だけ呼ぶこと） */
+size_t (*g_scan_eol)(const char *, size_t, size_t *, size_t) = scan_eol_scalar;
+const char *g_scan_eol_name = "scalar";
+
+void
+scan_eol_init(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        g_scan_eol = scan_eol_avx2;
+        g_scan_eol_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        g_scan_eol = scan_eol_sse2;
+        g_scan_eol_name = "sse2";
+    }
+#endif
+}
+
+/* 行ごとの応答（続けて届いた要求の切り出し）
+ *
+ * 1 回の recv には、クライアントが続けて送った複数の要求（行）が入っていることがある。
+ * g_scan_eol で区切りの位置をまとめて求め、1 行ごとに「行 + RESP_SUFFIX」の応答を 1 つずつ返す。
+ * - 区切りは CR / LF / CRLF（CR の直後の LF は同じ区切りとして読み飛ばす）
+ * - 改行で終わらない末尾は 1 行とする（呼び出し側はふつう line_end までしか渡さず、
+ *   行の途中は次の recv まで持ち越す。EOF のときと、改行の無いまま受信バッファが一杯に
+ *   なったときだけ末尾まで渡す）
+ * - 応答は受信バッファ内の行と RESP_SUFFIX を交互に並べた iovec にする（行をコピーしない）
+ *
+ * p[*pos..len) から最大 LINE_BATCH 行を iov[]（2 * LINE_BATCH 個）に並べて *pos を進め、
+ * 並べた応答の合計バイト数を *bytes に入れる。
+ * 戻り値：並べた iovec の数（行数の 2 倍。0 = もう行が無い）
+ */
+#define LINE_BATCH  (64)
+
+int
+frame_lines(const char *p, size_t len, size_t *pos, struct iovec *iov, size_t *bytes)
+{
+    size_t off[LINE_BATCH], base, start, e, n, k;
+    int cnt;
+
+    start = *pos;
+    /* 前の呼び出しが CR で終わっていれば、続く LF は同じ区切り */
+    if (start > 0 && start < len && p[start - 1] == '\r' && p[start] == '\n') {
+        start++;
+    }
+    cnt = 0;
+    *bytes = 0;
+    if (start >= len) {
+        *pos = len;
+        return (0);
+    }
+    base = start;
+    n = g_scan_eol(p + base, len - base, off, LINE_BATCH);
+    for (k = 0; k <= n; k++) {
+        if (k < n) {
+            e = base + off[k];
+            if (e == start && e > base && p[e] == '\n' && p[e - 1] == '\r') {
+                /* CRLF の LF */
+                start = e + 1;
+                continue;
+            }
+        } else if (n < LINE_BATCH && start < len) {
+            /* 改行で終わらない末尾 */
+            e = len;
+        } else {
+            break;
+        }
+        iov[cnt].iov_base = (char *) p + start;
+        iov[cnt].iov_len = e - start;
+        iov[cnt + 1].iov_base = RESP_SUFFIX;
+        iov[cnt + 1].iov_len = RESP_SUFFIX_LEN;
+        *bytes += e - start + RESP_SUFFIX_LEN;
+        cnt += 2;
+        start = e < len ? e + 1 : len;
+    }
+    *pos = start;
+    return (cnt);
+}
+
+/* p[0..len) の最後の区切り（CR / LF）の直後の位置（区切りが無ければ 0）
+ *
+ * recv の区切りは行の区切りと一致しないので、ここより後ろ（まだ改行の届いていない行の途中）は
+ * 応答せずに次の recv まで持ち越す
+ */
+size_t
+line_end(const char *p, size_t len)
+{
+    while (len > 0 && p[len - 1] != '\n' && p[len - 1] != '\r') {
+        len--;
+    }
+    return (len);
+}
+
+/* 行の持ち越し（接続ごと）
+ *
+ * recv の区切りは行の区切りと一致しない。最後の区切りより後ろ（まだ改行の届いていない行の途中）は
+ * 応答せずに接続の part に取っておき、次の recv の前に受信バッファの先頭へ戻す。
+ * - part_load ：持ち越しを buf の先頭へ写す（size に収まる分だけ。写した長さを返す）
+ * - part_store：buf[0..len)（先頭 loaded バイトは part_load で写した分）の最後の区切りより後ろを
+ *               持ち越しにして、応答する長さを返す（0 = まだ 1 行も揃っていない）
+ *   - 改行の無いまま buf が一杯（len == size）なら、そこまでを 1 行とする
+ *   - CR で終わったら cr に覚えておき、次の先頭の LF を同じ区切りとして読み飛ばす（*pos = 1）
+ * 持ち越しは改行を含まないので、残っていても応答を待っている要求は無い。
+ * buf_size を下げたあとは持ち越しが size を超えることがあり、収まらなかった分は part に残る。
+ */
+size_t
+part_load(const struct conn *c, char *buf, size_t size)
+{
+    size_t n;
+
+    n = c->partlen < size ? c->partlen : size;
+    if (n > 0) {
+        (void) memcpy(buf, c->part, n);
+    }
+    return (n);
+}
+
+size_t
+part_store(struct conn *c, const char *buf, size_t len, size_t loaded, size_t size, size_t *pos)
+{
+    size_t end, tail, rest;
+    char *p;
+
+    *pos = c->cr && len > 0 && buf[0] == '\n' ? 1 : 0;
+    if ((end = line_end(buf, len)) == 0 && len == size) {
+        end = len;
+    }
+    tail = len - end;
+    rest = c->partlen - loaded;
+    if (tail + rest > c->partcap) {
+        if ((p = realloc(c->part, tail + rest)) == NULL) {
+            /* 取っておけなければ、末尾までを 1 行として応答する */
+            perror("realloc");
+            end = len;
+            tail = 0;
+        } else {
+            c->part = p;
+            c->partcap = tail + rest;
+        }
+    }
+    if (rest > 0) {
+        (void) memmove(c->part + tail, c->part + loaded, rest);
+    }
+    if (tail > 0) {
+        (void) memcpy(c->part, buf + end, tail);
+    }
+    c->partlen = tail + rest;
+    c->cr = c->partlen == 0 && end > 0 && buf[end - 1] == '\r';
+    return (end);
+}
+
+/* 応答の送り残しを送る（iov[0..iovcnt) の done バイト目から後ろ。送信バッファが一杯なら
+ * SEND_WAIT ミリ秒まで待つ。iov は送った分だけ書き換える。戻り値：送った合計 = done + 残り）
+ *
+ * 接続 FD はノンブロッキングなので、sendmsg は送信バッファに入る分しか送らず、
+ * 一杯なら EAGAIN になる。buf_size を大きくすると（〜1MB）応答も大きくなり得るので、
+ * 残りは POLLOUT を待って送り切る
+ * （相手が読まない間は、同じキューの他の接続の応答も待たされる。教材として簡略化）
+ */
+#define SEND_WAIT (1000)
+
+ssize_t
+send_rest(int fd, struct iovec *iov, int iovcnt, size_t done)
+{
+    struct msghdr msg;
+    struct pollfd pfd;
+    size_t skip;
+    ssize_t n;
+
+    (void) memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t) iovcnt;
+    skip = done;
+    for (;;) {
+        /* 送り終えた iovec を飛ばし、途中まで送ったものは先頭をずらす */
+        while (msg.msg_iovlen > 0 && skip >= msg.msg_iov->iov_len) {
+            skip -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen == 0) {
+            break;
+        }
+        msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + skip;
+        msg.msg_iov->iov_len -= skip;
+        if ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1) {
+            skip = 0;
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return (-1);
+            }
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            if (poll(&pfd, 1, SEND_WAIT) <= 0) {
+                errno = ETIMEDOUT;
+                return (-1);
+            }
+            continue;
+        }
+        skip = (size_t) n;
+        done += (size_t) n;
+    }
+    return ((ssize_t) done);
+}
+
+/* 送信スレッド（consumer）
+   - qi（0..g_nsender-1）に対応するキューからデータを取り出して応答する
+   - キューが空なら cond_wait でスリープし、producer からの signal で起きる
+   - 次の要素を取りにロックを取った時点で前の要素の処理は終わっているので、そこで busy を下ろす
+     （キューの作り直しを待っている main には idle で知らせる。追加のロックは取らない） */
+void *
+send_thread(void *arg)
+{
+    struct iovec iov[2 * LINE_BATCH];
+    struct msghdr msg;
+    size_t pos, total;
+    unsigned long nline;
+    ssize_t len;
+    int n, k;
+
+    struct queue *q;          /* 自分のキュー */
+    struct queue_data *d;     /* pop した要素 */
+    double now;
+    int acc;                  /* 応答先の接続 */
+
+    /* 引数：qi を受け取る
+       注意：本来は intptr_t を使うのが安全（64bit 環境でのポインタ/整数変換） */
+    q = &g_queue[(int) arg];
+
+    for (;;) {
+        /* キューの排他制御開始（前の要素の処理はここで終わっている） */
+        (void) pthread_mutex_lock(&q->mutex);
+        q->busy = 0;
+        if (q->resizing) {
+            /* main が作り直し（要素を移す）を終えるまで次を pop しない
+               （すぐ pop すると busy が 1 に戻り、main は要素が尽きるまで待たされる） */
+            (void) pthread_cond_signal(&q->idle);
+            while (q->resizing == 1) {
+                (void) pthread_cond_wait(&q->cond, &q->mutex);
+            }
+        }
+
+        if (q->last != q->front) {
+            /* キューにデータがある：front を 1つ進めて pop
+               - data は作り直しで変わるので、ロックの中で読んでおく */
+            d = &q->data[q->front];
+            __atomic_store_n(&q->front, QUEUE_NEXT(q, q->front), __ATOMIC_RELEASE);
+            q->busy = 1;
+
+            /* pop が確定したのでロック解除（以降は自分だけが d の要素を触る想定） */
+            (void) pthread_mutex_unlock(&q->mutex);
+        } else if (q->stop) {
+            /* キューが空で停止要求あり：スレッドを終える */
+            (void) pthread_mutex_unlock(&q->mutex);
+            break;
+        } else {
+            /* キューが空：新しいデータが来るまで待つ
+               - 待ち行列は捌けたので overload を解く（受け付け制御）
+               - cond_wait は mutex を一時解放し、起床時に再ロックして戻る */
+            if (__atomic_load_n(&q->qd.overload, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&q->qd.overload, 0, __ATOMIC_RELAXED);
+                (void) fprintf(stderr, "admission: queue[%d] overload=0 (empty)\n",
+                               (int) (q - g_queue));
+            }
+            (void) pthread_cond_wait(&q->cond, &q->mutex);
+            (void) pthread_mutex_unlock(&q->mutex);
+            continue;
+        }
+
+        /* ここからは “d の要素” を処理して応答する */
+
+        /* 待ち時間（recv してからキューで待った時間）を受け付け制御に渡す */
+        now = now_sec();
+        if (qdelay_sample(&q->qd, now - d->t, now)) {
+            (void) fprintf(stderr, "admission: queue[%d] overload=%d qdelay=%dus\n",
+                           (int) (q - g_queue),
+                           __atomic_load_n(&q->qd.overload, __ATOMIC_RELAXED),
+                           __atomic_load_n(&q->qd.usec, __ATOMIC_RELAXED));
+        }
+
+        /* 受信済みの要素を行に切り分け、1 行ごとに応答する（NUL 終端は不要）
+           - fd は queued が 0 になるまで main が閉じない（conn_release）ので、ここで書く先は同じ接続
+           - 壊れた接続として閉じかけ（CONN_BROKEN）なら送らずに捨てる
+           - main が RST に気付く前に書くこともあるので、writev ではなく MSG_NOSIGNAL 付きの
+             sendmsg にする（EPIPE で SIGPIPE を受けてプロセスごと落ちない）
+           - 送信バッファに入りきらなかった分は send_rest で送り切る */
+        acc = d->acc;
+        nline = 0;
+        pos = 0;
+        while ((n = frame_lines(d->buf, (size_t) d->len, &pos, iov, &total)) > 0) {
+            for (k = 0; k < n; k += 2) {
+                /* ログ出力（child は fd を出しているが、ここでは acc を表示） */
+                (void) fprintf(stderr, "[child%d]%.*s\n", acc,
+                               (int) iov[k].iov_len, (char *) iov[k].iov_base);
+            }
+            nline += (unsigned long) n / 2;
+            if (__atomic_load_n(&g_conn[acc].closing, __ATOMIC_RELAXED) == CONN_BROKEN) {
+                continue;
+            }
+            (void) memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = (size_t) n;
+            if ((len = sendmsg(acc, &msg, MSG_NOSIGNAL)) == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    perror("sendmsg");
+                } else {
+                    len = 0;
+                }
+            }
+            if (len != -1 && (size_t) len < total
+                && (len = send_rest(acc, iov, n, (size_t) len)) == -1) {
+                perror("send_rest");
+            }
+
+            /* 統計（書くのはこのスレッドだけ。管理用ソケットから main が読むので relaxed の atomic） */
+            if (len > 0) {
+                __atomic_add_fetch(&g_conn[acc].tx, (unsigned long long) len, __ATOMIC_RELAXED);
+                __atomic_add_fetch(&q->tx, (unsigned long long) len, __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_add_fetch(&q->nreq, nline, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&q->hist[hist_bucket((now_sec() - d->t) * 1e6)], nline, __ATOMIC_RELAXED);
+
+        /* 応答待ちを -1（これが最後。0 にした後は main が閉じて番号を使い回すので g_conn[acc] には書かない）
+           閉じかけの接続で 0 になったら、eventfd で main に close を頼む */
+        if (__atomic_sub_fetch(&g_conn[acc].queued, 1, __ATOMIC_SEQ_CST) == 0
+            && __atomic_load_n(&g_conn[acc].closing, __ATOMIC_SEQ_CST) != 0) {
+            (void) eventfd_write(g_reap_fd, 1);
+        }
+
+        /* この実装では send 失敗時も切断処理まではしない（学習用簡略） */
+    }
+
+    pthread_exit((void *) 0);
+    return ((void *) 0);
+}
+
+/* 実行時設定（設定ファイル + SIGHUP での読み直し）
+ *
+ * server9 port [profile] [conf] の conf に「キー 値」（または「キー = 値」）を 1 行ずつ書く。
+ * '#' から行末まではコメント。書かなかったキーは既定値に戻る。
+ *
+ *   max_conn      同時接続の上限（既定：RLIMIT_NOFILE - RESERVED_FD。それより大きくはできない）
+ *   senders       送信スレッドの本数（既定：オンライン CPU 数、1..MAXSENDER）
+ *   queue_size    キュー 1 本の要素数（既定 MAXQUEUESZ）
+ *   queue_hiwat   これ以上溜まったキューの接続は recv を後回しにする（0 = queue_size - 1）
+ *   buf_size      1 要素の受信バッファ（既定 QUEUE_BUFSZ。1 回の recv の最大長になる。
+ *                 応答は行ごとに ":OK\r\n" が付く分だけ大きくなり、送信バッファに入らない分は
+ *                 send_rest で送る）
+ *   drain_timeout drain の期限（秒、既定 DRAIN_TIMEOUT）
+ *   keepidle      keepalive を始めるまでの無通信時間（秒、既定 KEEPIDLE。0 = keepalive しない）
+ *   keepintvl     keepalive のプローブ間隔（秒、既定 KEEPINTVL）
+ *   keepcnt       応答の無いプローブがこの回数続いたら切る（既定 KEEPCNT）
+ *   user_timeout  TCP_USER_TIMEOUT（ミリ秒、既定 USER_TIMEOUT。0 = 付けない）
+ *   qdelay_target   キューの待ち時間の目標（ミリ秒、既定 QDELAY_TARGET。0 = 待ち時間では断らない）
+ *   qdelay_interval 待ち時間の最小値を見る区間（ミリ秒、既定 QDELAY_INTERVAL）
+ *   accept_pause    1 = 上限 / overload の間は BUSY で断らず accept を止める（既定 0）
+ *   verbose         1 = accept ごとに接続元を表示する（既定 0。接続の多いときは表示が重いので、
+ *                   普段は管理用ソケットの conns で見る）
+ *
+ * 起動時に読み、SIGHUP で読み直して動いたまま反映する（conf_apply）。
+ * 1 行でも誤りがあれば、そのファイルは丸ごと使わない（起動時はエラー終了、SIGHUP なら今の値のまま）。
+ */
+struct config {
+    int max_conn;
+    int senders;
+    int queue_size;
+    int queue_hiwat;
+    int buf_size;
+    int drain_timeout;
+    int keepidle;
+    int keepintvl;
+    int keepcnt;
+    int user_timeout;
+    int qdelay_target;
+    int qdelay_interval;
+    int accept_pause;
+    int verbose;
+};
+
+/* キー名と struct config の中の位置、受け付ける範囲 */
+struct conf_key {
+    const char *name;
+    size_t off;
+    int min;
+    int max;
+};
+
+const struct conf_key g_conf_keys[] = {
+    { "max_conn",      offsetof(struct config, max_conn),      1,   INT_MAX },
+    { "senders",       offsetof(struct config, senders),       1,   MAXSENDER },
+    { "queue_size",    offsetof(struct config, queue_size),    2,   1 << 20 },
+    { "queue_hiwat",   offsetof(struct config, queue_hiwat),   0,   1 << 20 },
+    { "buf_size",      offsetof(struct config, buf_size),      64,  1 << 20 },
+    { "drain_timeout", offsetof(struct config, drain_timeout), 0,   86400 },
+    { "keepidle",      offsetof(struct config, keepidle),      0,   32767 },
+    { "keepintvl",     offsetof(struct config, keepintvl),     1,   32767 },
+    { "keepcnt",       offsetof(struct config, keepcnt),       1,   127 },
+    { "user_timeout",  offsetof(struct config, user_timeout),  0,   INT_MAX },
+    { "qdelay_target", offsetof(struct config, qdelay_target), 0,   10000 },
+    { "qdelay_interval", offsetof(struct config, qdelay_interval), 1, 10000 },
+    { "accept_pause",  offsetof(struct config, accept_pause),  0,   1 },
+    { "verbose",       offsetof(struct config, verbose),       0,   1 },
+};
+
+/* 設定ファイルのパス（NULL なら既定値だけで動く） */
+const char *g_conf_path = NULL;
+
+/* いま反映されている設定（管理用ソケットの set はこれを写して 1 つだけ変える） */
+struct config g_conf_cur;
+
+/* 既定値（CPU 数と FD 上限から決める） */
+void
+conf_defaults(struct config *c)
+{
+    long ncpu;
+
+    if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+        ncpu = 1;
+    }
+    c->max_conn = g_conn_cap;
+    c->senders = ncpu > MAXSENDER ? MAXSENDER : (int) ncpu;
+    c->queue_size = MAXQUEUESZ;
+    c->queue_hiwat = 0;
+    c->buf_size = QUEUE_BUFSZ;
+    c->drain_timeout = DRAIN_TIMEOUT;
+    c->keepidle = KEEPIDLE;
+    c->keepintvl = KEEPINTVL;
+    c->keepcnt = KEEPCNT;
+    c->user_timeout = USER_TIMEOUT;
+    c->qdelay_target = QDELAY_TARGET;
+    c->qdelay_interval = QDELAY_INTERVAL;
+    c->accept_pause = 0;
+    c->verbose = 0;
+}
+
+/* path を読んで c を上書きする（戻り値：0 = 成功 / -1 = 開けない、または誤りがあった） */
+int
+conf_parse(const char *path, struct config *c)
+{
+    char line[256], key[64], *p, *end;
+    FILE *fp;
+    long v;
+    size_t k;
+    int lineno, err, n;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        return (-1);
+    }
+    err = 0;
+    lineno = 0;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        if ((p = strchr(line, '#')) != NULL) {
+            *p = '\0';
+        }
+        if ((p = strchr(line, '=')) != NULL) {
+            *p = ' ';
+        }
+        if (sscanf(line, "%63s%n", key, &n) != 1) {
+            continue;                   /* 空行・コメントだけの行 */
+        }
+        for (k = 0; k < sizeof(g_conf_keys) / sizeof(g_conf_keys[0]); k++) {
+            if (strcmp(key, g_conf_keys[k].name) == 0) {
+                break;
+            }
+        }
+        if (k == sizeof(g_conf_keys) / sizeof(g_conf_keys[0])) {
+            (void) fprintf(stderr, "conf:%s:%d: unknown key %s\n", path, lineno, key);
+            err = 1;
+            continue;
+        }
+        errno = 0;
+        v = strtol(line + n, &end, 10);
+        while (isspace((unsigned char) *end)) {
+            end++;
+        }
+        if (errno != 0 || end == line + n || *end != '\0'
+            || v < g_conf_keys[k].min || v > g_conf_keys[k].max) {
+            (void) fprintf(stderr, "conf:%s:%d: bad value for %s (%d..%d)\n",
+                           path, lineno, key, g_conf_keys[k].min, g_conf_keys[k].max);
+            err = 1;
+            continue;
+        }
+        *(int *) ((char *) c + g_conf_keys[k].off) = (int) v;
+    }
+    (void) fclose(fp);
+    return (err ? -1 : 0);
+}
+
+/* キュー 1 本を size 要素・要素あたり bufsz バイトで作る（戻り値：0 / -1） */
+int
+queue_init(struct queue *q, int size, size_t bufsz)
+{
+    int k;
+
+    (void) memset(q, 0, sizeof(*q));
+    q->qd.min = -1.0;
+    if ((q->data = calloc((size_t) size, sizeof(struct queue_data))) == NULL
+        || (q->bufs = malloc((size_t) size * bufsz)) == NULL) {
+        perror("malloc");
+        free(q->data);
+        return (-1);
+    }
+    for (k = 0; k < size; k++) {
+        q->data[k].buf = q->bufs + (size_t) k * bufsz;
+    }
+    q->size = size;
+    q->bufsz = bufsz;
+    (void) pthread_mutex_init(&q->mutex, NULL);
+    (void) pthread_cond_init(&q->cond, NULL);
+    (void) pthread_cond_init(&q->idle, NULL);
+    return (0);
+}
+
+/* consumer が要素を処理していない（empty なら キューも空の）状態になるまで待つ
+ * - mutex を取ったまま戻る（呼び出し側が unlock する）
+ * - producer（main）はここで止まっているので、待っている間にキューは増えない
+ */
+void
+queue_quiesce(struct queue *q, int empty)
+{
+    (void) pthread_mutex_lock(&q->mutex);
+    q->resizing = empty ? 2 : 1;
+    while (q->busy || (empty && q->front != q->last)) {
+        (void) pthread_cond_wait(&q->idle, &q->mutex);
+    }
+    q->resizing = 0;
+    (void) pthread_cond_broadcast(&q->cond);    /* unlock すると待っていた consumer が動き出す */
+}
+
+/* キューを size 要素・要素あたり bufsz バイトに作り直す（溜まっている要素は順に移す）
+ *
+ * - 溜まっている件数より小さくはしない
+ * - バッファを縮めるときは、キューが空になるまで待ってから作り直す
+ *   （受信済みの要素が新しい大きさに入りきらないことがあるので、切り詰めて送らない）
+ * - 戻り値：0 / -1（確保に失敗。キューは元の大きさのまま）
+ */
+int
+queue_resize(struct queue *q, int size, size_t bufsz)
+{
+    struct queue_data *data;
+    char *bufs;
+    int n, k, j;
+
+    queue_quiesce(q, bufsz < q->bufsz);
+    n = QUEUE_DEPTH(q, q->front);
+    if (size <= n) {
+        size = n + 1;
+    }
+    bufs = NULL;
+    if ((data = calloc((size_t) size, sizeof(struct queue_data))) == NULL
+        || (bufs = malloc((size_t) size * bufsz)) == NULL) {
+        perror("malloc");
+        free(data);
+        (void) pthread_mutex_unlock(&q->mutex);
+        return (-1);
+    }
+    for (k = 0; k < size; k++) {
+        data[k].buf = bufs + (size_t) k * bufsz;
+    }
+    for (k = 0; k < n; k++) {
+        j = (q->front + k) % q->size;
+        data[k].acc = q->data[j].acc;
+        data[k].len = q->data[j].len;
+        data[k].t = q->data[j].t;
+        (void) memcpy(data[k].buf, q->data[j].buf, (size_t) q->data[j].len);
+    }
+    free(q->data);
+    free(q->bufs);
+    q->data = data;
+    q->bufs = bufs;
+    q->size = size;
+    q->bufsz = bufsz;
+    q->front = 0;
+    q->last = n;
+    (void) pthread_mutex_unlock(&q->mutex);
+    return (0);
+}
+
+/* qi 番のキューを作って送信スレッドを起動する（戻り値：0 / -1） */
+int
+sender_start(int qi, int size, size_t bufsz)
+{
+    if (queue_init(&g_queue[qi], size, bufsz) == -1) {
+        return (-1);
+    }
+    /* 注意：64bit 環境では (void*)i が危険なので、本来は (void*)(intptr_t)i が良い */
+    if ((errno = pthread_create(&g_sender[qi], NULL, send_thread, (void *) qi)) != 0) {
+        perror("pthread_create");
+        free(g_queue[qi].data);
+        free(g_queue[qi].bufs);
+        return (-1);
+    }
+    return (0);
+}
+
+/* qi 番の送信スレッドを止める（キューに残った応答を送り終えてから抜ける）→ join して片付ける
+ * - そのキューの統計は g_stats に繰り入れる（join の後なので atomic は要らない） */
+void
+sender_stop(int qi)
+{
+    struct queue *q = &g_queue[qi];
+    int b;
+
+    (void) pthread_mutex_lock(&q->mutex);
+    q->stop = 1;
+    (void) pthread_cond_broadcast(&q->cond);
+    (void) pthread_mutex_unlock(&q->mutex);
+    (void) pthread_join(g_sender[qi], NULL);
+
+    g_stats.requests += q->nreq;
+    g_stats.tx += q->tx;
+    for (b = 0; b < HIST_BUCKETS; b++) {
+        g_stats.hist_req[b] += q->hist[b];
+    }
+
+    free(q->data);
+    free(q->bufs);
+    q->data = NULL;
+    q->bufs = NULL;
+    (void) pthread_mutex_destroy(&q->mutex);
+    (void) pthread_cond_destroy(&q->cond);
+    (void) pthread_cond_destroy(&q->idle);
+}
+
+/* 設定 c を動いたまま反映する（main スレッド = producer から呼ぶ）
+ *
+ * アルゴリズム：
+ * 1) senders が変わるなら、まず全キューが空になるのを待つ
+ *    （fd % g_nsender の振り分けが変わるので、同じ接続の応答が前後しないように）
+ *    → 足りなければ送信スレッドを起こし、多ければ後ろから止める
+ * 2) queue_size / buf_size が変わったキューを作り直す（consumer が処理中でない隙に、ロックの中で）
+ *    → 1 本でも作り直せなければ、作り直した分を今の大きさに戻して queue_size / buf_size は変えない
+ * 3) 接続上限・水位・drain の期限・keepalive・受け付け制御は変数を書き換えるだけ
+ *    （keepalive / user_timeout は以後 accept する接続に効く）
+ *    （max_conn を今の接続数より下げても既存の接続は切らない。新しい接続を断るだけ）
+ * g_conf_cur には実際に反映できた値だけを残す（conf / set の表示がずれないように）。
+ * 戻り値：0 = 全部反映した / -1 = senders / queue_size / buf_size の一部を反映できなかった
+ */
+int
+conf_apply(const struct config *c)
+{
+    struct config applied;
+    size_t bufsz;
+    int i, ret;
+
+    bufsz = (size_t) c->buf_size;
+    if (c->senders != g_nsender) {
+        for (i = 0; i < g_nsender; i++) {
+            queue_quiesce(&g_queue[i], 1);
+            (void) pthread_mutex_unlock(&g_queue[i].mutex);
+        }
+        while (g_nsender < c->senders
+               && sender_start(g_nsender, c->queue_size, bufsz) == 0) {
+            g_nsender++;
+        }
+        while (g_nsender > c->senders) {
+            sender_stop(--g_nsender);
+        }
+    }
+    applied = *c;
+    ret = 0;
+    if (g_nsender != c->senders) {
+        (void) fprintf(stderr, "conf: senders=%d not applied, running %d\n",
+                       c->senders, g_nsender);
+        applied.senders = g_nsender;
+        ret = -1;
+    }
+    for (i = 0; i < g_nsender; i++) {
+        if ((g_queue[i].size != c->queue_size || g_queue[i].bufsz != bufsz)
+            && queue_resize(&g_queue[i], c->queue_size, bufsz) == -1) {
+            break;
+        }
+    }
+    if (i < g_nsender) {
+        (void) fprintf(stderr, "conf: queue_size=%d buf_size=%d not applied, keep %d/%d\n",
+                       c->queue_size, c->buf_size, g_conf_cur.queue_size, g_conf_cur.buf_size);
+        applied.queue_size = g_conf_cur.queue_size;
+        applied.buf_size = g_conf_cur.buf_size;
+        bufsz = (size_t) applied.buf_size;
+        for (i = 0; i < g_nsender; i++) {
+            if (g_queue[i].size != applied.queue_size || g_queue[i].bufsz != bufsz) {
+                (void) queue_resize(&g_queue[i], applied.queue_size, bufsz);
+            }
+        }
+        ret = -1;
+    }
+    c = &applied;
+    g_queue_hiwat = c->queue_hiwat > 0 && c->queue_hiwat < c->queue_size
+                    ? c->queue_hiwat : c->queue_size - 1;
+    g_max_child = c->max_conn < g_conn_cap ? c->max_conn : g_conn_cap;
+    g_drain_timeout = c->drain_timeout;
+    g_keepidle = c->keepidle;
+    g_keepintvl = c->keepintvl;
+    g_keepcnt = c->keepcnt;
+    g_user_timeout = c->user_timeout;
+    __atomic_store_n(&g_qdelay_target, c->qdelay_target, __ATOMIC_RELAXED);
+    __atomic_store_n(&g_qdelay_interval, c->qdelay_interval, __ATOMIC_RELAXED);
+    g_accept_pause = c->accept_pause;
+    g_verbose = c->verbose;
+    g_conf_cur = *c;
+
+    (void) fprintf(stderr,
+                   "conf: max_conn=%d senders=%d queue_size=%d queue_hiwat=%d buf_size=%d"
+                   " drain_timeout=%d keepalive=%d/%d/%d user_timeout=%d"
+                   " qdelay=%d/%d accept_pause=%d verbose=%d\n",
+                   g_max_child, g_nsender, c->queue_size, g_queue_hiwat, c->buf_size,
+                   g_drain_timeout, g_keepidle, g_keepintvl, g_keepcnt, g_user_timeout,
+                   g_qdelay_target, g_qdelay_interval, g_accept_pause, g_verbose);
+    return (ret);
+}
+
+/* SIGHUP：設定ファイルを読み直して反映する（誤りがあれば今の値のまま） */
+void
+conf_reload(void)
+{
+    struct config c;
+
+    if (g_conf_path == NULL) {
+        (void) fprintf(stderr, "conf: no file, keep current\n");
+        return;
+    }
+    conf_defaults(&c);
+    if (conf_parse(g_conf_path, &c) == -1) {
+        (void) fprintf(stderr, "conf:%s: not applied, keep current\n", g_conf_path);
+        return;
+    }
+    (void) conf_apply(&c);
+}
+
+/* 管理用ソケット（admin）
+ *
+ * 動いているサーバの状態を、stderr のログを grep せずに問い合わせるための AF_UNIX ソケット。
+ * adminctl（または socat 等）で 1 行のコマンドを送ると、テキストで応答して閉じる。
+ *
+ * コマンド：
+ * - stats           : 稼働時間、接続数、accept / 拒否 / 要求数、送受信バイト数、キューごとの溜まり
+ * - conns           : 接続ごとの fd、接続元、経過秒、要求数、送受信バイト数、応答待ちの件数
+ * - set KEY VALUE   : 設定ファイルと同じキーを 1 つ変えて conf_apply で反映する
+ *                     （次の SIGHUP では設定ファイルの値に戻る）
+ * - drain           : SIGTERM と同じ drain を始める
+ * - dump-histograms : 要求の処理時間（recv → 応答送信、µs）と接続の寿命（ms）の log2 ヒストグラム
+ *
+ * - パスは ADMIN_PATH_FMT にポート番号を入れたもの。権限 0600（起動したユーザだけが使える）
+ * - listen も接続もノンブロッキングで epoll に載せ、main スレッドのイベントループで処理する
+ *   （送信スレッドやキューのロックは取らず、カウンタを relaxed の atomic で読むだけ）
+ * - 同時に扱う管理接続は ADMIN_MAX 本まで。1 接続 1 コマンドで、応答を書き終えたら閉じる
+ */
+struct admin {
+    int fd;                             /* -1 = 空き */
+    int replied;                        /* コマンドを実行済み（応答の送信中）なら 1 */
+    size_t inlen;                       /* in[] に溜まったコマンド行の長さ */
+    char in[ADMIN_LINE];
+    char *out;                          /* 応答（admin_printf で伸ばす） */
+    size_t outlen, outsize, outoff;     /* 応答の長さ / 確保量 / 送信済み */
+};
+
+struct admin g_admin[ADMIN_MAX];
+char g_admin_path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+
+/* 管理用ソケットを作る（失敗しても管理機能が無いだけで、サーバは続行する） */
+int
+admin_socket(const char *portnm)
+{
+    struct sockaddr_un sun;
+    int i;
+
+    for (i = 0; i < ADMIN_MAX; i++) {
+        g_admin[i].fd = -1;
+    }
+    (void) memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    (void) snprintf(sun.sun_path, sizeof(sun.sun_path), ADMIN_PATH_FMT, portnm);
+    if ((g_admin_soc = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1) {
+        perror("socket(AF_UNIX)");
+        return (-1);
+    }
+    (void) unlink(sun.sun_path);
+    if (bind(g_admin_soc, (struct sockaddr *) &sun, sizeof(sun)) == -1
+        || chmod(sun.sun_path, 0600) == -1
+        || listen(g_admin_soc, ADMIN_MAX) == -1) {
+        perror(sun.sun_path);
+        (void) close(g_admin_soc);
+        g_admin_soc = -1;
+        return (-1);
+    }
+    (void) strcpy(g_admin_path, sun.sun_path);
+    (void) fprintf(stderr, "admin=%s\n", g_admin_path);
+    return (g_admin_soc);
+}
+
+/* 応答に書式付きで追記する */
+void
+admin_printf(struct admin *a, const char *fmt, ...)
+{
+    va_list ap;
+    size_t need;
+    char *p;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    need = a->outlen + (size_t) n + 1;
+    if (need > a->outsize) {
+        if ((p = realloc(a->out, need < 4096 ? 4096 : need * 2)) == NULL) {
+            return;
+        }
+        a->out = p;
+        a->outsize = need < 4096 ? 4096 : need * 2;
+    }
+    va_start(ap, fmt);
+    (void) vsnprintf(a->out + a->outlen, (size_t) n + 1, fmt, ap);
+    va_end(ap);
+    a->outlen += (size_t) n;
+}
+
+/* 管理接続を閉じて枠を空ける */
+void
+admin_close(int epollfd, struct admin *a)
+{
+    (void) epoll_ctl(epollfd, EPOLL_CTL_DEL, a->fd, NULL);
+    (void) close(a->fd);
+    free(a->out);
+    (void) memset(a, 0, sizeof(*a));
+    a->fd = -1;
+}
+
+/* 管理用 listen ソケットが ready → 空き枠がある分だけ accept する */
+void
+admin_accept(int epollfd)
+{
+    struct epoll_event ev;
+    int fd, i;
+
+    for (;;) {
+        for (i = 0; i < ADMIN_MAX && g_admin[i].fd != -1; i++)
+            ;
+        if ((fd = accept4(g_admin_soc, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) == -1) {
+            return;
+        }
+        if (i == ADMIN_MAX) {
+            /* 枠が無い：待たせずに断る */
+            (void) close(fd);
+            continue;
+        }
+        ev.data.fd = fd;
+        ev.events = EPOLLIN;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            perror("epoll_ctl");
+            (void) close(fd);
+            continue;
+        }
+        g_admin[i].fd = fd;
+    }
+}
+
+/* fd が管理接続なら、その枠を返す */
+struct admin *
+admin_lookup(int fd)
+{
+    int i;
+
+    for (i = 0; i < ADMIN_MAX; i++) {
+        if (g_admin[i].fd == fd) {
+            return (&g_admin[i]);
+        }
+    }
+    return (NULL);
+}
+
+/* ヒストグラム 1 本を「階級の範囲 件数」で書き出す（0 件の階級は省く） */
+void
+admin_hist(struct admin *a, const char *name, const unsigned long *h)
+{
+    unsigned long total;
+    int i;
+
+    total = 0;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        total += h[i];
+    }
+    admin_printf(a, "%s total=%lu\n", name, total);
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        if (h[i] != 0) {
+            admin_printf(a, "  [%lu,%lu) %lu\n",
+                         i == 0 ? 0UL : 1UL << (i - 1), 1UL << i, h[i]);
+        }
+    }
+}
+
+/* set KEY VALUE：いまの設定を写して 1 つだけ変え、conf_apply で反映する */
+void
+admin_set(struct admin *a, const char *key, const char *val)
+{
+    struct config c;
+    char *end;
+    size_t k;
+    long v;
+
+    for (k = 0; k < sizeof(g_conf_keys) / sizeof(g_conf_keys[0]); k++) {
+        if (key != NULL && strcmp(key, g_conf_keys[k].name) == 0) {
+            break;
+        }
+    }
+    if (k == sizeof(g_conf_keys) / sizeof(g_conf_keys[0]) || val == NULL) {
+        admin_printf(a, "ERR usage: set KEY VALUE (");
+        for (k = 0; k < sizeof(g_conf_keys) / sizeof(g_conf_keys[0]); k++) {
+            admin_printf(a, "%s%s", k > 0 ? "|" : "", g_conf_keys[k].name);
+        }
+        admin_printf(a, ")\n");
+        return;
+    }
+    errno = 0;
+    v = strtol(val, &end, 10);
+    if (errno != 0 || end == val || *end != '\0'
+        || v < g_conf_keys[k].min || v > g_conf_keys[k].max) {
+        admin_printf(a, "ERR bad value for %s (%d..%d)\n",
+                     key, g_conf_keys[k].min, g_conf_keys[k].max);
+        return;
+    }
+    c = g_conf_cur;
+    *(int *) ((char *) &c + g_conf_keys[k].off) = (int) v;
+    if (conf_apply(&c) == -1) {
+        admin_printf(a, "ERR %s=%ld not applied, keep %s=%d\n", key, v, key,
+                     *(int *) ((char *) &g_conf_cur + g_conf_keys[k].off));
+        return;
+    }
+    admin_printf(a, "OK %s=%ld\n", key, v);
+}
+
+/* コマンド 1 行を実行して応答を組み立てる（nconn：現在の接続数） */
+void
+admin_command(struct admin *a, char *line, int nconn)
+{
+    unsigned long nreq, hist[HIST_BUCKETS];
+    unsigned long long tx;
+    char pbuf[PEER_STRLEN], *cmd, *key, *val;
+    struct queue *q;
+    double now;
+    int i, b;
+
+    now = now_sec();
+    cmd = strtok(line, " \t");
+    key = strtok(NULL, " \t");
+    val = strtok(NULL, " \t");
+    if (cmd == NULL) {
+        admin_printf(a, "ERR empty command\n");
+    } else if (strcmp(cmd, "stats") == 0) {
+        nreq = g_stats.requests;
+        tx = g_stats.tx;
+        for (i = 0; i < g_nsender; i++) {
+            nreq += __atomic_load_n(&g_queue[i].nreq, __ATOMIC_RELAXED);
+            tx += __atomic_load_n(&g_queue[i].tx, __ATOMIC_RELAXED);
+        }
+        admin_printf(a, "uptime=%.1f\nconns=%d\nmax_conn=%d\ndraining=%d\n"
+                     "accepted=%lu\nrefused=%lu\nclosed=%lu\nreceived=%lu\nrequests=%lu\n"
+                     "rx=%llu\ntx=%llu\nsenders=%d\nqueue_hiwat=%d\ndrain_timeout=%d\n"
+                     "keepidle=%d\nkeepintvl=%d\nkeepcnt=%d\nuser_timeout=%d\n"
+                     "reclaimed_timeout=%lu\nreclaimed_reset=%lu\nreclaimed_rdhup=%lu\n"
+                     "qdelay_target=%d\nqdelay_interval=%d\naccept_pause=%d\n"
+                     "shed_full=%lu\nshed_delay=%lu\nbusy_sent=%lu\naccept_paused=%lu\n",
+                     now - g_stats.start, nconn, g_max_child, g_drain_start != 0.0,
+                     g_stats.accepted, g_stats.refused, g_stats.closed, g_stats.received, nreq,
+                     g_stats.rx, tx, g_nsender, g_queue_hiwat, g_drain_timeout,
+                     g_keepidle, g_keepintvl, g_keepcnt, g_user_timeout,
+                     g_stats.reclaimed_timeout, g_stats.reclaimed_reset, g_stats.reclaimed_rdhup,
+                     g_qdelay_target, g_qdelay_interval, g_accept_pause,
+                     g_stats.shed_full, g_stats.shed_delay, g_stats.busy_sent,
+                     g_stats.accept_paused);
+        for (i = 0; i < g_nsender; i++) {
+            q = &g_queue[i];
+            admin_printf(a, "queue[%d] depth=%d size=%d bufsz=%zu requests=%lu"
+                         " qdelay_us=%d overload=%d\n", i,
+                         QUEUE_DEPTH(q, __atomic_load_n(&q->front, __ATOMIC_ACQUIRE)),
+                         q->size, q->bufsz, __atomic_load_n(&q->nreq, __ATOMIC_RELAXED),
+                         __atomic_load_n(&q->qd.usec, __ATOMIC_RELAXED),
+                         __atomic_load_n(&q->qd.overload, __ATOMIC_RELAXED));
+        }
+    } else if (strcmp(cmd, "conns") == 0) {
+        admin_printf(a, "fd peer age nreq rx tx queued\n");
+        for (i = 0; i < g_conn_cap + RESERVED_FD; i++) {
+            if (g_conn[i].active) {
+                (void) format_peer(&g_conn[i].addr, pbuf);
+                admin_printf(a, "%d %s %.1f %lu %llu %llu %d\n", i, pbuf,
+                             now - g_conn[i].since, g_conn[i].nreq, g_conn[i].rx,
+                             __atomic_load_n(&g_conn[i].tx, __ATOMIC_RELAXED),
+                             __atomic_load_n(&g_conn[i].queued, __ATOMIC_RELAXED));
+            }
+        }
+    } else if (strcmp(cmd, "set") == 0) {
+        admin_set(a, key, val);
+    } else if (strcmp(cmd, "drain") == 0) {
+        g_admin_drain = 1;
+        admin_printf(a, "OK draining conns=%d timeout=%d\n", nconn, g_drain_timeout);
+    } else if (strcmp(cmd, "dump-histograms") == 0) {
+        for (b = 0; b < HIST_BUCKETS; b++) {
+            hist[b] = g_stats.hist_req[b];
+            for (i = 0; i < g_nsender; i++) {
+                hist[b] += __atomic_load_n(&g_queue[i].hist[b], __ATOMIC_RELAXED);
+            }
+        }
+        admin_hist(a, "request_us", hist);
+        admin_hist(a, "conn_ms", g_stats.hist_conn);
+    } else {
+        admin_printf(a, "ERR unknown command %s "
+                     "(stats|conns|set|drain|dump-histograms)\n", cmd);
+    }
+    if (a->out != NULL) {
+        (void) fprintf(stderr, "admin:%s\n", cmd != NULL ? cmd : "");
+    }
+}
+
+/* 管理接続のイベント
+ *
+ * 1) コマンド行（'\n' まで）を溜める
+ * 2) 揃ったら admin_command で応答を作り、EPOLLOUT 待ちに切り替える
+ * 3) 応答を送り切ったら閉じる（送れない分は次の EPOLLOUT で続ける）
+ */
+void
+admin_event(int epollfd, struct admin *a, int nconn)
+{
+    struct epoll_event ev;
+    ssize_t n;
+    char *eol;
+
+    if (!a->replied) {
+        if ((n = recv(a->fd, a->in + a->inlen, sizeof(a->in) - 1 - a->inlen, 0)) == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                admin_close(epollfd, a);
+            }
+            return;
+        }
+        if (n == 0) {
+            admin_close(epollfd, a);
+            return;
+        }
+        a->inlen += (size_t) n;
+        a->in[a->inlen] = '\0';
+        if ((eol = strpbrk(a->in, "\r\n")) == NULL && a->inlen < sizeof(a->in) - 1) {
+            return;
+        }
+        if (eol != NULL) {
+            *eol = '\0';
+        }
+        admin_command(a, a->in, nconn);
+        if (a->out == NULL) {
+            admin_close(epollfd, a);
+            return;
+        }
+        a->replied = 1;
+        ev.data.fd = a->fd;
+        ev.events = EPOLLOUT;
+        (void) epoll_ctl(epollfd, EPOLL_CTL_MOD, a->fd, &ev);
+    }
+    if ((n = send(a->fd, a->out + a->outoff, a->outlen - a->outoff, MSG_NOSIGNAL)) == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            admin_close(epollfd, a);
+        }
+        return;
+    }
+    a->outoff += (size_t) n;
+    if (a->outoff == a->outlen) {
+        admin_close(epollfd, a);
+    }
+}
+
+/* 終了時：管理接続と管理用ソケットを閉じ、パスを消す */
+void
+admin_shutdown(int epollfd)
+{
+    int i;
+
+    if (g_admin_soc == -1) {
+        return;
+    }
+    for (i = 0; i < ADMIN_MAX; i++) {
+        if (g_admin[i].fd != -1) {
+            admin_close(epollfd, &g_admin[i]);
+        }
+    }
+    (void) close(g_admin_soc);
+    (void) unlink(g_admin_path);
+    g_admin_soc = -1;
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const int sigs[] = { SIGHUP, SIGTERM, SIGINT };
+    struct config conf;
+    int soc, i, nofile, fd, argi;
+
+    /* 引数：ポート番号 [プロファイル] [設定ファイル]
+       - 2 番目がプロファイル名ならそれを使い、設定ファイルは次の引数になる */
+    if (argc <= 1) {
+        (void) fprintf(stderr,"server9 port [latency|throughput|churn] [conf]\n");
+        return (EX_USAGE);
+    }
+    argi = 2;
+    if (argc > argi && profile_lookup(argv[argi]) != -1) {
+        g_profile = profile_lookup(argv[argi++]);
+    }
+    (void) fprintf(stderr, "profile=%s\n", g_profile_name[g_profile]);
+
+    /* SIGHUP / SIGTERM / SIGINT を FD で受け取る
+       - ブロックはスレッドに引き継がれるので、送信スレッドを作る前に行う */
+    if (sig_fd_init(sigs, (int) (sizeof(sigs) / sizeof(sigs[0]))) == -1) {
+        return (EX_OSERR);
+    }
+
+    /* FD 上限を引き上げ、接続管理テーブルの大きさを決める */
+    if ((nofile = raise_nofile_limit()) != -1) {
+        g_conn_cap = nofile - RESERVED_FD;
+    }
+    (void) fprintf(stderr, "nofile=%d conn_cap=%d\n", nofile, g_conn_cap);
+
+    /* 設定：既定値（CPU 数・FD 上限から）→ 設定ファイル */
+    conf_defaults(&conf);
+    if (argc > argi) {
+        g_conf_path = argv[argi];
+        if (conf_parse(g_conf_path, &conf) == -1) {
+            return (EX_CONFIG);
+        }
+    }
+
+    /* EMFILE 対策の予備 FD を確保しておく */
+    if ((g_spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC)) == -1) {
+        perror("open");
+    }
+
+    /* 行区切り検索の実装を CPU に合わせて選ぶ（スレッド/子プロセス生成前に 1 回だけ） */
+    scan_eol_init();
+    (void) fprintf(stderr, "scan_eol=%s\n", g_scan_eol_name);
+
+    /* 送信スレッド（consumer）を senders 本起動し、キュー・上限を設定どおりにする */
+    (void) conf_apply(&conf);
+    if (g_nsender == 0) {
+        return (EX_OSERR);
+    }
+
+    /* listening socket を作成 */
     if ((soc = server_socket(argv[1])) == -1) {
         (void) fprintf(stderr,"server_socket(%s):error\n", argv[1]);
         return (EX_UNAVAILABLE);
     }
 
+    /* 管理用ソケット（stats / conns / set / drain / dump-histograms） */
+    g_stats.start = now_sec();
+    (void) admin_socket(argv[1]);
+
     (void) fprintf(stderr, "ready for accept\n");
 
-    /* accept + recv + enqueue（producer）はメインスレッドで担当 */
+    /* accept + recv + enqueue（producer）はメインスレッドで担当
+       - drain が終わる（接続 0 / 期限切れ）と戻る。listen ソケットはその中で閉じている */
     accept_loop(soc);
 
-    /* accept_loop は基本戻らないが、形式的に join（最後に作った id しか join してない点に注意） */
-    pthread_join(id, NULL);
+    /* 送信スレッドを止める：積まれた応答を送り終えてから抜けるので、全部 join する */
+    for (i = g_nsender - 1; i >= 0; i--) {
+        sender_stop(i);
+    }
 
-    (void) close(soc);
+    /* 期限切れで残った接続を閉じる（応答を送り終えた後なので途中で切らない） */
+    if (g_conn != NULL) {
+        for (fd = 0; fd < g_conn_cap + RESERVED_FD; fd++) {
+            if (g_conn[fd].active) {
+                (void) close(fd);
+            }
+        }
+    }
+    (void) fprintf(stderr, "exit\n");
     return (EX_OK);
 }
@@ -1,4 +1,7 @@
 #include <sys/param.h>
+#ifdef __linux__
+#include <sys/signalfd.h>               /* signalfd（シグナルを FD で受け取る） */
+#endif
 #include <sys/socket.h>
 #include <sys/types.h>
 
@@ -9,6 +12,7 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -26,6 +30,11 @@
  * 3) Telnet の制御シーケンス処理: IAC(Interpret As Command) を検出したら WONT で否定応答する
  *
  * さらに、端末を raw モードにして 1 文字ずつ即時送信する（行入力ではなくキー入力をそのまま送る）。
+ *
+ * 終了シグナル（SIGINT/SIGTERM/SIGQUIT/SIGHUP）は signalfd で「読める FD」にして、
+ * select の監視対象に加える（signalfd が無い環境では自己パイプ）。
+ * - シグナルは select のイベントとして届くので、1 秒ごとにフラグを見に行く必要がない
+ * - ハンドラの中では何もしない（自己パイプでも番号を 1 バイト write するだけ）
  */
 
 /* ソケット（接続済み TCP ソケット）をグローバルに保持 */
@@ -33,10 +42,18 @@ int g_soc = -1;
 
 /*
  * 終了フラグ
- * - シグナルハンドラから書き換えられるため、volatile sig_atomic_t を使う
- * - sig_atomic_t は「シグナルハンドラ内で安全に読み書きできる最小単位」を意図している
+ * - シグナル FD から読んだシグナル番号、またはエラーで 1 が入る（0 以外なら終了）
+ * - ハンドラからは書き換えないので、ただの int でよい
+ */
+int g_end = 0;
+
+/*
+ * シグナルを FD で受け取る（sig_fd_init）
+ * - g_sig_fd   : signalfd、または自己パイプの読み側（select で待てる）
+ * - g_sig_pipe : 自己パイプ（signalfd が使えないときだけ使う）
  */
-volatile sig_atomic_t g_end = 0;
+int g_sig_fd = -1;
+int g_sig_pipe[2] = { -1, -1 };
 
 /*
  * サーバに TCP 接続する
@@ -106,14 +123,16 @@ client_socket(const char *hostnm, const char *portnm)
 
 /* 前方宣言（send_recv_loop から呼ぶ） */
 int recv_data(void);
+int sig_fd_read(void);
 
 /*
  * 送受信メインループ（I/O 多重化）
  *
  * ここがこのプログラムの“中核”:
- * - select() を使って、以下の 2 つを同時に待つ
+ * - select() を使って、以下の 3 つを同時に待つ
  *   - 標準入力 fd=0（キーボード入力）
  *   - 接続ソケット g_soc（サーバからの受信）
+ *   - シグナル FD g_sig_fd（終了シグナル）
  *
  * 端末を raw モードにしているので、
  * - getchar() は 1 文字単位ですぐ返る（行入力待ちではない）
@@ -122,7 +141,6 @@ int recv_data(void);
 void
 send_recv_loop(void)
 {
-    struct timeval timeout;
     int width;
     fd_set mask, ready;
     char c;
@@ -148,29 +166,26 @@ send_recv_loop(void)
     FD_ZERO(&mask);
     FD_SET(0, &mask);       /* 標準入力（キーボード） */
     FD_SET(g_soc, &mask);   /* ソケット受信 */
+    FD_SET(g_sig_fd, &mask); /* 終了シグナル */
 
     /*
      * select の第1引数 width は「監視対象 fd の最大値 + 1」
-     * - ここでは g_soc の方が 0 より大きいので g_soc + 1 で良い
      */
-    width = g_soc + 1;
+    width = (g_soc > g_sig_fd ? g_soc : g_sig_fd) + 1;
 
     for (;;) {
         /* select() は fd_set を破壊するので毎回 ready にコピーする */
         ready = mask;
 
-        /* タイムアウト（ここでは 1 秒）: 無限待ちにしないため */
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-
         /*
          * select(width, readfds, writefds, exceptfds, timeout)
          * - readfds に ready を渡し、「読めるようになった fd」を待つ
+         * - 終了シグナルもシグナル FD のイベントとして来るので、タイムアウトは不要
          */
-        switch (select(width, &ready, NULL, NULL, &timeout)) {
+        switch (select(width, &ready, NULL, NULL, NULL)) {
         case -1:
             /*
-             * シグナル割り込み(EINTR)はよくあるので無視して回す
+             * EINTR は（シグナルをブロックしているので）通常起きないが、念のため無視して回す
              * それ以外はエラーとして終了フラグを立てる
              */
             if (errno != EINTR) {
@@ -180,7 +195,7 @@ send_recv_loop(void)
             break;
 
         case 0:
-            /* タイムアウト: 定期的に g_end を見るだけ（何もしない） */
+            /* タイムアウトは指定していないので来ない */
             break;
 
         default:
@@ -188,9 +203,18 @@ send_recv_loop(void)
              * レディ有り:
              * - 受信できる（ソケット）
              * - 入力できる（標準入力）
-             * のどちらか（または両方）
+             * - 終了シグナルが届いた（シグナル FD）
+             * のどれか（または複数）
              */
 
+            if (FD_ISSET(g_sig_fd, &ready)) {
+                /* どのシグナルで終わったかを g_end に入れる（0 以外なら終了） */
+                g_end = sig_fd_read();
+                if (g_end != 0) {
+                    break;
+                }
+            }
+
             if (FD_ISSET(g_soc, &ready)) {
                 /*
                  * サーバから受信可能:
@@ -219,7 +243,7 @@ send_recv_loop(void)
             break;
         }
 
-        /* シグナル等で終了フラグが立ったら抜ける */
+        /* シグナル・エラーで終了フラグが立ったら抜ける */
         if (g_end) {
             break;
         }
@@ -299,28 +323,98 @@ recv_data(void)
 }
 
 /*
- * シグナルハンドラ
- * - ここでは「終了したい」ことだけを main ループに伝える
- * - 重い処理（printf など）を避け、g_end だけ立てるのが安全
+ * 自己パイプ用のシグナルハンドラ（signalfd が使えないとき）
+ * - シグナル番号を 1 バイト書くだけ（write は async-signal-safe）
+ * - 「終了したい」ことを select ループにイベントとして伝える
  */
 void
-sig_term_handler(int sig)
+sig_pipe_handler(int sig)
 {
-    g_end = sig; /* どのシグナルで終わったかを格納（0 以外なら終了） */
+    unsigned char c;
+    int save;
+
+    save = errno;
+    c = (unsigned char) sig;
+    (void) write(g_sig_pipe[1], &c, 1);
+    errno = save;
 }
 
 /*
  * シグナルの設定
  * - Ctrl+C (SIGINT) や kill (SIGTERM) などを捕まえて安全にループを抜ける
  * - raw モード中に異常終了すると端末が壊れた状態になりやすいので、捕まえる価値が高い
+ *
+ * アルゴリズム：
+ * 1) 対象のシグナルをブロック（以後、非同期に割り込まれない）
+ * 2) signalfd を作る → 届いたシグナルは signalfd_siginfo として read できる
+ * 3) signalfd が無ければ自己パイプ：ハンドラ（SA_RESTART）が番号を 1 バイト書き、
+ *    ブロックを外す
+ *
+ * 戻り値: select で待つ FD / -1（失敗）
  */
-void
-init_signal(void)
+int
+sig_fd_init(void)
+{
+    static const int sigs[] = { SIGINT, SIGTERM, SIGQUIT, SIGHUP };
+    struct sigaction sa;
+    sigset_t mask;
+    size_t i;
+
+    (void) sigemptyset(&mask);
+    for (i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) {
+        (void) sigaddset(&mask, sigs[i]);
+    }
+    (void) sigprocmask(SIG_BLOCK, &mask, NULL);
+#ifdef __linux__
+    if ((g_sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) != -1) {
+        return (g_sig_fd);
+    }
+    perror("signalfd");
+#endif
+    if (pipe(g_sig_pipe) == -1) {
+        perror("pipe");
+        (void) sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        return (-1);
+    }
+    for (i = 0; i < 2; i++) {
+        (void) fcntl(g_sig_pipe[i], F_SETFL, fcntl(g_sig_pipe[i], F_GETFL, 0) | O_NONBLOCK);
+        (void) fcntl(g_sig_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    (void) memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sig_pipe_handler;
+    (void) sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    for (i = 0; i < sizeof(sigs) / sizeof(sigs[0]); i++) {
+        (void) sigaction(sigs[i], &sa, NULL);
+    }
+    g_sig_fd = g_sig_pipe[0];
+    (void) sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    return (g_sig_fd);
+}
+
+/*
+ * シグナル FD から 1 つ取り出す（戻り値：シグナル番号 / 0 = もう無い）
+ */
+int
+sig_fd_read(void)
 {
-    (void) signal(SIGINT,  sig_term_handler);
-    (void) signal(SIGTERM, sig_term_handler);
-    (void) signal(SIGQUIT, sig_term_handler);
-    (void) signal(SIGHUP,  sig_term_handler);
+#ifdef __linux__
+    struct signalfd_siginfo si;
+#endif
+    unsigned char c;
+
+    if (g_sig_pipe[0] == -1) {
+#ifdef __linux__
+        if (read(g_sig_fd, &si, sizeof(si)) == (ssize_t) sizeof(si)) {
+            return ((int) si.ssi_signo);
+        }
+#endif
+        return (0);
+    }
+    if (read(g_sig_fd, &c, 1) == 1) {
+        return (c);
+    }
+    return (0);
 }
 
 int
@@ -348,7 +442,10 @@ main(int argc, char *argv[])
     }
 
     /* シグナル設定（raw 端末復帰のためにも重要） */
-    init_signal();
+    if (sig_fd_init() == -1) {
+        (void) close(g_soc);
+        return (EX_OSERR);
+    }
 
     /* メイン（I/O 多重化 + telnet コマンド最小処理） */
     send_recv_loop();
@@ -0,0 +1,499 @@
+/*
+ * tune-bench: 接続単位の TCP チューニング（プロファイル）の効果をループバックで比べる
+ *
+ * 目的：
+ * - 各サーバ（server2〜9）の起動引数で選べるプロファイル（none / latency / throughput / churn）を
+ *   同じ条件で動かし、それぞれが「何に効くのか」を数字で確かめる
+ *   （tune_listen / tune_accepted はサーバと同じ内容を写してある）
+ *
+ * 使い方：
+ *   tune-bench port [rounds [mbytes [conns]]]
+ *     - port   : 先頭のポート番号（プロファイルごとに +1 して使う）
+ *     - rounds : rr の往復回数（既定 200。none では 1 往復に遅延 ACK の 40ms 前後かかる）
+ *     - mbytes : bulk で受け取る量（MB、既定 256）
+ *     - conns  : churn の接続数（既定 2000）
+ *
+ * 計測内容（プロファイルごとに 1 行）：
+ * - rr    : 1 接続で「要求 1 回 → 応答をヘッダと本体の 2 回の write で返す」を繰り返した往復時間
+ *           （平均と 99 パーセンタイル、µs）
+ *           応答を分けて書くと、2 回目の write が Nagle で 1 回目の ACK 待ちになり、
+ *           相手の遅延 ACK と噛み合って止まる。latency（TCP_NODELAY）と throughput（TCP_CORK で
+ *           1 セグメントにまとめる）はこれが起きない
+ * - bulk  : サーバから mbytes MB を 64KB ずつ送って受け取る速さ（MB/s）
+ *           ループバックは RTT がほぼ 0 で自動調整のバッファでも足りるので、throughput の
+ *           大きなバッファの差は出にくい（帯域 × 遅延の大きい経路で効く）。ここでは退行が無いことを見る
+ * - churn : connect → 要求 → 応答 → close を conns 回繰り返す速さ（接続/秒）
+ *           empty は accept した時点でまだ要求が届いていなかった接続の数
+ *           （TCP_DEFER_ACCEPT があれば 0 になる = サーバが無駄に起こされない）
+ *           tfo は SYN に要求が載ってきた接続の数
+ *           （net.ipv4.tcp_fastopen にサーバ側の 2 のビットが立っているときだけ、churn のクライアントは
+ *            MSG_FASTOPEN で要求を SYN に載せる。立っていないと SYN の後の 1 往復が残るうえ、
+ *            応答が遅延 ACK に掛かって遅くなるので通常の connect にする）
+ * - 最後の列は accept した接続で読み直したオプション（listen から引き継がれたかの確認）
+ *
+ * 注意：
+ * - クライアントとサーバ（fork した子）が同じマシンで動くので、絶対値より差を見ること
+ */
+
+#define _GNU_SOURCE
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef MSG_FASTOPEN
+#define MSG_FASTOPEN    0x20000000
+#endif
+
+/* 既定値 */
+#define ROUNDS          200
+#define MBYTES          256
+#define CONNS           2000
+
+/* 要求 / 応答（ヘッダ + 本体）/ bulk の 1 回の write の大きさ */
+#define REQ_LEN         16
+#define HDR_LEN         8
+#define BODY_LEN        64
+#define BULK_CHUNK      (64 * 1024)
+
+/* プロファイル（server4.c / server9.c と同じ） */
+#define PROFILE_NONE        (0)
+#define PROFILE_LATENCY     (1)
+#define PROFILE_THROUGHPUT  (2)
+#define PROFILE_CHURN       (3)
+#define NUM_PROFILES        (4)
+
+const char *g_profile_name[] = { "none", "latency", "throughput", "churn" };
+
+int g_profile = PROFILE_NONE;
+
+#define TUNE_NOTSENT_LOWAT  (16 * 1024)
+#define TUNE_BUFSZ          (4 * 1024 * 1024)
+#define TUNE_DEFER_ACCEPT   (1)
+#define TUNE_FASTOPEN_QLEN  (256)
+#define TUNE_BACKLOG        (65535)
+
+/* サーバ（子）が数えてクライアント（親）に見せる値（共有メモリ） */
+struct result {
+    long empty;                         /* accept 時点で要求が未着だった接続 */
+    long syn_data;                      /* SYN に要求が載っていた接続（TFO） */
+    int nodelay;                        /* accept した接続の TCP_NODELAY */
+    int notsent_lowat;                  /* 同 TCP_NOTSENT_LOWAT */
+    int sndbuf;                         /* 同 SO_SNDBUF */
+    int rcvbuf;                         /* 同 SO_RCVBUF */
+};
+
+/* 単調増加時計の現在値（マイクロ秒） */
+static double
+now_us(void)
+{
+    struct timespec ts;
+
+    (void) clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((double) ts.tv_sec * 1e6 + (double) ts.tv_nsec / 1e3);
+}
+
+/* listen ソケットにプロファイルを付ける（server4.c と同じ） */
+static void
+tune_listen(int soc)
+{
+    int opt;
+
+    switch (g_profile) {
+    case PROFILE_LATENCY:
+        opt = 1;
+        (void) setsockopt(soc, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+        opt = TUNE_NOTSENT_LOWAT;
+        (void) setsockopt(soc, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &opt, sizeof(opt));
+        break;
+    case PROFILE_THROUGHPUT:
+        opt = TUNE_BUFSZ;
+        (void) setsockopt(soc, SOL_SOCKET, SO_SNDBUF, &opt, sizeof(opt));
+        (void) setsockopt(soc, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
+        break;
+    case PROFILE_CHURN:
+        opt = TUNE_DEFER_ACCEPT;
+        (void) setsockopt(soc, IPPROTO_TCP, TCP_DEFER_ACCEPT, &opt, sizeof(opt));
+        opt = TUNE_FASTOPEN_QLEN;
+        (void) setsockopt(soc, IPPROTO_TCP, TCP_FASTOPEN, &opt, sizeof(opt));
+        break;
+    default:
+        break;
+    }
+}
+
+/* accept した接続 / 受信した直後の接続に、引き継がれない分を付ける（server4.c と同じ） */
+static void
+tune_accepted(int acc)
+{
+    int opt;
+
+    if (g_profile == PROFILE_LATENCY) {
+        opt = 1;
+        (void) setsockopt(acc, IPPROTO_TCP, TCP_QUICKACK, &opt, sizeof(opt));
+    }
+}
+
+/* n バイトちょうど読む（戻り値：0 / -1 = EOF かエラー） */
+static int
+read_full(int fd, char *buf, size_t n)
+{
+    ssize_t len;
+    size_t got;
+
+    for (got = 0; got < n; got += (size_t) len) {
+        if ((len = recv(fd, buf + got, n - got, 0)) <= 0) {
+            if (len == -1 && errno == EINTR) {
+                len = 0;
+                continue;
+            }
+            return (-1);
+        }
+    }
+    return (0);
+}
+
+/* 応答を「ヘッダ → 本体」の 2 回の write で返す
+ * - 応答を組み立てながら書く素朴なサーバの形（mbuf で 1 回にまとめる前の server4 と同じ）
+ * - throughput は TCP_CORK で挟み、2 回の write を 1 セグメントにまとめてから出す
+ */
+static void
+send_reply(int fd)
+{
+    char hdr[HDR_LEN], body[BODY_LEN];
+    int opt;
+
+    (void) memset(hdr, 'h', sizeof(hdr));
+    (void) memset(body, 'b', sizeof(body));
+    if (g_profile == PROFILE_THROUGHPUT) {
+        opt = 1;
+        (void) setsockopt(fd, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt));
+    }
+    (void) send(fd, hdr, sizeof(hdr), MSG_NOSIGNAL);
+    (void) send(fd, body, sizeof(body), MSG_NOSIGNAL);
+    if (g_profile == PROFILE_THROUGHPUT) {
+        opt = 0;
+        (void) setsockopt(fd, IPPROTO_TCP, TCP_CORK, &opt, sizeof(opt));
+    }
+}
+
+/* サーバ（子プロセス）：1 接続ずつ順に処理する
+ *
+ * 要求の先頭 1 バイトで動作を決める：
+ * - 'r' : 応答（send_reply）を返して次の要求を待つ
+ * - 'b' : mbytes MB を送って閉じる
+ */
+static void
+serve(int soc, long mbytes, struct result *res)
+{
+    char req[REQ_LEN], *chunk;
+    struct tcp_info ti;
+    socklen_t len;
+    long sent;
+    int acc, first, opt;
+
+    if ((chunk = calloc(1, BULK_CHUNK)) == NULL) {
+        _exit(1);
+    }
+    first = 1;
+    for (;;) {
+        if ((acc = accept(soc, NULL, NULL)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            _exit(1);
+        }
+        tune_accepted(acc);
+
+        /* 引き継がれたオプションを 1 回だけ読んでおく */
+        if (first) {
+            first = 0;
+            len = sizeof(opt);
+            (void) getsockopt(acc, IPPROTO_TCP, TCP_NODELAY, &res->nodelay, &len);
+            len = sizeof(opt);
+            (void) getsockopt(acc, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &res->notsent_lowat, &len);
+            len = sizeof(opt);
+            (void) getsockopt(acc, SOL_SOCKET, SO_SNDBUF, &res->sndbuf, &len);
+            len = sizeof(opt);
+            (void) getsockopt(acc, SOL_SOCKET, SO_RCVBUF, &res->rcvbuf, &len);
+        }
+
+        /* accept した時点で要求が届いているか（DEFER_ACCEPT が無いと多くは未着） */
+        if (recv(acc, req, 1, MSG_PEEK | MSG_DONTWAIT) == -1
+            && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            res->empty++;
+        }
+        len = sizeof(ti);
+        if (getsockopt(acc, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0
+            && (ti.tcpi_options & TCPI_OPT_SYN_DATA)) {
+            res->syn_data++;
+        }
+
+        while (read_full(acc, req, sizeof(req)) == 0) {
+            tune_accepted(acc);
+            if (req[0] == 'b') {
+                for (sent = 0; sent < mbytes * 1024 * 1024; sent += BULK_CHUNK) {
+                    if (send(acc, chunk, BULK_CHUNK, MSG_NOSIGNAL) != BULK_CHUNK) {
+                        break;
+                    }
+                }
+                break;
+            }
+            send_reply(acc);
+        }
+        (void) close(acc);
+    }
+}
+
+/* 127.0.0.1:port に接続する（tfo なら要求を SYN に載せて送る） */
+static int
+client_connect(int port, const char *req, int tfo)
+{
+    struct sockaddr_in sin;
+    int soc;
+
+    (void) memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons((unsigned short) port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if ((soc = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        perror("socket");
+        return (-1);
+    }
+    if (tfo) {
+        /* クッキーが無い最初の 1 回などは、通常の 3way ハンドシェイク後に送られる */
+        if (sendto(soc, req, REQ_LEN, MSG_FASTOPEN | MSG_NOSIGNAL,
+                   (struct sockaddr *) &sin, sizeof(sin)) != REQ_LEN) {
+            perror("sendto(MSG_FASTOPEN)");
+            (void) close(soc);
+            return (-1);
+        }
+        return (soc);
+    }
+    if (connect(soc, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+        perror("connect");
+        (void) close(soc);
+        return (-1);
+    }
+    if (req != NULL && send(soc, req, REQ_LEN, MSG_NOSIGNAL) != REQ_LEN) {
+        perror("send");
+        (void) close(soc);
+        return (-1);
+    }
+    return (soc);
+}
+
+/* net.ipv4.tcp_fastopen の値（読めなければ 0） */
+static int
+tfo_sysctl(void)
+{
+    FILE *fp;
+    int v;
+
+    v = 0;
+    if ((fp = fopen("/proc/sys/net/ipv4/tcp_fastopen", "r")) != NULL) {
+        if (fscanf(fp, "%d", &v) != 1) {
+            v = 0;
+        }
+        (void) fclose(fp);
+    }
+    return (v);
+}
+
+/* qsort 用 */
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+
+    return (x < y ? -1 : x > y);
+}
+
+/* rr：1 接続で rounds 回往復（平均と p99 を µs で返す） */
+static int
+bench_rr(int port, int rounds, double *avg, double *p99)
+{
+    char req[REQ_LEN], rep[HDR_LEN + BODY_LEN];
+    double *t, t0, sum;
+    int soc, i;
+
+    if ((t = malloc(sizeof(double) * (size_t) rounds)) == NULL
+        || (soc = client_connect(port, NULL, 0)) == -1) {
+        free(t);
+        return (-1);
+    }
+    (void) memset(req, 'r', sizeof(req));
+    sum = 0.0;
+    for (i = 0; i < rounds; i++) {
+        t0 = now_us();
+        if (send(soc, req, sizeof(req), MSG_NOSIGNAL) != (ssize_t) sizeof(req)
+            || read_full(soc, rep, sizeof(rep)) == -1) {
+            (void) close(soc);
+            free(t);
+            return (-1);
+        }
+        t[i] = now_us() - t0;
+        sum += t[i];
+    }
+    (void) close(soc);
+    qsort(t, (size_t) rounds, sizeof(double), cmp_double);
+    *avg = sum / rounds;
+    *p99 = t[(int) (rounds * 0.99) < rounds ? (int) (rounds * 0.99) : rounds - 1];
+    free(t);
+    return (0);
+}
+
+/* bulk：mbytes MB を受け取る速さ（MB/s） */
+static double
+bench_bulk(int port, long mbytes)
+{
+    char req[REQ_LEN], *buf;
+    double t0;
+    long total;
+    ssize_t len;
+    int soc;
+
+    if ((buf = malloc(BULK_CHUNK)) == NULL) {
+        return (-1.0);
+    }
+    (void) memset(req, 'b', sizeof(req));
+    t0 = now_us();
+    if ((soc = client_connect(port, req, 0)) == -1) {
+        free(buf);
+        return (-1.0);
+    }
+    total = 0;
+    while ((len = recv(soc, buf, BULK_CHUNK, 0)) > 0) {
+        total += len;
+    }
+    (void) close(soc);
+    free(buf);
+    if (total < mbytes * 1024 * 1024) {
+        return (-1.0);
+    }
+    return ((double) total / (1024.0 * 1024.0) / ((now_us() - t0) / 1e6));
+}
+
+/* churn：接続 → 要求 → 応答 → close を conns 回（接続/秒） */
+static double
+bench_churn(int port, int conns, int tfo)
+{
+    char req[REQ_LEN], rep[HDR_LEN + BODY_LEN];
+    double t0;
+    int soc, i;
+
+    (void) memset(req, 'r', sizeof(req));
+    t0 = now_us();
+    for (i = 0; i < conns; i++) {
+        if ((soc = client_connect(port, req, tfo)) == -1) {
+            return (-1.0);
+        }
+        if (read_full(soc, rep, sizeof(rep)) == -1) {
+            (void) close(soc);
+            return (-1.0);
+        }
+        (void) close(soc);
+    }
+    return (conns / ((now_us() - t0) / 1e6));
+}
+
+/* listen ソケット（server4 の server_socket と同じ順：オプション → bind → listen） */
+static int
+listen_socket(int port)
+{
+    struct sockaddr_in sin;
+    int soc, opt;
+
+    if ((soc = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        perror("socket");
+        return (-1);
+    }
+    opt = 1;
+    (void) setsockopt(soc, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    tune_listen(soc);
+    (void) memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons((unsigned short) port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(soc, (struct sockaddr *) &sin, sizeof(sin)) == -1
+        || listen(soc, g_profile == PROFILE_CHURN ? TUNE_BACKLOG : SOMAXCONN) == -1) {
+        perror("bind/listen");
+        (void) close(soc);
+        return (-1);
+    }
+    return (soc);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct result *res;
+    double avg, p99, mbps, cps;
+    long mbytes;
+    pid_t pid;
+    int port, rounds, conns, p, soc, status, tfo;
+
+    if (argc <= 1) {
+        (void) fprintf(stderr, "tune-bench port [rounds [mbytes [conns]]]\n");
+        return (1);
+    }
+    port = atoi(argv[1]);
+    rounds = argc > 2 && atoi(argv[2]) > 0 ? atoi(argv[2]) : ROUNDS;
+    mbytes = argc > 3 && atol(argv[3]) > 0 ? atol(argv[3]) : MBYTES;
+    conns = argc > 4 && atoi(argv[4]) > 0 ? atoi(argv[4]) : CONNS;
+
+    if ((res = mmap(NULL, sizeof(*res) * NUM_PROFILES, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        perror("mmap");
+        return (1);
+    }
+
+    /* TFO はクライアント（1）とサーバ（2）の両方のビットが立っているときだけ使う */
+    tfo = tfo_sysctl();
+    (void) printf("rounds=%d mbytes=%ld conns=%d tcp_fastopen=%d\n", rounds, mbytes, conns, tfo);
+    (void) printf("%-10s %10s %10s %10s %10s %6s %5s  %s\n", "profile", "rr_avg_us",
+                  "rr_p99_us", "bulk_MB/s", "churn_c/s", "empty", "tfo",
+                  "accepted: nodelay lowat sndbuf rcvbuf");
+    for (p = 0; p < NUM_PROFILES; p++) {
+        g_profile = p;
+        if ((soc = listen_socket(port + p)) == -1) {
+            return (1);
+        }
+        if ((pid = fork()) == -1) {
+            perror("fork");
+            return (1);
+        }
+        if (pid == 0) {
+            serve(soc, mbytes, &res[p]);
+            _exit(0);
+        }
+        (void) close(soc);
+
+        if (bench_rr(port + p, rounds, &avg, &p99) == -1) {
+            avg = p99 = -1.0;
+        }
+        mbps = bench_bulk(port + p, mbytes);
+        cps = bench_churn(port + p, conns, p == PROFILE_CHURN && (tfo & 3) == 3);
+
+        (void) kill(pid, SIGKILL);
+        (void) waitpid(pid, &status, 0);
+        (void) printf("%-10s %10.1f %10.1f %10.1f %10.0f %6ld %5ld  %d %d %d %d\n",
+                      g_profile_name[p], avg, p99, mbps, cps, res[p].empty, res[p].syn_data,
+                      res[p].nodelay, res[p].notsent_lowat, res[p].sndbuf, res[p].rcvbuf);
+        (void) fflush(stdout);
+    }
+    return (0);
+}